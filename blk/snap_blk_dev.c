@@ -1,5 +1,7 @@
 #include "snap_blk_dev.h"
 #include "snap_null_blk_dev.h"
+#include "snap_ram_blk_dev.h"
+#include "snap_uring_blk_dev.h"
 
 /**
  * snap_blk_dev_open() - Opens a block device
@@ -15,6 +17,10 @@ struct snap_blk_dev *snap_blk_dev_open(const char *name,
 
 	if (attrs->type == SNAP_BLOCK_DEVICE_NULL)
 		bdev = snap_null_blk_dev_open(name, attrs);
+	else if (attrs->type == SNAP_BLOCK_DEVICE_RAM)
+		bdev = snap_ram_blk_dev_open(name, attrs);
+	else if (attrs->type == SNAP_BLOCK_DEVICE_URING)
+		bdev = snap_uring_blk_dev_open(name, attrs);
 	else
 		printf("Invalid block device type %d\n", attrs->type);
 
@@ -29,6 +35,10 @@ void snap_blk_dev_close(struct snap_blk_dev *bdev)
 {
 	if (bdev->attrs.type == SNAP_BLOCK_DEVICE_NULL)
 		snap_null_blk_dev_close(bdev);
+	else if (bdev->attrs.type == SNAP_BLOCK_DEVICE_RAM)
+		snap_ram_blk_dev_close(bdev);
+	else if (bdev->attrs.type == SNAP_BLOCK_DEVICE_URING)
+		snap_uring_blk_dev_close(bdev);
 	else
 		printf("Invalid block device type %d\n", bdev->attrs.type);
 }
@@ -10,9 +10,60 @@
 /*
  * enum snap_blk_dev_type - bdev types
  * @SNAP_BLOCK_DEVICE_NULL:	NULL Block device
+ * @SNAP_BLOCK_DEVICE_RAM:	RAM Block device
+ * @SNAP_BLOCK_DEVICE_URING:	io_uring Block device over a file
  */
 enum snap_blk_dev_type {
 	SNAP_BLOCK_DEVICE_NULL,
+	SNAP_BLOCK_DEVICE_RAM,
+	SNAP_BLOCK_DEVICE_URING,
+};
+
+struct ibv_pd;
+
+/**
+ * struct snap_blk_dev_ram_attrs - attributes of a RAM block device
+ * @num_threads:	number of threads submitting operations, thread ids
+ *			are 0 to @num_threads - 1. Zero means one thread.
+ * @numa_bind:		bind the memory of the device to @numa_node
+ * @numa_node:		NUMA node of the memory
+ * @pd:			protection domain the buffer pool is registered
+ *			with, may be NULL
+ * @pool_buf_size:	size of the buffers of the dma_pool_* operations
+ * @pool_bufs:		number of pool buffers of each thread, zero to
+ *			disable the pool
+ */
+struct snap_blk_dev_ram_attrs {
+	int num_threads;
+	bool numa_bind;
+	int numa_node;
+	struct ibv_pd *pd;
+	size_t pool_buf_size;
+	int pool_bufs;
+};
+
+/**
+ * struct snap_blk_dev_uring_attrs - attributes of an io_uring block device
+ * @path:		regular file or block device holding the data
+ * @direct:		open @path with O_DIRECT, falls back to buffered IO if
+ *			the file system does not support it
+ * @num_threads:	number of threads submitting operations, each one has
+ *			its own ring. Zero means one thread.
+ * @queue_depth:	size of each ring, zero for the default
+ * @pd:			protection domain the buffer pool is registered
+ *			with, may be NULL
+ * @pool_buf_size:	size of the buffers of the dma_pool_* operations
+ * @pool_bufs:		number of pool buffers of each thread, zero to
+ *			disable the pool
+ */
+struct snap_blk_dev_uring_attrs {
+	const char *path;
+	bool direct;
+	int num_threads;
+	int queue_depth;
+	struct ibv_pd *pd;
+	size_t pool_buf_size;
+	int pool_bufs;
 };
 
 /**
@@ -20,11 +71,15 @@ enum snap_blk_dev_type {
  * @type:	Type of the bdev
  * @size_b:	Size in blocks
  * @blk_size:	Block size
+ * @ram:	Attributes of a SNAP_BLOCK_DEVICE_RAM bdev
+ * @uring:	Attributes of a SNAP_BLOCK_DEVICE_URING bdev
  */
 struct snap_blk_dev_attrs {
 	enum snap_blk_dev_type type;
 	uint64_t size_b;
 	uint32_t blk_size;
+	struct snap_blk_dev_ram_attrs ram;
+	struct snap_blk_dev_uring_attrs uring;
 };
 
 /**
@@ -66,6 +66,9 @@ struct snap_blk_mempool_ctx {
  *			ZCOPY
  * @is_zcopy_aligned:	pointer to function which returns true if address is
  *			ZCOPY and bdev aligned
+ * @progress:		pointer to function which completes operations
+ *			submitted by a thread, called by that thread. May be
+ *			NULL if the bdev completes operations by itself.
  *
  * operations provided by the block device given to the virtio controller
  * ToDo: add mechanism to tell which block operations are supported
@@ -103,6 +106,7 @@ struct snap_bdev_ops {
 	void (*dma_pool_cancel)(struct snap_blk_mempool_ctx *mem_ctx);
 	void (*dma_pool_free)(struct snap_blk_mempool_ctx *ctx, void *buf);
 	bool (*dma_pool_enabled)(void *ctx);
+	int (*progress)(void *ctx, int thread_id);
 };
 
 #endif
@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <infiniband/verbs.h>
+#include "snap_blk_pool.h"
+
+#define SNAP_BLK_POOL_RING_SIZE	64
+
+static int snap_blk_pool_ring_init(struct snap_blk_pool_ring *ring)
+{
+	ring->mems = calloc(SNAP_BLK_POOL_RING_SIZE, sizeof(*ring->mems));
+	if (!ring->mems)
+		return -ENOMEM;
+	ring->mask = SNAP_BLK_POOL_RING_SIZE - 1;
+	ring->head = ring->tail = 0;
+	return 0;
+}
+
+static int snap_blk_pool_ring_push(struct snap_blk_pool_ring *ring,
+				   struct snap_blk_mempool_ctx *mem_ctx,
+				   void *buf)
+{
+	struct snap_blk_pool_mem *mems;
+	uint32_t i, size = ring->mask + 1;
+
+	if (ring->tail - ring->head > ring->mask) {
+		mems = calloc(2 * size, sizeof(*mems));
+		if (!mems)
+			return -ENOMEM;
+		for (i = 0; i < size; i++)
+			mems[i] = ring->mems[(ring->head + i) & ring->mask];
+		free(ring->mems);
+		ring->mems = mems;
+		ring->mask = 2 * size - 1;
+		ring->head = 0;
+		ring->tail = size;
+	}
+
+	ring->mems[ring->tail & ring->mask].mem_ctx = mem_ctx;
+	ring->mems[ring->tail & ring->mask].buf = buf;
+	ring->tail++;
+	return 0;
+}
+
+/**
+ * snap_blk_pool_init() - create the dma buffer pool of a block device
+ * @pool:	pool, zeroed by the caller
+ * @mem:	memory of the buffers, @num_threads * @bufs * @buf_size bytes
+ * @buf_size:	size of a buffer, see snap_blk_pool_buf_size()
+ * @bufs:	number of buffers of a thread
+ * @num_threads: number of threads of the device
+ * @pd:		protection domain the memory is registered with, may be NULL
+ *
+ * On error the caller still calls snap_blk_pool_destroy().
+ *
+ * Return: 0 or -errno on error
+ */
+int snap_blk_pool_init(struct snap_blk_pool *pool, void *mem, size_t buf_size,
+		       int bufs, int num_threads, struct ibv_pd *pd)
+{
+	struct snap_blk_pool_thread *t;
+	int i, j;
+
+	if (!buf_size || bufs <= 0 || num_threads <= 0)
+		return -EINVAL;
+
+	pool->buf_size = buf_size;
+	pool->thread_len = buf_size * bufs;
+	pool->threads = calloc(num_threads, sizeof(*pool->threads));
+	if (!pool->threads)
+		return -ENOMEM;
+	pool->num_threads = num_threads;
+
+	if (pd) {
+		pool->mr = ibv_reg_mr(pd, mem, pool->thread_len * num_threads,
+				      IBV_ACCESS_LOCAL_WRITE |
+				      IBV_ACCESS_REMOTE_READ |
+				      IBV_ACCESS_REMOTE_WRITE);
+		if (!pool->mr)
+			return -errno;
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		t = &pool->threads[i];
+		t->bufs = (uint8_t *)mem + i * pool->thread_len;
+		t->free_bufs = calloc(bufs, sizeof(void *));
+		if (!t->free_bufs)
+			return -ENOMEM;
+		for (j = 0; j < bufs; j++)
+			t->free_bufs[j] = t->bufs + j * buf_size;
+		t->n_free = bufs;
+		if (snap_blk_pool_ring_init(&t->ready) ||
+		    snap_blk_pool_ring_init(&t->waiters))
+			return -ENOMEM;
+	}
+
+	pool->mem = mem;
+	return 0;
+}
+
+/* releases whatever an init, even a failed one, allocated */
+void snap_blk_pool_destroy(struct snap_blk_pool *pool)
+{
+	int i;
+
+	if (pool->threads) {
+		for (i = 0; i < pool->num_threads; i++) {
+			free(pool->threads[i].ready.mems);
+			free(pool->threads[i].waiters.mems);
+			free(pool->threads[i].free_bufs);
+		}
+		free(pool->threads);
+	}
+	if (pool->mr)
+		ibv_dereg_mr(pool->mr);
+	memset(pool, 0, sizeof(*pool));
+}
+
+/*
+ * Allocations of the single-threaded progress of a controller have no
+ * thread id, they use the buffers of the first thread.
+ */
+struct snap_blk_pool_thread *snap_blk_pool_thread(struct snap_blk_pool *pool,
+						  int thread_id)
+{
+	if (thread_id < 0)
+		thread_id = 0;
+	if (thread_id >= pool->num_threads)
+		return NULL;
+	return &pool->threads[thread_id];
+}
+
+/* gives a free buffer to the first waiter, or back to the pool */
+static void snap_blk_pool_put(struct snap_blk_pool_thread *t, void *buf)
+{
+	struct snap_blk_pool_ring *waiters = &t->waiters;
+	struct snap_blk_mempool_ctx *mem_ctx;
+
+	while (waiters->head != waiters->tail) {
+		mem_ctx = waiters->mems[waiters->head & waiters->mask].mem_ctx;
+		if (!mem_ctx) {
+			waiters->head++;
+			continue;
+		}
+		if (snap_blk_pool_ring_push(&t->ready, mem_ctx, buf))
+			break;
+		waiters->head++;
+		return;
+	}
+
+	t->free_bufs[t->n_free++] = buf;
+}
+
+/**
+ * snap_blk_pool_malloc() - allocate a buffer of the pool
+ * @pool:	pool
+ * @size:	size of the allocation, at most the buffer size
+ * @mem_ctx:	context of the allocation
+ *
+ * The buffer is given to @mem_ctx by the next snap_blk_pool_progress() of
+ * the thread, or, if the thread has no free buffer, by the first progress
+ * after one is freed.
+ *
+ * Return: 0 or -errno on error
+ */
+int snap_blk_pool_malloc(struct snap_blk_pool *pool, size_t size,
+			 struct snap_blk_mempool_ctx *mem_ctx)
+{
+	struct snap_blk_pool_thread *t;
+	int ret;
+
+	t = snap_blk_pool_thread(pool, mem_ctx->thread_id);
+	if (!t || !pool->mem || size > pool->buf_size)
+		return -EINVAL;
+
+	if (!t->n_free)
+		return snap_blk_pool_ring_push(&t->waiters, mem_ctx, NULL);
+
+	ret = snap_blk_pool_ring_push(&t->ready, mem_ctx,
+				      t->free_bufs[t->n_free - 1]);
+	if (!ret)
+		t->n_free--;
+	return ret;
+}
+
+/**
+ * snap_blk_pool_cancel() - cancel an allocation that was not given yet
+ * @pool:	pool
+ * @mem_ctx:	context of the allocation
+ *
+ * A buffer already set aside for @mem_ctx goes to the next waiter.
+ */
+void snap_blk_pool_cancel(struct snap_blk_pool *pool,
+			  struct snap_blk_mempool_ctx *mem_ctx)
+{
+	struct snap_blk_pool_thread *t;
+	struct snap_blk_pool_mem *mem;
+	void *buf = NULL;
+	uint32_t i;
+
+	t = snap_blk_pool_thread(pool, mem_ctx->thread_id);
+	if (!t)
+		return;
+
+	for (i = t->waiters.head; i != t->waiters.tail; i++) {
+		mem = &t->waiters.mems[i & t->waiters.mask];
+		if (mem->mem_ctx == mem_ctx)
+			mem->mem_ctx = NULL;
+	}
+
+	for (i = t->ready.head; i != t->ready.tail; i++) {
+		mem = &t->ready.mems[i & t->ready.mask];
+		if (mem->mem_ctx == mem_ctx) {
+			buf = mem->buf;
+			mem->mem_ctx = NULL;
+			mem->buf = NULL;
+		}
+	}
+
+	if (buf)
+		snap_blk_pool_put(t, buf);
+}
+
+void snap_blk_pool_free(struct snap_blk_pool *pool,
+			struct snap_blk_mempool_ctx *mem_ctx, void *buf)
+{
+	struct snap_blk_pool_thread *t;
+
+	t = snap_blk_pool_thread(pool, mem_ctx->thread_id);
+	if (t)
+		snap_blk_pool_put(t, buf);
+}
+
+/**
+ * snap_blk_pool_progress() - give buffers to the allocations of a thread
+ * @pool:	pool
+ * @thread_id:	thread the allocations were made from
+ *
+ * Calls, in allocation order, the callbacks of the allocations that got a
+ * buffer. Allocations made by the callbacks wait for the next call. Must
+ * be called by that thread.
+ *
+ * Return: number of callbacks called
+ */
+int snap_blk_pool_progress(struct snap_blk_pool *pool, int thread_id)
+{
+	struct snap_blk_pool_thread *t;
+	struct snap_blk_pool_mem mem;
+	uint32_t i, n_ready;
+	int n = 0;
+
+	t = snap_blk_pool_thread(pool, thread_id);
+	if (!t)
+		return 0;
+
+	n_ready = t->ready.tail - t->ready.head;
+	for (i = 0; i < n_ready; i++) {
+		mem = t->ready.mems[t->ready.head++ & t->ready.mask];
+		if (!mem.mem_ctx)
+			continue;
+		mem.mem_ctx->callback(mem.buf, pool->mr, mem.mem_ctx->user);
+		n++;
+	}
+
+	return n;
+}
@@ -0,0 +1,98 @@
+#ifndef _SNAP_BLK_POOL_H
+#define _SNAP_BLK_POOL_H
+#include <stddef.h>
+#include <stdint.h>
+#include "snap_blk_ops.h"
+
+struct ibv_pd;
+
+/**
+ * struct snap_blk_pool_mem - pool allocation waiting for progress
+ * @mem_ctx:	context of the allocation, NULL if it was cancelled
+ * @buf:	buffer given to @mem_ctx
+ */
+struct snap_blk_pool_mem {
+	struct snap_blk_mempool_ctx *mem_ctx;
+	void *buf;
+};
+
+/**
+ * struct snap_blk_pool_ring - pool allocations of a thread
+ * @mems:	allocations, the size of the ring is a power of two
+ * @mask:	size of the ring - 1
+ * @head:	oldest allocation
+ * @tail:	next free entry
+ *
+ * Used only by its thread, the ring doubles when it is full.
+ */
+struct snap_blk_pool_ring {
+	struct snap_blk_pool_mem *mems;
+	uint32_t mask;
+	uint32_t head;
+	uint32_t tail;
+};
+
+/**
+ * struct snap_blk_pool_thread - pool buffers of a thread
+ * @bufs:	memory of the buffers of the thread
+ * @free_bufs:	free buffers
+ * @n_free:	number of @free_bufs
+ * @ready:	allocations given on the next progress
+ * @waiters:	allocations waiting for a free buffer
+ */
+struct snap_blk_pool_thread {
+	uint8_t *bufs;
+	void **free_bufs;
+	int n_free;
+	struct snap_blk_pool_ring ready;
+	struct snap_blk_pool_ring waiters;
+};
+
+/**
+ * struct snap_blk_pool - dma buffer pool of a block device
+ * @mem:	memory of the buffers, NULL without a pool
+ * @buf_size:	size of a buffer
+ * @thread_len:	length of the buffers of a thread
+ * @mr:		registration of @mem, NULL without a pd
+ * @threads:	per thread buffers, see snap_blk_pool_thread()
+ * @num_threads: number of @threads
+ *
+ * Every thread has its own buffers, so the pool needs no locking. The
+ * memory of the pool belongs to the device, it maps @mem before
+ * snap_blk_pool_init() and unmaps it after snap_blk_pool_destroy().
+ */
+struct snap_blk_pool {
+	uint8_t *mem;
+	size_t buf_size;
+	size_t thread_len;
+	struct ibv_mr *mr;
+	struct snap_blk_pool_thread *threads;
+	int num_threads;
+};
+
+#define SNAP_BLK_POOL_BUF_ALIGN	4096UL
+
+static inline size_t snap_blk_pool_buf_size(size_t size)
+{
+	return (size + SNAP_BLK_POOL_BUF_ALIGN - 1) &
+	       ~(SNAP_BLK_POOL_BUF_ALIGN - 1);
+}
+
+int snap_blk_pool_init(struct snap_blk_pool *pool, void *mem, size_t buf_size,
+		       int bufs, int num_threads, struct ibv_pd *pd);
+void snap_blk_pool_destroy(struct snap_blk_pool *pool);
+struct snap_blk_pool_thread *snap_blk_pool_thread(struct snap_blk_pool *pool,
+						  int thread_id);
+int snap_blk_pool_malloc(struct snap_blk_pool *pool, size_t size,
+			 struct snap_blk_mempool_ctx *mem_ctx);
+void snap_blk_pool_cancel(struct snap_blk_pool *pool,
+			  struct snap_blk_mempool_ctx *mem_ctx);
+void snap_blk_pool_free(struct snap_blk_pool *pool,
+			struct snap_blk_mempool_ctx *mem_ctx, void *buf);
+int snap_blk_pool_progress(struct snap_blk_pool *pool, int thread_id);
+
+static inline bool snap_blk_pool_enabled(struct snap_blk_pool *pool)
+{
+	return pool->mem != NULL;
+}
+#endif
@@ -1,14 +1,70 @@
 #include <stdlib.h>
 #include "snap_null_blk_dev.h"
 
+/**
+ * struct snap_null_blk_dev - null block device
+ * @bdev:	block device, must be first, it is the context of the ops
+ * @ios:	operations are recorded here, NULL when not recording
+ * @max_ios:	size of @ios
+ * @n_ios:	number of recorded operations
+ * @n_done:	number of recorded operations that were completed
+ * @defer:	recorded operations are completed by
+ *		snap_null_blk_dev_complete() instead of immediately
+ */
+struct snap_null_blk_dev {
+	struct snap_blk_dev bdev;
+	struct snap_null_blk_dev_io *ios;
+	int max_ios;
+	int n_ios;
+	int n_done;
+	bool defer;
+};
+
+static inline struct snap_null_blk_dev *to_null_blk_dev(void *ctx)
+{
+	return (struct snap_null_blk_dev *)ctx;
+}
+
+static int snap_null_blk_dev_io(void *ctx, enum snap_null_blk_dev_op op,
+				uint64_t offset_blocks, uint64_t num_blocks,
+				struct snap_bdev_io_done_ctx *done_ctx,
+				int thread_id)
+{
+	struct snap_null_blk_dev *dev = to_null_blk_dev(ctx);
+	struct snap_null_blk_dev_io *io;
+
+	if (dev->ios && dev->n_ios < dev->max_ios) {
+		io = &dev->ios[dev->n_ios++];
+		io->op = op;
+		io->offset_blocks = offset_blocks;
+		io->num_blocks = num_blocks;
+		io->done_ctx = done_ctx;
+		io->thread_id = thread_id;
+		if (dev->defer)
+			return 0;
+		dev->n_done++;
+	}
+
+	done_ctx->cb(SNAP_BDEV_OP_SUCCESS, done_ctx->user_arg);
+	return 0;
+}
+
+static uint64_t snap_null_blk_dev_blocks(void *ctx, uint64_t bytes)
+{
+	uint32_t blk_size = to_null_blk_dev(ctx)->bdev.attrs.blk_size;
+
+	return blk_size ? bytes / blk_size : bytes;
+}
+
 static int snap_null_blk_dev_readv_blocks(void *ctx,
 				  struct iovec *iov, int iovcnt,
 				  uint64_t offset_blocks, uint64_t num_blocks,
 				  struct snap_bdev_io_done_ctx *done_ctx,
 				  int thread_id)
 {
-	done_ctx->cb(SNAP_BDEV_OP_SUCCESS, done_ctx->user_arg);
-	return 0;
+	return snap_null_blk_dev_io(ctx, SNAP_NULL_BLK_DEV_OP_READ,
+				    offset_blocks, num_blocks, done_ctx,
+				    thread_id);
 }
 
 static int snap_null_blk_dev_writev_blocks(void *ctx,
@@ -17,8 +73,9 @@ static int snap_null_blk_dev_writev_blocks(void *ctx,
 				   struct snap_bdev_io_done_ctx *done_ctx,
 				   int thread_id)
 {
-	done_ctx->cb(SNAP_BDEV_OP_SUCCESS, done_ctx->user_arg);
-	return 0;
+	return snap_null_blk_dev_io(ctx, SNAP_NULL_BLK_DEV_OP_WRITE,
+				    offset_blocks, num_blocks, done_ctx,
+				    thread_id);
 }
 
 static int snap_null_blk_dev_read(void *ctx,
@@ -27,8 +84,10 @@ static int snap_null_blk_dev_read(void *ctx,
 					struct snap_bdev_io_done_ctx *done_ctx,
 					int thread_id)
 {
-	done_ctx->cb(SNAP_BDEV_OP_SUCCESS, done_ctx->user_arg);
-	return 0;
+	return snap_null_blk_dev_io(ctx, SNAP_NULL_BLK_DEV_OP_READ,
+				    snap_null_blk_dev_blocks(ctx, offset),
+				    snap_null_blk_dev_blocks(ctx, len),
+				    done_ctx, thread_id);
 }
 
 static int snap_null_blk_dev_write(void *ctx,
@@ -37,8 +96,10 @@ static int snap_null_blk_dev_write(void *ctx,
 					struct snap_bdev_io_done_ctx *done_ctx,
 					int thread_id)
 {
-	done_ctx->cb(SNAP_BDEV_OP_SUCCESS, done_ctx->user_arg);
-	return 0;
+	return snap_null_blk_dev_io(ctx, SNAP_NULL_BLK_DEV_OP_WRITE,
+				    snap_null_blk_dev_blocks(ctx, offset),
+				    snap_null_blk_dev_blocks(ctx, len),
+				    done_ctx, thread_id);
 }
 
 static int snap_null_blk_dev_flush(void *ctx,
@@ -46,8 +107,9 @@ static int snap_null_blk_dev_flush(void *ctx,
 				   struct snap_bdev_io_done_ctx *done_ctx,
 				   int thread_id)
 {
-	done_ctx->cb(SNAP_BDEV_OP_SUCCESS, done_ctx->user_arg);
-	return 0;
+	return snap_null_blk_dev_io(ctx, SNAP_NULL_BLK_DEV_OP_FLUSH,
+				    offset_blocks, num_blocks, done_ctx,
+				    thread_id);
 }
 
 static int snap_null_blk_dev_write_zeroes(void *ctx,
@@ -56,8 +118,9 @@ static int snap_null_blk_dev_write_zeroes(void *ctx,
 					  struct snap_bdev_io_done_ctx *done_ctx,
 					  int thread_id)
 {
-	done_ctx->cb(SNAP_BDEV_OP_SUCCESS, done_ctx->user_arg);
-	return 0;
+	return snap_null_blk_dev_io(ctx, SNAP_NULL_BLK_DEV_OP_WRITE_ZEROES,
+				    offset_blocks, num_blocks, done_ctx,
+				    thread_id);
 }
 
 static int snap_null_blk_dev_discard(void *ctx,
@@ -66,8 +129,9 @@ static int snap_null_blk_dev_discard(void *ctx,
 				     struct snap_bdev_io_done_ctx *done_ctx,
 				     int thread_id)
 {
-	done_ctx->cb(SNAP_BDEV_OP_SUCCESS, done_ctx->user_arg);
-	return 0;
+	return snap_null_blk_dev_io(ctx, SNAP_NULL_BLK_DEV_OP_DISCARD,
+				    offset_blocks, num_blocks, done_ctx,
+				    thread_id);
 }
 
 static void *snap_null_blk_dev_dma_malloc(size_t size)
@@ -104,11 +168,13 @@ static const char *snap_null_blk_dev_get_bdev_name(void *ctx)
 struct snap_blk_dev *snap_null_blk_dev_open(const char *name,
 				       const struct snap_blk_dev_attrs *attrs)
 {
+	struct snap_null_blk_dev *dev;
 	struct snap_blk_dev *bdev;
 
-	bdev = calloc(1, sizeof(struct snap_blk_dev));
-	if (!bdev)
+	dev = calloc(1, sizeof(struct snap_null_blk_dev));
+	if (!dev)
 		goto err;
+	bdev = &dev->bdev;
 
 	bdev->name = strdup(name);
 	if (!bdev->name)
@@ -131,7 +197,7 @@ struct snap_blk_dev *snap_null_blk_dev_open(const char *name,
 	return bdev;
 
 free_bdev:
-	free(bdev);
+	free(dev);
 err:
 	return NULL;
 }
@@ -139,5 +205,57 @@ err:
 void snap_null_blk_dev_close(struct snap_blk_dev *bdev)
 {
 	free(bdev->name);
-	free(bdev);
+	free(to_null_blk_dev(bdev));
+}
+
+/**
+ * snap_null_blk_dev_record() - record operations received by the device
+ * @bdev:	null block device
+ * @ios:	array to record the operations to, NULL to stop recording
+ * @max_ios:	size of @ios, operations beyond it are not recorded
+ * @defer:	do not complete recorded operations until
+ *		snap_null_blk_dev_complete() is called
+ *
+ * Used by tests to check which operations reach the block device and to
+ * complete them asynchronously.
+ */
+void snap_null_blk_dev_record(struct snap_blk_dev *bdev,
+			      struct snap_null_blk_dev_io *ios, int max_ios,
+			      bool defer)
+{
+	struct snap_null_blk_dev *dev = to_null_blk_dev(bdev);
+
+	dev->ios = ios;
+	dev->max_ios = ios ? max_ios : 0;
+	dev->n_ios = 0;
+	dev->n_done = 0;
+	dev->defer = defer;
+}
+
+/**
+ * snap_null_blk_dev_num_ios() - number of recorded operations
+ * @bdev:	null block device
+ */
+int snap_null_blk_dev_num_ios(struct snap_blk_dev *bdev)
+{
+	return to_null_blk_dev(bdev)->n_ios;
+}
+
+/**
+ * snap_null_blk_dev_complete() - complete deferred operations
+ * @bdev:	null block device
+ * @status:	completion status given to the operations
+ *
+ * Completes, in order, the recorded operations that were not completed yet.
+ */
+void snap_null_blk_dev_complete(struct snap_blk_dev *bdev,
+				enum snap_bdev_op_status status)
+{
+	struct snap_null_blk_dev *dev = to_null_blk_dev(bdev);
+	struct snap_bdev_io_done_ctx *done_ctx;
+
+	while (dev->n_done < dev->n_ios) {
+		done_ctx = dev->ios[dev->n_done++].done_ctx;
+		done_ctx->cb(status, done_ctx->user_arg);
+	}
 }
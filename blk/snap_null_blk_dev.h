@@ -2,7 +2,40 @@
 #define _SNAP_NULL_BLK_DEV_H
 #include "snap_blk_dev.h"
 
+/**
+ * enum snap_null_blk_dev_op - operations recorded by the null block device
+ */
+enum snap_null_blk_dev_op {
+	SNAP_NULL_BLK_DEV_OP_READ,
+	SNAP_NULL_BLK_DEV_OP_WRITE,
+	SNAP_NULL_BLK_DEV_OP_FLUSH,
+	SNAP_NULL_BLK_DEV_OP_WRITE_ZEROES,
+	SNAP_NULL_BLK_DEV_OP_DISCARD,
+};
+
+/**
+ * struct snap_null_blk_dev_io - operation received by the null block device
+ * @op:			operation
+ * @offset_blocks:	first block of the operation
+ * @num_blocks:		number of blocks
+ * @done_ctx:		completion context of the operation
+ * @thread_id:		thread id given with the operation
+ */
+struct snap_null_blk_dev_io {
+	enum snap_null_blk_dev_op op;
+	uint64_t offset_blocks;
+	uint64_t num_blocks;
+	struct snap_bdev_io_done_ctx *done_ctx;
+	int thread_id;
+};
+
 struct snap_blk_dev *snap_null_blk_dev_open(const char *name,
 					    const struct snap_blk_dev_attrs *attrs);
 void snap_null_blk_dev_close(struct snap_blk_dev *bdev);
+void snap_null_blk_dev_record(struct snap_blk_dev *bdev,
+			      struct snap_null_blk_dev_io *ios, int max_ios,
+			      bool defer);
+int snap_null_blk_dev_num_ios(struct snap_blk_dev *bdev);
+void snap_null_blk_dev_complete(struct snap_blk_dev *bdev,
+				enum snap_bdev_op_status status);
 #endif
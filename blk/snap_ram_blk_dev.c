@@ -0,0 +1,596 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "snap_ram_blk_dev.h"
+#include "snap_blk_pool.h"
+
+#define SNAP_RAM_BLK_DEV_RING_SIZE	256
+#define SNAP_RAM_BLK_DEV_HUGEPAGE	(2UL * 1024 * 1024)
+#define SNAP_RAM_BLK_DEV_BUF_ALIGN	4096UL
+#define SNAP_RAM_BLK_DEV_MAX_NODES	1024
+#define SNAP_RAM_BLK_DEV_LONG_BITS	(8 * sizeof(unsigned long))
+
+#define snap_ram_blk_dev_align(val, align) \
+	(((val) + (align) - 1) & ~((align) - 1))
+
+/**
+ * struct snap_ram_blk_dev_comp - completion waiting for progress
+ * @done_ctx:	completion context of a block operation
+ */
+struct snap_ram_blk_dev_comp {
+	struct snap_bdev_io_done_ctx *done_ctx;
+};
+
+/**
+ * struct snap_ram_blk_dev_ring - completion ring of a thread
+ * @comps:	completions, the size of the ring is a power of two
+ * @mask:	size of the ring - 1
+ * @head:	next completion to deliver
+ * @tail:	next free entry
+ *
+ * Used only by its thread, the ring doubles when it is full.
+ */
+struct snap_ram_blk_dev_ring {
+	struct snap_ram_blk_dev_comp *comps;
+	uint32_t mask;
+	uint32_t head;
+	uint32_t tail;
+};
+
+/**
+ * struct snap_ram_blk_dev_thread - per thread state of the device
+ * @comps:	operations completed by the next snap_ram_blk_dev_progress()
+ */
+struct snap_ram_blk_dev_thread {
+	struct snap_ram_blk_dev_ring comps;
+};
+
+/**
+ * struct snap_ram_blk_dev - RAM block device
+ * @bdev:		block device, must be first, it is the context of the ops
+ * @data:		backing store of the device
+ * @size:		size of the device in bytes
+ * @data_len:		mapped length of @data
+ * @page_size:		page size of @data
+ * @threads:		per thread state, see snap_ram_blk_dev_thread()
+ * @num_threads:	number of @threads
+ * @pool_mem:		memory of the pool buffers, NULL without a pool
+ * @pool_len:		mapped length of @pool_mem
+ * @pool:		dma buffer pool
+ */
+struct snap_ram_blk_dev {
+	struct snap_blk_dev bdev;
+	uint8_t *data;
+	uint64_t size;
+	size_t data_len;
+	size_t page_size;
+	struct snap_ram_blk_dev_thread *threads;
+	int num_threads;
+	uint8_t *pool_mem;
+	size_t pool_len;
+	struct snap_blk_pool pool;
+};
+
+static inline struct snap_ram_blk_dev *to_ram_blk_dev(void *ctx)
+{
+	return (struct snap_ram_blk_dev *)ctx;
+}
+
+static int snap_ram_blk_dev_mbind(void *addr, size_t len, int node)
+{
+	unsigned long mask[SNAP_RAM_BLK_DEV_MAX_NODES / SNAP_RAM_BLK_DEV_LONG_BITS] = {};
+
+	if (node < 0 || node >= SNAP_RAM_BLK_DEV_MAX_NODES)
+		return -EINVAL;
+
+	mask[node / SNAP_RAM_BLK_DEV_LONG_BITS] |=
+		1UL << (node % SNAP_RAM_BLK_DEV_LONG_BITS);
+	/* the kernel takes one bit less than maxnode */
+	if (syscall(SYS_mbind, addr, len, MPOL_BIND, mask,
+		    SNAP_RAM_BLK_DEV_MAX_NODES + 1, 0))
+		return -errno;
+	return 0;
+}
+
+/**
+ * snap_ram_blk_dev_mmap() - map memory of the device
+ * @attrs:	attributes of the device
+ * @len:	length to map, updated to the mapped length
+ * @page_size:	set to the page size of the mapping
+ *
+ * Maps huge pages if there are enough of them, normal pages otherwise. The
+ * pages are bound to the NUMA node of the device before they are touched,
+ * so they are allocated there on first use.
+ *
+ * Return: address of the mapping or NULL on error
+ */
+static void *snap_ram_blk_dev_mmap(const struct snap_blk_dev_ram_attrs *attrs,
+				   size_t *len, size_t *page_size)
+{
+	size_t map_len;
+	void *addr;
+	int ret;
+
+	map_len = snap_ram_blk_dev_align(*len, SNAP_RAM_BLK_DEV_HUGEPAGE);
+	addr = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (addr != MAP_FAILED) {
+		*page_size = SNAP_RAM_BLK_DEV_HUGEPAGE;
+	} else {
+		*page_size = sysconf(_SC_PAGESIZE);
+		map_len = snap_ram_blk_dev_align(*len, *page_size);
+		addr = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED)
+			return NULL;
+	}
+
+	if (attrs->numa_bind) {
+		ret = snap_ram_blk_dev_mbind(addr, map_len, attrs->numa_node);
+		if (ret) {
+			printf("Failed to bind block device memory to node %d, err %d\n",
+			       attrs->numa_node, ret);
+			munmap(addr, map_len);
+			return NULL;
+		}
+	}
+
+	*len = map_len;
+	return addr;
+}
+
+static int snap_ram_blk_dev_ring_init(struct snap_ram_blk_dev_ring *ring)
+{
+	ring->comps = calloc(SNAP_RAM_BLK_DEV_RING_SIZE, sizeof(*ring->comps));
+	if (!ring->comps)
+		return -ENOMEM;
+	ring->mask = SNAP_RAM_BLK_DEV_RING_SIZE - 1;
+	ring->head = ring->tail = 0;
+	return 0;
+}
+
+static int snap_ram_blk_dev_ring_grow(struct snap_ram_blk_dev_ring *ring)
+{
+	struct snap_ram_blk_dev_comp *comps;
+	uint32_t i, size = ring->mask + 1;
+
+	comps = calloc(2 * size, sizeof(*comps));
+	if (!comps)
+		return -ENOMEM;
+	for (i = 0; i < size; i++)
+		comps[i] = ring->comps[(ring->head + i) & ring->mask];
+	free(ring->comps);
+	ring->comps = comps;
+	ring->mask = 2 * size - 1;
+	ring->head = 0;
+	ring->tail = size;
+	return 0;
+}
+
+static int snap_ram_blk_dev_ring_push(struct snap_ram_blk_dev_ring *ring,
+				      struct snap_bdev_io_done_ctx *done_ctx)
+{
+	if (ring->tail - ring->head > ring->mask &&
+	    snap_ram_blk_dev_ring_grow(ring))
+		return -ENOMEM;
+
+	ring->comps[ring->tail++ & ring->mask].done_ctx = done_ctx;
+	return 0;
+}
+
+/*
+ * Operations of the single-threaded progress of a controller have no
+ * thread id, they use the state of the first thread.
+ */
+static struct snap_ram_blk_dev_thread *
+snap_ram_blk_dev_thread(struct snap_ram_blk_dev *dev, int thread_id)
+{
+	if (thread_id < 0)
+		thread_id = 0;
+	if (thread_id >= dev->num_threads)
+		return NULL;
+	return &dev->threads[thread_id];
+}
+
+static uint8_t *snap_ram_blk_dev_addr(struct snap_ram_blk_dev *dev,
+				      uint64_t offset, uint64_t len)
+{
+	if (offset > dev->size || len > dev->size - offset)
+		return NULL;
+	return dev->data + offset;
+}
+
+static uint8_t *snap_ram_blk_dev_blocks_addr(struct snap_ram_blk_dev *dev,
+					     uint64_t offset_blocks,
+					     uint64_t num_blocks)
+{
+	uint64_t size_b = dev->bdev.attrs.size_b;
+
+	if (offset_blocks > size_b || num_blocks > size_b - offset_blocks)
+		return NULL;
+	return dev->data + offset_blocks * dev->bdev.attrs.blk_size;
+}
+
+static void snap_ram_blk_dev_copyv(uint8_t *addr, struct iovec *iov,
+				   int iovcnt, uint64_t len, bool write)
+{
+	uint64_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && len; i++) {
+		n = iov[i].iov_len < len ? iov[i].iov_len : len;
+		if (write)
+			memcpy(addr, iov[i].iov_base, n);
+		else
+			memcpy(iov[i].iov_base, addr, n);
+		addr += n;
+		len -= n;
+	}
+}
+
+static int snap_ram_blk_dev_rwv(void *ctx, struct iovec *iov, int iovcnt,
+				uint64_t offset_blocks, uint64_t num_blocks,
+				struct snap_bdev_io_done_ctx *done_ctx,
+				int thread_id, bool write)
+{
+	struct snap_ram_blk_dev *dev = to_ram_blk_dev(ctx);
+	struct snap_ram_blk_dev_thread *t;
+	uint8_t *addr;
+
+	t = snap_ram_blk_dev_thread(dev, thread_id);
+	addr = snap_ram_blk_dev_blocks_addr(dev, offset_blocks, num_blocks);
+	if (!t || !addr)
+		return -EINVAL;
+
+	snap_ram_blk_dev_copyv(addr, iov, iovcnt,
+			       num_blocks * dev->bdev.attrs.blk_size, write);
+	return snap_ram_blk_dev_ring_push(&t->comps, done_ctx);
+}
+
+static int snap_ram_blk_dev_readv_blocks(void *ctx,
+				  struct iovec *iov, int iovcnt,
+				  uint64_t offset_blocks, uint64_t num_blocks,
+				  struct snap_bdev_io_done_ctx *done_ctx,
+				  int thread_id)
+{
+	return snap_ram_blk_dev_rwv(ctx, iov, iovcnt, offset_blocks,
+				    num_blocks, done_ctx, thread_id, false);
+}
+
+static int snap_ram_blk_dev_writev_blocks(void *ctx,
+				   struct iovec *iov, int iovcnt,
+				   uint64_t offset_blocks, uint64_t num_blocks,
+				   struct snap_bdev_io_done_ctx *done_ctx,
+				   int thread_id)
+{
+	return snap_ram_blk_dev_rwv(ctx, iov, iovcnt, offset_blocks,
+				    num_blocks, done_ctx, thread_id, true);
+}
+
+static int snap_ram_blk_dev_rw(void *ctx, void *buf,
+			       uint64_t offset, uint64_t len,
+			       struct snap_bdev_io_done_ctx *done_ctx,
+			       int thread_id, bool write)
+{
+	struct snap_ram_blk_dev *dev = to_ram_blk_dev(ctx);
+	struct snap_ram_blk_dev_thread *t;
+	uint8_t *addr;
+
+	t = snap_ram_blk_dev_thread(dev, thread_id);
+	addr = snap_ram_blk_dev_addr(dev, offset, len);
+	if (!t || !addr)
+		return -EINVAL;
+
+	if (write)
+		memcpy(addr, buf, len);
+	else
+		memcpy(buf, addr, len);
+	return snap_ram_blk_dev_ring_push(&t->comps, done_ctx);
+}
+
+static int snap_ram_blk_dev_read(void *ctx,
+					void *buf,
+					uint64_t offset, uint64_t len,
+					struct snap_bdev_io_done_ctx *done_ctx,
+					int thread_id)
+{
+	return snap_ram_blk_dev_rw(ctx, buf, offset, len, done_ctx,
+				   thread_id, false);
+}
+
+static int snap_ram_blk_dev_write(void *ctx,
+					void *buf,
+					uint64_t offset, uint64_t len,
+					struct snap_bdev_io_done_ctx *done_ctx,
+					int thread_id)
+{
+	return snap_ram_blk_dev_rw(ctx, buf, offset, len, done_ctx,
+				   thread_id, true);
+}
+
+static int snap_ram_blk_dev_flush(void *ctx,
+				  uint64_t offset_blocks, uint64_t num_blocks,
+				  struct snap_bdev_io_done_ctx *done_ctx,
+				  int thread_id)
+{
+	struct snap_ram_blk_dev_thread *t;
+
+	/* nothing is cached on the way to memory */
+	t = snap_ram_blk_dev_thread(to_ram_blk_dev(ctx), thread_id);
+	if (!t)
+		return -EINVAL;
+	return snap_ram_blk_dev_ring_push(&t->comps, done_ctx);
+}
+
+static int snap_ram_blk_dev_write_zeroes(void *ctx,
+					 uint64_t offset_blocks,
+					 uint64_t num_blocks,
+					 struct snap_bdev_io_done_ctx *done_ctx,
+					 int thread_id)
+{
+	struct snap_ram_blk_dev *dev = to_ram_blk_dev(ctx);
+	struct snap_ram_blk_dev_thread *t;
+	uint8_t *addr;
+
+	t = snap_ram_blk_dev_thread(dev, thread_id);
+	addr = snap_ram_blk_dev_blocks_addr(dev, offset_blocks, num_blocks);
+	if (!t || !addr)
+		return -EINVAL;
+
+	memset(addr, 0, num_blocks * dev->bdev.attrs.blk_size);
+	return snap_ram_blk_dev_ring_push(&t->comps, done_ctx);
+}
+
+/*
+ * Unlike write zeroes, discard gives the whole pages of the range back to
+ * the system. They read as zeroes until they are written again.
+ */
+static int snap_ram_blk_dev_discard(void *ctx,
+				    uint64_t offset_blocks,
+				    uint64_t num_blocks,
+				    struct snap_bdev_io_done_ctx *done_ctx,
+				    int thread_id)
+{
+	struct snap_ram_blk_dev *dev = to_ram_blk_dev(ctx);
+	struct snap_ram_blk_dev_thread *t;
+	uint64_t offset, end, start_page, end_page;
+
+	t = snap_ram_blk_dev_thread(dev, thread_id);
+	if (!t || !snap_ram_blk_dev_blocks_addr(dev, offset_blocks, num_blocks))
+		return -EINVAL;
+
+	offset = offset_blocks * dev->bdev.attrs.blk_size;
+	end = offset + num_blocks * dev->bdev.attrs.blk_size;
+	start_page = snap_ram_blk_dev_align(offset, dev->page_size);
+	end_page = end & ~(dev->page_size - 1);
+	if (start_page < end_page &&
+	    !madvise(dev->data + start_page, end_page - start_page,
+		     MADV_DONTNEED)) {
+		memset(dev->data + offset, 0, start_page - offset);
+		memset(dev->data + end_page, 0, end - end_page);
+	} else {
+		memset(dev->data + offset, 0, end - offset);
+	}
+
+	return snap_ram_blk_dev_ring_push(&t->comps, done_ctx);
+}
+
+static void *snap_ram_blk_dev_dma_malloc(size_t size)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, SNAP_RAM_BLK_DEV_BUF_ALIGN, size))
+		return NULL;
+	memset(buf, 0, size);
+	return buf;
+}
+
+static void snap_ram_blk_dev_dma_free(void *buf)
+{
+	free(buf);
+}
+
+static int snap_ram_blk_dev_dma_pool_malloc(size_t size,
+					    struct snap_blk_mempool_ctx *mem_ctx)
+{
+	return snap_blk_pool_malloc(&to_ram_blk_dev(mem_ctx->ctx)->pool, size,
+				    mem_ctx);
+}
+
+static void snap_ram_blk_dev_dma_pool_cancel(struct snap_blk_mempool_ctx *mem_ctx)
+{
+	snap_blk_pool_cancel(&to_ram_blk_dev(mem_ctx->ctx)->pool, mem_ctx);
+}
+
+static void snap_ram_blk_dev_dma_pool_free(struct snap_blk_mempool_ctx *ctx,
+					   void *buf)
+{
+	snap_blk_pool_free(&to_ram_blk_dev(ctx->ctx)->pool, ctx, buf);
+}
+
+static bool snap_ram_blk_dev_dma_pool_enabled(void *ctx)
+{
+	return snap_blk_pool_enabled(&to_ram_blk_dev(ctx)->pool);
+}
+
+static int snap_ram_blk_dev_progress_ctx(void *ctx, int thread_id)
+{
+	struct snap_ram_blk_dev *dev = to_ram_blk_dev(ctx);
+	struct snap_ram_blk_dev_thread *t;
+	struct snap_ram_blk_dev_comp comp;
+	uint32_t i, n;
+	int done;
+
+	t = snap_ram_blk_dev_thread(dev, thread_id);
+	if (!t)
+		return 0;
+
+	done = snap_blk_pool_progress(&dev->pool, thread_id);
+	/* completions added by the callbacks wait for the next call */
+	n = t->comps.tail - t->comps.head;
+	for (i = 0; i < n; i++) {
+		comp = t->comps.comps[t->comps.head++ & t->comps.mask];
+		comp.done_ctx->cb(SNAP_BDEV_OP_SUCCESS, comp.done_ctx->user_arg);
+		done++;
+	}
+
+	return done;
+}
+
+static uint64_t snap_ram_blk_dev_get_num_blocks(void *ctx)
+{
+	struct snap_blk_dev *bdev = (struct snap_blk_dev *)ctx;
+
+	return bdev->attrs.size_b;
+}
+
+static uint32_t snap_ram_blk_dev_get_block_size(void *ctx)
+{
+	struct snap_blk_dev *bdev = (struct snap_blk_dev *)ctx;
+
+	return bdev->attrs.blk_size;
+}
+
+static const char *snap_ram_blk_dev_get_bdev_name(void *ctx)
+{
+	struct snap_blk_dev *bdev = (struct snap_blk_dev *)ctx;
+
+	return bdev->name;
+}
+
+static int snap_ram_blk_dev_pool_init(struct snap_ram_blk_dev *dev,
+				      const struct snap_blk_dev_ram_attrs *attrs)
+{
+	size_t buf_size, page_size;
+
+	buf_size = snap_blk_pool_buf_size(attrs->pool_buf_size);
+	if (!buf_size)
+		return -EINVAL;
+
+	dev->pool_len = buf_size * attrs->pool_bufs * dev->num_threads;
+	dev->pool_mem = snap_ram_blk_dev_mmap(attrs, &dev->pool_len, &page_size);
+	if (!dev->pool_mem)
+		return -ENOMEM;
+
+	return snap_blk_pool_init(&dev->pool, dev->pool_mem, buf_size,
+				  attrs->pool_bufs, dev->num_threads, attrs->pd);
+}
+
+/* releases whatever an open, even a failed one, allocated */
+static void snap_ram_blk_dev_free(struct snap_ram_blk_dev *dev)
+{
+	int i;
+
+	if (dev->threads) {
+		for (i = 0; i < dev->num_threads; i++)
+			free(dev->threads[i].comps.comps);
+		free(dev->threads);
+	}
+	snap_blk_pool_destroy(&dev->pool);
+	if (dev->pool_mem)
+		munmap(dev->pool_mem, dev->pool_len);
+	if (dev->data)
+		munmap(dev->data, dev->data_len);
+	free(dev->bdev.name);
+	free(dev);
+}
+
+/**
+ * snap_ram_blk_dev_open() - open a RAM block device
+ * @name:	block device name
+ * @attrs:	creation attributes, see struct snap_blk_dev_ram_attrs
+ *
+ * The device keeps its data in anonymous memory, huge pages when the
+ * system has enough of them. Operations are executed when they are
+ * submitted and completed by the next snap_ram_blk_dev_progress() of the
+ * submitting thread, so their callbacks never run in the submission.
+ *
+ * Return: block device or NULL on error
+ */
+struct snap_blk_dev *snap_ram_blk_dev_open(const char *name,
+					   const struct snap_blk_dev_attrs *attrs)
+{
+	struct snap_ram_blk_dev *dev;
+	struct snap_blk_dev *bdev;
+	int i;
+
+	if (!attrs->size_b || !attrs->blk_size || attrs->ram.num_threads < 0 ||
+	    attrs->ram.pool_bufs < 0)
+		return NULL;
+
+	dev = calloc(1, sizeof(struct snap_ram_blk_dev));
+	if (!dev)
+		return NULL;
+	bdev = &dev->bdev;
+
+	bdev->name = strdup(name);
+	if (!bdev->name)
+		goto free_dev;
+	memcpy(&bdev->attrs, attrs, sizeof(bdev->attrs));
+
+	dev->size = attrs->size_b * attrs->blk_size;
+	dev->data_len = dev->size;
+	dev->data = snap_ram_blk_dev_mmap(&attrs->ram, &dev->data_len,
+					  &dev->page_size);
+	if (!dev->data)
+		goto free_dev;
+
+	dev->num_threads = attrs->ram.num_threads ? attrs->ram.num_threads : 1;
+	dev->threads = calloc(dev->num_threads, sizeof(*dev->threads));
+	if (!dev->threads)
+		goto free_dev;
+	for (i = 0; i < dev->num_threads; i++) {
+		if (snap_ram_blk_dev_ring_init(&dev->threads[i].comps))
+			goto free_dev;
+	}
+
+	if (attrs->ram.pool_bufs &&
+	    snap_ram_blk_dev_pool_init(dev, &attrs->ram))
+		goto free_dev;
+
+	bdev->ops.readv_blocks = snap_ram_blk_dev_readv_blocks;
+	bdev->ops.writev_blocks = snap_ram_blk_dev_writev_blocks;
+	bdev->ops.read = snap_ram_blk_dev_read;
+	bdev->ops.write = snap_ram_blk_dev_write;
+	bdev->ops.flush = snap_ram_blk_dev_flush;
+	bdev->ops.write_zeroes = snap_ram_blk_dev_write_zeroes;
+	bdev->ops.discard = snap_ram_blk_dev_discard;
+	bdev->ops.dma_malloc = snap_ram_blk_dev_dma_malloc;
+	bdev->ops.dma_free = snap_ram_blk_dev_dma_free;
+	bdev->ops.get_num_blocks = snap_ram_blk_dev_get_num_blocks;
+	bdev->ops.get_block_size = snap_ram_blk_dev_get_block_size;
+	bdev->ops.get_bdev_name = snap_ram_blk_dev_get_bdev_name;
+	bdev->ops.dma_pool_malloc = snap_ram_blk_dev_dma_pool_malloc;
+	bdev->ops.dma_pool_cancel = snap_ram_blk_dev_dma_pool_cancel;
+	bdev->ops.dma_pool_free = snap_ram_blk_dev_dma_pool_free;
+	bdev->ops.dma_pool_enabled = snap_ram_blk_dev_dma_pool_enabled;
+	bdev->ops.progress = snap_ram_blk_dev_progress_ctx;
+
+	return bdev;
+
+free_dev:
+	snap_ram_blk_dev_free(dev);
+	return NULL;
+}
+
+void snap_ram_blk_dev_close(struct snap_blk_dev *bdev)
+{
+	snap_ram_blk_dev_free(to_ram_blk_dev(bdev));
+}
+
+/**
+ * snap_ram_blk_dev_progress() - complete operations of a thread
+ * @bdev:	RAM block device
+ * @thread_id:	thread the operations were submitted from
+ *
+ * Calls the callbacks of the pool allocations and then of the operations
+ * of @thread_id, each in submission order. Must be called by that thread.
+ *
+ * Return: number of callbacks called
+ */
+int snap_ram_blk_dev_progress(struct snap_blk_dev *bdev, int thread_id)
+{
+	return snap_ram_blk_dev_progress_ctx(bdev, thread_id);
+}
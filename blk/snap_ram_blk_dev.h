@@ -0,0 +1,9 @@
+#ifndef _SNAP_RAM_BLK_DEV_H
+#define _SNAP_RAM_BLK_DEV_H
+#include "snap_blk_dev.h"
+
+struct snap_blk_dev *snap_ram_blk_dev_open(const char *name,
+					   const struct snap_blk_dev_attrs *attrs);
+void snap_ram_blk_dev_close(struct snap_blk_dev *bdev);
+int snap_ram_blk_dev_progress(struct snap_blk_dev *bdev, int thread_id);
+#endif
@@ -0,0 +1,1054 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+#include "snap_uring_blk_dev.h"
+#include "snap_blk_pool.h"
+
+#define SNAP_URING_BLK_DEV_QUEUE_DEPTH	256
+#define SNAP_URING_BLK_DEV_RING_SIZE	64
+#define SNAP_URING_BLK_DEV_BUF_ALIGN	4096UL
+#define SNAP_URING_BLK_DEV_BLK_SIZE	512
+
+/**
+ * struct snap_uring_blk_dev_io - operation in the ring
+ * @done_ctx:	completion context of the operation
+ * @len:	expected result, a shorter transfer is an error
+ * @zero_off:	offset of a write zeroes, see snap_uring_blk_dev_reap()
+ * @zero_len:	length of a write zeroes, zero for other operations
+ * @next:	next free operation
+ */
+struct snap_uring_blk_dev_io {
+	struct snap_bdev_io_done_ctx *done_ctx;
+	uint32_t len;
+	uint64_t zero_off;
+	uint64_t zero_len;
+	struct snap_uring_blk_dev_io *next;
+};
+
+/**
+ * struct snap_uring_blk_dev_op - operation waiting for room in the ring
+ * @done_ctx:	completion context of the operation
+ * @len:	expected result, see struct snap_uring_blk_dev_io
+ * @sqe:	submission queue entry of the operation
+ */
+struct snap_uring_blk_dev_op {
+	struct snap_bdev_io_done_ctx *done_ctx;
+	uint32_t len;
+	struct io_uring_sqe sqe;
+};
+
+/**
+ * struct snap_uring_blk_dev_op_ring - backlog of a thread
+ * @ops:	operations, the size of the ring is a power of two
+ * @mask:	size of the ring - 1
+ * @head:	oldest operation
+ * @tail:	next free entry
+ *
+ * Used only by its thread, the ring doubles when it is full.
+ */
+struct snap_uring_blk_dev_op_ring {
+	struct snap_uring_blk_dev_op *ops;
+	uint32_t mask;
+	uint32_t head;
+	uint32_t tail;
+};
+
+/**
+ * struct snap_uring_blk_dev_ring - io_uring of a thread
+ * @fd:		io_uring file descriptor
+ * @file:	fd or fixed file index the operations use
+ * @sqe_flags:	IOSQE_FIXED_FILE if @file is a fixed file
+ * @sq_head:	kernel head of the submission queue
+ * @sq_tail:	tail of the submission queue seen by the kernel
+ * @sq_mask:	submission queue size - 1
+ * @sqes:	submission queue entries
+ * @sqe_tail:	tail of the submission queue, published by
+ *		snap_uring_blk_dev_submit()
+ * @cq_head:	head of the completion queue
+ * @cq_tail:	kernel tail of the completion queue
+ * @cq_mask:	completion queue size - 1
+ * @cqes:	completion queue entries
+ * @sq_ptr:	mapping of the submission queue ring
+ * @sq_len:	length of @sq_ptr
+ * @cq_ptr:	mapping of the completion queue ring, may be @sq_ptr
+ * @cq_len:	length of @cq_ptr
+ * @sqes_len:	length of @sqes
+ * @ios:	operations, one for every completion queue entry
+ * @free_ios:	free @ios
+ * @backlog:	operations submitted while all @ios or all submission queue
+ *		entries were in use, started by the next progress calls
+ * @bufs:	pool buffers of the thread, registered as fixed buffer 0
+ * @bufs_len:	length of @bufs
+ * @fixed_bufs:	@bufs is registered with the ring
+ * @stats:	statistics
+ */
+struct snap_uring_blk_dev_ring {
+	int fd;
+	int file;
+	uint8_t sqe_flags;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+	struct snap_uring_blk_dev_io *ios;
+	struct snap_uring_blk_dev_io *free_ios;
+	struct snap_uring_blk_dev_op_ring backlog;
+	uint8_t *bufs;
+	size_t bufs_len;
+	bool fixed_bufs;
+	struct snap_uring_blk_dev_stats stats;
+};
+
+/**
+ * struct snap_uring_blk_dev - io_uring block device
+ * @bdev:		block device, must be first, it is the context of the ops
+ * @fd:			file descriptor of the backing file
+ * @direct:		@fd was opened with O_DIRECT
+ * @rings:		per thread rings, see snap_uring_blk_dev_ring()
+ * @num_rings:		number of @rings
+ * @pool_mem:		memory of the pool buffers, NULL without a pool
+ * @pool_len:		length of @pool_mem
+ * @pool:		dma buffer pool
+ */
+struct snap_uring_blk_dev {
+	struct snap_blk_dev bdev;
+	int fd;
+	bool direct;
+	struct snap_uring_blk_dev_ring *rings;
+	int num_rings;
+	uint8_t *pool_mem;
+	size_t pool_len;
+	struct snap_blk_pool pool;
+};
+
+static inline struct snap_uring_blk_dev *to_uring_blk_dev(void *ctx)
+{
+	return (struct snap_uring_blk_dev *)ctx;
+}
+
+static int snap_uring_blk_dev_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int snap_uring_blk_dev_enter(int fd, unsigned to_submit)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int snap_uring_blk_dev_register(int fd, unsigned opcode, void *arg,
+				       unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int snap_uring_blk_dev_op_ring_init(struct snap_uring_blk_dev_op_ring *ring)
+{
+	ring->ops = calloc(SNAP_URING_BLK_DEV_RING_SIZE, sizeof(*ring->ops));
+	if (!ring->ops)
+		return -ENOMEM;
+	ring->mask = SNAP_URING_BLK_DEV_RING_SIZE - 1;
+	ring->head = ring->tail = 0;
+	return 0;
+}
+
+static int snap_uring_blk_dev_op_ring_push(struct snap_uring_blk_dev_op_ring *ring,
+					   struct snap_bdev_io_done_ctx *done_ctx,
+					   uint32_t len,
+					   const struct io_uring_sqe *sqe)
+{
+	struct snap_uring_blk_dev_op *ops, *op;
+	uint32_t i, size = ring->mask + 1;
+
+	if (ring->tail - ring->head > ring->mask) {
+		ops = calloc(2 * size, sizeof(*ops));
+		if (!ops)
+			return -ENOMEM;
+		for (i = 0; i < size; i++)
+			ops[i] = ring->ops[(ring->head + i) & ring->mask];
+		free(ring->ops);
+		ring->ops = ops;
+		ring->mask = 2 * size - 1;
+		ring->head = 0;
+		ring->tail = size;
+	}
+
+	op = &ring->ops[ring->tail++ & ring->mask];
+	op->done_ctx = done_ctx;
+	op->len = len;
+	op->sqe = *sqe;
+	return 0;
+}
+
+/**
+ * snap_uring_blk_dev_ring_init() - create the io_uring of a thread
+ * @r:		ring
+ * @fd:		backing file, registered as fixed file if possible
+ * @entries:	size of the submission queue
+ *
+ * The pool buffers of the thread, if any, must be set in @r. They are
+ * registered as fixed buffer 0 if possible. Registration needs locked
+ * memory, so without it the ring uses plain operations.
+ *
+ * Return: 0 or -errno on error
+ */
+static int snap_uring_blk_dev_ring_init(struct snap_uring_blk_dev_ring *r,
+					int fd, unsigned entries)
+{
+	struct io_uring_params p;
+	struct iovec iov;
+	unsigned *sq_array, i;
+	uint8_t *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = snap_uring_blk_dev_setup(entries, &p);
+	if (r->fd < 0) {
+		r->fd = -1;
+		return -errno;
+	}
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		return -errno;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = NULL;
+			return -errno;
+		}
+	}
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		return -errno;
+	}
+
+	sq = r->sq_ptr;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	r->sqe_tail = *r->sq_tail;
+	/* entries are used in order, the array never changes */
+	sq_array = (unsigned *)(sq + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+
+	cq = r->cq_ptr;
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* no more operations than completion entries, they never overflow */
+	r->ios = calloc(p.cq_entries, sizeof(*r->ios));
+	if (!r->ios)
+		return -ENOMEM;
+	for (i = 0; i < p.cq_entries; i++) {
+		r->ios[i].next = r->free_ios;
+		r->free_ios = &r->ios[i];
+	}
+
+	if (!snap_uring_blk_dev_register(r->fd, IORING_REGISTER_FILES, &fd, 1)) {
+		r->file = 0;
+		r->sqe_flags = IOSQE_FIXED_FILE;
+	} else {
+		r->file = fd;
+		r->sqe_flags = 0;
+	}
+
+	if (r->bufs) {
+		iov.iov_base = r->bufs;
+		iov.iov_len = r->bufs_len;
+		r->fixed_bufs = !snap_uring_blk_dev_register(r->fd,
+							     IORING_REGISTER_BUFFERS,
+							     &iov, 1);
+	}
+
+	return snap_uring_blk_dev_op_ring_init(&r->backlog);
+}
+
+static void snap_uring_blk_dev_ring_destroy(struct snap_uring_blk_dev_ring *r)
+{
+	free(r->backlog.ops);
+	free(r->ios);
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	if (r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_len);
+	if (r->fd >= 0)
+		close(r->fd);
+}
+
+/*
+ * Operations of the single-threaded progress of a controller have no
+ * thread id, they use the ring of the first thread.
+ */
+static struct snap_uring_blk_dev_ring *
+snap_uring_blk_dev_ring(struct snap_uring_blk_dev *dev, int thread_id)
+{
+	if (thread_id < 0)
+		thread_id = 0;
+	if (thread_id >= dev->num_rings)
+		return NULL;
+	return &dev->rings[thread_id];
+}
+
+/**
+ * snap_uring_blk_dev_submit() - let the kernel see new operations
+ * @r:	ring
+ *
+ * Publishes the operations queued since the last call and submits them
+ * with a single io_uring_enter().
+ *
+ * Return: number of submitted operations or -errno on error
+ */
+static int snap_uring_blk_dev_submit(struct snap_uring_blk_dev_ring *r)
+{
+	unsigned to_submit;
+	int ret;
+
+	to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if (!to_submit)
+		return 0;
+
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	ret = snap_uring_blk_dev_enter(r->fd, to_submit);
+	if (ret < 0)
+		return -errno;
+
+	r->stats.submits++;
+	r->stats.sqes += ret;
+	return ret;
+}
+
+/*
+ * Operations are queued in the ring and submitted in a batch by the next
+ * progress of the thread. If the submission queue is full, the queued
+ * operations are submitted right away to make room.
+ */
+static struct io_uring_sqe *
+snap_uring_blk_dev_next_sqe(struct snap_uring_blk_dev_ring *r)
+{
+	if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > r->sq_mask &&
+	    snap_uring_blk_dev_submit(r) <= 0)
+		return NULL;
+
+	return &r->sqes[r->sqe_tail++ & r->sq_mask];
+}
+
+static void snap_uring_blk_dev_prep(struct snap_uring_blk_dev_ring *r,
+				    struct io_uring_sqe *sqe,
+				    uint8_t opcode, uint64_t off)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->flags = r->sqe_flags;
+	sqe->fd = r->file;
+	sqe->off = off;
+}
+
+static struct io_uring_sqe *
+snap_uring_blk_dev_queue(struct snap_uring_blk_dev_ring *r,
+			 struct snap_uring_blk_dev_io *io,
+			 uint8_t opcode, uint64_t off)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = snap_uring_blk_dev_next_sqe(r);
+	if (!sqe)
+		return NULL;
+
+	snap_uring_blk_dev_prep(r, sqe, opcode, off);
+	sqe->user_data = (uintptr_t)io;
+	return sqe;
+}
+
+/* queues an operation in the ring, false if the ring has no room for it */
+static bool snap_uring_blk_dev_start(struct snap_uring_blk_dev_ring *r,
+				     struct snap_bdev_io_done_ctx *done_ctx,
+				     uint32_t len,
+				     const struct io_uring_sqe *sqe)
+{
+	struct snap_uring_blk_dev_io *io;
+	struct io_uring_sqe *ring_sqe;
+
+	io = r->free_ios;
+	if (!io)
+		return false;
+
+	ring_sqe = snap_uring_blk_dev_next_sqe(r);
+	if (!ring_sqe)
+		return false;
+
+	*ring_sqe = *sqe;
+	ring_sqe->user_data = (uintptr_t)io;
+	r->free_ios = io->next;
+	io->done_ctx = done_ctx;
+	io->len = len;
+	io->zero_len = 0;
+	if (sqe->opcode == IORING_OP_FALLOCATE &&
+	    (sqe->len & FALLOC_FL_ZERO_RANGE)) {
+		io->zero_off = sqe->off;
+		io->zero_len = sqe->addr;
+	}
+	return true;
+}
+
+/**
+ * snap_uring_blk_dev_push() - queue an operation
+ * @r:		ring
+ * @done_ctx:	completion context of the operation
+ * @len:	expected result of the operation
+ * @sqe:	submission queue entry of the operation
+ *
+ * A ring has no more operations than completion queue entries. When all
+ * of them are in use, or the submission queue is full and cannot be
+ * submitted, the operation waits in the backlog of the ring. The progress
+ * of the thread moves the backlog to the ring, in order, as operations
+ * complete. A busy ring is never reported as an error.
+ *
+ * Return: 0 or -ENOMEM
+ */
+static int snap_uring_blk_dev_push(struct snap_uring_blk_dev_ring *r,
+				   struct snap_bdev_io_done_ctx *done_ctx,
+				   uint32_t len,
+				   const struct io_uring_sqe *sqe)
+{
+	int ret;
+
+	if (r->backlog.head == r->backlog.tail &&
+	    snap_uring_blk_dev_start(r, done_ctx, len, sqe))
+		return 0;
+
+	ret = snap_uring_blk_dev_op_ring_push(&r->backlog, done_ctx, len, sqe);
+	if (!ret)
+		r->stats.backlog++;
+	return ret;
+}
+
+static int snap_uring_blk_dev_start_backlog(struct snap_uring_blk_dev_ring *r)
+{
+	struct snap_uring_blk_dev_op *op;
+	int n = 0;
+
+	while (r->backlog.head != r->backlog.tail) {
+		op = &r->backlog.ops[r->backlog.head & r->backlog.mask];
+		if (!snap_uring_blk_dev_start(r, op->done_ctx, op->len, &op->sqe))
+			break;
+		r->backlog.head++;
+		n++;
+	}
+	return n;
+}
+
+static void snap_uring_blk_dev_set_fallocate(struct io_uring_sqe *sqe,
+					     uint64_t len, int mode)
+{
+	/* the length of a fallocate goes in addr and its mode in len */
+	sqe->addr = len;
+	sqe->len = mode;
+}
+
+static bool snap_uring_blk_dev_in_range(struct snap_uring_blk_dev *dev,
+					uint64_t offset_blocks,
+					uint64_t num_blocks)
+{
+	uint64_t size_b = dev->bdev.attrs.size_b;
+
+	return offset_blocks <= size_b && num_blocks <= size_b - offset_blocks;
+}
+
+static int snap_uring_blk_dev_rwv(void *ctx, struct iovec *iov, int iovcnt,
+				  uint64_t offset_blocks, uint64_t num_blocks,
+				  struct snap_bdev_io_done_ctx *done_ctx,
+				  int thread_id, uint8_t opcode)
+{
+	struct snap_uring_blk_dev *dev = to_uring_blk_dev(ctx);
+	uint32_t blk_size = dev->bdev.attrs.blk_size;
+	struct snap_uring_blk_dev_ring *r;
+	struct io_uring_sqe sqe;
+
+	r = snap_uring_blk_dev_ring(dev, thread_id);
+	if (!r || !snap_uring_blk_dev_in_range(dev, offset_blocks, num_blocks) ||
+	    num_blocks * blk_size > UINT32_MAX)
+		return -EINVAL;
+
+	snap_uring_blk_dev_prep(r, &sqe, opcode, offset_blocks * blk_size);
+	sqe.addr = (uintptr_t)iov;
+	sqe.len = iovcnt;
+	return snap_uring_blk_dev_push(r, done_ctx, num_blocks * blk_size, &sqe);
+}
+
+static int snap_uring_blk_dev_readv_blocks(void *ctx,
+				  struct iovec *iov, int iovcnt,
+				  uint64_t offset_blocks, uint64_t num_blocks,
+				  struct snap_bdev_io_done_ctx *done_ctx,
+				  int thread_id)
+{
+	return snap_uring_blk_dev_rwv(ctx, iov, iovcnt, offset_blocks,
+				      num_blocks, done_ctx, thread_id,
+				      IORING_OP_READV);
+}
+
+static int snap_uring_blk_dev_writev_blocks(void *ctx,
+				   struct iovec *iov, int iovcnt,
+				   uint64_t offset_blocks, uint64_t num_blocks,
+				   struct snap_bdev_io_done_ctx *done_ctx,
+				   int thread_id)
+{
+	return snap_uring_blk_dev_rwv(ctx, iov, iovcnt, offset_blocks,
+				      num_blocks, done_ctx, thread_id,
+				      IORING_OP_WRITEV);
+}
+
+/* buffers of the pool of the ring are transferred without mapping them */
+static int snap_uring_blk_dev_rw(void *ctx, void *buf,
+				 uint64_t offset, uint64_t len,
+				 struct snap_bdev_io_done_ctx *done_ctx,
+				 int thread_id, bool write)
+{
+	struct snap_uring_blk_dev *dev = to_uring_blk_dev(ctx);
+	uint64_t size = dev->bdev.attrs.size_b * dev->bdev.attrs.blk_size;
+	struct snap_uring_blk_dev_ring *r;
+	struct io_uring_sqe sqe;
+	bool fixed;
+	uint8_t op;
+	int ret;
+
+	r = snap_uring_blk_dev_ring(dev, thread_id);
+	if (!r || offset > size || len > size - offset || len > UINT32_MAX)
+		return -EINVAL;
+
+	fixed = r->fixed_bufs && (uint8_t *)buf >= r->bufs &&
+		(uint8_t *)buf + len <= r->bufs + r->bufs_len;
+	if (fixed)
+		op = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	else
+		op = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	snap_uring_blk_dev_prep(r, &sqe, op, offset);
+	sqe.addr = (uintptr_t)buf;
+	sqe.len = len;
+	sqe.buf_index = 0;
+	ret = snap_uring_blk_dev_push(r, done_ctx, len, &sqe);
+	if (!ret)
+		r->stats.fixed += fixed;
+	return ret;
+}
+
+static int snap_uring_blk_dev_read(void *ctx,
+					void *buf,
+					uint64_t offset, uint64_t len,
+					struct snap_bdev_io_done_ctx *done_ctx,
+					int thread_id)
+{
+	return snap_uring_blk_dev_rw(ctx, buf, offset, len, done_ctx,
+				     thread_id, false);
+}
+
+static int snap_uring_blk_dev_write(void *ctx,
+					void *buf,
+					uint64_t offset, uint64_t len,
+					struct snap_bdev_io_done_ctx *done_ctx,
+					int thread_id)
+{
+	return snap_uring_blk_dev_rw(ctx, buf, offset, len, done_ctx,
+				     thread_id, true);
+}
+
+static int snap_uring_blk_dev_flush(void *ctx,
+				    uint64_t offset_blocks, uint64_t num_blocks,
+				    struct snap_bdev_io_done_ctx *done_ctx,
+				    int thread_id)
+{
+	struct snap_uring_blk_dev_ring *r;
+	struct io_uring_sqe sqe;
+
+	r = snap_uring_blk_dev_ring(to_uring_blk_dev(ctx), thread_id);
+	if (!r)
+		return -EINVAL;
+
+	snap_uring_blk_dev_prep(r, &sqe, IORING_OP_FSYNC, 0);
+	sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+	return snap_uring_blk_dev_push(r, done_ctx, 0, &sqe);
+}
+
+static int snap_uring_blk_dev_fallocate(void *ctx,
+					uint64_t offset_blocks,
+					uint64_t num_blocks,
+					struct snap_bdev_io_done_ctx *done_ctx,
+					int thread_id, int mode)
+{
+	struct snap_uring_blk_dev *dev = to_uring_blk_dev(ctx);
+	uint32_t blk_size = dev->bdev.attrs.blk_size;
+	struct snap_uring_blk_dev_ring *r;
+	struct io_uring_sqe sqe;
+
+	r = snap_uring_blk_dev_ring(dev, thread_id);
+	if (!r || !snap_uring_blk_dev_in_range(dev, offset_blocks, num_blocks))
+		return -EINVAL;
+
+	snap_uring_blk_dev_prep(r, &sqe, IORING_OP_FALLOCATE,
+				offset_blocks * blk_size);
+	snap_uring_blk_dev_set_fallocate(&sqe, num_blocks * blk_size, mode);
+	return snap_uring_blk_dev_push(r, done_ctx, 0, &sqe);
+}
+
+static int snap_uring_blk_dev_write_zeroes(void *ctx,
+					   uint64_t offset_blocks,
+					   uint64_t num_blocks,
+					   struct snap_bdev_io_done_ctx *done_ctx,
+					   int thread_id)
+{
+	return snap_uring_blk_dev_fallocate(ctx, offset_blocks, num_blocks,
+					    done_ctx, thread_id,
+					    FALLOC_FL_ZERO_RANGE |
+					    FALLOC_FL_KEEP_SIZE);
+}
+
+static int snap_uring_blk_dev_discard(void *ctx,
+				      uint64_t offset_blocks,
+				      uint64_t num_blocks,
+				      struct snap_bdev_io_done_ctx *done_ctx,
+				      int thread_id)
+{
+	return snap_uring_blk_dev_fallocate(ctx, offset_blocks, num_blocks,
+					    done_ctx, thread_id,
+					    FALLOC_FL_PUNCH_HOLE |
+					    FALLOC_FL_KEEP_SIZE);
+}
+
+/* aligned for O_DIRECT */
+static void *snap_uring_blk_dev_dma_malloc(size_t size)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, SNAP_URING_BLK_DEV_BUF_ALIGN, size))
+		return NULL;
+	memset(buf, 0, size);
+	return buf;
+}
+
+static void snap_uring_blk_dev_dma_free(void *buf)
+{
+	free(buf);
+}
+
+static int snap_uring_blk_dev_dma_pool_malloc(size_t size,
+					      struct snap_blk_mempool_ctx *mem_ctx)
+{
+	return snap_blk_pool_malloc(&to_uring_blk_dev(mem_ctx->ctx)->pool, size,
+				    mem_ctx);
+}
+
+static void snap_uring_blk_dev_dma_pool_cancel(struct snap_blk_mempool_ctx *mem_ctx)
+{
+	snap_blk_pool_cancel(&to_uring_blk_dev(mem_ctx->ctx)->pool, mem_ctx);
+}
+
+static void snap_uring_blk_dev_dma_pool_free(struct snap_blk_mempool_ctx *ctx,
+					     void *buf)
+{
+	snap_blk_pool_free(&to_uring_blk_dev(ctx->ctx)->pool, ctx, buf);
+}
+
+static bool snap_uring_blk_dev_dma_pool_enabled(void *ctx)
+{
+	return snap_blk_pool_enabled(&to_uring_blk_dev(ctx)->pool);
+}
+
+/*
+ * A file system without FALLOC_FL_ZERO_RANGE, like tmpfs, still zeroes a
+ * range by punching a hole in it.
+ */
+static bool snap_uring_blk_dev_retry_zeroes(struct snap_uring_blk_dev_ring *r,
+					    struct snap_uring_blk_dev_io *io,
+					    int res)
+{
+	struct io_uring_sqe *sqe;
+
+	if (res != -EOPNOTSUPP || !io->zero_len)
+		return false;
+
+	sqe = snap_uring_blk_dev_queue(r, io, IORING_OP_FALLOCATE,
+				       io->zero_off);
+	if (!sqe)
+		return false;
+	snap_uring_blk_dev_set_fallocate(sqe, io->zero_len,
+					 FALLOC_FL_PUNCH_HOLE |
+					 FALLOC_FL_KEEP_SIZE);
+	io->zero_len = 0;
+	return true;
+}
+
+static int snap_uring_blk_dev_reap(struct snap_uring_blk_dev_ring *r)
+{
+	struct snap_uring_blk_dev_io *io;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	bool ok;
+	int n = 0, res;
+
+	head = *r->cq_head;
+	tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		cqe = &r->cqes[head & r->cq_mask];
+		io = (struct snap_uring_blk_dev_io *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		/* free the entry before the callback, it may submit again */
+		__atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+		if (snap_uring_blk_dev_retry_zeroes(r, io, res))
+			continue;
+		ok = res >= 0 && (uint32_t)res == io->len;
+		io->next = r->free_ios;
+		r->free_ios = io;
+		io->done_ctx->cb(ok ? SNAP_BDEV_OP_SUCCESS :
+				 SNAP_BDEV_OP_IO_ERROR,
+				 io->done_ctx->user_arg);
+		n++;
+	}
+
+	r->stats.cqes += n;
+	return n;
+}
+
+static int snap_uring_blk_dev_progress_ctx(void *ctx, int thread_id)
+{
+	struct snap_uring_blk_dev *dev = to_uring_blk_dev(ctx);
+	struct snap_uring_blk_dev_ring *r;
+	int n;
+
+	r = snap_uring_blk_dev_ring(dev, thread_id);
+	if (!r)
+		return 0;
+
+	n = snap_blk_pool_progress(&dev->pool, thread_id);
+
+	/* operations left unsubmitted are retried on the next call */
+	snap_uring_blk_dev_submit(r);
+	n += snap_uring_blk_dev_reap(r);
+	/* the completed operations made room for the backlog */
+	if (snap_uring_blk_dev_start_backlog(r))
+		snap_uring_blk_dev_submit(r);
+	return n;
+}
+
+static uint64_t snap_uring_blk_dev_get_num_blocks(void *ctx)
+{
+	struct snap_blk_dev *bdev = (struct snap_blk_dev *)ctx;
+
+	return bdev->attrs.size_b;
+}
+
+static uint32_t snap_uring_blk_dev_get_block_size(void *ctx)
+{
+	struct snap_blk_dev *bdev = (struct snap_blk_dev *)ctx;
+
+	return bdev->attrs.blk_size;
+}
+
+static const char *snap_uring_blk_dev_get_bdev_name(void *ctx)
+{
+	struct snap_blk_dev *bdev = (struct snap_blk_dev *)ctx;
+
+	return bdev->name;
+}
+
+/*
+ * O_DIRECT is not supported by every file system, the device falls back to
+ * buffered IO on them.
+ */
+static int snap_uring_blk_dev_open_file(struct snap_uring_blk_dev *dev,
+					const struct snap_blk_dev_uring_attrs *attrs)
+{
+	dev->direct = attrs->direct;
+	if (attrs->direct) {
+		dev->fd = open(attrs->path, O_RDWR | O_DIRECT);
+		if (dev->fd >= 0)
+			return 0;
+		if (errno != EINVAL)
+			return -errno;
+		dev->direct = false;
+	}
+
+	dev->fd = open(attrs->path, O_RDWR);
+	if (dev->fd < 0)
+		return -errno;
+	return 0;
+}
+
+/*
+ * A device without a size gets the size of the file. A regular file
+ * smaller than the device is extended, the new blocks read as zeroes.
+ */
+static int snap_uring_blk_dev_set_size(struct snap_uring_blk_dev *dev)
+{
+	struct snap_blk_dev_attrs *attrs = &dev->bdev.attrs;
+	uint64_t size;
+	struct stat st;
+
+	if (fstat(dev->fd, &st))
+		return -errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(dev->fd, BLKGETSIZE64, &size))
+			return -errno;
+	} else {
+		size = st.st_size;
+	}
+
+	if (!attrs->size_b)
+		attrs->size_b = size / attrs->blk_size;
+	if (!attrs->size_b)
+		return -EINVAL;
+
+	if (size >= attrs->size_b * attrs->blk_size)
+		return 0;
+	if (!S_ISREG(st.st_mode))
+		return -EINVAL;
+	if (ftruncate(dev->fd, attrs->size_b * attrs->blk_size))
+		return -errno;
+	return 0;
+}
+
+static int snap_uring_blk_dev_pool_init(struct snap_uring_blk_dev *dev,
+					const struct snap_blk_dev_uring_attrs *attrs)
+{
+	size_t buf_size;
+	int i, ret;
+
+	buf_size = snap_blk_pool_buf_size(attrs->pool_buf_size);
+	if (!buf_size)
+		return -EINVAL;
+
+	dev->pool_len = buf_size * attrs->pool_bufs * dev->num_rings;
+	dev->pool_mem = mmap(NULL, dev->pool_len, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (dev->pool_mem == MAP_FAILED) {
+		dev->pool_mem = NULL;
+		return -ENOMEM;
+	}
+
+	ret = snap_blk_pool_init(&dev->pool, dev->pool_mem, buf_size,
+				 attrs->pool_bufs, dev->num_rings, attrs->pd);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < dev->num_rings; i++) {
+		dev->rings[i].bufs = dev->pool.threads[i].bufs;
+		dev->rings[i].bufs_len = dev->pool.thread_len;
+	}
+	return 0;
+}
+
+/* releases whatever an open, even a failed one, allocated */
+static void snap_uring_blk_dev_free(struct snap_uring_blk_dev *dev)
+{
+	int i;
+
+	if (dev->rings) {
+		for (i = 0; i < dev->num_rings; i++)
+			snap_uring_blk_dev_ring_destroy(&dev->rings[i]);
+		free(dev->rings);
+	}
+	snap_blk_pool_destroy(&dev->pool);
+	if (dev->pool_mem)
+		munmap(dev->pool_mem, dev->pool_len);
+	if (dev->fd >= 0)
+		close(dev->fd);
+	free((char *)dev->bdev.attrs.uring.path);
+	free(dev->bdev.name);
+	free(dev);
+}
+
+/**
+ * snap_uring_blk_dev_open() - open an io_uring block device
+ * @name:	block device name
+ * @attrs:	creation attributes, see struct snap_blk_dev_uring_attrs
+ *
+ * The device reads and writes a file or a block device with one io_uring
+ * per thread. Operations are queued when they are submitted and given to
+ * the kernel together by the next snap_uring_blk_dev_progress() of the
+ * submitting thread, which also completes them, so their callbacks never
+ * run in the submission. The iovecs of readv and writev must stay valid
+ * until the operation completes.
+ *
+ * Return: block device or NULL on error
+ */
+struct snap_blk_dev *snap_uring_blk_dev_open(const char *name,
+					     const struct snap_blk_dev_attrs *attrs)
+{
+	const struct snap_blk_dev_uring_attrs *uattrs = &attrs->uring;
+	struct snap_uring_blk_dev *dev;
+	struct snap_blk_dev *bdev;
+	unsigned entries;
+	int i, ret;
+
+	if (!uattrs->path || uattrs->num_threads < 0 ||
+	    uattrs->queue_depth < 0 || uattrs->pool_bufs < 0)
+		return NULL;
+
+	dev = calloc(1, sizeof(struct snap_uring_blk_dev));
+	if (!dev)
+		return NULL;
+	dev->fd = -1;
+	bdev = &dev->bdev;
+
+	memcpy(&bdev->attrs, attrs, sizeof(bdev->attrs));
+	bdev->attrs.uring.path = strdup(uattrs->path);
+	bdev->name = strdup(name);
+	if (!bdev->name || !bdev->attrs.uring.path)
+		goto free_dev;
+	if (!bdev->attrs.blk_size)
+		bdev->attrs.blk_size = SNAP_URING_BLK_DEV_BLK_SIZE;
+
+	ret = snap_uring_blk_dev_open_file(dev, uattrs);
+	if (ret) {
+		printf("Failed to open %s, err %d\n", uattrs->path, ret);
+		goto free_dev;
+	}
+	ret = snap_uring_blk_dev_set_size(dev);
+	if (ret) {
+		printf("Failed to set the size of %s, err %d\n", uattrs->path,
+		       ret);
+		goto free_dev;
+	}
+
+	dev->num_rings = uattrs->num_threads ? uattrs->num_threads : 1;
+	dev->rings = calloc(dev->num_rings, sizeof(*dev->rings));
+	if (!dev->rings)
+		goto free_dev;
+	for (i = 0; i < dev->num_rings; i++)
+		dev->rings[i].fd = -1;
+
+	if (uattrs->pool_bufs && snap_uring_blk_dev_pool_init(dev, uattrs))
+		goto free_dev;
+
+	entries = uattrs->queue_depth ? uattrs->queue_depth :
+		  SNAP_URING_BLK_DEV_QUEUE_DEPTH;
+	for (i = 0; i < dev->num_rings; i++) {
+		ret = snap_uring_blk_dev_ring_init(&dev->rings[i], dev->fd,
+						   entries);
+		if (ret) {
+			printf("Failed to create io_uring %d, err %d\n", i, ret);
+			goto free_dev;
+		}
+	}
+
+	bdev->ops.readv_blocks = snap_uring_blk_dev_readv_blocks;
+	bdev->ops.writev_blocks = snap_uring_blk_dev_writev_blocks;
+	bdev->ops.read = snap_uring_blk_dev_read;
+	bdev->ops.write = snap_uring_blk_dev_write;
+	bdev->ops.flush = snap_uring_blk_dev_flush;
+	bdev->ops.write_zeroes = snap_uring_blk_dev_write_zeroes;
+	bdev->ops.discard = snap_uring_blk_dev_discard;
+	bdev->ops.dma_malloc = snap_uring_blk_dev_dma_malloc;
+	bdev->ops.dma_free = snap_uring_blk_dev_dma_free;
+	bdev->ops.get_num_blocks = snap_uring_blk_dev_get_num_blocks;
+	bdev->ops.get_block_size = snap_uring_blk_dev_get_block_size;
+	bdev->ops.get_bdev_name = snap_uring_blk_dev_get_bdev_name;
+	bdev->ops.dma_pool_malloc = snap_uring_blk_dev_dma_pool_malloc;
+	bdev->ops.dma_pool_cancel = snap_uring_blk_dev_dma_pool_cancel;
+	bdev->ops.dma_pool_free = snap_uring_blk_dev_dma_pool_free;
+	bdev->ops.dma_pool_enabled = snap_uring_blk_dev_dma_pool_enabled;
+	bdev->ops.progress = snap_uring_blk_dev_progress_ctx;
+
+	return bdev;
+
+free_dev:
+	snap_uring_blk_dev_free(dev);
+	return NULL;
+}
+
+void snap_uring_blk_dev_close(struct snap_blk_dev *bdev)
+{
+	snap_uring_blk_dev_free(to_uring_blk_dev(bdev));
+}
+
+/**
+ * snap_uring_blk_dev_progress() - submit and complete operations of a thread
+ * @bdev:	io_uring block device
+ * @thread_id:	thread the operations were submitted from
+ *
+ * Gives the pool buffers that became available to their allocations,
+ * submits the operations queued by @thread_id since the last call with a
+ * single system call and calls the callbacks of the completed ones. The
+ * operations of the backlog that fit in the ring again are submitted too.
+ * Must be called by that thread.
+ *
+ * Return: number of callbacks called
+ */
+int snap_uring_blk_dev_progress(struct snap_blk_dev *bdev, int thread_id)
+{
+	return snap_uring_blk_dev_progress_ctx(bdev, thread_id);
+}
+
+/**
+ * snap_uring_blk_dev_is_direct() - check if the device bypasses the page cache
+ * @bdev:	io_uring block device
+ *
+ * Return: true if the file was opened with O_DIRECT
+ */
+bool snap_uring_blk_dev_is_direct(struct snap_blk_dev *bdev)
+{
+	return to_uring_blk_dev(bdev)->direct;
+}
+
+/**
+ * snap_uring_blk_dev_get_stats() - get the ring statistics of a thread
+ * @bdev:	io_uring block device
+ * @thread_id:	thread
+ * @stats:	filled with the statistics
+ *
+ * Return: 0 or -EINVAL if there is no such thread
+ */
+int snap_uring_blk_dev_get_stats(struct snap_blk_dev *bdev, int thread_id,
+				 struct snap_uring_blk_dev_stats *stats)
+{
+	struct snap_uring_blk_dev_ring *r;
+
+	r = snap_uring_blk_dev_ring(to_uring_blk_dev(bdev), thread_id);
+	if (!r)
+		return -EINVAL;
+	*stats = r->stats;
+	return 0;
+}
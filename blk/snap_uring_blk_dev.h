@@ -0,0 +1,28 @@
+#ifndef _SNAP_URING_BLK_DEV_H
+#define _SNAP_URING_BLK_DEV_H
+#include "snap_blk_dev.h"
+
+/**
+ * struct snap_uring_blk_dev_stats - ring statistics of a thread
+ * @submits:	io_uring_enter() calls that submitted operations
+ * @sqes:	operations submitted
+ * @cqes:	operations completed
+ * @fixed:	reads and writes of registered pool buffers
+ * @backlog:	operations that waited for room in the ring
+ */
+struct snap_uring_blk_dev_stats {
+	uint64_t submits;
+	uint64_t sqes;
+	uint64_t cqes;
+	uint64_t fixed;
+	uint64_t backlog;
+};
+
+struct snap_blk_dev *snap_uring_blk_dev_open(const char *name,
+					     const struct snap_blk_dev_attrs *attrs);
+void snap_uring_blk_dev_close(struct snap_blk_dev *bdev);
+int snap_uring_blk_dev_progress(struct snap_blk_dev *bdev, int thread_id);
+bool snap_uring_blk_dev_is_direct(struct snap_blk_dev *bdev);
+int snap_uring_blk_dev_get_stats(struct snap_blk_dev *bdev, int thread_id,
+				 struct snap_uring_blk_dev_stats *stats);
+#endif
@@ -14,25 +14,450 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/queue.h>
 #include "snap_buf.h"
 #include "snap_macros.h"
 #include "snap_mr.h"
+#include "snap_env.h"
 
+#define SNAP_BUF_POOL_SLAB_SIZE (1024 * 1024)
+#define SNAP_BUF_POOL_MAX_BUF_SIZE (64 * 1024)
+#define SNAP_BUF_POOL_SLAB_ALIGN 4096
+
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_BUF_POOL, 0);
+
+struct snap_buf_slab;
 
 struct snap_buf {
 	struct ibv_mr *mr;
-	uint8_t padding[SNAP_DCACHE_LINE - sizeof(struct ibv_mr *)];
+	/* NULL unless the buffer belongs to a pool slab */
+	struct snap_buf_slab *slab;
+	/* NULL unless the buffer was allocated by a pool */
+	struct snap_buf_pool *pool;
+	struct snap_buf *next;
+	uint8_t padding[SNAP_DCACHE_LINE - 4 * sizeof(void *)];
 	uint8_t ubuf[];
 };
 
+/*
+ * Slab is a registered chunk of memory carved into buffers of the same
+ * size class. All buffers of the slab share its memory region.
+ */
+struct snap_buf_slab {
+	struct snap_buf_class *cls;
+	void *mem;
+	struct ibv_mr *mr;
+	struct snap_buf *free_list;
+	int n_free;
+	int n_bufs;
+	LIST_ENTRY(snap_buf_slab) entry;
+	LIST_ENTRY(snap_buf_slab) avail_entry;
+};
+
+struct snap_buf_class {
+	size_t buf_size;
+	size_t stride;
+	int n_free;
+	/* slabs that have free buffers */
+	LIST_HEAD(, snap_buf_slab) avail;
+	LIST_HEAD(, snap_buf_slab) slabs;
+};
+
+struct snap_buf_pool {
+	struct snap_buf_pool_attr attr;
+	struct ibv_pd *pd;
+	int n_classes;
+	struct snap_buf_class classes[SNAP_BUF_POOL_MAX_CLASSES];
+	struct snap_buf_pool_stats stats;
+	pthread_mutex_t lock;
+	/* users of the process wide pool, see snap_buf_pool_acquire() */
+	int refcnt;
+	LIST_ENTRY(snap_buf_pool) entry;
+};
+
+static LIST_HEAD(, snap_buf_pool) snap_buf_pool_list = LIST_HEAD_INITIALIZER(snap_buf_pool_list);
+static pthread_mutex_t snap_buf_pool_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ibv_mr *snap_buf_pool_verbs_reg(void *arg, void *addr, size_t len)
+{
+	return snap_reg_mr((struct ibv_pd *)arg, addr, len);
+}
+
+static void snap_buf_pool_verbs_dereg(void *arg, struct ibv_mr *mr)
+{
+	ibv_dereg_mr(mr);
+}
+
+static const struct snap_buf_pool_ops snap_buf_pool_verbs_ops = {
+	.reg = snap_buf_pool_verbs_reg,
+	.dereg = snap_buf_pool_verbs_dereg
+};
+
+static size_t snap_buf_alloc_size(size_t size)
+{
+	return SNAP_ALIGN_CEIL(size + SNAP_DCACHE_LINE, SNAP_DCACHE_LINE);
+}
+
+static struct snap_buf_slab *snap_buf_slab_create(struct snap_buf_pool *pool,
+		struct snap_buf_class *cls)
+{
+	struct snap_buf_slab *slab;
+	struct snap_buf *buf;
+	size_t size;
+	int i;
+
+	slab = calloc(1, sizeof(*slab));
+	if (!slab)
+		return NULL;
+
+	slab->n_bufs = pool->attr.slab_size / cls->stride;
+	if (slab->n_bufs == 0)
+		slab->n_bufs = 1;
+	size = SNAP_ALIGN_CEIL(slab->n_bufs * cls->stride, SNAP_BUF_POOL_SLAB_ALIGN);
+
+	slab->mem = aligned_alloc(SNAP_BUF_POOL_SLAB_ALIGN, size);
+	if (!slab->mem)
+		goto free_slab;
+
+	slab->mr = pool->attr.ops->reg(pool->attr.arg, slab->mem, size);
+	if (!slab->mr)
+		goto free_mem;
+
+	for (i = slab->n_bufs - 1; i >= 0; i--) {
+		buf = (struct snap_buf *)((uint8_t *)slab->mem + i * cls->stride);
+		buf->mr = slab->mr;
+		buf->slab = slab;
+		buf->pool = pool;
+		buf->next = slab->free_list;
+		slab->free_list = buf;
+	}
+
+	slab->cls = cls;
+	slab->n_free = slab->n_bufs;
+	cls->n_free += slab->n_bufs;
+	LIST_INSERT_HEAD(&cls->slabs, slab, entry);
+	LIST_INSERT_HEAD(&cls->avail, slab, avail_entry);
+	pool->stats.slab_allocs++;
+	pool->stats.reg_bytes += size;
+	return slab;
+
+free_mem:
+	free(slab->mem);
+free_slab:
+	free(slab);
+	return NULL;
+}
+
+static void snap_buf_slab_destroy(struct snap_buf_pool *pool,
+		struct snap_buf_slab *slab)
+{
+	struct snap_buf_class *cls = slab->cls;
+
+	if (slab->n_free)
+		LIST_REMOVE(slab, avail_entry);
+	LIST_REMOVE(slab, entry);
+	cls->n_free -= slab->n_free;
+	pool->stats.slab_frees++;
+	pool->stats.reg_bytes -= slab->mr->length;
+	pool->attr.ops->dereg(pool->attr.arg, slab->mr);
+	free(slab->mem);
+	free(slab);
+}
+
+/**
+ * snap_buf_pool_create() - Create registered buffer pool
+ * @pd:   protection domain
+ * @attr: pool attributes, NULL for defaults
+ *
+ * The pool serves buffers from power of two size classes. Each class is
+ * backed by large registered slabs, so that the buffer allocation and
+ * release do not involve memory registration.
+ *
+ * Return: pool or NULL on error
+ */
+struct snap_buf_pool *snap_buf_pool_create(struct ibv_pd *pd,
+		const struct snap_buf_pool_attr *attr)
+{
+	struct snap_buf_pool *pool;
+	struct snap_buf_class *cls;
+	size_t size;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	if (attr)
+		pool->attr = *attr;
+	if (!pool->attr.slab_size)
+		pool->attr.slab_size = SNAP_BUF_POOL_SLAB_SIZE;
+	if (!pool->attr.max_buf_size)
+		pool->attr.max_buf_size = SNAP_BUF_POOL_MAX_BUF_SIZE;
+	if (!pool->attr.high_watermark)
+		pool->attr.high_watermark = 4 * pool->attr.slab_size;
+	if (!pool->attr.ops) {
+		pool->attr.ops = &snap_buf_pool_verbs_ops;
+		pool->attr.arg = pd;
+	}
+
+	for (size = 1UL << SNAP_BUF_POOL_MIN_SHIFT;
+	     pool->n_classes < SNAP_BUF_POOL_MAX_CLASSES; size <<= 1) {
+		cls = &pool->classes[pool->n_classes++];
+		cls->buf_size = size;
+		cls->stride = snap_buf_alloc_size(size);
+		LIST_INIT(&cls->avail);
+		LIST_INIT(&cls->slabs);
+		if (size >= pool->attr.max_buf_size)
+			break;
+	}
+	pool->attr.max_buf_size = pool->classes[pool->n_classes - 1].buf_size;
+
+	pool->pd = pd;
+	pthread_mutex_init(&pool->lock, NULL);
+	return pool;
+}
+
+/**
+ * snap_buf_pool_destroy() - Destroy buffer pool
+ * @pool: pool to destroy
+ *
+ * All buffers must be freed before the pool is destroyed.
+ */
+void snap_buf_pool_destroy(struct snap_buf_pool *pool)
+{
+	struct snap_buf_class *cls;
+	int i;
+
+	for (i = 0; i < pool->n_classes; i++) {
+		cls = &pool->classes[i];
+		while (!LIST_EMPTY(&cls->slabs))
+			snap_buf_slab_destroy(pool, LIST_FIRST(&cls->slabs));
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+static void *snap_buf_pool_alloc_large(struct snap_buf_pool *pool, size_t size)
+{
+	struct snap_buf *buf;
+
+	buf = aligned_alloc(SNAP_DCACHE_LINE, snap_buf_alloc_size(size));
+	if (!buf)
+		return NULL;
+	memset(buf, 0, sizeof(*buf) + size);
+
+	buf->mr = pool->attr.ops->reg(pool->attr.arg, buf->ubuf, size);
+	if (!buf->mr) {
+		free(buf);
+		return NULL;
+	}
+
+	buf->pool = pool;
+	pthread_mutex_lock(&pool->lock);
+	pool->stats.large_allocs++;
+	pthread_mutex_unlock(&pool->lock);
+	return buf->ubuf;
+}
+
+static int snap_buf_pool_class(size_t size)
+{
+	int shift = SNAP_BUF_POOL_MIN_SHIFT;
+
+	while ((1UL << shift) < size)
+		shift++;
+	return shift - SNAP_BUF_POOL_MIN_SHIFT;
+}
+
+/**
+ * snap_buf_pool_alloc() - Allocate registered buffer from the pool
+ * @pool: buffer pool
+ * @size: buffer size
+ *
+ * The buffer is zeroed. Use snap_buf_get_mkey() and snap_buf_get_rkey()
+ * to get its keys and snap_buf_free() to free it.
+ *
+ * Return: buffer or NULL on error
+ */
+void *snap_buf_pool_alloc(struct snap_buf_pool *pool, size_t size)
+{
+	struct snap_buf_class *cls;
+	struct snap_buf_slab *slab;
+	struct snap_buf *buf;
+
+	if (size > pool->attr.max_buf_size)
+		return snap_buf_pool_alloc_large(pool, size);
+
+	cls = &pool->classes[snap_buf_pool_class(size)];
+
+	pthread_mutex_lock(&pool->lock);
+	slab = LIST_FIRST(&cls->avail);
+	if (!slab) {
+		slab = snap_buf_slab_create(pool, cls);
+		if (!slab) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+	}
+
+	buf = slab->free_list;
+	slab->free_list = buf->next;
+	cls->n_free--;
+	if (--slab->n_free == 0)
+		LIST_REMOVE(slab, avail_entry);
+	pool->stats.allocs++;
+	pthread_mutex_unlock(&pool->lock);
+
+	memset(buf->ubuf, 0, size);
+	return buf->ubuf;
+}
+
+static void snap_buf_pool_free(struct snap_buf_pool *pool, struct snap_buf *buf)
+{
+	struct snap_buf_slab *slab = buf->slab;
+	struct snap_buf_class *cls = slab->cls;
+
+	pthread_mutex_lock(&pool->lock);
+	buf->next = slab->free_list;
+	slab->free_list = buf;
+	if (slab->n_free++ == 0)
+		LIST_INSERT_HEAD(&cls->avail, slab, avail_entry);
+	cls->n_free++;
+	pool->stats.frees++;
+
+	if (slab->n_free == slab->n_bufs &&
+	    cls->n_free * cls->stride > pool->attr.high_watermark)
+		snap_buf_slab_destroy(pool, slab);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * snap_buf_pool_shrink() - Release unused pool memory
+ * @pool: buffer pool
+ *
+ * The function releases all slabs that have no allocated buffers.
+ */
+void snap_buf_pool_shrink(struct snap_buf_pool *pool)
+{
+	struct snap_buf_slab *slab, *next;
+	struct snap_buf_class *cls;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->n_classes; i++) {
+		cls = &pool->classes[i];
+		for (slab = LIST_FIRST(&cls->slabs); slab; slab = next) {
+			next = LIST_NEXT(slab, entry);
+			if (slab->n_free == slab->n_bufs)
+				snap_buf_slab_destroy(pool, slab);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * snap_buf_pool_get_stats() - Get buffer pool statistics
+ * @pool:  buffer pool
+ * @stats: where to store the statistics
+ */
+void snap_buf_pool_get_stats(struct snap_buf_pool *pool,
+		struct snap_buf_pool_stats *stats)
+{
+	pthread_mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static struct snap_buf_pool *snap_buf_pool_get(struct ibv_pd *pd)
+{
+	struct snap_buf_pool *pool;
+
+	pthread_mutex_lock(&snap_buf_pool_list_lock);
+	LIST_FOREACH(pool, &snap_buf_pool_list, entry) {
+		if (pool->pd == pd)
+			goto out;
+	}
+
+	pool = snap_buf_pool_create(pd, NULL);
+	if (pool)
+		LIST_INSERT_HEAD(&snap_buf_pool_list, pool, entry);
+out:
+	pthread_mutex_unlock(&snap_buf_pool_list_lock);
+	return pool;
+}
+
+/**
+ * snap_buf_pool_acquire() - Take a reference on the process wide pool
+ * @pd: protection domain
+ *
+ * When SNAP_BUF_POOL is set, snap_buf_alloc() allocates from a process
+ * wide pool of the protection domain. Every user of the @pd, for example
+ * a controller, takes a reference on the pool and drops it with
+ * snap_buf_pool_release() when it is done with the @pd.
+ *
+ * Return: 0 on success, -ENOMEM if the pool cannot be created
+ */
+int snap_buf_pool_acquire(struct ibv_pd *pd)
+{
+	struct snap_buf_pool *pool;
+
+	if (snap_env_getenv(SNAP_BUF_POOL) <= 0)
+		return 0;
+
+	pool = snap_buf_pool_get(pd);
+	if (!pool)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&snap_buf_pool_list_lock);
+	pool->refcnt++;
+	pthread_mutex_unlock(&snap_buf_pool_list_lock);
+	return 0;
+}
+
+/**
+ * snap_buf_pool_release() - Release process wide pool of the protection domain
+ * @pd: protection domain
+ *
+ * The function drops a reference taken by snap_buf_pool_acquire(). The
+ * pool keeps memory registered on the @pd, so it is destroyed with the
+ * last reference, which must happen before the @pd is deallocated. All
+ * buffers of the @pd must be freed at that point.
+ */
+void snap_buf_pool_release(struct ibv_pd *pd)
+{
+	struct snap_buf_pool *pool;
+
+	pthread_mutex_lock(&snap_buf_pool_list_lock);
+	LIST_FOREACH(pool, &snap_buf_pool_list, entry) {
+		if (pool->pd == pd) {
+			if (--pool->refcnt > 0)
+				break;
+			LIST_REMOVE(pool, entry);
+			snap_buf_pool_destroy(pool);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&snap_buf_pool_list_lock);
+}
+
 void *snap_buf_alloc(struct ibv_pd *pd, size_t size)
 {
+	struct snap_buf_pool *pool;
 	struct snap_buf *buf;
 
-	buf = aligned_alloc(SNAP_DCACHE_LINE, size + SNAP_DCACHE_LINE);
+	if (snap_env_getenv(SNAP_BUF_POOL) > 0) {
+		pool = snap_buf_pool_get(pd);
+		if (pool)
+			return snap_buf_pool_alloc(pool, size);
+	}
+
+	buf = aligned_alloc(SNAP_DCACHE_LINE, snap_buf_alloc_size(size));
 	if (!buf)
 		return NULL;
-	memset(buf, 0, size);
+	memset(buf, 0, sizeof(*buf) + size);
 
 	buf->mr = snap_reg_mr(pd, buf->ubuf, size);
 	if (!buf->mr) {
@@ -47,7 +472,15 @@ void snap_buf_free(void *ubuf)
 {
 	struct snap_buf *buf = container_of(ubuf, struct snap_buf, ubuf);
 
-	ibv_dereg_mr(buf->mr);
+	if (buf->slab) {
+		snap_buf_pool_free(buf->pool, buf);
+		return;
+	}
+
+	if (buf->pool)
+		buf->pool->attr.ops->dereg(buf->pool->attr.arg, buf->mr);
+	else
+		ibv_dereg_mr(buf->mr);
 	free(buf);
 }
 
@@ -57,3 +490,10 @@ uint32_t snap_buf_get_mkey(void *ubuf)
 
 	return buf->mr->lkey;
 }
+
+uint32_t snap_buf_get_rkey(void *ubuf)
+{
+	const struct snap_buf *buf = container_of(ubuf, struct snap_buf, ubuf);
+
+	return buf->mr->rkey;
+}
@@ -18,7 +18,75 @@
 
 #define SNAP_DCACHE_LINE 64
 
+#define SNAP_BUF_POOL "SNAP_BUF_POOL"
+
+/* smallest size class is a cache line */
+#define SNAP_BUF_POOL_MIN_SHIFT 6
+#define SNAP_BUF_POOL_MAX_CLASSES 20
+
+/**
+ * struct snap_buf_pool_ops - memory registration callbacks
+ * @reg:   register memory, return memory region or NULL on error
+ * @dereg: release memory region returned by @reg
+ */
+struct snap_buf_pool_ops {
+	struct ibv_mr *(*reg)(void *arg, void *addr, size_t len);
+	void (*dereg)(void *arg, struct ibv_mr *mr);
+};
+
+/**
+ * struct snap_buf_pool_attr - buffer pool attributes
+ * @slab_size:      size of the registered memory chunk that is carved into
+ *                  the buffers of one size class. 0 means 1MB.
+ * @max_buf_size:   buffers larger than @max_buf_size are allocated and
+ *                  registered one by one. 0 means 64KB.
+ * @high_watermark: free memory kept by a size class. Slabs that become
+ *                  completely free above the watermark are released.
+ *                  0 means 4 slabs.
+ * @ops:            registration callbacks, NULL to register with
+ *                  snap_reg_mr() on the pool protection domain
+ * @arg:            first argument of the callbacks
+ */
+struct snap_buf_pool_attr {
+	size_t slab_size;
+	size_t max_buf_size;
+	size_t high_watermark;
+	const struct snap_buf_pool_ops *ops;
+	void *arg;
+};
+
+/**
+ * struct snap_buf_pool_stats - buffer pool statistics
+ * @allocs:       buffers allocated from the size classes
+ * @frees:        buffers returned to the size classes
+ * @large_allocs: buffers allocated and registered one by one
+ * @slab_allocs:  slabs allocated and registered
+ * @slab_frees:   slabs released
+ * @reg_bytes:    memory registered by the pool
+ */
+struct snap_buf_pool_stats {
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t large_allocs;
+	uint64_t slab_allocs;
+	uint64_t slab_frees;
+	uint64_t reg_bytes;
+};
+
+struct snap_buf_pool;
+
 void *snap_buf_alloc(struct ibv_pd *pd, size_t size);
 void snap_buf_free(void *buf);
 uint32_t snap_buf_get_mkey(void *buf);
+uint32_t snap_buf_get_rkey(void *buf);
+
+struct snap_buf_pool *snap_buf_pool_create(struct ibv_pd *pd,
+		const struct snap_buf_pool_attr *attr);
+void snap_buf_pool_destroy(struct snap_buf_pool *pool);
+void *snap_buf_pool_alloc(struct snap_buf_pool *pool, size_t size);
+void snap_buf_pool_shrink(struct snap_buf_pool *pool);
+void snap_buf_pool_get_stats(struct snap_buf_pool *pool,
+		struct snap_buf_pool_stats *stats);
+int snap_buf_pool_acquire(struct ibv_pd *pd);
+void snap_buf_pool_release(struct ibv_pd *pd);
 #endif
@@ -11,11 +11,99 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "snap_poll_groups.h"
+#include "snap_macros.h"
+
+/* trylock attempts of a writer before it gives up its cpu */
+#define SNAP_PG_WRITER_SPINS 256
+/* events returned by one epoll_wait() of a sleeping thread */
+#define SNAP_PG_IDLE_EVENTS 16
+
+/* work of a poll group thread, summed over the controllers */
+struct snap_pg_thread_load {
+	uint64_t busy;
+	uint64_t work;
+};
 
 static size_t *virtio_pg_usage;
+static struct snap_pg_thread_load *virtio_pg_load;
+static struct snap_pg_idle *virtio_pg_idle;
+static int virtio_pg_nidle;
 static size_t virtio_pg_ref_count;
 
+static int snap_pg_idle_init(struct snap_pg_idle *idle)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	int ret;
+
+	memset(idle, 0, sizeof(*idle));
+	TAILQ_INIT(&idle->pgs);
+	idle->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (idle->epfd < 0)
+		return -errno;
+
+	idle->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (idle->kick_fd < 0) {
+		ret = -errno;
+		goto close_epfd;
+	}
+
+	ev.data.fd = idle->kick_fd;
+	if (epoll_ctl(idle->epfd, EPOLL_CTL_ADD, idle->kick_fd, &ev)) {
+		ret = -errno;
+		goto close_kick_fd;
+	}
+
+	pthread_mutex_init(&idle->lock, NULL);
+	return 0;
+
+close_kick_fd:
+	close(idle->kick_fd);
+close_epfd:
+	close(idle->epfd);
+	return ret;
+}
+
+static void snap_pg_idle_fini(struct snap_pg_idle *idle)
+{
+	pthread_mutex_destroy(&idle->lock);
+	close(idle->kick_fd);
+	close(idle->epfd);
+}
+
+static void snap_pg_idle_free_all(void)
+{
+	int i;
+
+	for (i = 0; i < virtio_pg_nidle; i++)
+		snap_pg_idle_fini(&virtio_pg_idle[i]);
+	free(virtio_pg_idle);
+	virtio_pg_idle = NULL;
+	virtio_pg_nidle = 0;
+}
+
+static int snap_pg_idle_alloc_all(int npgs)
+{
+	if (posix_memalign((void **)&virtio_pg_idle, SNAP_CACHE_LINE_SIZE,
+			   npgs * sizeof(*virtio_pg_idle)))
+		return -ENOMEM;
+
+	for (virtio_pg_nidle = 0; virtio_pg_nidle < npgs; virtio_pg_nidle++) {
+		if (snap_pg_idle_init(&virtio_pg_idle[virtio_pg_nidle])) {
+			snap_pg_idle_free_all();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
 void snap_pgs_free(struct snap_pg_ctx *ctx)
 {
 	int i;
@@ -23,8 +111,13 @@ void snap_pgs_free(struct snap_pg_ctx *ctx)
 	if (ctx->npgs == 0)
 		return;
 
-	for (i = 0; i < ctx->npgs; i++)
+	for (i = 0; i < ctx->npgs; i++) {
+		pthread_mutex_lock(&ctx->pgs[i].idle->lock);
+		TAILQ_REMOVE(&ctx->pgs[i].idle->pgs, &ctx->pgs[i], idle_entry);
+		pthread_mutex_unlock(&ctx->pgs[i].idle->lock);
+		pthread_spin_destroy(&ctx->pgs[i].steal_lock);
 		pthread_spin_destroy(&ctx->pgs[i].lock);
+	}
 
 	free(ctx->pgs);
 
@@ -32,6 +125,9 @@ void snap_pgs_free(struct snap_pg_ctx *ctx)
 	if (!virtio_pg_ref_count) {
 		free(virtio_pg_usage);
 		virtio_pg_usage = NULL;
+		free(virtio_pg_load);
+		virtio_pg_load = NULL;
+		snap_pg_idle_free_all();
 	}
 }
 
@@ -40,13 +136,20 @@ int snap_pgs_alloc(struct snap_pg_ctx *ctx, int npgs)
 	int i;
 
 	ctx->npgs = 0;
-	ctx->pgs = calloc(npgs, sizeof(struct snap_pg));
-	if (!ctx->pgs)
+	if (posix_memalign((void **)&ctx->pgs, SNAP_CACHE_LINE_SIZE,
+			   npgs * sizeof(struct snap_pg)))
 		return -1;
+	memset(ctx->pgs, 0, npgs * sizeof(struct snap_pg));
 
 	if (!virtio_pg_usage) {
 		virtio_pg_usage = calloc(npgs, sizeof(*virtio_pg_usage));
-		if (!virtio_pg_usage) {
+		virtio_pg_load = calloc(npgs, sizeof(*virtio_pg_load));
+		if (!virtio_pg_usage || !virtio_pg_load ||
+		    snap_pg_idle_alloc_all(npgs)) {
+			free(virtio_pg_usage);
+			virtio_pg_usage = NULL;
+			free(virtio_pg_load);
+			virtio_pg_load = NULL;
 			free(ctx->pgs);
 			return -1;
 		}
@@ -55,9 +158,19 @@ int snap_pgs_alloc(struct snap_pg_ctx *ctx, int npgs)
 	virtio_pg_ref_count++;
 
 	ctx->npgs = npgs;
+	ctx->migrating = 0;
+	ctx->migrations = 0;
+	ctx->steal = false;
 	for (i = 0; i < npgs; i++) {
 		pthread_spin_init(&ctx->pgs[i].lock, PTHREAD_PROCESS_PRIVATE);
+		pthread_spin_init(&ctx->pgs[i].steal_lock, PTHREAD_PROCESS_PRIVATE);
 		TAILQ_INIT(&ctx->pgs[i].q_list);
+		ctx->pgs[i].id = i;
+		ctx->pgs[i].ctx = ctx;
+		ctx->pgs[i].idle = &virtio_pg_idle[i];
+		pthread_mutex_lock(&ctx->pgs[i].idle->lock);
+		TAILQ_INSERT_TAIL(&ctx->pgs[i].idle->pgs, &ctx->pgs[i], idle_entry);
+		pthread_mutex_unlock(&ctx->pgs[i].idle->lock);
 	}
 	return 0;
 }
@@ -67,7 +180,7 @@ void snap_pgs_suspend(struct snap_pg_ctx *ctx)
 	int i;
 
 	for (i = 0; i < ctx->npgs; i++)
-		pthread_spin_lock(&ctx->pgs[i].lock);
+		snap_pg_suspend(&ctx->pgs[i]);
 }
 
 void snap_pgs_resume(struct snap_pg_ctx *ctx)
@@ -75,7 +188,91 @@ void snap_pgs_resume(struct snap_pg_ctx *ctx)
 	int i;
 
 	for (i = ctx->npgs - 1; i >= 0; i--)
-		pthread_spin_unlock(&ctx->pgs[i].lock);
+		snap_pg_resume(&ctx->pgs[i]);
+}
+
+/* writers spin less than the poll group thread, they are not latency bound */
+static void snap_pg_writer_lock(struct snap_pg *pg)
+{
+	unsigned int i;
+
+	for (i = 1; pthread_spin_trylock(&pg->lock); i++)
+		if (i % SNAP_PG_WRITER_SPINS == 0)
+			sched_yield();
+}
+
+/**
+ * snap_pg_suspend() - hold a poll group
+ * @pg:		poll group
+ *
+ * Once the function returns the poll group thread does not progress the
+ * queues of @pg until snap_pg_resume(), so the caller can change the
+ * queue list and call the queue functions that are not thread safe with
+ * regard to the queue progress.
+ *
+ * If the poll group thread is online the function waits for it to pass a
+ * quiescent point, it must keep polling or go offline. Threads that steal
+ * from the queues of @pg are waited for as well.
+ */
+void snap_pg_suspend(struct snap_pg *pg)
+{
+	uint64_t token;
+
+	snap_pg_writer_lock(pg);
+	pthread_spin_lock(&pg->steal_lock);
+	/* either the thread sees @paused or it is seen online, as in
+	 * snap_pg_online()
+	 */
+	__atomic_store_n(&pg->paused, true, __ATOMIC_SEQ_CST);
+	token = __atomic_load_n(&pg->token, __ATOMIC_RELAXED) + 1;
+	__atomic_store_n(&pg->token, token, __ATOMIC_RELEASE);
+
+	if (!__atomic_load_n(&pg->online, __ATOMIC_SEQ_CST) ||
+	    pthread_equal(pg->poller, pthread_self()))
+		return;
+
+	/* the thread may sleep past its quiescent point */
+	snap_pg_idle_kick(pg->idle);
+
+	/* a pass that started before @paused was seen ends with the old token */
+	while (__atomic_load_n(&pg->online, __ATOMIC_ACQUIRE) &&
+	       __atomic_load_n(&pg->qs, __ATOMIC_ACQUIRE) < token)
+		sched_yield();
+}
+
+void snap_pg_resume(struct snap_pg *pg)
+{
+	__atomic_store_n(&pg->paused, false, __ATOMIC_RELEASE);
+	pthread_spin_unlock(&pg->steal_lock);
+	pthread_spin_unlock(&pg->lock);
+}
+
+/**
+ * snap_pg_online() - poll a poll group without the group lock
+ * @pg:		poll group
+ *
+ * Called by the poll group thread, between passes. Until snap_pg_offline()
+ * the thread must keep calling snap_pg_poll_begin() and snap_pg_poll_end(),
+ * writers wait for it in snap_pg_suspend().
+ */
+void snap_pg_online(struct snap_pg *pg)
+{
+	pg->poller = pthread_self();
+	/* a writer either sees the thread online or the thread sees @paused */
+	__atomic_store_n(&pg->online, true, __ATOMIC_SEQ_CST);
+	(void)__atomic_load_n(&pg->paused, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * snap_pg_offline() - go back to polling with the group lock
+ * @pg:		poll group
+ *
+ * Called by the poll group thread, between passes, before it stops
+ * polling the group.
+ */
+void snap_pg_offline(struct snap_pg *pg)
+{
+	__atomic_store_n(&pg->online, false, __ATOMIC_RELEASE);
 }
 
 struct snap_pg *snap_pg_get_next(struct snap_pg_ctx *ctx)
@@ -97,3 +294,448 @@ void snap_pg_usage_decrease(size_t pg_index)
 {
 	virtio_pg_usage[pg_index]--;
 }
+
+/**
+ * snap_pgs_set_rebalance() - set poll group rebalancing policy
+ * @ctx:	poll groups
+ * @attr:	policy, a zero period disables rebalancing
+ *
+ * Context: the poll groups must be suspended
+ */
+void snap_pgs_set_rebalance(struct snap_pg_ctx *ctx,
+			    const struct snap_pg_rebalance_attr *attr)
+{
+	ctx->rebalance = *attr;
+	ctx->last_sample = 0;
+}
+
+void snap_pg_q_account(struct snap_pg *pg, struct snap_pg_q_entry *q,
+		       uint64_t busy, uint64_t work)
+{
+	q->load.busy += busy;
+	q->load.work += work;
+	/* other controllers account the same thread from the same thread */
+	virtio_pg_load[pg->id].busy += busy;
+	virtio_pg_load[pg->id].work += work;
+}
+
+static void snap_pg_load_sample(struct snap_pg_load *load)
+{
+	int w = load->win;
+
+	load->win_busy[w] = load->busy - load->sampled_busy;
+	load->win_work[w] = load->work - load->sampled_work;
+	load->sampled_busy = load->busy;
+	load->sampled_work = load->work;
+	load->win = (w + 1) % SNAP_PG_LOAD_WINDOWS;
+}
+
+uint64_t snap_pg_load_busy(const struct snap_pg_load *load)
+{
+	uint64_t busy = 0;
+	int i;
+
+	for (i = 0; i < SNAP_PG_LOAD_WINDOWS; i++)
+		busy += load->win_busy[i];
+	return busy;
+}
+
+uint64_t snap_pg_load_work(const struct snap_pg_load *load)
+{
+	uint64_t work = 0;
+	int i;
+
+	for (i = 0; i < SNAP_PG_LOAD_WINDOWS; i++)
+		work += load->win_work[i];
+	return work;
+}
+
+/* move the window of @q from @from to @to, the windows are sampled together */
+static void snap_pg_load_move(struct snap_pg_load *from,
+			      struct snap_pg_load *to,
+			      const struct snap_pg_load *q)
+{
+	uint64_t n;
+	int i;
+
+	for (i = 0; i < SNAP_PG_LOAD_WINDOWS; i++) {
+		n = snap_min(q->win_busy[i], from->win_busy[i]);
+		from->win_busy[i] -= n;
+		to->win_busy[i] += n;
+		n = snap_min(q->win_work[i], from->win_work[i]);
+		from->win_work[i] -= n;
+		to->win_work[i] += n;
+	}
+}
+
+/**
+ * snap_pgs_sample() - sample the load windows
+ * @ctx:	poll groups
+ * @now:	current clock, in snap_qos_ticks()
+ *
+ * Closes a sample period once per rebalance period. The first call only
+ * starts the first period.
+ *
+ * Context: the poll groups must be suspended
+ *
+ * Return: true if a sample period was closed
+ */
+bool snap_pgs_sample(struct snap_pg_ctx *ctx, uint64_t now)
+{
+	struct snap_pg_q_entry *q;
+	struct snap_pg *pg;
+	bool prime = !ctx->last_sample;
+	int i;
+
+	if (!snap_pgs_sample_due(ctx, now))
+		return false;
+
+	ctx->last_sample = now;
+	for (i = 0; i < ctx->npgs; i++) {
+		pg = &ctx->pgs[i];
+		pg->load.busy = virtio_pg_load[i].busy;
+		pg->load.work = virtio_pg_load[i].work;
+		if (prime) {
+			pg->load.sampled_busy = pg->load.busy;
+			pg->load.sampled_work = pg->load.work;
+		} else {
+			snap_pg_load_sample(&pg->load);
+		}
+		TAILQ_FOREACH(q, &pg->q_list, entry) {
+			if (prime) {
+				q->load.sampled_busy = q->load.busy;
+				q->load.sampled_work = q->load.work;
+				continue;
+			}
+			snap_pg_load_sample(&q->load);
+			if (q->cooldown)
+				q->cooldown--;
+		}
+	}
+
+	return !prime;
+}
+
+static struct snap_pg_q_entry *
+snap_pg_rebalance_pick(struct snap_pg_ctx *ctx, struct snap_pg *src,
+		       uint64_t src_busy, uint64_t dst_busy)
+{
+	struct snap_pg_q_entry *q, *best = NULL;
+	uint64_t busy, new_max, best_gain;
+
+	/* a move must pay for itself */
+	best_gain = ctx->rebalance.cost;
+	TAILQ_FOREACH(q, &src->q_list, entry) {
+		if (q->migrate_to || q->cooldown)
+			continue;
+
+		busy = snap_pg_load_busy(&q->load);
+		if (!busy || busy > src_busy)
+			continue;
+
+		new_max = snap_max(src_busy - busy, dst_busy + busy);
+		if (new_max < src_busy && src_busy - new_max > best_gain) {
+			best = q;
+			best_gain = src_busy - new_max;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * snap_pgs_rebalance() - choose queues to move between poll groups
+ * @ctx:	poll groups
+ *
+ * Queues of the busiest poll group are moved to the least busy one while
+ * the load difference is above the imbalance threshold, the move lowers
+ * the busiest group load by more than the migration cost and the budget
+ * of migrations allows it. The chosen queues get their migrate_to set, the
+ * caller drains them, moves them to the new group and calls
+ * snap_pg_q_migrated(). Nothing is chosen while migrations are in flight.
+ *
+ * The load windows of the groups are updated as if the queues had already
+ * moved, so they do not look movable again once the move is done.
+ *
+ * Context: the poll groups must be suspended
+ *
+ * Return: number of queues chosen
+ */
+int snap_pgs_rebalance(struct snap_pg_ctx *ctx)
+{
+	const struct snap_pg_rebalance_attr *attr = &ctx->rebalance;
+	struct snap_pg *src, *dst, *pg;
+	struct snap_pg_q_entry *q;
+	uint64_t src_busy, dst_busy, busy;
+	int i, n = 0;
+
+	if (ctx->npgs < 2 || ctx->migrating || !attr->period)
+		return 0;
+
+	while (n < attr->max_migrations) {
+		src = dst = &ctx->pgs[0];
+		src_busy = dst_busy = snap_pg_load_busy(&src->load);
+		for (i = 1; i < ctx->npgs; i++) {
+			pg = &ctx->pgs[i];
+			busy = snap_pg_load_busy(&pg->load);
+			if (busy > src_busy) {
+				src = pg;
+				src_busy = busy;
+			}
+			if (busy < dst_busy) {
+				dst = pg;
+				dst_busy = busy;
+			}
+		}
+
+		if (src_busy * 100 <= (uint64_t)attr->min_busy * attr->period *
+				      SNAP_PG_LOAD_WINDOWS)
+			break;
+		if ((src_busy - dst_busy) * 100 <= (uint64_t)attr->imbalance * src_busy)
+			break;
+
+		q = snap_pg_rebalance_pick(ctx, src, src_busy, dst_busy);
+		if (!q)
+			break;
+
+		q->migrate_to = dst;
+		snap_pg_load_move(&src->load, &dst->load, &q->load);
+		ctx->migrating++;
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * snap_pg_q_migrated() - finish a queue move
+ * @ctx:	poll groups
+ * @q:		queue, already in the q_list of its migrate_to group
+ *
+ * Context: the poll groups must be suspended
+ */
+void snap_pg_q_migrated(struct snap_pg_ctx *ctx, struct snap_pg_q_entry *q)
+{
+	virtio_pg_usage[q->migrate_to->id]++;
+	q->migrate_to = NULL;
+	q->cooldown = ctx->rebalance.cooldown;
+	ctx->migrating--;
+	ctx->migrations++;
+}
+
+/**
+ * snap_pg_q_migration_cancel() - cancel a queue move
+ * @ctx:	poll groups
+ * @q:		queue
+ *
+ * Context: the poll groups must be suspended
+ */
+void snap_pg_q_migration_cancel(struct snap_pg_ctx *ctx,
+				struct snap_pg_q_entry *q)
+{
+	if (!q->migrate_to)
+		return;
+
+	q->migrate_to = NULL;
+	ctx->migrating--;
+}
+
+/**
+ * snap_pgs_set_idle() - set the idle policy of the poll group threads
+ * @ctx:	poll groups
+ * @attr:	policy, a zero spin keeps the threads polling
+ *
+ * The policy belongs to the threads, so it is shared with the other
+ * controllers they progress. Sleeping threads are woken up to apply it.
+ */
+void snap_pgs_set_idle(struct snap_pg_ctx *ctx,
+		       const struct snap_pg_idle_attr *attr)
+{
+	struct snap_pg_idle *idle;
+	int i;
+
+	for (i = 0; i < ctx->npgs; i++) {
+		idle = ctx->pgs[i].idle;
+		pthread_mutex_lock(&idle->lock);
+		idle->attr = *attr;
+		idle->attr.spin = snap_max(attr->spin, 0);
+		idle->attr.max_spin = snap_max(attr->max_spin, idle->attr.spin);
+		__atomic_store_n(&idle->spin, idle->attr.spin, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&idle->lock);
+		snap_pg_idle_kick(idle);
+	}
+}
+
+/**
+ * snap_pg_idle_add_fd() - add a notification source of a queue
+ * @idle:	idle state of the thread that progresses the queue
+ * @fd:		file descriptor that becomes readable when the queue has work
+ *
+ * Events are consumed by the q_arm callback of the queue, before the
+ * thread sleeps.
+ *
+ * Return: 0 on success, -errno otherwise
+ */
+int snap_pg_idle_add_fd(struct snap_pg_idle *idle, int fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+
+	if (epoll_ctl(idle->epfd, EPOLL_CTL_ADD, fd, &ev))
+		return -errno;
+	return 0;
+}
+
+void snap_pg_idle_del_fd(struct snap_pg_idle *idle, int fd)
+{
+	/* a closed fd is already gone */
+	epoll_ctl(idle->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/**
+ * snap_pg_idle_kick() - wake up a poll group thread
+ * @idle:	idle state of the thread
+ *
+ * A thread that does not sleep returns at once from its next sleep.
+ */
+void snap_pg_idle_kick(struct snap_pg_idle *idle)
+{
+	uint64_t one = 1;
+
+	/* fails only if the counter overflows, the thread is awake then */
+	if (write(idle->kick_fd, &one, sizeof(one)) != sizeof(one))
+		snap_debug("kick of a poll group thread failed\n");
+}
+
+static void snap_pg_idle_unkick(struct snap_pg_idle *idle)
+{
+	uint64_t val;
+	ssize_t ret;
+
+	/* the counter is empty if the kick was consumed already */
+	ret = read(idle->kick_fd, &val, sizeof(val));
+	(void)ret;
+}
+
+/*
+ * Arms the queues of all groups of the thread. A queue drains its
+ * notifications, arms them and checks for work once more, so work that
+ * comes after the check wakes the thread up.
+ */
+static int snap_pg_idle_arm(struct snap_pg_idle *idle)
+{
+	struct snap_pg_q_entry *q;
+	struct snap_pg *pg;
+	int ret = 0;
+
+	TAILQ_FOREACH(pg, &idle->pgs, idle_entry) {
+		if (TAILQ_EMPTY(&pg->q_list))
+			continue;
+		/* progressed by another thread */
+		if (__atomic_load_n(&pg->online, __ATOMIC_RELAXED) &&
+		    !pthread_equal(pg->poller, pthread_self()))
+			return -EBUSY;
+		if (!pg->ctx->q_arm)
+			return -ENOTSUP;
+
+		if (snap_pg_poll_begin(pg)) {
+			TAILQ_FOREACH(q, &pg->q_list, entry) {
+				ret = pg->ctx->q_arm(q);
+				if (ret)
+					break;
+			}
+		} else {
+			/* a writer changes the queues */
+			ret = -EBUSY;
+		}
+		snap_pg_poll_end(pg);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static uint64_t snap_pg_idle_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * snap_pg_idle_sleep() - sleep until a queue of the thread has work
+ * @idle:	idle state of the thread
+ *
+ * Called by the poll group thread when snap_pg_idle_pass() tells it to.
+ * If all queues of the thread can notify it and none of them has work,
+ * the thread sleeps until a notification, a kick or the end of the
+ * longest sleep. Otherwise it keeps polling for another spin.
+ *
+ * Return: number of notifications that woke up the thread
+ */
+int snap_pg_idle_sleep(struct snap_pg_idle *idle)
+{
+	struct epoll_event evs[SNAP_PG_IDLE_EVENTS];
+	uint64_t start;
+	int i, n, ret, timeout;
+
+	idle->empty = 0;
+	pthread_mutex_lock(&idle->lock);
+	timeout = idle->attr.max_sleep_ms;
+	ret = snap_pg_idle_arm(idle);
+	pthread_mutex_unlock(&idle->lock);
+	if (ret) {
+		idle->refused++;
+		return 0;
+	}
+
+	start = snap_pg_idle_clock_ns();
+	n = epoll_wait(idle->epfd, evs, SNAP_PG_IDLE_EVENTS, timeout);
+	for (i = 0, ret = 0; i < n; i++) {
+		if (evs[i].data.fd == idle->kick_fd)
+			snap_pg_idle_unkick(idle);
+		else
+			ret++;
+	}
+
+	/* a signal is not a timeout */
+	snap_pg_idle_woke(idle, snap_pg_idle_clock_ns() - start, n == 0);
+	return ret;
+}
+
+/**
+ * snap_pg_idle_woke() - adapt the spin to the length of a sleep
+ * @idle:	idle state of the thread
+ * @slept_ns:	length of the sleep
+ * @timed_out:	the sleep was not ended by activity
+ *
+ * Called by snap_pg_idle_sleep(). A short sleep cost the wake-up latency
+ * and saved little, so the thread spins twice as long before the next one.
+ */
+void snap_pg_idle_woke(struct snap_pg_idle *idle, uint64_t slept_ns,
+		       bool timed_out)
+{
+	int spin;
+
+	pthread_mutex_lock(&idle->lock);
+	idle->sleeps++;
+	idle->slept_ns += slept_ns;
+	if (timed_out)
+		idle->timeouts++;
+
+	spin = idle->spin;
+	if (!spin)
+		goto out;
+
+	if (!timed_out &&
+	    slept_ns < (uint64_t)idle->attr.short_sleep_us * 1000) {
+		idle->short_sleeps++;
+		spin = snap_min(spin, idle->attr.max_spin / 2) * 2;
+		spin = snap_max(spin, idle->spin);
+	} else {
+		spin = snap_max(spin / 2, idle->attr.spin);
+	}
+	__atomic_store_n(&idle->spin, spin, __ATOMIC_RELAXED);
+out:
+	pthread_mutex_unlock(&idle->lock);
+}
@@ -13,31 +13,330 @@
 #ifndef _SNAP_POLL_GROUPS_H
 #define _SNAP_POLL_GROUPS_H
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <pthread.h>
 #include <sys/queue.h>
+#include "snap_macros.h"
 
+/* number of sample periods in the load sliding window */
+#define SNAP_PG_LOAD_WINDOWS 4
+
+/**
+ * struct snap_pg_load - work done over a sliding window
+ * @busy:	busy ticks, cumulative
+ * @work:	work items, e.g. commands, cumulative
+ * @sampled_busy: @busy at the last sample
+ * @sampled_work: @work at the last sample
+ * @win_busy:	busy ticks of each of the last sample periods
+ * @win_work:	work items of each of the last sample periods
+ * @win:	slot of the next sample
+ *
+ * The counters are written by the poll group thread, the windows by the
+ * thread that samples them.
+ */
+struct snap_pg_load {
+	uint64_t busy;
+	uint64_t work;
+	uint64_t sampled_busy;
+	uint64_t sampled_work;
+	uint64_t win_busy[SNAP_PG_LOAD_WINDOWS];
+	uint64_t win_work[SNAP_PG_LOAD_WINDOWS];
+	int win;
+};
+
+struct snap_pg;
+struct snap_pg_ctx;
+
+/**
+ * struct snap_pg_idle_attr - idle policy of a poll group thread
+ * @spin:	empty passes over the queues before the thread sleeps, 0 keeps
+ *		it polling
+ * @max_spin:	limit of the empty passes before a sleep
+ * @max_sleep_ms: longest sleep, the thread polls again when it expires
+ * @short_sleep_us: a sleep ended by activity sooner than that was not
+ *		worth it, the thread polls twice as many empty passes before
+ *		the next one, up to @max_spin. A longer sleep halves them, down
+ *		to @spin.
+ *
+ * Lower @spin and @max_spin save cpu time and add the wake-up latency of
+ * the thread to more commands.
+ */
+struct snap_pg_idle_attr {
+	int spin;
+	int max_spin;
+	int max_sleep_ms;
+	int short_sleep_us;
+};
+
+/**
+ * struct snap_pg_idle - idle state of a poll group thread
+ * @lock:	protects @attr, @spin updates and @pgs
+ * @attr:	policy
+ * @pgs:	poll groups progressed by the thread, one per controller
+ * @epfd:	epoll of the notification sources of the queues
+ * @kick_fd:	eventfd that wakes the thread
+ * @spin:	empty passes before the next sleep
+ * @empty:	empty passes in a row
+ * @sleeps:	sleeps
+ * @timeouts:	sleeps that lasted @attr.max_sleep_ms
+ * @short_sleeps: sleeps ended by activity before @attr.short_sleep_us
+ * @refused:	sleeps not taken because a queue had work in flight or
+ *		could not notify the thread
+ * @slept_ns:	time spent sleeping
+ *
+ * Poll groups with the same id of all controllers are progressed by the
+ * same thread, so they share the idle state. Except for @attr and @pgs the
+ * fields are written by the thread only.
+ */
+struct snap_pg_idle {
+	pthread_mutex_t lock;
+	struct snap_pg_idle_attr attr;
+	TAILQ_HEAD(, snap_pg) pgs;
+	int epfd;
+	int kick_fd;
+	int spin;
+	int empty;
+	uint64_t sleeps;
+	uint64_t timeouts;
+	uint64_t short_sleeps;
+	uint64_t refused;
+	uint64_t slept_ns;
+} SNAP_CACHE_ALIGNED;
+
+/**
+ * struct snap_pg_q_entry - queue in a poll group
+ * @entry:	entry in the q_list of the poll group
+ * @load:	work of the queue
+ * @migrate_to:	poll group the queue is moving to, NULL if it does not move
+ * @cooldown:	sample periods before the queue can move again
+ */
 struct snap_pg_q_entry {
 	TAILQ_ENTRY(snap_pg_q_entry) entry;
+	struct snap_pg_load load;
+	struct snap_pg *migrate_to;
+	int cooldown;
 };
 
+/**
+ * struct snap_pg - poll group
+ * @id:		poll group id
+ * @q_list:	queues progressed by the group
+ * @lock:	protects @q_list, taken by the writers and by a poll group
+ *		thread that is not online
+ * @now:	snap_qos_ticks() sampled at the start of each pass over the
+ *		queues, the clock of the queues QoS and of the load accounting
+ * @load:	work of the poll group thread, including the queues of other
+ *		controllers that share it
+ * @online:	the poll group thread polls without taking @lock
+ * @poller:	the poll group thread, valid while @online
+ * @qs:		value of @token at the last quiescent point of the poll group
+ *		thread, the end of a pass over the queues
+ * @ctx:	poll groups of the controller
+ * @idle:	idle state of the poll group thread
+ * @idle_entry:	entry in the pgs list of @idle
+ * @paused:	a writer holds the group, the queues must not be progressed
+ * @token:	incremented by each writer
+ * @steal_lock:	held by the writers and by a thread that takes work from
+ *		the queues of the group, see snap_pg_steal_begin()
+ *
+ * The fields written by the poll group thread and by the writers are kept
+ * in separate cachelines.
+ */
 struct snap_pg {
 	int id;
 
 	TAILQ_HEAD(, snap_pg_q_entry) q_list;
 	pthread_spinlock_t lock;
+	uint64_t now;
+	struct snap_pg_load load;
+	bool online;
+	pthread_t poller;
+	uint64_t qs;
+	struct snap_pg_ctx *ctx;
+	struct snap_pg_idle *idle;
+	TAILQ_ENTRY(snap_pg) idle_entry;
+
+	bool paused SNAP_CACHE_ALIGNED;
+	uint64_t token;
+	pthread_spinlock_t steal_lock;
+} SNAP_CACHE_ALIGNED;
+
+/**
+ * struct snap_pg_rebalance_attr - poll group rebalancing policy
+ * @period:	ticks between load samples, 0 disables rebalancing
+ * @imbalance:	queues are moved when the load of the least busy group is
+ *		below the load of the busiest one by more than @imbalance
+ *		percent of it
+ * @min_busy:	percent of the time the busiest group must be busy, a light
+ *		load is not worth a migration
+ * @cost:	busy ticks a migration is expected to cost, a queue is moved
+ *		only if the busiest group load goes down by more than @cost
+ *		over the window
+ * @max_migrations: queues moved at once
+ * @cooldown:	sample periods a moved queue stays in its new group
+ */
+struct snap_pg_rebalance_attr {
+	uint64_t period;
+	int imbalance;
+	int min_busy;
+	uint64_t cost;
+	int max_migrations;
+	int cooldown;
 };
 
 struct snap_pg_ctx {
     /* Polling groups */
 	struct snap_pg *pgs;
 	int npgs;
+	/* Load balancing */
+	struct snap_pg_rebalance_attr rebalance;
+	uint64_t last_sample;
+	int migrating;
+	uint64_t migrations;
+	/* Idle policy, returns 0 if the queue can notify and has no work */
+	int (*q_arm)(struct snap_pg_q_entry *q);
+	/* Idle threads take work from the queues of the other groups */
+	bool steal;
 };
 
 void snap_pgs_free(struct snap_pg_ctx *ctx);
 int snap_pgs_alloc(struct snap_pg_ctx *ctx, int nthreads);
 void snap_pgs_suspend(struct snap_pg_ctx *ctx);
 void snap_pgs_resume(struct snap_pg_ctx *ctx);
+void snap_pg_suspend(struct snap_pg *pg);
+void snap_pg_resume(struct snap_pg *pg);
+void snap_pg_online(struct snap_pg *pg);
+void snap_pg_offline(struct snap_pg *pg);
 struct snap_pg *snap_pg_get_next(struct snap_pg_ctx *ctx);
 void snap_pg_usage_decrease(size_t pg_index);
 
+void snap_pgs_set_rebalance(struct snap_pg_ctx *ctx,
+			    const struct snap_pg_rebalance_attr *attr);
+bool snap_pgs_sample(struct snap_pg_ctx *ctx, uint64_t now);
+int snap_pgs_rebalance(struct snap_pg_ctx *ctx);
+void snap_pg_q_migrated(struct snap_pg_ctx *ctx, struct snap_pg_q_entry *q);
+void snap_pg_q_migration_cancel(struct snap_pg_ctx *ctx,
+				struct snap_pg_q_entry *q);
+uint64_t snap_pg_load_busy(const struct snap_pg_load *load);
+uint64_t snap_pg_load_work(const struct snap_pg_load *load);
+
+void snap_pgs_set_idle(struct snap_pg_ctx *ctx,
+		       const struct snap_pg_idle_attr *attr);
+int snap_pg_idle_add_fd(struct snap_pg_idle *idle, int fd);
+void snap_pg_idle_del_fd(struct snap_pg_idle *idle, int fd);
+void snap_pg_idle_kick(struct snap_pg_idle *idle);
+int snap_pg_idle_sleep(struct snap_pg_idle *idle);
+void snap_pg_idle_woke(struct snap_pg_idle *idle, uint64_t slept_ns,
+		       bool timed_out);
+
+/**
+ * snap_pg_poll_begin() - start a pass over the queues of a poll group
+ * @pg:		poll group
+ *
+ * A thread that is online takes neither the group lock nor any atomic
+ * read-modify-write, it only checks that no writer holds the group. A
+ * thread that is not online takes the group lock.
+ *
+ * snap_pg_poll_end() must be called after the pass, even if the queues
+ * were not progressed.
+ *
+ * Return: true if the queues of @pg can be progressed
+ */
+static inline bool snap_pg_poll_begin(struct snap_pg *pg)
+{
+	if (!__atomic_load_n(&pg->online, __ATOMIC_RELAXED)) {
+		pthread_spin_lock(&pg->lock);
+		return true;
+	}
+
+	return !__atomic_load_n(&pg->paused, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * snap_pg_poll_end() - finish a pass over the queues of a poll group
+ * @pg:		poll group
+ *
+ * The end of a pass is the quiescent point of an online thread: it does
+ * not use the queues of @pg until the next snap_pg_poll_begin().
+ */
+static inline void snap_pg_poll_end(struct snap_pg *pg)
+{
+	if (!__atomic_load_n(&pg->online, __ATOMIC_RELAXED)) {
+		pthread_spin_unlock(&pg->lock);
+		return;
+	}
+
+	__atomic_store_n(&pg->qs, __atomic_load_n(&pg->token, __ATOMIC_ACQUIRE),
+			 __ATOMIC_RELEASE);
+}
+
+/**
+ * snap_pg_steal_begin() - start taking work from the queues of a poll group
+ * @pg:		poll group of another thread
+ *
+ * While it succeeds the queue list of @pg does not change and its queues
+ * are not destroyed, but they are progressed by their poll group thread
+ * concurrently, so only the parts of a queue made for other threads can
+ * be used. The attempt fails rather than waits for a writer or for another
+ * thread that steals.
+ *
+ * Return: true if snap_pg_steal_end() must be called
+ */
+static inline bool snap_pg_steal_begin(struct snap_pg *pg)
+{
+	return !pthread_spin_trylock(&pg->steal_lock);
+}
+
+static inline void snap_pg_steal_end(struct snap_pg *pg)
+{
+	pthread_spin_unlock(&pg->steal_lock);
+}
+
+/**
+ * snap_pg_idle_pass() - count a pass of the poll group thread
+ * @idle:	idle state of the thread
+ * @n:		work done by the pass
+ *
+ * Return: true if the thread should call snap_pg_idle_sleep()
+ */
+static inline bool snap_pg_idle_pass(struct snap_pg_idle *idle, int n)
+{
+	int spin;
+
+	if (n > 0) {
+		idle->empty = 0;
+		return false;
+	}
+
+	spin = __atomic_load_n(&idle->spin, __ATOMIC_RELAXED);
+	return spin && ++idle->empty >= spin;
+}
+
+/* true if the poll group threads should account the work of the queues */
+static inline bool snap_pgs_rebalance_enabled(const struct snap_pg_ctx *ctx)
+{
+	return ctx->rebalance.period != 0;
+}
+
+/* true if snap_pgs_sample() would close or start a sample period */
+static inline bool snap_pgs_sample_due(const struct snap_pg_ctx *ctx,
+				       uint64_t now)
+{
+	return !ctx->last_sample ||
+	       now - ctx->last_sample >= ctx->rebalance.period;
+}
+
+/**
+ * snap_pg_q_account() - account work of a queue
+ * @pg:		poll group of the queue
+ * @q:		queue
+ * @busy:	ticks spent progressing the queue
+ * @work:	work items done
+ *
+ * Context: called by the poll group thread, with the poll group locked
+ */
+void snap_pg_q_account(struct snap_pg *pg, struct snap_pg_q_entry *q,
+		       uint64_t busy, uint64_t work);
+
 #endif
@@ -0,0 +1,312 @@
+/*
+ * Copyright © 2021 NVIDIA CORPORATION & AFFILIATES. ALL RIGHTS RESERVED.
+ *
+ * This software product is a proprietary product of Nvidia Corporation and its affiliates
+ * (the "Company") and all right, title, and interest in and to the software
+ * product, including all associated intellectual property rights, are and
+ * shall remain exclusively with the Company.
+ *
+ * This software product is governed by the End User License Agreement
+ * provided with the software product.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "snap_qos.h"
+#include "snap_macros.h"
+
+/* default burst is 1/SNAP_QOS_BURST_DIV of a second */
+#define SNAP_QOS_BURST_DIV 10
+/* duration of the clock calibration */
+#define SNAP_QOS_CALIBRATE_NS 10000000ULL
+
+static void snap_qos_bucket_set(struct snap_qos_bucket *b, uint64_t rate,
+				uint64_t burst)
+{
+	b->rate = rate;
+	if (!rate) {
+		b->burst = b->tokens = 0;
+		b->frac = 0;
+		return;
+	}
+
+	if (!burst)
+		burst = snap_max(rate / SNAP_QOS_BURST_DIV, 1);
+	b->burst = snap_min(burst, (uint64_t)INT64_MAX);
+	/* a new limit starts with a full bucket */
+	b->tokens = b->burst;
+	b->frac = 0;
+}
+
+static void snap_qos_bucket_refill(struct snap_qos_bucket *b, uint64_t ticks,
+				   uint64_t ticks_hz)
+{
+	unsigned __int128 add;
+	uint64_t n;
+
+	if (!b->rate || b->tokens >= b->burst)
+		return;
+
+	add = (unsigned __int128)ticks * b->rate + b->frac;
+	if (add / ticks_hz >= (uint64_t)(b->burst - b->tokens)) {
+		b->tokens = b->burst;
+		b->frac = 0;
+		return;
+	}
+
+	n = add / ticks_hz;
+	b->tokens += n;
+	b->frac = add % ticks_hz;
+}
+
+/*
+ * A command larger than the bucket is admitted when the bucket is full and
+ * leaves it in debt, so that it is not blocked forever and the long term
+ * rate is still kept.
+ */
+static inline bool snap_qos_bucket_has(const struct snap_qos_bucket *b,
+				       uint64_t n)
+{
+	return !b->rate || b->tokens >= (int64_t)snap_min(n, (uint64_t)b->burst);
+}
+
+static inline void snap_qos_bucket_take(struct snap_qos_bucket *b, uint64_t n)
+{
+	if (b->rate)
+		b->tokens -= snap_min(n, (uint64_t)INT64_MAX);
+}
+
+static void snap_qos_refill(struct snap_qos *qos, uint64_t now)
+{
+	/* the clock of another poll group can be slightly behind */
+	if ((int64_t)(now - qos->last) <= 0)
+		return;
+
+	snap_qos_bucket_refill(&qos->iops, now - qos->last, qos->ticks_hz);
+	snap_qos_bucket_refill(&qos->bps, now - qos->last, qos->ticks_hz);
+	qos->last = now;
+}
+
+static inline bool snap_qos_has(const struct snap_qos *qos, uint64_t bytes)
+{
+	return snap_qos_bucket_has(&qos->iops, 1) &&
+	       snap_qos_bucket_has(&qos->bps, bytes);
+}
+
+static inline void snap_qos_take(struct snap_qos *qos, uint64_t bytes)
+{
+	snap_qos_bucket_take(&qos->iops, 1);
+	snap_qos_bucket_take(&qos->bps, bytes);
+}
+
+static void snap_qos_leave_parent(struct snap_qos *qos)
+{
+	if (!qos->waiting)
+		return;
+
+	TAILQ_REMOVE(&qos->parent->waiters, qos, entry);
+	qos->waiting = false;
+}
+
+/**
+ * snap_qos_init() - initialize QoS object
+ * @qos:	object to initialize
+ * @parent:	object with the limits shared by @qos and its siblings, or NULL
+ * @ticks_hz:	frequency of the clock given to snap_qos_admit()
+ *
+ * The object starts without limits. The parent must outlive @qos.
+ *
+ * Return: 0 on success, -errno otherwise
+ */
+int snap_qos_init(struct snap_qos *qos, struct snap_qos *parent,
+		  uint64_t ticks_hz)
+{
+	if (!ticks_hz)
+		return -EINVAL;
+
+	memset(qos, 0, sizeof(*qos));
+	if (pthread_spin_init(&qos->lock, PTHREAD_PROCESS_PRIVATE))
+		return -ENOMEM;
+
+	qos->parent = parent;
+	qos->ticks_hz = ticks_hz;
+	TAILQ_INIT(&qos->waiters);
+	return 0;
+}
+
+/**
+ * snap_qos_cancel() - stop waiting for the tokens of the parent
+ * @qos:	object that has no more commands to admit
+ *
+ * An object that failed an admission keeps its turn for the tokens of the
+ * parent, and its siblings wait behind it. The caller must cancel the turn
+ * when it drops the commands it was going to retry, e.g. when its queue
+ * is flushed. A later admission takes a new turn.
+ */
+void snap_qos_cancel(struct snap_qos *qos)
+{
+	if (!qos->parent)
+		return;
+
+	pthread_spin_lock(&qos->parent->lock);
+	snap_qos_leave_parent(qos);
+	pthread_spin_unlock(&qos->parent->lock);
+}
+
+/**
+ * snap_qos_destroy() - destroy QoS object
+ * @qos:	object to destroy
+ *
+ * Children of @qos must be destroyed first.
+ */
+void snap_qos_destroy(struct snap_qos *qos)
+{
+	snap_qos_cancel(qos);
+	pthread_spin_destroy(&qos->lock);
+}
+
+/**
+ * snap_qos_set_limits() - change limits
+ * @qos:	object to change
+ * @limits:	new limits
+ * @now:	current clock
+ *
+ * Buckets start full. The function can be called while other threads
+ * admit commands.
+ */
+void snap_qos_set_limits(struct snap_qos *qos,
+			 const struct snap_qos_limits *limits, uint64_t now)
+{
+	struct snap_qos *child;
+
+	pthread_spin_lock(&qos->lock);
+	qos->limits = *limits;
+	snap_qos_bucket_set(&qos->iops, limits->iops, limits->iops_burst);
+	snap_qos_bucket_set(&qos->bps, limits->bps, limits->bps_burst);
+	qos->last = now;
+	/* children wait again, once they run out of the new tokens */
+	while ((child = TAILQ_FIRST(&qos->waiters))) {
+		TAILQ_REMOVE(&qos->waiters, child, entry);
+		child->waiting = false;
+	}
+	qos->limited = limits->iops || limits->bps;
+	pthread_spin_unlock(&qos->lock);
+}
+
+void snap_qos_get_limits(struct snap_qos *qos, struct snap_qos_limits *limits)
+{
+	pthread_spin_lock(&qos->lock);
+	*limits = qos->limits;
+	pthread_spin_unlock(&qos->lock);
+}
+
+static bool snap_qos_parent_admit(struct snap_qos *qos, uint64_t bytes,
+				  uint64_t now)
+{
+	struct snap_qos *parent = qos->parent;
+	struct snap_qos *first;
+	bool ok;
+
+	pthread_spin_lock(&parent->lock);
+	if (!parent->limited) {
+		pthread_spin_unlock(&parent->lock);
+		return true;
+	}
+
+	snap_qos_refill(parent, now);
+	first = TAILQ_FIRST(&parent->waiters);
+	ok = (!first || first == qos) && snap_qos_has(parent, bytes);
+	if (ok) {
+		snap_qos_take(parent, bytes);
+		snap_qos_leave_parent(qos);
+	} else if (!qos->waiting) {
+		TAILQ_INSERT_TAIL(&parent->waiters, qos, entry);
+		qos->waiting = true;
+	}
+	pthread_spin_unlock(&parent->lock);
+	return ok;
+}
+
+/**
+ * snap_qos_admit() - admit a command
+ * @qos:	object the command belongs to
+ * @bytes:	data length of the command
+ * @now:	current clock
+ *
+ * If the command is admitted its tokens are taken. Otherwise the caller
+ * keeps the command and tries again later, commands of the same object
+ * must be retried in their original order.
+ *
+ * Return: true if the command can be executed
+ */
+bool snap_qos_admit(struct snap_qos *qos, uint64_t bytes, uint64_t now)
+{
+	bool ok;
+
+	if (!snap_qos_is_limited(qos)) {
+		qos->admitted++;
+		return true;
+	}
+
+	pthread_spin_lock(&qos->lock);
+	snap_qos_refill(qos, now);
+	ok = snap_qos_has(qos, bytes);
+	if (ok && qos->parent) {
+		ok = snap_qos_parent_admit(qos, bytes, now);
+	} else if (!ok && qos->waiting) {
+		/* do not hold up the siblings while out of own tokens */
+		snap_qos_cancel(qos);
+	}
+
+	if (ok) {
+		snap_qos_take(qos, bytes);
+		qos->admitted++;
+	} else {
+		qos->throttled++;
+	}
+	pthread_spin_unlock(&qos->lock);
+	return ok;
+}
+
+static uint64_t snap_qos_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * snap_qos_ticks_hz() - frequency of snap_qos_ticks()
+ *
+ * The frequency is read from the generic timer on ARM and measured once
+ * against the monotonic clock elsewhere.
+ *
+ * Return: ticks per second
+ */
+uint64_t snap_qos_ticks_hz(void)
+{
+	static uint64_t ticks_hz;
+	uint64_t t0, ns0, ns;
+
+	if (ticks_hz)
+		return ticks_hz;
+
+#if defined(__aarch64__)
+	__asm__ volatile("mrs %0, cntfrq_el0" : "=r"(ticks_hz));
+#endif
+	if (!ticks_hz) {
+		ns0 = snap_qos_clock_ns();
+		t0 = snap_qos_ticks();
+		do {
+			ns = snap_qos_clock_ns();
+		} while (ns - ns0 < SNAP_QOS_CALIBRATE_NS);
+		ticks_hz = (unsigned __int128)(snap_qos_ticks() - t0) *
+			   1000000000ULL / (ns - ns0);
+	}
+	/* no cycle counter, the QoS clock does not move */
+	if (!ticks_hz)
+		ticks_hz = 1;
+	return ticks_hz;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright © 2021 NVIDIA CORPORATION & AFFILIATES. ALL RIGHTS RESERVED.
+ *
+ * This software product is a proprietary product of Nvidia Corporation and its affiliates
+ * (the "Company") and all right, title, and interest in and to the software
+ * product, including all associated intellectual property rights, are and
+ * shall remain exclusively with the Company.
+ *
+ * This software product is governed by the End User License Agreement
+ * provided with the software product.
+ */
+#ifndef SNAP_QOS_H
+#define SNAP_QOS_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include "snap_dma_stat.h"
+
+/**
+ * struct snap_qos_limits - rate limits
+ * @iops:	commands per second, 0 means unlimited
+ * @iops_burst:	commands that can be admitted at once after an idle period,
+ *		0 means 1/10 of a second worth of @iops
+ * @bps:	bytes per second, 0 means unlimited
+ * @bps_burst:	bytes that can be admitted at once after an idle period,
+ *		0 means 1/10 of a second worth of @bps
+ */
+struct snap_qos_limits {
+	uint64_t iops;
+	uint64_t iops_burst;
+	uint64_t bps;
+	uint64_t bps_burst;
+};
+
+/**
+ * struct snap_qos_bucket - token bucket
+ * @rate:	tokens per second, 0 means unlimited
+ * @burst:	bucket depth
+ * @tokens:	available tokens, negative after a command larger than the
+ *		bucket was admitted
+ * @frac:	fraction of a token, in 1/ticks_hz units
+ */
+struct snap_qos_bucket {
+	uint64_t rate;
+	int64_t burst;
+	int64_t tokens;
+	uint64_t frac;
+};
+
+/**
+ * struct snap_qos - command admission by IOPS and bandwidth limits
+ * @lock:	protects the buckets and the waiters
+ * @parent:	limits shared with other objects, e.g. the controller of a
+ *		queue, NULL if there are none
+ * @limits:	configured limits
+ * @iops:	command bucket
+ * @bps:	byte bucket
+ * @ticks_hz:	clock frequency
+ * @last:	clock of the last refill
+ * @limited:	one of the limits is set
+ * @waiters:	children that wait for tokens of this object, oldest first
+ * @entry:	entry in the @waiters list of the parent
+ * @waiting:	the object is in the @waiters list of the parent
+ * @admitted:	number of admitted commands
+ * @throttled:	number of failed admissions
+ *
+ * Buckets are refilled from the clock passed to snap_qos_admit(), so a
+ * poll loop samples the clock once and all of its queues share it.
+ *
+ * A command is admitted when both buckets of the object and both buckets
+ * of the parent have enough tokens. Tokens of the parent are handed out in
+ * the order children ran out of them, so a child that polls first cannot
+ * starve the others.
+ */
+struct snap_qos {
+	pthread_spinlock_t lock;
+	struct snap_qos *parent;
+	struct snap_qos_limits limits;
+	struct snap_qos_bucket iops;
+	struct snap_qos_bucket bps;
+	uint64_t ticks_hz;
+	uint64_t last;
+	bool limited;
+	TAILQ_HEAD(, snap_qos) waiters;
+	TAILQ_ENTRY(snap_qos) entry;
+	bool waiting;
+	uint64_t admitted;
+	uint64_t throttled;
+};
+
+int snap_qos_init(struct snap_qos *qos, struct snap_qos *parent,
+		  uint64_t ticks_hz);
+void snap_qos_destroy(struct snap_qos *qos);
+void snap_qos_cancel(struct snap_qos *qos);
+void snap_qos_set_limits(struct snap_qos *qos,
+			 const struct snap_qos_limits *limits, uint64_t now);
+void snap_qos_get_limits(struct snap_qos *qos, struct snap_qos_limits *limits);
+bool snap_qos_admit(struct snap_qos *qos, uint64_t bytes, uint64_t now);
+uint64_t snap_qos_ticks_hz(void);
+
+/* clock of the QoS buckets */
+static inline uint64_t snap_qos_ticks(void)
+{
+	return snap_dma_stat_ticks();
+}
+
+/* true if snap_qos_admit() can refuse a command */
+static inline bool snap_qos_is_limited(const struct snap_qos *qos)
+{
+	return qos->limited || (qos->parent && qos->parent->limited);
+}
+
+#endif
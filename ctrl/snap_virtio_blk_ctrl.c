@@ -26,6 +26,9 @@
 					 (1ULL << VIRTIO_BLK_F_SIZE_MAX) |\
 					 (1ULL << VIRTIO_BLK_F_SEG_MAX) |\
 					 (1ULL << VIRTIO_BLK_F_BLK_SIZE)|\
+					 (1ULL << VIRTIO_BLK_F_DISCARD)|\
+					 (1ULL << VIRTIO_BLK_F_WRITE_ZEROES)|\
+					 (1ULL << VIRTIO_F_IN_ORDER)|\
 					 (1ULL << VIRTIO_F_ADMIN_VQ)|\
 					 (1ULL << VIRTIO_F_ADMIN_MIGRATION)|\
 					 (1ULL << VIRTIO_F_ADMIN_DIRTY_PAGE_PUSH_BITMAP_TRACK)|\
@@ -167,6 +170,12 @@ snap_virtio_blk_ctrl_bar_get_state(struct snap_virtio_ctrl *ctrl,
 	dev_cfg->seg_max = vbbar->seg_max;
 	dev_cfg->blk_size = vbbar->blk_size;
 	dev_cfg->num_queues = vbbar->max_blk_queues;
+	dev_cfg->max_discard_sectors = vbbar->max_discard_sectors;
+	dev_cfg->max_discard_seg = vbbar->max_discard_seg;
+	dev_cfg->discard_sector_alignment = vbbar->discard_sector_alignment;
+	dev_cfg->max_write_zeroes_sectors = vbbar->max_write_zeroes_sectors;
+	dev_cfg->max_write_zeroes_seg = vbbar->max_write_zeroes_segs;
+	dev_cfg->write_zeroes_may_unmap = vbbar->write_zeroes_may_unmap;
 	return snap_virtio_blk_ctrl_bar_get_state_size(ctrl);
 }
 
@@ -200,6 +209,12 @@ snap_virtio_blk_ctrl_bar_set_state(struct snap_virtio_ctrl *ctrl,
 	vbbar->seg_max = dev_cfg->seg_max;
 	vbbar->blk_size = dev_cfg->blk_size;
 	vbbar->max_blk_queues = dev_cfg->num_queues;
+	vbbar->max_discard_sectors = dev_cfg->max_discard_sectors;
+	vbbar->max_discard_seg = dev_cfg->max_discard_seg;
+	vbbar->discard_sector_alignment = dev_cfg->discard_sector_alignment;
+	vbbar->max_write_zeroes_sectors = dev_cfg->max_write_zeroes_sectors;
+	vbbar->max_write_zeroes_segs = dev_cfg->max_write_zeroes_seg;
+	vbbar->write_zeroes_may_unmap = dev_cfg->write_zeroes_may_unmap;
 
 	ret = snap_virtio_blk_modify_device(ctrl->sdev,
 					    SNAP_VIRTIO_MOD_ALL |
@@ -417,6 +432,20 @@ int snap_virtio_blk_ctrl_bar_setup(struct snap_virtio_blk_ctrl *ctrl,
 					    ~SNAP_VIRTIO_BLK_MODIFIABLE_FTRS);
 		bar.vattr.device_feature |= (new_ftrs &
 					     SNAP_VIRTIO_BLK_MODIFIABLE_FTRS);
+		/*
+		 * Discard and write zeroes are advertised by default when
+		 * the block device implements them, and never otherwise
+		 */
+		if (!regs->device_features) {
+			if (ctrl->bdev_ops && ctrl->bdev_ops->discard)
+				bar.vattr.device_feature |= 1ULL << VIRTIO_BLK_F_DISCARD;
+			if (ctrl->bdev_ops && ctrl->bdev_ops->write_zeroes)
+				bar.vattr.device_feature |= 1ULL << VIRTIO_BLK_F_WRITE_ZEROES;
+		}
+		if (!ctrl->bdev_ops || !ctrl->bdev_ops->discard)
+			bar.vattr.device_feature &= ~(1ULL << VIRTIO_BLK_F_DISCARD);
+		if (!ctrl->bdev_ops || !ctrl->bdev_ops->write_zeroes)
+			bar.vattr.device_feature &= ~(1ULL << VIRTIO_BLK_F_WRITE_ZEROES);
 		bar.vattr.max_queue_size = regs->queue_size ? :
 					   bar.vattr.max_queue_size;
 		bar.vattr.max_queues = regs->max_queues;
@@ -442,6 +471,22 @@ int snap_virtio_blk_ctrl_bar_setup(struct snap_virtio_blk_ctrl *ctrl,
 			snap_warn("Seg_max cannot be larger than queue depth - 2. Changed seg_max to %d.\n", regs->seg_max);
 		}
 		bar.seg_max = regs->seg_max ? : bar.seg_max;
+		bar.max_discard_sectors = regs->max_discard_sectors ? :
+					  bar.max_discard_sectors ? :
+					  VIRTIO_BLK_DEF_DWZ_SECTORS;
+		bar.max_discard_seg = regs->max_discard_seg ? :
+				      bar.max_discard_seg ? :
+				      VIRTIO_BLK_DEF_DWZ_SEG;
+		bar.discard_sector_alignment = regs->discard_sector_alignment ? :
+					       bar.discard_sector_alignment;
+		bar.max_write_zeroes_sectors = regs->max_write_zeroes_sectors ? :
+					       bar.max_write_zeroes_sectors ? :
+					       VIRTIO_BLK_DEF_DWZ_SECTORS;
+		bar.max_write_zeroes_segs = regs->max_write_zeroes_segs ? :
+					    bar.max_write_zeroes_segs ? :
+					    VIRTIO_BLK_DEF_DWZ_SEG;
+		/* write zeroes are not turned into deallocation */
+		bar.write_zeroes_may_unmap = 0;
 	}
 
 	ret = snap_virtio_blk_modify_device(sdev, regs_mask | extra_flags, &bar);
@@ -1088,6 +1133,8 @@ static int blk_adm_virtq_create_helper(struct snap_virtio_blk_ctrl_queue *vbq,
 	attr.common.device_pa = vbq->attr->vattr.device;
 	attr.common.msix_vector = vbq->attr->vattr.msix_vector;
 	attr.common.op_flags = SNAP_VQ_OP_FLAGS_IN_ORDER_COMPLETIONS;
+	if (vctrl->bar_curr->driver_feature & (1ULL << VIRTIO_F_IN_ORDER))
+		attr.common.op_flags |= SNAP_VQ_OP_FLAGS_IN_ORDER_USED;
 	attr.common.xmkey = vctrl->xmkey->mkey;
 	attr.common.pd = vctrl->lb_pd;
 	attr.common.sdev = vctrl->sdev;
@@ -1116,6 +1163,7 @@ static int blk_virtq_create_helper(struct snap_virtio_blk_ctrl_queue *vbq,
 	struct snap_virtio_blk_ctrl *blk_ctrl = to_blk_ctrl(vctrl);
 	struct snap_context *sctx = vctrl->sdev->sctx;
 	struct snap_virtio_blk_device_attr *dev_attr;
+	struct blk_virtq_dwz_limits *dwz_limits;
 
 	dev_attr = to_blk_device_attr(vctrl->bar_curr);
 	vbq->attr = &dev_attr->q_attrs[index];
@@ -1142,7 +1190,12 @@ static int blk_virtq_create_helper(struct snap_virtio_blk_ctrl_queue *vbq,
 		attr.virtio_version_1_0 = 0;
 	}
 	attr.force_in_order = blk_ctrl->common.force_in_order;
+	attr.in_order = !!(vctrl->bar_curr->driver_feature & (1ULL << VIRTIO_F_IN_ORDER));
+	attr.event_idx = !!(vctrl->bar_curr->driver_feature & (1ULL << VIRTIO_RING_F_EVENT_IDX));
 	attr.in_recovery = in_recovery;
+	/* the idle policy can be set at any time, see snap_virtio_ctrl_set_pg_idle() */
+	attr.notify = true;
+	attr.steal = vctrl->pg_ctx.steal;
 
 	attr.xmkey = vctrl->xmkey->mkey;
 
@@ -1160,6 +1213,16 @@ static int blk_virtq_create_helper(struct snap_virtio_blk_ctrl_queue *vbq,
 	dev_attr->q_attrs[index].hw_available_index = attr.hw_available_index;
 	dev_attr->q_attrs[index].hw_used_index = attr.hw_used_index;
 
+	dwz_limits = &to_blk_ctx(vbq->q_impl)->dwz_limits;
+	if (vctrl->bar_curr->driver_feature & (1ULL << VIRTIO_BLK_F_DISCARD)) {
+		dwz_limits->max_discard_sectors = dev_attr->max_discard_sectors;
+		dwz_limits->max_discard_seg = dev_attr->max_discard_seg;
+	}
+	if (vctrl->bar_curr->driver_feature & (1ULL << VIRTIO_BLK_F_WRITE_ZEROES)) {
+		dwz_limits->max_write_zeroes_sectors = dev_attr->max_write_zeroes_sectors;
+		dwz_limits->max_write_zeroes_seg = dev_attr->max_write_zeroes_segs;
+	}
+
 	return 0;
 }
 
@@ -1320,13 +1383,12 @@ static int snap_virtio_blk_ctrl_queue_resume(struct snap_virtio_ctrl_queue *vq)
 static int snap_virtio_blk_ctrl_queue_progress(struct snap_virtio_ctrl_queue *vq)
 {
 	struct snap_virtio_blk_ctrl_queue *vbq = to_blk_ctrl_q(vq);
-	struct virtq_common_ctx *q = &to_blk_ctx(vbq->q_impl)->common_ctx;
 
 	if (vbq->is_adm_vq) {
 		if (snap_likely(vbq->q_impl))
 			return snap_vq_progress(vbq->q_impl);
 	} else
-		return virtq_progress(q, vq->thread_id);
+		return blk_virtq_progress(to_blk_ctx(vbq->q_impl), vq->thread_id);
 
 	return 0;
 }
@@ -1363,6 +1425,44 @@ snap_virtio_blk_ctrl_queue_get_io_stats(struct snap_virtio_ctrl_queue *vq)
 	return NULL;
 }
 
+static int snap_virtio_blk_ctrl_queue_arm(struct snap_virtio_ctrl_queue *vq)
+{
+	struct snap_virtio_blk_ctrl_queue *vbq = to_blk_ctrl_q(vq);
+
+	if (vbq->is_adm_vq || !vbq->q_impl)
+		return -ENOTSUP;
+	return virtq_arm(&to_blk_ctx(vbq->q_impl)->common_ctx);
+}
+
+static int snap_virtio_blk_ctrl_queue_get_event_fd(struct snap_virtio_ctrl_queue *vq)
+{
+	struct snap_virtio_blk_ctrl_queue *vbq = to_blk_ctrl_q(vq);
+
+	if (vbq->is_adm_vq || !vbq->q_impl)
+		return -1;
+	return virtq_event_fd(&to_blk_ctx(vbq->q_impl)->common_ctx);
+}
+
+static int snap_virtio_blk_ctrl_queue_steal(struct snap_virtio_ctrl_queue *vq,
+					    int pg_id, int max)
+{
+	struct snap_virtio_blk_ctrl_queue *vbq = to_blk_ctrl_q(vq);
+
+	if (vbq->is_adm_vq || !vbq->q_impl)
+		return 0;
+	return virtq_steal(&to_blk_ctx(vbq->q_impl)->common_ctx, pg_id, max);
+}
+
+static int snap_virtio_blk_ctrl_bdev_progress(struct snap_virtio_ctrl *vctrl,
+					      int thread_id)
+{
+	struct snap_virtio_blk_ctrl *ctrl = to_blk_ctrl(vctrl);
+
+	if (!ctrl->bdev_ops || !ctrl->bdev_ops->progress)
+		return 0;
+	return ctrl->bdev_ops->progress(ctrl->bdev, thread_id);
+}
+
 static int snap_virtio_blk_ctrl_recover(struct snap_virtio_blk_ctrl *ctrl,
 					struct snap_virtio_blk_ctrl_attr *attr)
 {
@@ -1411,7 +1511,11 @@ static struct snap_virtio_queue_ops snap_virtio_blk_queue_ops = {
 	.is_suspended = snap_virtio_blk_ctrl_queue_is_suspended,
 	.resume = snap_virtio_blk_ctrl_queue_resume,
 	.get_state = snap_virtio_blk_ctrl_queue_get_state,
-	.get_io_stats = snap_virtio_blk_ctrl_queue_get_io_stats
+	.get_io_stats = snap_virtio_blk_ctrl_queue_get_io_stats,
+	.arm = snap_virtio_blk_ctrl_queue_arm,
+	.get_event_fd = snap_virtio_blk_ctrl_queue_get_event_fd,
+	.steal = snap_virtio_blk_ctrl_queue_steal,
+	.bdev_progress = snap_virtio_blk_ctrl_bdev_progress
 };
 
 /**
@@ -1445,6 +1549,14 @@ snap_virtio_blk_ctrl_open(struct snap_context *sctx,
 	ctrl->bdev_ops = bdev_ops;
 	ctrl->bdev = bdev;
 
+	ret = snap_qos_init(&ctrl->qos, NULL, snap_qos_ticks_hz());
+	if (ret) {
+		errno = -ret;
+		goto free_ctrl_mem;
+	}
+	snap_qos_set_limits(&ctrl->qos, &attr->qos, snap_qos_ticks());
+	ctrl->queue_qos = attr->queue_qos;
+
 	if (attr->common.pf_id < 0 ||
 	    attr->common.pf_id >= sctx->virtio_blk_pfs.max_pfs) {
 		snap_error("Bad PF id (%d). Only %d PFs are supported\n",
@@ -1533,6 +1645,8 @@ teardown_dev:
 close_ctrl:
 	snap_virtio_ctrl_close(&ctrl->common);
 free_ctrl:
+	snap_qos_destroy(&ctrl->qos);
+free_ctrl_mem:
 	free(ctrl);
 err:
 	return NULL;
@@ -1550,6 +1664,7 @@ void snap_virtio_blk_ctrl_close(struct snap_virtio_blk_ctrl *ctrl)
 	if (!ctrl->common.pending_flr)
 		snap_virtio_blk_teardown_device(ctrl->common.sdev);
 	snap_virtio_ctrl_close(&ctrl->common);
+	snap_qos_destroy(&ctrl->qos);
 	free(ctrl);
 }
 
@@ -1612,10 +1727,64 @@ int snap_virtio_blk_ctrl_io_progress(struct snap_virtio_blk_ctrl *ctrl)
  * @thread_id:	id queues belong to
  *
  * Looks for any IO requests from host received on QPs which belong to thread
- * thread_id, and handles them based on the request's parameters.
+ * thread_id, and handles them based on the request's parameters. With an
+ * idle policy, see snap_virtio_ctrl_set_pg_idle(), the thread may sleep
+ * in the call while its queues are idle.
  */
 int snap_virtio_blk_ctrl_io_progress_thread(struct snap_virtio_blk_ctrl *ctrl,
 					     uint32_t thread_id)
 {
 	return snap_virtio_ctrl_pg_io_progress(&ctrl->common, thread_id);
 }
+
+/**
+ * snap_virtio_blk_ctrl_set_qos() - change the limits of the controller
+ * @ctrl:	controller instance
+ * @limits:	new limits, zero for none
+ *
+ * The limits are shared by all IO queues of the controller. Queues that
+ * run out of tokens are served in turn, so a busy queue does not starve
+ * the others.
+ *
+ * Context: Can be called while the queues are progressed
+ *
+ * Return: 0 on success, -errno otherwise
+ */
+int snap_virtio_blk_ctrl_set_qos(struct snap_virtio_blk_ctrl *ctrl,
+				 const struct snap_qos_limits *limits)
+{
+	snap_qos_set_limits(&ctrl->qos, limits, snap_qos_ticks());
+	return 0;
+}
+
+/**
+ * snap_virtio_blk_ctrl_set_queue_qos() - change the limits of the IO queues
+ * @ctrl:	controller instance
+ * @limits:	new limits, zero for none
+ *
+ * Every IO queue of the controller gets its own budget of @limits, queues
+ * created later inherit them.
+ *
+ * Context: Calling thread must be the one that calls
+ *          snap_virtio_blk_ctrl_progress()
+ *
+ * Return: 0 on success, -errno otherwise
+ */
+int snap_virtio_blk_ctrl_set_queue_qos(struct snap_virtio_blk_ctrl *ctrl,
+				       const struct snap_qos_limits *limits)
+{
+	struct snap_virtio_blk_ctrl_queue *vbq;
+	int i;
+
+	ctrl->queue_qos = *limits;
+	for (i = 0; i < ctrl->common.max_queues; i++) {
+		if (!ctrl->common.queues[i])
+			continue;
+		vbq = to_blk_ctrl_q(ctrl->common.queues[i]);
+		if (vbq->is_adm_vq || !vbq->q_impl)
+			continue;
+		blk_virtq_set_qos(to_blk_ctx(vbq->q_impl), limits);
+	}
+
+	return 0;
+}
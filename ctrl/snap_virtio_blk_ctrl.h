@@ -19,6 +19,7 @@
 #include "snap_virtio_common_ctrl.h"
 #include "snap_virtio_blk.h"
 #include "snap_blk_ops.h"
+#include "snap_qos.h"
 
 #define VIRTIO_BLK_MAX_CTRL_NUM		128
 #define VIRTIO_BLK_CTRL_NUM_VIRTQ_MAX	32
@@ -29,6 +30,10 @@
 #define VIRTIO_BLK_CTRL_MDTS_MAX	6
 #define VIRTIO_BLK_MAX_REQ_DATA		(VIRTIO_BLK_CTRL_PAGE_SIZE * (1 << VIRTIO_BLK_CTRL_MDTS_MAX))
 
+/* discard and write zeroes limits used when the registers leave them 0 */
+#define VIRTIO_BLK_DEF_DWZ_SECTORS	(1U << 22)
+#define VIRTIO_BLK_DEF_DWZ_SEG		16
+
 typedef struct snap_virtio_blk_ctrl_zcopy_ctx {
 	void *fake_addr_table;
 	size_t fake_addr_table_size;
@@ -46,9 +51,18 @@ struct snap_virtio_blk_ctrl_queue {
 	bool is_adm_vq;
 };
 
+/**
+ * struct snap_virtio_blk_ctrl_attr - virtio-blk controller attributes
+ * @common:	common virtio controller attributes
+ * @regs:	initial device registers
+ * @qos:	limits of the whole controller, zero for none
+ * @queue_qos:	limits of every IO queue of the controller, zero for none
+ */
 struct snap_virtio_blk_ctrl_attr {
 	struct snap_virtio_ctrl_attr common;
 	struct snap_virtio_blk_registers regs;
+	struct snap_qos_limits qos;
+	struct snap_qos_limits queue_qos;
 };
 
 struct snap_virtio_blk_ctrl {
@@ -63,6 +77,8 @@ struct snap_virtio_blk_ctrl {
 	struct snap_virtio_blk_ctrl **vfs_ctrl;
 	uint8_t *lm_buf;
 	bool has_adm_vq;
+	struct snap_qos qos;
+	struct snap_qos_limits queue_qos;
 };
 
 struct snap_virtio_blk_ctrl *
@@ -80,5 +96,9 @@ void snap_virtio_blk_ctrl_progress(struct snap_virtio_blk_ctrl *ctrl);
 int snap_virtio_blk_ctrl_io_progress(struct snap_virtio_blk_ctrl *ctrl);
 int snap_virtio_blk_ctrl_io_progress_thread(struct snap_virtio_blk_ctrl *ctrl,
 					     uint32_t thread_id);
+int snap_virtio_blk_ctrl_set_qos(struct snap_virtio_blk_ctrl *ctrl,
+				 const struct snap_qos_limits *limits);
+int snap_virtio_blk_ctrl_set_queue_qos(struct snap_virtio_blk_ctrl *ctrl,
+				       const struct snap_qos_limits *limits);
 
 #endif
@@ -43,6 +43,14 @@ struct blk_virtq_cmd_aux {
  * @zcopy:			use ZCOPY
  * @iov:			command descriptors converted to the io vector
  * @iov_cnt:			number of io vectors in the command
+ * @init_aux:			aux buffer that holds up to seg_max descriptors
+ * @init_aux_mr:		memory region of @init_aux
+ * @dwz:			discard or write zeroes segments in flight
+ * @qos_entry:			entry in the QoS wait list of the queue
+ * @qos_admitted:		admitted by blk_virtq_progress(), do not check
+ *				the limits again
+ * @bdev_status:		status of a block device operation that completes
+ *				through the done ring, see virtq_steal_done()
  */
 struct blk_virtq_cmd {
 	struct virtq_cmd common_cmd;
@@ -55,6 +63,12 @@ struct blk_virtq_cmd {
 	struct virtio_blk_outftr ftr;
 	int max_iov_cnt;
 	int iov_cnt;
+	void *init_aux;
+	struct ibv_mr *init_aux_mr;
+	struct blk_virtq_dwz_io dwz;
+	TAILQ_ENTRY(blk_virtq_cmd) qos_entry;
+	bool qos_admitted;
+	enum snap_bdev_op_status bdev_status;
 	struct iovec iov[];
 };
 
@@ -147,31 +161,6 @@ to_blk_ctrl(struct snap_virtio_ctrl *vctrl)
 
 static void virtq_mem_ready(void *data, struct ibv_mr *mr, void *user);
 
-static int alloc_aux(struct virtq_cmd *cmd, uint32_t seg_max)
-{
-	const size_t descs_size = VIRTIO_NUM_DESC(seg_max) * sizeof(struct vring_desc);
-	const size_t aux_size = sizeof(struct blk_virtq_cmd_aux) + descs_size;
-
-	cmd->aux = calloc(1, aux_size);
-	if (!cmd->aux) {
-		snap_error("failed to allocate aux memory (%ld bytes) for virtq %d cmd %d\n",
-			   aux_size, cmd->vq_priv->vq_ctx->idx, cmd->idx);
-		return -ENOMEM;
-	}
-
-	cmd->aux_mr = ibv_reg_mr(cmd->vq_priv->pd, cmd->aux, aux_size,
-					IBV_ACCESS_REMOTE_READ |
-					IBV_ACCESS_REMOTE_WRITE |
-					IBV_ACCESS_LOCAL_WRITE);
-	if (!cmd->aux_mr) {
-		virtq_reg_mr_fail_log_error(cmd);
-		free(cmd->aux);
-		return -1;
-	}
-
-	return 0;
-}
-
 static void init_blk_virtq_cmd(struct blk_virtq_cmd *cmd, int idx,
 			      uint32_t size_max, uint32_t seg_max,
 			      struct virtq_priv *vq_priv, uint8_t *req_buf,
@@ -192,6 +181,8 @@ static void init_blk_virtq_cmd(struct blk_virtq_cmd *cmd, int idx,
 
 	cmd->common_cmd.aux = aux_buf;
 	cmd->common_cmd.aux_mr = aux_mr;
+	cmd->init_aux = aux_buf;
+	cmd->init_aux_mr = aux_mr;
 	if (cmd->common_cmd.vq_priv->use_mem_pool) {
 		cmd->dma_pool_ctx.ctx = vq_priv->virtq_dev.ctx;
 		cmd->dma_pool_ctx.user = cmd;
@@ -268,6 +259,16 @@ alloc_blk_virtq_cmd_arr(uint32_t size_max, uint32_t seg_max,
 		goto free_data;
 	}
 
+	if (virtq_aux_pool_init(&vq_priv->aux_pool, vq_priv->pd,
+				sizeof(struct blk_virtq_cmd_aux) +
+				num * sizeof(struct vring_desc),
+				SNAP_VIRTQ_AUX_POOL_INIT,
+				snap_virtio_ctrl_aux_pool(num), NULL, NULL)) {
+		snap_error("failed to create descriptor pool for virtq %d\n",
+			   vq_priv->vq_ctx->idx);
+		goto dereg_data;
+	}
+
 	if (vq_priv->use_mem_pool) {
 		for (i = 0; i < num; i++) {
 			cmd_data = NULL;
@@ -288,6 +289,8 @@ alloc_blk_virtq_cmd_arr(uint32_t size_max, uint32_t seg_max,
 
 	return cmd_arr;
 
+dereg_data:
+	ibv_dereg_mr(vq_priv->data_mr);
 free_data:
 	to_blk_bdev_ops(&vq_priv->virtq_dev)->dma_free(vq_priv->data);
 free_cmd_arr:
@@ -300,38 +303,35 @@ out:
 
 static void free_blk_virtq_cmd_arr(struct virtq_priv *vq_priv)
 {
+	struct virtq_cmd *cmd;
+	int i;
+
+	for (i = 0; i < vq_priv->vattr->size; i++) {
+		cmd = blk_virtq_get_avail_cmd(vq_priv->cmd_arr, i);
+		if (cmd->use_seg_dmem)
+			virtq_aux_pool_put(&vq_priv->aux_pool, cmd->aux, cmd->aux_mr);
+	}
+	virtq_aux_pool_destroy(&vq_priv->aux_pool);
 	ibv_dereg_mr(vq_priv->data_mr);
 	to_blk_bdev_ops(&vq_priv->virtq_dev)->dma_free(vq_priv->data);
 	free(vq_priv->cmd_arr);
 }
 
-static int virtq_alloc_desc_buf(struct virtq_cmd *cmd, size_t old_len, size_t len)
+static int virtq_alloc_desc_buf(struct virtq_cmd *cmd, size_t old_len)
 {
-	int aux_size = len * sizeof(struct vring_desc) + sizeof(struct virtio_blk_outhdr);
 	struct ibv_mr *new_aux_mr;
-	struct blk_virtq_cmd_aux *new_aux  = calloc(1, aux_size);
+	struct blk_virtq_cmd_aux *new_aux;
 
+	new_aux = virtq_aux_pool_get(&cmd->vq_priv->aux_pool, &new_aux_mr);
 	if (!new_aux) {
-		snap_error("failed to dynamically allocate %lu bytes for command %d request\n",
-				len, cmd->idx);
-		goto err;
-	}
-	new_aux_mr = ibv_reg_mr(cmd->vq_priv->pd, new_aux, aux_size,
-					IBV_ACCESS_REMOTE_READ |
-					IBV_ACCESS_REMOTE_WRITE |
-					IBV_ACCESS_LOCAL_WRITE);
-	if (!new_aux_mr) {
-		virtq_reg_mr_fail_log_error(cmd);
-		free(new_aux);
+		ERR_ON_CMD(cmd, "failed to get descriptor buffer for %lu descriptors\n",
+			   old_len);
 		goto err;
 	}
 
 	memcpy(new_aux->descs, to_blk_cmd_aux(cmd->aux)->descs, old_len * sizeof(struct vring_desc));
-	if (cmd->vq_priv->use_mem_pool || cmd->use_seg_dmem) {
-		//mem for aux was previously allocated with malloc
-		ibv_dereg_mr(cmd->aux_mr);
-		free(cmd->aux);
-	}
+	if (cmd->use_seg_dmem)
+		virtq_aux_pool_put(&cmd->vq_priv->aux_pool, cmd->aux, cmd->aux_mr);
 	cmd->aux = new_aux;
 	cmd->use_seg_dmem = true;
 	cmd->aux_mr = new_aux_mr;
@@ -343,9 +343,9 @@ err:
 	return -1;
 }
 
-static void bdev_io_comp_cb(enum snap_bdev_op_status status, void *done_arg)
+static void blk_virtq_bdev_comp(struct blk_virtq_cmd *cmd,
+			       enum snap_bdev_op_status status)
 {
-	struct blk_virtq_cmd *cmd = done_arg;
 	enum virtq_cmd_sm_op_status op_status = VIRTQ_CMD_SM_OP_OK;
 
 	if (snap_unlikely(status != SNAP_BDEV_OP_SUCCESS)) {
@@ -360,6 +360,25 @@ static void bdev_io_comp_cb(enum snap_bdev_op_status status, void *done_arg)
 	virtq_cmd_progress(&cmd->common_cmd, op_status);
 }
 
+static void bdev_io_comp_cb(enum snap_bdev_op_status status, void *done_arg)
+{
+	struct blk_virtq_cmd *cmd = done_arg;
+
+	/* the command may have been submitted by another thread */
+	if (cmd->common_cmd.steal) {
+		cmd->bdev_status = status;
+		virtq_steal_done(&cmd->common_cmd);
+		return;
+	}
+
+	blk_virtq_bdev_comp(cmd, status);
+}
+
+static void blk_virtq_bdev_done(struct virtq_cmd *cmd)
+{
+	blk_virtq_bdev_comp(to_blk_virtq_cmd(cmd), to_blk_virtq_cmd(cmd)->bdev_status);
+}
+
 
 static inline int virtq_descs_to_iovec(struct blk_virtq_cmd *cmd)
 {
@@ -397,7 +416,8 @@ static inline bool zcopy_prepare(struct blk_virtq_cmd *cmd)
 	if (cmd->common_cmd.num_desc == NUM_HDR_FTR_DESCS)
 		return false;
 
-	if (aux->header.type == VIRTIO_BLK_T_GET_ID)
+	if (aux->header.type != VIRTIO_BLK_T_IN &&
+	    aux->header.type != VIRTIO_BLK_T_OUT)
 		return false;
 
 	if (!ops->zcopy_validate_params)
@@ -423,7 +443,9 @@ static inline bool zcopy_prepare(struct blk_virtq_cmd *cmd)
  * @cmd: Command being processed
  *
  * merge 2 data descriptors that are a continuation of one another into one,
- * as a result, following descriptors that are not merged will be moved in the data_desc array
+ * as a result, following descriptors that are not merged will be moved in the data_desc array.
+ * Each merged descriptor is a single entry of the data transfer list, see
+ * virtq_xfer_data_descs().
  *
  * Return: number of descs after merge
  */
@@ -439,7 +461,8 @@ static size_t virtq_sequential_data_descs_merge(struct vring_desc *descs,
 	for (i = 2; i < num_desc - 1; i++) {
 		if ((descs[i].addr == descs[merged_index].addr + descs[merged_index].len)
 				&& ((descs[merged_index].flags & VRING_DESC_F_WRITE)
-						== (descs[i].flags & VRING_DESC_F_WRITE))) {
+						== (descs[i].flags & VRING_DESC_F_WRITE))
+				&& descs[i].len <= UINT32_MAX - descs[merged_index].len) {
 			/* merge two descriptors */
 			descs[merged_index].len += descs[i].len;
 			descs[merged_index].next = descs[i].next;
@@ -511,13 +534,19 @@ static int blk_seg_dmem(struct virtq_cmd *cmd)
 {
 	if (snap_unlikely(cmd->num_desc >=
 			VIRTIO_NUM_DESC(cmd->vq_priv->seg_max))) {
-		if (virtq_alloc_desc_buf(cmd, cmd->num_desc,
-				cmd->vq_priv->vattr->size))
+		if (virtq_alloc_desc_buf(cmd, cmd->num_desc))
 			return -1;
 	}
 	return 0;
 }
 
+static uint32_t blk_virtq_max_descs(struct virtq_cmd *cmd)
+{
+	if (cmd->use_seg_dmem)
+		return cmd->vq_priv->vattr->size;
+	return VIRTIO_NUM_DESC(cmd->vq_priv->seg_max);
+}
+
 static void blk_virtq_proc_desc(struct virtq_cmd *cmd)
 {
 	int i;
@@ -609,6 +638,56 @@ static void virtq_mem_ready(void *data, struct ibv_mr *mr, void *user)
 	virtq_cmd_progress(&cmd->common_cmd, VIRTQ_CMD_SM_OP_OK);
 }
 
+static uint64_t blk_virtq_qos_bytes(struct virtq_cmd *cmd)
+{
+	switch (to_blk_cmd_aux(cmd->aux)->header.type) {
+	case VIRTIO_BLK_T_IN:
+	case VIRTIO_BLK_T_OUT:
+		return cmd->total_seg_len;
+	default:
+		return 0;
+	}
+}
+
+static uint64_t blk_virtq_qos_now(struct virtq_priv *priv)
+{
+	struct snap_pg *pg = priv->vbq ? priv->vbq->pg : NULL;
+
+	return pg ? pg->now : snap_qos_ticks();
+}
+
+/*
+ * Commands are admitted once the header and the data length are known,
+ * before any data is moved. A command over the budget waits behind the
+ * commands that wait already and is resumed by blk_virtq_progress(). A
+ * flushing queue does not wait for tokens.
+ */
+static bool blk_virtq_qos_wait(struct virtq_cmd *cmd)
+{
+	struct blk_virtq_cmd *blk_cmd = to_blk_virtq_cmd(cmd);
+	struct blk_virtq_ctx *q = to_blk_virtq_ctx(cmd->vq_priv->vq_ctx);
+
+	if (blk_cmd->qos_admitted) {
+		blk_cmd->qos_admitted = false;
+		return false;
+	}
+
+	if (snap_likely(!snap_qos_is_limited(&q->qos)) ||
+	    cmd->vq_priv->swq_state != SW_VIRTQ_RUNNING)
+		return false;
+
+	if (TAILQ_EMPTY(&q->qos_wait) &&
+	    snap_qos_admit(&q->qos, blk_virtq_qos_bytes(cmd),
+			   blk_virtq_qos_now(cmd->vq_priv)))
+		return false;
+
+	virtq_log_data(cmd, "QOS_WAIT: type %u len %u\n",
+		       to_blk_cmd_aux(cmd->aux)->header.type, cmd->total_seg_len);
+	TAILQ_INSERT_TAIL(&q->qos_wait, blk_cmd, qos_entry);
+	cmd->vq_priv->qos_throttled = true;
+	return true;
+}
+
 /**
  * virtq_parse_header() - Parse received header
  * @cmd: Command being processed
@@ -632,6 +711,9 @@ static bool blk_virtq_sm_parse_header(struct virtq_cmd *cmd,
 		return true;
 	}
 
+	if (blk_virtq_qos_wait(cmd))
+		return false;
+
 	blk_cmd->zcopy = zcopy_prepare(blk_cmd);
 
 	if (blk_cmd->zcopy) {
@@ -641,6 +723,8 @@ static bool blk_virtq_sm_parse_header(struct virtq_cmd *cmd,
 
 	switch (to_blk_cmd_aux(cmd->aux)->header.type) {
 	case VIRTIO_BLK_T_OUT:
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
 		req_len = cmd->total_seg_len;
 		cmd->state = VIRTQ_CMD_STATE_READ_DATA;
 		break;
@@ -685,16 +769,12 @@ static bool blk_virtq_sm_parse_header(struct virtq_cmd *cmd,
  * virtq_read_req_from_host() - Read request from host
  * @cmd: Command being processed
  *
- * RDMA READ the command request data from host memory.
- * Error after requesting the first RDMA READ is fatal because we can't
- * cancel previous RDMA READ requests done for this command, and since
- * the failing RDMA READ will not return the completion counter will not get
- * to 0 and the callback for the previous RDMA READ requests will not return.
+ * RDMA READ the command request data from host memory, see
+ * virtq_xfer_data_descs().
  *
  * Handles also cases in which request is bigger than maximum buffer, so that
  * drivers which don't support the VIRTIO_BLK_F_SIZE_MAX feature will not
  * crash
- * ToDo: add non-fatal error in case first read fails
  * Note: Last desc is always VRING_DESC_F_READ
  *
  * Return: True if state machine is moved synchronously to the new state
@@ -705,44 +785,89 @@ static bool blk_virtq_sm_read_data(struct virtq_cmd *cmd,
 	     enum virtq_cmd_sm_op_status status)
 {
 	struct virtq_priv *priv = cmd->vq_priv;
-	size_t offset, i;
-	int ret;
+	int ret, n_posted;
 
 	cmd->state = VIRTQ_CMD_STATE_HANDLE_REQ;
-
-	// Calculate number of descriptors we want to read
-	cmd->dma_comp.count = 0;
-	for (i = 1; i < cmd->num_desc - 1; i++) {
-		if (to_blk_cmd_aux(cmd->aux)->descs[i].flags & VRING_DESC_F_WRITE)
-			continue;
-		cmd->dma_comp.count++;
+	ret = virtq_xfer_data_descs(cmd, to_blk_cmd_aux(cmd->aux)->descs + 1,
+				    cmd->num_desc - NUM_HDR_FTR_DESCS, false, &n_posted);
+	if (snap_unlikely(ret)) {
+		ERR_ON_CMD(cmd, "failed to read data, ret %d\n", ret);
+		if (!n_posted) {
+			cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
+			return true;
+		}
+		/* wait for the posted reads, then fail the request */
+		to_blk_cmd_ftr(cmd->ftr)->status = VIRTIO_BLK_S_IOERR;
+		cmd->state = VIRTQ_CMD_STATE_WRITE_STATUS;
 	}
 
 	// If we have nothing to read - move synchronously to
 	// VIRTQ_CMD_STATE_HANDLE_REQ
-	if (!cmd->dma_comp.count)
+	if (!n_posted)
 		return true;
 
-	offset = 0;
-	for (i = 1; i < cmd->num_desc - 1; i++) {
-		if (to_blk_cmd_aux(cmd->aux)->descs[i].flags & VRING_DESC_F_WRITE)
-			continue;
+	++priv->cmd_cntrs.outstanding_to_host;
+	return false;
+}
 
-		virtq_log_data(cmd, "READ_DATA: pa 0x%llx len %u\n",
-				to_blk_cmd_aux(cmd->aux)->descs[i].addr, to_blk_cmd_aux(cmd->aux)->descs[i].len);
-		ret = snap_dma_q_read(priv->dma_q, cmd->req_buf + offset,
-				to_blk_cmd_aux(cmd->aux)->descs[i].len, cmd->req_mr->lkey, to_blk_cmd_aux(cmd->aux)->descs[i].addr,
-				priv->vattr->dma_mkey, &cmd->dma_comp);
-		if (ret) {
-			ERR_ON_CMD(cmd, "failed to read data, ret %d\n", ret);
-			cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
-			return true;
-		}
-		offset += to_blk_cmd_aux(cmd->aux)->descs[i].len;
+/*
+ * Submits a read, write or flush to the block device channel of @thread_id,
+ * the state the command moves to once it completes is already set.
+ */
+static int blk_virtq_bdev_io(struct virtq_cmd *cmd, int thread_id)
+{
+	struct virtq_bdev *bdev = &cmd->vq_priv->virtq_dev;
+	struct blk_virtq_cmd *blk_cmd = to_blk_virtq_cmd(cmd);
+	struct snap_bdev_ops *ops = to_blk_bdev_ops(bdev);
+	uint64_t offset = to_blk_cmd_aux(cmd->aux)->header.sector * BDEV_SECTOR_SIZE;
+
+	switch (to_blk_cmd_aux(cmd->aux)->header.type) {
+	case VIRTIO_BLK_T_OUT:
+		if (blk_cmd->zcopy)
+			return ops->writev_blocks(bdev->ctx, blk_cmd->iov,
+						  blk_cmd->iov_cnt,
+						  blk_cmd->offset_blocks,
+						  blk_cmd->num_blocks,
+						  &blk_cmd->bdev_op_ctx, thread_id);
+		return ops->write(bdev->ctx, cmd->req_buf, offset,
+				  cmd->total_seg_len, &blk_cmd->bdev_op_ctx,
+				  thread_id);
+	case VIRTIO_BLK_T_IN:
+		if (blk_cmd->zcopy)
+			return ops->readv_blocks(bdev->ctx, blk_cmd->iov,
+						 blk_cmd->iov_cnt,
+						 blk_cmd->offset_blocks,
+						 blk_cmd->num_blocks,
+						 &blk_cmd->bdev_op_ctx, thread_id);
+		return ops->read(bdev->ctx, cmd->req_buf, offset,
+				 cmd->total_seg_len, &blk_cmd->bdev_op_ctx,
+				 thread_id);
+	case VIRTIO_BLK_T_FLUSH:
+		return ops->flush(bdev->ctx, 0,
+				  ops->get_num_blocks(bdev->ctx) *
+				  ops->get_block_size(bdev->ctx),
+				  &blk_cmd->bdev_op_ctx, thread_id);
+	default:
+		return -EINVAL;
 	}
+}
 
-	++priv->cmd_cntrs.outstanding_to_host;
-	return false;
+/* with work stealing the submission is left to the first thread that takes it */
+static inline int blk_virtq_bdev_io_start(struct virtq_cmd *cmd, bool *steal)
+{
+	*steal = virtq_steal_enabled(cmd->vq_priv);
+	if (*steal)
+		return 0;
+	return blk_virtq_bdev_io(cmd, cmd->vq_priv->pg_id);
+}
+
+static void blk_virtq_bdev_submit(struct virtq_cmd *cmd, int thread_id)
+{
+	if (blk_virtq_bdev_io(cmd, thread_id)) {
+		ERR_ON_CMD(cmd, "failed while executing command %d\n",
+			   to_blk_cmd_aux(cmd->aux)->header.type);
+		bdev_io_comp_cb(SNAP_BDEV_OP_IO_ERROR, to_blk_virtq_cmd(cmd));
+	}
 }
 
 /**
@@ -750,7 +875,8 @@ static bool blk_virtq_sm_read_data(struct virtq_cmd *cmd,
  * @cmd: Command being processed
  * @status: Callback status
  *
- * Perform commands operation (READ/WRITE/FLUSH) on backend block device.
+ * Perform commands operation (READ/WRITE/FLUSH/DISCARD/WRITE_ZEROES) on
+ * backend block device.
  *
  * Return: True if state machine is moved synchronously to the new state
  * (error cases) or false if the state transition will be done asynchronously.
@@ -759,11 +885,12 @@ static bool blk_virtq_sm_handle_req(struct virtq_cmd *cmd,
 			     enum virtq_cmd_sm_op_status status)
 {
 	struct virtq_bdev *bdev = &cmd->vq_priv->virtq_dev;
-	int ret, len;
-	uint64_t num_blocks;
-	uint32_t blk_size;
+	struct blk_virtq_ctx *vq_ctx = to_blk_virtq_ctx(cmd->vq_priv->vq_ctx);
+	struct virtio_blk_discard_write_zeroes *segs;
+	int ret, len, n_segs;
 	const char *dev_name;
-	uint64_t offset;
+	uint8_t dwz_status;
+	bool steal = false;
 	uint32_t cmd_type = to_blk_cmd_aux(cmd->aux)->header.type;
 
 	if (status != VIRTQ_CMD_SM_OP_OK) {
@@ -787,40 +914,17 @@ static bool blk_virtq_sm_handle_req(struct virtq_cmd *cmd,
 	case VIRTIO_BLK_T_OUT:
 		cmd->io_cmd_stat = &(to_blk_virtq_ctx(cmd->vq_priv->vq_ctx)->io_stat.write);
 		cmd->state = VIRTQ_CMD_STATE_OUT_DATA_DONE;
-		offset = to_blk_cmd_aux(cmd->aux)->header.sector * BDEV_SECTOR_SIZE;
-		if (to_blk_virtq_cmd(cmd)->zcopy) {
-			ret = to_blk_bdev_ops(bdev)->writev_blocks(bdev->ctx, to_blk_virtq_cmd(cmd)->iov,
-						to_blk_virtq_cmd(cmd)->iov_cnt,
-						to_blk_virtq_cmd(cmd)->offset_blocks,
-						to_blk_virtq_cmd(cmd)->num_blocks,
-						&to_blk_virtq_cmd(cmd)->bdev_op_ctx,
-						cmd->vq_priv->pg_id);
-		} else {
-			ret = to_blk_bdev_ops(bdev)->write(bdev->ctx, cmd->req_buf,
-					       offset, cmd->total_seg_len,
-					       &to_blk_virtq_cmd(cmd)->bdev_op_ctx,
-					       cmd->vq_priv->pg_id);
-		}
+		ret = blk_virtq_bdev_io_start(cmd, &steal);
 		break;
 	case VIRTIO_BLK_T_IN:
 		cmd->io_cmd_stat = &(to_blk_virtq_ctx(cmd->vq_priv->vq_ctx)->io_stat.read);
-		offset = to_blk_cmd_aux(cmd->aux)->header.sector * BDEV_SECTOR_SIZE;
 		if (to_blk_virtq_cmd(cmd)->zcopy) {
 			cmd->total_in_len += cmd->total_seg_len;
 			cmd->state = VIRTQ_CMD_STATE_WRITE_STATUS;
-			ret = to_blk_bdev_ops(bdev)->readv_blocks(bdev->ctx, to_blk_virtq_cmd(cmd)->iov,
-					       to_blk_virtq_cmd(cmd)->iov_cnt,
-					       to_blk_virtq_cmd(cmd)->offset_blocks,
-					       to_blk_virtq_cmd(cmd)->num_blocks,
-					       &to_blk_virtq_cmd(cmd)->bdev_op_ctx,
-					       cmd->vq_priv->pg_id);
 		} else {
 			cmd->state = VIRTQ_CMD_STATE_IN_DATA_DONE;
-			ret = to_blk_bdev_ops(bdev)->read(bdev->ctx, cmd->req_buf,
-					      offset, cmd->total_seg_len,
-					      &to_blk_virtq_cmd(cmd)->bdev_op_ctx,
-					      cmd->vq_priv->pg_id);
 		}
+		ret = blk_virtq_bdev_io_start(cmd, &steal);
 		break;
 	case VIRTIO_BLK_T_FLUSH:
 		cmd->io_cmd_stat = &(to_blk_virtq_ctx(cmd->vq_priv->vq_ctx)->io_stat.flush);
@@ -829,13 +933,39 @@ static bool blk_virtq_sm_handle_req(struct virtq_cmd *cmd,
 			ret = -1;
 		} else {
 			cmd->state = VIRTQ_CMD_STATE_WRITE_STATUS;
-			num_blocks = to_blk_bdev_ops(bdev)->get_num_blocks(bdev->ctx);
-			blk_size = to_blk_bdev_ops(bdev)->get_block_size(bdev->ctx);
-			ret = to_blk_bdev_ops(bdev)->flush(bdev->ctx, 0,
-					       num_blocks * blk_size,
-					       &to_blk_virtq_cmd(cmd)->bdev_op_ctx, cmd->vq_priv->pg_id);
+			ret = blk_virtq_bdev_io_start(cmd, &steal);
 		}
 		break;
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		if (cmd_type == VIRTIO_BLK_T_DISCARD)
+			cmd->io_cmd_stat = &vq_ctx->io_stat.discard;
+		else
+			cmd->io_cmd_stat = &vq_ctx->io_stat.write_zeroes;
+		cmd->state = VIRTQ_CMD_STATE_WRITE_STATUS;
+		segs = (struct virtio_blk_discard_write_zeroes *)cmd->req_buf;
+		n_segs = cmd->total_seg_len / sizeof(*segs);
+		dwz_status = VIRTIO_BLK_S_IOERR;
+		if (cmd->total_seg_len % sizeof(*segs) == 0)
+			dwz_status = blk_virtq_dwz_check(cmd_type, segs, n_segs,
+					&vq_ctx->dwz_limits,
+					to_blk_bdev_ops(bdev)->get_block_size(bdev->ctx),
+					to_blk_bdev_ops(bdev)->get_num_blocks(bdev->ctx));
+		if (dwz_status != VIRTIO_BLK_S_OK) {
+			ERR_ON_CMD(cmd, "invalid %s command, %u bytes of segments, status %d\n",
+				   cmd_type == VIRTIO_BLK_T_DISCARD ? "discard" : "write zeroes",
+				   cmd->total_seg_len, dwz_status);
+			cmd->io_cmd_stat->total++;
+			cmd->io_cmd_stat->fail++;
+			to_blk_cmd_ftr(cmd->ftr)->status = dwz_status;
+			return true;
+		}
+		ret = blk_virtq_dwz_submit(&to_blk_virtq_cmd(cmd)->dwz,
+					   to_blk_bdev_ops(bdev), bdev->ctx,
+					   cmd_type, segs, n_segs,
+					   &to_blk_virtq_cmd(cmd)->bdev_op_ctx,
+					   cmd->vq_priv->pg_id);
+		break;
 	case VIRTIO_BLK_T_GET_ID:
 		cmd->state = VIRTQ_CMD_STATE_WRITE_STATUS;
 		dev_name = to_blk_bdev_ops(bdev)->get_bdev_name(bdev->ctx);
@@ -890,6 +1020,9 @@ static bool blk_virtq_sm_handle_req(struct virtq_cmd *cmd,
 		++to_blk_queue(cmd->vq_priv->snap_vbq)->uncomp_bdev_cmds;
 	}
 
+	/* other threads may take the command from now on */
+	if (steal)
+		virtq_steal_push(cmd);
 	return false;
 
 err:
@@ -912,8 +1045,8 @@ err:
 static bool blk_virtq_sm_handle_in_iov_done(struct virtq_cmd *cmd,
 				  enum virtq_cmd_sm_op_status status)
 {
-	int i, ret;
-	size_t offset = 0;
+	struct vring_desc *descs = to_blk_cmd_aux(cmd->aux)->descs;
+	int i, ret, n_posted;
 
 	if (status != VIRTQ_CMD_SM_OP_OK) {
 		ERR_ON_CMD(cmd, "failed to read from block device, send ioerr to host\n");
@@ -922,28 +1055,27 @@ static bool blk_virtq_sm_handle_in_iov_done(struct virtq_cmd *cmd,
 		return true;
 	}
 
-	cmd->dma_comp.count = cmd->num_desc - NUM_HDR_FTR_DESCS;
 	cmd->state = VIRTQ_CMD_STATE_WRITE_STATUS;
-	for (i = 0; i < cmd->num_desc - NUM_HDR_FTR_DESCS; i++) {
-		virtq_log_data(cmd, "WRITE_DATA: pa 0x%llx len %u\n",
-			       to_blk_cmd_aux(cmd->aux)->descs[i + 1].addr, to_blk_cmd_aux(cmd->aux)->descs[i + 1].len);
-		ret = snap_dma_q_write(cmd->vq_priv->dma_q,
-				       cmd->req_buf + offset,
-				       to_blk_cmd_aux(cmd->aux)->descs[i + 1].len,
-				       cmd->req_mr->lkey,
-				       to_blk_cmd_aux(cmd->aux)->descs[i + 1].addr,
-				       cmd->vq_priv->vattr->dma_mkey,
-				       &(cmd->dma_comp));
-		if (ret) {
-			to_blk_cmd_ftr(cmd->ftr)->status = VIRTIO_BLK_S_IOERR;
-			cmd->state = VIRTQ_CMD_STATE_WRITE_STATUS;
+	ret = virtq_xfer_data_descs(cmd, descs + 1, cmd->num_desc - NUM_HDR_FTR_DESCS,
+				    true, &n_posted);
+	if (snap_unlikely(ret)) {
+		ERR_ON_CMD(cmd, "failed to write data, ret %d\n", ret);
+		to_blk_cmd_ftr(cmd->ftr)->status = VIRTIO_BLK_S_IOERR;
+		if (!n_posted)
 			return true;
-		}
-		virtq_mark_dirty_mem(cmd, to_blk_cmd_aux(cmd->aux)->descs[i + 1].addr,
-				     to_blk_cmd_aux(cmd->aux)->descs[i + 1].len, false);
-		offset += to_blk_cmd_aux(cmd->aux)->descs[i + 1].len;
-		cmd->total_in_len += to_blk_cmd_aux(cmd->aux)->descs[i + 1].len;
+		/* status is written once the posted writes are done */
+		++cmd->vq_priv->cmd_cntrs.outstanding_to_host;
+		return false;
 	}
+
+	for (i = 1; i < cmd->num_desc - 1; i++) {
+		virtq_mark_dirty_mem(cmd, descs[i].addr, descs[i].len, false);
+		cmd->total_in_len += descs[i].len;
+	}
+
+	if (!n_posted)
+		return true;
+
 	++cmd->vq_priv->cmd_cntrs.outstanding_to_host;
 	return false;
 }
@@ -959,33 +1091,20 @@ static void virtq_rel_req_mempool_buf(struct virtq_cmd *cmd)
  * virtq_rel_req_desc() - release aux in case of extra segs received
  * @cmd: Command being processed
  *
- * In case extra mem was allocated to accommodate unexpected segments,
- * at release extra memory is freed, and aux size is returned to regular init size
+ * In case a descriptor block was taken to accommodate unexpected segments,
+ * at release it is returned to the queue pool, and aux is returned to the
+ * regular init buffer
  *
- * Return: True if state machine is moved to error state (alloc error),
- *  false otherwise
+ * Return: false, the state machine is not moved
  */
 static bool virtq_rel_req_desc(struct virtq_cmd *cmd)
 {
-	bool repeat = false;
-
-	ibv_dereg_mr(cmd->aux_mr);
-	free(cmd->aux);
-	if (cmd->vq_priv->use_mem_pool) {
-		if (alloc_aux(cmd, cmd->vq_priv->seg_max)) {
-			ERR_ON_CMD(cmd, "failed to allocate memory for extra segments %d\n",
-				   cmd->vq_priv->seg_max);
-			cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
-			//alloc fail, move to error state
-			repeat = true;
-		}
-	} else {
-		cmd->aux = (struct blk_virtq_cmd_aux *)((uint8_t *)cmd->buf + cmd->req_size);
-		cmd->aux_mr = cmd->mr;
-	}
+	virtq_aux_pool_put(&cmd->vq_priv->aux_pool, cmd->aux, cmd->aux_mr);
+	cmd->aux = to_blk_virtq_cmd(cmd)->init_aux;
+	cmd->aux_mr = to_blk_virtq_cmd(cmd)->init_aux_mr;
 	cmd->use_seg_dmem = false;
 
-	return repeat;
+	return false;
 }
 
 /**
@@ -1061,8 +1180,11 @@ static struct virtq_impl_ops blk_impl_ops = {
 	.progress_suspend = blk_progress_suspend,
 	.mem_pool_release = virtq_rel_req_mempool_buf,
 	.seg_dmem = blk_seg_dmem,
+	.max_descs = blk_virtq_max_descs,
 	.seg_dmem_release = virtq_rel_req_desc,
 	.send_comp = virtq_tunnel_send_comp,
+	.bdev_submit = blk_virtq_bdev_submit,
+	.bdev_done = blk_virtq_bdev_done,
 };
 
 //sm array states must be according to the order of virtq_cmd_sm_state
@@ -1127,9 +1249,15 @@ struct blk_virtq_ctx *blk_virtq_create(struct snap_virtio_blk_ctrl_queue *vbq,
 	vq_ctx = calloc(1, sizeof(struct blk_virtq_ctx));
 	if (!vq_ctx)
 		goto err;
+	if (snap_qos_init(&vq_ctx->qos, &to_blk_ctrl(vbq->common.ctrl)->qos,
+			  snap_qos_ticks_hz()))
+		goto release_ctx;
+	snap_qos_set_limits(&vq_ctx->qos, &to_blk_ctrl(vbq->common.ctrl)->queue_qos,
+			    snap_qos_ticks());
+	TAILQ_INIT(&vq_ctx->qos_wait);
 	if (!virtq_ctx_init(&vq_ctx->common_ctx, attr,
 		    &ctx_attr))
-		goto release_ctx;
+		goto destroy_qos;
 
 	vq_priv = vq_ctx->common_ctx.priv;
 	vq_priv->custom_sm = &blk_sm;
@@ -1163,8 +1291,10 @@ struct blk_virtq_ctx *blk_virtq_create(struct snap_virtio_blk_ctrl_queue *vbq,
 		snap_error("failed to change virtq to READY state\n");
 		goto destroy_virtio_blk_queue;
 	}
-	if (to_common_queue_attr(vq_priv->vattr)->q_provider == SNAP_SW_Q_PROVIDER)
+	if (to_common_queue_attr(vq_priv->vattr)->q_provider == SNAP_SW_Q_PROVIDER) {
 		blk_impl_ops.send_comp = virtq_sw_send_comp;
+		vq_priv->q_poll = true;
+	}
 
 	if (to_common_queue_attr(vq_priv->vattr)->q_provider == SNAP_DPA_Q_PROVIDER) {
 		blk_impl_ops.send_comp = virtq_dpa_send_comp;
@@ -1181,6 +1311,8 @@ dealloc_cmd_arr:
 	free_blk_virtq_cmd_arr(vq_priv);
 release_priv:
 	virtq_ctx_destroy(vq_priv);
+destroy_qos:
+	snap_qos_destroy(&vq_ctx->qos);
 release_ctx:
 	free(vq_ctx);
 err:
@@ -1216,9 +1348,62 @@ void blk_virtq_destroy(struct blk_virtq_ctx *q)
 
 	free_blk_virtq_cmd_arr(vq_priv);
 	virtq_ctx_destroy(vq_priv);
+	snap_qos_destroy(&q->qos);
 	free(q);
 }
 
+/**
+ * blk_virtq_progress() - progress blk virtq
+ * @q:		queue to progress
+ * @thread_id:	id of the calling thread
+ *
+ * Resumes the commands that wait for QoS admission, in their order, as
+ * long as the limits allow, then progresses the queue.
+ *
+ * Context: Not thread safe
+ *
+ * Return: number of events handled
+ */
+int blk_virtq_progress(struct blk_virtq_ctx *q, int thread_id)
+{
+	struct virtq_priv *priv = q->common_ctx.priv;
+	struct blk_virtq_cmd *cmd;
+	uint64_t now;
+
+	if (snap_unlikely(!TAILQ_EMPTY(&q->qos_wait))) {
+		now = blk_virtq_qos_now(priv);
+		while ((cmd = TAILQ_FIRST(&q->qos_wait))) {
+			if (priv->swq_state == SW_VIRTQ_RUNNING &&
+			    !snap_qos_admit(&q->qos,
+					    blk_virtq_qos_bytes(&cmd->common_cmd),
+					    now))
+				break;
+			TAILQ_REMOVE(&q->qos_wait, cmd, qos_entry);
+			cmd->qos_admitted = true;
+			virtq_cmd_progress(&cmd->common_cmd, VIRTQ_CMD_SM_OP_OK);
+		}
+		priv->qos_throttled = !TAILQ_EMPTY(&q->qos_wait);
+		/* the flushed commands no longer hold up the sibling queues */
+		if (priv->swq_state != SW_VIRTQ_RUNNING)
+			snap_qos_cancel(&q->qos);
+	}
+
+	return virtq_progress(&q->common_ctx, thread_id);
+}
+
+/**
+ * blk_virtq_set_qos() - change the limits of the queue
+ * @q:		queue
+ * @limits:	new limits, zero for none
+ *
+ * Context: Can be called while the queue is progressed by another thread
+ */
+void blk_virtq_set_qos(struct blk_virtq_ctx *q,
+		       const struct snap_qos_limits *limits)
+{
+	snap_qos_set_limits(&q->qos, limits, snap_qos_ticks());
+}
+
 int blk_virtq_get_debugstat(struct blk_virtq_ctx *q,
 			    struct snap_virtio_queue_debugstat *q_debugstat)
 {
@@ -1337,6 +1522,145 @@ blk_virtq_get_io_stats(struct blk_virtq_ctx *q)
 	return io_stat;
 }
 
+/**
+ * blk_virtq_dwz_check() - validate discard or write zeroes segments
+ * @type:	VIRTIO_BLK_T_DISCARD or VIRTIO_BLK_T_WRITE_ZEROES
+ * @segs:	segments read from the host
+ * @n_segs:	number of segments
+ * @limits:	limits advertised in the device config
+ * @block_size:	bdev block size
+ * @num_blocks:	bdev number of blocks
+ *
+ * Unknown flags and the unmap flag on discard are not supported, as the
+ * virtio spec requires. Segments must not exceed the advertised limits and
+ * must cover whole blocks inside the bdev.
+ *
+ * Return: VIRTIO_BLK_S_OK, VIRTIO_BLK_S_UNSUPP or VIRTIO_BLK_S_IOERR
+ */
+uint8_t blk_virtq_dwz_check(uint32_t type,
+			    const struct virtio_blk_discard_write_zeroes *segs,
+			    int n_segs, const struct blk_virtq_dwz_limits *limits,
+			    uint32_t block_size, uint64_t num_blocks)
+{
+	uint32_t max_seg, max_sectors, sectors_per_block;
+	uint64_t end;
+	int i;
+
+	if (type == VIRTIO_BLK_T_DISCARD) {
+		max_seg = limits->max_discard_seg;
+		max_sectors = limits->max_discard_sectors;
+	} else {
+		max_seg = limits->max_write_zeroes_seg;
+		max_sectors = limits->max_write_zeroes_sectors;
+	}
+
+	if (!max_seg)
+		return VIRTIO_BLK_S_UNSUPP;
+
+	if (n_segs <= 0 || n_segs > max_seg)
+		return VIRTIO_BLK_S_IOERR;
+
+	sectors_per_block = snap_max(block_size / BDEV_SECTOR_SIZE, 1);
+	for (i = 0; i < n_segs; i++) {
+		if (segs[i].flags & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)
+			return VIRTIO_BLK_S_UNSUPP;
+		if (type == VIRTIO_BLK_T_DISCARD && segs[i].flags)
+			return VIRTIO_BLK_S_UNSUPP;
+		if (segs[i].num_sectors > max_sectors)
+			return VIRTIO_BLK_S_IOERR;
+		if (segs[i].sector % sectors_per_block ||
+		    segs[i].num_sectors % sectors_per_block)
+			return VIRTIO_BLK_S_IOERR;
+		end = segs[i].sector + segs[i].num_sectors;
+		if (end < segs[i].sector || end / sectors_per_block > num_blocks)
+			return VIRTIO_BLK_S_IOERR;
+	}
+
+	return VIRTIO_BLK_S_OK;
+}
+
+static void blk_virtq_dwz_seg_done(enum snap_bdev_op_status status,
+				   void *done_arg)
+{
+	struct blk_virtq_dwz_io *io = done_arg;
+
+	if (status != SNAP_BDEV_OP_SUCCESS)
+		io->failed = true;
+
+	if (--io->pending)
+		return;
+
+	io->done_ctx->cb(io->failed ? SNAP_BDEV_OP_IO_ERROR : SNAP_BDEV_OP_SUCCESS,
+			 io->done_ctx->user_arg);
+}
+
+/**
+ * blk_virtq_dwz_submit() - submit discard or write zeroes segments
+ * @io:		command context, must stay valid until @done_ctx is called
+ * @ops:	bdev operations
+ * @bdev:	bdev context
+ * @type:	VIRTIO_BLK_T_DISCARD or VIRTIO_BLK_T_WRITE_ZEROES
+ * @segs:	segments validated by blk_virtq_dwz_check()
+ * @n_segs:	number of segments
+ * @done_ctx:	called once, when all the segments are completed
+ * @thread_id:	thread the bdev operations are submitted from
+ *
+ * Every non empty segment is a bdev operation, segments may complete
+ * synchronously or asynchronously and in any order. The unmap flag of write
+ * zeroes is a hint, the blocks are always zeroed by the write_zeroes
+ * operation.
+ *
+ * Return: 0 if @done_ctx will be called, including when only some of the
+ * segments were submitted, -errno if nothing was submitted.
+ */
+int blk_virtq_dwz_submit(struct blk_virtq_dwz_io *io,
+			 struct snap_bdev_ops *ops, void *bdev, uint32_t type,
+			 const struct virtio_blk_discard_write_zeroes *segs,
+			 int n_segs, struct snap_bdev_io_done_ctx *done_ctx,
+			 int thread_id)
+{
+	int (*op)(void *ctx, uint64_t offset_blocks, uint64_t num_blocks,
+		  struct snap_bdev_io_done_ctx *done_ctx, int thread_id);
+	uint32_t sectors_per_block;
+	int i, ret = 0, n_submitted = 0;
+
+	op = type == VIRTIO_BLK_T_DISCARD ? ops->discard : ops->write_zeroes;
+	if (!op)
+		return -ENOTSUP;
+
+	sectors_per_block = snap_max(ops->get_block_size(bdev) / BDEV_SECTOR_SIZE, 1);
+	io->seg_ctx.cb = blk_virtq_dwz_seg_done;
+	io->seg_ctx.user_arg = io;
+	io->done_ctx = done_ctx;
+	io->failed = false;
+	/* keeps the command from completing while segments are submitted */
+	io->pending = 1;
+
+	for (i = 0; i < n_segs; i++) {
+		if (!segs[i].num_sectors)
+			continue;
+
+		io->pending++;
+		ret = op(bdev, segs[i].sector / sectors_per_block,
+			 segs[i].num_sectors / sectors_per_block,
+			 &io->seg_ctx, thread_id);
+		if (ret) {
+			snap_error("failed to submit segment %d of %d, ret %d\n",
+				   i, n_segs, ret);
+			io->pending--;
+			io->failed = true;
+			break;
+		}
+		n_submitted++;
+	}
+
+	if (ret && !n_submitted)
+		return ret;
+
+	blk_virtq_dwz_seg_done(SNAP_BDEV_OP_SUCCESS, io);
+	return 0;
+}
+
 inline struct blk_virtq_ctx *to_blk_ctx(void *ctx)
 {
 	return (struct blk_virtq_ctx *)ctx;
@@ -15,14 +15,63 @@
 
 #include "snap.h"
 #include <sys/uio.h>
+#include <linux/virtio_blk.h>
 #include "snap_blk_ops.h"
 #include "snap_virtio_common_ctrl.h"
 #include "snap_virtio_blk.h"
 #include "virtq_common.h"
+#include "snap_qos.h"
 
+/**
+ * struct blk_virtq_dwz_limits - discard and write zeroes limits
+ * @max_discard_sectors:	max sectors in a discard segment
+ * @max_discard_seg:		max segments in a discard command
+ * @max_write_zeroes_sectors:	max sectors in a write zeroes segment
+ * @max_write_zeroes_seg:	max segments in a write zeroes command
+ *
+ * Limits advertised in the device config. Zero segments means that the
+ * feature was not negotiated and commands of this type are not supported.
+ */
+struct blk_virtq_dwz_limits {
+	uint32_t max_discard_sectors;
+	uint32_t max_discard_seg;
+	uint32_t max_write_zeroes_sectors;
+	uint32_t max_write_zeroes_seg;
+};
+
+/**
+ * struct blk_virtq_dwz_io - discard or write zeroes command in flight
+ * @seg_ctx:	completion context given to the bdev for every segment
+ * @done_ctx:	completion context of the command
+ * @pending:	segments not completed yet
+ * @failed:	one of the segments failed
+ *
+ * A command carries several segments, each one is a bdev operation. The
+ * command completes once, when the last segment completes.
+ */
+struct blk_virtq_dwz_io {
+	struct snap_bdev_io_done_ctx seg_ctx;
+	struct snap_bdev_io_done_ctx *done_ctx;
+	int pending;
+	bool failed;
+};
+
+struct blk_virtq_cmd;
+
+/**
+ * struct blk_virtq_ctx - virtio-blk queue
+ * @common_ctx:	common virtq context
+ * @io_stat:	IO statistics
+ * @dwz_limits:	discard and write zeroes limits
+ * @qos:	queue limits, the controller limits are its parent
+ * @qos_wait:	commands waiting for admission, oldest first
+ */
 struct blk_virtq_ctx {
 	struct virtq_common_ctx common_ctx;
 	struct snap_virtio_ctrl_queue_stats io_stat;
+	struct blk_virtq_dwz_limits dwz_limits;
+	struct snap_qos qos;
+	TAILQ_HEAD(, blk_virtq_cmd) qos_wait;
 };
 
 struct snap_virtio_blk_ctrl_queue;
@@ -34,6 +83,8 @@ void blk_virtq_destroy(struct blk_virtq_ctx *q);
 void blk_virtq_start(struct blk_virtq_ctx *q,
 		     struct virtq_start_attr *attr);
 int blk_virtq_progress(struct blk_virtq_ctx *q, int thread_id);
+void blk_virtq_set_qos(struct blk_virtq_ctx *q,
+		       const struct snap_qos_limits *limits);
 int blk_virtq_get_debugstat(struct blk_virtq_ctx *q,
 			    struct snap_virtio_queue_debugstat *q_debugstat);
 int blk_virtq_query_error_state(struct blk_virtq_ctx *q,
@@ -45,6 +96,15 @@ int blk_virtq_get_state(struct blk_virtq_ctx *q,
 const struct snap_virtio_ctrl_queue_stats *
 blk_virtq_get_io_stats(struct blk_virtq_ctx *q);
 struct blk_virtq_ctx *to_blk_ctx(void *ctx);
+uint8_t blk_virtq_dwz_check(uint32_t type,
+			    const struct virtio_blk_discard_write_zeroes *segs,
+			    int n_segs, const struct blk_virtq_dwz_limits *limits,
+			    uint32_t block_size, uint64_t num_blocks);
+int blk_virtq_dwz_submit(struct blk_virtq_dwz_io *io,
+			 struct snap_bdev_ops *ops, void *bdev, uint32_t type,
+			 const struct virtio_blk_discard_write_zeroes *segs,
+			 int n_segs, struct snap_bdev_io_done_ctx *done_ctx,
+			 int thread_id);
 /* debug */
 struct snap_dma_q *get_dma_q(struct blk_virtq_ctx *ctx);
 int set_dma_mkey(struct blk_virtq_ctx *ctx, uint32_t mkey);
@@ -19,6 +19,14 @@
 #include "snap_vq_adm.h"
 #include "snap_dp_map.h"
 #include "snap_virtio_state.h"
+#include "snap_env.h"
+#include "snap_qos.h"
+#include "snap_buf.h"
+
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_VIRTQ_DESC_PREFETCH, 8);
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_VIRTQ_COMP_BATCH, 32);
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_VIRTQ_COMP_DELAY, 0);
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_VIRTQ_AUX_POOL, 16);
 
 int snap_virtio_ctrl_state_size_v2(struct snap_virtio_ctrl *ctrl, size_t *common_cfg_len,
 				size_t *queue_cfg_len, size_t *dev_cfg_len);
@@ -48,6 +56,9 @@ int snap_virtio_ctrl_state_size_v2(struct snap_virtio_ctrl *ctrl, size_t *common
 #define SNAP_VIRTIO_CTRL_LIVE_DETECTED(vctrl) \
 		!!(vctrl->bar_curr->status & SNAP_VIRTIO_DEVICE_S_DRIVER_OK)
 
+/* commands an idle poll group thread takes from a busy queue at once */
+#define SNAP_VIRTIO_CTRL_STEAL_BATCH 4
+
 /**
  * snap_virtio_ctrl_critical_bar_change_detected
  * @ctrl:	virtio controller
@@ -263,6 +274,14 @@ static void snap_virtio_ctrl_sched_q_nolock(struct snap_virtio_ctrl *ctrl,
 	vq->pg = pg;
 	if (ctrl->q_ops->start)
 		ctrl->q_ops->start(vq);
+
+	vq->event_fd = ctrl->q_ops->get_event_fd ?
+		       ctrl->q_ops->get_event_fd(vq) : -1;
+	if (vq->event_fd >= 0 && snap_pg_idle_add_fd(pg->idle, vq->event_fd)) {
+		snap_warn("ctrl %p queue %d: pg_id %d cannot sleep on its notifications\n",
+			  ctrl, vq->index, pg->id);
+		vq->event_fd = -1;
+	}
 }
 
 static void snap_virtio_ctrl_sched_q(struct snap_virtio_ctrl *ctrl,
@@ -272,10 +291,10 @@ static void snap_virtio_ctrl_sched_q(struct snap_virtio_ctrl *ctrl,
 
 	pg = snap_pg_get_next(&ctrl->pg_ctx);
 
-	pthread_spin_lock(&pg->lock);
+	snap_pg_suspend(pg);
 	snap_virtio_ctrl_sched_q_nolock(ctrl, vq, pg);
 	snap_debug("Virtio queue polling group id = %d\n", vq->pg->id);
-	pthread_spin_unlock(&pg->lock);
+	snap_pg_resume(pg);
 }
 
 static void snap_virtio_ctrl_desched_q_nolock(struct snap_virtio_ctrl_queue *vq)
@@ -287,6 +306,9 @@ static void snap_virtio_ctrl_desched_q_nolock(struct snap_virtio_ctrl_queue *vq)
 
 	TAILQ_REMOVE(&pg->q_list, &vq->pg_q, entry);
 	snap_pg_usage_decrease(vq->pg->id);
+	if (vq->event_fd >= 0)
+		snap_pg_idle_del_fd(pg->idle, vq->event_fd);
+	vq->event_fd = -1;
 	vq->pg = NULL;
 }
 
@@ -297,9 +319,9 @@ static void snap_virtio_ctrl_desched_q(struct snap_virtio_ctrl_queue *vq)
 	if (!pg)
 		return;
 
-	pthread_spin_lock(&pg->lock);
+	snap_pg_suspend(pg);
 	snap_virtio_ctrl_desched_q_nolock(vq);
-	pthread_spin_unlock(&pg->lock);
+	snap_pg_resume(pg);
 }
 
 static struct snap_virtio_ctrl_queue*
@@ -314,6 +336,7 @@ snap_virtio_ctrl_queue_create(struct snap_virtio_ctrl *ctrl, int index)
 	vq->ctrl = ctrl;
 	vq->index = index;
 	vq->log_writes_to_host = ctrl->log_writes_to_host;
+	vq->event_fd = -1;
 
 	if (!snap_virtio_ctrl_is_suspended(ctrl))
 		snap_virtio_ctrl_sched_q(ctrl, vq);
@@ -325,6 +348,7 @@ static void snap_virtio_ctrl_queue_destroy(struct snap_virtio_ctrl_queue *vq)
 {
 	struct snap_virtio_ctrl *ctrl = vq->ctrl;
 
+	snap_pg_q_migration_cancel(&ctrl->pg_ctx, &vq->pg_q);
 	snap_virtio_ctrl_desched_q(vq);
 	ctrl->q_ops->destroy(vq);
 }
@@ -753,8 +777,11 @@ int snap_virtio_ctrl_suspend(struct snap_virtio_ctrl *ctrl)
 
 	snap_pgs_suspend(&ctrl->pg_ctx);
 	for (i = 0; i < ctrl->max_queues; i++) {
-		if (ctrl->queues[i])
-			ctrl->q_ops->suspend(ctrl->queues[i]);
+		if (!ctrl->queues[i])
+			continue;
+		/* queues resume in their current poll group */
+		snap_pg_q_migration_cancel(&ctrl->pg_ctx, &ctrl->queues[i]->pg_q);
+		ctrl->q_ops->suspend(ctrl->queues[i]);
 	}
 	snap_pgs_resume(&ctrl->pg_ctx);
 
@@ -940,6 +967,106 @@ void snap_virtio_ctrl_progress_unlock(struct snap_virtio_ctrl *ctrl)
 	pthread_mutex_unlock(&ctrl->progress_lock);
 }
 
+static void snap_virtio_ctrl_migrate_q_nolock(struct snap_virtio_ctrl *ctrl,
+					     struct snap_virtio_ctrl_queue *vq)
+{
+	struct snap_pg *src = vq->pg, *dst = vq->pg_q.migrate_to;
+	int ret;
+
+	/* all commands fetched by the old thread are done */
+	ret = ctrl->q_ops->resume(vq);
+	if (ret) {
+		snap_error("ctrl %p queue %d: resume failed, cannot move it to pg_id %d\n",
+			   ctrl, vq->index, dst->id);
+		snap_pg_q_migration_cancel(&ctrl->pg_ctx, &vq->pg_q);
+		return;
+	}
+
+	snap_virtio_ctrl_desched_q_nolock(vq);
+	snap_virtio_ctrl_sched_q_nolock(ctrl, vq, dst);
+	snap_pg_q_migrated(&ctrl->pg_ctx, &vq->pg_q);
+	snap_info("ctrl %p queue %d: moved from pg_id %d to pg_id %d\n",
+		  ctrl, vq->index, src->id, dst->id);
+}
+
+/*
+ * Queues are moved between poll groups by the suspend and resume used for
+ * the controller suspend: the suspend drains the commands in flight, the
+ * resume continues from the same ring indexes and the queue is started in
+ * the new poll group, so no command is lost or handled by two threads.
+ */
+static void snap_virtio_ctrl_progress_rebalance(struct snap_virtio_ctrl *ctrl)
+{
+	struct snap_pg_ctx *ctx = &ctrl->pg_ctx;
+	struct snap_virtio_ctrl_queue *vq;
+	uint64_t now = snap_qos_ticks();
+	bool sample;
+	int i;
+
+	/* the threads are only stopped once per period or to move queues */
+	sample = snap_pgs_rebalance_enabled(ctx) && snap_pgs_sample_due(ctx, now);
+	if (!ctx->migrating && !sample)
+		return;
+
+	if (!ctrl->q_ops->suspend || !ctrl->q_ops->resume)
+		return;
+
+	snap_pgs_suspend(ctx);
+	for (i = 0; ctx->migrating && i < ctrl->max_queues; i++) {
+		vq = ctrl->queues[i];
+		if (vq && vq->pg_q.migrate_to && ctrl->q_ops->is_suspended(vq))
+			snap_virtio_ctrl_migrate_q_nolock(ctrl, vq);
+	}
+
+	if (sample && snap_pgs_sample(ctx, now) &&
+	    ctrl->state == SNAP_VIRTIO_CTRL_STARTED &&
+	    snap_pgs_rebalance(ctx)) {
+		for (i = 0; i < ctrl->max_queues; i++) {
+			vq = ctrl->queues[i];
+			if (!vq || !vq->pg_q.migrate_to)
+				continue;
+			snap_info("ctrl %p queue %d: moving from pg_id %d to pg_id %d\n",
+				  ctrl, vq->index, vq->pg->id,
+				  vq->pg_q.migrate_to->id);
+			ctrl->q_ops->suspend(vq);
+		}
+	}
+	snap_pgs_resume(ctx);
+}
+
+/**
+ * snap_virtio_ctrl_set_pg_rebalance() - set poll group rebalancing policy
+ * @ctrl:	virtio controller
+ * @attr:	policy, a zero period disables rebalancing
+ *
+ * Queues that are already moving finish their move.
+ */
+void snap_virtio_ctrl_set_pg_rebalance(struct snap_virtio_ctrl *ctrl,
+				       const struct snap_pg_rebalance_attr *attr)
+{
+	snap_virtio_ctrl_progress_lock(ctrl);
+	snap_pgs_suspend(&ctrl->pg_ctx);
+	snap_pgs_set_rebalance(&ctrl->pg_ctx, attr);
+	snap_pgs_resume(&ctrl->pg_ctx);
+	snap_virtio_ctrl_progress_unlock(ctrl);
+}
+
+/**
+ * snap_virtio_ctrl_set_pg_idle() - set idle policy of the poll group threads
+ * @ctrl:	virtio controller
+ * @attr:	policy, a zero spin keeps the threads polling
+ *
+ * Threads that call snap_virtio_ctrl_pg_io_progress() sleep when their
+ * queues are idle. The policy is shared by the controllers progressed by
+ * the same threads, and a thread sleeps only if all of its queues can
+ * notify it.
+ */
+void snap_virtio_ctrl_set_pg_idle(struct snap_virtio_ctrl *ctrl,
+				  const struct snap_pg_idle_attr *attr)
+{
+	snap_pgs_set_idle(&ctrl->pg_ctx, attr);
+}
+
 /**
  * snap_virtio_ctrl_progress() - progress virtio controller
  * @ctrl:   virtio controller
@@ -988,6 +1115,8 @@ void snap_virtio_ctrl_progress(struct snap_virtio_ctrl *ctrl)
 	if (ctrl->bar_curr->num_of_vfs != ctrl->bar_prev->num_of_vfs)
 		snap_virtio_ctrl_change_num_vfs(ctrl);
 
+	snap_virtio_ctrl_progress_rebalance(ctrl);
+
 out:
 	snap_virtio_ctrl_progress_unlock(ctrl);
 }
@@ -1013,22 +1142,126 @@ static int snap_virtio_ctrl_pg_thread_io_progress(
 	struct snap_pg *pg = &ctrl->pg_ctx.pgs[pg_id];
 	struct snap_virtio_ctrl_queue *vq;
 	struct snap_pg_q_entry *pg_q;
-	int n = 0;
+	uint64_t start, end;
+	bool account;
+	int n = 0, qn;
+
+	if (!snap_pg_poll_begin(pg))
+		goto out;
 
-	pthread_spin_lock(&pg->lock);
+	account = snap_pgs_rebalance_enabled(&ctrl->pg_ctx);
+	pg->now = start = snap_qos_ticks();
 	TAILQ_FOREACH(pg_q, &pg->q_list, entry) {
 		vq = pg_q_entry_to_virtio_ctrl_queue(pg_q);
 		vq->thread_id = thread_id;
-		n += snap_virtio_ctrl_queue_progress(vq);
+		qn = snap_virtio_ctrl_queue_progress(vq);
+		n += qn;
+		if (!account)
+			continue;
+		/* polling an idle queue is not counted as busy */
+		end = snap_qos_ticks();
+		if (qn > 0)
+			snap_pg_q_account(pg, pg_q, end - start, qn);
+		start = end;
+	}
+out:
+	snap_pg_poll_end(pg);
+	return n;
+}
+
+static int snap_virtio_ctrl_queue_arm(struct snap_pg_q_entry *pg_q)
+{
+	struct snap_virtio_ctrl_queue *vq = pg_q_entry_to_virtio_ctrl_queue(pg_q);
+
+	if (vq->event_fd < 0)
+		return -ENOTSUP;
+	return vq->ctrl->q_ops->arm(vq);
+}
+
+/*
+ * An idle thread takes a few commands from the first busy queue it finds in
+ * the other poll groups, starting with the next one so that the threads do
+ * not all go after the same group.
+ */
+static int snap_virtio_ctrl_pg_steal(struct snap_virtio_ctrl *ctrl, int pg_id)
+{
+	struct snap_pg_ctx *ctx = &ctrl->pg_ctx;
+	struct snap_pg_q_entry *pg_q;
+	struct snap_pg *pg;
+	int i, n = 0;
+
+	for (i = 1; i < ctx->npgs && !n; i++) {
+		pg = &ctx->pgs[(pg_id + i) % ctx->npgs];
+		if (!snap_pg_steal_begin(pg))
+			continue;
+		TAILQ_FOREACH(pg_q, &pg->q_list, entry) {
+			n = ctrl->q_ops->steal(pg_q_entry_to_virtio_ctrl_queue(pg_q),
+					       pg_id, SNAP_VIRTIO_CTRL_STEAL_BATCH);
+			if (n)
+				break;
+		}
+		snap_pg_steal_end(pg);
 	}
-	pthread_spin_unlock(&pg->lock);
 
 	return n;
 }
 
+/**
+ * snap_virtio_ctrl_pg_io_progress() - progress queues of a poll group
+ * @ctrl:	virtio controller
+ * @pg_id:	poll group id, also the id of the calling thread
+ *
+ * With work stealing, see &snap_virtio_ctrl_attr.pg_steal, a thread whose
+ * queues are idle submits commands of the queues of other poll groups.
+ * Completions of backend operations submitted by the thread, its own or
+ * stolen ones, count as work of the pass. With an idle policy, see
+ * snap_virtio_ctrl_set_pg_idle(), the thread may sleep in the call once it
+ * had no work for a while.
+ *
+ * Return: number of events handled
+ */
 int snap_virtio_ctrl_pg_io_progress(struct snap_virtio_ctrl *ctrl, int pg_id)
 {
-	return snap_virtio_ctrl_pg_thread_io_progress(ctrl, pg_id, pg_id);
+	struct snap_pg *pg = &ctrl->pg_ctx.pgs[pg_id];
+	int n;
+
+	n = snap_virtio_ctrl_pg_thread_io_progress(ctrl, pg_id, pg_id);
+	if (!n && ctrl->pg_ctx.steal)
+		n = snap_virtio_ctrl_pg_steal(ctrl, pg_id);
+	if (ctrl->q_ops->bdev_progress)
+		n += ctrl->q_ops->bdev_progress(ctrl, pg_id);
+	if (snap_unlikely(snap_pg_idle_pass(pg->idle, n)))
+		snap_pg_idle_sleep(pg->idle);
+	return n;
+}
+
+/**
+ * snap_virtio_ctrl_pg_online() - progress a poll group without locking
+ * @ctrl:	virtio controller
+ * @pg_id:	poll group id
+ *
+ * Must be called by the thread that calls snap_virtio_ctrl_pg_io_progress()
+ * for @pg_id. From now on the thread takes no lock to progress the poll
+ * group, the controller waits for the end of its current pass instead
+ * when it changes the queues of the group. The thread must keep calling
+ * snap_virtio_ctrl_pg_io_progress() until snap_virtio_ctrl_pg_offline().
+ */
+void snap_virtio_ctrl_pg_online(struct snap_virtio_ctrl *ctrl, int pg_id)
+{
+	snap_pg_online(&ctrl->pg_ctx.pgs[pg_id]);
+}
+
+/**
+ * snap_virtio_ctrl_pg_offline() - progress a poll group with locking
+ * @ctrl:	virtio controller
+ * @pg_id:	poll group id
+ *
+ * Must be called by the poll group thread before it stops calling
+ * snap_virtio_ctrl_pg_io_progress() for @pg_id.
+ */
+void snap_virtio_ctrl_pg_offline(struct snap_virtio_ctrl *ctrl, int pg_id)
+{
+	snap_pg_offline(&ctrl->pg_ctx.pgs[pg_id]);
 }
 
 int snap_virtio_ctrl_io_progress(struct snap_virtio_ctrl *ctrl)
@@ -1038,6 +1271,8 @@ int snap_virtio_ctrl_io_progress(struct snap_virtio_ctrl *ctrl)
 
 	for (i = 0; i < ctrl->pg_ctx.npgs; i++)
 		n += snap_virtio_ctrl_pg_thread_io_progress(ctrl, i, -1);
+	if (ctrl->q_ops->bdev_progress)
+		n += ctrl->q_ops->bdev_progress(ctrl, -1);
 
 	return n;
 }
@@ -1122,6 +1357,13 @@ int snap_virtio_ctrl_open(struct snap_virtio_ctrl *ctrl,
 		ret = -EINVAL;
 		goto free_queues;
 	}
+	snap_pgs_set_rebalance(&ctrl->pg_ctx, &attr->pg_rebalance);
+	if (q_ops->arm)
+		ctrl->pg_ctx.q_arm = snap_virtio_ctrl_queue_arm;
+	/* keep the policy other controllers set for the threads */
+	if (attr->pg_idle.spin)
+		snap_pgs_set_idle(&ctrl->pg_ctx, &attr->pg_idle);
+	ctrl->pg_ctx.steal = attr->pg_steal && q_ops->steal && npgs > 1;
 
 	cm_attr.vtunnel = ctrl->sdev->mdev.vtunnel;
 	cm_attr.dma_rkey = ctrl->sdev->dma_rkey;
@@ -1134,10 +1376,16 @@ int snap_virtio_ctrl_open(struct snap_virtio_ctrl *ctrl,
 		goto free_pgs;
 	}
 
+	ret = snap_buf_pool_acquire(ctrl->lb_pd);
+	if (ret)
+		goto destroy_xmkey;
+
 	ctrl->type = attr->type;
 	ctrl->force_in_order = attr->force_in_order;
 	return 0;
 
+destroy_xmkey:
+	(void)snap_destroy_cross_mkey(ctrl->xmkey);
 free_pgs:
 	snap_pgs_free(&ctrl->pg_ctx);
 free_queues:
@@ -1174,6 +1422,8 @@ void snap_virtio_ctrl_close(struct snap_virtio_ctrl *ctrl)
 	snap_virtio_ctrl_bars_teardown(ctrl);
 	if (!ctrl->pending_flr)
 		snap_close_device(ctrl->sdev);
+	/* registered buffers of the app owned pd must not outlive the controller */
+	snap_buf_pool_release(ctrl->lb_pd);
 }
 
 /**
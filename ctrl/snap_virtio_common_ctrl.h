@@ -19,10 +19,58 @@
 #include "snap.h"
 #include "snap_virtio_common.h"
 #include "snap_poll_groups.h"
+#include "snap_env.h"
+
+#define SNAP_VIRTQ_DESC_PREFETCH "SNAP_VIRTQ_DESC_PREFETCH"
+#define SNAP_VIRTQ_DESC_PREFETCH_MAX 64
+#define SNAP_VIRTQ_COMP_BATCH "SNAP_VIRTQ_COMP_BATCH"
+#define SNAP_VIRTQ_COMP_DELAY "SNAP_VIRTQ_COMP_DELAY"
+#define SNAP_VIRTQ_AUX_POOL "SNAP_VIRTQ_AUX_POOL"
+#define SNAP_VIRTQ_AUX_POOL_INIT 2
 
 struct snap_virtio_ctrl;
 struct snap_virtio_ctrl_queue;
 
+/* number of descriptors read at once when a chain is fetched from host */
+static inline uint16_t snap_virtio_ctrl_desc_prefetch(void)
+{
+	long long val = snap_env_getenv(SNAP_VIRTQ_DESC_PREFETCH);
+
+	if (val < 1)
+		return 1;
+	return snap_min(val, SNAP_VIRTQ_DESC_PREFETCH_MAX);
+}
+
+/* max number of used ring updates written to host at once, 1 disables */
+static inline uint16_t snap_virtio_ctrl_comp_batch(uint16_t queue_size)
+{
+	long long val = snap_env_getenv(SNAP_VIRTQ_COMP_BATCH);
+
+	if (val < 1)
+		return 1;
+	return snap_min(val, queue_size);
+}
+
+/* number of progress calls a used ring update may be held back */
+static inline uint16_t snap_virtio_ctrl_comp_delay(void)
+{
+	long long val = snap_env_getenv(SNAP_VIRTQ_COMP_DELAY);
+
+	if (val < 0)
+		return 0;
+	return snap_min(val, UINT16_MAX);
+}
+
+/* max number of long chain descriptor blocks kept by a queue */
+static inline int snap_virtio_ctrl_aux_pool(uint16_t queue_size)
+{
+	long long val = snap_env_getenv(SNAP_VIRTQ_AUX_POOL);
+
+	if (val < 0)
+		return 0;
+	return snap_min(val, queue_size);
+}
+
 enum snap_virtio_ctrl_type {
 	SNAP_VIRTIO_BLK_CTRL,
 	SNAP_VIRTIO_NET_CTRL,
@@ -114,6 +162,10 @@ struct snap_virtio_ctrl_attr {
 	struct snap_virtio_ctrl_bar_cbs *bar_cbs;
 	struct ibv_pd *pd;
 	uint32_t npgs;
+	struct snap_pg_rebalance_attr pg_rebalance;
+	struct snap_pg_idle_attr pg_idle;
+	/* idle poll group threads submit commands of busy queues */
+	bool pg_steal;
 	bool force_in_order;
 	bool suspended;
 	bool recover;
@@ -132,6 +184,8 @@ struct snap_virtio_ctrl_queue {
 
 	TAILQ_ENTRY(snap_virtio_ctrl_queue) entry;
 	int thread_id;
+	/* notification source in the idle state of the poll group, or -1 */
+	int event_fd;
 };
 
 struct snap_virtio_ctrl_queue_counter {
@@ -163,6 +217,8 @@ struct snap_virtio_ctrl_queue_stats {
 	struct snap_virtio_ctrl_queue_counter read;
 	struct snap_virtio_ctrl_queue_counter write;
 	struct snap_virtio_ctrl_queue_counter flush;
+	struct snap_virtio_ctrl_queue_counter discard;
+	struct snap_virtio_ctrl_queue_counter write_zeroes;
 	struct snap_virtio_ctrl_queue_out_counter outstanding;
 };
 
@@ -181,6 +237,11 @@ struct snap_virtio_queue_ops {
 			 struct snap_virtio_ctrl_queue_state *state);
 	const struct snap_virtio_ctrl_queue_stats *
 			(*get_io_stats)(struct snap_virtio_ctrl_queue *queue);
+	int (*arm)(struct snap_virtio_ctrl_queue *queue);
+	int (*get_event_fd)(struct snap_virtio_ctrl_queue *queue);
+	int (*steal)(struct snap_virtio_ctrl_queue *queue, int pg_id, int max);
+	/* completes backend operations submitted by the calling thread */
+	int (*bdev_progress)(struct snap_virtio_ctrl *ctrl, int thread_id);
 };
 
 struct snap_virtio_ctrl_bar_ops {
@@ -260,6 +321,12 @@ void snap_virtio_ctrl_progress_lock(struct snap_virtio_ctrl *ctrl);
 void snap_virtio_ctrl_progress_unlock(struct snap_virtio_ctrl *ctrl);
 int snap_virtio_ctrl_io_progress(struct snap_virtio_ctrl *ctrl);
 int snap_virtio_ctrl_pg_io_progress(struct snap_virtio_ctrl *ctrl, int pg_id);
+void snap_virtio_ctrl_pg_online(struct snap_virtio_ctrl *ctrl, int pg_id);
+void snap_virtio_ctrl_pg_offline(struct snap_virtio_ctrl *ctrl, int pg_id);
+void snap_virtio_ctrl_set_pg_rebalance(struct snap_virtio_ctrl *ctrl,
+				       const struct snap_pg_rebalance_attr *attr);
+void snap_virtio_ctrl_set_pg_idle(struct snap_virtio_ctrl *ctrl,
+				  const struct snap_pg_idle_attr *attr);
 int snap_virtio_ctrl_open(struct snap_virtio_ctrl *ctrl,
 			  struct snap_virtio_ctrl_bar_ops *bar_ops,
 			  struct snap_virtio_queue_ops *q_ops,
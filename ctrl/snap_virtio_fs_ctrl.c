@@ -31,7 +31,8 @@ struct virtio_fs_config {
 } __attribute__((packed));
 #endif
 
-#define SNAP_VIRTIO_FS_MODIFIABLE_FTRS (1ULL << VIRTIO_F_VERSION_1)
+#define SNAP_VIRTIO_FS_MODIFIABLE_FTRS ((1ULL << VIRTIO_F_VERSION_1) |\
+					(1ULL << VIRTIO_F_IN_ORDER))
 #define SNAP_VIRTIO_FS_SEG_SIZE_MAX (4096)
 
 
@@ -543,6 +544,7 @@ static int fs_virtq_create_helper(struct snap_virtio_fs_ctrl_queue *vfsq,
 	attr.msix_vector = vfsq->attr->vattr.msix_vector;
 	attr.virtio_version_1_0 = vfsq->attr->vattr.virtio_version_1_0;
 	attr.force_in_order = fs_ctrl->common.force_in_order;
+	attr.in_order = !!(vctrl->bar_curr->driver_feature & (1ULL << VIRTIO_F_IN_ORDER));
 
 	attr.hw_available_index = vfsq->attr->hw_available_index;
 	attr.hw_used_index = vfsq->attr->hw_used_index;
@@ -475,6 +475,10 @@ static int fs_seg_dmem(struct virtq_cmd *cmd)
 	return 0;
 }
 
+static uint32_t fs_virtq_max_descs(struct virtq_cmd *cmd)
+{
+	return cmd->vq_priv->seg_max;
+}
 
 /**
  * fs_virtq_process_desc() - Handle descriptors received
@@ -871,6 +875,7 @@ static const struct virtq_impl_ops fs_impl_ops = {
 	.progress_suspend	= fs_progress_suspend,
 	.mem_pool_release	= NULL,
 	.seg_dmem		= fs_seg_dmem,
+	.max_descs		= fs_virtq_max_descs,
 	.seg_dmem_release	= NULL,
 	.send_comp = virtq_tunnel_send_comp,
 };
@@ -974,9 +979,8 @@ struct fs_virtq_ctx *fs_virtq_create(struct snap_virtio_fs_ctrl_queue *vfsq,
 		goto destroy_virtio_fs_queue;
 	}
 
-	vq_priv->force_in_order = attr->force_in_order;
 	snap_debug("created VIRTQ %d successfully in_order %d\n", attr->idx,
-		   attr->force_in_order);
+		   vq_priv->force_in_order);
 	return vq_ctx;
 
 destroy_virtio_fs_queue:
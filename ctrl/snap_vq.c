@@ -32,6 +32,11 @@ enum snap_vq_hwq_modify {
 
 static void snap_vq_cmd_process(struct snap_vq_cmd *cmd);
 
+static inline bool snap_vq_is_packed(const struct snap_vq *q)
+{
+	return q->op_flags & SNAP_VQ_OP_FLAGS_PACKED_RING;
+}
+
 static void snap_vq_cmd_prefetch_header(struct snap_vq_cmd *cmd)
 {
 	if (snap_likely(cmd->vq->cmd_ops->prefetch))
@@ -50,6 +55,7 @@ snap_vq_desc_pool_get(struct snap_vq *q)
 
 	desc = TAILQ_FIRST(&q->desc_pool.free_descs);
 	TAILQ_REMOVE(&q->desc_pool.free_descs, desc, entry);
+	q->desc_pool.n_free--;
 
 	return desc;
 }
@@ -58,6 +64,7 @@ static inline void snap_vq_desc_pool_put(struct snap_vq *q,
 					struct snap_vq_cmd_desc *desc)
 {
 	TAILQ_INSERT_HEAD(&q->desc_pool.free_descs, desc, entry);
+	q->desc_pool.n_free++;
 }
 
 static inline struct snap_vq_cmd_desc *snap_vq_cmd_desc_get(struct snap_vq_cmd *cmd)
@@ -81,6 +88,16 @@ static inline void snap_vq_cmd_desc_put(struct snap_vq_cmd *cmd)
 	snap_vq_desc_pool_put(cmd->vq, desc);
 }
 
+static inline void snap_vq_cmd_desc_put_last(struct snap_vq_cmd *cmd)
+{
+	struct snap_vq_cmd_desc *desc;
+
+	cmd->num_descs--;
+	desc = TAILQ_LAST(&cmd->descs, snap_vq_cmd_desc_list);
+	TAILQ_REMOVE(&cmd->descs, desc, entry);
+	snap_vq_desc_pool_put(cmd->vq, desc);
+}
+
 static void snap_vq_cmd_fetch_next_desc_done(struct snap_dma_completion *self,
 						int status)
 {
@@ -94,21 +111,69 @@ static void snap_vq_cmd_fetch_next_desc_done(struct snap_dma_completion *self,
 		snap_vq_cmd_fatal(cmd);
 }
 
+/*
+ * Chained descriptors usually occupy consecutive ring slots. Up to
+ * desc_prefetch of them are read in one batch, and the ones that turn out
+ * not to belong to the chain are dropped when the batch completes. Once
+ * the chain jumps out of the batch, it is read one descriptor at a time.
+ */
+static void snap_vq_cmd_desc_window_trim(struct snap_vq_cmd *cmd)
+{
+	struct snap_vq_cmd_desc *desc;
+	uint16_t idx = cmd->desc_window_idx;
+	int i, n = cmd->desc_window;
+
+	desc = TAILQ_LAST(&cmd->descs, snap_vq_cmd_desc_list);
+	for (i = 1; i < n; i++)
+		desc = TAILQ_PREV(desc, snap_vq_cmd_desc_list, entry);
+
+	for (i = 1; i < n; i++) {
+		idx = (idx + 1) % cmd->vq->size;
+		if (!(desc->desc.flags & VRING_DESC_F_NEXT))
+			break;
+		if (desc->desc.next != idx) {
+			cmd->desc_prefetch_off = true;
+			break;
+		}
+		desc = TAILQ_NEXT(desc, entry);
+	}
+
+	for (; i < n; i++)
+		snap_vq_cmd_desc_put_last(cmd);
+	cmd->desc_window = 0;
+}
+
 static void snap_vq_cmd_fetch_next_desc(struct snap_vq_cmd *cmd)
 {
+	struct snap_dma_op ops[SNAP_VIRTQ_DESC_PREFETCH_MAX];
 	struct snap_vq_cmd_desc *last;
 	struct snap_vq_cmd_desc *next;
-	uint64_t next_addr;
+	uint16_t idx;
+	int i, n = 1;
 	int ret;
 
 	last = TAILQ_LAST(&cmd->descs, snap_vq_cmd_desc_list);
-	next = snap_vq_cmd_desc_get(cmd);
-	next_addr = cmd->vq->desc_pa + last->desc.next * sizeof(next->desc);
+	idx = last->desc.next % cmd->vq->size;
+	if (!cmd->desc_prefetch_off)
+		n = snap_max(1, snap_min(cmd->vq->desc_prefetch,
+					 cmd->vq->desc_pool.n_free));
+
+	for (i = 0; i < n; i++) {
+		next = snap_vq_cmd_desc_get(cmd);
+		ops[i].opcode = SNAP_DMA_OP_READ;
+		ops[i].buf = &next->desc;
+		ops[i].len = sizeof(struct vring_desc);
+		ops[i].lkey = cmd->vq->desc_pool.lkey;
+		ops[i].rkey = cmd->vq->xmkey;
+		ops[i].raddr = cmd->vq->desc_pa +
+			((idx + i) % cmd->vq->size) * sizeof(next->desc);
+	}
+
+	cmd->desc_window = n;
+	cmd->desc_window_idx = idx;
 	cmd->dma_comp.count = 1;
 	cmd->dma_comp.func = snap_vq_cmd_fetch_next_desc_done;
-	ret = snap_dma_q_read(cmd->vq->dma_q, &next->desc,
-			sizeof(struct vring_desc), cmd->vq->desc_pool.lkey,
-			next_addr, cmd->vq->xmkey, &cmd->dma_comp);
+	ret = snap_dma_q_post_batch(cmd->vq->dma_q, ops, n, &cmd->dma_comp);
 	if (ret)
 		snap_vq_cmd_fatal(cmd);
 }
@@ -117,6 +182,9 @@ static void snap_vq_cmd_process(struct snap_vq_cmd *cmd)
 {
 	struct snap_vq_cmd_desc *desc;
 
+	if (cmd->desc_window > 1)
+		snap_vq_cmd_desc_window_trim(cmd);
+
 	desc = TAILQ_LAST(&cmd->descs, snap_vq_cmd_desc_list);
 	if (desc->desc.flags & VRING_DESC_F_NEXT)
 		snap_vq_cmd_fetch_next_desc(cmd);
@@ -166,6 +234,8 @@ static void snap_vq_cmd_start(struct snap_vq *q, const struct snap_vq_header *hd
 	cmd = snap_vq_cmd_get(q);
 	cmd->id = hdr->desc_head_idx;
 	cmd->len = 0;
+	cmd->desc_window = 0;
+	cmd->desc_prefetch_off = false;
 
 	for (i = 0; i < hdr->num_descs; i++) {
 		desc = snap_vq_cmd_desc_get(cmd);
@@ -180,6 +250,449 @@ static void snap_vq_cmd_start(struct snap_vq *q, const struct snap_vq_header *hd
 	snap_vq_cmd_process(cmd);
 }
 
+/*
+ * Packed rings are polled by software. A window of the descriptor ring is
+ * read together with the driver event suppression structure, and every
+ * complete chain found in the window starts a command. Chains occupy
+ * consecutive slots, so a batch of commands costs a single ring read.
+ */
+static inline bool snap_vq_packed_desc_avail(const struct vring_packed_desc *desc,
+					     bool wrap)
+{
+	bool avail = desc->flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+	bool used = desc->flags & (1 << VRING_PACKED_DESC_F_USED);
+
+	return avail == wrap && used != wrap;
+}
+
+static inline void snap_vq_packed_idx_inc(const struct snap_vq *q,
+					  uint16_t *idx, bool *wrap, int n)
+{
+	*idx += n;
+	if (*idx >= q->size) {
+		*idx -= q->size;
+		*wrap = !*wrap;
+	}
+}
+
+static void snap_vq_packed_cmd_run(struct snap_vq_cmd *cmd)
+{
+	snap_vq_cmd_prefetch_header(cmd);
+	snap_vq_cmd_handle(cmd);
+}
+
+static void snap_vq_packed_indirect_done(struct snap_dma_completion *self,
+					 int status)
+{
+	struct snap_vq_cmd *cmd;
+	struct snap_vq_cmd_desc *desc;
+	uint16_t flags;
+
+	cmd = container_of(self, struct snap_vq_cmd, dma_comp);
+	if (snap_unlikely(status != IBV_WC_SUCCESS)) {
+		snap_vq_cmd_fatal(cmd);
+		return;
+	}
+
+	/* entries were read in the packed layout, flags landed in next */
+	TAILQ_FOREACH(desc, &cmd->descs, entry) {
+		flags = desc->desc.next;
+		desc->desc.flags = flags & VRING_DESC_F_WRITE;
+		if (desc != TAILQ_LAST(&cmd->descs, snap_vq_cmd_desc_list))
+			desc->desc.flags |= VRING_DESC_F_NEXT;
+		desc->desc.next = 0;
+	}
+
+	snap_vq_packed_cmd_run(cmd);
+}
+
+static void snap_vq_packed_fetch_indirect(struct snap_vq_cmd *cmd,
+					  const struct vring_packed_desc *pdesc,
+					  int n)
+{
+	struct snap_vq *q = cmd->vq;
+	struct snap_dma_op ops[SNAP_VQ_PACKED_FETCH_MAX];
+	struct snap_vq_cmd_desc *desc;
+	int i, j, batch, ret;
+
+	batch = snap_min(SNAP_VQ_PACKED_FETCH_MAX, q->size);
+	cmd->dma_comp.count = (n + batch - 1) / batch;
+	cmd->dma_comp.func = snap_vq_packed_indirect_done;
+	for (i = 0; i < n; i += j) {
+		for (j = 0; j < batch && i + j < n; j++) {
+			desc = snap_vq_cmd_desc_get(cmd);
+			ops[j].opcode = SNAP_DMA_OP_READ;
+			ops[j].buf = &desc->desc;
+			ops[j].len = sizeof(desc->desc);
+			ops[j].lkey = q->desc_pool.lkey;
+			ops[j].rkey = q->xmkey;
+			ops[j].raddr = pdesc->addr + (i + j) * sizeof(*pdesc);
+		}
+
+		ret = snap_dma_q_post_batch(q->dma_q, ops, j, &cmd->dma_comp);
+		if (snap_unlikely(ret)) {
+			snap_error("queue %d: failed to read indirect table, ret %d\n",
+				   q->index, ret);
+			snap_vq_cmd_fatal(cmd);
+			return;
+		}
+	}
+}
+
+/*
+ * Start a command from n_slots ring slots starting at head. Return -EAGAIN
+ * if the descriptor pool can't hold the command yet.
+ */
+static int snap_vq_packed_cmd_start(struct snap_vq *q, uint16_t head,
+				    int n_slots)
+{
+	const struct vring_packed_desc *ring = q->packed.ring;
+	struct snap_vq_cmd_desc *desc;
+	struct snap_vq_cmd *cmd;
+	uint16_t idx;
+	int i, n_descs = n_slots;
+	bool indirect = ring[head].flags & VRING_DESC_F_INDIRECT;
+	bool bad_indirect = false;
+
+	if (indirect) {
+		n_descs = ring[head].len / sizeof(struct vring_packed_desc);
+		bad_indirect = n_slots != 1 || !n_descs || n_descs > q->size ||
+			       ring[head].len % sizeof(struct vring_packed_desc);
+	}
+	if (!bad_indirect && n_descs > q->desc_pool.n_free)
+		return -EAGAIN;
+
+	cmd = snap_vq_cmd_get(q);
+	cmd->id = ring[(head + n_slots - 1) % q->size].id;
+	cmd->len = 0;
+	cmd->ring_slots = n_slots;
+	cmd->desc_window = 0;
+	cmd->desc_prefetch_off = true;
+
+	if (snap_unlikely(bad_indirect)) {
+		snap_error("queue %d: bad indirect descriptor at %u, len %u\n",
+			   q->index, head, ring[head].len);
+		snap_vq_cmd_fatal(cmd);
+		return 0;
+	}
+
+	if (indirect) {
+		snap_vq_packed_fetch_indirect(cmd, &ring[head], n_descs);
+		return 0;
+	}
+
+	for (i = 0, idx = head; i < n_slots; i++, idx = (idx + 1) % q->size) {
+		desc = snap_vq_cmd_desc_get(cmd);
+		desc->desc.addr = ring[idx].addr;
+		desc->desc.len = ring[idx].len;
+		desc->desc.flags = ring[idx].flags &
+				   (VRING_DESC_F_NEXT | VRING_DESC_F_WRITE);
+		desc->desc.next = 0;
+		if (snap_unlikely(ring[idx].flags & VRING_DESC_F_INDIRECT)) {
+			snap_error("queue %d: indirect descriptor chained at %u\n",
+				   q->index, idx);
+			snap_vq_cmd_fatal(cmd);
+			return 0;
+		}
+	}
+
+	snap_vq_packed_cmd_run(cmd);
+	return 0;
+}
+
+static void snap_vq_packed_parse(struct snap_vq *q)
+{
+	struct snap_vq_packed *packed = &q->packed;
+	const struct vring_packed_desc *desc;
+	uint16_t idx;
+	bool wrap;
+	int i, n_slots;
+
+	packed->fetch_len = snap_min(SNAP_VQ_PACKED_FETCH_MAX, q->size);
+	for (i = 0; i < packed->fetch_n; i += n_slots) {
+		if (TAILQ_EMPTY(&q->free_cmds))
+			return;
+
+		idx = packed->avail_idx;
+		wrap = packed->avail_wrap;
+		for (n_slots = 1; ; n_slots++) {
+			/* chain continues beyond the window, read more next time */
+			if (i + n_slots > packed->fetch_n) {
+				if (i == 0)
+					packed->fetch_len = snap_min(2 * packed->fetch_n,
+								     q->size);
+				return;
+			}
+
+			/* the rest of the chain may not be visible yet */
+			desc = &packed->ring[idx];
+			if (!snap_vq_packed_desc_avail(desc, wrap))
+				return;
+			if (!(desc->flags & VRING_DESC_F_NEXT))
+				break;
+			snap_vq_packed_idx_inc(q, &idx, &wrap, 1);
+		}
+
+		if (snap_vq_packed_cmd_start(q, packed->avail_idx, n_slots))
+			return;
+
+		packed->n_started++;
+		snap_vq_packed_idx_inc(q, &packed->avail_idx,
+				       &packed->avail_wrap, n_slots);
+	}
+}
+
+static void snap_vq_packed_fetch_done(struct snap_dma_completion *self,
+				      int status)
+{
+	struct snap_vq_packed *packed;
+	struct snap_vq *q;
+
+	packed = container_of(self, struct snap_vq_packed, fetch_comp);
+	q = container_of(packed, struct snap_vq, packed);
+	packed->fetching = false;
+	if (snap_unlikely(status != IBV_WC_SUCCESS)) {
+		snap_error("queue %d: failed to read packed ring, status %d\n",
+			   q->index, status);
+		return;
+	}
+
+	if (snap_likely(q->state == SNAP_VQ_STATE_RUNNING))
+		snap_vq_packed_parse(q);
+}
+
+static void snap_vq_packed_read_op(struct snap_vq *q, struct snap_dma_op *op,
+				   void *buf, size_t len, uint64_t raddr)
+{
+	op->opcode = SNAP_DMA_OP_READ;
+	op->buf = buf;
+	op->len = len;
+	op->lkey = q->packed.lkey;
+	op->rkey = q->xmkey;
+	op->raddr = raddr;
+}
+
+/*
+ * The window starts at the first slot the device has not consumed yet. The
+ * driver makes a chain head available last, but the window is read by a
+ * single DMA, so every descriptor of a chain is checked by the parser, not
+ * just the head. A window that crosses the end of the ring is read by two
+ * operations.
+ */
+static int snap_vq_packed_fetch(struct snap_vq *q)
+{
+	struct snap_vq_packed *packed = &q->packed;
+	struct snap_dma_op ops[2];
+	uint16_t idx = packed->avail_idx;
+	int n_ops = 0, n, first, ret;
+
+	n = snap_min(packed->fetch_len, q->size);
+	first = snap_min(n, q->size - idx);
+	snap_vq_packed_read_op(q, &ops[n_ops++], &packed->ring[idx],
+			       first * sizeof(*packed->ring),
+			       q->desc_pa + idx * sizeof(*packed->ring));
+	if (n > first)
+		snap_vq_packed_read_op(q, &ops[n_ops++], packed->ring,
+				       (n - first) * sizeof(*packed->ring),
+				       q->desc_pa);
+
+	packed->fetch_n = n;
+	packed->fetching = true;
+	packed->fetch_comp.count = 1;
+	packed->fetch_comp.func = snap_vq_packed_fetch_done;
+	ret = snap_dma_q_post_batch(q->dma_q, ops, n_ops, &packed->fetch_comp);
+	if (snap_unlikely(ret)) {
+		packed->fetching = false;
+		return ret;
+	}
+
+	packed->fetches++;
+	return 0;
+}
+
+static void snap_vq_packed_signal(struct snap_vq *q);
+
+static int snap_vq_packed_progress(struct snap_vq *q)
+{
+	struct snap_vq_packed *packed = &q->packed;
+	int n;
+
+	if (!packed->fetching && !TAILQ_EMPTY(&q->free_cmds))
+		(void)snap_vq_packed_fetch(q);
+	if (snap_unlikely(!packed->event_read &&
+			  packed->signalled_idx != packed->used_idx))
+		snap_vq_packed_signal(q);
+
+	n = packed->n_started;
+	packed->n_started = 0;
+	return n;
+}
+
+static bool snap_vq_packed_need_notify(struct snap_vq *q)
+{
+	struct snap_vq_packed *packed = &q->packed;
+	const struct vring_packed_desc_event *event = packed->driver_event;
+	uint16_t event_idx, new_idx = packed->event_idx;
+	uint16_t old_idx = packed->signalled_idx;
+
+	if (event->flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		return false;
+	if (event->flags != VRING_PACKED_EVENT_FLAG_DESC)
+		return true;
+
+	/* both indexes are taken relative to the lap of the new one */
+	event_idx = event->off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if ((event->off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) !=
+	    packed->event_wrap)
+		event_idx -= q->size;
+	if (packed->signalled_wrap != packed->event_wrap)
+		old_idx -= q->size;
+	return vring_need_event(event_idx, new_idx, old_idx);
+}
+
+static void snap_vq_packed_event_done(struct snap_dma_completion *self,
+				      int status)
+{
+	struct snap_vq_packed *packed;
+	struct snap_vq *q;
+
+	packed = container_of(self, struct snap_vq_packed, event_comp);
+	q = container_of(packed, struct snap_vq, packed);
+	packed->event_read = false;
+
+	/* an interrupt too many is harmless, a missing one stalls the driver */
+	if (snap_unlikely(status != IBV_WC_SUCCESS) ||
+	    snap_vq_packed_need_notify(q)) {
+		packed->notifies++;
+		if (packed->notify)
+			packed->notify(q);
+	}
+
+	packed->signalled_idx = packed->event_idx;
+	packed->signalled_wrap = packed->event_wrap;
+	if (packed->signalled_idx != packed->used_idx)
+		snap_vq_packed_signal(q);
+}
+
+/*
+ * The driver event is read behind the used descriptor write on the same
+ * queue, so the value it returns is at least as new as the one the driver
+ * had when it checked the ring. Deciding with the copy fetched with the
+ * ring window can miss a driver that has just enabled notifications. One
+ * read is in flight at a time, used descriptors written meanwhile are
+ * decided by a new read once it completes. A failed read post is retried
+ * by the next progress call.
+ */
+static void snap_vq_packed_signal(struct snap_vq *q)
+{
+	struct snap_vq_packed *packed = &q->packed;
+
+	if (packed->event_read)
+		return;
+
+	packed->event_comp.func = snap_vq_packed_event_done;
+	packed->event_comp.count = 1;
+	if (snap_dma_q_read_short(q->dma_q, packed->driver_event,
+				  sizeof(*packed->driver_event), q->driver_pa,
+				  q->xmkey, &packed->event_comp))
+		return;
+
+	packed->event_read = true;
+	packed->event_idx = packed->used_idx;
+	packed->event_wrap = packed->used_wrap;
+}
+
+/*
+ * Used descriptor len, id and flags are adjacent, a single write publishes
+ * the used buffer. The driver finds the next used descriptor by skipping
+ * the slots of the buffer it got back, n_slots.
+ */
+static int snap_vq_packed_write_used(struct snap_vq *q, uint16_t id,
+				     uint32_t len, uint16_t n_slots)
+{
+	struct snap_vq_packed *packed = &q->packed;
+	struct vring_packed_desc *used = &packed->used[packed->used_idx];
+	int ret;
+
+	used->len = len;
+	used->id = id;
+	used->flags = packed->used_wrap ?
+		(1 << VRING_PACKED_DESC_F_AVAIL) | (1 << VRING_PACKED_DESC_F_USED) : 0;
+	ret = snap_dma_q_write(q->dma_q, &used->len,
+			sizeof(*used) - offsetof(struct vring_packed_desc, len),
+			packed->lkey,
+			q->desc_pa + packed->used_idx * sizeof(*used) +
+			offsetof(struct vring_packed_desc, len),
+			q->xmkey, NULL);
+	if (snap_unlikely(ret))
+		return ret;
+
+	snap_vq_packed_idx_inc(q, &packed->used_idx, &packed->used_wrap, n_slots);
+	snap_vq_packed_signal(q);
+	return 0;
+}
+
+/**
+ * snap_vq_packed_init() - Initialize packed ring state
+ * @q:		queue, the ring buffers are allocated
+ * @avail_idx:	first slot to fetch, wrap counter in SNAP_VQ_PACKED_IDX_WRAP
+ * @used_idx:	first slot to complete, wrap counter in SNAP_VQ_PACKED_IDX_WRAP
+ *
+ * The device never needs to be notified about new buffers, as the ring is
+ * polled, so the device event suppression structure disables them.
+ *
+ * Return: 0 on success, -errno otherwise
+ */
+int snap_vq_packed_init(struct snap_vq *q, uint16_t avail_idx,
+			uint16_t used_idx)
+{
+	struct snap_vq_packed *packed = &q->packed;
+
+	packed->avail_idx = (avail_idx & ~SNAP_VQ_PACKED_IDX_WRAP) % q->size;
+	packed->avail_wrap = avail_idx & SNAP_VQ_PACKED_IDX_WRAP;
+	packed->used_idx = (used_idx & ~SNAP_VQ_PACKED_IDX_WRAP) % q->size;
+	packed->used_wrap = used_idx & SNAP_VQ_PACKED_IDX_WRAP;
+	packed->fetch_len = snap_min(SNAP_VQ_PACKED_FETCH_MAX, q->size);
+	packed->fetching = false;
+	packed->n_started = 0;
+	packed->event_read = false;
+	packed->signalled_idx = packed->used_idx;
+	packed->signalled_wrap = packed->used_wrap;
+	packed->driver_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+
+	packed->device_event->off_wrap = 0;
+	packed->device_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+	return snap_dma_q_write(q->dma_q, packed->device_event,
+				sizeof(*packed->device_event), packed->lkey,
+				q->device_pa, q->xmkey, NULL);
+}
+
+static int snap_vq_packed_create(struct snap_vq *q,
+				 const struct snap_vq_create_attr *attr)
+{
+	struct snap_vq_packed *packed = &q->packed;
+	size_t ring_len = attr->size * sizeof(struct vring_packed_desc);
+
+	packed->ring = snap_buf_alloc(attr->pd, 2 * ring_len +
+				2 * sizeof(struct vring_packed_desc_event));
+	if (!packed->ring)
+		return -ENOMEM;
+
+	packed->used = packed->ring + attr->size;
+	packed->driver_event = (struct vring_packed_desc_event *)
+				(packed->used + attr->size);
+	packed->device_event = packed->driver_event + 1;
+	packed->lkey = snap_buf_get_mkey(packed->ring);
+	packed->notify = attr->notify;
+	return 0;
+}
+
+static void snap_vq_packed_destroy(struct snap_vq *q)
+{
+	snap_buf_free(q->packed.ring);
+	q->packed.ring = NULL;
+}
+
 int snap_vq_cmd_descs_rw(struct snap_vq_cmd *cmd,
 		const struct snap_vq_cmd_desc *first_desc, size_t first_offset,
 		void *lbuf, size_t total_len, uint32_t lbuf_mkey,
@@ -220,7 +733,7 @@ int snap_vq_cmd_descs_rw(struct snap_vq_cmd *cmd,
 				raddr, cmd->vq->xmkey, &cmd->dma_comp);
 		}
 		if (snap_unlikely(ret))
-			/* TODO add -EBUSY handling, pending list */
+			/* sq is full and dma_q pending ring is full too */
 			return ret;
 
 		laddr += len;
@@ -237,9 +750,15 @@ static void snap_vq_cmd_complete_execute(struct snap_vq_cmd *cmd)
 	struct snap_vq_completion comp = {};
 	int ret;
 
-	comp.id = cmd->id;
-	comp.len = cmd->len;
-	ret = snap_dma_q_send_completion(cmd->vq->dma_q, &comp, sizeof(comp));
+	if (snap_vq_is_packed(cmd->vq)) {
+		ret = snap_vq_packed_write_used(cmd->vq, cmd->id, cmd->len,
+						cmd->ring_slots);
+	} else {
+		comp.id = cmd->id;
+		comp.len = cmd->len;
+		ret = snap_dma_q_send_completion(cmd->vq->dma_q, &comp,
+						 sizeof(comp));
+	}
 	if (snap_unlikely(ret))
 		snap_vq_cmd_fatal(cmd);
 	else
@@ -247,10 +766,50 @@ static void snap_vq_cmd_complete_execute(struct snap_vq_cmd *cmd)
 	snap_vq_cmd_put(cmd->vq, cmd);
 }
 
+/*
+ * With VIRTIO_F_IN_ORDER a packed ring takes a single used descriptor for
+ * the whole batch, with the buffer id of the last command.
+ */
+static void snap_vq_packed_flush_pending_completions(struct snap_vq *q)
+{
+	struct snap_vq_cmd *cmd, *last = NULL;
+	int n_slots = 0;
+
+	cmd = TAILQ_LAST(&q->inflight_cmds, snap_vq_inflight_cmds);
+	while (cmd && cmd->pending_completion) {
+		n_slots += cmd->ring_slots;
+		last = cmd;
+		cmd = TAILQ_PREV(cmd, snap_vq_inflight_cmds, entry);
+	}
+	if (!last)
+		return;
+
+	if (snap_unlikely(snap_vq_packed_write_used(q, last->id, last->len,
+						    n_slots))) {
+		do {
+			cmd = TAILQ_LAST(&q->inflight_cmds, snap_vq_inflight_cmds);
+			cmd->pending_completion = false;
+			snap_vq_cmd_fatal(cmd);
+		} while (cmd != last);
+		return;
+	}
+
+	do {
+		cmd = TAILQ_LAST(&q->inflight_cmds, snap_vq_inflight_cmds);
+		cmd->pending_completion = false;
+		snap_vq_cmd_cleanup(cmd);
+		snap_vq_cmd_put(q, cmd);
+	} while (cmd != last);
+}
+
 static void snap_vq_flush_pending_completions(struct snap_vq *q)
 {
 	struct snap_vq_cmd *cmd;
 
+	if (snap_vq_is_packed(q) &&
+	    (q->op_flags & SNAP_VQ_OP_FLAGS_IN_ORDER_USED))
+		return snap_vq_packed_flush_pending_completions(q);
+
 	while (!TAILQ_EMPTY(&q->inflight_cmds)) {
 		cmd = TAILQ_LAST(&q->inflight_cmds, snap_vq_inflight_cmds);
 		if (!cmd->pending_completion)
@@ -318,6 +877,7 @@ static int snap_vq_dma_q_create(struct snap_vq *q,
 	dma_attr.comp_channel = attr->comp_channel;
 	dma_attr.comp_vector = attr->comp_vector;
 	dma_attr.comp_context = q;
+	dma_attr.pending_qsize = attr->size;
 	q->dma_q = snap_dma_q_create(attr->pd, &dma_attr);
 	if (!q->dma_q)
 		return -EINVAL;
@@ -344,7 +904,7 @@ static void snap_vq_cmds_destroy(struct snap_vq *q)
 	while (!TAILQ_EMPTY(&q->free_cmds)) {
 		cmd = TAILQ_FIRST(&q->free_cmds);
 		TAILQ_REMOVE(&q->free_cmds, cmd, entry);
-		q->cmd_ops->delete(cmd);
+		q->cmd_ops->destroy(cmd);
 	}
 }
 
@@ -375,18 +935,20 @@ destroy_cmds:
 static int snap_vq_descs_create(struct snap_vq *q,
 			const struct snap_vq_create_attr *attr)
 {
-	int i;
+	int i, n;
 	struct snap_vq_desc_pool *pool = &q->desc_pool;
 
-	pool->entries = snap_buf_alloc(attr->pd,
-					attr->size * sizeof(*pool->entries));
+	/* every command may hold up to desc_prefetch - 1 speculative descs */
+	n = attr->size * q->desc_prefetch;
+	pool->entries = snap_buf_alloc(attr->pd, n * sizeof(*pool->entries));
 	if (!pool->entries)
 		return -ENOMEM;
 
 	/* TODO consider more advanced poo impl, e.x. DPDK */
 	pool->lkey = snap_buf_get_mkey(pool->entries);
 	TAILQ_INIT(&pool->free_descs);
-	for (i = 0; i < attr->size; i++)
+	pool->n_free = 0;
+	for (i = 0; i < n; i++)
 		snap_vq_desc_pool_put(q, &pool->entries[i]);
 
 	return 0;
@@ -516,30 +1078,48 @@ static void snap_vq_hwq_destroy(struct snap_vq *q)
 int snap_vq_create(struct snap_vq *q, struct snap_vq_create_attr *attr,
 			const struct snap_vq_cmd_ops *cmd_ops)
 {
+	bool packed = attr->op_flags & SNAP_VQ_OP_FLAGS_PACKED_RING;
 	uint16_t hw_used;
 
+	if (packed && attr->comp_channel) {
+		snap_error("packed ring queue %d is polled, events are not supported\n",
+			   attr->index);
+		goto err;
+	}
+
+	q->desc_prefetch = snap_virtio_ctrl_desc_prefetch();
 	if (snap_vq_dma_q_create(q, attr, cmd_ops))
 		goto err;
 
-	if (attr->in_recovery) {
+	if (packed) {
+		/* host memory has no packed ring indexes, keep the given ones */
+		if (!attr->in_recovery) {
+			attr->hw_avail_index = SNAP_VQ_PACKED_IDX_WRAP;
+			attr->hw_used_index = SNAP_VQ_PACKED_IDX_WRAP;
+		}
+	} else if (attr->in_recovery) {
 		if (snap_virtio_get_used_index_from_host(q->dma_q,
 					attr->device_pa, attr->xmkey, &hw_used))
 			goto destroy_dma_q;
+		attr->hw_avail_index = hw_used;
+		attr->hw_used_index = hw_used;
 	} else {
-		hw_used = 0;
+		attr->hw_avail_index = 0;
+		attr->hw_used_index = 0;
 	}
 
-	attr->hw_avail_index = hw_used;
-	attr->hw_used_index = hw_used;
-
 	if (snap_vq_cmds_create(q, attr->size, cmd_ops))
 		goto destroy_dma_q;
 
 	if (snap_vq_descs_create(q, attr))
 		goto destroy_cmds;
 
-	if (snap_vq_hwq_create(q, q->dma_q, attr))
+	if (packed) {
+		if (snap_vq_packed_create(q, attr))
+			goto destroy_descs;
+	} else if (snap_vq_hwq_create(q, q->dma_q, attr)) {
 		goto destroy_descs;
+	}
 
 	q->index = attr->index;
 	q->state = SNAP_VQ_STATE_RUNNING;
@@ -551,6 +1131,12 @@ int snap_vq_create(struct snap_vq *q, struct snap_vq_create_attr *attr,
 	q->xmkey = attr->xmkey;
 	q->caps = attr->caps;
 	q->vctrl = attr->vctrl;
+
+	if (packed && snap_vq_packed_init(q, attr->hw_avail_index,
+					  attr->hw_used_index)) {
+		snap_vq_packed_destroy(q);
+		goto destroy_descs;
+	}
 	return 0;
 
 destroy_descs:
@@ -565,7 +1151,10 @@ err:
 
 void snap_vq_destroy(struct snap_vq *q)
 {
-	snap_vq_hwq_destroy(q);
+	if (snap_vq_is_packed(q))
+		snap_vq_packed_destroy(q);
+	else
+		snap_vq_hwq_destroy(q);
 	snap_vq_descs_destroy(&q->desc_pool);
 	snap_vq_cmds_destroy(q);
 	snap_vq_dma_q_destroy(q);
@@ -682,12 +1271,17 @@ int snap_vq_progress(struct snap_vq *q)
 {
 	int n;
 
-	n = q->dma_q->ops->progress_tx(q->dma_q);
-	if (snap_likely(q->state == SNAP_VQ_STATE_RUNNING))
-		n += q->dma_q->ops->progress_rx(q->dma_q);
+	n = snap_dma_q_progress_tx(q->dma_q);
+	if (snap_likely(q->state == SNAP_VQ_STATE_RUNNING)) {
+		if (snap_vq_is_packed(q))
+			n += snap_vq_packed_progress(q);
+		else
+			n += q->dma_q->ops->progress_rx(q->dma_q);
+	}
 
 	if (snap_unlikely(q->state == SNAP_VQ_STATE_FLUSHING &&
-			TAILQ_EMPTY(&q->inflight_cmds)))
+			TAILQ_EMPTY(&q->inflight_cmds) &&
+			!(snap_vq_is_packed(q) && q->packed.fetching)))
 		q->state = SNAP_VQ_STATE_SUSPENDED;
 
 	return n;
@@ -716,6 +1310,17 @@ int snap_vq_get_debugstat(struct snap_vq *q,
 	uint16_t vru, vra;
 	int ret;
 
+	if (snap_vq_is_packed(q)) {
+		q_debugstat->qid = q->index;
+		q_debugstat->hw_available_index = q->packed.avail_idx |
+			(q->packed.avail_wrap ? SNAP_VQ_PACKED_IDX_WRAP : 0);
+		q_debugstat->sw_available_index = q_debugstat->hw_available_index;
+		q_debugstat->hw_used_index = q->packed.used_idx |
+			(q->packed.used_wrap ? SNAP_VQ_PACKED_IDX_WRAP : 0);
+		q_debugstat->sw_used_index = q_debugstat->hw_used_index;
+		return 0;
+	}
+
 	ret = snap_virtio_get_used_index_from_host(q->dma_q, q->device_pa,
 						q->xmkey, &vru);
 	if (ret) {
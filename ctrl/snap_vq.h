@@ -50,16 +50,36 @@ typedef void (*snap_vq_cmd_done_cb_t)(struct snap_vq_cmd *cmd,
 typedef void (*snap_vq_process_fn_t)(struct snap_virtio_ctrl *vctrl,
 					struct snap_vq_cmd *cmd);
 
+/**
+ * typedef snap_vq_notify_fn_t - Driver notification callback.
+ * @q: queue
+ *
+ * Called when used buffers were written and the driver asked to be notified
+ * about them (packed rings only, see struct vring_packed_desc_event).
+ */
+typedef void (*snap_vq_notify_fn_t)(struct snap_vq *q);
+
 /**
  * enum snap_vq_op_flags - snap VQ Operation flags.
  * @SNAP_VQ_OP_FLAGS_IN_ORDER_COMPLETIONS: Force in-order completions.
+ * @SNAP_VQ_OP_FLAGS_PACKED_RING: Packed ring layout (VIRTIO_F_RING_PACKED).
+ *	The ring is polled and completed by software, without descriptor
+ *	tunneling.
+ * @SNAP_VQ_OP_FLAGS_IN_ORDER_USED: VIRTIO_F_IN_ORDER was negotiated. A packed
+ *	ring returns a batch of in-order completions with a single used
+ *	descriptor, requires @SNAP_VQ_OP_FLAGS_IN_ORDER_COMPLETIONS.
  *
  * Describes various special modes of operation for the virtqueue.
  */
 enum snap_vq_op_flags {
 	SNAP_VQ_OP_FLAGS_IN_ORDER_COMPLETIONS = 1 << 0,
+	SNAP_VQ_OP_FLAGS_PACKED_RING = 1 << 1,
+	SNAP_VQ_OP_FLAGS_IN_ORDER_USED = 1 << 2,
 };
 
+/* packed ring indexes carry the wrap counter in the top bit */
+#define SNAP_VQ_PACKED_IDX_WRAP (1 << 15)
+
 /**
  * struct snap_vq_cmd_desc - snap virtio command descriptor
  * @entry: list entry
@@ -84,11 +104,16 @@ TAILQ_HEAD(snap_vq_cmd_desc_list, snap_vq_cmd_desc);
  * struct snap_vq_create_attr - snap VQ common creation attributes
  * @index: Queue index.
  * @size: Queue size.
- * @desc_pa: desc table address on host memory
- * @driver_pa: avail ring address on host memory
- * @device_pa: used ring address on host memory
- * @hw_avail_index: avail index to initialize queue with
- * @hw_used_index: used index to initialize queue with
+ * @desc_pa: desc table address on host memory, descriptor ring for
+ *	packed rings
+ * @driver_pa: avail ring address on host memory, driver event suppression
+ *	structure for packed rings
+ * @device_pa: used ring address on host memory, device event suppression
+ *	structure for packed rings
+ * @hw_avail_index: avail index to initialize queue with, for packed rings
+ *	with the wrap counter in SNAP_VQ_PACKED_IDX_WRAP
+ * @hw_used_index: used index to initialize queue with, for packed rings
+ *	with the wrap counter in SNAP_VQ_PACKED_IDX_WRAP
  * @msix_vector: msix vector to assign queue with
  * @op_flags: Operation flags, subset of enum snap_vq_op_flags.
  * @xmkey: Cross-mkey for host memory access
@@ -97,6 +122,8 @@ TAILQ_HEAD(snap_vq_cmd_desc_list, snap_vq_cmd_desc);
  * @caps: Virtio HW capabilities
  * @comp_channel: Completion channel for queue events (optional)
  * @comp_vector: Completion vector for queue events (optional)
+ * @in_recovery: Queue is recreated, resume from the given indexes
+ * @notify: Driver notification callback (optional, packed rings)
  *
  * Describes all required/optional attribute used for virtqueue
  * creation process.
@@ -119,6 +146,7 @@ struct snap_vq_create_attr {
 	struct ibv_comp_channel *comp_channel;
 	int comp_vector;
 	bool in_recovery;
+	snap_vq_notify_fn_t notify;
 };
 
 void snap_vq_suspend(struct snap_vq *q);
@@ -372,7 +372,7 @@ static const struct snap_vq_cmd_ops snap_vq_adm_cmd_ops = {
 				sizeof(struct snap_virtio_adm_cmd_ftr)),
 	.create = snap_vq_adm_create_cmd,
 	.handle = snap_vq_adm_handle_cmd,
-	.delete = snap_vq_adm_delete_cmd,
+	.destroy = snap_vq_adm_delete_cmd,
 	.prefetch = NULL,
 };
 
@@ -27,9 +27,66 @@ enum snap_vq_state {
 struct snap_vq_desc_pool {
 	struct snap_vq_cmd_desc *entries;
 	struct snap_vq_cmd_desc_list free_descs;
+	int n_free;
 	uint32_t lkey;
 };
 
+/* max descriptors read from a packed ring at once, grows for longer chains */
+#define SNAP_VQ_PACKED_FETCH_MAX 64
+
+/**
+ * struct snap_vq_packed - packed ring state
+ * @ring:		local copy of the descriptor ring, read by windows
+ * @used:		used descriptors, staged before they are written to host
+ * @driver_event:	local copy of the driver event suppression structure,
+ *			read behind the used descriptors it decides on
+ * @device_event:	device event suppression structure written to host
+ * @lkey:		memory key of the above
+ * @avail_idx:		next ring slot to check for an available descriptor
+ * @avail_wrap:		driver wrap counter expected at @avail_idx
+ * @used_idx:		next ring slot to write a used descriptor to
+ * @used_wrap:		device wrap counter written at @used_idx
+ * @fetch_len:		descriptors to read with the next window
+ * @fetch_n:		descriptors read by the window in flight
+ * @fetching:		window read is in flight
+ * @fetch_comp:		window read completion
+ * @event_comp:		driver event read completion
+ * @event_read:		driver event read is in flight
+ * @event_idx:		used index the read in flight decides on
+ * @event_wrap:		used wrap counter at @event_idx
+ * @signalled_idx:	used index the driver was last notified about
+ * @signalled_wrap:	used wrap counter at @signalled_idx
+ * @notify:		driver notification callback
+ * @n_started:		commands started since the last progress
+ * @fetches:		windows read
+ * @notifies:		driver notifications
+ */
+struct snap_vq_packed {
+	struct vring_packed_desc *ring;
+	struct vring_packed_desc *used;
+	struct vring_packed_desc_event *driver_event;
+	struct vring_packed_desc_event *device_event;
+	uint32_t lkey;
+	uint16_t avail_idx;
+	bool avail_wrap;
+	uint16_t used_idx;
+	bool used_wrap;
+	uint16_t fetch_len;
+	uint16_t fetch_n;
+	bool fetching;
+	struct snap_dma_completion fetch_comp;
+	struct snap_dma_completion event_comp;
+	bool event_read;
+	uint16_t event_idx;
+	bool event_wrap;
+	uint16_t signalled_idx;
+	bool signalled_wrap;
+	snap_vq_notify_fn_t notify;
+	int n_started;
+	uint64_t fetches;
+	uint64_t notifies;
+};
+
 struct snap_vq_cmd_ops {
 	size_t hdr_size;
 	size_t ftr_size;
@@ -37,8 +94,8 @@ struct snap_vq_cmd_ops {
 	struct snap_vq_cmd *(*create)(struct snap_vq *q, int index);
 	/* Handle: handle command after descriptor chain is obtained. */
 	void (*handle)(struct snap_vq_cmd *cmd);
-	/* Delete: Delete command */
-	void (*delete)(struct snap_vq_cmd *cmd);
+	/* Destroy: Delete command */
+	void (*destroy)(struct snap_vq_cmd *cmd);
 
 	/*
 	 * Prefetch (optional): fetch header before finish reading all
@@ -57,6 +114,12 @@ struct snap_vq_cmd {
 	uint32_t len;
 	uint16_t id;
 	bool pending_completion;
+	/* descriptors read speculatively by the last fetch */
+	uint16_t desc_window;
+	uint16_t desc_window_idx;
+	bool desc_prefetch_off;
+	/* packed ring slots taken by the command */
+	uint16_t ring_slots;
 	struct snap_dma_completion dma_comp;
 	snap_vq_cmd_done_cb_t done_cb;
 	void *priv;
@@ -86,6 +149,8 @@ struct snap_vq {
 	struct snap_virtio_queue *hw_q;
 
 	struct snap_vq_desc_pool desc_pool;
+	uint16_t desc_prefetch;
+	struct snap_vq_packed packed;
 };
 
 int snap_vq_create(struct snap_vq *q, struct snap_vq_create_attr *attr,
@@ -98,4 +163,7 @@ void snap_vq_cmd_fatal(struct snap_vq_cmd *cmd);
 void snap_vq_cmd_destroy(struct snap_vq_cmd *cmd);
 void snap_vq_cmd_dma_rw_done(struct snap_dma_completion *self, int status);
 
+int snap_vq_packed_init(struct snap_vq *q, uint16_t avail_idx,
+			uint16_t used_idx);
+
 #endif
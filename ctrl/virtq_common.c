@@ -11,14 +11,18 @@
  */
 
 #include "virtq_common.h"
+#include <fcntl.h>
 #include <linux/virtio_ring.h>
 #include <linux/virtio_pci.h>
 #include "snap_channel.h"
 #include "snap_dma.h"
 #include "snap_env.h"
 #include "snap_dp_map.h"
+#include "snap_mr.h"
 
 #define SNAP_DMA_Q_OPMODE   "SNAP_DMA_Q_OPMODE"
+/* ready commands the queue owner submits per progress call */
+#define VIRTQ_STEAL_OWNER_BATCH 16
 
 static struct snap_dma_q *virtq_rdma_qp_init(struct virtq_create_attr *attr,
 		struct virtq_priv *vq_priv, int tx_elem_size, int rx_elem_size,
@@ -26,6 +30,7 @@ static struct snap_dma_q *virtq_rdma_qp_init(struct virtq_create_attr *attr,
 {
 	struct snap_dma_q_create_attr rdma_qp_create_attr = { };
 
+	rdma_qp_create_attr.comp_channel = vq_priv->comp_channel;
 	rdma_qp_create_attr.tx_qsize = attr->queue_size;
 	rdma_qp_create_attr.tx_elem_size = tx_elem_size;
 	rdma_qp_create_attr.rx_qsize = attr->queue_size;
@@ -33,6 +38,8 @@ static struct snap_dma_q *virtq_rdma_qp_init(struct virtq_create_attr *attr,
 	rdma_qp_create_attr.uctx = vq_priv;
 	rdma_qp_create_attr.rx_cb = cb;
 	rdma_qp_create_attr.mode = snap_env_getenv(SNAP_DMA_Q_OPMODE);
+	/* status and completion writes must not fail when sq is full */
+	rdma_qp_create_attr.pending_qsize = attr->queue_size;
 
 	return snap_dma_q_create(attr->pd, &rdma_qp_create_attr);
 }
@@ -60,6 +67,43 @@ static void virtq_vattr_from_attr(struct virtq_create_attr *attr,
 	vattr->pd = attr->pd;
 }
 
+/**
+ * virtq_steal_init() - allocate the rings of work stealing
+ * @steal:	zeroed state to initialize
+ * @queue_size:	number of commands of the queue
+ *
+ * Return: 0 on success, -errno otherwise
+ */
+int virtq_steal_init(struct virtq_steal *steal, int queue_size)
+{
+	uint32_t i, size = 1;
+
+	while (size < queue_size)
+		size <<= 1;
+
+	steal->ready.cmds = calloc(size, sizeof(*steal->ready.cmds));
+	steal->done.slots = calloc(size, sizeof(*steal->done.slots));
+	if (!steal->ready.cmds || !steal->done.slots) {
+		free(steal->ready.cmds);
+		free(steal->done.slots);
+		steal->ready.cmds = NULL;
+		steal->done.slots = NULL;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < size; i++)
+		steal->done.slots[i].seq = i;
+	steal->ready.mask = steal->done.mask = size - 1;
+	steal->owner_batch = VIRTQ_STEAL_OWNER_BATCH;
+	return 0;
+}
+
+void virtq_steal_destroy(struct virtq_steal *steal)
+{
+	free(steal->ready.cmds);
+	free(steal->done.slots);
+}
+
 /**
  * virtq_ctxt_init() - Creates a new virtq object, along with RDMA QPs.
 
@@ -100,14 +144,42 @@ bool virtq_ctx_init(struct virtq_common_ctx *vq_ctx,
 	vq_priv->swq_state = SW_VIRTQ_RUNNING;
 	vq_priv->vbq = ctxt_attr->vq;
 	memset(&vq_priv->cmd_cntrs, 0, sizeof(vq_priv->cmd_cntrs));
-	vq_priv->force_in_order = attr->force_in_order;
+	vq_priv->force_in_order = attr->force_in_order || attr->in_order;
+	vq_priv->desc_prefetch = snap_virtio_ctrl_desc_prefetch();
+	vq_priv->indirect_idx = calloc(2 * attr->queue_size, sizeof(uint16_t));
+	if (!vq_priv->indirect_idx)
+		goto destroy_attr;
+	vq_priv->used_batch.ring = calloc(attr->queue_size,
+					  sizeof(struct vring_used_elem));
+	if (!vq_priv->used_batch.ring)
+		goto destroy_attr;
+	vq_priv->used_batch.mr = snap_reg_mr(attr->pd, vq_priv->used_batch.ring,
+					     attr->queue_size * sizeof(struct vring_used_elem));
+	if (!vq_priv->used_batch.mr)
+		goto destroy_attr;
+	vq_priv->used_batch.max_batch = snap_virtio_ctrl_comp_batch(attr->queue_size);
+	vq_priv->used_batch.max_delay = snap_virtio_ctrl_comp_delay();
+	vq_priv->used_batch.event_idx = attr->event_idx;
+	if (attr->steal && virtq_steal_init(&vq_priv->steal, attr->queue_size))
+		goto dereg_used_batch;
+	if (attr->notify) {
+		vq_priv->comp_channel = ibv_create_comp_channel(attr->pd->context);
+		if (!vq_priv->comp_channel) {
+			snap_error("failed creating completion channel\n");
+			goto dereg_used_batch;
+		}
+		/* events are drained without blocking, see virtq_arm() */
+		if (fcntl(vq_priv->comp_channel->fd, F_SETFL,
+			  fcntl(vq_priv->comp_channel->fd, F_GETFL) | O_NONBLOCK))
+			goto destroy_comp_channel;
+	}
 	vq_priv->dma_q = virtq_rdma_qp_init(attr, vq_priv,
 					    ctxt_attr->tx_elem_size,
 					    ctxt_attr->rx_elem_size,
 					    ctxt_attr->cb);
 	if (!vq_priv->dma_q) {
 		snap_error("failed creating rdma qp loop\n");
-		goto destroy_attr;
+		goto destroy_comp_channel;
 	}
 
 	if (attr->in_recovery) {
@@ -133,12 +205,22 @@ bool virtq_ctx_init(struct virtq_common_ctx *vq_ctx,
 	vq_priv->vattr = &snap_attr->vattr;
 	vq_priv->vattr->size = attr->queue_size;
 	vq_priv->vattr->dma_mkey = attr->xmkey;
+	vq_priv->used_batch.used_idx = hw_used;
+	vq_priv->used_batch.signalled_used = hw_used;
 
 	return true;
 
 destroy_dma_q:
 	snap_dma_q_destroy(vq_priv->dma_q);
+destroy_comp_channel:
+	if (vq_priv->comp_channel)
+		ibv_destroy_comp_channel(vq_priv->comp_channel);
+dereg_used_batch:
+	ibv_dereg_mr(vq_priv->used_batch.mr);
 destroy_attr:
+	virtq_steal_destroy(&vq_priv->steal);
+	free(vq_priv->used_batch.ring);
+	free(vq_priv->indirect_idx);
 	free(snap_attr);
 release_priv:
 	free(vq_priv);
@@ -150,6 +232,12 @@ err:
 void virtq_ctx_destroy(struct virtq_priv *vq_priv)
 {
 	snap_dma_q_destroy(vq_priv->dma_q);
+	if (vq_priv->comp_channel)
+		ibv_destroy_comp_channel(vq_priv->comp_channel);
+	ibv_dereg_mr(vq_priv->used_batch.mr);
+	virtq_steal_destroy(&vq_priv->steal);
+	free(vq_priv->used_batch.ring);
+	free(vq_priv->indirect_idx);
 	free(to_common_queue_attr(vq_priv->vattr));
 	free(vq_priv);
 }
@@ -187,12 +275,152 @@ bool virtq_sm_idle(struct virtq_cmd *cmd, enum virtq_cmd_sm_op_status status)
 	return false;
 }
 
+/*
+ * Descriptors of a chain usually occupy consecutive ring slots, so instead of
+ * reading them one by one, a window of up to desc_prefetch descriptors is
+ * read at once. The window is validated when the read completes: it is cut
+ * after the first descriptor that does not continue to the next slot.
+ * If the chain jumps out of the window, the rest of the chain is read one
+ * descriptor at a time.
+ */
+static void virtq_desc_window_trim(struct virtq_cmd *cmd, const struct vring_desc *descs)
+{
+	uint16_t size = cmd->vq_priv->vattr->size;
+	uint16_t idx = cmd->desc_window_idx;
+	size_t i;
+
+	for (i = cmd->num_desc - cmd->desc_window; i < cmd->num_desc - 1; i++) {
+		if (++idx == size)
+			idx = 0;
+		if (!(descs[i].flags & VRING_DESC_F_NEXT))
+			break;
+		if (descs[i].next != idx) {
+			cmd->desc_prefetch_off = true;
+			cmd->vq_priv->desc_prefetch_misses++;
+			break;
+		}
+	}
+
+	cmd->num_desc = i + 1;
+	cmd->desc_window = 0;
+}
+
+static int virtq_desc_window_size(struct virtq_cmd *cmd)
+{
+	const struct virtq_priv *vq_priv = cmd->vq_priv;
+	uint32_t room;
+
+	if (cmd->desc_prefetch_off || vq_priv->desc_prefetch <= 1 ||
+	    !vq_priv->ops->max_descs)
+		return 1;
+
+	room = vq_priv->ops->max_descs(cmd) - cmd->num_desc;
+	return snap_min(room, snap_min(vq_priv->desc_prefetch, vq_priv->vattr->size));
+}
+
+static int virtq_read_desc_window(struct virtq_cmd *cmd, uint16_t idx, int n)
+{
+	struct virtq_priv *vq_priv = cmd->vq_priv;
+	struct vring_desc *dst = &vq_priv->ops->get_descs(cmd)[cmd->num_desc];
+	uint16_t first = snap_min(n, vq_priv->vattr->size - idx);
+	struct snap_dma_op ops[2];
+	int n_ops = 1;
+
+	ops[0].opcode = SNAP_DMA_OP_READ;
+	ops[0].buf = dst;
+	ops[0].len = first * sizeof(struct vring_desc);
+	ops[0].lkey = cmd->aux_mr->lkey;
+	ops[0].rkey = vq_priv->vattr->dma_mkey;
+	ops[0].raddr = vq_priv->vattr->desc + idx * sizeof(struct vring_desc);
+	/* window wraps at the queue size */
+	if (first < n) {
+		ops[1] = ops[0];
+		ops[1].buf = dst + first;
+		ops[1].len = (n - first) * sizeof(struct vring_desc);
+		ops[1].raddr = vq_priv->vattr->desc;
+		n_ops = 2;
+	}
+
+	virtq_log_data(cmd, "READ_DESC: idx %u window %d\n", idx, n);
+	return snap_dma_q_post_batch(vq_priv->dma_q, ops, n_ops, &cmd->dma_comp);
+}
+
+/*
+ * Indirect tables are read into the command descriptors and arranged there
+ * in chain order. Drivers fill tables sequentially, and with IN_ORDER they
+ * must, so usually the table is already arranged. Otherwise the table is
+ * permuted in place using the queue scratch index arrays, so that no memory
+ * is allocated per command.
+ */
+static int virtq_indirect_arrange(struct virtq_cmd *cmd, struct vring_desc *table)
+{
+	struct virtq_priv *vq_priv = cmd->vq_priv;
+	uint16_t n = cmd->indirect_len / sizeof(struct vring_desc);
+	uint16_t *order = vq_priv->indirect_idx;
+	uint16_t *pos = order + vq_priv->vattr->size;
+	struct vring_desc tmp;
+	uint16_t i, j, k, len;
+
+	for (i = 0; i < n; i++) {
+		if (!(table[i].flags & VRING_DESC_F_NEXT)) {
+			cmd->num_desc += i + 1;
+			return 0;
+		}
+		if (table[i].next != i + 1)
+			break;
+	}
+
+	vq_priv->indirect_reorders++;
+	memset(pos, 0xff, n * sizeof(*pos));
+	len = 0;
+	j = 0;
+	for (;;) {
+		if (snap_unlikely(j >= n || pos[j] != UINT16_MAX)) {
+			ERR_ON_CMD(cmd, "malformed indirect table, desc %u of %u\n",
+				   j, n);
+			return -EINVAL;
+		}
+		pos[j] = len;
+		order[len++] = j;
+		if (!(table[j].flags & VRING_DESC_F_NEXT))
+			break;
+		j = table[j].next;
+	}
+
+	/* descriptors that are not in the chain complete the permutation */
+	for (j = 0, k = len; j < n; j++) {
+		if (pos[j] == UINT16_MAX)
+			order[k++] = j;
+	}
+
+	/* table[k] = table[order[k]], one cycle at a time */
+	for (k = 0; k < n; k++) {
+		if (order[k] == k)
+			continue;
+		tmp = table[k];
+		j = k;
+		while (order[j] != k) {
+			i = order[j];
+			table[j] = table[i];
+			order[j] = j;
+			j = i;
+		}
+		table[j] = tmp;
+		order[j] = j;
+	}
+
+	cmd->num_desc += len;
+	return 0;
+}
+
 /**
  * fetch_next_desc() - Fetches command descriptors from host memory
  * @cmd: command descriptors belongs to
  *
  * Function checks if there are descriptors that were not sent in the
- * tunnled command, and if so it reads them from host memory one by one.
+ * tunnled command, and if so it reads them from host memory. Descriptors
+ * that are likely to be the next in the chain are read together, see
+ * virtq_desc_window_trim().
  * Reading from host memory is done asynchronous
  *
  * Return: virtq_fetch_desc_status
@@ -200,50 +428,43 @@ bool virtq_sm_idle(struct virtq_cmd *cmd, enum virtq_cmd_sm_op_status status)
 static enum virtq_fetch_desc_status fetch_next_desc(struct virtq_cmd *cmd)
 {
 	uint64_t srcaddr;
-	uint16_t in_ring_desc_addr;
+	uint16_t in_ring_desc_addr = 0;
 	size_t len;
-	int ret;
+	int ret, n = 1;
 	struct vring_desc *descs = cmd->vq_priv->ops->get_descs(cmd);
 
 	if (snap_unlikely(cmd->is_indirect)) {
-		/*IN_ORDER is not support now, so we need to sort indirect table*/
-		struct vring_desc *descs_tmp = calloc(1, cmd->indirect_len);
-		struct vring_desc *descs_indrect = &descs[cmd->indirect_pos];
-		uint16_t indirect_num = cmd->indirect_len/sizeof(struct vring_desc);
-		int i = 0, j = 0;
-
-		if (snap_unlikely(!descs_tmp)) {
-			ERR_ON_CMD(cmd, "failed to malloc data for cmd\n");
+		if (virtq_indirect_arrange(cmd, &descs[cmd->indirect_pos]))
 			return VIRTQ_FETCH_DESC_ERR;
-		}
-		for (; i < indirect_num; i++) {
-			memcpy(&descs_tmp[i], &descs_indrect[j], sizeof(struct vring_desc));
-			if (descs_indrect[j].flags & VRING_DESC_F_NEXT)
-				j = descs_indrect[j].next;
-			else
-				break;
-		}
-		cmd->num_desc += i+1;
-		memcpy(descs_indrect, descs_tmp, cmd->indirect_len);
-		free(descs_tmp);
 		return VIRTQ_FETCH_DESC_DONE;
 	}
 
+	if (cmd->desc_window > 1)
+		virtq_desc_window_trim(cmd, descs);
+
 	if (cmd->num_desc == 0) {
 		in_ring_desc_addr = cmd->descr_head_idx % cmd->vq_priv->vattr->size;
 		srcaddr = cmd->vq_priv->vattr->desc +
 			  in_ring_desc_addr * sizeof(struct vring_desc);
 		len = sizeof(struct vring_desc);
+		n = -1;
 		/* TODO add some indication about this case */
 	} else if (descs[cmd->num_desc - 1].flags & VRING_DESC_F_NEXT) {
 		in_ring_desc_addr = descs[cmd->num_desc - 1].next;
 		srcaddr = cmd->vq_priv->vattr->desc +
 		  in_ring_desc_addr * sizeof(struct vring_desc);
 		len = sizeof(struct vring_desc);
+		n = -1;
 	} else if (descs[cmd->num_desc - 1].flags & VRING_DESC_F_INDIRECT) {
 		srcaddr = descs[cmd->num_desc - 1].addr;
 		len = descs[cmd->num_desc - 1].len;
+		if (snap_unlikely(!len || len % sizeof(struct vring_desc) ||
+				  len / sizeof(struct vring_desc) > cmd->vq_priv->vattr->size)) {
+			ERR_ON_CMD(cmd, "invalid indirect table len %lu\n", len);
+			return VIRTQ_FETCH_DESC_ERR;
+		}
 		cmd->num_desc--;
+		cmd->desc_window = 0;
 		cmd->is_indirect = true;
 		cmd->indirect_pos = cmd->num_desc;
 		cmd->indirect_len = len;
@@ -253,19 +474,39 @@ static enum virtq_fetch_desc_status fetch_next_desc(struct virtq_cmd *cmd)
 	if (cmd->vq_priv->ops->seg_dmem(cmd))
 		return VIRTQ_FETCH_DESC_ERR;
 
+	if (snap_unlikely(cmd->is_indirect) && cmd->vq_priv->ops->max_descs &&
+	    cmd->num_desc + len / sizeof(struct vring_desc) >
+	    cmd->vq_priv->ops->max_descs(cmd)) {
+		ERR_ON_CMD(cmd, "indirect table of %lu descs does not fit\n",
+			   len / sizeof(struct vring_desc));
+		return VIRTQ_FETCH_DESC_ERR;
+	}
+
 	cmd->dma_comp.count = 1;
-	virtq_log_data(cmd, "READ_DESC: pa 0x%lx len %lu\n", srcaddr, sizeof(struct vring_desc));
-	ret = snap_dma_q_read(cmd->vq_priv->dma_q, &cmd->vq_priv->ops->get_descs(cmd)[cmd->num_desc],
-			len, cmd->aux_mr->lkey, srcaddr,
-			cmd->vq_priv->vattr->dma_mkey,
-			&(cmd->dma_comp));
+	if (n < 0)
+		n = virtq_desc_window_size(cmd);
+	if (n > 1) {
+		in_ring_desc_addr %= cmd->vq_priv->vattr->size;
+		ret = virtq_read_desc_window(cmd, in_ring_desc_addr, n);
+	} else {
+		n = 1;
+		virtq_log_data(cmd, "READ_DESC: pa 0x%lx len %lu\n", srcaddr, sizeof(struct vring_desc));
+		ret = snap_dma_q_read(cmd->vq_priv->dma_q, &cmd->vq_priv->ops->get_descs(cmd)[cmd->num_desc],
+				len, cmd->aux_mr->lkey, srcaddr,
+				cmd->vq_priv->vattr->dma_mkey,
+				&(cmd->dma_comp));
+	}
 	if (ret)
 		return VIRTQ_FETCH_DESC_ERR;
 	/* Note: the num_desc should be incremented in case the success completion only.
 	 * The completion result is tested in virtq_sm_fetch_cmd_descs
 	 */
-	if (!cmd->is_indirect)
-		cmd->num_desc++;
+	if (!cmd->is_indirect) {
+		cmd->num_desc += n;
+		cmd->desc_window = n;
+		cmd->desc_window_idx = in_ring_desc_addr;
+	}
+	++cmd->vq_priv->desc_reads;
 	++cmd->vq_priv->cmd_cntrs.outstanding_to_host;
 	return VIRTQ_FETCH_DESC_READ;
 }
@@ -288,7 +529,7 @@ bool virtq_sm_fetch_cmd_descs(struct virtq_cmd *cmd,
 	enum virtq_fetch_desc_status ret;
 
 	if (status != VIRTQ_CMD_SM_OP_OK) {
-		--cmd->num_desc;
+		cmd->num_desc -= cmd->desc_window;
 		ERR_ON_CMD(cmd, "failed to fetch commands descs - num_desc: %ld, dumping command without response\n",
 			   cmd->num_desc);
 		cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
@@ -312,6 +553,105 @@ bool virtq_sm_fetch_cmd_descs(struct virtq_cmd *cmd,
 	}
 }
 
+static int virtq_post_data_chunk(struct virtq_cmd *cmd, bool to_host,
+		struct iovec *liov, struct iovec *riov, int riov_cnt)
+{
+	struct virtq_priv *priv = cmd->vq_priv;
+	uint32_t lkey = cmd->req_mr->lkey;
+	uint32_t rkey = priv->vattr->dma_mkey;
+	int ret;
+
+	cmd->dma_comp.count++;
+	if (riov_cnt == 1) {
+		if (to_host)
+			ret = snap_dma_q_write(priv->dma_q, liov->iov_base,
+					       liov->iov_len, lkey,
+					       (uint64_t)riov->iov_base, rkey,
+					       &cmd->dma_comp);
+		else
+			ret = snap_dma_q_read(priv->dma_q, liov->iov_base,
+					      liov->iov_len, lkey,
+					      (uint64_t)riov->iov_base, rkey,
+					      &cmd->dma_comp);
+	} else if (to_host) {
+		ret = snap_dma_q_writev2v(priv->dma_q, &lkey, liov, 1,
+					  &rkey, riov, riov_cnt, true, true,
+					  &cmd->dma_comp);
+	} else {
+		ret = snap_dma_q_readv2v(priv->dma_q, &lkey, liov, 1,
+					 &rkey, riov, riov_cnt, true, true,
+					 &cmd->dma_comp);
+	}
+
+	if (snap_unlikely(ret))
+		cmd->dma_comp.count--;
+	return ret;
+}
+
+/**
+ * virtq_xfer_data_descs() - Move data between host and command request buffer
+ * @cmd:      Command being processed
+ * @descs:    data descriptors
+ * @num_desc: number of data descriptors
+ * @to_host:  write the request buffer to the host, otherwise read the
+ *            driver readable descriptors from the host
+ * @n_posted: number of posted dma operations
+ *
+ * The local side of the transfer is the contiguous request buffer, the
+ * remote side is the list of the data descriptors. The list is split into
+ * chunks of up to SNAP_DMA_Q_MAX_IOV_CNT descriptors and each chunk is posted
+ * with a single vectored dma operation. All operations complete on the
+ * command dma completion.
+ *
+ * Return: 0 on success, -errno if an operation failed to post. Operations
+ * that were posted before the failure are reported in @n_posted.
+ */
+int virtq_xfer_data_descs(struct virtq_cmd *cmd, const struct vring_desc *descs,
+			  size_t num_desc, bool to_host, int *n_posted)
+{
+	int max_iov = snap_min(SNAP_DMA_Q_MAX_IOV_CNT, cmd->vq_priv->vattr->size);
+	struct iovec riov[SNAP_DMA_Q_MAX_IOV_CNT];
+	struct iovec liov;
+	size_t offset = 0, i;
+	int n = 0, ret;
+
+	*n_posted = 0;
+	cmd->dma_comp.count = 0;
+	liov.iov_base = cmd->req_buf;
+	liov.iov_len = 0;
+	for (i = 0; i < num_desc; i++) {
+		if (!to_host && (descs[i].flags & VRING_DESC_F_WRITE))
+			continue;
+
+		virtq_log_data(cmd, "%s: pa 0x%llx len %u\n",
+			       to_host ? "WRITE_DATA" : "READ_DATA",
+			       descs[i].addr, descs[i].len);
+		riov[n].iov_base = (void *)descs[i].addr;
+		riov[n].iov_len = descs[i].len;
+		liov.iov_len += descs[i].len;
+		offset += descs[i].len;
+		if (++n < max_iov)
+			continue;
+
+		ret = virtq_post_data_chunk(cmd, to_host, &liov, riov, n);
+		if (ret)
+			return ret;
+		(*n_posted)++;
+		liov.iov_base = cmd->req_buf + offset;
+		liov.iov_len = 0;
+		n = 0;
+	}
+
+	if (n) {
+		ret = virtq_post_data_chunk(cmd, to_host, &liov, riov, n);
+		if (ret)
+			return ret;
+		(*n_posted)++;
+	}
+
+	return 0;
+}
+
 /**
  * virtq_sm_write_back_done() - check write to bdev result status
  * @cmd:	command which requested the write
@@ -431,7 +771,7 @@ inline bool virtq_sm_write_status(struct virtq_cmd *cmd,
 				cmd->vq_priv->vattr->dma_mkey);
 
 	if (snap_unlikely(ret)) {
-		/* TODO: at some point we will have to do pending queue */
+		/* -EAGAIN here means that dma_q pending ring is full */
 		ERR_ON_CMD(cmd, "failed to send status, err=%d", ret);
 		cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
 		return true;
@@ -444,30 +784,176 @@ inline bool virtq_sm_write_status(struct virtq_cmd *cmd,
 	return true;
 }
 
-int virtq_sw_send_comp(struct virtq_cmd *cmd, struct snap_dma_q *q)
+static int virtq_used_batch_write(struct virtq_priv *vq_priv, uint16_t slot,
+				  uint16_t n)
 {
-	struct snap_virtio_common_queue_attr *cmn_queue = to_common_queue_attr(cmd->vq_priv->vattr);
-	uint64_t used_idx_addr, used_elem_addr;
-	struct vring_used_elem elem;
+	struct virtq_used_batch *ub = &vq_priv->used_batch;
+
+	return snap_dma_q_write(vq_priv->dma_q, &ub->ring[slot],
+				n * sizeof(struct vring_used_elem),
+				ub->mr ? ub->mr->lkey : 0,
+				vq_priv->vattr->device +
+				offsetof(struct vring_used, ring[slot]),
+				vq_priv->vattr->dma_mkey, NULL);
+}
+
+static void virtq_used_batch_notify(struct virtq_used_batch *ub)
+{
+	ub->interrupts++;
+	if (ub->notify)
+		ub->notify(ub->notify_arg);
+}
+
+static void virtq_used_event_cb(struct snap_dma_completion *comp, int status);
+
+/**
+ * virtq_used_batch_signal() - interrupt the driver about a new used index
+ * @vq_priv:	queue to signal
+ *
+ * With EVENT_IDX the used_event read is posted behind the used index
+ * write on the same queue, so the value it returns is at least as new as
+ * the one the driver used to check the used index. Deciding with an older
+ * used_event, e.g. one fetched with the avail ring, can miss the update
+ * the driver is waiting for. When the index write is left in the dma queue
+ * deferred operations ring, the read is deferred behind it, it is never
+ * posted ahead of it. One read is in flight at a time, updates
+ * written meanwhile are decided by a new read once it completes.
+ *
+ * A failed read post is retried by the next progress call.
+ */
+static void virtq_used_batch_signal(struct virtq_priv *vq_priv)
+{
+	struct virtq_used_batch *ub = &vq_priv->used_batch;
+	uint16_t size = vq_priv->vattr->size;
+
+	if (!ub->event_idx) {
+		virtq_used_batch_notify(ub);
+		return;
+	}
+
+	if (ub->event_read || ub->used_idx == ub->signalled_used)
+		return;
+
+	ub->event_comp.func = virtq_used_event_cb;
+	ub->event_comp.count = 1;
+	if (snap_dma_q_read_short(vq_priv->dma_q, &ub->used_event,
+				  sizeof(uint16_t),
+				  vq_priv->vattr->driver +
+				  offsetof(struct vring_avail, ring[size]),
+				  vq_priv->vattr->dma_mkey, &ub->event_comp))
+		return;
+
+	ub->event_read = true;
+	ub->event_used_idx = ub->used_idx;
+}
+
+static void virtq_used_event_cb(struct snap_dma_completion *comp, int status)
+{
+	struct virtq_used_batch *ub = container_of(comp, struct virtq_used_batch,
+						   event_comp);
+	struct virtq_priv *vq_priv = container_of(ub, struct virtq_priv,
+						  used_batch);
+	uint16_t old = ub->signalled_used;
+	bool valid = ub->signalled_valid;
+
+	ub->event_read = false;
+	ub->signalled_used = ub->event_used_idx;
+	ub->signalled_valid = true;
+
+	/* an interrupt too many is harmless, a missing one stalls the driver */
+	if (snap_unlikely(status != IBV_WC_SUCCESS) || !valid ||
+	    vring_need_event(ub->used_event, ub->signalled_used, old))
+		virtq_used_batch_notify(ub);
+	else
+		ub->suppressed++;
+
+	if (ub->used_idx == ub->signalled_used)
+		return;
+	if (snap_likely(vq_priv->swq_state == SW_VIRTQ_RUNNING)) {
+		virtq_used_batch_signal(vq_priv);
+	} else {
+		/* the queue is being flushed, do not post any more */
+		ub->signalled_used = ub->used_idx;
+		virtq_used_batch_notify(ub);
+	}
+}
+
+/**
+ * virtq_used_batch_flush() - write pending used elements to the host
+ * @vq_priv:	queue to flush
+ *
+ * Pending elements occupy consecutive ring slots starting at
+ * hw_used_index, they are written with one dma write per contiguous run
+ * followed by a single used index update. The shadow ring entries are not
+ * reused before the driver has seen the new used index, and that write is
+ * ordered after the ring writes on the same queue, so the writes do not
+ * need a completion.
+ *
+ * On failure the elements stay pending and the flush is retried by the
+ * next progress call.
+ *
+ * Return: 0 on success, -errno otherwise
+ */
+int virtq_used_batch_flush(struct virtq_priv *vq_priv)
+{
+	struct snap_virtio_common_queue_attr *cmn_queue = to_common_queue_attr(vq_priv->vattr);
+	struct virtq_used_batch *ub = &vq_priv->used_batch;
+	uint16_t size = vq_priv->vattr->size;
+	uint16_t slot = cmn_queue->hw_used_index % size;
+	uint16_t n = snap_min(ub->n, size - slot);
 	int ret;
 
-	elem.id = cmd->descr_head_idx;
-	elem.len = cmd->total_in_len;
-	used_elem_addr = cmd->vq_priv->vattr->device +
-			offsetof(struct vring_used, ring[cmn_queue->hw_used_index % cmd->vq_priv->vattr->size]);
-	ret = snap_dma_q_write_short(q, &elem, sizeof(elem),
-			used_elem_addr,
-			cmd->vq_priv->vattr->dma_mkey);
+	ub->age = 0;
+	if (!ub->n)
+		return 0;
+
+	ret = virtq_used_batch_write(vq_priv, slot, n);
+	if (snap_likely(!ret) && n < ub->n)
+		ret = virtq_used_batch_write(vq_priv, 0, ub->n - n);
 	if (snap_unlikely(ret))
 		return ret;
 
-	used_idx_addr = cmd->vq_priv->vattr->device + offsetof(struct vring_used, idx);
-	cmn_queue->hw_used_index = cmn_queue->hw_used_index + 1;
-	ret = snap_dma_q_write_short(q, &cmn_queue->hw_used_index, sizeof(uint16_t),
-						   used_idx_addr,
-					       cmd->vq_priv->vattr->dma_mkey);
+	ub->used_idx = cmn_queue->hw_used_index + ub->n;
+	ret = snap_dma_q_write_short(vq_priv->dma_q, &ub->used_idx,
+				     sizeof(uint16_t),
+				     vq_priv->vattr->device + offsetof(struct vring_used, idx),
+				     vq_priv->vattr->dma_mkey);
+	if (snap_unlikely(ret))
+		return ret;
 
-	return ret;
+	cmn_queue->hw_used_index = ub->used_idx;
+	ub->flushes++;
+	ub->elems += ub->n;
+	ub->n = 0;
+	virtq_used_batch_signal(vq_priv);
+	return 0;
+}
+
+int virtq_sw_send_comp(struct virtq_cmd *cmd, struct snap_dma_q *q)
+{
+	struct snap_virtio_common_queue_attr *cmn_queue = to_common_queue_attr(cmd->vq_priv->vattr);
+	struct virtq_used_batch *ub = &cmd->vq_priv->used_batch;
+	struct vring_used_elem *elem;
+	int ret;
+
+	/* shadow ring is full only if the flushes keep failing, try again */
+	if (snap_unlikely(ub->n == cmd->vq_priv->vattr->size)) {
+		ret = virtq_used_batch_flush(cmd->vq_priv);
+		if (ret)
+			return ret;
+	}
+
+	elem = &ub->ring[(uint16_t)(cmn_queue->hw_used_index + ub->n) %
+			 cmd->vq_priv->vattr->size];
+	elem->id = cmd->descr_head_idx;
+	elem->len = cmd->total_in_len;
+	ub->n++;
+
+	if (ub->n < ub->max_batch)
+		return 0;
+	/* the element is queued, a failed flush is retried by progress */
+	virtq_used_batch_flush(cmd->vq_priv);
+	return 0;
 }
 
 int virtq_blk_dpa_complete(struct snap_virtio_queue *vq, struct vring_used_elem *comp);
@@ -543,8 +1029,12 @@ inline bool virtq_sm_send_completion(struct virtq_cmd *cmd,
 	}
 
 	ret = cmd->vq_priv->ops->send_comp(cmd, cmd->vq_priv->dma_q);
-	if (snap_unlikely(ret)) {
-		/* TODO: pending queue */
+	if (snap_unlikely(ret == -EAGAIN)) {
+		/* dma queue is out of resources, progress sends it later */
+		cmd->state = VIRTQ_CMD_STATE_SEND_COMP;
+		cmd->vq_priv->blocked_comps++;
+		return false;
+	} else if (snap_unlikely(ret)) {
 		ERR_ON_CMD(cmd, "failed to send completion ret %d\n", ret);
 		cmd->state = VIRTQ_CMD_STATE_FATAL_ERR;
 	} else {
@@ -614,6 +1104,9 @@ static void virtq_progress_suspend(struct virtq_common_ctx *q)
 	if (!virtq_check_outstanding_progress_suspend(priv))
 		return;
 
+	if (virtq_used_batch_flush(priv))
+		return;
+
 	n = snap_dma_q_flush(priv->dma_q);
 
 	qattr.vattr.state = SNAP_VIRTQ_STATE_SUSPEND;
@@ -648,7 +1141,195 @@ static void virtq_progress_unordered(struct virtq_priv *vq_priv)
 	}
 }
 
+/*
+ * Commands whose completion could not be sent wait in the
+ * VIRTQ_CMD_STATE_SEND_COMP state, no other command rests in that state
+ * between progress calls.
+ */
+static void virtq_progress_blocked_comps(struct virtq_priv *vq_priv)
+{
+	struct virtq_cmd *cmd;
+	uint16_t i;
+
+	for (i = 0; i < vq_priv->vattr->size && vq_priv->blocked_comps; i++) {
+		cmd = vq_priv->ops->get_avail_cmd(vq_priv->cmd_arr, i);
+		if (cmd->state != VIRTQ_CMD_STATE_SEND_COMP)
+			continue;
+
+		vq_priv->blocked_comps--;
+		virtq_cmd_progress(cmd, VIRTQ_CMD_SM_OP_OK);
+		/* still no resources, do not try the others */
+		if (cmd->state == VIRTQ_CMD_STATE_SEND_COMP)
+			break;
+	}
+}
+
 //#define VIRTIO_QUEUE_POLL_ENABLED
+
+#define VIRTQ_POLL_MAX_REQS 64
+
+/*
+ * Heads are not fetched while the queue is flushing or while commands wait
+ * for QoS admission, the provider keeps them until the queue runs again.
+ */
+static int virtq_progress_poll(struct virtq_priv *priv)
+{
+	struct virtq_split_tunnel_req reqs[VIRTQ_POLL_MAX_REQS];
+	struct virtq_q_ops *q_ops = priv->snap_vbq->q_ops;
+	int i, n = 0;
+
+	if (snap_likely(priv->swq_state == SW_VIRTQ_RUNNING && !priv->qos_throttled)) {
+		n = q_ops->poll(priv->snap_vbq, reqs, VIRTQ_POLL_MAX_REQS);
+		for (i = 0; i < n; i++)
+			priv->dma_q->rx_cb(priv->dma_q, &reqs[i], 0, 0);
+	}
+
+	if (q_ops->send_completions)
+		q_ops->send_completions(priv->snap_vbq);
+
+	return snap_max(n, 0);
+}
+
+static struct virtq_cmd *virtq_ready_pop(struct virtq_ready_ring *ring)
+{
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	struct virtq_cmd *cmd;
+
+	/* the slot is refilled only after the head moves past it, in which
+	 * case the CAS fails and the command is not used
+	 */
+	do {
+		if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+			return NULL;
+		cmd = __atomic_load_n(&ring->cmds[head & ring->mask], __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&ring->head, &head, head + 1, false,
+					      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return cmd;
+}
+
+static struct virtq_cmd *virtq_done_pop(struct virtq_done_ring *ring)
+{
+	struct virtq_done_slot *slot = &ring->slots[ring->head & ring->mask];
+	struct virtq_cmd *cmd;
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->head + 1)
+		return NULL;
+
+	cmd = slot->cmd;
+	/* free for the producer that claims it a lap later */
+	__atomic_store_n(&slot->seq, ring->head + ring->mask + 1, __ATOMIC_RELEASE);
+	ring->head++;
+	return cmd;
+}
+
+/**
+ * virtq_steal_push() - let any poll group thread submit a command
+ * @cmd:	command in the HANDLE_REQ state, already accounted in
+ *		outstanding_in_bdev
+ *
+ * The command is submitted by the first thread that takes it from the
+ * ready ring, with virtq_steal(). It continues on the queue owner once
+ * the block device completes it, see virtq_steal_done().
+ *
+ * Context: called by the thread that progresses the queue
+ */
+void virtq_steal_push(struct virtq_cmd *cmd)
+{
+	struct virtq_ready_ring *ring = &cmd->vq_priv->steal.ready;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+	cmd->steal = true;
+	__atomic_store_n(&ring->cmds[tail & ring->mask], cmd, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * virtq_steal_done() - hand a command back to the queue owner
+ * @cmd:	command whose block device operation is done
+ *
+ * The command must not be touched by the caller afterwards.
+ *
+ * Context: called by any thread, typically from the block device
+ * completion callback of the thread that submitted the command
+ */
+void virtq_steal_done(struct virtq_cmd *cmd)
+{
+	struct virtq_done_ring *ring = &cmd->vq_priv->steal.done;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	struct virtq_done_slot *slot;
+	uint32_t seq;
+
+	for (;;) {
+		slot = &ring->slots[tail & ring->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq != tail) {
+			tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, false,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	slot->cmd = cmd;
+	__atomic_store_n(&slot->seq, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * virtq_steal() - submit block device operations of a queue
+ * @q:		queue
+ * @thread_id:	poll group thread the operations are submitted from
+ * @max:	maximum number of commands
+ *
+ * Takes the oldest commands of the ready ring of @q and submits them to the
+ * block device channel of @thread_id.
+ *
+ * Context: called by any thread. Threads other than the queue owner must
+ * keep @q from being destroyed, see snap_pg_steal_begin().
+ *
+ * Return: number of commands submitted
+ */
+int virtq_steal(struct virtq_common_ctx *q, int thread_id, int max)
+{
+	struct virtq_priv *priv = q->priv;
+	struct virtq_cmd *cmd;
+	int n;
+
+	if (!virtq_steal_enabled(priv))
+		return 0;
+
+	for (n = 0; n < max; n++) {
+		cmd = virtq_ready_pop(&priv->steal.ready);
+		if (!cmd)
+			break;
+		priv->ops->bdev_submit(cmd, thread_id);
+	}
+
+	if (n && thread_id != priv->pg_id)
+		__atomic_add_fetch(&priv->steal.stolen, n, __ATOMIC_RELAXED);
+	return n;
+}
+
+/*
+ * Commands completed by the block device continue here, on the thread that
+ * owns the DMA queue. The owner also submits some of its ready commands,
+ * the others are left to idle threads.
+ */
+static int virtq_steal_progress(struct virtq_priv *priv)
+{
+	struct virtq_cmd *cmd;
+	int n = 0;
+
+	while ((cmd = virtq_done_pop(&priv->steal.done))) {
+		cmd->steal = false;
+		priv->ops->bdev_done(cmd);
+		n++;
+	}
+
+	return n + virtq_steal(priv->vq_ctx, priv->pg_id, priv->steal.owner_batch);
+}
+
 /**
  * virtq_progress() - Progress RDMA QPs,  Polls on QPs CQs
  * @q:	queue to progress
@@ -668,22 +1349,25 @@ int virtq_progress(struct virtq_common_ctx *q, int thread_id)
 	priv->thread_id = thread_id;
 	n += snap_dma_q_progress(priv->dma_q);
 
+	if (priv->q_poll)
+		n += virtq_progress_poll(priv);
 #ifdef VIRTIO_QUEUE_POLL_ENABLED
-	if (priv->snap_vbq->q_ops->poll) {
-		int i;
-		int n;
-		struct virtq_split_tunnel_req reqs[64];
-
-		n = priv->snap_vbq->q_ops->poll(priv->snap_vbq, reqs, 64);
-		for (i = 0; i < n; i++)
-			priv->dma_q->rx_cb(priv->dma_q, &reqs[i], 0, 0);
-
-		priv->snap_vbq->q_ops->send_completions(priv->snap_vbq);
-	}
+	else if (priv->snap_vbq->q_ops->poll)
+		n += virtq_progress_poll(priv);
 #endif
+	if (virtq_steal_enabled(priv))
+		n += virtq_steal_progress(priv);
+	if (snap_unlikely(priv->blocked_comps))
+		virtq_progress_blocked_comps(priv);
 	if (snap_unlikely(priv->force_in_order))
 		virtq_progress_unordered(priv);
 
+	if (priv->used_batch.n && ++priv->used_batch.age > priv->used_batch.max_delay)
+		virtq_used_batch_flush(priv);
+	else if (snap_unlikely(priv->used_batch.event_idx &&
+			       priv->used_batch.used_idx != priv->used_batch.signalled_used))
+		virtq_used_batch_signal(priv);
+
 	/*
 	 * need to wait until all inflight requests
 	 * are finished before moving to the suspend state
@@ -695,6 +1379,74 @@ out:
 	return n;
 }
 
+/* acks the events of the armed cqs, they are not armed anymore */
+static void virtq_ack_events(struct virtq_priv *priv)
+{
+	struct ibv_cq *cq;
+	void *cq_ctx;
+
+	while (!ibv_get_cq_event(priv->comp_channel, &cq, &cq_ctx))
+		ibv_ack_cq_events(cq, 1);
+}
+
+/**
+ * virtq_arm() - let the queue wake up its idle poll group thread
+ * @q:		queue
+ *
+ * Arms the cqs of the queue, they receive the new commands and the DMA
+ * completions. Commands that wait for the block device or for QoS tokens
+ * and delayed used ring updates have no notification, the queue must be
+ * polled until they are done.
+ *
+ * Context: called by the poll group thread, between progress calls
+ *
+ * Return: 0 if the thread can sleep, -EBUSY if the queue has work,
+ * -ENOTSUP if the queue has no notification
+ */
+int virtq_arm(struct virtq_common_ctx *q)
+{
+	struct virtq_priv *priv = q->priv;
+
+	if (!priv->comp_channel || priv->q_poll)
+		return -ENOTSUP;
+
+	virtq_ack_events(priv);
+	if (priv->swq_state == SW_VIRTQ_SUSPENDED)
+		return 0;
+
+	if (priv->swq_state != SW_VIRTQ_RUNNING || priv->qos_throttled ||
+	    priv->cmd_cntrs.outstanding_in_bdev ||
+	    priv->cmd_cntrs.outstanding_total != priv->cmd_cntrs.outstanding_to_host ||
+	    priv->used_batch.n ||
+	    (priv->used_batch.event_idx &&
+	     priv->used_batch.used_idx != priv->used_batch.signalled_used))
+		return -EBUSY;
+
+	if (snap_dma_q_arm_batch(priv->dma_q))
+		return -ENOTSUP;
+
+	/* completions that came before the cqs were armed do not notify */
+	if (snap_dma_q_progress(priv->dma_q))
+		return -EBUSY;
+
+	return 0;
+}
+
+/**
+ * virtq_event_fd() - file descriptor of the queue notifications
+ * @q:		queue
+ *
+ * Return: file descriptor to poll, -1 if the queue has no notification
+ */
+int virtq_event_fd(struct virtq_common_ctx *q)
+{
+	struct virtq_priv *priv = q->priv;
+
+	if (!priv->comp_channel || priv->q_poll)
+		return -1;
+	return priv->comp_channel->fd;
+}
+
 /**
  * virtq_start() - set virtq attributes used for operating
  * @q:		queue to start
@@ -796,6 +1548,8 @@ virtq_rx_cb_common_set(struct virtq_priv *vq_priv, const void *data)
 	cmd->req_mr = cmd->mr;
 	cmd->cmd_available_index = vq_priv->ctrl_available_index;
 	cmd->is_indirect = false;
+	cmd->desc_window = 0;
+	cmd->desc_prefetch_off = false;
 	return cmd;
 }
 
@@ -872,3 +1626,154 @@ void virtq_reg_mr_fail_log_error(const struct virtq_cmd *cmd)
 	snap_error("failed to register mr: ctrl %p queue %d cmd %p cmd_idx %d - error %d (%s)\n",
 		   vq->ctrl, cmd->vq_priv->vq_ctx->idx, cmd, cmd->idx, errno, strerror(errno));
 }
+
+static struct ibv_mr *virtq_aux_pool_reg(struct virtq_aux_pool *pool, void *addr)
+{
+	if (pool->ops)
+		return pool->ops->reg(pool->arg, addr, pool->block_size);
+	return snap_reg_mr(pool->pd, addr, pool->block_size);
+}
+
+static void virtq_aux_pool_dereg(struct virtq_aux_pool *pool, struct ibv_mr *mr)
+{
+	if (pool->ops)
+		pool->ops->dereg(pool->arg, mr);
+	else
+		ibv_dereg_mr(mr);
+}
+
+static void *virtq_aux_pool_alloc(struct virtq_aux_pool *pool, struct ibv_mr **mr)
+{
+	void *block;
+
+	block = malloc(pool->block_size);
+	if (!block) {
+		snap_error("failed to allocate %lu bytes for descriptors\n",
+			   pool->block_size);
+		return NULL;
+	}
+
+	*mr = virtq_aux_pool_reg(pool, block);
+	if (!*mr) {
+		snap_error("failed to register %lu bytes for descriptors - error %d (%s)\n",
+			   pool->block_size, errno, strerror(errno));
+		free(block);
+		return NULL;
+	}
+
+	return block;
+}
+
+static void virtq_aux_pool_release(struct virtq_aux_pool *pool, void *block,
+				   struct ibv_mr *mr)
+{
+	virtq_aux_pool_dereg(pool, mr);
+	free(block);
+}
+
+/**
+ * virtq_aux_pool_init() - create long chain descriptor blocks
+ * @pool:	pool to initialize
+ * @pd:		protection domain used to register the blocks
+ * @block_size:	size of a block
+ * @n_init:	number of blocks registered upfront
+ * @max_free:	max number of free blocks kept by the pool
+ * @ops:	registration callbacks, NULL to register with snap_reg_mr()
+ * @arg:	first argument of the callbacks
+ *
+ * Return: 0 on success, -errno otherwise
+ */
+int virtq_aux_pool_init(struct virtq_aux_pool *pool, struct ibv_pd *pd,
+			size_t block_size, int n_init, int max_free,
+			const struct snap_buf_pool_ops *ops, void *arg)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->pd = pd;
+	pool->ops = ops;
+	pool->arg = arg;
+	pool->block_size = block_size;
+	pool->max_free = max_free;
+	if (!max_free)
+		return 0;
+
+	pool->blocks = calloc(max_free, sizeof(*pool->blocks));
+	pool->mrs = calloc(max_free, sizeof(*pool->mrs));
+	if (!pool->blocks || !pool->mrs)
+		goto err;
+
+	for (n_init = snap_min(n_init, max_free); pool->n_free < n_init; pool->n_free++) {
+		pool->blocks[pool->n_free] = virtq_aux_pool_alloc(pool,
+					&pool->mrs[pool->n_free]);
+		if (!pool->blocks[pool->n_free])
+			goto err;
+	}
+
+	return 0;
+
+err:
+	virtq_aux_pool_destroy(pool);
+	return -ENOMEM;
+}
+
+/**
+ * virtq_aux_pool_destroy() - release free descriptor blocks
+ * @pool:	pool to destroy
+ *
+ * All blocks must be returned to the pool before.
+ */
+void virtq_aux_pool_destroy(struct virtq_aux_pool *pool)
+{
+	while (pool->n_free) {
+		pool->n_free--;
+		virtq_aux_pool_release(pool, pool->blocks[pool->n_free],
+				       pool->mrs[pool->n_free]);
+	}
+	free(pool->blocks);
+	free(pool->mrs);
+	pool->blocks = NULL;
+	pool->mrs = NULL;
+}
+
+/**
+ * virtq_aux_pool_get() - get a registered descriptor block
+ * @pool:	pool to get the block from
+ * @mr:	returns memory region of the block
+ *
+ * A block is allocated and registered if the pool is empty.
+ *
+ * Return: block or NULL on error
+ */
+void *virtq_aux_pool_get(struct virtq_aux_pool *pool, struct ibv_mr **mr)
+{
+	pool->gets++;
+	if (snap_likely(pool->n_free)) {
+		pool->n_free--;
+		*mr = pool->mrs[pool->n_free];
+		return pool->blocks[pool->n_free];
+	}
+
+	pool->misses++;
+	return virtq_aux_pool_alloc(pool, mr);
+}
+
+/**
+ * virtq_aux_pool_put() - return a descriptor block to the pool
+ * @pool:	pool the block was taken from
+ * @block:	block returned by virtq_aux_pool_get()
+ * @mr:	memory region of the block
+ *
+ * The block is kept for the next long chain unless the pool already holds
+ * max_free blocks.
+ */
+void virtq_aux_pool_put(struct virtq_aux_pool *pool, void *block,
+			struct ibv_mr *mr)
+{
+	if (snap_unlikely(pool->n_free == pool->max_free)) {
+		virtq_aux_pool_release(pool, block, mr);
+		return;
+	}
+
+	pool->blocks[pool->n_free] = block;
+	pool->mrs[pool->n_free] = mr;
+	pool->n_free++;
+}
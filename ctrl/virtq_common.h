@@ -39,6 +39,11 @@
 #include <sys/uio.h>
 #include "snap_virtio_common_ctrl.h"
 #include "snap_dma.h"
+#include "snap_buf.h"
+
+#ifndef VIRTIO_F_IN_ORDER
+#define VIRTIO_F_IN_ORDER 35
+#endif
 
 #define ERR_ON_CMD(cmd, fmt, ...) \
 	snap_error("queue:%d cmd_idx:%d err: " fmt, \
@@ -86,6 +91,12 @@ struct virtq_common_ctx {
  * @hw_available_index:	initial value of the driver available index.
  * @hw_used_index:	initial value of the device used index
  * @force_in_order:	handle reqs in order
+ * @in_order:	VIRTIO_F_IN_ORDER was negotiated, implies @force_in_order
+ * @event_idx:	VIRTIO_RING_F_EVENT_IDX was negotiated
+ * @notify:	the queue notifies an idle poll group thread of new commands
+ *		and DMA completions over a completion channel
+ * @steal:	block device operations of the queue can be submitted by
+ *		other poll group threads, see virtq_steal()
  */
 struct virtq_create_attr {
 	int idx;
@@ -102,8 +113,12 @@ struct virtq_create_attr {
 	uint16_t hw_available_index;
 	uint16_t hw_used_index;
 	bool force_in_order;
+	bool in_order;
 	uint32_t xmkey;
 	bool in_recovery;
+	bool event_idx;
+	bool notify;
+	bool steal;
 };
 
 struct virtq_start_attr {
@@ -174,6 +189,10 @@ enum virtq_sw_state {
  * @io_cmd_stat:		command io stats
  * @cmd_available_index:sequential number of the command according to arrival
  * @use_seg_dmem:		command uses dynamic mem for descriptors
+ * @desc_window:		number of descriptors read by the last fetch
+ * @desc_window_idx:	ring index of the first descriptor read by the last fetch
+ * @desc_prefetch_off:	chain left the prefetch window, fetch one by one
+ * @steal:		block device operation goes through the steal rings
  */
 struct virtq_cmd {
 	int idx;
@@ -200,6 +219,10 @@ struct virtq_cmd {
 	uint16_t indirect_len;
 	bool use_seg_dmem;
 	bool is_indirect;
+	uint16_t desc_window;
+	uint16_t desc_window_idx;
+	bool desc_prefetch_off;
+	bool steal;
 };
 
 /**
@@ -212,6 +235,151 @@ struct virtq_bdev {
 	void *ops;
 };
 
+/**
+ * struct virtq_used_batch - used ring updates accumulated by virtq_sw_send_comp()
+ * @ring:	shadow of the host used ring, queue size entries
+ * @mr:		@ring memory registration
+ * @n:		number of pending used elements, they follow hw_used_index
+ * @max_batch:	flush once that many elements are pending
+ * @max_delay:	flush once elements are pending for that many progress calls
+ * @age:	progress calls since the last flush
+ * @used_idx:	used index value written to the host by the last flush
+ * @flushes:	number of flushes
+ * @elems:	number of flushed used elements
+ * @event_idx:	VIRTIO_RING_F_EVENT_IDX was negotiated
+ * @used_event:	used_event read from the avail ring
+ * @event_comp:	completion of the used_event read
+ * @event_read:	used_event read is in flight
+ * @event_used_idx:	used index written before the used_event read
+ * @signalled_used:	used index of the last interrupt decision
+ * @signalled_valid:	@signalled_used is valid
+ * @notify:	raises the queue interrupt, optional
+ * @notify_arg:	argument of @notify
+ * @interrupts:	number of interrupts
+ * @suppressed:	number of used index updates that did not need an interrupt
+ *
+ * Used elements of consecutive completions land in consecutive ring slots,
+ * so a flush writes at most two runs (one at the ring wrap) and a single
+ * used index update, instead of two writes per completion.
+ *
+ * Without EVENT_IDX every flush interrupts the driver. With it, used_event
+ * is read behind the used index write and the driver is interrupted only
+ * if the used index has just passed it.
+ */
+struct virtq_used_batch {
+	struct vring_used_elem *ring;
+	struct ibv_mr *mr;
+	uint16_t n;
+	uint16_t max_batch;
+	uint16_t max_delay;
+	uint16_t age;
+	uint16_t used_idx;
+	uint64_t flushes;
+	uint64_t elems;
+	bool event_idx;
+	uint16_t used_event;
+	struct snap_dma_completion event_comp;
+	bool event_read;
+	uint16_t event_used_idx;
+	uint16_t signalled_used;
+	bool signalled_valid;
+	void (*notify)(void *arg);
+	void *notify_arg;
+	uint64_t interrupts;
+	uint64_t suppressed;
+};
+
+/**
+ * struct virtq_aux_pool - registered descriptor blocks for long chains
+ * @pd:		protection domain of the blocks
+ * @ops:	registration callbacks
+ * @arg:	first argument of the callbacks
+ * @block_size:	size of a block
+ * @blocks:	free blocks
+ * @mrs:	memory regions of the free blocks
+ * @n_free:	number of free blocks
+ * @max_free:	number of free blocks kept by the pool, blocks returned
+ *		above it are released
+ * @gets:	number of blocks taken from the pool
+ * @misses:	number of blocks that were allocated and registered on demand
+ *
+ * Commands with more descriptors than seg_max move their descriptors to a
+ * block that can hold a whole queue. The pool only grows, so that in the
+ * steady state long chains do not register memory.
+ */
+struct virtq_aux_pool {
+	struct ibv_pd *pd;
+	const struct snap_buf_pool_ops *ops;
+	void *arg;
+	size_t block_size;
+	void **blocks;
+	struct ibv_mr **mrs;
+	int n_free;
+	int max_free;
+	uint64_t gets;
+	uint64_t misses;
+};
+
+/**
+ * struct virtq_ready_ring - commands ready for the block device
+ * @cmds:	slots, @mask + 1 entries
+ * @mask:	number of slots - 1, the number of slots is a power of 2
+ * @tail:	next slot to fill, written by the queue owner only
+ * @head:	next slot to take, advanced by the consumers with a CAS
+ *
+ * Single producer, multi consumer ring: the thread that progresses the
+ * queue adds commands, it and the threads that steal from it take them in
+ * FIFO order.
+ */
+struct virtq_ready_ring {
+	struct virtq_cmd **cmds;
+	uint32_t mask;
+	uint32_t tail SNAP_CACHE_ALIGNED;
+	uint32_t head SNAP_CACHE_ALIGNED;
+};
+
+struct virtq_done_slot {
+	uint32_t seq;
+	struct virtq_cmd *cmd;
+};
+
+/**
+ * struct virtq_done_ring - commands back from the block device
+ * @slots:	slots, @mask + 1 entries
+ * @mask:	number of slots - 1, the number of slots is a power of 2
+ * @tail:	next slot to fill, claimed by the producers with a CAS
+ * @head:	next slot to take, used by the queue owner only
+ *
+ * Multi producer, single consumer ring. The sequence number of a slot
+ * tells whether it is free for the producer that claimed it or filled for
+ * the consumer, so a producer does not wait for the others.
+ */
+struct virtq_done_ring {
+	struct virtq_done_slot *slots;
+	uint32_t mask;
+	uint32_t tail SNAP_CACHE_ALIGNED;
+	uint32_t head SNAP_CACHE_ALIGNED;
+};
+
+/**
+ * struct virtq_steal - block device operations shared with other threads
+ * @ready:	commands in the HANDLE_REQ state waiting to be submitted
+ * @done:	completed commands waiting to continue on the queue owner
+ * @owner_batch: commands the owner submits per progress call, the rest is
+ *		left for the threads that steal
+ * @stolen:	commands submitted by other threads, updated atomically
+ *
+ * Only the block device operation moves between threads, everything that
+ * uses the DMA queue stays on the thread that progresses the queue. Both
+ * rings hold a whole queue, so they never overflow.
+ */
+struct virtq_steal {
+	struct virtq_ready_ring ready;
+	struct virtq_done_ring done;
+	int owner_batch;
+	uint64_t stolen;
+};
+
 /**
  * struct virtq_priv - virtq private context
  * @custom_sm:		state machine handlers array
@@ -236,6 +404,19 @@ struct virtq_bdev {
  * @merge_descs:	merges sequntial descriptors
  * @use_mem_pool:	uses memory pool for data act
  * @thread_id:		thread id
+ * @desc_prefetch:	max number of descriptors read from host memory at once
+ * @desc_reads:		number of descriptor reads from host memory
+ * @desc_prefetch_misses:	number of chains that left the prefetch window
+ * @indirect_idx:	scratch index arrays used to arrange indirect tables
+ *			in place, 2 x queue size entries
+ * @indirect_reorders:	number of indirect tables that were not sequential
+ * @used_batch:	used ring updates pending flush
+ * @aux_pool:	descriptor blocks for chains longer than seg_max
+ * @q_poll:	new heads are polled with the queue provider poll op,
+ *		there is no descriptor tunneling
+ * @qos_throttled:	commands wait for QoS admission, new heads are not
+ *			polled
+ * @steal:	block device operations other threads can submit, optional
  */
 struct virtq_priv {
 	struct virtq_state_machine *custom_sm;
@@ -262,6 +443,18 @@ struct virtq_priv {
 	int merge_descs;
 	bool use_mem_pool;
 	int thread_id;
+	uint16_t desc_prefetch;
+	uint64_t desc_reads;
+	uint64_t desc_prefetch_misses;
+	uint16_t *indirect_idx;
+	uint64_t indirect_reorders;
+	struct virtq_used_batch used_batch;
+	uint16_t blocked_comps;
+	struct virtq_aux_pool aux_pool;
+	bool q_poll;
+	bool qos_throttled;
+	struct ibv_comp_channel *comp_channel;
+	struct virtq_steal steal;
 };
 
 struct virtq_status_data {
@@ -293,8 +486,13 @@ struct virtq_impl_ops {
 			struct snap_virtio_common_queue_attr *qattr);
 	void (*mem_pool_release)(struct virtq_cmd *cmd);
 	int (*seg_dmem)(struct virtq_cmd *cmd);
+	uint32_t (*max_descs)(struct virtq_cmd *cmd);
 	bool (*seg_dmem_release)(struct virtq_cmd *cmd);
 	int (*send_comp)(struct virtq_cmd *cmd, struct snap_dma_q *q);
+	/* block device operation of a command taken from the ready ring */
+	void (*bdev_submit)(struct virtq_cmd *cmd, int thread_id);
+	/* command back from the done ring, called by the queue owner */
+	void (*bdev_done)(struct virtq_cmd *cmd);
 	/* hack... */
 	int (*send_status)(struct snap_virtio_queue *vq, void *data, int size, uint64_t raddr);
 };
@@ -365,6 +563,8 @@ int virtq_cmd_progress(struct virtq_cmd *cmd, enum virtq_cmd_sm_op_status status
 bool virtq_sm_idle(struct virtq_cmd *cmd, enum virtq_cmd_sm_op_status status);
 bool virtq_sm_fetch_cmd_descs(struct virtq_cmd *cmd,
 			       enum virtq_cmd_sm_op_status status);
+int virtq_xfer_data_descs(struct virtq_cmd *cmd, const struct vring_desc *descs,
+			  size_t num_desc, bool to_host, int *n_posted);
 bool virtq_sm_write_back_done(struct virtq_cmd *cmd,
 				   enum virtq_cmd_sm_op_status status);
 void virtq_mark_dirty_mem(struct virtq_cmd *cmd, uint64_t pa,
@@ -376,6 +576,13 @@ bool virtq_sm_send_completion(struct virtq_cmd *cmd,
 bool virtq_sm_release(struct virtq_cmd *cmd, enum virtq_cmd_sm_op_status status);
 bool virtq_sm_fatal_error(struct virtq_cmd *cmd, enum virtq_cmd_sm_op_status status);
 int virtq_progress(struct virtq_common_ctx *q, int thread_id);
+int virtq_arm(struct virtq_common_ctx *q);
+int virtq_event_fd(struct virtq_common_ctx *q);
+int virtq_steal_init(struct virtq_steal *steal, int queue_size);
+void virtq_steal_destroy(struct virtq_steal *steal);
+void virtq_steal_push(struct virtq_cmd *cmd);
+void virtq_steal_done(struct virtq_cmd *cmd);
+int virtq_steal(struct virtq_common_ctx *q, int thread_id, int max);
 void virtq_start(struct virtq_common_ctx *q, struct virtq_start_attr *attr);
 int virtq_suspend(struct virtq_common_ctx *q);
 bool virtq_is_suspended(struct virtq_common_ctx *q);
@@ -385,6 +592,14 @@ bool virtq_rx_cb_common_proc(struct virtq_cmd *cmd, const void *data,
 			     uint32_t data_len, uint32_t imm_data);
 int virtq_tunnel_send_comp(struct virtq_cmd *cmd, struct snap_dma_q *q);
 int virtq_sw_send_comp(struct virtq_cmd *cmd, struct snap_dma_q *q);
+int virtq_used_batch_flush(struct virtq_priv *vq_priv);
+int virtq_aux_pool_init(struct virtq_aux_pool *pool, struct ibv_pd *pd,
+			size_t block_size, int n_init, int max_free,
+			const struct snap_buf_pool_ops *ops, void *arg);
+void virtq_aux_pool_destroy(struct virtq_aux_pool *pool);
+void *virtq_aux_pool_get(struct virtq_aux_pool *pool, struct ibv_mr **mr);
+void virtq_aux_pool_put(struct virtq_aux_pool *pool, void *block,
+			struct ibv_mr *mr);
 int virtq_dpa_send_comp(struct virtq_cmd *cmd, struct snap_dma_q *q);
 
 static inline bool virtq_check_outstanding_progress_suspend(struct virtq_priv *vq_priv)
@@ -405,5 +620,10 @@ static inline bool virtq_check_outstanding_progress_suspend(struct virtq_priv *v
 
 void virtq_reg_mr_fail_log_error(const struct virtq_cmd *cmd);
 
+static inline bool virtq_steal_enabled(const struct virtq_priv *vq_priv)
+{
+	return vq_priv->steal.ready.cmds != NULL;
+}
+
 #endif
 
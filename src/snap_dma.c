@@ -38,11 +38,109 @@ int snap_dma_q_progress(struct snap_dma_q *q)
 {
 	int n;
 
-	n = q->ops->progress_tx(q);
+	n = snap_dma_q_progress_tx(q);
 	n += q->ops->progress_rx(q);
 	return n;
 }
 
+/**
+ * snap_dma_q_progress_tx() - Progress dma queue send operations
+ * @q: dma queue
+ *
+ * The function posts operations from the queue deferred operations ring
+ * (see &struct snap_dma_q_create_attr.pending_qsize) and progresses send
+ * operations on the given dma queue. Deferred operations are posted first
+ * so that their doorbell is rung by the same progress call.
+ *
+ * Send &typedef snap_dma_comp_cb_t callbacks may be called from within
+ * this function.
+ *
+ * Return: number of send events that were processed
+ */
+int snap_dma_q_progress_tx(struct snap_dma_q *q)
+{
+	int n;
+
+	if (snap_unlikely(snap_dma_q_has_pending(q)))
+		snap_dma_q_pending_progress(q);
+
+	n = q->ops->progress_tx(q);
+	snap_dma_q_stat_complete(q);
+	return n;
+}
+
+/**
+ * snap_dma_q_pending_count() - Get number of deferred operations
+ * @q: dma queue
+ *
+ * Return: number of operations that are waiting in the deferred operations
+ * ring for the send queue credits.
+ */
+int snap_dma_q_pending_count(struct snap_dma_q *q)
+{
+	return q->pending ? q->pending->pi - q->pending->ci : 0;
+}
+
+static inline struct snap_dma_pending_op *
+snap_dma_q_pending_get(struct snap_dma_q *q)
+{
+	struct snap_dma_pending_ring *ring = q->pending;
+
+	if (snap_unlikely(ring->pi - ring->ci > ring->mask))
+		return NULL;
+
+	return &ring->ops[ring->pi & ring->mask];
+}
+
+static inline void *snap_dma_q_pending_data(struct snap_dma_q *q)
+{
+	struct snap_dma_pending_ring *ring = q->pending;
+
+	return ring->data + (ring->pi & ring->mask) * ring->elem_size;
+}
+
+/*
+ * Once an operation is deferred all following operations must be deferred
+ * too, otherwise they will be executed out of order.
+ */
+static int snap_dma_q_defer(struct snap_dma_q *q, int type, void *buf,
+			    size_t len, uint32_t lkey, uint64_t raddr,
+			    uint32_t rkey, struct snap_dma_completion *comp,
+			    bool more)
+{
+	struct snap_dma_pending_op *op;
+
+	op = snap_dma_q_pending_get(q);
+	if (snap_unlikely(!op))
+		return -EAGAIN;
+
+	op->type = type;
+	op->iov.iov_base = buf;
+	op->iov.iov_len = len;
+	op->lkey = lkey;
+	op->raddr = raddr;
+	op->rkey = rkey;
+	op->comp = comp;
+	op->more = more;
+	q->pending->pi++;
+	return 0;
+}
+
+static int snap_dma_q_defer_short(struct snap_dma_q *q, int type, void *buf,
+				  size_t len, uint64_t raddr, uint32_t rkey)
+{
+	void *data;
+
+	/* caller may reuse the buffer once the function returns */
+	if (snap_unlikely(!snap_dma_q_pending_get(q)))
+		return -EAGAIN;
+
+	data = snap_dma_q_pending_data(q);
+	memcpy(data, buf, len);
+	return snap_dma_q_defer(q, type, data, len, 0, raddr, rkey, NULL,
+				false);
+}
+
 /**
  * snap_dma_q_poll_rx() - Poll rx from dma queue
  * @q: dma queue
@@ -76,7 +174,11 @@ int snap_dma_q_poll_rx(struct snap_dma_q *q, struct snap_rx_completion *rx_compl
  */
 int snap_dma_q_poll_tx(struct snap_dma_q *q, struct snap_dma_completion **comp, int max_completions)
 {
-	return q->ops->poll_tx(q, comp, max_completions);
+	int n;
+
+	n = q->ops->poll_tx(q, comp, max_completions);
+	snap_dma_q_stat_complete(q);
+	return n;
 }
 
 /**
@@ -95,6 +197,29 @@ int snap_dma_q_arm(struct snap_dma_q *q)
 	return q->ops->arm(q);
 }
 
+/**
+ * snap_dma_q_arm_batch() - Request notification, keep the doorbell mode
+ * @q: dma queue
+ *
+ * Same as snap_dma_q_arm(), but the queue keeps its doorbell mode. The
+ * pending doorbells are rung before the queue is armed, the doorbells of
+ * the operations posted after the wake up are batched again until the next
+ * snap_dma_q_progress() call.
+ *
+ * Not available on DPA
+ *
+ * Return:  0 or -errno on error
+ */
+int snap_dma_q_arm_batch(struct snap_dma_q *q)
+{
+	enum snap_db_ring_flag db_flag = q->sw_qp.dv_qp.db_flag;
+	int rc;
+
+	rc = q->ops->arm(q);
+	q->sw_qp.dv_qp.db_flag = db_flag;
+	return rc;
+}
+
 /**
  * snap_dma_q_flush() - Wait for outstanding operations to complete
  * @q:   dma queue
@@ -110,7 +235,14 @@ int snap_dma_q_arm(struct snap_dma_q *q)
  */
 int snap_dma_q_flush(struct snap_dma_q *q)
 {
-	return q->ops->flush(q);
+	int n = 0;
+
+	while (snap_dma_q_has_pending(q))
+		n += snap_dma_q_progress_tx(q);
+
+	n += q->ops->flush(q);
+	snap_dma_q_stat_complete(q);
+	return n;
 }
 
 /**
@@ -135,10 +267,14 @@ int snap_dma_q_flush_nowait(struct snap_dma_q *q, struct snap_dma_completion *co
 	int rc, n_bb = 0;
 
 	rc = q->ops->flush_nowait(q, comp, &n_bb);
-	if (snap_unlikely(rc))
+	if (snap_unlikely(rc)) {
+		if (rc == -EAGAIN)
+			snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_FLUSH);
 		return rc;
+	}
 
 	q->tx_available -= n_bb;
+	snap_dma_q_stat_post(q, SNAP_DMA_STAT_OP_FLUSH, 0, false, n_bb);
 	return 0;
 }
 
@@ -154,7 +290,7 @@ int snap_dma_q_flush_nowait(struct snap_dma_q *q, struct snap_dma_completion *co
  */
 bool snap_dma_q_empty(struct snap_dma_q *q)
 {
-	return q->ops->empty(q);
+	return !snap_dma_q_has_pending(q) && q->ops->empty(q);
 }
 
 /**
@@ -180,9 +316,9 @@ bool snap_dma_q_empty(struct snap_dma_q *q)
  * < 0
  *	some other error has occurred. Return value is -errno
  */
-int snap_dma_q_write(struct snap_dma_q *q, void *src_buf, size_t len,
-		     uint32_t lkey, uint64_t dstaddr, uint32_t rmkey,
-		     struct snap_dma_completion *comp)
+static inline int dma_q_write(struct snap_dma_q *q, void *src_buf, size_t len,
+			      uint32_t lkey, uint64_t dstaddr, uint32_t rmkey,
+			      struct snap_dma_completion *comp)
 {
 	int rc;
 
@@ -194,6 +330,101 @@ int snap_dma_q_write(struct snap_dma_q *q, void *src_buf, size_t len,
 		return rc;
 
 	q->tx_available--;
+	snap_dma_q_stat_post(q, SNAP_DMA_STAT_OP_WRITE, len, false, 1);
+	return 0;
+}
+
+int snap_dma_q_write(struct snap_dma_q *q, void *src_buf, size_t len,
+		     uint32_t lkey, uint64_t dstaddr, uint32_t rmkey,
+		     struct snap_dma_completion *comp)
+{
+	int rc;
+
+	if (snap_likely(!snap_dma_q_has_pending(q))) {
+		rc = dma_q_write(q, src_buf, len, lkey, dstaddr, rmkey, comp);
+		if (snap_likely(rc != -EAGAIN))
+			return rc;
+	}
+
+	snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_WRITE);
+	if (!q->pending)
+		return -EAGAIN;
+
+	return snap_dma_q_defer(q, SNAP_DMA_PENDING_OP_WRITE, src_buf, len,
+				lkey, dstaddr, rmkey, comp, false);
+}
+
+static inline size_t snap_dma_iov_len(struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/*
+ * Walk the local and the remote lists in parallel, one piece per
+ * contiguous run of both. Pieces are deferred only if @n, the number of
+ * pieces, is known.
+ */
+static int snap_dma_q_v2v_pieces(struct snap_dma_q *q, int type,
+				 struct snap_dma_q_io_attr *io_attr, int n,
+				 struct snap_dma_completion *comp)
+{
+	struct iovec *liov = io_attr->liov;
+	struct iovec *riov = io_attr->riov;
+	size_t loff = 0, roff = 0, len;
+	int i = 0, j = 0, k = 0;
+
+	while (i < io_attr->liov_cnt && j < io_attr->riov_cnt) {
+		len = snap_min(liov[i].iov_len - loff, riov[j].iov_len - roff);
+		if (len) {
+			k++;
+			if (n)
+				snap_dma_q_defer(q, type,
+						 (char *)liov[i].iov_base + loff,
+						 len, io_attr->lkey[i],
+						 (uintptr_t)riov[j].iov_base + roff,
+						 io_attr->rkey[j],
+						 k == n ? comp : NULL, k != n);
+		}
+
+		loff += len;
+		roff += len;
+		if (loff == liov[i].iov_len) {
+			i++;
+			loff = 0;
+		}
+		if (roff == riov[j].iov_len) {
+			j++;
+			roff = 0;
+		}
+	}
+
+	return k;
+}
+
+/*
+ * Vectored operation is deferred as plain reads or writes, as a whole or
+ * not at all. Like in the deferred batch only the last one carries @comp,
+ * a piece that fails to post drops the rest and fails @comp.
+ */
+static int snap_dma_q_defer_v2v(struct snap_dma_q *q, int type,
+				struct snap_dma_q_io_attr *io_attr,
+				struct snap_dma_completion *comp)
+{
+	struct snap_dma_pending_ring *ring = q->pending;
+	int n;
+
+	n = snap_dma_q_v2v_pieces(q, type, io_attr, 0, NULL);
+	if (snap_unlikely(!n))
+		return -EINVAL;
+	if (ring->mask + 1 - (ring->pi - ring->ci) < (uint32_t)n)
+		return -EAGAIN;
+
+	snap_dma_q_v2v_pieces(q, type, io_attr, n, comp);
 	return 0;
 }
 
@@ -265,13 +496,23 @@ int snap_dma_q_writev2v(struct snap_dma_q *q,
 	io_attr.riov = dst_iov;
 	io_attr.riov_cnt = dst_iovcnt;
 
-	rc = q->ops->writev2v(q, &io_attr, comp, &n_bb);
-	if (snap_unlikely(rc))
-		return rc;
+	if (snap_likely(!snap_dma_q_has_pending(q))) {
+		rc = q->ops->writev2v(q, &io_attr, comp, &n_bb);
+		if (snap_likely(!rc)) {
+			q->tx_available -= n_bb;
+			snap_dma_q_stat_post(q, SNAP_DMA_STAT_OP_WRITEV, snap_dma_iov_len(src_iov, src_iovcnt), false, n_bb);
+			return 0;
+		}
+		if (rc != -EAGAIN)
+			return rc;
+	}
 
-	q->tx_available -= n_bb;
+	snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_WRITEV);
+	if (!q->pending)
+		return -EAGAIN;
 
-	return 0;
+	return snap_dma_q_defer_v2v(q, SNAP_DMA_PENDING_OP_WRITE, &io_attr,
+				    comp);
 }
 
 /**
@@ -326,11 +567,21 @@ int snap_dma_q_writec(struct snap_dma_q *q, void *src_buf, uint32_t lkey,
 	io_attr.riov_cnt = iov_cnt;
 	io_attr.dek_obj_id = dek_obj_id;
 
+	/* encrypted op is not deferred, it must not overtake deferred ones */
+	if (snap_unlikely(snap_dma_q_has_pending(q))) {
+		snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_WRITEC);
+		return -EAGAIN;
+	}
+
 	rc = q->ops->writec(q, &io_attr, comp, &n_bb);
-	if (snap_unlikely(rc))
+	if (snap_unlikely(rc)) {
+		if (rc == -EAGAIN)
+			snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_WRITEC);
 		return rc;
+	}
 
 	q->tx_available -= n_bb;
+	snap_dma_q_stat_post(q, SNAP_DMA_STAT_OP_WRITEC, len, false, n_bb);
 
 	return 0;
 }
@@ -359,22 +610,42 @@ int snap_dma_q_writec(struct snap_dma_q *q, void *src_buf, uint32_t lkey,
  * < 0
  *	some other error has occurred. Return value is -errno
  */
-int snap_dma_q_write_short(struct snap_dma_q *q, void *src_buf, size_t len,
-			   uint64_t dstaddr, uint32_t rmkey)
+static inline int dma_q_write_short(struct snap_dma_q *q, void *src_buf,
+				    size_t len, uint64_t dstaddr, uint32_t rmkey)
 {
 	int rc, n_bb = 0;
 
-	if (snap_unlikely(len > q->tx_elem_size))
-		return -EINVAL;
-
 	rc = q->ops->write_short(q, src_buf, len, dstaddr, rmkey, &n_bb);
 	if (snap_unlikely(rc))
 		return rc;
 
 	q->tx_available -= n_bb;
+	snap_dma_q_stat_post(q, SNAP_DMA_STAT_OP_WRITE_SHORT, len, true, n_bb);
 	return 0;
 }
 
+int snap_dma_q_write_short(struct snap_dma_q *q, void *src_buf, size_t len,
+			   uint64_t dstaddr, uint32_t rmkey)
+{
+	int rc;
+
+	if (snap_unlikely(len > q->tx_elem_size))
+		return -EINVAL;
+
+	if (snap_likely(!snap_dma_q_has_pending(q))) {
+		rc = dma_q_write_short(q, src_buf, len, dstaddr, rmkey);
+		if (snap_likely(rc != -EAGAIN))
+			return rc;
+	}
+
+	snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_WRITE_SHORT);
+	if (!q->pending)
+		return -EAGAIN;
+
+	return snap_dma_q_defer_short(q, SNAP_DMA_PENDING_OP_WRITE_SHORT,
+				      src_buf, len, dstaddr, rmkey);
+}
+
 /**
  * snap_dma_q_read() - DMA read from the host memory
  * @q:            dma queue
@@ -398,9 +669,9 @@ int snap_dma_q_write_short(struct snap_dma_q *q, void *src_buf, size_t len,
  * < 0
  *	some other error has occurred. Return value is -errno
  */
-int snap_dma_q_read(struct snap_dma_q *q, void *dst_buf, size_t len,
-		    uint32_t lkey, uint64_t srcaddr, uint32_t rmkey,
-		    struct snap_dma_completion *comp)
+static inline int dma_q_read(struct snap_dma_q *q, void *dst_buf, size_t len,
+			     uint32_t lkey, uint64_t srcaddr, uint32_t rmkey,
+			     struct snap_dma_completion *comp)
 {
 	int rc;
 
@@ -412,9 +683,127 @@ int snap_dma_q_read(struct snap_dma_q *q, void *dst_buf, size_t len,
 		return rc;
 
 	q->tx_available--;
+	snap_dma_q_stat_post(q, SNAP_DMA_STAT_OP_READ, len, false, 1);
 	return 0;
 }
 
+int snap_dma_q_read(struct snap_dma_q *q, void *dst_buf, size_t len,
+		    uint32_t lkey, uint64_t srcaddr, uint32_t rmkey,
+		    struct snap_dma_completion *comp)
+{
+	int rc;
+
+	if (snap_likely(!snap_dma_q_has_pending(q))) {
+		rc = dma_q_read(q, dst_buf, len, lkey, srcaddr, rmkey, comp);
+		if (snap_likely(rc != -EAGAIN))
+			return rc;
+	}
+
+	snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_READ);
+	if (!q->pending)
+		return -EAGAIN;
+
+	return snap_dma_q_defer(q, SNAP_DMA_PENDING_OP_READ, dst_buf, len,
+				lkey, srcaddr, rmkey, comp, false);
+}
+
+static int snap_dma_q_defer_batch(struct snap_dma_q *q, struct snap_dma_op *ops,
+				  int n, struct snap_dma_completion *comp)
+{
+	struct snap_dma_pending_ring *ring = q->pending;
+	int i, type;
+
+	/* batch is deferred as a whole or not at all */
+	if (!ring || ring->mask + 1 - (ring->pi - ring->ci) < (uint32_t)n)
+		return -EAGAIN;
+
+	for (i = 0; i < n; i++) {
+		type = ops[i].opcode == SNAP_DMA_OP_WRITE ?
+			SNAP_DMA_PENDING_OP_WRITE : SNAP_DMA_PENDING_OP_READ;
+		snap_dma_q_defer(q, type, ops[i].buf, ops[i].len, ops[i].lkey,
+				 ops[i].raddr, ops[i].rkey, i == n - 1 ? comp : NULL,
+				 i != n - 1);
+	}
+
+	return 0;
+}
+
+/* post ops one by one, used when the queue has no batch implementation */
+static int snap_dma_q_post_batch_ops(struct snap_dma_q *q, struct snap_dma_op *ops,
+				     int n, struct snap_dma_completion *comp)
+{
+	struct snap_dma_completion *c;
+	int i, rc;
+
+	for (i = 0; i < n; i++) {
+		c = i == n - 1 ? comp : NULL;
+		if (ops[i].opcode == SNAP_DMA_OP_WRITE)
+			rc = dma_q_write(q, ops[i].buf, ops[i].len, ops[i].lkey,
+					 ops[i].raddr, ops[i].rkey, c);
+		else
+			rc = dma_q_read(q, ops[i].buf, ops[i].len, ops[i].lkey,
+					ops[i].raddr, ops[i].rkey, c);
+		if (snap_unlikely(rc))
+			return rc;
+	}
+
+	return 0;
+}
+
+/**
+ * snap_dma_q_post_batch() - Post a batch of DMA reads and writes
+ * @q:    dma queue
+ * @ops:  operations to post
+ * @n:    number of operations, must not exceed the send queue size
+ * @comp: dma completion structure, may be NULL
+ *
+ * The function posts @n read and write operations to the host memory as
+ * a single unit: send credits are checked once, all work requests are built
+ * back to back and a single doorbell is rung. Operations are executed in
+ * order.
+ *
+ * Only the last operation carries @comp, so @comp->count is decremented
+ * once, when the whole batch is completed.
+ *
+ * If the queue has the deferred operations ring, the batch is deferred
+ * when there are not enough send credits.
+ *
+ * Return:
+ * 0
+ *	operations have been successfully submitted to the queue
+ *	and are now in progress
+ * \-EAGAIN
+ *	queue does not have enough resources for the whole batch, nothing was
+ *	posted. Must be retried later.
+ * < 0
+ *	some other error has occurred. Return value is -errno
+ */
+int snap_dma_q_post_batch(struct snap_dma_q *q, struct snap_dma_op *ops, int n,
+			  struct snap_dma_completion *comp)
+{
+	int rc;
+
+	if (snap_unlikely(n <= 0))
+		return -EINVAL;
+
+	if (snap_likely(!snap_dma_q_has_pending(q) && qp_can_tx(q, n))) {
+		if (!q->ops->post_batch)
+			return snap_dma_q_post_batch_ops(q, ops, n, comp);
+
+		rc = q->ops->post_batch(q, ops, n, comp);
+		if (snap_unlikely(rc))
+			return rc;
+
+		q->tx_available -= n;
+		snap_dma_q_stat_post_batch(q, ops, n);
+		return 0;
+	}
+
+	snap_dma_q_stat_eagain(q, ops[0].opcode == SNAP_DMA_OP_WRITE ?
+			       SNAP_DMA_STAT_OP_WRITE : SNAP_DMA_STAT_OP_READ);
+	return snap_dma_q_defer_batch(q, ops, n, comp);
+}
+
 /**
  * snap_dma_q_readv2v() - DMA read from the host memory
  * @q:              dma queue
@@ -456,7 +845,53 @@ int snap_dma_q_readv2v(struct snap_dma_q *q,
 				bool share_dst_mkey, bool share_src_mkey,
 				struct snap_dma_completion *comp)
 {
-	return -ENOTSUP;
+	int i, rc, n_bb = 0;
+	uint32_t lkey[dst_iovcnt];
+	uint32_t rkey[src_iovcnt];
+	struct snap_dma_q_io_attr io_attr = {0};
+
+	if (!q->ops->readv2v)
+		return -ENOTSUP;
+
+	if (share_dst_mkey) {
+		for (i = 0; i < dst_iovcnt; i++)
+			lkey[i] = *dst_mkey;
+		io_attr.lkey = lkey;
+	} else {
+		io_attr.lkey = dst_mkey;
+	}
+
+	if (share_src_mkey) {
+		for (i = 0; i < src_iovcnt; i++)
+			rkey[i] = *src_mkey;
+		io_attr.rkey = rkey;
+	} else {
+		io_attr.rkey = src_mkey;
+	}
+
+	io_attr.io_type = SNAP_DMA_Q_IO_TYPE_IOV;
+	io_attr.liov = dst_iov;
+	io_attr.liov_cnt = dst_iovcnt;
+	io_attr.riov = src_iov;
+	io_attr.riov_cnt = src_iovcnt;
+
+	if (snap_likely(!snap_dma_q_has_pending(q))) {
+		rc = q->ops->readv2v(q, &io_attr, comp, &n_bb);
+		if (snap_likely(!rc)) {
+			q->tx_available -= n_bb;
+			snap_dma_q_stat_post(q, SNAP_DMA_STAT_OP_READV, snap_dma_iov_len(dst_iov, dst_iovcnt), false, n_bb);
+			return 0;
+		}
+		if (rc != -EAGAIN)
+			return rc;
+	}
+
+	snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_READV);
+	if (!q->pending)
+		return -EAGAIN;
+
+	return snap_dma_q_defer_v2v(q, SNAP_DMA_PENDING_OP_READ, &io_attr,
+				    comp);
 }
 
 /**
@@ -511,11 +946,21 @@ int snap_dma_q_readc(struct snap_dma_q *q, void *dst_buf, uint32_t lkey,
 	io_attr.riov_cnt = iov_cnt;
 	io_attr.dek_obj_id = dek_obj_id;
 
+	/* encrypted op is not deferred, it must not overtake deferred ones */
+	if (snap_unlikely(snap_dma_q_has_pending(q))) {
+		snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_READC);
+		return -EAGAIN;
+	}
+
 	rc = q->ops->readc(q, &io_attr, comp, &n_bb);
-	if (snap_unlikely(rc))
+	if (snap_unlikely(rc)) {
+		if (rc == -EAGAIN)
+			snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_READC);
 		return rc;
+	}
 
 	q->tx_available -= n_bb;
+	snap_dma_q_stat_post(q, SNAP_DMA_STAT_OP_READC, len, false, n_bb);
 
 	return 0;
 }
@@ -544,16 +989,12 @@ int snap_dma_q_readc(struct snap_dma_q *q, void *dst_buf, uint32_t lkey,
  * < 0
  *	some other error has occurred. Return value is -errno
  */
-int snap_dma_q_read_short(struct snap_dma_q *q, void *dst_buf,
-		    size_t len, uint64_t srcaddr, uint32_t rmkey,
-		    struct snap_dma_completion *comp)
+static inline int dma_q_read_short(struct snap_dma_q *q, void *dst_buf,
+				   size_t len, uint64_t srcaddr, uint32_t rmkey,
+				   struct snap_dma_completion *comp)
 {
 	int rc;
 
-	/* only support up-to-32B Scatter-to-CQE */
-	if (snap_unlikely(len > 32))
-		return -EINVAL;
-
 	if (snap_unlikely(!qp_can_tx(q, 1)))
 		return -EAGAIN;
 
@@ -562,9 +1003,35 @@ int snap_dma_q_read_short(struct snap_dma_q *q, void *dst_buf,
 		return rc;
 
 	q->tx_available--;
+	snap_dma_q_stat_post(q, SNAP_DMA_STAT_OP_READ_SHORT, len, true, 1);
 	return 0;
 }
 
+int snap_dma_q_read_short(struct snap_dma_q *q, void *dst_buf,
+		    size_t len, uint64_t srcaddr, uint32_t rmkey,
+		    struct snap_dma_completion *comp)
+{
+	int rc;
+
+	/* only support up-to-32B Scatter-to-CQE */
+	if (snap_unlikely(len > 32))
+		return -EINVAL;
+
+	if (snap_likely(!snap_dma_q_has_pending(q))) {
+		rc = dma_q_read_short(q, dst_buf, len, srcaddr, rmkey, comp);
+		if (snap_likely(rc != -EAGAIN))
+			return rc;
+	}
+
+	snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_READ_SHORT);
+	if (!q->pending)
+		return -EAGAIN;
+
+	/* @dst_buf is owned by the caller until the completion */
+	return snap_dma_q_defer(q, SNAP_DMA_PENDING_OP_READ_SHORT, dst_buf, len,
+				0, srcaddr, rmkey, comp, false);
+}
+
 /**
  * snap_dma_q_send_completion() - Send completion to the host
  * @q:       dma queue to
@@ -590,21 +1057,107 @@ int snap_dma_q_read_short(struct snap_dma_q *q, void *dst_buf,
  *	some other error has occurred. Return value is -errno
  *
  */
-int snap_dma_q_send_completion(struct snap_dma_q *q, void *src_buf, size_t len)
+static inline int dma_q_send_completion(struct snap_dma_q *q, void *src_buf,
+					size_t len)
 {
 	int rc, n_bb = 0;
 
-	if (snap_unlikely(len > q->tx_elem_size))
-		return -EINVAL;
-
 	rc = q->ops->send_completion(q, src_buf, len, &n_bb);
 	if (snap_unlikely(rc))
 		return rc;
 
 	q->tx_available -= n_bb;
+	snap_dma_q_stat_post(q, SNAP_DMA_STAT_OP_SEND_COMPLETION, len, true, n_bb);
 	return 0;
 }
 
+int snap_dma_q_send_completion(struct snap_dma_q *q, void *src_buf, size_t len)
+{
+	int rc;
+
+	if (snap_unlikely(len > q->tx_elem_size))
+		return -EINVAL;
+
+	if (snap_likely(!snap_dma_q_has_pending(q))) {
+		rc = dma_q_send_completion(q, src_buf, len);
+		if (snap_likely(rc != -EAGAIN))
+			return rc;
+	}
+
+	snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_SEND_COMPLETION);
+	if (!q->pending)
+		return -EAGAIN;
+
+	return snap_dma_q_defer_short(q, SNAP_DMA_PENDING_OP_SEND_COMPLETION,
+				      src_buf, len, 0, 0);
+}
+
+static inline int snap_dma_q_post_pending_op(struct snap_dma_q *q,
+					     struct snap_dma_pending_op *op)
+{
+	switch (op->type) {
+	case SNAP_DMA_PENDING_OP_WRITE:
+		return dma_q_write(q, op->iov.iov_base, op->iov.iov_len,
+				   op->lkey, op->raddr, op->rkey, op->comp);
+	case SNAP_DMA_PENDING_OP_READ:
+		return dma_q_read(q, op->iov.iov_base, op->iov.iov_len,
+				  op->lkey, op->raddr, op->rkey, op->comp);
+	case SNAP_DMA_PENDING_OP_WRITE_SHORT:
+		return dma_q_write_short(q, op->iov.iov_base, op->iov.iov_len,
+					 op->raddr, op->rkey);
+	case SNAP_DMA_PENDING_OP_READ_SHORT:
+		return dma_q_read_short(q, op->iov.iov_base, op->iov.iov_len,
+					op->raddr, op->rkey, op->comp);
+	case SNAP_DMA_PENDING_OP_SEND_COMPLETION:
+		return dma_q_send_completion(q, op->iov.iov_base,
+					     op->iov.iov_len);
+	default:
+		return -EINVAL;
+	}
+}
+
+/**
+ * snap_dma_q_pending_progress() - Post deferred operations
+ * @q: dma queue
+ *
+ * The function posts operations from the deferred operations ring in order
+ * until the ring is empty or the send queue is full again. If an operation
+ * fails with an error other than -EAGAIN, it is completed with the error
+ * code as a status. When the operation was split into several pieces (a
+ * batch or a vectored read or write), the remaining pieces are dropped and
+ * the completion of the last one reports the error.
+ *
+ * Return: number of operations removed from the ring
+ */
+int snap_dma_q_pending_progress(struct snap_dma_q *q)
+{
+	struct snap_dma_pending_ring *ring = q->pending;
+	struct snap_dma_pending_op *op;
+	int n = 0, rc;
+
+	while (ring->ci != ring->pi) {
+		op = &ring->ops[ring->ci & ring->mask];
+		rc = snap_dma_q_post_pending_op(q, op);
+		if (rc == -EAGAIN)
+			break;
+
+		ring->ci++;
+		n++;
+		if (snap_unlikely(rc)) {
+			snap_debug("dma_q:%p failed to post deferred op %d, err=%d\n",
+				   q, op->type, rc);
+			while (op->more) {
+				op = &ring->ops[ring->ci++ & ring->mask];
+				n++;
+			}
+			if (op->comp && --op->comp->count == 0)
+				op->comp->func(op->comp, rc);
+		}
+	}
+
+	return n;
+}
+
 /**
  * snap_dma_q_get_fw_qp() - Get FW qp
  * @q:   dma queue
@@ -614,11 +1167,14 @@ int snap_dma_q_send_completion(struct snap_dma_q *q, void *src_buf, size_t len)
  *
  * Not valid on the DPA
  *
- * Return: fw qp
+ * Return: fw qp or NULL if the queue does not have one
  */
 struct ibv_qp *snap_dma_q_get_fw_qp(struct snap_dma_q *q)
 {
 #if !defined(__DPA)
+	/* SNAP_DMA_Q_MODE_SW queue has no fw qp */
+	if (!q->fw_qp.qp)
+		return NULL;
 	return snap_qp_to_verbs_qp(q->fw_qp.qp);
 #else
 	return NULL;
@@ -654,11 +1210,21 @@ int snap_dma_q_send(struct snap_dma_q *q, void *in_buf, size_t in_len,
 {
 	int n_bb = 0, rc;
 
+	/* send is not deferred, it must not overtake deferred operations */
+	if (snap_unlikely(snap_dma_q_has_pending(q))) {
+		snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_SEND);
+		return -EAGAIN;
+	}
+
 	rc = q->ops->send(q, in_buf, in_len, addr, len, key, &n_bb);
-	if (snap_unlikely(rc))
+	if (snap_unlikely(rc)) {
+		if (rc == -EAGAIN)
+			snap_dma_q_stat_eagain(q, SNAP_DMA_STAT_OP_SEND);
 		return rc;
+	}
 
 	q->tx_available -= n_bb;
+	snap_dma_q_stat_post(q, SNAP_DMA_STAT_OP_SEND, in_len + len, false, n_bb);
 
 	return 0;
 }
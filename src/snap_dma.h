@@ -31,6 +31,8 @@
 #define SNAP_DMA_Q_IOV_SUPP      "SNAP_DMA_Q_IOV_SUPP"
 #define SNAP_DMA_Q_CRYPTO_SUPP   "SNAP_DMA_Q_CRYPTO_SUPP"
 #define SNAP_DMA_Q_DBMODE        "SNAP_DMA_Q_DBMODE"
+#define SNAP_DMA_Q_SW_DELAY      "SNAP_DMA_Q_SW_DELAY"
+#define SNAP_DMA_Q_STATS         "SNAP_DMA_Q_STATS"
 
 #define SNAP_DMA_Q_MAX_IOV_CNT		128
 #define SNAP_DMA_Q_MAX_SGE_NUM		20
@@ -41,6 +43,8 @@
 
 struct snap_dma_q;
 struct snap_dma_completion;
+struct snap_dma_sw_ctx;
+struct snap_dma_sw_mem;
 
 /**
  * typedef snap_dma_rx_cb_t - receive callback
@@ -124,33 +128,46 @@ enum snap_db_ring_flag {
 };
 
 struct snap_dv_qp {
+	/* hot: sq and rq producer/consumer state, single cacheline */
 	struct snap_hw_qp hw_qp;
-	int n_outstanding;
-	uint32_t opaque_lkey;
+	/* hot tx: everything that is needed to post wqe and ring doorbell */
+	struct {
+		struct snap_dv_dma_completion *comps;
+		struct mlx5_wqe_ctrl_seg *ctrl;
+		/* worker mode: qp bit in the worker active queues bitmap */
+		uint64_t *wk_active;
+		uint64_t wk_active_mask;
+		int n_outstanding;
+		enum snap_db_ring_flag db_flag;
+		bool tx_need_ring_db;
+		uint32_t opaque_lkey;
+		/* stat.tx ends the tx line, stat.rx starts the cold one */
+		struct snap_dv_qp_stat stat;
+	} SNAP_CACHE_ALIGNED;
+	/* cold */
 	uint32_t dpa_mkey;
-	struct snap_dv_dma_completion *comps;
+	/* true if tx db is in the non cacheable memory */
+	bool tx_db_nc;
 	/* used to hold GGA data */
 	struct mlx5_dma_opaque     *opaque_buf;
 	struct ibv_mr              *opaque_mr;
-	/* true if tx db is in the non cacheable memory */
-	bool tx_db_nc;
-	enum snap_db_ring_flag db_flag;
-	bool tx_need_ring_db;
-	struct mlx5_wqe_ctrl_seg *ctrl;
-	struct snap_dv_qp_stat stat;
 };
 
 struct snap_dma_ibv_qp {
-	/* used when working in devx mode */
-	struct snap_hw_cq dv_tx_cq;
-	struct snap_hw_cq dv_rx_cq;
 	struct snap_dv_qp dv_qp;
+	/* used when working in devx mode */
+	struct snap_hw_cq dv_tx_cq SNAP_CACHE_ALIGNED;
+	/* hot rx: cq and receive buffers */
+	struct {
+		struct snap_hw_cq dv_rx_cq;
+		char           *rx_buf;
+	} SNAP_CACHE_ALIGNED;
 
+	/* cold */
 	struct snap_qp *qp;
 	struct snap_cq *tx_cq;
 	struct snap_cq *rx_cq;
 	struct ibv_mr  *rx_mr;
-	char           *rx_buf;
 	int            mode;
 	struct {
 		struct snap_dpa_memh *rx_mr;
@@ -180,11 +197,35 @@ struct snap_dma_q_io_attr {
 	uint8_t  xts_initial_tweak[SNAP_CRYPTO_XTS_INITIAL_TWEAK_SIZE];
 };
 
+enum snap_dma_op_opcode {
+	SNAP_DMA_OP_READ,
+	SNAP_DMA_OP_WRITE
+};
+
+/**
+ * struct snap_dma_op - DMA operation, see snap_dma_q_post_batch()
+ * @opcode: &enum snap_dma_op_opcode
+ * @buf:    local buffer
+ * @len:    data length
+ * @lkey:   local memory key
+ * @raddr:  host physical or virtual address
+ * @rkey:   host memory key that describes remote memory
+ */
+struct snap_dma_op {
+	int opcode;
+	void *buf;
+	size_t len;
+	uint32_t lkey;
+	uint32_t rkey;
+	uint64_t raddr;
+};
+
 enum snap_dma_q_mode {
 	SNAP_DMA_Q_MODE_AUTOSELECT = 0,
 	SNAP_DMA_Q_MODE_VERBS = 1,
 	SNAP_DMA_Q_MODE_DV = 2,
-	SNAP_DMA_Q_MODE_GGA = 3
+	SNAP_DMA_Q_MODE_GGA = 3,
+	SNAP_DMA_Q_MODE_SW = 4
 };
 
 struct snap_dma_q_ops {
@@ -224,6 +265,9 @@ struct snap_dma_q_ops {
 	int (*poll_rx)(struct snap_dma_q *q, struct snap_rx_completion *rx_completions, int max_completions);
 	int (*poll_tx)(struct snap_dma_q *q, struct snap_dma_completion **comp, int max_completions);
 	const struct snap_dv_qp_stat* (*stat)(const struct snap_dma_q *q);
+	/* optional, takes n send credits */
+	int (*post_batch)(struct snap_dma_q *q, struct snap_dma_op *ops, int n,
+			  struct snap_dma_completion *comp);
 };
 
 struct snap_dma_q_iov_ctx {
@@ -284,17 +328,38 @@ struct snap_dma_q_ir_ctx {
  */
 struct snap_dma_q {
 	/* private: */
-	/* TODO: for dpa/ep we don't need all fields. Group all frequently used
-	 * fields so that they all fit into 2 cachelines
+	/*
+	 * Hot fields are grouped by the cacheline. Posting a send touches
+	 * the tx line, sw_qp.dv_qp.hw_qp and the sw_qp.dv_qp tx line.
+	 * Receive progress touches the rx line, sw_qp.dv_qp.hw_qp and
+	 * the sw_qp rx line. Layout is verified by static asserts below,
+	 * keep it in mind when adding new fields.
 	 */
+	struct {
+		const struct snap_dma_q_ops  *ops;
+		struct snap_dma_pending_ring *pending;
+		struct snap_dma_worker *worker;
+		struct snap_dma_sw_ctx *sw_ctx;
+		struct snap_dma_q_stats_ctx *stats;
+		int                    tx_available;
+		int                    tx_qsize;
+		int                    tx_elem_size;
+	} SNAP_CACHE_ALIGNED;
+
+	struct {
+		snap_dma_rx_cb_t       rx_cb;
+		int                    rx_elem_size;
+		/* public: */
+		int                    rx_qsize;
+		/** @uctx:  user supplied context */
+		void                  *uctx;
+	} SNAP_CACHE_ALIGNED;
+
+	/* private: */
 	struct snap_dma_ibv_qp sw_qp;
-	int                    tx_available;
-	int                    tx_qsize;
-	int                    tx_elem_size;
-	int                    rx_elem_size;
-	snap_dma_rx_cb_t       rx_cb;
+
+	/* cold, control path only */
 	struct snap_dma_ibv_qp fw_qp;
-	const struct snap_dma_q_ops  *ops;
 
 	struct snap_dma_q_iov_ctx *iov_ctx;
 	struct snap_dma_q_crypto_ctx *crypto_ctx;
@@ -309,17 +374,28 @@ struct snap_dma_q {
 	TAILQ_HEAD(, snap_dma_q_ir_ctx) free_ir_ctx;
 
 	struct snap_dma_q_ops  *custom_ops;
-	struct snap_dma_worker *worker;
 
 	/* public: */
-	/** @uctx:  user supplied context */
-	void                  *uctx;
 	bool                  iov_support;
 	bool                  crypto_support;
 	bool                  no_events;
-	int                   rx_qsize;
 };
 
+SNAP_STATIC_ASSERT(offsetof(struct snap_dv_qp, comps) == SNAP_CACHE_LINE_SIZE,
+		"snap_dv_qp tx line must follow hw_qp");
+SNAP_STATIC_ASSERT(SNAP_SAME_CACHE_LINE(struct snap_dv_qp, comps, stat.tx),
+		"snap_dv_qp tx fields must fit into a single cacheline");
+SNAP_STATIC_ASSERT(SNAP_SAME_CACHE_LINE(struct snap_dma_ibv_qp, dv_rx_cq, rx_buf),
+		"snap_dma_ibv_qp rx fields must fit into a single cacheline");
+SNAP_STATIC_ASSERT(offsetof(struct snap_dma_q, ops) == 0 &&
+		SNAP_SAME_CACHE_LINE(struct snap_dma_q, ops, tx_elem_size),
+		"snap_dma_q tx fields must fit into the first cacheline");
+SNAP_STATIC_ASSERT(offsetof(struct snap_dma_q, rx_cb) == SNAP_CACHE_LINE_SIZE &&
+		SNAP_SAME_CACHE_LINE(struct snap_dma_q, rx_cb, uctx),
+		"snap_dma_q rx fields must fit into the second cacheline");
+SNAP_STATIC_ASSERT(offsetof(struct snap_dma_q, sw_qp) == 2 * SNAP_CACHE_LINE_SIZE,
+		"snap_dma_q sw_qp must follow the rx line");
+
 enum {
 	SNAP_DMA_Q_DPA_MODE_NONE = 0,
 	SNAP_DMA_Q_DPA_MODE_POLLING,
@@ -344,8 +420,14 @@ enum {
  *                 SNAP_DMA_Q_MODE_DV    - dv, direct hw access, faster than verbs
  *                 SNAP_DMA_Q_MODE_GGA   - dv, plus uses hw dma engine directly to
  *                                         do rdma read or write. Fastest, best bandwidth.
+ *                 SNAP_DMA_Q_MODE_SW    - no hw, data is copied to/from the simulated
+ *                                         host memory. See snap_dma_sw_mem_create().
+ *                                         Intended for testing and benchmarking.
+ *                                         Can only be used with SNAP_DMA_WORKER_MODE_SINGLE
+ *                                         worker.
  *                Mode choice can be overridden at runtime by setting SNAP_DMA_Q_OPMODE
- *                environment variable: 0 - autoselect, 1 - verbs, 2 - dv, 3 - gga.
+ *                environment variable: 0 - autoselect, 1 - verbs, 2 - dv, 3 - gga,
+ *                4 - sw.
  * @rx_cb:        receive callback. See &typedef snap_dma_rx_cb_t
  * @iov_enable:   enable/disable this dma queue to use readv/writev API
  * @crypto_enable:enable/disable this dma queue to use crypto rw API
@@ -376,6 +458,17 @@ enum {
  * @dpa_proc:     snap dpa process context. Must be valid if @dpa_mode is SNAP_DMA_Q_DPA_MODE_POLLING
  * @dpa_thread:   snap dpa thread context. Must be valid if @dpa_mode is
  *                SNAP_DMA_Q_DPA_MODE_EVENT or SMAP_DMA_Q_DPA_MODE_TRIGGER
+ * @pending_qsize: if non zero, size of the deferred operations ring. Write,
+ *                read, write_short, read_short, send_completion, writev2v
+ *                and readv2v that can not be posted because the send queue
+ *                is full are stored in the ring and posted by the tx
+ *                progress once send credits are returned. In such case
+ *                -EAGAIN is returned only if the ring is full. writec, readc
+ *                and send are not deferred, they return -EAGAIN as long as
+ *                the ring is not empty. Not available on DPA.
+ * @stats_enable: collect extended statistics, see snap_dma_q_stats_enable().
+ *                Can also be enabled by setting SNAP_DMA_Q_STATS=1 environment
+ *                variable. Not available on DPA.
  */
 struct snap_dma_q_create_attr {
 	uint32_t tx_qsize;
@@ -400,19 +493,22 @@ struct snap_dma_q_create_attr {
 		struct snap_dpa_ctx *dpa_proc;
 		struct snap_dpa_thread *dpa_thread;
 	};
+
+	uint32_t pending_qsize;
+	bool stats_enable;
 };
 
-/* TODO add support for worker mode single and SRQ*/
 enum snap_dma_worker_mode {
-	SNAP_DMA_WORKER_MODE_SINGLE, /* cq per qp, suitable for small numbers of qps */
+	SNAP_DMA_WORKER_MODE_SINGLE, /* single queue with its own cqs, no demux */
 	SNAP_DMA_WORKER_MODE_CQ_POOL, /* cq pool, rx cq size is exp_queue_num * exp_queue_rx_size */
-	SNAP_DMA_WORKER_MODE_SRQ /* use to receive */
+	SNAP_DMA_WORKER_MODE_SRQ /* cq pool, all queues receive from a single srq */
 };
 
 struct snap_dma_worker_create_attr {
 	enum snap_dma_worker_mode mode;
 	int exp_queue_num; /* hint to the worker: how many queues it is going to serve */
 	int exp_queue_rx_size; /* hint to the worker: queue rx size */
+	int rx_elem_size; /* SRQ mode: size of the receive buffer */
 	int id;
 };
 
@@ -424,15 +520,43 @@ struct snap_dma_worker_queue {
 	SLIST_ENTRY(snap_dma_worker_queue) entry;
 };
 
+/* shared receive queue, data of the wqe N is always placed in the buffer N */
+struct snap_dv_srq {
+	uint64_t addr;
+	uint32_t stride;
+	uint32_t wqe_cnt;
+	uint32_t *dbr;
+	uint16_t counter;
+	uint16_t tail;
+	uint32_t srqn;
+	char *rx_buf;
+	uint32_t rx_elem_size;
+};
+
+struct snap_dma_worker_qpn {
+	uint32_t qpn;
+	struct snap_dma_q *q;
+};
+
 struct snap_dma_worker {
 	/* used when working in devx mode */
 	struct snap_hw_cq dv_tx_cq;
 	struct snap_hw_cq dv_rx_cq;
+	struct snap_dv_srq dv_srq;
 
 	struct snap_cq *rx_cq;
 	struct snap_cq *tx_cq;
 	enum snap_dma_worker_mode mode;
 	int max_queues;
+	/* queues that have outstanding tx or doorbells to ring */
+	uint64_t *active_qs;
+
+	/* SRQ mode */
+	struct ibv_srq *srq;
+	struct ibv_mr *srq_mr;
+	/* qp number to queue, open addressing by the low qpn bits */
+	struct snap_dma_worker_qpn *qpn_table;
+	uint32_t qpn_mask;
 
 	SLIST_HEAD(, snap_dma_worker_queue) free_queues;
 	struct snap_dma_worker_queue queues[0];
@@ -480,12 +604,15 @@ int snap_dma_q_read_short(struct snap_dma_q *q, void *dst_buf,
 		    struct snap_dma_completion *comp);
 int snap_dma_q_send_completion(struct snap_dma_q *q, void *src_buf, size_t len);
 int snap_dma_q_progress(struct snap_dma_q *q);
+int snap_dma_q_progress_tx(struct snap_dma_q *q);
+int snap_dma_q_pending_count(struct snap_dma_q *q);
 int snap_dma_q_poll_rx(struct snap_dma_q *q, struct snap_rx_completion *rx_completions, int max_completions);
 int snap_dma_q_poll_tx(struct snap_dma_q *q, struct snap_dma_completion **comp, int max_completions);
 int snap_dma_q_flush(struct snap_dma_q *q);
 int snap_dma_q_flush_nowait(struct snap_dma_q *q, struct snap_dma_completion *comp);
 bool snap_dma_q_empty(struct snap_dma_q *q);
 int snap_dma_q_arm(struct snap_dma_q *q);
+int snap_dma_q_arm_batch(struct snap_dma_q *q);
 struct ibv_qp *snap_dma_q_get_fw_qp(struct snap_dma_q *q);
 struct snap_dma_q *snap_dma_ep_create(struct ibv_pd *pd,
 	const struct snap_dma_q_create_attr *attr);
@@ -494,6 +621,24 @@ int snap_dma_ep_connect_remote_qpn(struct snap_dma_q *q1, int remote_qp2_num);
 int snap_dma_q_send(struct snap_dma_q *q, void *in_buf, size_t in_len,
 		uint64_t addr, size_t len, uint32_t key);
 int snap_dma_q_post_recv(struct snap_dma_q *q);
+int snap_dma_q_post_batch(struct snap_dma_q *q, struct snap_dma_op *ops, int n,
+		struct snap_dma_completion *comp);
+
+int snap_dma_q_stats_enable(struct snap_dma_q *q, bool enable);
+const struct snap_dma_q_stats *snap_dma_q_stats_get(const struct snap_dma_q *q);
+void snap_dma_q_stats_reset(struct snap_dma_q *q);
+int snap_dma_worker_stats(struct snap_dma_worker *wk, struct snap_dma_q_stats *stats);
+
+/* SNAP_DMA_Q_MODE_SW only */
+struct snap_dma_sw_mem *snap_dma_sw_mem_create(void *buf, size_t len,
+		uint64_t addr, uint32_t mkey);
+void snap_dma_sw_mem_destroy(struct snap_dma_sw_mem *mem);
+void *snap_dma_sw_mem_addr(struct snap_dma_sw_mem *mem, uint64_t addr);
+void snap_dma_sw_q_set_delay(struct snap_dma_q *q, uint32_t delay);
+int snap_dma_sw_q_rx_post(struct snap_dma_q *q, const void *data, size_t len,
+		uint32_t imm_data);
+int snap_dma_sw_q_fw_recv(struct snap_dma_q *q, void *buf, size_t len);
+
 struct snap_dma_ep_copy_cmd {
 	struct snap_dpa_cmd base;
 	struct snap_dma_q q;
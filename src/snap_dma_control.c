@@ -165,6 +165,7 @@ static void snap_free_rx_wqes(struct snap_dma_ibv_qp *qp)
 		return;
 	ibv_dereg_mr(qp->rx_mr);
 	free(qp->rx_buf);
+	qp->rx_buf = NULL;
 }
 
 static int snap_alloc_rx_wqes(struct ibv_pd *pd, struct snap_dma_ibv_qp *qp, size_t rx_qsize,
@@ -197,6 +198,12 @@ static int dummy_progress(struct snap_dma_q *q)
 	return 0;
 }
 
+/* queues of the SINGLE mode worker own their cqs */
+static inline bool snap_dma_q_shares_worker_cqs(const struct snap_dma_q *q)
+{
+	return q->worker && q->worker->mode != SNAP_DMA_WORKER_MODE_SINGLE;
+}
+
 /* NOTE: we cannot take mode from the dma_q_attr because it can be 'autoselect'
  * and then it is replaced by the real mode in dma_q->ops
  *
@@ -376,7 +383,9 @@ static void snap_destroy_sw_qp(struct snap_dma_q *q)
 {
 	bool destroy_cqs = true;
 
-	if (!snap_qp_on_dpa(q->sw_qp.qp))
+	if (q->ops->mode == SNAP_DMA_Q_MODE_SW)
+		snap_dma_sw_q_destroy(q);
+	else if (!snap_qp_on_dpa(q->sw_qp.qp))
 		snap_free_rx_wqes(&q->sw_qp);
 
 	if (q->custom_ops) {
@@ -384,7 +393,14 @@ static void snap_destroy_sw_qp(struct snap_dma_q *q)
 		q->custom_ops = NULL;
 	}
 
-	if (q->worker)
+	/* SNAP_DMA_Q_MODE_SW does not use hw qp */
+	if (!q->sw_qp.qp)
+		return;
+
+	if (q->worker && q->worker->mode == SNAP_DMA_WORKER_MODE_SRQ)
+		snap_dma_worker_qpn_del(q->worker, q->sw_qp.dv_qp.hw_qp.qp_num);
+
+	if (snap_dma_q_shares_worker_cqs(q))
 		destroy_cqs = false;
 	snap_destroy_qp_helper(&q->sw_qp, destroy_cqs);
 }
@@ -569,6 +585,9 @@ static int snap_qp_attr_helper(struct snap_dma_q *q, struct ibv_pd *pd,
 	case SNAP_DMA_Q_MODE_GGA:
 		q->ops = &gga_ops;
 		break;
+	case SNAP_DMA_Q_MODE_SW:
+		q->ops = &sw_ops;
+		break;
 	default:
 		snap_error("Invalid SNAP_DMA_Q_OPMODE %d\n", attr->mode);
 		return -EINVAL;
@@ -592,6 +611,20 @@ static int snap_qp_attr_helper(struct snap_dma_q *q, struct ibv_pd *pd,
 	}
 
 	snap_debug("Opening dma_q of type %d dpa_mode %d\n", attr->mode, attr->dpa_mode);
+	if (q->ops->mode == SNAP_DMA_Q_MODE_SW) {
+		/* there are no cqs to share, only SINGLE worker mode is possible */
+		if (attr->dpa_mode != SNAP_DMA_Q_DPA_MODE_NONE ||
+		    (attr->wk && attr->wk->mode != SNAP_DMA_WORKER_MODE_SINGLE))
+			return -ENOTSUP;
+
+		/* no completion moderation, no completion channel */
+		q->no_events = true;
+		q->tx_qsize = attr->tx_qsize;
+		q->rx_elem_size = attr->rx_elem_size;
+		q->tx_elem_size = attr->tx_elem_size;
+		return 0;
+	}
+
 	if (attr->dpa_mode != SNAP_DMA_Q_DPA_MODE_NONE) {
 		if (snap_dpa_enabled(pd->context)) {
 			if (q->ops->mode != SNAP_DMA_Q_MODE_DV)
@@ -632,7 +665,10 @@ static int snap_qp_attr_helper(struct snap_dma_q *q, struct ibv_pd *pd,
 		qp_init_attr->sq_max_sge = 1;
 	qp_init_attr->rq_max_sge = 1;
 
-	if (attr->wk) {
+	if (attr->wk)
+		q->no_events = true;
+
+	if (snap_dma_q_shares_worker_cqs(q)) {
 		const struct snap_dma_worker_queue *worker_q = container_of(q, struct snap_dma_worker_queue, q);
 
 		qp_init_attr->rq_cq = attr->wk->rx_cq;
@@ -641,7 +677,17 @@ static int snap_qp_attr_helper(struct snap_dma_q *q, struct ibv_pd *pd,
 		qp_init_attr->qp_type = SNAP_OBJ_DEVX;
 		qp_init_attr->uidx = worker_q->index;
 		qp_init_attr->qp_on_dpa = false;
-		q->no_events = true;
+	}
+
+	if (attr->wk && attr->wk->mode == SNAP_DMA_WORKER_MODE_SRQ) {
+		if (attr->rx_elem_size > attr->wk->dv_srq.rx_elem_size) {
+			snap_error("rx_elem_size %d is bigger than worker srq buffer %u\n",
+				   attr->rx_elem_size, attr->wk->dv_srq.rx_elem_size);
+			return -EINVAL;
+		}
+		qp_init_attr->rq_size = 0;
+		qp_init_attr->srq_enable = true;
+		qp_init_attr->srqn = attr->wk->dv_srq.srqn;
 	}
 
 	return 0;
@@ -724,6 +770,14 @@ static int snap_sw_qp_rx_wqe_helper(struct snap_dma_q *q, struct ibv_pd *pd,
 	if (attr->dpa_mode)
 		return 0;
 
+	if (q->worker && q->worker->mode == SNAP_DMA_WORKER_MODE_SRQ) {
+		/* receive buffers belong to the worker srq */
+		rc = snap_dma_worker_qpn_add(q->worker, q->sw_qp.dv_qp.hw_qp.qp_num, q);
+		if (rc)
+			goto free_qp;
+		return 0;
+	}
+
 	rc = snap_alloc_rx_wqes(pd, &q->sw_qp, 2 * attr->rx_qsize, attr->rx_elem_size);
 	if (rc)
 		goto free_qp;
@@ -733,7 +787,7 @@ static int snap_sw_qp_rx_wqe_helper(struct snap_dma_q *q, struct ibv_pd *pd,
 	return 0;
 
 free_qp:
-	if (q->worker)
+	if (snap_dma_q_shares_worker_cqs(q))
 		destroy_cqs = false;
 	snap_destroy_qp_helper(&q->sw_qp, destroy_cqs);
 	return rc;
@@ -748,7 +802,9 @@ static int snap_create_sw_qp(struct snap_dma_q *q, struct ibv_pd *pd,
 	rc = snap_qp_attr_helper(q, pd, attr, &qp_init_attr);
 	if (rc)
 		return rc;
-	if (attr->wk)
+	if (q->ops->mode == SNAP_DMA_Q_MODE_SW)
+		return snap_dma_sw_q_init(q, attr);
+	if (snap_dma_q_shares_worker_cqs(q))
 		rc = snap_create_worker_qp_helper(pd, &qp_init_attr, &q->sw_qp,
 				q->ops->mode);
 	else
@@ -1256,7 +1312,7 @@ static int snap_alloc_crypto_ctx(struct snap_dma_q *q, struct ibv_pd *pd)
 		return -ENOMEM;
 	}
 
-	ret = snap_query_relaxed_ordering_caps(pd->context, &caps);
+	ret = snap_get_relaxed_ordering_caps(pd->context, &caps);
 	if (ret) {
 		snap_error("query relaxed_ordering_caps failed, ret:%d\n", ret);
 		goto free_crypto_ctx;
@@ -1486,6 +1542,9 @@ int snap_dma_ep_connect(struct snap_dma_q *q1, struct snap_dma_q *q2)
 	if (!q1 || !q2)
 		return -1;
 
+	if (!q1->sw_qp.qp || !q2->sw_qp.qp)
+		return -ENOTSUP;
+
 	pd = snap_qp_get_pd(q1->sw_qp.qp);
 	if (!pd)
 		return -1;
@@ -1558,6 +1617,11 @@ static struct snap_dma_q *snap_dma_worker_queue_get(struct snap_dma_worker *wk)
 
 	SLIST_REMOVE_HEAD(&wk->free_queues, entry);
 	queue->in_use = true;
+	/* SINGLE mode queue is progressed directly */
+	if (wk->mode != SNAP_DMA_WORKER_MODE_SINGLE) {
+		queue->q.sw_qp.dv_qp.wk_active = &wk->active_qs[queue->index / 64];
+		queue->q.sw_qp.dv_qp.wk_active_mask = 1ULL << (queue->index % 64);
+	}
 	return &queue->q;
 }
 
@@ -1566,10 +1630,72 @@ static void snap_dma_worker_queue_put(struct snap_dma_q *q)
 	struct snap_dma_worker_queue *queue = container_of(q, struct snap_dma_worker_queue, q);
 
 	queue->in_use = false;
+	if (q->sw_qp.dv_qp.wk_active) {
+		*q->sw_qp.dv_qp.wk_active &= ~q->sw_qp.dv_qp.wk_active_mask;
+		q->sw_qp.dv_qp.wk_active = NULL;
+	}
 	SLIST_INSERT_HEAD(&q->worker->free_queues, queue, entry);
 	q->worker = NULL;
 }
 
+/* snap_dma_q hot fields are grouped in cacheline aligned blocks */
+static void *snap_dma_calloc_aligned(size_t size)
+{
+	void *p;
+
+	if (posix_memalign(&p, SNAP_CACHE_LINE_SIZE, size))
+		return NULL;
+
+	memset(p, 0, size);
+	return p;
+}
+
+static int snap_dma_q_pending_create(struct snap_dma_q *q,
+		const struct snap_dma_q_create_attr *attr)
+{
+	struct snap_dma_pending_ring *ring;
+	uint32_t size;
+
+	q->pending = NULL;
+	if (!attr->pending_qsize)
+		return 0;
+
+	if (attr->dpa_mode != SNAP_DMA_Q_DPA_MODE_NONE)
+		return -ENOTSUP;
+
+	size = SNAP_ROUNDUP_POW2(attr->pending_qsize);
+	ring = calloc(1, sizeof(*ring) + size * sizeof(ring->ops[0]));
+	if (!ring)
+		return -ENOMEM;
+
+	ring->mask = size - 1;
+	ring->elem_size = attr->tx_elem_size;
+	if (ring->elem_size) {
+		ring->data = calloc(size, ring->elem_size);
+		if (!ring->data) {
+			free(ring);
+			return -ENOMEM;
+		}
+	}
+
+	q->pending = ring;
+	return 0;
+}
+
+static void snap_dma_q_pending_destroy(struct snap_dma_q *q)
+{
+	if (!q->pending)
+		return;
+
+	if (q->pending->pi != q->pending->ci)
+		snap_warn("dma_q:%p destroyed with %u deferred operations\n",
+			  q, q->pending->pi - q->pending->ci);
+
+	free(q->pending->data);
+	free(q->pending);
+	q->pending = NULL;
+}
+
 /**
  * snap_dma_ep_create() - Create sw only DMA queue
  * @pd:    protection domain to create qp
@@ -1578,6 +1704,8 @@ static void snap_dma_worker_queue_put(struct snap_dma_q *q)
  * The function creates only a sw qp.
  * The use is to create 2 separate sw only snap_dma_q's and connect them
  *
+ * @pd may be NULL if @attr->mode is SNAP_DMA_Q_MODE_SW.
+ *
  * If the endpoint is created on DPA, dpa_dma_ep_init() must be called by a
  * DPA thread to complete initialization.
  *
@@ -1589,26 +1717,36 @@ struct snap_dma_q *snap_dma_ep_create(struct ibv_pd *pd,
 	int rc;
 	struct snap_dma_q *q;
 
-	if (!pd)
+	if (!pd && attr->mode != SNAP_DMA_Q_MODE_SW)
 		return NULL;
 
 	if (!attr->rx_cb)
 		return NULL;
 
 	if (!attr->wk)
-		q = calloc(1, sizeof(*q));
+		q = snap_dma_calloc_aligned(sizeof(*q));
 	else
 		q = snap_dma_worker_queue_get(attr->wk);
 	if (!q)
 		return NULL;
 	q->worker = attr->wk;
-	rc = snap_create_sw_qp(q, pd, attr);
+	rc = snap_dma_q_pending_create(q, attr);
 	if (rc)
 		goto free_q;
+	rc = snap_create_sw_qp(q, pd, attr);
+	if (rc)
+		goto free_pending;
+	rc = snap_dma_q_stats_init(q, attr);
+	if (rc)
+		goto free_sw_qp;
 	q->uctx = attr->uctx;
 	q->rx_cb = attr->rx_cb;
 	return q;
 
+free_sw_qp:
+	snap_destroy_sw_qp(q);
+free_pending:
+	snap_dma_q_pending_destroy(q);
 free_q:
 	if (!attr->wk)
 		free(q);
@@ -1636,6 +1774,9 @@ free_q:
  *
  * All these steps must be done by the application.
  *
+ * In the SNAP_DMA_Q_MODE_SW mode no qps are created, @pd may be NULL and
+ * snap_dma_q_get_fw_qp() returns NULL.
+ *
  * Return: dma queue or NULL on error.
  */
 struct snap_dma_q *snap_dma_q_create(struct ibv_pd *pd,
@@ -1647,6 +1788,9 @@ struct snap_dma_q *snap_dma_q_create(struct ibv_pd *pd,
 	q = snap_dma_ep_create(pd, attr);
 	if (!q)
 		return NULL;
+	if (q->ops->mode == SNAP_DMA_Q_MODE_SW)
+		goto create_io_ctx;
+
 	rc = snap_create_fw_qp(q, pd, attr);
 	if (rc)
 		goto free_sw_qp;
@@ -1661,6 +1805,7 @@ struct snap_dma_q *snap_dma_q_create(struct ibv_pd *pd,
 	if (rc)
 		goto free_fw_qp;
 
+create_io_ctx:
 	rc = snap_create_io_ctx(q, pd, attr);
 	if (rc)
 		goto free_fw_qp;
@@ -1681,7 +1826,9 @@ free_sw_qp:
  */
 void snap_dma_ep_destroy(struct snap_dma_q *q)
 {
+	snap_dma_q_stats_destroy(q);
 	snap_destroy_sw_qp(q);
+	snap_dma_q_pending_destroy(q);
 	if (q->worker)
 		snap_dma_worker_queue_put(q);
 	else
@@ -1700,7 +1847,7 @@ void snap_dma_q_destroy(struct snap_dma_q *q)
 	snap_dma_ep_destroy(q);
 }
 
-SNAP_STATIC_ASSERT(sizeof(struct snap_dma_q) < SNAP_DMA_THREAD_MBOX_CMD_SIZE,
+SNAP_STATIC_ASSERT(sizeof(struct snap_dma_ep_copy_cmd) <= SNAP_DPA_THREAD_MBOX_RSP_OFFSET,
 		"struct snap_dma_q is too big for the DPA thread mbox");
 /**
  * snap_dma_ep_dpa_copy_sync() - Copy DMA endpoint to DPA
@@ -1778,10 +1925,169 @@ free_tx_cq:
 	return -EINVAL;
 }
 
+/**
+ * snap_dma_worker_qpn_add() - Add queue to the worker qp number table
+ * @wk:  dma worker
+ * @qpn: qp number
+ * @q:   dma queue that owns the qp
+ *
+ * Return: 0 on success or -EEXIST if @qpn is already in the table
+ */
+int snap_dma_worker_qpn_add(struct snap_dma_worker *wk, uint32_t qpn,
+		struct snap_dma_q *q)
+{
+	uint32_t i;
+
+	/* table is at least twice as big as max_queues, never full */
+	for (i = qpn & wk->qpn_mask; wk->qpn_table[i].q; i = (i + 1) & wk->qpn_mask) {
+		if (wk->qpn_table[i].qpn == qpn)
+			return -EEXIST;
+	}
+
+	wk->qpn_table[i].qpn = qpn;
+	wk->qpn_table[i].q = q;
+	return 0;
+}
+
+/**
+ * snap_dma_worker_qpn_del() - Remove qp number from the worker table
+ * @wk:  dma worker
+ * @qpn: qp number
+ */
+void snap_dma_worker_qpn_del(struct snap_dma_worker *wk, uint32_t qpn)
+{
+	struct snap_dma_worker_qpn *t = wk->qpn_table;
+	uint32_t i, j, mask = wk->qpn_mask;
+
+	for (i = qpn & mask; t[i].q; i = (i + 1) & mask) {
+		if (t[i].qpn == qpn)
+			break;
+	}
+	if (!t[i].q)
+		return;
+
+	/* no tombstones: move back entries that can not be found otherwise */
+	for (j = (i + 1) & mask; t[j].q; j = (j + 1) & mask) {
+		if (((j - t[j].qpn) & mask) >= ((j - i) & mask)) {
+			t[i] = t[j];
+			i = j;
+		}
+	}
+	t[i].q = NULL;
+}
+
+static int snap_create_worker_srq(struct snap_dma_worker *wk, struct ibv_pd *pd,
+		const struct snap_dma_worker_create_attr *attr)
+{
+	struct ibv_srq_init_attr srq_attr = {};
+	struct mlx5dv_srq dv_srq = {};
+	struct mlx5dv_obj dv_obj = {};
+	struct mlx5_wqe_srq_next_seg *next;
+	struct snap_dv_srq *srq = &wk->dv_srq;
+	size_t buf_len;
+	uint32_t i;
+	int rc;
+
+	if (attr->rx_elem_size <= 0 || attr->exp_queue_rx_size <= 0) {
+		snap_error("SRQ worker needs rx_elem_size and exp_queue_rx_size\n");
+		return -EINVAL;
+	}
+
+	wk->qpn_mask = SNAP_ROUNDUP_POW2(2 * attr->exp_queue_num) - 1;
+	wk->qpn_table = calloc(wk->qpn_mask + 1, sizeof(*wk->qpn_table));
+	if (!wk->qpn_table)
+		return -ENOMEM;
+
+	srq_attr.attr.max_wr = attr->exp_queue_num * attr->exp_queue_rx_size;
+	srq_attr.attr.max_sge = 1;
+	wk->srq = ibv_create_srq(pd, &srq_attr);
+	if (!wk->srq) {
+		snap_error("Failed to create srq with %u wqes: %m\n", srq_attr.attr.max_wr);
+		rc = -EINVAL;
+		goto free_table;
+	}
+
+	dv_obj.srq.in = wk->srq;
+	dv_obj.srq.out = &dv_srq;
+	dv_srq.comp_mask = MLX5DV_SRQ_MASK_SRQN;
+	rc = mlx5dv_init_obj(&dv_obj, MLX5DV_OBJ_SRQ);
+	if (rc)
+		goto destroy_srq;
+
+	/* the tail wqe is never posted, see libmlx5 */
+	srq->addr = (uintptr_t)dv_srq.buf;
+	srq->stride = dv_srq.stride;
+	srq->wqe_cnt = dv_srq.tail + 1;
+	srq->dbr = (uint32_t *)dv_srq.dbrec;
+	srq->tail = dv_srq.tail;
+	srq->srqn = dv_srq.srqn;
+	srq->rx_elem_size = attr->rx_elem_size;
+
+	buf_len = (size_t)srq->wqe_cnt * srq->rx_elem_size;
+	rc = posix_memalign((void **)&srq->rx_buf, SNAP_DMA_RX_BUF_ALIGN, buf_len);
+	if (rc)
+		goto destroy_srq;
+
+	wk->srq_mr = ibv_reg_mr(pd, srq->rx_buf, buf_len, IBV_ACCESS_LOCAL_WRITE);
+	if (!wk->srq_mr) {
+		rc = -ENOMEM;
+		goto free_rx_buf;
+	}
+
+	for (i = 0; i < srq->wqe_cnt; i++) {
+		next = (struct mlx5_wqe_srq_next_seg *)(srq->addr + i * srq->stride);
+		next->next_wqe_index = htobe16((i + 1) & (srq->wqe_cnt - 1));
+		mlx5dv_set_data_seg((struct mlx5_wqe_data_seg *)(next + 1),
+				    srq->rx_elem_size, wk->srq_mr->lkey,
+				    (uintptr_t)(srq->rx_buf + i * srq->rx_elem_size));
+	}
+	srq->counter = srq->wqe_cnt - 1;
+	snap_dv_srq_ring_db(srq);
+	return 0;
+
+free_rx_buf:
+	free(srq->rx_buf);
+destroy_srq:
+	ibv_destroy_srq(wk->srq);
+free_table:
+	free(wk->qpn_table);
+	return rc;
+}
+
+static void snap_destroy_worker_srq(struct snap_dma_worker *wk)
+{
+	ibv_destroy_srq(wk->srq);
+	ibv_dereg_mr(wk->srq_mr);
+	free(wk->dv_srq.rx_buf);
+	free(wk->qpn_table);
+}
+
+/**
+ * snap_dma_worker_create() - Create DMA worker
+ * @pd:   protection domain to create worker resources
+ * @attr: worker creation attributes
+ *
+ * The worker serves up to &struct snap_dma_worker_create_attr.exp_queue_num
+ * dma queues created with &struct snap_dma_q_create_attr.wk set.
+ *
+ * Worker modes:
+ * SNAP_DMA_WORKER_MODE_SINGLE - exactly one queue with its own cqs. Worker
+ * progress calls the queue progress directly.
+ *
+ * SNAP_DMA_WORKER_MODE_CQ_POOL - queues share tx and rx cqs, each queue has
+ * its own receive buffers.
+ *
+ * SNAP_DMA_WORKER_MODE_SRQ - same as CQ_POOL but all queues receive into a
+ * single shared receive queue of exp_queue_num * exp_queue_rx_size buffers
+ * of the &struct snap_dma_worker_create_attr.rx_elem_size bytes. Queue
+ * rx_qsize is ignored and rx_elem_size must not be bigger than the worker one.
+ *
+ * Return: dma worker or NULL on error
+ */
 struct snap_dma_worker *snap_dma_worker_create(struct ibv_pd *pd,
 	const struct snap_dma_worker_create_attr *attr)
 {
-	struct snap_dma_worker *wk = calloc(1, sizeof(*wk) + attr->exp_queue_num * sizeof(struct snap_dma_worker_queue));
+	struct snap_dma_worker *wk;
 	struct snap_cq_attr cq_attr = {
 		.cq_context = NULL,
 		.comp_channel = NULL,
@@ -1791,14 +2097,61 @@ struct snap_dma_worker *snap_dma_worker_create(struct ibv_pd *pd,
 		.cq_type = SNAP_OBJ_DEVX,
 		.oi_enable = true
 	};
+	int rc;
+
+	if (attr->exp_queue_num <= 0)
+		return NULL;
 
+	switch (attr->mode) {
+	case SNAP_DMA_WORKER_MODE_SINGLE:
+		if (attr->exp_queue_num != 1) {
+			snap_error("SINGLE mode worker serves one queue, requested %d\n",
+				   attr->exp_queue_num);
+			return NULL;
+		}
+		break;
+	case SNAP_DMA_WORKER_MODE_CQ_POOL:
+	case SNAP_DMA_WORKER_MODE_SRQ:
+		break;
+	default:
+		snap_error("Invalid worker mode %d\n", attr->mode);
+		return NULL;
+	}
+
+	wk = snap_dma_calloc_aligned(sizeof(*wk) +
+			attr->exp_queue_num * sizeof(struct snap_dma_worker_queue));
 	if (!wk)
 		return NULL;
 
-	snap_create_worker_cqs_helper(wk, pd, &cq_attr);
+	wk->mode = attr->mode;
+	wk->active_qs = calloc(SNAP_DMA_WORKER_BITMAP_WORDS(attr->exp_queue_num),
+			       sizeof(*wk->active_qs));
+	if (!wk->active_qs)
+		goto free_wk;
+
+	if (wk->mode != SNAP_DMA_WORKER_MODE_SINGLE) {
+		rc = snap_create_worker_cqs_helper(wk, pd, &cq_attr);
+		if (rc)
+			goto free_active_qs;
+	}
+
+	if (wk->mode == SNAP_DMA_WORKER_MODE_SRQ) {
+		rc = snap_create_worker_srq(wk, pd, attr);
+		if (rc)
+			goto free_cqs;
+	}
 
 	snap_dma_worker_init_queues(wk, attr->exp_queue_num);
 	return wk;
+
+free_cqs:
+	snap_cq_destroy(wk->rx_cq);
+	snap_cq_destroy(wk->tx_cq);
+free_active_qs:
+	free(wk->active_qs);
+free_wk:
+	free(wk);
+	return NULL;
 }
 
 void snap_dma_worker_destroy(struct snap_dma_worker *wk)
@@ -1806,22 +2159,56 @@ void snap_dma_worker_destroy(struct snap_dma_worker *wk)
 	if (!wk)
 		return;
 
-	snap_cq_destroy(wk->rx_cq);
-	snap_cq_destroy(wk->tx_cq);
+	if (wk->mode == SNAP_DMA_WORKER_MODE_SRQ)
+		snap_destroy_worker_srq(wk);
+	if (wk->mode != SNAP_DMA_WORKER_MODE_SINGLE) {
+		snap_cq_destroy(wk->rx_cq);
+		snap_cq_destroy(wk->tx_cq);
+	}
+	free(wk->active_qs);
 	free(wk);
 }
 
+static inline struct snap_dma_q *snap_dma_worker_single_q(struct snap_dma_worker *wk)
+{
+	return snap_likely(wk->queues[0].in_use) ? &wk->queues[0].q : NULL;
+}
+
 int snap_dma_worker_flush(struct snap_dma_worker *wk)
 {
+	struct snap_dma_q *q;
+
+	if (wk->mode == SNAP_DMA_WORKER_MODE_SINGLE) {
+		q = snap_dma_worker_single_q(wk);
+		return q ? snap_dma_q_flush(q) : 0;
+	}
+
 	return dv_worker_flush(wk);
 }
 
 int snap_dma_worker_progress_rx(struct snap_dma_worker *wk)
 {
-	return dv_worker_progress_rx(wk);
+	struct snap_dma_q *q;
+
+	switch (wk->mode) {
+	case SNAP_DMA_WORKER_MODE_SINGLE:
+		q = snap_dma_worker_single_q(wk);
+		return q ? q->ops->progress_rx(q) : 0;
+	case SNAP_DMA_WORKER_MODE_SRQ:
+		return dv_worker_srq_progress_rx(wk);
+	default:
+		return dv_worker_progress_rx(wk);
+	}
 }
 
 int snap_dma_worker_progress_tx(struct snap_dma_worker *wk)
 {
+	struct snap_dma_q *q;
+
+	if (wk->mode == SNAP_DMA_WORKER_MODE_SINGLE) {
+		q = snap_dma_worker_single_q(wk);
+		return q ? snap_dma_q_progress_tx(q) : 0;
+	}
+
 	return dv_worker_progress_tx(wk);
 }
@@ -100,6 +100,46 @@ static int dv_dma_q_read(struct snap_dma_q *q, void *dst_buf, size_t len,
 			MLX5_OPCODE_RDMA_READ, flags, comp, false);
 }
 
+typedef int (*dv_dma_xfer_fn_t)(struct snap_dma_q *q, void *buf, size_t len,
+				uint32_t lkey, uint64_t raddr, uint32_t rkey,
+				struct snap_dma_completion *comp);
+
+/*
+ * Build all wqes back to back and ring a single doorbell. Send queue
+ * completions are in order, so only the last wqe carries the completion.
+ */
+static inline int do_dv_dma_post_batch(struct snap_dma_q *q,
+		struct snap_dma_op *ops, int n, struct snap_dma_completion *comp,
+		dv_dma_xfer_fn_t write, dv_dma_xfer_fn_t read)
+{
+	struct snap_dv_qp *dv_qp = &q->sw_qp.dv_qp;
+	enum snap_db_ring_flag db_flag = dv_qp->db_flag;
+	struct snap_dma_completion *c;
+	struct snap_dma_op *op;
+	int i;
+
+	dv_qp->db_flag = SNAP_DB_RING_BATCH;
+	for (i = 0; i < n; i++) {
+		op = &ops[i];
+		c = i == n - 1 ? comp : NULL;
+		if (op->opcode == SNAP_DMA_OP_WRITE)
+			write(q, op->buf, op->len, op->lkey, op->raddr, op->rkey, c);
+		else
+			read(q, op->buf, op->len, op->lkey, op->raddr, op->rkey, c);
+	}
+	dv_qp->db_flag = db_flag;
+
+	if (db_flag != SNAP_DB_RING_BATCH)
+		snap_dv_tx_complete(dv_qp);
+	return 0;
+}
+
+static int dv_dma_q_post_batch(struct snap_dma_q *q, struct snap_dma_op *ops,
+			       int n, struct snap_dma_completion *comp)
+{
+	return do_dv_dma_post_batch(q, ops, n, comp, dv_dma_q_write, dv_dma_q_read);
+}
+
 /* UMRs are not supported on the DPA yet */
 __attribute__((unused)) static void
 snap_use_klm_mkey_done(struct snap_dma_completion *comp, int status)
@@ -376,9 +416,9 @@ static int do_dv_dma_xfer_v2v(struct snap_dma_q *q,
 	return 0;
 }
 
-static int dv_dma_q_writev2v(struct snap_dma_q *q,
+static int dv_dma_q_xfer_v2v(struct snap_dma_q *q,
 				struct snap_dma_q_io_attr *io_attr,
-				struct snap_dma_completion *comp, int *n_bb)
+				struct snap_dma_completion *comp, int *n_bb, int op)
 {
 	int wr_cnt;
 	int num_sge[SNAP_DMA_Q_MAX_WR_CNT];
@@ -393,11 +433,24 @@ static int dv_dma_q_writev2v(struct snap_dma_q *q,
 		return -EAGAIN;
 	}
 
-	return do_dv_dma_xfer_v2v(q, wr_cnt,
-				MLX5_OPCODE_RDMA_WRITE, num_sge,
+	return do_dv_dma_xfer_v2v(q, wr_cnt, op, num_sge,
 				l_sgl, r_sgl, comp, n_bb);
 }
 
+static int dv_dma_q_writev2v(struct snap_dma_q *q,
+				struct snap_dma_q_io_attr *io_attr,
+				struct snap_dma_completion *comp, int *n_bb)
+{
+	return dv_dma_q_xfer_v2v(q, io_attr, comp, n_bb, MLX5_OPCODE_RDMA_WRITE);
+}
+
+static int dv_dma_q_readv2v(struct snap_dma_q *q,
+				struct snap_dma_q_io_attr *io_attr,
+				struct snap_dma_completion *comp, int *n_bb)
+{
+	return dv_dma_q_xfer_v2v(q, io_attr, comp, n_bb, MLX5_OPCODE_RDMA_READ);
+}
+
 static inline int do_dv_xfer_inline(struct snap_dma_q *q, void *src_buf, size_t len,
 				    int op, uint64_t raddr, uint32_t rkey,
 				    struct snap_dma_completion *flush_comp, int *n_bb)
@@ -901,6 +954,7 @@ const struct snap_dma_q_ops dv_ops = {
 	.writec          = dv_dma_q_writec,
 	.write_short     = dv_dma_q_write_short,
 	.read            = dv_dma_q_read,
+	.readv2v         = dv_dma_q_readv2v,
 	.readc           = dv_dma_q_readc,
 	.read_short      = dv_dma_q_read_short,
 	.send_completion = dv_dma_q_send_completion,
@@ -914,6 +968,7 @@ const struct snap_dma_q_ops dv_ops = {
 	.flush_nowait    = dv_dma_q_flush_nowait,
 	.empty           = dv_dma_q_empty,
 	.stat            = dv_dma_q_stat,
+	.post_batch      = dv_dma_q_post_batch,
 };
 
 /* GGA */
@@ -986,6 +1041,12 @@ static int gga_dma_q_read(struct snap_dma_q *q, void *dst_buf, size_t len,
 			(uint64_t)dst_buf, lkey, comp, false);
 }
 
+static int gga_dma_q_post_batch(struct snap_dma_q *q, struct snap_dma_op *ops,
+				int n, struct snap_dma_completion *comp)
+{
+	return do_dv_dma_post_batch(q, ops, n, comp, gga_dma_q_write, gga_dma_q_read);
+}
+
 static int gga_dma_q_writec(struct snap_dma_q *q,
 				struct snap_dma_q_io_attr *io_attr,
 				struct snap_dma_completion *comp, int *n_bb)
@@ -1007,6 +1068,7 @@ const struct snap_dma_q_ops gga_ops = {
 	.writec          = gga_dma_q_writec,
 	.write_short     = dv_dma_q_write_short,
 	.read            = gga_dma_q_read,
+	.readv2v         = dv_dma_q_readv2v,
 	.readc           = gga_dma_q_readc,
 	.read_short      = dv_dma_q_read_short,
 	.send_completion = dv_dma_q_send_completion,
@@ -1020,6 +1082,7 @@ const struct snap_dma_q_ops gga_ops = {
 	.flush_nowait    = dv_dma_q_flush_nowait,
 	.empty           = dv_dma_q_empty,
 	.stat            = dv_dma_q_stat,
+	.post_batch      = gga_dma_q_post_batch,
 };
 
 int dv_worker_progress_rx(struct snap_dma_worker *wk)
@@ -1067,32 +1130,86 @@ int dv_worker_progress_rx(struct snap_dma_worker *wk)
 	return n;
 }
 
+int dv_worker_srq_progress_rx(struct snap_dma_worker *wk)
+{
+	struct mlx5_cqe64 *cqe[SNAP_DMA_MAX_RX_COMPLETIONS];
+	struct snap_dma_q *qs[SNAP_DMA_MAX_RX_COMPLETIONS];
+	struct snap_dv_srq *srq = &wk->dv_srq;
+	struct snap_dma_q *q;
+	uint16_t wqe_index;
+	int n, i, op;
+
+	n = 0;
+	do {
+		cqe[n] = snap_dv_poll_cq(&wk->dv_rx_cq, SNAP_DMA_Q_RX_CQE_SIZE);
+		if (!cqe[n])
+			break;
+		op = mlx5dv_get_cqe_opcode(cqe[n]);
+		if (snap_unlikely(op != MLX5_CQE_RESP_SEND &&
+				  op != MLX5_CQE_RESP_SEND_IMM &&
+				  op != MLX5_CQE_RESP_WR_IMM)) {
+			/* the wqe is shared by all queues, it is reposted anyway */
+			snap_dv_cqe_err(cqe[n]);
+			qs[n++] = NULL;
+			continue;
+		}
+
+		/* srqn_uidx holds srq number, demux by the qp number */
+		qs[n] = worker_qpn_lookup(wk, be32toh(cqe[n]->sop_drop_qpn) & 0xffffff);
+		n++;
+	} while (n < SNAP_DMA_MAX_RX_COMPLETIONS);
+
+	if (n == 0)
+		return 0;
+
+	snap_memory_cpu_load_fence();
+
+	for (i = 0; i < n; i++) {
+		wqe_index = be16toh(cqe[i]->wqe_counter) & (srq->wqe_cnt - 1);
+		q = qs[i];
+		if (snap_likely(q)) {
+			q->rx_cb(q, srq->rx_buf + wqe_index * srq->rx_elem_size,
+				 be32toh(cqe[i]->byte_cnt), cqe[i]->imm_inval_pkey);
+			q->sw_qp.dv_qp.stat.rx.total_completed++;
+		} else {
+			snap_debug("%s: dropping CQE of qpn 0x%x\n", __func__,
+				   be32toh(cqe[i]->sop_drop_qpn) & 0xffffff);
+		}
+		snap_dv_srq_repost(srq, wqe_index);
+	}
+
+	snap_dv_srq_ring_db(srq);
+	return n;
+}
+
 static inline void dv_worker_ring_all_doorbells(struct snap_dma_worker *wk)
 {
 	int i;
+	struct snap_dma_q *q;
 	struct snap_dv_qp *dv_qp;
 
-	for (i = 0; i < wk->max_queues; i++) {
+	/* only queues that posted since they became idle are visited */
+	worker_foreach_active_q(wk, i) {
 		dv_qp = &wk->queues[i].q.sw_qp.dv_qp;
-		if (snap_likely(wk->queues[i].in_use)) {
-			if (dv_qp->tx_need_ring_db)
-				snap_dv_update_tx_db(dv_qp);
-		}
+		if (dv_qp->tx_need_ring_db)
+			snap_dv_update_tx_db(dv_qp);
 	}
 
 	snap_memory_bus_store_fence();
 
-	for (i = 0; i < wk->max_queues; i++) {
-		dv_qp = &wk->queues[i].q.sw_qp.dv_qp;
-		if (snap_likely(wk->queues[i].in_use)) {
-			if (dv_qp->tx_need_ring_db) {
-				dv_qp->tx_need_ring_db = false;
-				snap_dv_flush_tx_db(dv_qp, dv_qp->ctrl);
+	worker_foreach_active_q(wk, i) {
+		q = &wk->queues[i].q;
+		dv_qp = &q->sw_qp.dv_qp;
+		if (dv_qp->tx_need_ring_db) {
+			dv_qp->tx_need_ring_db = false;
+			snap_dv_flush_tx_db(dv_qp, dv_qp->ctrl);
 #if !defined(__aarch64__)
-				if (!dv_qp->hw_qp.sq.tx_db_nc)
-					snap_memory_bus_store_fence();
+			if (!dv_qp->hw_qp.sq.tx_db_nc)
+				snap_memory_bus_store_fence();
 #endif
-			}
+		} else if (q->tx_available == dv_qp->hw_qp.sq.wqe_cnt) {
+			/* all work is completed, queue is idle */
+			*dv_qp->wk_active &= ~dv_qp->wk_active_mask;
 		}
 	}
 }
@@ -1132,6 +1249,14 @@ int dv_worker_progress_tx(struct snap_dma_worker *wk)
 			comp[i]->func(comp[i], mlx5dv_get_cqe_opcode(cqe[i]));
 	}
 
+	/* queue with deferred ops has outstanding work, so it is active */
+	worker_foreach_active_q(wk, i) {
+		q = &wk->queues[i].q;
+		snap_dma_q_stat_complete(q);
+		if (snap_unlikely(snap_dma_q_has_pending(q)))
+			snap_dma_q_pending_progress(q);
+	}
+
 	dv_worker_ring_all_doorbells(wk);
 
 	return n;
@@ -1166,16 +1291,18 @@ int dv_worker_flush(struct snap_dma_worker *wk)
 	while (!worker_qps_can_tx(wk, 1))
 		n += dv_worker_progress_tx(wk);
 
-	for (i = 0 ; i < wk->max_queues; i++) {
-		if (snap_unlikely(!wk->queues[i].in_use))
-			continue;
+	worker_foreach_active_q(wk, i) {
+		q = &wk->queues[i].q;
+		while (snap_dma_q_has_pending(q))
+			n += dv_worker_progress_tx(wk);
+	}
+
+	worker_foreach_active_q(wk, i) {
 		q = &wk->queues[i].q;
 		n += worker_flush_helper(q);
 	}
 
-	for (i = 0 ; i < wk->max_queues; i++) {
-		if (snap_unlikely(!wk->queues[i].in_use))
-			continue;
+	worker_foreach_active_q(wk, i) {
 		tx_available = wk->queues[i].q.sw_qp.dv_qp.hw_qp.sq.wqe_cnt;
 		while (wk->queues[i].q.tx_available < tx_available)
 			n += dv_worker_progress_tx(wk);
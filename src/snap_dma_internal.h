@@ -51,6 +51,119 @@ struct mlx5_dma_wqe {
 	struct mlx5_wqe_data_seg scatter;
 };
 
+enum snap_dma_pending_op_type {
+	SNAP_DMA_PENDING_OP_WRITE,
+	SNAP_DMA_PENDING_OP_READ,
+	SNAP_DMA_PENDING_OP_WRITE_SHORT,
+	SNAP_DMA_PENDING_OP_READ_SHORT,
+	SNAP_DMA_PENDING_OP_SEND_COMPLETION
+};
+
+/* operation that was deferred because the send queue was full */
+struct snap_dma_pending_op {
+	int type;
+	/* local buffer or a copy of the data in case of the short ops */
+	struct iovec iov;
+	uint32_t lkey;
+	uint64_t raddr;
+	uint32_t rkey;
+	struct snap_dma_completion *comp;
+	/* more pieces of the same operation follow, the last one has @comp */
+	bool more;
+};
+
+struct snap_dma_pending_ring {
+	uint32_t pi;
+	uint32_t ci;
+	uint32_t mask;
+	/* short ops data copy, elem_size bytes per ring entry */
+	uint32_t elem_size;
+	char *data;
+	struct snap_dma_pending_op ops[];
+};
+
+static inline bool snap_dma_q_has_pending(struct snap_dma_q *q)
+{
+	return q->pending && q->pending->pi != q->pending->ci;
+}
+
+int snap_dma_q_pending_progress(struct snap_dma_q *q);
+
+/* op that is waiting for the completion, kept in the post order */
+struct snap_dma_stat_inflight {
+	uint64_t ts;
+	uint16_t n_bb;
+	uint8_t op;
+};
+
+struct snap_dma_q_stats_ctx {
+	struct snap_dma_q_stats stats;
+	struct snap_dma_stat_inflight *inflight;
+	uint32_t pi;
+	uint32_t ci;
+	uint32_t mask;
+	/* send credits of the idle queue */
+	int max_tx_available;
+	/* wqe basic blocks posted and accounted as completed */
+	uint64_t bb_posted;
+	uint64_t bb_done;
+	/* sq pi at the last tx doorbell */
+	uint16_t db_pi;
+};
+
+void snap_dma_q_stats_post(struct snap_dma_q_stats_ctx *ctx, int op,
+		size_t len, bool is_inline, int n_bb, uint64_t ts);
+void snap_dma_q_stats_complete(struct snap_dma_q *q, uint64_t now);
+void snap_dma_q_stats_db(struct snap_dma_q_stats_ctx *ctx, int batch);
+int snap_dma_q_stats_init(struct snap_dma_q *q, const struct snap_dma_q_create_attr *attr);
+void snap_dma_q_stats_destroy(struct snap_dma_q *q);
+
+/*
+ * Statistics hooks, compiled out if SNAP_DMA_STATS is 0. Otherwise cost is
+ * a single check of the pointer that lives in the tx cacheline.
+ */
+static inline void snap_dma_q_stat_post(struct snap_dma_q *q, int op,
+					size_t len, bool is_inline, int n_bb)
+{
+#if SNAP_DMA_STATS
+	if (snap_unlikely(q->stats))
+		snap_dma_q_stats_post(q->stats, op, len, is_inline, n_bb,
+				      snap_dma_stat_ticks());
+#endif
+}
+
+static inline void snap_dma_q_stat_post_batch(struct snap_dma_q *q,
+					      struct snap_dma_op *ops, int n)
+{
+#if SNAP_DMA_STATS
+	int i;
+
+	if (snap_likely(!q->stats))
+		return;
+
+	for (i = 0; i < n; i++)
+		snap_dma_q_stats_post(q->stats, ops[i].opcode == SNAP_DMA_OP_WRITE ?
+				      SNAP_DMA_STAT_OP_WRITE : SNAP_DMA_STAT_OP_READ,
+				      ops[i].len, false, 1, snap_dma_stat_ticks());
+#endif
+}
+
+static inline void snap_dma_q_stat_eagain(struct snap_dma_q *q, int op)
+{
+#if SNAP_DMA_STATS
+	if (snap_unlikely(q->stats))
+		q->stats->stats.ops[op].eagain++;
+#endif
+}
+
+static inline void snap_dma_q_stat_complete(struct snap_dma_q *q)
+{
+#if SNAP_DMA_STATS
+	if (snap_unlikely(q->stats))
+		snap_dma_q_stats_complete(q, snap_dma_stat_ticks());
+#endif
+}
+
 static inline uint16_t round_up(uint16_t x, uint16_t d)
 {
 	return (x + d - 1)/d;
@@ -62,13 +175,51 @@ static inline bool qp_can_tx(struct snap_dma_q *q, int bb_needed)
 	return q->tx_available >= bb_needed;
 }
 
+#define SNAP_DMA_WORKER_BITMAP_WORDS(n) (((n) + 63) / 64)
+
+/* return index of the first active worker queue starting from i or -1 */
+static inline int worker_next_active_q(struct snap_dma_worker *wk, int i)
+{
+	int w = i / 64;
+	uint64_t bits;
+
+	if (i >= wk->max_queues)
+		return -1;
+
+	bits = wk->active_qs[w] & (~0ULL << (i % 64));
+	while (!bits) {
+		if (++w >= SNAP_DMA_WORKER_BITMAP_WORDS(wk->max_queues))
+			return -1;
+		bits = wk->active_qs[w];
+	}
+
+	return w * 64 + __builtin_ctzll(bits);
+}
+
+/* iterate over the queues that have outstanding tx or unrung doorbells */
+#define worker_foreach_active_q(wk, i) \
+	for ((i) = worker_next_active_q(wk, 0); (i) >= 0; \
+	     (i) = worker_next_active_q(wk, (i) + 1))
+
+/* qp numbers are allocated sequentially, so low bits are almost always unique */
+static inline struct snap_dma_q *worker_qpn_lookup(struct snap_dma_worker *wk, uint32_t qpn)
+{
+	uint32_t i;
+
+	for (i = qpn & wk->qpn_mask; wk->qpn_table[i].q; i = (i + 1) & wk->qpn_mask) {
+		if (snap_likely(wk->qpn_table[i].qpn == qpn))
+			return wk->qpn_table[i].q;
+	}
+
+	return NULL;
+}
+
 static inline bool worker_qps_can_tx(struct snap_dma_worker *wk, int bb_needed)
 {
 	int i;
 
-	for (i = 0; i < wk->max_queues; i++) {
-		if (snap_unlikely(!wk->queues[i].in_use))
-			continue;
+	/* idle queues have all tx credits */
+	worker_foreach_active_q(wk, i) {
 		if (wk->queues[i].q.tx_available < bb_needed)
 			return false;
 	}
@@ -115,6 +266,17 @@ static inline void snap_dv_flush_tx_db(struct snap_dv_qp *dv_qp, struct mlx5_wqe
 {
 	*(uint64_t *)(dv_qp->hw_qp.sq.bf_addr) = *(uint64_t *)ctrl;
 	++dv_qp->stat.tx.total_dbs;
+#if SNAP_DMA_STATS
+	{
+		/* tx doorbell is only rung on the snap_dma_q sw_qp */
+		struct snap_dma_q *q = container_of(dv_qp, struct snap_dma_q, sw_qp.dv_qp);
+
+		if (snap_unlikely(q->stats)) {
+			snap_dma_q_stats_db(q->stats, (uint16_t)(dv_qp->hw_qp.sq.pi - q->stats->db_pi));
+			q->stats->db_pi = dv_qp->hw_qp.sq.pi;
+		}
+	}
+#endif
 }
 
 static inline void snap_dv_ring_tx_db(struct snap_dv_qp *dv_qp, struct mlx5_wqe_ctrl_seg *ctrl)
@@ -198,6 +360,8 @@ static inline void snap_dv_set_comp(struct snap_dv_qp *dv_qp, uint16_t pi,
 static inline void snap_dv_wqe_submit(struct snap_dv_qp *dv_qp, struct mlx5_wqe_ctrl_seg *ctrl)
 {
 	dv_qp->hw_qp.sq.pi++;
+	if (dv_qp->wk_active)
+		*dv_qp->wk_active |= dv_qp->wk_active_mask;
 	if (dv_qp->db_flag == SNAP_DB_RING_BATCH) {
 		dv_qp->tx_need_ring_db = true;
 		dv_qp->ctrl = ctrl;
@@ -225,6 +389,28 @@ static inline void snap_dv_post_recv(struct snap_dv_qp *dv_qp, void *addr,
 	dv_qp->hw_qp.rq.ci++;
 }
 
+/*
+ * Return srq wqe to the hw. Same as mlx5_free_srq_wqe() followed by
+ * the srq post recv in the libmlx5, except that the wqe keeps its data
+ * segment and only needs to be linked at the tail of the free list.
+ */
+static inline void snap_dv_srq_repost(struct snap_dv_srq *srq, uint16_t wqe_index)
+{
+	struct mlx5_wqe_srq_next_seg *next;
+
+	next = (struct mlx5_wqe_srq_next_seg *)(srq->addr + srq->tail * srq->stride);
+	next->next_wqe_index = htobe16(wqe_index);
+	srq->tail = wqe_index;
+	srq->counter++;
+}
+
+static inline void snap_dv_srq_ring_db(struct snap_dv_srq *srq)
+{
+	snap_memory_cpu_store_fence();
+	*srq->dbr = htobe32(srq->counter);
+	snap_memory_bus_store_fence();
+}
+
 static inline void snap_dv_arm_cq(struct snap_hw_cq *cq)
 {
 #if !__DPA
@@ -252,12 +438,21 @@ static inline void snap_dv_arm_cq(struct snap_hw_cq *cq)
 }
 
 int dv_worker_progress_rx(struct snap_dma_worker *wk);
+int dv_worker_srq_progress_rx(struct snap_dma_worker *wk);
 int dv_worker_progress_tx(struct snap_dma_worker *wk);
 int dv_worker_flush(struct snap_dma_worker *wk);
 
+int snap_dma_worker_qpn_add(struct snap_dma_worker *wk, uint32_t qpn,
+		struct snap_dma_q *q);
+void snap_dma_worker_qpn_del(struct snap_dma_worker *wk, uint32_t qpn);
+
 extern const struct snap_dma_q_ops verb_ops;
 extern const struct snap_dma_q_ops dv_ops;
 extern const struct snap_dma_q_ops gga_ops;
+extern const struct snap_dma_q_ops sw_ops;
+
+int snap_dma_sw_q_init(struct snap_dma_q *q, const struct snap_dma_q_create_attr *attr);
+void snap_dma_sw_q_destroy(struct snap_dma_q *q);
 
 static inline struct mlx5_cqe64 *snap_dv_get_cqe(struct snap_hw_cq *dv_cq, int cqe_size)
 {
@@ -395,7 +590,7 @@ static inline int snap_dma_build_sgl(struct snap_dma_q_io_attr *io_attr, int *wr
 		*n_bb += (sge_cnt <= 2) ? 1 : 1 + round_up((sge_cnt - 2), 4);
 
 		k++;
-		if (k >= SNAP_DMA_Q_MAX_WR_CNT) {
+		if (k >= SNAP_DMA_Q_MAX_WR_CNT && i < io_attr->riov_cnt - 1) {
 			snap_error("wr cnt reach to max number(%d) supported.\n", SNAP_DMA_Q_MAX_WR_CNT);
 			return -1;
 		}
@@ -0,0 +1,337 @@
+/*
+ * Copyright © 2022 NVIDIA CORPORATION & AFFILIATES. ALL RIGHTS RESERVED.
+ *
+ * This software product is a proprietary product of Nvidia Corporation and its affiliates
+ * (the "Company") and all right, title, and interest in and to the software
+ * product, including all associated intellectual property rights, are and
+ * shall remain exclusively with the Company.
+ *
+ * This software product is governed by the End User License Agreement
+ * provided with the software product.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "snap_dma_internal.h"
+#include "snap_env.h"
+#include "config.h"
+
+/*
+ * Extended dma queue statistics
+ *
+ * Posted operations are recorded in the inflight ring together with the
+ * post timestamp and the number of wqe basic blocks they took. Send queue
+ * completions are returned in order, so once the queue gets back its send
+ * credits the oldest entries of the ring are completed: an entry is done when
+ * the number of basic blocks returned so far covers it. This way the latency
+ * is measured without touching the completion structures or the provider
+ * specific completion path.
+ */
+
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_DMA_Q_STATS, 0);
+
+static const char *snap_dma_stat_op_names[SNAP_DMA_STAT_OP_MAX] = {
+	[SNAP_DMA_STAT_OP_WRITE] = "write",
+	[SNAP_DMA_STAT_OP_READ] = "read",
+	[SNAP_DMA_STAT_OP_WRITE_SHORT] = "write_short",
+	[SNAP_DMA_STAT_OP_READ_SHORT] = "read_short",
+	[SNAP_DMA_STAT_OP_WRITEV] = "writev2v",
+	[SNAP_DMA_STAT_OP_READV] = "readv2v",
+	[SNAP_DMA_STAT_OP_WRITEC] = "writec",
+	[SNAP_DMA_STAT_OP_READC] = "readc",
+	[SNAP_DMA_STAT_OP_SEND_COMPLETION] = "send_completion",
+	[SNAP_DMA_STAT_OP_SEND] = "send",
+	[SNAP_DMA_STAT_OP_FLUSH] = "flush"
+};
+
+/**
+ * snap_dma_stat_op_name() - Get operation name
+ * @op: operation
+ *
+ * Return: printable name of the operation
+ */
+const char *snap_dma_stat_op_name(enum snap_dma_stat_op op)
+{
+	if (op >= SNAP_DMA_STAT_OP_MAX)
+		return "unknown";
+	return snap_dma_stat_op_names[op];
+}
+
+/**
+ * snap_dma_stat_hist_merge() - Add one histogram to another
+ * @dst: histogram to add to
+ * @src: histogram to add
+ */
+void snap_dma_stat_hist_merge(struct snap_dma_stat_hist *dst,
+		const struct snap_dma_stat_hist *src)
+{
+	int i;
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	for (i = 0; i < SNAP_DMA_STAT_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+/**
+ * snap_dma_stat_hist_percentile() - Estimate histogram percentile
+ * @h:   histogram
+ * @pct: percentile, 0 to 100
+ *
+ * Buckets have power of two boundaries, so the result is the upper boundary
+ * of the bucket that contains the percentile. It is never larger than the
+ * maximum recorded value.
+ *
+ * Return: percentile estimation or 0 if the histogram is empty
+ */
+uint64_t snap_dma_stat_hist_percentile(const struct snap_dma_stat_hist *h,
+		unsigned int pct)
+{
+	uint64_t target, n = 0, val;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+
+	if (pct > 100)
+		pct = 100;
+	/* rank of the percentile value, rounded up */
+	target = (h->count * pct + 99) / 100;
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < SNAP_DMA_STAT_HIST_BUCKETS - 1; i++) {
+		n += h->buckets[i];
+		if (n >= target)
+			break;
+	}
+
+	if (i == 0)
+		return 0;
+	if (i == SNAP_DMA_STAT_HIST_BUCKETS - 1)
+		return h->max;
+
+	val = (1ULL << i) - 1;
+	return val < h->max ? val : h->max;
+}
+
+/**
+ * snap_dma_q_stats_merge() - Add one queue statistics to another
+ * @dst: statistics to add to
+ * @src: statistics to add
+ */
+void snap_dma_q_stats_merge(struct snap_dma_q_stats *dst,
+		const struct snap_dma_q_stats *src)
+{
+	struct snap_dma_stat_op_counters *d;
+	const struct snap_dma_stat_op_counters *s;
+	int i;
+
+	for (i = 0; i < SNAP_DMA_STAT_OP_MAX; i++) {
+		d = &dst->ops[i];
+		s = &src->ops[i];
+		d->posted += s->posted;
+		d->completed += s->completed;
+		d->bytes += s->bytes;
+		d->inline_posted += s->inline_posted;
+		d->eagain += s->eagain;
+		snap_dma_stat_hist_merge(&d->latency, &s->latency);
+	}
+	snap_dma_stat_hist_merge(&dst->db_batch, &src->db_batch);
+}
+
+void snap_dma_q_stats_post(struct snap_dma_q_stats_ctx *ctx, int op,
+		size_t len, bool is_inline, int n_bb, uint64_t ts)
+{
+	struct snap_dma_stat_op_counters *c = &ctx->stats.ops[op];
+	struct snap_dma_stat_inflight *e;
+
+	c->posted++;
+	c->bytes += len;
+	if (is_inline)
+		c->inline_posted++;
+
+	ctx->bb_posted += n_bb;
+	if (snap_unlikely(ctx->pi - ctx->ci > ctx->mask)) {
+		/* can not happen unless queue credits were changed behind
+		 * our back. Keep the accounting right, lose the sample.
+		 */
+		ctx->inflight[(ctx->pi - 1) & ctx->mask].n_bb += n_bb;
+		return;
+	}
+
+	e = &ctx->inflight[ctx->pi++ & ctx->mask];
+	e->ts = ts;
+	e->n_bb = n_bb;
+	e->op = op;
+}
+
+void snap_dma_q_stats_complete(struct snap_dma_q *q, uint64_t now)
+{
+	struct snap_dma_q_stats_ctx *ctx = q->stats;
+	struct snap_dma_stat_op_counters *c;
+	struct snap_dma_stat_inflight *e;
+	uint64_t outstanding, done;
+
+	if (snap_unlikely(q->tx_available > ctx->max_tx_available))
+		ctx->max_tx_available = q->tx_available;
+
+	outstanding = ctx->max_tx_available - q->tx_available;
+	/* ops posted before the stats were enabled complete first */
+	done = ctx->bb_posted > outstanding ? ctx->bb_posted - outstanding : 0;
+
+	while (ctx->ci != ctx->pi) {
+		e = &ctx->inflight[ctx->ci & ctx->mask];
+		if (ctx->bb_done + e->n_bb > done)
+			break;
+
+		ctx->bb_done += e->n_bb;
+		ctx->ci++;
+		c = &ctx->stats.ops[e->op];
+		c->completed++;
+		snap_dma_stat_hist_add(&c->latency, now > e->ts ? now - e->ts : 0);
+	}
+}
+
+void snap_dma_q_stats_db(struct snap_dma_q_stats_ctx *ctx, int batch)
+{
+	snap_dma_stat_hist_add(&ctx->stats.db_batch, batch);
+}
+
+static int snap_dma_q_tx_capacity(struct snap_dma_q *q)
+{
+	if (q->sw_qp.mode == SNAP_DMA_Q_MODE_SW)
+		return q->tx_qsize;
+	return q->sw_qp.dv_qp.hw_qp.sq.wqe_cnt;
+}
+
+/**
+ * snap_dma_q_stats_enable() - Enable or disable extended statistics
+ * @q:      dma queue
+ * @enable: true to start collecting statistics
+ *
+ * The function starts or stops collection of the per operation counters,
+ * latency and doorbell batch histograms (see &struct snap_dma_q_stats).
+ * Statistics are cleared when the collection is disabled.
+ *
+ * The function must be called from the thread that owns the queue. If
+ * it is called while there are outstanding operations, their latency
+ * is not recorded.
+ *
+ * Return: 0 or -errno on error
+ */
+int snap_dma_q_stats_enable(struct snap_dma_q *q, bool enable)
+{
+	struct snap_dma_q_stats_ctx *ctx;
+	int capacity;
+	uint32_t size;
+
+	if (!SNAP_DMA_STATS)
+		return -ENOTSUP;
+
+	if (!enable) {
+		snap_dma_q_stats_destroy(q);
+		return 0;
+	}
+
+	if (q->stats)
+		return 0;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return -ENOMEM;
+
+	/* every op takes at least one basic block */
+	capacity = snap_dma_q_tx_capacity(q);
+	if (q->tx_available > capacity)
+		capacity = q->tx_available;
+	for (size = 1; size < (uint32_t)capacity; size <<= 1)
+		;
+
+	ctx->inflight = calloc(size, sizeof(*ctx->inflight));
+	if (!ctx->inflight) {
+		free(ctx);
+		return -ENOMEM;
+	}
+
+	ctx->mask = size - 1;
+	ctx->max_tx_available = capacity;
+	ctx->db_pi = q->sw_qp.dv_qp.hw_qp.sq.pi;
+	q->stats = ctx;
+	return 0;
+}
+
+void snap_dma_q_stats_destroy(struct snap_dma_q *q)
+{
+	if (!q->stats)
+		return;
+
+	free(q->stats->inflight);
+	free(q->stats);
+	q->stats = NULL;
+}
+
+/**
+ * snap_dma_q_stats_get() - Get extended statistics
+ * @q: dma queue
+ *
+ * Return: queue statistics or NULL if the collection is not enabled
+ */
+const struct snap_dma_q_stats *snap_dma_q_stats_get(const struct snap_dma_q *q)
+{
+	return q->stats ? &q->stats->stats : NULL;
+}
+
+/**
+ * snap_dma_q_stats_reset() - Clear extended statistics
+ * @q: dma queue
+ *
+ * The function clears counters and histograms. Operations that are in
+ * flight are still tracked and will be counted as completed.
+ */
+void snap_dma_q_stats_reset(struct snap_dma_q *q)
+{
+	if (q->stats)
+		memset(&q->stats->stats, 0, sizeof(q->stats->stats));
+}
+
+/**
+ * snap_dma_worker_stats() - Aggregate statistics of the worker queues
+ * @wk:    dma worker
+ * @stats: where to store the aggregated statistics
+ *
+ * The function sums statistics of all worker queues that have the
+ * collection enabled.
+ *
+ * Return: number of queues that were aggregated
+ */
+int snap_dma_worker_stats(struct snap_dma_worker *wk, struct snap_dma_q_stats *stats)
+{
+	int i, n = 0;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < wk->max_queues; i++) {
+		if (!wk->queues[i].in_use || !wk->queues[i].q.stats)
+			continue;
+		snap_dma_q_stats_merge(stats, &wk->queues[i].q.stats->stats);
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Called on the queue creation: the collection is enabled either by the
+ * queue attributes or for all queues by the environment
+ */
+int snap_dma_q_stats_init(struct snap_dma_q *q, const struct snap_dma_q_create_attr *attr)
+{
+	if (!attr->stats_enable && !snap_env_getenv(SNAP_DMA_Q_STATS))
+		return 0;
+
+	return snap_dma_q_stats_enable(q, true);
+}
@@ -23,9 +23,125 @@ struct snap_dv_qp_db_counter {
 };
 
 struct snap_dv_qp_stat {
-	struct snap_dv_qp_db_counter rx;
+	/* tx is updated on the post path, keep it first. See snap_dv_qp */
 	struct snap_dv_qp_db_counter tx;
+	struct snap_dv_qp_db_counter rx;
+};
+
+/*
+ * Extended dma queue statistics: per operation counters, post to
+ * completion latency and doorbell batch size histograms.
+ *
+ * Collection is compiled in unless SNAP_DMA_STATS is defined to 0
+ * (configure --disable-dma-stats). Even when compiled in, it is disabled by
+ * default and costs a single well predicted branch per post. It can be
+ * enabled per queue with snap_dma_q_stats_enable(), with
+ * &struct snap_dma_q_create_attr.stats_enable or for all queues with the
+ * SNAP_DMA_Q_STATS=1 environment variable.
+ *
+ * Statistics are kept per queue and updated only by the thread that owns
+ * the queue, so no locking or atomics are needed. Readers on other threads
+ * may observe counters that are slightly out of sync with each other.
+ *
+ * Not available on DPA.
+ */
+#ifndef SNAP_DMA_STATS
+#if __DPA
+#define SNAP_DMA_STATS 0
+#else
+#define SNAP_DMA_STATS 1
+#endif
+#endif
+
+/* bucket N counts values in [2^(N-1), 2^N), bucket 0 counts zeros */
+#define SNAP_DMA_STAT_HIST_BUCKETS 40
+
+struct snap_dma_stat_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[SNAP_DMA_STAT_HIST_BUCKETS];
+};
+
+enum snap_dma_stat_op {
+	SNAP_DMA_STAT_OP_WRITE,
+	SNAP_DMA_STAT_OP_READ,
+	SNAP_DMA_STAT_OP_WRITE_SHORT,
+	SNAP_DMA_STAT_OP_READ_SHORT,
+	SNAP_DMA_STAT_OP_WRITEV,
+	SNAP_DMA_STAT_OP_READV,
+	SNAP_DMA_STAT_OP_WRITEC,
+	SNAP_DMA_STAT_OP_READC,
+	SNAP_DMA_STAT_OP_SEND_COMPLETION,
+	SNAP_DMA_STAT_OP_SEND,
+	SNAP_DMA_STAT_OP_FLUSH,
+	SNAP_DMA_STAT_OP_MAX
+};
+
+struct snap_dma_stat_op_counters {
+	uint64_t posted;
+	uint64_t completed;
+	uint64_t bytes;
+	/* data was copied into the wqe or scattered to the cqe */
+	uint64_t inline_posted;
+	/* post failed or was deferred because the send queue was full */
+	uint64_t eagain;
+	/* post to completion, in snap_dma_stat_ticks() units */
+	struct snap_dma_stat_hist latency;
 };
 
+struct snap_dma_q_stats {
+	struct snap_dma_stat_op_counters ops[SNAP_DMA_STAT_OP_MAX];
+	/* number of send wqe basic blocks covered by a single tx doorbell */
+	struct snap_dma_stat_hist db_batch;
+};
+
+static inline unsigned int snap_dma_stat_hist_bucket(uint64_t val)
+{
+	unsigned int b;
+
+	if (val == 0)
+		return 0;
+
+	b = 64 - __builtin_clzll(val);
+	return b < SNAP_DMA_STAT_HIST_BUCKETS ? b : SNAP_DMA_STAT_HIST_BUCKETS - 1;
+}
+
+static inline void snap_dma_stat_hist_add(struct snap_dma_stat_hist *h, uint64_t val)
+{
+	h->count++;
+	h->sum += val;
+	if (val > h->max)
+		h->max = val;
+	h->buckets[snap_dma_stat_hist_bucket(val)]++;
+}
+
+void snap_dma_stat_hist_merge(struct snap_dma_stat_hist *dst,
+		const struct snap_dma_stat_hist *src);
+uint64_t snap_dma_stat_hist_percentile(const struct snap_dma_stat_hist *h,
+		unsigned int pct);
+void snap_dma_q_stats_merge(struct snap_dma_q_stats *dst,
+		const struct snap_dma_q_stats *src);
+const char *snap_dma_stat_op_name(enum snap_dma_stat_op op);
+
+#if !__DPA
+/* cpu timestamp counter, used as the latency unit */
+static inline uint64_t snap_dma_stat_ticks(void)
+{
+#if defined(__x86_64__)
+	uint32_t lo, hi;
+
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+	uint64_t cnt;
+
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(cnt));
+	return cnt;
+#else
+	return 0;
+#endif
+}
 #endif
 
+#endif
@@ -0,0 +1,728 @@
+/*
+ * Copyright © 2022 NVIDIA CORPORATION & AFFILIATES. ALL RIGHTS RESERVED.
+ *
+ * This software product is a proprietary product of Nvidia Corporation and its affiliates
+ * (the "Company") and all right, title, and interest in and to the software
+ * product, including all associated intellectual property rights, are and
+ * shall remain exclusively with the Company.
+ *
+ * This software product is governed by the End User License Agreement
+ * provided with the software product.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "snap_dma_internal.h"
+#include "snap_env.h"
+#include "config.h"
+
+/*
+ * Software (loopback) implementation of the dma queue
+ *
+ * There is no hardware behind the queue. Data is moved with memcpy()
+ * between the local buffers and the simulated host memory regions created by
+ * snap_dma_sw_mem_create(). Local keys are ignored, remote keys together
+ * with the remote address select the host memory region.
+ *
+ * Data is copied when the operation is posted. The completion is reported
+ * by the progress_tx()/poll_tx() only after SNAP_DMA_Q_SW_DELAY progress
+ * calls so that the asynchronous behaviour of the real queue is preserved.
+ *
+ * Messages sent by the send_completion() and send() are stored in the 'fw'
+ * ring and can be fetched by snap_dma_sw_q_fw_recv(). Receive data is
+ * injected by the snap_dma_sw_q_rx_post().
+ */
+
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_DMA_Q_SW_DELAY, 0);
+
+struct snap_dma_sw_mem {
+	void *buf;
+	uint64_t addr;
+	size_t len;
+	uint32_t mkey;
+	bool own_buf;
+	LIST_ENTRY(snap_dma_sw_mem) entry;
+};
+
+struct snap_dma_sw_tx_op {
+	struct snap_dma_completion *comp;
+	uint64_t ready_tick;
+	int n_bb;
+	int status;
+};
+
+struct snap_dma_sw_msg {
+	uint32_t len;
+	uint32_t imm_data;
+};
+
+struct snap_dma_sw_ctx {
+	/* tx completions, wait for the ready_tick */
+	struct snap_dma_sw_tx_op *tx_ops;
+	uint32_t tx_mask;
+	uint32_t tx_pi;
+	uint32_t tx_ci;
+	uint64_t tick;
+	uint32_t delay;
+
+	/* data sent by the queue to the 'fw' side */
+	char *fw_buf;
+	struct snap_dma_sw_msg *fw_msgs;
+	uint32_t fw_mask;
+	uint32_t fw_pi;
+	uint32_t fw_ci;
+
+	/* data received from the 'fw' side */
+	char *rx_buf;
+	struct snap_dma_sw_msg *rx_msgs;
+	uint32_t rx_mask;
+	uint32_t rx_pi;
+	uint32_t rx_ci;
+
+	/* last used host memory region */
+	struct snap_dma_sw_mem *mem;
+	unsigned int mem_gen;
+
+	struct snap_dv_qp_stat stat;
+};
+
+static LIST_HEAD(, snap_dma_sw_mem) sw_mem_list = LIST_HEAD_INITIALIZER(sw_mem_list);
+static pthread_mutex_t sw_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+/* bumped each time a region is destroyed, invalidates queue caches */
+static unsigned int sw_mem_gen;
+
+/**
+ * snap_dma_sw_mem_create() - Create simulated host memory region
+ * @buf:   memory that backs the region. If NULL, zeroed memory of @len bytes
+ *         is allocated and owned by the region
+ * @len:   region length
+ * @addr:  host address of the first byte of the region
+ * @mkey:  host memory key of the region
+ *
+ * The region is used by the dma queues created in the SNAP_DMA_Q_MODE_SW mode.
+ * A remote address @raddr with the remote key @mkey is translated into the
+ * local address @buf + (@raddr - @addr). Regions with the same @mkey must not
+ * overlap.
+ *
+ * Return: memory region or NULL on error
+ */
+struct snap_dma_sw_mem *snap_dma_sw_mem_create(void *buf, size_t len,
+		uint64_t addr, uint32_t mkey)
+{
+	struct snap_dma_sw_mem *mem;
+
+	if (!len)
+		return NULL;
+
+	mem = calloc(1, sizeof(*mem));
+	if (!mem)
+		return NULL;
+
+	if (!buf) {
+		if (posix_memalign(&mem->buf, SNAP_DMA_BUF_ALIGN, len))
+			goto free_mem;
+		memset(mem->buf, 0, len);
+		mem->own_buf = true;
+	} else
+		mem->buf = buf;
+
+	mem->len = len;
+	mem->addr = addr;
+	mem->mkey = mkey;
+
+	pthread_mutex_lock(&sw_mem_lock);
+	LIST_INSERT_HEAD(&sw_mem_list, mem, entry);
+	pthread_mutex_unlock(&sw_mem_lock);
+	return mem;
+
+free_mem:
+	free(mem);
+	return NULL;
+}
+
+/**
+ * snap_dma_sw_mem_destroy() - Destroy simulated host memory region
+ * @mem: memory region
+ *
+ * Outstanding operations that target the region must be completed before
+ * the region is destroyed.
+ */
+void snap_dma_sw_mem_destroy(struct snap_dma_sw_mem *mem)
+{
+	pthread_mutex_lock(&sw_mem_lock);
+	LIST_REMOVE(mem, entry);
+	__atomic_add_fetch(&sw_mem_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&sw_mem_lock);
+
+	if (mem->own_buf)
+		free(mem->buf);
+	free(mem);
+}
+
+/**
+ * snap_dma_sw_mem_addr() - Get local address of the host memory
+ * @mem:  memory region
+ * @addr: host address
+ *
+ * Return: pointer to the local copy of the host memory at @addr or NULL if
+ * @addr is not in the region
+ */
+void *snap_dma_sw_mem_addr(struct snap_dma_sw_mem *mem, uint64_t addr)
+{
+	if (addr < mem->addr || addr - mem->addr >= mem->len)
+		return NULL;
+
+	return (char *)mem->buf + (addr - mem->addr);
+}
+
+static inline bool sw_mem_contains(const struct snap_dma_sw_mem *mem,
+		uint64_t addr, size_t len, uint32_t mkey)
+{
+	return mem->mkey == mkey && addr >= mem->addr &&
+	       addr - mem->addr <= mem->len && len <= mem->len - (addr - mem->addr);
+}
+
+static struct snap_dma_sw_mem *sw_mem_lookup(uint64_t addr, size_t len, uint32_t mkey)
+{
+	struct snap_dma_sw_mem *mem;
+
+	LIST_FOREACH(mem, &sw_mem_list, entry) {
+		if (sw_mem_contains(mem, addr, len, mkey))
+			return mem;
+	}
+	return NULL;
+}
+
+static void *sw_dma_q_host_addr(struct snap_dma_q *q, uint64_t addr, size_t len,
+		uint32_t mkey)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+	unsigned int gen = __atomic_load_n(&sw_mem_gen, __ATOMIC_ACQUIRE);
+
+	if (snap_likely(ctx->mem && ctx->mem_gen == gen &&
+			sw_mem_contains(ctx->mem, addr, len, mkey)))
+		return (char *)ctx->mem->buf + (addr - ctx->mem->addr);
+
+	pthread_mutex_lock(&sw_mem_lock);
+	ctx->mem = sw_mem_lookup(addr, len, mkey);
+	ctx->mem_gen = sw_mem_gen;
+	pthread_mutex_unlock(&sw_mem_lock);
+
+	if (snap_unlikely(!ctx->mem)) {
+		snap_error("dma_q:%p no host memory at 0x%lx len %lu mkey 0x%x\n",
+			   q, addr, len, mkey);
+		return NULL;
+	}
+
+	return (char *)ctx->mem->buf + (addr - ctx->mem->addr);
+}
+
+static inline void sw_dma_q_post(struct snap_dma_q *q,
+		struct snap_dma_completion *comp, int status)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+	struct snap_dma_sw_tx_op *op;
+
+	op = &ctx->tx_ops[ctx->tx_pi++ & ctx->tx_mask];
+	op->comp = comp;
+	op->n_bb = 1;
+	op->status = status;
+	op->ready_tick = ctx->tick + ctx->delay;
+	ctx->stat.tx.total_dbs++;
+#if SNAP_DMA_STATS
+	/* every operation is 'rung' immediately */
+	if (snap_unlikely(q->stats))
+		snap_dma_q_stats_db(q->stats, 1);
+#endif
+}
+
+static int sw_dma_q_copy(struct snap_dma_q *q, void *lbuf, size_t len,
+		uint64_t raddr, uint32_t rkey, bool is_read)
+{
+	void *hbuf;
+
+	if (!len)
+		return IBV_WC_SUCCESS;
+
+	hbuf = sw_dma_q_host_addr(q, raddr, len, rkey);
+	if (snap_unlikely(!hbuf))
+		return IBV_WC_REM_ACCESS_ERR;
+
+	if (is_read)
+		memcpy(lbuf, hbuf, len);
+	else
+		memcpy(hbuf, lbuf, len);
+	return IBV_WC_SUCCESS;
+}
+
+static int sw_dma_q_write(struct snap_dma_q *q, void *src_buf, size_t len,
+			  uint32_t lkey, uint64_t dstaddr, uint32_t rmkey,
+			  struct snap_dma_completion *comp)
+{
+	sw_dma_q_post(q, comp, sw_dma_q_copy(q, src_buf, len, dstaddr, rmkey, false));
+	return 0;
+}
+
+static int sw_dma_q_read(struct snap_dma_q *q, void *dst_buf, size_t len,
+			 uint32_t lkey, uint64_t srcaddr, uint32_t rmkey,
+			 struct snap_dma_completion *comp)
+{
+	sw_dma_q_post(q, comp, sw_dma_q_copy(q, dst_buf, len, srcaddr, rmkey, true));
+	return 0;
+}
+
+static int sw_dma_q_read_short(struct snap_dma_q *q, void *dst_buf,
+			       size_t len, uint64_t srcaddr, uint32_t rmkey,
+			       struct snap_dma_completion *comp)
+{
+	return sw_dma_q_read(q, dst_buf, len, 0, srcaddr, rmkey, comp);
+}
+
+static int sw_dma_q_write_short(struct snap_dma_q *q, void *src_buf, size_t len,
+				uint64_t dstaddr, uint32_t rmkey, int *n_bb)
+{
+	if (snap_unlikely(!qp_can_tx(q, 1)))
+		return -EAGAIN;
+
+	*n_bb = 1;
+	sw_dma_q_post(q, NULL, sw_dma_q_copy(q, src_buf, len, dstaddr, rmkey, false));
+	return 0;
+}
+
+static int sw_dma_q_xfer_v2v(struct snap_dma_q *q,
+			     struct snap_dma_q_io_attr *io_attr,
+			     struct snap_dma_completion *comp, int *n_bb,
+			     bool is_read)
+{
+	int i, j, status;
+	size_t loff, roff, len;
+	char *hbuf;
+
+	if (snap_unlikely(!qp_can_tx(q, 1)))
+		return -EAGAIN;
+
+	status = IBV_WC_SUCCESS;
+	for (i = 0, j = 0, loff = 0, roff = 0; i < io_attr->riov_cnt; i++, roff = 0) {
+		hbuf = sw_dma_q_host_addr(q, (uint64_t)io_attr->riov[i].iov_base,
+					  io_attr->riov[i].iov_len, io_attr->rkey[i]);
+		if (snap_unlikely(!hbuf)) {
+			status = IBV_WC_REM_ACCESS_ERR;
+			break;
+		}
+
+		while (roff < io_attr->riov[i].iov_len && j < io_attr->liov_cnt) {
+			len = snap_min(io_attr->riov[i].iov_len - roff,
+				       io_attr->liov[j].iov_len - loff);
+			if (is_read)
+				memcpy((char *)io_attr->liov[j].iov_base + loff, hbuf + roff, len);
+			else
+				memcpy(hbuf + roff, (char *)io_attr->liov[j].iov_base + loff, len);
+
+			roff += len;
+			loff += len;
+			if (loff == io_attr->liov[j].iov_len) {
+				loff = 0;
+				j++;
+			}
+		}
+
+		if (snap_unlikely(roff < io_attr->riov[i].iov_len)) {
+			status = IBV_WC_LOC_LEN_ERR;
+			break;
+		}
+	}
+
+	*n_bb = 1;
+	sw_dma_q_post(q, comp, status);
+	return 0;
+}
+
+static int sw_dma_q_writev2v(struct snap_dma_q *q,
+			     struct snap_dma_q_io_attr *io_attr,
+			     struct snap_dma_completion *comp, int *n_bb)
+{
+	return sw_dma_q_xfer_v2v(q, io_attr, comp, n_bb, false);
+}
+
+static int sw_dma_q_readv2v(struct snap_dma_q *q,
+			    struct snap_dma_q_io_attr *io_attr,
+			    struct snap_dma_completion *comp, int *n_bb)
+{
+	return sw_dma_q_xfer_v2v(q, io_attr, comp, n_bb, true);
+}
+
+static int sw_dma_q_crypto(struct snap_dma_q *q,
+			   struct snap_dma_q_io_attr *io_attr,
+			   struct snap_dma_completion *comp, int *n_bb)
+{
+	return -ENOTSUP;
+}
+
+static inline int sw_dma_q_fw_post(struct snap_dma_q *q, void *in_buf,
+		size_t in_len, void *buf, size_t len, int *n_bb)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+	struct snap_dma_sw_msg *msg;
+	char *data;
+
+	if (snap_unlikely(in_len + len > q->tx_elem_size))
+		return -EINVAL;
+
+	if (snap_unlikely(!qp_can_tx(q, 1)))
+		return -EAGAIN;
+
+	/* nobody consumes fw messages, keep only the most recent ones */
+	if (snap_unlikely(ctx->fw_pi - ctx->fw_ci > ctx->fw_mask))
+		ctx->fw_ci++;
+
+	msg = &ctx->fw_msgs[ctx->fw_pi & ctx->fw_mask];
+	data = ctx->fw_buf + (ctx->fw_pi & ctx->fw_mask) * q->tx_elem_size;
+	memcpy(data, in_buf, in_len);
+	if (len)
+		memcpy(data + in_len, buf, len);
+	msg->len = in_len + len;
+	msg->imm_data = 0;
+	ctx->fw_pi++;
+
+	*n_bb = 1;
+	sw_dma_q_post(q, NULL, IBV_WC_SUCCESS);
+	return 0;
+}
+
+static int sw_dma_q_send_completion(struct snap_dma_q *q, void *src_buf,
+				    size_t len, int *n_bb)
+{
+	return sw_dma_q_fw_post(q, src_buf, len, NULL, 0, n_bb);
+}
+
+static int sw_dma_q_send(struct snap_dma_q *q, void *in_buf, size_t in_len,
+			 uint64_t addr, int len, uint32_t key, int *n_bb)
+{
+	return sw_dma_q_fw_post(q, in_buf, in_len, (void *)addr, len, n_bb);
+}
+
+static inline struct snap_dma_sw_tx_op *sw_dma_q_get_tx_op(struct snap_dma_q *q)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+	struct snap_dma_sw_tx_op *op;
+
+	if (ctx->tx_ci == ctx->tx_pi)
+		return NULL;
+
+	op = &ctx->tx_ops[ctx->tx_ci & ctx->tx_mask];
+	if ((int64_t)(op->ready_tick - ctx->tick) >= 0)
+		return NULL;
+
+	ctx->tx_ci++;
+	q->tx_available += op->n_bb;
+	return op;
+}
+
+static int sw_dma_q_progress_tx(struct snap_dma_q *q)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+	struct snap_dma_sw_tx_op *op;
+	int n = 0;
+
+	ctx->tick++;
+	while (n < SNAP_DMA_MAX_TX_COMPLETIONS) {
+		op = sw_dma_q_get_tx_op(q);
+		if (!op)
+			break;
+		n++;
+		if (op->comp && --op->comp->count == 0)
+			op->comp->func(op->comp, op->status);
+	}
+
+	ctx->stat.tx.total_completed += n;
+	return n;
+}
+
+static int sw_dma_q_poll_tx(struct snap_dma_q *q, struct snap_dma_completion **comp,
+			    int max_completions)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+	struct snap_dma_sw_tx_op *op;
+	int n = 0;
+
+	ctx->tick++;
+	while (n < max_completions) {
+		op = sw_dma_q_get_tx_op(q);
+		if (!op)
+			break;
+		ctx->stat.tx.total_completed++;
+		if (op->comp && --op->comp->count == 0)
+			comp[n++] = op->comp;
+	}
+
+	return n;
+}
+
+static inline void sw_dma_q_get_rx_comp(struct snap_dma_q *q,
+		struct snap_rx_completion *rx_comp)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+	uint32_t ri = ctx->rx_ci++ & ctx->rx_mask;
+
+	rx_comp->data = ctx->rx_buf + ri * q->rx_elem_size;
+	rx_comp->byte_len = ctx->rx_msgs[ri].len;
+	rx_comp->imm_data = ctx->rx_msgs[ri].imm_data;
+}
+
+static int sw_dma_q_progress_rx(struct snap_dma_q *q)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+	struct snap_rx_completion rx_comp[SNAP_DMA_MAX_RX_COMPLETIONS];
+	uint32_t rx_ci = ctx->rx_ci;
+	int n, i;
+
+	n = 0;
+	while (ctx->rx_ci != ctx->rx_pi && n < SNAP_DMA_MAX_RX_COMPLETIONS)
+		sw_dma_q_get_rx_comp(q, &rx_comp[n++]);
+
+	/* slots are not reused until the callbacks are done */
+	ctx->rx_ci = rx_ci;
+	for (i = 0; i < n; i++)
+		q->rx_cb(q, rx_comp[i].data, rx_comp[i].byte_len, rx_comp[i].imm_data);
+
+	ctx->rx_ci += n;
+	ctx->stat.rx.total_completed += n;
+	return n;
+}
+
+static int sw_dma_q_poll_rx(struct snap_dma_q *q,
+			    struct snap_rx_completion *rx_completions,
+			    int max_completions)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+	int n = 0;
+
+	while (ctx->rx_ci != ctx->rx_pi && n < max_completions)
+		sw_dma_q_get_rx_comp(q, &rx_completions[n++]);
+
+	ctx->stat.rx.total_completed += n;
+	return n;
+}
+
+static int sw_dma_q_arm(struct snap_dma_q *q)
+{
+	return 0;
+}
+
+static int sw_dma_q_flush(struct snap_dma_q *q)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+	int n = 0;
+
+	while (ctx->tx_ci != ctx->tx_pi)
+		n += sw_dma_q_progress_tx(q);
+
+	return n;
+}
+
+static int sw_dma_q_flush_nowait(struct snap_dma_q *q,
+				 struct snap_dma_completion *comp, int *n_bb)
+{
+	if (snap_unlikely(!qp_can_tx(q, 1)))
+		return -EAGAIN;
+
+	*n_bb = 1;
+	sw_dma_q_post(q, comp, IBV_WC_SUCCESS);
+	return 0;
+}
+
+static bool sw_dma_q_empty(struct snap_dma_q *q)
+{
+	return q->sw_ctx->tx_ci == q->sw_ctx->tx_pi;
+}
+
+static const struct snap_dv_qp_stat *sw_dma_q_stat(const struct snap_dma_q *q)
+{
+	return &q->sw_ctx->stat;
+}
+
+const struct snap_dma_q_ops sw_ops = {
+	.mode            = SNAP_DMA_Q_MODE_SW,
+	.write           = sw_dma_q_write,
+	.writev2v        = sw_dma_q_writev2v,
+	.writec          = sw_dma_q_crypto,
+	.write_short     = sw_dma_q_write_short,
+	.read            = sw_dma_q_read,
+	.readv2v         = sw_dma_q_readv2v,
+	.readc           = sw_dma_q_crypto,
+	.read_short      = sw_dma_q_read_short,
+	.send_completion = sw_dma_q_send_completion,
+	.send            = sw_dma_q_send,
+	.progress_tx     = sw_dma_q_progress_tx,
+	.progress_rx     = sw_dma_q_progress_rx,
+	.poll_rx         = sw_dma_q_poll_rx,
+	.poll_tx         = sw_dma_q_poll_tx,
+	.arm             = sw_dma_q_arm,
+	.flush           = sw_dma_q_flush,
+	.flush_nowait    = sw_dma_q_flush_nowait,
+	.empty           = sw_dma_q_empty,
+	.stat            = sw_dma_q_stat,
+};
+
+/**
+ * snap_dma_sw_q_init() - Allocate software dma queue resources
+ * @q:    dma queue
+ * @attr: dma queue creation attributes
+ *
+ * Return: 0 on success or -errno
+ */
+int snap_dma_sw_q_init(struct snap_dma_q *q, const struct snap_dma_q_create_attr *attr)
+{
+	struct snap_dma_sw_ctx *ctx;
+	uint32_t tx_cnt, rx_cnt;
+	long long delay;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return -ENOMEM;
+
+	/* ring sizes must be a power of two, free running indexes are used */
+	tx_cnt = SNAP_ROUNDUP_POW2(snap_max(attr->tx_qsize, 1));
+	rx_cnt = SNAP_ROUNDUP_POW2(snap_max(2 * attr->rx_qsize, 1));
+
+	ctx->tx_mask = tx_cnt - 1;
+	ctx->tx_ops = calloc(tx_cnt, sizeof(*ctx->tx_ops));
+	if (!ctx->tx_ops)
+		goto free_ctx;
+
+	ctx->fw_mask = tx_cnt - 1;
+	ctx->fw_msgs = calloc(tx_cnt, sizeof(*ctx->fw_msgs));
+	if (!ctx->fw_msgs)
+		goto free_tx_ops;
+	ctx->fw_buf = calloc(tx_cnt, snap_max(attr->tx_elem_size, 1));
+	if (!ctx->fw_buf)
+		goto free_fw_msgs;
+
+	ctx->rx_mask = rx_cnt - 1;
+	ctx->rx_msgs = calloc(rx_cnt, sizeof(*ctx->rx_msgs));
+	if (!ctx->rx_msgs)
+		goto free_fw_buf;
+	ctx->rx_buf = calloc(rx_cnt, snap_max(attr->rx_elem_size, 1));
+	if (!ctx->rx_buf)
+		goto free_rx_msgs;
+
+	delay = snap_env_getenv(SNAP_DMA_Q_SW_DELAY);
+	ctx->delay = delay > 0 ? delay : 0;
+
+	q->sw_ctx = ctx;
+	q->sw_qp.mode = SNAP_DMA_Q_MODE_SW;
+	q->tx_available = attr->tx_qsize;
+	q->rx_qsize = attr->rx_qsize;
+	return 0;
+
+free_rx_msgs:
+	free(ctx->rx_msgs);
+free_fw_buf:
+	free(ctx->fw_buf);
+free_fw_msgs:
+	free(ctx->fw_msgs);
+free_tx_ops:
+	free(ctx->tx_ops);
+free_ctx:
+	free(ctx);
+	return -ENOMEM;
+}
+
+/**
+ * snap_dma_sw_q_destroy() - Free software dma queue resources
+ * @q: dma queue
+ */
+void snap_dma_sw_q_destroy(struct snap_dma_q *q)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+
+	free(ctx->rx_buf);
+	free(ctx->rx_msgs);
+	free(ctx->fw_buf);
+	free(ctx->fw_msgs);
+	free(ctx->tx_ops);
+	free(ctx);
+	q->sw_ctx = NULL;
+}
+
+/**
+ * snap_dma_sw_q_set_delay() - Set completion delay
+ * @q:     dma queue created in the SNAP_DMA_Q_MODE_SW mode
+ * @delay: number of tx progress (or poll) calls an operation stays
+ *         outstanding before it is completed
+ *
+ * Overrides the SNAP_DMA_Q_SW_DELAY value for the queue. The new delay applies
+ * to the operations posted after the call.
+ */
+void snap_dma_sw_q_set_delay(struct snap_dma_q *q, uint32_t delay)
+{
+	q->sw_ctx->delay = delay;
+}
+
+/**
+ * snap_dma_sw_q_rx_post() - Simulate data arrival
+ * @q:        dma queue created in the SNAP_DMA_Q_MODE_SW mode
+ * @data:     data to receive
+ * @len:      data length, must be no greater than the queue rx_elem_size
+ * @imm_data: immediate data
+ *
+ * The data will be passed to the queue rx callback by the
+ * snap_dma_q_progress() or returned by the snap_dma_q_poll_rx().
+ *
+ * Return: 0 on success, -EAGAIN if the receive queue is full or -EINVAL
+ */
+int snap_dma_sw_q_rx_post(struct snap_dma_q *q, const void *data, size_t len,
+		uint32_t imm_data)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+	uint32_t ri;
+
+	if (len > q->rx_elem_size)
+		return -EINVAL;
+
+	if (ctx->rx_pi - ctx->rx_ci > ctx->rx_mask)
+		return -EAGAIN;
+
+	ri = ctx->rx_pi & ctx->rx_mask;
+	memcpy(ctx->rx_buf + ri * q->rx_elem_size, data, len);
+	ctx->rx_msgs[ri].len = len;
+	ctx->rx_msgs[ri].imm_data = imm_data;
+	ctx->rx_pi++;
+	ctx->stat.rx.total_dbs++;
+	return 0;
+}
+
+/**
+ * snap_dma_sw_q_fw_recv() - Get data sent by the queue
+ * @q:   dma queue created in the SNAP_DMA_Q_MODE_SW mode
+ * @buf: where to copy the data
+ * @len: @buf size
+ *
+ * The function returns the oldest message that was sent by the
+ * snap_dma_q_send_completion() or by the snap_dma_q_send(). Only the last
+ * tx_qsize messages are kept.
+ *
+ * Return: message length, 0 if there are no messages or -EINVAL if @buf is
+ * too small
+ */
+int snap_dma_sw_q_fw_recv(struct snap_dma_q *q, void *buf, size_t len)
+{
+	struct snap_dma_sw_ctx *ctx = q->sw_ctx;
+	struct snap_dma_sw_msg *msg;
+	uint32_t fi;
+
+	if (ctx->fw_ci == ctx->fw_pi)
+		return 0;
+
+	fi = ctx->fw_ci & ctx->fw_mask;
+	msg = &ctx->fw_msgs[fi];
+	if (len < msg->len)
+		return -EINVAL;
+
+	memcpy(buf, ctx->fw_buf + fi * q->tx_elem_size, msg->len);
+	ctx->fw_ci++;
+	return msg->len;
+}
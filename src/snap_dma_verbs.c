@@ -127,9 +127,10 @@ static inline int verbs_dma_q_writec(struct snap_dma_q *q,
 	return -ENOTSUP;
 }
 
-static inline int verbs_dma_q_writev2v(struct snap_dma_q *q,
+static inline int verbs_dma_q_xfer_v2v(struct snap_dma_q *q,
 				struct snap_dma_q_io_attr *io_attr,
-				struct snap_dma_completion *comp, int *n_bb)
+				struct snap_dma_completion *comp, int *n_bb,
+				enum ibv_wr_opcode op)
 {
 	int wr_cnt;
 	int num_sge[SNAP_DMA_Q_MAX_WR_CNT];
@@ -151,11 +152,25 @@ static inline int verbs_dma_q_writev2v(struct snap_dma_q *q,
 		return errno;
 
 	verbs_dma_q_prepare_wr(wr, wr_cnt, l_sgl, num_sge, r_sgl,
-			IBV_WR_RDMA_WRITE, 0, &iov_ctx->comp);
+			op, 0, &iov_ctx->comp);
 
 	return do_verbs_dma_xfer(q, wr);
 }
 
+static inline int verbs_dma_q_writev2v(struct snap_dma_q *q,
+				struct snap_dma_q_io_attr *io_attr,
+				struct snap_dma_completion *comp, int *n_bb)
+{
+	return verbs_dma_q_xfer_v2v(q, io_attr, comp, n_bb, IBV_WR_RDMA_WRITE);
+}
+
+static inline int verbs_dma_q_readv2v(struct snap_dma_q *q,
+				struct snap_dma_q_io_attr *io_attr,
+				struct snap_dma_completion *comp, int *n_bb)
+{
+	return verbs_dma_q_xfer_v2v(q, io_attr, comp, n_bb, IBV_WR_RDMA_READ);
+}
+
 static inline int verbs_dma_q_write_short(struct snap_dma_q *q, void *src_buf,
 					  size_t len, uint64_t dstaddr,
 					  uint32_t rmkey, int *n_bb)
@@ -208,6 +223,36 @@ static inline int verbs_dma_q_read(struct snap_dma_q *q, void *dst_buf, size_t l
 	return do_verbs_dma_xfer(q, wr);
 }
 
+/* whole batch is posted as a chain, single ibv_post_send() rings the doorbell */
+static int verbs_dma_q_post_batch(struct snap_dma_q *q, struct snap_dma_op *ops,
+				  int n, struct snap_dma_completion *comp)
+{
+	struct ibv_send_wr wr[n];
+	struct ibv_sge sge[n];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		sge[i].addr = (uint64_t)ops[i].buf;
+		sge[i].length = ops[i].len;
+		sge[i].lkey = ops[i].lkey;
+
+		wr[i].opcode = ops[i].opcode == SNAP_DMA_OP_WRITE ?
+			IBV_WR_RDMA_WRITE : IBV_WR_RDMA_READ;
+		/* every wr is signaled, tx credits are returned per completion */
+		wr[i].send_flags = IBV_SEND_SIGNALED;
+		wr[i].num_sge = 1;
+		wr[i].sg_list = &sge[i];
+		wr[i].wr.rdma.rkey = ops[i].rkey;
+		wr[i].wr.rdma.remote_addr = ops[i].raddr;
+		wr[i].wr_id = 0;
+		wr[i].next = &wr[i + 1];
+	}
+	wr[n - 1].wr_id = (uint64_t)comp;
+	wr[n - 1].next = NULL;
+
+	return do_verbs_dma_xfer(q, wr);
+}
+
 static int verbs_dma_q_readc(struct snap_dma_q *q,
 				struct snap_dma_q_io_attr *io_attr,
 				struct snap_dma_completion *comp, int *n_bb)
@@ -541,6 +586,7 @@ const struct snap_dma_q_ops verb_ops = {
 	.writec           = verbs_dma_q_writec,
 	.write_short     = verbs_dma_q_write_short,
 	.read            = verbs_dma_q_read,
+	.readv2v          = verbs_dma_q_readv2v,
 	.readc            = verbs_dma_q_readc,
 	.read_short      = verbs_dma_q_read_short,
 	.send_completion = verbs_dma_q_send_completion,
@@ -552,5 +598,6 @@ const struct snap_dma_q_ops verb_ops = {
 	.arm = verbs_dma_q_arm,
 	.flush = verbs_dma_q_flush,
 	.flush_nowait = verbs_dma_q_flush_nowait,
-	.empty = verbs_dma_q_empty
+	.empty = verbs_dma_q_empty,
+	.post_batch = verbs_dma_q_post_batch
 };
@@ -82,6 +82,14 @@
 
 #define SNAP_PACKED __attribute__((packed))
 
+#define SNAP_CACHE_LINE_SIZE 64
+#define SNAP_CACHE_ALIGNED __attribute__((aligned(SNAP_CACHE_LINE_SIZE)))
+
+/* true if both struct fields are in the same cacheline */
+#define SNAP_SAME_CACHE_LINE(_type, _f1, _f2) \
+	(offsetof(_type, _f1) / SNAP_CACHE_LINE_SIZE == \
+	 (offsetof(_type, _f2) + sizeof(((_type *)0)->_f2) - 1) / SNAP_CACHE_LINE_SIZE)
+
 #ifdef SNAP_DEBUG
 #define assert_debug(_expr) assert(_expr)
 #else
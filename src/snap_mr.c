@@ -11,7 +11,9 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
+#include <pthread.h>
 #include <infiniband/mlx5dv.h>
 
 #include "config.h"
@@ -55,7 +57,7 @@ struct ibv_mr *snap_reg_mr(struct ibv_pd *pd, void *addr, size_t length)
 	mr_access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
 						IBV_ACCESS_REMOTE_WRITE;
 
-	if (!snap_query_relaxed_ordering_caps(pd->context, &ro_caps)) {
+	if (!snap_get_relaxed_ordering_caps(pd->context, &ro_caps)) {
 		if (ro_caps.relaxed_ordering_write &&
 					ro_caps.relaxed_ordering_read)
 			mr_access |= IBV_ACCESS_RELAXED_ORDERING;
@@ -464,3 +466,59 @@ int snap_query_relaxed_ordering_caps(struct ibv_context *context,
 		out, capability.cmd_hca_cap.relaxed_ordering_read_umr);
 	return 0;
 }
+
+struct snap_ro_caps_entry {
+	char dev_name[IBV_SYSFS_NAME_MAX];
+	struct snap_relaxed_ordering_caps caps;
+	LIST_ENTRY(snap_ro_caps_entry) entry;
+};
+
+static LIST_HEAD(, snap_ro_caps_entry) snap_ro_caps_list = LIST_HEAD_INITIALIZER(snap_ro_caps_list);
+static pthread_mutex_t snap_ro_caps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * snap_get_relaxed_ordering_caps() - Get Relaxed-Ordering capabilities
+ * @context: ibv_context to query.
+ * @caps: relaxed-ordering capabilities (output)
+ *
+ * Same as snap_query_relaxed_ordering_caps() but the device is queried
+ * only once. Capabilities are cached per device name, so that they survive
+ * ibv_context reopen, and are kept until the process exits.
+ *
+ * Return:
+ * 0 or -errno on error
+ */
+int snap_get_relaxed_ordering_caps(struct ibv_context *context,
+				   struct snap_relaxed_ordering_caps *caps)
+{
+	struct snap_ro_caps_entry *e;
+	const char *dev_name;
+	int ret;
+
+	dev_name = ibv_get_device_name(context->device);
+
+	pthread_mutex_lock(&snap_ro_caps_lock);
+	LIST_FOREACH(e, &snap_ro_caps_list, entry) {
+		if (!strcmp(e->dev_name, dev_name)) {
+			*caps = e->caps;
+			pthread_mutex_unlock(&snap_ro_caps_lock);
+			return 0;
+		}
+	}
+
+	ret = snap_query_relaxed_ordering_caps(context, caps);
+	if (ret)
+		goto out;
+
+	e = calloc(1, sizeof(*e));
+	/* not fatal, caps will be queried again next time */
+	if (!e)
+		goto out;
+
+	snprintf(e->dev_name, sizeof(e->dev_name), "%s", dev_name);
+	e->caps = *caps;
+	LIST_INSERT_HEAD(&snap_ro_caps_list, e, entry);
+out:
+	pthread_mutex_unlock(&snap_ro_caps_lock);
+	return ret;
+}
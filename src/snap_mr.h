@@ -112,5 +112,7 @@ struct snap_relaxed_ordering_caps {
 
 int snap_query_relaxed_ordering_caps(struct ibv_context *context,
 				     struct snap_relaxed_ordering_caps *caps);
+int snap_get_relaxed_ordering_caps(struct ibv_context *context,
+				   struct snap_relaxed_ordering_caps *caps);
 
 #endif
@@ -0,0 +1,454 @@
+/*
+ * Copyright © 2022 NVIDIA CORPORATION & AFFILIATES. ALL RIGHTS RESERVED.
+ *
+ * This software product is a proprietary product of Nvidia Corporation and its affiliates
+ * (the "Company") and all right, title, and interest in and to the software
+ * product, including all associated intellectual property rights, are and
+ * shall remain exclusively with the Company.
+ *
+ * This software product is governed by the End User License Agreement
+ * provided with the software product.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "snap_mr.h"
+#include "snap_mr_cache.h"
+#include "snap_env.h"
+
+/*
+ * Memory registration cache
+ *
+ * Registrations are kept in an AVL tree keyed by the start address. Ranges
+ * in the tree never overlap: when a new range overlaps existing ones, the
+ * union is registered and the overlapped registrations leave the tree. Such
+ * registrations are released as soon as their last user puts them back.
+ *
+ * Registrations that are not used by anyone are kept on the LRU list and
+ * released, oldest first, when the registered size exceeds the budget.
+ *
+ * The cache does not track the lifetime of the memory. Memory must be
+ * invalidated with snap_mr_cache_invalidate() before it is freed,
+ * otherwise the cache will keep stale pages pinned and will return their
+ * registration for the new memory at the same address.
+ */
+
+SNAP_ENV_REG_ENV_VARIABLE(SNAP_MR_CACHE_MAX_MB, 1024);
+
+static inline int mrc_height(struct snap_mr_cache_entry *e)
+{
+	return e ? e->height : 0;
+}
+
+static inline void mrc_update_height(struct snap_mr_cache_entry *e)
+{
+	int l = mrc_height(e->left);
+	int r = mrc_height(e->right);
+
+	e->height = 1 + (l > r ? l : r);
+}
+
+static struct snap_mr_cache_entry *mrc_rotate_right(struct snap_mr_cache_entry *y)
+{
+	struct snap_mr_cache_entry *x = y->left;
+
+	y->left = x->right;
+	x->right = y;
+	mrc_update_height(y);
+	mrc_update_height(x);
+	return x;
+}
+
+static struct snap_mr_cache_entry *mrc_rotate_left(struct snap_mr_cache_entry *x)
+{
+	struct snap_mr_cache_entry *y = x->right;
+
+	x->right = y->left;
+	y->left = x;
+	mrc_update_height(x);
+	mrc_update_height(y);
+	return y;
+}
+
+static struct snap_mr_cache_entry *mrc_balance(struct snap_mr_cache_entry *n)
+{
+	int bf;
+
+	mrc_update_height(n);
+	bf = mrc_height(n->left) - mrc_height(n->right);
+	if (bf > 1) {
+		if (mrc_height(n->left->left) < mrc_height(n->left->right))
+			n->left = mrc_rotate_left(n->left);
+		return mrc_rotate_right(n);
+	}
+	if (bf < -1) {
+		if (mrc_height(n->right->right) < mrc_height(n->right->left))
+			n->right = mrc_rotate_right(n->right);
+		return mrc_rotate_left(n);
+	}
+	return n;
+}
+
+static struct snap_mr_cache_entry *mrc_insert(struct snap_mr_cache_entry *root,
+		struct snap_mr_cache_entry *e)
+{
+	if (!root) {
+		e->left = e->right = NULL;
+		e->height = 1;
+		return e;
+	}
+
+	if (e->start < root->start)
+		root->left = mrc_insert(root->left, e);
+	else
+		root->right = mrc_insert(root->right, e);
+	return mrc_balance(root);
+}
+
+static struct snap_mr_cache_entry *mrc_remove_min(struct snap_mr_cache_entry *n,
+		struct snap_mr_cache_entry **min)
+{
+	if (!n->left) {
+		*min = n;
+		return n->right;
+	}
+
+	n->left = mrc_remove_min(n->left, min);
+	return mrc_balance(n);
+}
+
+static struct snap_mr_cache_entry *mrc_remove(struct snap_mr_cache_entry *root,
+		struct snap_mr_cache_entry *e)
+{
+	struct snap_mr_cache_entry *min, *right;
+
+	if (!root)
+		return NULL;
+
+	if (root == e) {
+		if (!e->right)
+			return e->left;
+		right = mrc_remove_min(e->right, &min);
+		min->left = e->left;
+		min->right = right;
+		return mrc_balance(min);
+	}
+
+	if (e->start < root->start)
+		root->left = mrc_remove(root->left, e);
+	else
+		root->right = mrc_remove(root->right, e);
+	return mrc_balance(root);
+}
+
+static struct snap_mr_cache_entry *mrc_find(struct snap_mr_cache_entry *n,
+		uintptr_t start, uintptr_t end)
+{
+	while (n) {
+		if (n->end <= start)
+			n = n->right;
+		else if (n->start >= end)
+			n = n->left;
+		else
+			return n;
+	}
+
+	return NULL;
+}
+
+static void mrc_release(struct snap_mr_cache *cache, struct snap_mr_cache_entry *e)
+{
+	cache->attr.ops->dereg(cache->attr.arg, e->mr);
+	cache->stats.entries--;
+	cache->stats.bytes -= e->end - e->start;
+	free(e);
+}
+
+/* take entry out of the tree, release it if it is not used */
+static void mrc_detach(struct snap_mr_cache *cache, struct snap_mr_cache_entry *e)
+{
+	cache->root = mrc_remove(cache->root, e);
+	e->in_tree = false;
+	if (e->refcnt == 0) {
+		TAILQ_REMOVE(&cache->lru, e, lru);
+		mrc_release(cache, e);
+	}
+}
+
+static void mrc_evict(struct snap_mr_cache *cache)
+{
+	struct snap_mr_cache_entry *e;
+
+	while (cache->stats.bytes > cache->attr.max_bytes &&
+	       (e = TAILQ_FIRST(&cache->lru))) {
+		cache->stats.evictions++;
+		mrc_detach(cache, e);
+	}
+}
+
+static void mrc_align(struct snap_mr_cache *cache, void *addr, size_t len,
+		uintptr_t *start, uintptr_t *end)
+{
+	uintptr_t mask = cache->attr.alignment - 1;
+
+	if (len == 0)
+		len = 1;
+	*start = (uintptr_t)addr & ~mask;
+	*end = ((uintptr_t)addr + len + mask) & ~mask;
+}
+
+/**
+ * snap_mr_cache_create() - Create memory registration cache
+ * @attr: cache attributes
+ *
+ * Return: cache or NULL on error
+ */
+struct snap_mr_cache *snap_mr_cache_create(const struct snap_mr_cache_attr *attr)
+{
+	struct snap_mr_cache *cache;
+
+	if (!attr->ops || !attr->ops->reg || !attr->ops->dereg ||
+	    (attr->alignment & (attr->alignment - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->attr = *attr;
+	if (!cache->attr.alignment)
+		cache->attr.alignment = sysconf(_SC_PAGESIZE);
+	TAILQ_INIT(&cache->lru);
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+/**
+ * snap_mr_cache_destroy() - Destroy memory registration cache
+ * @cache: cache to destroy
+ *
+ * All registrations are released. Entries returned by snap_mr_cache_get()
+ * must be put back before the cache is destroyed.
+ */
+void snap_mr_cache_destroy(struct snap_mr_cache *cache)
+{
+	struct snap_mr_cache_entry *e;
+
+	while (cache->root) {
+		e = cache->root;
+		cache->root = mrc_remove(cache->root, e);
+		if (e->refcnt == 0)
+			TAILQ_REMOVE(&cache->lru, e, lru);
+		mrc_release(cache, e);
+	}
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+/**
+ * snap_mr_cache_get() - Get registration of the memory range
+ * @cache: registration cache
+ * @addr:  start of the range
+ * @len:   length of the range
+ *
+ * The function returns a registration that covers the given range. If
+ * there is no such registration in the cache, a new one is created. The
+ * registration stays valid until it is put back with snap_mr_cache_put().
+ *
+ * Return: cache entry or NULL on error
+ */
+struct snap_mr_cache_entry *snap_mr_cache_get(struct snap_mr_cache *cache,
+		void *addr, size_t len)
+{
+	struct snap_mr_cache_entry *e;
+	uintptr_t start, end;
+	bool merged = false;
+
+	mrc_align(cache, addr, len, &start, &end);
+
+	pthread_mutex_lock(&cache->lock);
+	e = mrc_find(cache->root, start, end);
+	if (e && e->start <= start && e->end >= end) {
+		if (e->refcnt++ == 0)
+			TAILQ_REMOVE(&cache->lru, e, lru);
+		cache->stats.hits++;
+		pthread_mutex_unlock(&cache->lock);
+		return e;
+	}
+
+	/* replace overlapping registrations by a registration of the union */
+	while (e) {
+		if (e->start < start)
+			start = e->start;
+		if (e->end > end)
+			end = e->end;
+		mrc_detach(cache, e);
+		merged = true;
+		e = mrc_find(cache->root, start, end);
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		goto out_unlock;
+
+	e->mr = cache->attr.ops->reg(cache->attr.arg, (void *)start, end - start);
+	if (!e->mr) {
+		free(e);
+		e = NULL;
+		goto out_unlock;
+	}
+
+	e->start = start;
+	e->end = end;
+	e->refcnt = 1;
+	e->in_tree = true;
+	e->cache = cache;
+	cache->root = mrc_insert(cache->root, e);
+	cache->stats.misses++;
+	cache->stats.merges += merged;
+	cache->stats.entries++;
+	cache->stats.bytes += end - start;
+	mrc_evict(cache);
+out_unlock:
+	pthread_mutex_unlock(&cache->lock);
+	return e;
+}
+
+/**
+ * snap_mr_cache_put() - Put back registration
+ * @e: cache entry returned by snap_mr_cache_get()
+ *
+ * Unused registration is kept in the cache unless it was invalidated or
+ * the cache budget is exceeded.
+ */
+void snap_mr_cache_put(struct snap_mr_cache_entry *e)
+{
+	struct snap_mr_cache *cache = e->cache;
+
+	pthread_mutex_lock(&cache->lock);
+	if (--e->refcnt == 0) {
+		if (!e->in_tree) {
+			mrc_release(cache, e);
+		} else {
+			TAILQ_INSERT_TAIL(&cache->lru, e, lru);
+			mrc_evict(cache);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * snap_mr_cache_invalidate() - Invalidate registrations of the memory range
+ * @cache: registration cache
+ * @addr:  start of the range
+ * @len:   length of the range
+ *
+ * The function must be called before the memory is freed or unmapped.
+ * Registrations that overlap the range are removed from the cache. Unused
+ * ones are released immediately, others when they are put back.
+ */
+void snap_mr_cache_invalidate(struct snap_mr_cache *cache, void *addr, size_t len)
+{
+	struct snap_mr_cache_entry *e;
+	uintptr_t start, end;
+
+	mrc_align(cache, addr, len, &start, &end);
+
+	pthread_mutex_lock(&cache->lock);
+	while ((e = mrc_find(cache->root, start, end))) {
+		cache->stats.invalidations++;
+		mrc_detach(cache, e);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * snap_mr_cache_get_stats() - Get registration cache statistics
+ * @cache: registration cache
+ * @stats: where to store the statistics
+ */
+void snap_mr_cache_get_stats(struct snap_mr_cache *cache,
+		struct snap_mr_cache_stats *stats)
+{
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static void *snap_mr_cache_verbs_reg(void *arg, void *addr, size_t len)
+{
+	return snap_reg_mr((struct ibv_pd *)arg, addr, len);
+}
+
+static void snap_mr_cache_verbs_dereg(void *arg, void *mr)
+{
+	ibv_dereg_mr((struct ibv_mr *)mr);
+}
+
+static const struct snap_mr_cache_ops snap_mr_cache_verbs_ops = {
+	.reg = snap_mr_cache_verbs_reg,
+	.dereg = snap_mr_cache_verbs_dereg
+};
+
+static LIST_HEAD(, snap_mr_cache) snap_mr_cache_list = LIST_HEAD_INITIALIZER(snap_mr_cache_list);
+static pthread_mutex_t snap_mr_cache_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * snap_mr_cache_pd_get() - Get registration cache of the protection domain
+ * @pd: protection domain
+ *
+ * There is one cache per protection domain, it is created on the first
+ * call. Registrations are done with snap_reg_mr(). The cache budget is
+ * set by the SNAP_MR_CACHE_MAX_MB environment variable.
+ *
+ * Return: cache or NULL on error
+ */
+struct snap_mr_cache *snap_mr_cache_pd_get(struct ibv_pd *pd)
+{
+	struct snap_mr_cache_attr attr = {};
+	struct snap_mr_cache *cache;
+
+	pthread_mutex_lock(&snap_mr_cache_list_lock);
+	LIST_FOREACH(cache, &snap_mr_cache_list, entry) {
+		if (cache->pd == pd) {
+			cache->pd_refcnt++;
+			goto out;
+		}
+	}
+
+	attr.max_bytes = (size_t)snap_env_getenv(SNAP_MR_CACHE_MAX_MB) << 20;
+	attr.ops = &snap_mr_cache_verbs_ops;
+	attr.arg = pd;
+	cache = snap_mr_cache_create(&attr);
+	if (!cache)
+		goto out;
+
+	cache->pd = pd;
+	cache->pd_refcnt = 1;
+	LIST_INSERT_HEAD(&snap_mr_cache_list, cache, entry);
+out:
+	pthread_mutex_unlock(&snap_mr_cache_list_lock);
+	return cache;
+}
+
+/**
+ * snap_mr_cache_pd_put() - Put back registration cache of the protection domain
+ * @cache: cache returned by snap_mr_cache_pd_get()
+ *
+ * The cache is destroyed when the last user puts it back.
+ */
+void snap_mr_cache_pd_put(struct snap_mr_cache *cache)
+{
+	pthread_mutex_lock(&snap_mr_cache_list_lock);
+	if (--cache->pd_refcnt == 0) {
+		LIST_REMOVE(cache, entry);
+		snap_mr_cache_destroy(cache);
+	}
+	pthread_mutex_unlock(&snap_mr_cache_list_lock);
+}
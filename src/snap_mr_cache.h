@@ -0,0 +1,123 @@
+/*
+ * Copyright © 2022 NVIDIA CORPORATION & AFFILIATES. ALL RIGHTS RESERVED.
+ *
+ * This software product is a proprietary product of Nvidia Corporation and its affiliates
+ * (the "Company") and all right, title, and interest in and to the software
+ * product, including all associated intellectual property rights, are and
+ * shall remain exclusively with the Company.
+ *
+ * This software product is governed by the End User License Agreement
+ * provided with the software product.
+ */
+
+#ifndef SNAP_MR_CACHE_H
+#define SNAP_MR_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include <infiniband/verbs.h>
+
+#define SNAP_MR_CACHE_MAX_MB "SNAP_MR_CACHE_MAX_MB"
+
+/**
+ * struct snap_mr_cache_ops - memory registration callbacks
+ * @reg:   register memory range, return registration handle or NULL
+ *         on error
+ * @dereg: release registration handle returned by @reg
+ *
+ * The callbacks are called with the cache lock held.
+ */
+struct snap_mr_cache_ops {
+	void *(*reg)(void *arg, void *addr, size_t len);
+	void (*dereg)(void *arg, void *mr);
+};
+
+/**
+ * struct snap_mr_cache_attr - registration cache attributes
+ * @max_bytes: budget of the registered memory. Unused registrations are
+ *             released in LRU order once the budget is exceeded.
+ * @alignment: registrations are extended to the @alignment boundaries, so
+ *             that buffers on the same pages share one registration.
+ *             Must be a power of two, 0 means page size.
+ * @ops:       registration callbacks
+ * @arg:       first argument of the callbacks
+ */
+struct snap_mr_cache_attr {
+	size_t max_bytes;
+	size_t alignment;
+	const struct snap_mr_cache_ops *ops;
+	void *arg;
+};
+
+/**
+ * struct snap_mr_cache_entry - cached registration
+ * @start: first address covered by the registration
+ * @end:   first address after the registration
+ * @mr:    registration handle returned by &snap_mr_cache_ops.reg
+ *
+ * Other fields are private to the cache.
+ */
+struct snap_mr_cache_entry {
+	uintptr_t start;
+	uintptr_t end;
+	void *mr;
+
+	int refcnt;
+	bool in_tree;
+	int height;
+	struct snap_mr_cache_entry *left;
+	struct snap_mr_cache_entry *right;
+	TAILQ_ENTRY(snap_mr_cache_entry) lru;
+	struct snap_mr_cache *cache;
+};
+
+/**
+ * struct snap_mr_cache_stats - registration cache statistics
+ * @hits:          lookups that were served by an existing registration
+ * @misses:        lookups that required a new registration
+ * @merges:        registrations that replaced overlapping ones
+ * @evictions:     unused registrations released due to the budget
+ * @invalidations: registrations released by snap_mr_cache_invalidate()
+ * @entries:       number of live registrations
+ * @bytes:         size of the live registrations
+ */
+struct snap_mr_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t merges;
+	uint64_t evictions;
+	uint64_t invalidations;
+	uint64_t entries;
+	uint64_t bytes;
+};
+
+struct snap_mr_cache {
+	struct snap_mr_cache_attr attr;
+	struct snap_mr_cache_entry *root;
+	TAILQ_HEAD(, snap_mr_cache_entry) lru;
+	struct snap_mr_cache_stats stats;
+	pthread_mutex_t lock;
+
+	/* per pd caches */
+	struct ibv_pd *pd;
+	int pd_refcnt;
+	LIST_ENTRY(snap_mr_cache) entry;
+};
+
+struct snap_mr_cache *snap_mr_cache_create(const struct snap_mr_cache_attr *attr);
+void snap_mr_cache_destroy(struct snap_mr_cache *cache);
+struct snap_mr_cache_entry *snap_mr_cache_get(struct snap_mr_cache *cache,
+		void *addr, size_t len);
+void snap_mr_cache_put(struct snap_mr_cache_entry *e);
+void snap_mr_cache_invalidate(struct snap_mr_cache *cache, void *addr, size_t len);
+void snap_mr_cache_get_stats(struct snap_mr_cache *cache,
+		struct snap_mr_cache_stats *stats);
+
+struct snap_mr_cache *snap_mr_cache_pd_get(struct ibv_pd *pd);
+void snap_mr_cache_pd_put(struct snap_mr_cache *cache);
+
+#endif
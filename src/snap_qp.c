@@ -547,7 +547,17 @@ static int devx_qp_init(struct snap_qp *qp, struct ibv_pd *pd, const struct snap
 	} else {
 		DEVX_SET(qpc, qpc, no_sq, 1);
 	}
-	if (attr->rq_size) {
+	if (attr->srq_enable) {
+		if (attr->rq_size || attr->rq_cq->type != SNAP_OBJ_DEVX) {
+			ret = -EINVAL;
+			goto reset_qp_umem;
+		}
+
+		/* no scatter to cqe: data always lands in the srq buffers */
+		DEVX_SET(qpc, qpc, cqn_rcv, attr->rq_cq->devx_cq.devx.id);
+		DEVX_SET(qpc, qpc, rq_type, MLX5_SRQ_RQ);
+		DEVX_SET(qpc, qpc, srqn_rmpn_xrqn, attr->srqn);
+	} else if (attr->rq_size) {
 		if (attr->rq_cq->type != SNAP_OBJ_DEVX) {
 			ret = -EINVAL;
 			goto reset_qp_umem;
@@ -148,6 +148,10 @@ struct snap_qp_attr {
 	struct snap_cq *rq_cq;
 	uint32_t uidx;
 
+	/* receive on the shared receive queue, rq_size must be 0 */
+	bool srq_enable;
+	uint32_t srqn;
+
 	bool qp_on_dpa;
 	struct snap_dpa_ctx *dpa_proc;
 
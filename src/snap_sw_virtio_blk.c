@@ -13,29 +13,10 @@
 #include "snap.h"
 #include "snap_virtio_common.h"
 #include "snap_virtio_blk.h"
+#include "snap_sw_virtio_blk.h"
 
-enum sw_queue_prog_state {
-	READ_AVAILABLE_IDX,
-	READ_HEADER_IDX,
-	NEW_CMD_PROC,
-};
-
-struct snap_virtio_blk_sw_queue {
-	struct snap_virtio_blk_queue vbq;
-	struct snap_dma_q	*dma_q;
-	uint64_t			driver_addr;
-	uint64_t			q_size;
-	uint16_t			prev_avail;
-	uint16_t			avail_idx;
-	struct ibv_mr		*avail_mr;
-	uint16_t			desc_head_idx;
-	struct ibv_mr		*desc_head_mr;
-	bool				read_done;
-	enum sw_queue_prog_state prog_state;
-	struct snap_dma_completion avail_read;
-	uint32_t dma_mkey;
-};
-
+/* heads handed out by one poll, unless the caller asks for less */
+#define SNAP_SW_VIRTQ_WINDOW 64
 
 static inline struct snap_virtio_blk_sw_queue *
 to_sw_queue(struct snap_virtio_blk_queue *vbq)
@@ -44,48 +25,67 @@ to_sw_queue(struct snap_virtio_blk_queue *vbq)
 			vbq);
 }
 
-static void sw_queue_prog_read_cb(struct snap_dma_completion *comp, int status)
+static void sw_queue_avail_read_cb(struct snap_dma_completion *comp, int status)
 {
 	struct snap_virtio_blk_sw_queue *sw_q = container_of(comp,
 			struct snap_virtio_blk_sw_queue, avail_read);
 
+	sw_q->read_posted = false;
+	if (snap_unlikely(status != IBV_WC_SUCCESS)) {
+		snap_error("failed DMA read vring_available for drv: 0x%lx status %d\n",
+			   sw_q->driver_addr, status);
+		return;
+	}
 	sw_q->read_done = true;
 }
 
+/**
+ * snap_virtio_blk_sw_queue_init() - Initialize software queue polling state
+ * @swq:	queue, @swq->avail and @swq->avail_mr are already set up
+ * @attr:	queue attributes
+ *
+ * Polling starts from @attr->hw_available_index.
+ */
+void snap_virtio_blk_sw_queue_init(struct snap_virtio_blk_sw_queue *swq,
+				   struct snap_virtio_common_queue_attr *attr)
+{
+	swq->prev_avail = attr->hw_available_index;
+	swq->max_window = snap_min(SNAP_SW_VIRTQ_WINDOW, attr->vattr.size);
+	swq->read_posted = false;
+	swq->read_done = false;
+	swq->avail_read.func = sw_queue_avail_read_cb;
+	swq->driver_addr = attr->vattr.driver;
+	swq->q_size = attr->vattr.size;
+	attr->q_provider = SNAP_SW_Q_PROVIDER;
+	swq->dma_q = attr->dma_q;
+	swq->dma_mkey = attr->vattr.dma_mkey;
+}
+
 static struct snap_virtio_queue *
 snap_virtio_blk_create_sw_queue(struct snap_device *sdev,
 				struct snap_virtio_common_queue_attr *attr)
 {
 	struct snap_virtio_blk_sw_queue *swq = calloc(1, sizeof(struct snap_virtio_blk_sw_queue));
+	size_t avail_len;
 
 	if (!swq)
 		goto out;
-	swq->avail_idx = 0;
-	swq->avail_mr = snap_reg_mr(attr->qp->pd,
-			&swq->avail_idx, sizeof(uint16_t));
-	if (!swq->avail_mr) {
-		snap_error("failed to register avail_mr\n");
+
+	avail_len = offsetof(struct vring_avail, ring[attr->vattr.size]);
+	swq->avail = calloc(1, avail_len);
+	if (!swq->avail)
 		goto rel_q;
-	}
-	swq->desc_head_mr = snap_reg_mr(attr->qp->pd,
-			&swq->desc_head_idx, sizeof(uint16_t));
-	if (!swq->desc_head_mr) {
+
+	swq->avail_mr = snap_reg_mr(attr->qp->pd, swq->avail, avail_len);
+	if (!swq->avail_mr) {
 		snap_error("failed to register avail_mr\n");
-		goto dereg_avail;
+		goto free_avail;
 	}
-	swq->prev_avail = 0;
-	swq->prog_state = 0;
-	swq->avail_read.func = sw_queue_prog_read_cb;
-	swq->driver_addr = attr->vattr.driver;
-	swq->q_size = attr->vattr.size;
-	attr->q_provider = SNAP_SW_Q_PROVIDER;
-	swq->dma_q = attr->dma_q;
-	swq->dma_mkey = attr->vattr.dma_mkey;
-
+	snap_virtio_blk_sw_queue_init(swq, attr);
 	return &swq->vbq.virtq;
 
-dereg_avail:
-	ibv_dereg_mr(swq->avail_mr);
+free_avail:
+	free(swq->avail);
 rel_q:
 	free(swq);
 out:
@@ -97,15 +97,18 @@ static int snap_virtio_blk_destroy_sw_queue(struct snap_virtio_queue *vq)
 	struct snap_virtio_blk_sw_queue *swq = to_sw_queue(to_blk_queue(vq));
 
 	ibv_dereg_mr(swq->avail_mr);
-	ibv_dereg_mr(swq->desc_head_mr);
+	free(swq->avail);
 	free(swq);
 
 	return 0;
 }
 
-static int snap_virtio_blk_query_sw_queue(struct snap_virtio_queue *vbq,
+static int snap_virtio_blk_query_sw_queue(struct snap_virtio_queue *vq,
 		struct snap_virtio_common_queue_attr *attr)
 {
+	struct snap_virtio_blk_sw_queue *swq = to_sw_queue(to_blk_queue(vq));
+
+	attr->hw_available_index = swq->prev_avail;
 	return 0;
 }
 
@@ -115,60 +118,70 @@ static int snap_virtio_blk_modify_sw_queue(struct snap_virtio_queue *vq,
 	return 0;
 }
 
-/* TODO: convert to the poll/complete/send_completion model */
-static int __attribute__((unused)) snap_virtio_blk_progress_sw_queue(struct snap_virtio_queue *vq)
+/*
+ * The read starts at the avail ring header, so that the index and the ring
+ * entries after prev_avail come in one DMA. The index is at the lowest
+ * address and is sampled first, entries it covers are already written.
+ * A window that goes past the end of the ring reads the whole ring.
+ */
+static int sw_queue_read_avail(struct snap_virtio_blk_sw_queue *sw_q)
 {
-	struct snap_virtio_blk_sw_queue *sw_q = to_sw_queue(to_blk_queue(vq));
-	uint64_t avail_idx_addr  = sw_q->driver_addr + offsetof(struct vring_avail, idx);
-	uint64_t desc_hdr_idx_addr;
+	uint16_t slot = sw_q->prev_avail % sw_q->q_size;
+	size_t len;
 	int ret;
 
-	switch (sw_q->prog_state) {
-	case READ_AVAILABLE_IDX:
-		sw_q->avail_read.count = 1;
+	len = offsetof(struct vring_avail,
+		       ring[snap_min(sw_q->q_size, slot + sw_q->max_window)]);
+	sw_q->avail_read.count = 1;
+	ret = snap_dma_q_read(sw_q->dma_q, sw_q->avail, len,
+			      sw_q->avail_mr->lkey, sw_q->driver_addr,
+			      sw_q->dma_mkey, &sw_q->avail_read);
+	if (snap_unlikely(ret)) {
+		snap_error("failed DMA read vring_available for drv: 0x%lx\n",
+			   sw_q->driver_addr);
+		return ret;
+	}
+
+	sw_q->read_posted = true;
+	sw_q->reads++;
+	return 0;
+}
+
+static int snap_virtio_blk_poll_sw_queue(struct snap_virtio_queue *vq,
+		struct virtq_split_tunnel_req *reqs, int num_reqs)
+{
+	struct snap_virtio_blk_sw_queue *sw_q = to_sw_queue(to_blk_queue(vq));
+	uint16_t n_avail;
+	int i, ret, n = 0;
+
+	if (sw_q->read_posted)
+		return 0;
+
+	if (sw_q->read_done) {
 		sw_q->read_done = false;
-		ret = snap_dma_q_read(sw_q->dma_q, &sw_q->avail_idx, sizeof(uint16_t),
-				sw_q->avail_mr->lkey, avail_idx_addr, sw_q->dma_mkey, &sw_q->avail_read);
-		if (snap_unlikely(ret)) {
-			snap_error("failed DMA read vring_available for drv: 0x%lx\n",
-					sw_q->driver_addr);
-			return ret;
-		}
-		sw_q->prog_state = READ_HEADER_IDX;
-		break;
-	case READ_HEADER_IDX:
-		if (sw_q->read_done) {
-			sw_q->read_done = false;
-			if ((sw_q->avail_idx % sw_q->q_size) != sw_q->prev_avail) {
-				desc_hdr_idx_addr = sw_q->driver_addr +
-					offsetof(struct vring_avail, ring[sw_q->prev_avail]);
-				sw_q->prev_avail = (sw_q->prev_avail + 1) % sw_q->q_size;
-				sw_q->avail_read.count = 1;
-				ret = snap_dma_q_read(sw_q->dma_q, &sw_q->desc_head_idx, sizeof(uint16_t),
-						sw_q->desc_head_mr->lkey, desc_hdr_idx_addr, sw_q->dma_mkey, &sw_q->avail_read);
-				if (snap_unlikely(ret)) {
-					snap_error("failed DMA read descriptor head idx for drv: 0x%lx\n",
-							sw_q->driver_addr);
-					return ret;
-				}
-				sw_q->prog_state = NEW_CMD_PROC;
-			} else
-				sw_q->prog_state = READ_AVAILABLE_IDX;
+		n_avail = sw_q->avail->idx - sw_q->prev_avail;
+		if (snap_unlikely(n_avail > sw_q->q_size)) {
+			snap_error("bad avail index %u, last %u, drv: 0x%lx\n",
+				   sw_q->avail->idx, sw_q->prev_avail,
+				   sw_q->driver_addr);
+			return -EINVAL;
 		}
-		break;
-	case NEW_CMD_PROC:
-		if (sw_q->read_done) {
-			struct virtq_split_tunnel_req_hdr hdr;
-
-			sw_q->read_done = false;
-			hdr.descr_head_idx = sw_q->desc_head_idx;
-			hdr.num_desc = 0;
-			sw_q->dma_q->rx_cb(sw_q->dma_q, &hdr, 0, 0);
-			sw_q->prog_state = READ_AVAILABLE_IDX;
+
+		n = snap_min(n_avail, snap_min(num_reqs, sw_q->max_window));
+		for (i = 0; i < n; i++) {
+			reqs[i].hdr.descr_head_idx =
+				sw_q->avail->ring[(uint16_t)(sw_q->prev_avail + i) % sw_q->q_size];
+			reqs[i].hdr.num_desc = 0;
+			reqs[i].hdr.dpa_vq_table_flag = 0;
+			reqs[i].tunnel_descs = NULL;
 		}
-		break;
+		sw_q->prev_avail += n;
+		sw_q->heads += n;
 	}
-	return 0;
+
+	/* heads are copied out, the next window can be read in the background */
+	ret = sw_queue_read_avail(sw_q);
+	return n ? n : ret;
 }
 
 static struct virtq_q_ops snap_virtq_blk_sw_ops = {
@@ -176,7 +189,7 @@ static struct virtq_q_ops snap_virtq_blk_sw_ops = {
 	.destroy = snap_virtio_blk_destroy_sw_queue,
 	.query = snap_virtio_blk_query_sw_queue,
 	.modify = snap_virtio_blk_modify_sw_queue,
-	//.progress = snap_virtio_blk_progress_sw_queue,
+	.poll = snap_virtio_blk_poll_sw_queue,
 };
 
 struct virtq_q_ops *get_sw_queue_ops(void)
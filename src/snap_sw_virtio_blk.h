@@ -13,6 +13,48 @@
 #ifndef SRC_SNAP_SW_VIRTIO_BLK_H_
 #define SRC_SNAP_SW_VIRTIO_BLK_H_
 
+#include "snap_virtio_blk.h"
+
+/**
+ * struct snap_virtio_blk_sw_queue - software polled virtio-blk queue
+ * @vbq:		blk queue
+ * @dma_q:		dma queue to read the avail ring with
+ * @driver_addr:	avail ring address on host memory
+ * @q_size:		queue size
+ * @dma_mkey:		host memory key
+ * @avail:		local copy of the avail ring, read by windows
+ * @avail_mr:		memory region of @avail
+ * @prev_avail:		avail index of the next head to hand out
+ * @max_window:		max ring entries a single read covers
+ * @read_posted:	avail ring read is in flight
+ * @read_done:		avail ring read completed, @avail is valid
+ * @avail_read:		avail ring read completion
+ * @reads:		avail ring reads posted
+ * @heads:		heads handed to the upper layer
+ *
+ * The queue is polled with virtq_q_ops.poll(). Every read covers the avail
+ * index and the ring entries after @prev_avail, so a batch of heads costs a
+ * single DMA.
+ */
+struct snap_virtio_blk_sw_queue {
+	struct snap_virtio_blk_queue vbq;
+	struct snap_dma_q *dma_q;
+	uint64_t driver_addr;
+	uint16_t q_size;
+	uint32_t dma_mkey;
+	struct vring_avail *avail;
+	struct ibv_mr *avail_mr;
+	uint16_t prev_avail;
+	uint16_t max_window;
+	bool read_posted;
+	bool read_done;
+	struct snap_dma_completion avail_read;
+	uint64_t reads;
+	uint64_t heads;
+};
+
+void snap_virtio_blk_sw_queue_init(struct snap_virtio_blk_sw_queue *swq,
+				   struct snap_virtio_common_queue_attr *attr);
 struct virtq_q_ops *get_sw_queue_ops(void);
 
 
@@ -548,6 +548,24 @@ int snap_virtio_modify_device(struct snap_device *sdev,
 				 virtio_blk_config.blk_size, battr->blk_size);
 			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
 				 virtio_blk_config.num_queues, battr->max_blk_queues);
+			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
+				 virtio_blk_config.max_discard_sectors,
+				 battr->max_discard_sectors);
+			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
+				 virtio_blk_config.max_discard_seg,
+				 battr->max_discard_seg);
+			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
+				 virtio_blk_config.discard_sector_alignment,
+				 battr->discard_sector_alignment);
+			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
+				 virtio_blk_config.max_write_zeroes_sectors,
+				 battr->max_write_zeroes_sectors);
+			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
+				 virtio_blk_config.max_write_zeroes_segs,
+				 battr->max_write_zeroes_segs);
+			DEVX_SET(virtio_blk_device_emulation, device_emulation_in,
+				 virtio_blk_config.write_zeroes_may_unmap,
+				 battr->write_zeroes_may_unmap);
 		}
 
 		if (mask & SNAP_VIRTIO_MOD_ALL) {
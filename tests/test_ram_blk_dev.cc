@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+extern "C" {
+#include "snap_blk_dev.h"
+#include "snap_ram_blk_dev.h"
+};
+
+#include "gtest/gtest.h"
+
+#define RAM_TEST_BLK_SIZE 512
+/* large enough to discard whole huge pages */
+#define RAM_TEST_SIZE_B   (8 * 1024 * 1024 / RAM_TEST_BLK_SIZE)
+#define RAM_TEST_THREADS  2
+#define RAM_TEST_POOL_BUF 4096
+
+class RamBlkDevTest : public ::testing::Test {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	struct snap_blk_dev_attrs m_attrs;
+	struct snap_blk_dev *m_bdev;
+	struct snap_bdev_io_done_ctx m_done_ctx;
+	std::vector<void *> m_done;
+	int m_errors;
+
+	void open(int pool_bufs);
+	int write(uint64_t offset_blocks, uint64_t num_blocks, uint8_t val,
+		  int thread_id = 0);
+	bool check(uint64_t offset_blocks, uint64_t num_blocks, uint8_t val);
+};
+
+static void ram_test_done(enum snap_bdev_op_status status, void *arg)
+{
+	RamBlkDevTest *t = (RamBlkDevTest *)arg;
+
+	if (status != SNAP_BDEV_OP_SUCCESS)
+		t->m_errors++;
+	t->m_done.push_back(arg);
+}
+
+void RamBlkDevTest::SetUp()
+{
+	memset(&m_attrs, 0, sizeof(m_attrs));
+	m_attrs.type = SNAP_BLOCK_DEVICE_RAM;
+	m_attrs.size_b = RAM_TEST_SIZE_B;
+	m_attrs.blk_size = RAM_TEST_BLK_SIZE;
+	m_attrs.ram.num_threads = RAM_TEST_THREADS;
+	m_done_ctx.cb = ram_test_done;
+	m_done_ctx.user_arg = this;
+	m_bdev = NULL;
+	m_errors = 0;
+}
+
+void RamBlkDevTest::TearDown()
+{
+	if (m_bdev)
+		snap_blk_dev_close(m_bdev);
+}
+
+void RamBlkDevTest::open(int pool_bufs)
+{
+	m_attrs.ram.pool_bufs = pool_bufs;
+	m_attrs.ram.pool_buf_size = RAM_TEST_POOL_BUF;
+	m_bdev = snap_blk_dev_open("ram_blk", &m_attrs);
+	ASSERT_TRUE(m_bdev);
+	EXPECT_EQ((uint64_t)RAM_TEST_SIZE_B, m_bdev->ops.get_num_blocks(m_bdev));
+	EXPECT_EQ((uint32_t)RAM_TEST_BLK_SIZE,
+		  m_bdev->ops.get_block_size(m_bdev));
+	EXPECT_STREQ("ram_blk", m_bdev->ops.get_bdev_name(m_bdev));
+}
+
+int RamBlkDevTest::write(uint64_t offset_blocks, uint64_t num_blocks,
+			 uint8_t val, int thread_id)
+{
+	std::vector<uint8_t> buf(num_blocks * RAM_TEST_BLK_SIZE, val);
+	struct iovec iov;
+
+	iov.iov_base = buf.data();
+	iov.iov_len = buf.size();
+	return m_bdev->ops.writev_blocks(m_bdev, &iov, 1, offset_blocks,
+					 num_blocks, &m_done_ctx, thread_id);
+}
+
+bool RamBlkDevTest::check(uint64_t offset_blocks, uint64_t num_blocks,
+			  uint8_t val)
+{
+	std::vector<uint8_t> buf(num_blocks * RAM_TEST_BLK_SIZE, val ^ 0xff);
+	struct iovec iov;
+	size_t i;
+
+	iov.iov_base = buf.data();
+	iov.iov_len = buf.size();
+	if (m_bdev->ops.readv_blocks(m_bdev, &iov, 1, offset_blocks, num_blocks,
+				     &m_done_ctx, 0))
+		return false;
+	snap_ram_blk_dev_progress(m_bdev, 0);
+	for (i = 0; i < buf.size(); i++)
+		if (buf[i] != val)
+			return false;
+	return true;
+}
+
+/* callbacks run from the progress of the thread, never in the submission */
+TEST_F(RamBlkDevTest, rw_async) {
+	uint8_t wbuf[3 * RAM_TEST_BLK_SIZE], rbuf[3 * RAM_TEST_BLK_SIZE] = {};
+	struct iovec wiov[2], riov[3];
+	size_t i;
+
+	open(0);
+	for (i = 0; i < sizeof(wbuf); i++)
+		wbuf[i] = i * 7;
+	wiov[0].iov_base = wbuf;
+	wiov[0].iov_len = 100;
+	wiov[1].iov_base = wbuf + 100;
+	wiov[1].iov_len = sizeof(wbuf) - 100;
+	ASSERT_EQ(0, m_bdev->ops.writev_blocks(m_bdev, wiov, 2, 10, 3,
+					       &m_done_ctx, 0));
+	EXPECT_EQ(0U, m_done.size());
+	EXPECT_EQ(1, snap_ram_blk_dev_progress(m_bdev, 0));
+	EXPECT_EQ(1U, m_done.size());
+
+	riov[0].iov_base = rbuf;
+	riov[0].iov_len = RAM_TEST_BLK_SIZE;
+	riov[1].iov_base = rbuf + RAM_TEST_BLK_SIZE;
+	riov[1].iov_len = 1;
+	riov[2].iov_base = rbuf + RAM_TEST_BLK_SIZE + 1;
+	riov[2].iov_len = sizeof(rbuf) - RAM_TEST_BLK_SIZE - 1;
+	ASSERT_EQ(0, m_bdev->ops.readv_blocks(m_bdev, riov, 3, 10, 3,
+					      &m_done_ctx, 0));
+	ASSERT_EQ(0, m_bdev->ops.flush(m_bdev, 0, 0, &m_done_ctx, 0));
+	EXPECT_EQ(1U, m_done.size());
+	EXPECT_EQ(2, snap_ram_blk_dev_progress(m_bdev, 0));
+	EXPECT_EQ(0, memcmp(wbuf, rbuf, sizeof(wbuf)));
+
+	/* byte addressed operations see the same data */
+	memset(rbuf, 0, sizeof(rbuf));
+	ASSERT_EQ(0, m_bdev->ops.read(m_bdev, rbuf, 10 * RAM_TEST_BLK_SIZE + 3,
+				      5, &m_done_ctx, 0));
+	EXPECT_EQ(1, snap_ram_blk_dev_progress(m_bdev, 0));
+	EXPECT_EQ(0, memcmp(wbuf + 3, rbuf, 5));
+	EXPECT_EQ(0, m_errors);
+}
+
+TEST_F(RamBlkDevTest, write_zeroes_discard) {
+	uint64_t half = RAM_TEST_SIZE_B / 2;
+
+	open(0);
+	ASSERT_EQ(0, write(0, RAM_TEST_SIZE_B, 0xa5));
+	ASSERT_EQ(0, m_bdev->ops.write_zeroes(m_bdev, 1, 2, &m_done_ctx, 0));
+	/* whole pages in the middle, partial ones at both ends */
+	ASSERT_EQ(0, m_bdev->ops.discard(m_bdev, half - 3, half, &m_done_ctx,
+					 0));
+	EXPECT_EQ(3, snap_ram_blk_dev_progress(m_bdev, 0));
+
+	EXPECT_TRUE(check(0, 1, 0xa5));
+	EXPECT_TRUE(check(1, 2, 0));
+	EXPECT_TRUE(check(3, half - 6, 0xa5));
+	EXPECT_TRUE(check(half - 3, half, 0));
+	EXPECT_TRUE(check(RAM_TEST_SIZE_B - 3, 3, 0xa5));
+
+	/* discarded blocks can be written again */
+	ASSERT_EQ(0, write(half, 1, 0x11));
+	snap_ram_blk_dev_progress(m_bdev, 0);
+	EXPECT_TRUE(check(half, 1, 0x11));
+	EXPECT_EQ(0, m_errors);
+}
+
+TEST_F(RamBlkDevTest, invalid) {
+	uint8_t buf[RAM_TEST_BLK_SIZE];
+
+	open(0);
+	EXPECT_EQ(-EINVAL, write(RAM_TEST_SIZE_B, 1, 0));
+	EXPECT_EQ(-EINVAL, write(RAM_TEST_SIZE_B - 1, 2, 0));
+	EXPECT_EQ(-EINVAL, write(0, 1, 0, RAM_TEST_THREADS));
+	EXPECT_EQ(-EINVAL, m_bdev->ops.discard(m_bdev, 1, RAM_TEST_SIZE_B,
+					       &m_done_ctx, 0));
+	EXPECT_EQ(-EINVAL, m_bdev->ops.write(m_bdev, buf,
+					     RAM_TEST_SIZE_B * RAM_TEST_BLK_SIZE - 1,
+					     2, &m_done_ctx, 0));
+	EXPECT_EQ(-EINVAL, m_bdev->ops.flush(m_bdev, 0, 0, &m_done_ctx,
+					     RAM_TEST_THREADS));
+	EXPECT_EQ(0, snap_ram_blk_dev_progress(m_bdev, 0));
+	EXPECT_EQ(0U, m_done.size());
+	EXPECT_FALSE(m_bdev->ops.dma_pool_enabled(m_bdev));
+}
+
+/* each thread completes only its own operations */
+TEST_F(RamBlkDevTest, threads) {
+	open(0);
+	ASSERT_EQ(0, write(0, 1, 1, 1));
+	EXPECT_EQ(0, snap_ram_blk_dev_progress(m_bdev, 0));
+	EXPECT_EQ(1, snap_ram_blk_dev_progress(m_bdev, 1));
+
+	/* without a thread id the operations belong to the first thread */
+	ASSERT_EQ(0, write(0, 1, 2, -1));
+	EXPECT_EQ(0, snap_ram_blk_dev_progress(m_bdev, 1));
+	EXPECT_EQ(1, snap_ram_blk_dev_progress(m_bdev, -1));
+	EXPECT_EQ(2U, m_done.size());
+}
+
+struct ram_test_ordered {
+	RamBlkDevTest *t;
+	struct snap_bdev_io_done_ctx done_ctx;
+	int idx;
+};
+
+static std::vector<int> g_ram_test_order;
+
+static void ram_test_ordered_done(enum snap_bdev_op_status status, void *arg)
+{
+	g_ram_test_order.push_back(((struct ram_test_ordered *)arg)->idx);
+}
+
+/* the ring grows past its initial size and keeps the order */
+TEST_F(RamBlkDevTest, many_ops) {
+	const int n = 1000;
+	std::vector<struct ram_test_ordered> ops(n);
+	int i;
+
+	open(0);
+	g_ram_test_order.clear();
+	for (i = 0; i < n; i++) {
+		ops[i].idx = i;
+		ops[i].done_ctx.cb = ram_test_ordered_done;
+		ops[i].done_ctx.user_arg = &ops[i];
+		ASSERT_EQ(0, m_bdev->ops.flush(m_bdev, 0, 0, &ops[i].done_ctx, 0));
+		if (i == 100) {
+			EXPECT_EQ(101, snap_ram_blk_dev_progress(m_bdev, 0));
+		}
+	}
+	EXPECT_EQ(n - 101, snap_ram_blk_dev_progress(m_bdev, 0));
+	ASSERT_EQ((size_t)n, g_ram_test_order.size());
+	for (i = 0; i < n; i++)
+		EXPECT_EQ(i, g_ram_test_order[i]);
+}
+
+struct ram_test_mem {
+	struct snap_blk_mempool_ctx ctx;
+	void *buf;
+	int ready;
+};
+
+static void ram_test_mem_ready(void *data, struct ibv_mr *mr, void *user)
+{
+	struct ram_test_mem *mem = (struct ram_test_mem *)user;
+
+	mem->buf = data;
+	mem->ready++;
+}
+
+static void ram_test_mem_init(struct ram_test_mem *mem,
+			      struct snap_blk_dev *bdev, int thread_id)
+{
+	memset(mem, 0, sizeof(*mem));
+	mem->ctx.ctx = bdev;
+	mem->ctx.user = mem;
+	mem->ctx.callback = ram_test_mem_ready;
+	mem->ctx.thread_id = thread_id;
+}
+
+/* allocations wait for a free buffer of their thread */
+TEST_F(RamBlkDevTest, pool) {
+	struct ram_test_mem mem[4], other;
+	int i;
+
+	open(2);
+	ASSERT_TRUE(m_bdev->ops.dma_pool_enabled(m_bdev));
+	for (i = 0; i < 4; i++) {
+		ram_test_mem_init(&mem[i], m_bdev, 0);
+		ASSERT_EQ(0, m_bdev->ops.dma_pool_malloc(RAM_TEST_POOL_BUF,
+							 &mem[i].ctx));
+	}
+	EXPECT_EQ(-EINVAL, m_bdev->ops.dma_pool_malloc(RAM_TEST_POOL_BUF + 1,
+						       &mem[0].ctx));
+	EXPECT_EQ(0, mem[0].ready);
+	EXPECT_EQ(2, snap_ram_blk_dev_progress(m_bdev, 0));
+	ASSERT_EQ(1, mem[0].ready);
+	ASSERT_EQ(1, mem[1].ready);
+	EXPECT_NE(mem[0].buf, mem[1].buf);
+	EXPECT_EQ(0, mem[2].ready);
+	memset(mem[0].buf, 0xff, RAM_TEST_POOL_BUF);
+
+	/* the other thread has its own buffers */
+	ram_test_mem_init(&other, m_bdev, 1);
+	ASSERT_EQ(0, m_bdev->ops.dma_pool_malloc(RAM_TEST_POOL_BUF, &other.ctx));
+	EXPECT_EQ(1, snap_ram_blk_dev_progress(m_bdev, 1));
+	EXPECT_EQ(1, other.ready);
+	m_bdev->ops.dma_pool_free(&other.ctx, other.buf);
+
+	/* a cancelled waiter does not take the buffer */
+	m_bdev->ops.dma_pool_cancel(&mem[2].ctx);
+	m_bdev->ops.dma_pool_free(&mem[0].ctx, mem[0].buf);
+	EXPECT_EQ(1, snap_ram_blk_dev_progress(m_bdev, 0));
+	EXPECT_EQ(0, mem[2].ready);
+	ASSERT_EQ(1, mem[3].ready);
+	EXPECT_EQ(mem[0].buf, mem[3].buf);
+
+	/* a cancelled allocation gives its buffer back */
+	m_bdev->ops.dma_pool_free(&mem[1].ctx, mem[1].buf);
+	ASSERT_EQ(0, m_bdev->ops.dma_pool_malloc(RAM_TEST_POOL_BUF,
+						 &mem[2].ctx));
+	m_bdev->ops.dma_pool_cancel(&mem[2].ctx);
+	EXPECT_EQ(0, snap_ram_blk_dev_progress(m_bdev, 0));
+	EXPECT_EQ(0, mem[2].ready);
+	ASSERT_EQ(0, m_bdev->ops.dma_pool_malloc(RAM_TEST_POOL_BUF,
+						 &mem[2].ctx));
+	EXPECT_EQ(1, snap_ram_blk_dev_progress(m_bdev, 0));
+	EXPECT_EQ(1, mem[2].ready);
+	m_bdev->ops.dma_pool_free(&mem[2].ctx, mem[2].buf);
+	m_bdev->ops.dma_pool_free(&mem[3].ctx, mem[3].buf);
+}
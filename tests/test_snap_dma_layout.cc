@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include <infiniband/verbs.h>
+#include <infiniband/mlx5dv.h>
+
+extern "C" {
+#include "snap_dma.h"
+
+extern const struct snap_dma_q_ops dv_ops;
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * snap_dma_q hot path layout. Static asserts in the snap_dma.h guard the
+ * layout at compile time, here it is shown and measured: write_short is
+ * posted through the dv ops on a queue that lives in plain memory, the
+ * doorbell record and the blueflame register are regular variables.
+ */
+
+#define LAYOUT_TEST_SQ_SIZE 256
+#define LAYOUT_TEST_N_OPS   (10 * 1000 * 1000)
+
+struct layout_test_qp {
+	char sq[LAYOUT_TEST_SQ_SIZE * MLX5_SEND_WQE_BB] __attribute__((aligned(64)));
+	struct snap_dv_dma_completion comps[LAYOUT_TEST_SQ_SIZE];
+	uint32_t dbr[2];
+	uint64_t bf;
+};
+
+static int cacheline(size_t offset)
+{
+	return offset / SNAP_CACHE_LINE_SIZE;
+}
+
+#define LAYOUT_LINE(_f) cacheline(offsetof(struct snap_dma_q, _f))
+#define LAYOUT_LAST_LINE(_f) \
+	cacheline(offsetof(struct snap_dma_q, _f) + sizeof(((struct snap_dma_q *)0)->_f) - 1)
+
+TEST(snap_dma_q_layout, hot_fields) {
+	printf("sizeof(struct snap_dma_q) %zu\n", sizeof(struct snap_dma_q));
+
+	/* tx line */
+	EXPECT_EQ(0, LAYOUT_LINE(ops));
+	EXPECT_EQ(0, LAYOUT_LINE(pending));
+	EXPECT_EQ(0, LAYOUT_LINE(worker));
+	EXPECT_EQ(0, LAYOUT_LINE(sw_ctx));
+	EXPECT_EQ(0, LAYOUT_LINE(tx_available));
+	EXPECT_EQ(0, LAYOUT_LAST_LINE(tx_elem_size));
+
+	/* rx line */
+	EXPECT_EQ(1, LAYOUT_LINE(rx_cb));
+	EXPECT_EQ(1, LAYOUT_LINE(rx_elem_size));
+	EXPECT_EQ(1, LAYOUT_LAST_LINE(uctx));
+
+	/* dv qp: hw_qp line followed by the tx line */
+	EXPECT_EQ(0U, offsetof(struct snap_dma_q, sw_qp.dv_qp.hw_qp) % SNAP_CACHE_LINE_SIZE);
+	EXPECT_EQ(LAYOUT_LINE(sw_qp.dv_qp.hw_qp), LAYOUT_LAST_LINE(sw_qp.dv_qp.hw_qp));
+	EXPECT_EQ(LAYOUT_LINE(sw_qp.dv_qp.hw_qp) + 1, LAYOUT_LINE(sw_qp.dv_qp.comps));
+	EXPECT_EQ(LAYOUT_LINE(sw_qp.dv_qp.comps), LAYOUT_LINE(sw_qp.dv_qp.ctrl));
+	EXPECT_EQ(LAYOUT_LINE(sw_qp.dv_qp.comps), LAYOUT_LINE(sw_qp.dv_qp.n_outstanding));
+	EXPECT_EQ(LAYOUT_LINE(sw_qp.dv_qp.comps), LAYOUT_LINE(sw_qp.dv_qp.tx_need_ring_db));
+	EXPECT_EQ(LAYOUT_LINE(sw_qp.dv_qp.comps), LAYOUT_LINE(sw_qp.dv_qp.wk_active));
+	EXPECT_EQ(LAYOUT_LINE(sw_qp.dv_qp.comps), LAYOUT_LAST_LINE(sw_qp.dv_qp.stat.tx));
+
+	/* cqs */
+	EXPECT_EQ(LAYOUT_LINE(sw_qp.dv_tx_cq), LAYOUT_LAST_LINE(sw_qp.dv_tx_cq));
+	EXPECT_EQ(LAYOUT_LINE(sw_qp.dv_rx_cq), LAYOUT_LAST_LINE(sw_qp.rx_buf));
+
+	/* cold data is after all hot lines */
+	EXPECT_GT(offsetof(struct snap_dma_q, fw_qp), offsetof(struct snap_dma_q, sw_qp.rx_buf));
+	EXPECT_GT(offsetof(struct snap_dma_q, custom_ops), offsetof(struct snap_dma_q, sw_qp.rx_buf));
+}
+
+static struct snap_dma_q *layout_test_q_create(struct layout_test_qp *qp)
+{
+	struct snap_dma_q *q;
+
+	if (posix_memalign((void **)&q, SNAP_CACHE_LINE_SIZE, sizeof(*q)))
+		return NULL;
+	memset(q, 0, sizeof(*q));
+	memset(qp, 0, sizeof(*qp));
+
+	q->ops = &dv_ops;
+	q->tx_elem_size = 16;
+	q->tx_qsize = LAYOUT_TEST_SQ_SIZE;
+	q->tx_available = LAYOUT_TEST_SQ_SIZE;
+	q->sw_qp.mode = SNAP_DMA_Q_MODE_DV;
+	q->sw_qp.dv_qp.db_flag = SNAP_DB_RING_IMM;
+	q->sw_qp.dv_qp.comps = qp->comps;
+	q->sw_qp.dv_qp.hw_qp.dbr_addr = (uintptr_t)qp->dbr;
+	q->sw_qp.dv_qp.hw_qp.sq.addr = (uintptr_t)qp->sq;
+	q->sw_qp.dv_qp.hw_qp.sq.bf_addr = (uintptr_t)&qp->bf;
+	q->sw_qp.dv_qp.hw_qp.sq.wqe_cnt = LAYOUT_TEST_SQ_SIZE;
+	q->sw_qp.dv_qp.hw_qp.sq.tx_db_nc = 1;
+	return q;
+}
+
+static int layout_test_perf_open(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t layout_test_perf_read(int fd)
+{
+	uint64_t val = 0;
+
+	if (fd < 0 || read(fd, &val, sizeof(val)) != sizeof(val))
+		return 0;
+	return val;
+}
+
+static uint64_t layout_test_ticks(void)
+{
+#if defined(__x86_64__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+TEST(snap_dma_q_layout, write_short_perf) {
+	struct layout_test_qp *qp;
+	struct snap_dma_q *q;
+	char data[16];
+	uint64_t t, l1_misses, cycles;
+	int i, l1_fd, cycles_fd;
+
+	qp = (struct layout_test_qp *)aligned_alloc(64, sizeof(*qp));
+	ASSERT_TRUE(qp);
+	q = layout_test_q_create(qp);
+	ASSERT_TRUE(q);
+	memset(data, 0xA5, sizeof(data));
+
+	l1_fd = layout_test_perf_open(PERF_TYPE_HW_CACHE,
+			PERF_COUNT_HW_CACHE_L1D |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	cycles_fd = layout_test_perf_open(PERF_TYPE_HARDWARE,
+			PERF_COUNT_HW_CPU_CYCLES);
+	if (l1_fd >= 0)
+		ioctl(l1_fd, PERF_EVENT_IOC_ENABLE, 0);
+	if (cycles_fd >= 0)
+		ioctl(cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+
+	t = layout_test_ticks();
+	for (i = 0; i < LAYOUT_TEST_N_OPS; i++) {
+		/* pretend that sq was completed */
+		if (snap_unlikely(q->tx_available == 0)) {
+			q->tx_available = LAYOUT_TEST_SQ_SIZE;
+			q->sw_qp.dv_qp.n_outstanding = 0;
+		}
+		if (snap_unlikely(snap_dma_q_write_short(q, data, sizeof(data), 0, 0)))
+			break;
+	}
+	t = layout_test_ticks() - t;
+
+	if (l1_fd >= 0)
+		ioctl(l1_fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (cycles_fd >= 0)
+		ioctl(cycles_fd, PERF_EVENT_IOC_DISABLE, 0);
+	l1_misses = layout_test_perf_read(l1_fd);
+	cycles = layout_test_perf_read(cycles_fd);
+
+	ASSERT_EQ(LAYOUT_TEST_N_OPS, i);
+	ASSERT_EQ(htobe32((uint16_t)LAYOUT_TEST_N_OPS), qp->dbr[MLX5_SND_DBR]);
+	ASSERT_EQ((uint64_t)LAYOUT_TEST_N_OPS, q->sw_qp.dv_qp.stat.tx.total_dbs);
+
+#if defined(__x86_64__)
+	printf("write_short: %d ops, %.2f tsc ticks/op\n", i, (double)t / i);
+#else
+	printf("write_short: %d ops, %.2f ns/op\n", i, (double)t / i);
+#endif
+	if (cycles_fd >= 0)
+		printf("write_short: %.2f cycles/op\n", (double)cycles / i);
+	if (l1_fd >= 0)
+		printf("write_short: %.4f L1D read misses/op\n", (double)l1_misses / i);
+	else
+		printf("write_short: perf counters are not available\n");
+
+	if (l1_fd >= 0)
+		close(l1_fd);
+	if (cycles_fd >= 0)
+		close(cycles_fd);
+	free(q);
+	free(qp);
+}
@@ -0,0 +1,1104 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <infiniband/verbs.h>
+
+extern "C" {
+#include "snap_dma.h"
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * SNAP_DMA_Q_MODE_SW tests. Mirror test_snap_dma.cc but do not need
+ * any rdma device: the host memory is simulated by the snap_dma_sw_mem
+ */
+
+#define SW_HOST_ADDR 0x100000000ULL
+#define SW_HOST_MKEY 0x1234
+
+class SnapDmaSwTest : public ::testing::Test {
+	virtual void SetUp();
+	virtual void TearDown();
+
+	protected:
+	struct snap_dma_sw_mem *m_hmem;
+	char *m_lbuf;
+	char *m_rbuf;
+	uint64_t m_raddr;
+	int   m_bsize;
+	int   m_bcount;
+	struct snap_dma_q_create_attr m_dma_q_attr;
+
+	void dma_xfer_test(struct snap_dma_q *q, bool is_read, bool poll_mode,
+			   int len);
+	void progress_until(struct snap_dma_q *q, int *count, int expected);
+};
+
+static int g_rx_count;
+static char g_last_rx[128];
+
+static void dma_rx_cb(struct snap_dma_q *q, const void *data, uint32_t data_len,
+		uint32_t imm_data)
+{
+	g_rx_count++;
+	memcpy(g_last_rx, data, data_len);
+}
+
+static int g_comp_count;
+static int g_last_comp_status;
+
+static void dma_completion(struct snap_dma_completion *comp, int status)
+{
+	g_comp_count++;
+	g_last_comp_status = status;
+}
+
+void SnapDmaSwTest::SetUp()
+{
+	memset(&m_dma_q_attr, 0, sizeof(m_dma_q_attr));
+	m_dma_q_attr.tx_qsize = m_dma_q_attr.rx_qsize = 64;
+	m_dma_q_attr.tx_elem_size = 16;
+	m_dma_q_attr.rx_elem_size = 64;
+	m_dma_q_attr.rx_cb = dma_rx_cb;
+	m_dma_q_attr.mode = SNAP_DMA_Q_MODE_SW;
+
+	m_bsize = 4096;
+	m_bcount = 64;
+	m_lbuf = (char *)malloc(m_bcount * m_bsize);
+	ASSERT_TRUE(m_lbuf);
+
+	m_hmem = snap_dma_sw_mem_create(NULL, m_bcount * m_bsize, SW_HOST_ADDR,
+					SW_HOST_MKEY);
+	ASSERT_TRUE(m_hmem);
+	m_raddr = SW_HOST_ADDR;
+	m_rbuf = (char *)snap_dma_sw_mem_addr(m_hmem, m_raddr);
+	ASSERT_TRUE(m_rbuf);
+
+	g_comp_count = 0;
+	g_rx_count = 0;
+}
+
+void SnapDmaSwTest::TearDown()
+{
+	if (m_hmem)
+		snap_dma_sw_mem_destroy(m_hmem);
+	free(m_lbuf);
+}
+
+void SnapDmaSwTest::progress_until(struct snap_dma_q *q, int *count, int expected)
+{
+	int n = 0;
+
+	while (n < 10000 && *count != expected) {
+		snap_dma_q_progress(q);
+		n++;
+	}
+	ASSERT_EQ(expected, *count);
+}
+
+void SnapDmaSwTest::dma_xfer_test(struct snap_dma_q *q, bool is_read,
+		bool poll_mode, int len)
+{
+	struct snap_dma_completion comp, *comps[1];
+	int rc;
+
+	comp.func = dma_completion;
+	comp.count = 1;
+	g_comp_count = 0;
+
+	if (is_read) {
+		memset(m_lbuf, 0, len);
+		memset(m_rbuf, 0xED, len);
+		rc = snap_dma_q_read(q, m_lbuf, len, 0, m_raddr, SW_HOST_MKEY, &comp);
+	} else {
+		memset(m_rbuf, 0, len);
+		memset(m_lbuf, 0xED, len);
+		rc = snap_dma_q_write(q, m_lbuf, len, 0, m_raddr, SW_HOST_MKEY, &comp);
+	}
+	ASSERT_EQ(0, rc);
+
+	if (poll_mode) {
+		ASSERT_EQ(1, snap_dma_q_poll_tx(q, comps, 1));
+		ASSERT_EQ(&comp, comps[0]);
+		comps[0]->func(comps[0], 0);
+	} else
+		progress_until(q, &g_comp_count, 1);
+
+	ASSERT_EQ(1, g_comp_count);
+	ASSERT_EQ(0, g_last_comp_status);
+	ASSERT_EQ(0, comp.count);
+	ASSERT_EQ(0, memcmp(m_lbuf, m_rbuf, len));
+}
+
+TEST_F(SnapDmaSwTest, create_destroy) {
+	struct snap_dma_q *q;
+
+	/* no pd is needed */
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+	ASSERT_EQ(SNAP_DMA_Q_MODE_SW, q->ops->mode);
+	ASSERT_TRUE(snap_dma_q_get_fw_qp(q) == NULL);
+	ASSERT_TRUE(snap_dma_q_empty(q));
+	snap_dma_q_destroy(q);
+
+	/* creating another queue after one was destroyed must work */
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, create_destroy_n) {
+	const int N = 16;
+	int i;
+	struct snap_dma_q *q[N];
+
+	for (i = 0; i < N; i++) {
+		q[i] = snap_dma_q_create(NULL, &m_dma_q_attr);
+		ASSERT_TRUE(q[i]);
+	}
+
+	for (i = 0; i < N; i++)
+		snap_dma_q_destroy(q[i]);
+}
+
+TEST_F(SnapDmaSwTest, create_no_tx_rx) {
+	struct snap_dma_q *q;
+
+	m_dma_q_attr.tx_qsize = 0;
+	m_dma_q_attr.rx_qsize = 0;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+	ASSERT_EQ(0, snap_dma_q_progress(q));
+	ASSERT_EQ(-EAGAIN, snap_dma_q_write_short(q, m_lbuf, 8, m_raddr, SW_HOST_MKEY));
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, dma_read) {
+	struct snap_dma_q *q;
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	dma_xfer_test(q, true, false, m_bsize);
+	dma_xfer_test(q, true, true, m_bsize);
+
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, dma_write) {
+	struct snap_dma_q *q;
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	dma_xfer_test(q, false, false, m_bsize);
+	dma_xfer_test(q, false, true, m_bsize);
+
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, dma_read_short) {
+	struct snap_dma_q *q;
+	struct snap_dma_completion comp;
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	comp.func = dma_completion;
+	comp.count = 1;
+	memset(m_rbuf, 'A', 32);
+	ASSERT_EQ(0, snap_dma_q_read_short(q, m_lbuf, 32, m_raddr, SW_HOST_MKEY, &comp));
+	progress_until(q, &g_comp_count, 1);
+	ASSERT_EQ(0, memcmp(m_lbuf, m_rbuf, 32));
+
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, dma_write_short) {
+	struct snap_dma_q *q;
+	char cqe[m_dma_q_attr.tx_elem_size];
+	int saved_tx_available;
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	saved_tx_available = q->tx_available;
+
+	memset(m_rbuf, 0, sizeof(cqe));
+	memset(cqe, 0xDA, sizeof(cqe));
+
+	ASSERT_EQ(0, snap_dma_q_write_short(q, cqe, sizeof(cqe), m_raddr + 8,
+				SW_HOST_MKEY));
+	/* source buffer may be reused right away */
+	memset(cqe, 0, sizeof(cqe));
+	ASSERT_EQ(saved_tx_available - 1, q->tx_available);
+	ASSERT_EQ((char)0xDA, m_rbuf[8]);
+	ASSERT_EQ((char)0xDA, m_rbuf[8 + sizeof(cqe) - 1]);
+	ASSERT_EQ(0, m_rbuf[0]);
+
+	ASSERT_EQ(1, snap_dma_q_flush(q));
+	ASSERT_EQ(saved_tx_available, q->tx_available);
+
+	ASSERT_EQ(-EINVAL, snap_dma_q_write_short(q, cqe, sizeof(cqe) + 1,
+				m_raddr, SW_HOST_MKEY));
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, dma_v2v) {
+	struct snap_dma_q *q;
+	struct snap_dma_completion comp;
+	struct iovec liov[3], riov[2];
+	uint32_t lkey = 0, rkey = SW_HOST_MKEY;
+	int i;
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	/* local buffer is split differently than the remote one */
+	liov[0].iov_base = m_lbuf;
+	liov[0].iov_len = 100;
+	liov[1].iov_base = m_lbuf + 1000;
+	liov[1].iov_len = 300;
+	liov[2].iov_base = m_lbuf + 2000;
+	liov[2].iov_len = 112;
+	riov[0].iov_base = (void *)(m_raddr + 4096);
+	riov[0].iov_len = 256;
+	riov[1].iov_base = (void *)(m_raddr);
+	riov[1].iov_len = 256;
+
+	for (i = 0; i < m_bsize; i++)
+		m_lbuf[i] = i;
+	memset(m_rbuf, 0, 2 * m_bsize);
+
+	comp.func = dma_completion;
+	comp.count = 1;
+	ASSERT_EQ(0, snap_dma_q_writev2v(q, &lkey, liov, 3, &rkey, riov, 2,
+					 true, true, &comp));
+	progress_until(q, &g_comp_count, 1);
+	ASSERT_EQ(0, g_last_comp_status);
+	ASSERT_EQ(0, memcmp(m_rbuf + 4096, m_lbuf, 100));
+	ASSERT_EQ(0, memcmp(m_rbuf + 4096 + 100, m_lbuf + 1000, 156));
+	ASSERT_EQ(0, memcmp(m_rbuf, m_lbuf + 1000 + 156, 144));
+	ASSERT_EQ(0, memcmp(m_rbuf + 144, m_lbuf + 2000, 112));
+
+	memset(m_lbuf, 0, m_bsize);
+	comp.count = 1;
+	ASSERT_EQ(0, snap_dma_q_readv2v(q, &lkey, liov, 3, &rkey, riov, 2,
+					true, true, &comp));
+	progress_until(q, &g_comp_count, 2);
+	ASSERT_EQ(0, g_last_comp_status);
+	ASSERT_EQ(0, memcmp(m_rbuf + 4096, m_lbuf, 100));
+	ASSERT_EQ(0, memcmp(m_rbuf + 4096 + 100, m_lbuf + 1000, 156));
+	ASSERT_EQ(0, memcmp(m_rbuf, m_lbuf + 1000 + 156, 144));
+	ASSERT_EQ(0, memcmp(m_rbuf + 144, m_lbuf + 2000, 112));
+
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, send_completion) {
+	struct snap_dma_q *q;
+	char cqe[m_dma_q_attr.tx_elem_size];
+	char fw_cqe[m_dma_q_attr.tx_elem_size];
+	char data[8];
+	int saved_tx_available;
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	saved_tx_available = q->tx_available;
+	memset(cqe, 0xDA, sizeof(cqe));
+
+	ASSERT_EQ(0, snap_dma_q_send_completion(q, cqe, sizeof(cqe)));
+	ASSERT_EQ((int)sizeof(cqe), snap_dma_sw_q_fw_recv(q, fw_cqe, sizeof(fw_cqe)));
+	ASSERT_EQ(0, memcmp(cqe, fw_cqe, sizeof(cqe)));
+	ASSERT_EQ(0, snap_dma_sw_q_fw_recv(q, fw_cqe, sizeof(fw_cqe)));
+
+	/* inline part followed by the local buffer */
+	memset(data, 0xAB, sizeof(data));
+	ASSERT_EQ(0, snap_dma_q_send(q, cqe, 8, (uintptr_t)data, sizeof(data), 0));
+	ASSERT_EQ(16, snap_dma_sw_q_fw_recv(q, fw_cqe, sizeof(fw_cqe)));
+	ASSERT_EQ(0, memcmp(cqe, fw_cqe, 8));
+	ASSERT_EQ(0, memcmp(data, fw_cqe + 8, 8));
+
+	snap_dma_q_flush(q);
+	ASSERT_EQ(saved_tx_available, q->tx_available);
+
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, flush) {
+	struct snap_dma_q *q;
+	char cqe[m_dma_q_attr.tx_elem_size];
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	/* no outstanding requests */
+	ASSERT_EQ(0, snap_dma_q_flush(q));
+
+	ASSERT_EQ(0, snap_dma_q_read(q, m_lbuf, m_bsize, 0, m_raddr,
+				SW_HOST_MKEY, NULL));
+	ASSERT_EQ(0, snap_dma_q_write(q, m_lbuf, m_bsize, 0, m_raddr,
+				SW_HOST_MKEY, NULL));
+	ASSERT_EQ(0, snap_dma_q_send_completion(q, cqe, sizeof(cqe)));
+	/* 3 outstanding requests */
+	ASSERT_EQ(3, snap_dma_q_flush(q));
+
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, flush_async) {
+	struct snap_dma_q *q;
+	struct snap_dma_completion comp;
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+	snap_dma_sw_q_set_delay(q, 4);
+
+	ASSERT_EQ(0, snap_dma_q_read(q, m_lbuf, m_bsize, 0, m_raddr,
+				SW_HOST_MKEY, NULL));
+	ASSERT_FALSE(snap_dma_q_empty(q));
+
+	comp.count = 1;
+	comp.func = dma_completion;
+	ASSERT_EQ(0, snap_dma_q_flush_nowait(q, &comp));
+	ASSERT_EQ(0, g_comp_count);
+	ASSERT_FALSE(snap_dma_q_empty(q));
+
+	progress_until(q, &g_comp_count, 1);
+	ASSERT_TRUE(snap_dma_q_empty(q));
+
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, completion_delay) {
+	struct snap_dma_q *q;
+	struct snap_dma_completion comp;
+	const int delay = 8;
+	int i;
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+	snap_dma_sw_q_set_delay(q, delay);
+
+	comp.func = dma_completion;
+	comp.count = 2;
+	ASSERT_EQ(0, snap_dma_q_write(q, m_lbuf, m_bsize, 0, m_raddr,
+				SW_HOST_MKEY, &comp));
+	snap_dma_q_progress(q);
+	ASSERT_EQ(0, snap_dma_q_write(q, m_lbuf, m_bsize, 0, m_raddr,
+				SW_HOST_MKEY, &comp));
+
+	/* completions are delivered in order after 'delay' progress calls */
+	for (i = 1; i < delay; i++) {
+		snap_dma_q_progress(q);
+		ASSERT_EQ(0, g_comp_count);
+		ASSERT_EQ(2, comp.count);
+	}
+	snap_dma_q_progress(q);
+	ASSERT_EQ(0, g_comp_count);
+	snap_dma_q_progress(q);
+	ASSERT_EQ(1, g_comp_count);
+	ASSERT_EQ(0, comp.count);
+	ASSERT_TRUE(snap_dma_q_empty(q));
+
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, tx_credits) {
+	struct snap_dma_q *q;
+	int i;
+
+	m_dma_q_attr.tx_qsize = 8;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	for (i = 0; i < 8; i++)
+		ASSERT_EQ(0, snap_dma_q_write(q, m_lbuf, 64, 0, m_raddr,
+					SW_HOST_MKEY, NULL));
+	ASSERT_EQ(0, q->tx_available);
+	ASSERT_EQ(-EAGAIN, snap_dma_q_write(q, m_lbuf, 64, 0, m_raddr,
+				SW_HOST_MKEY, NULL));
+	ASSERT_EQ(-EAGAIN, snap_dma_q_write_short(q, m_lbuf, 8, m_raddr,
+				SW_HOST_MKEY));
+
+	ASSERT_EQ(8, snap_dma_q_progress(q));
+	ASSERT_EQ(8, q->tx_available);
+
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, rx_callback) {
+	struct snap_dma_q *q;
+	char sqe[m_dma_q_attr.rx_elem_size];
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	memset(sqe, 0xDA, sizeof(sqe));
+	ASSERT_EQ(0, snap_dma_sw_q_rx_post(q, sqe, sizeof(sqe), 0));
+	ASSERT_EQ(-EINVAL, snap_dma_sw_q_rx_post(q, sqe, sizeof(sqe) + 1, 0));
+
+	snap_dma_q_progress(q);
+
+	ASSERT_EQ(1, g_rx_count);
+	ASSERT_EQ(0, memcmp(g_last_rx, sqe, sizeof(sqe)));
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, poll_rx) {
+	struct snap_dma_q *q;
+	char sqe[m_dma_q_attr.rx_elem_size];
+	const int rx_reqs = 16;
+	struct snap_rx_completion read_comp[rx_reqs];
+	int i, n;
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	for (i = 0; i < rx_reqs; i++) {
+		memset(sqe, i, sizeof(sqe));
+		ASSERT_EQ(0, snap_dma_sw_q_rx_post(q, sqe, sizeof(sqe), i));
+	}
+
+	n = snap_dma_q_poll_rx(q, read_comp, rx_reqs);
+	ASSERT_EQ(rx_reqs, n);
+	for (i = 0; i < n; i++) {
+		ASSERT_EQ((uint32_t)i, read_comp[i].imm_data);
+		ASSERT_EQ((uint32_t)m_dma_q_attr.rx_elem_size, read_comp[i].byte_len);
+		ASSERT_EQ(i, ((char *)read_comp[i].data)[0]);
+		q->rx_cb(q, read_comp[i].data, read_comp[i].byte_len, read_comp[i].imm_data);
+	}
+	ASSERT_EQ(rx_reqs, g_rx_count);
+	ASSERT_EQ(0, snap_dma_q_poll_rx(q, read_comp, rx_reqs));
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, rx_overflow) {
+	struct snap_dma_q *q;
+	char sqe[m_dma_q_attr.rx_elem_size];
+	int i;
+
+	m_dma_q_attr.rx_qsize = 4;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	memset(sqe, 0, sizeof(sqe));
+	/* same as hw: there are 2 * rx_qsize receive buffers */
+	for (i = 0; i < 8; i++)
+		ASSERT_EQ(0, snap_dma_sw_q_rx_post(q, sqe, sizeof(sqe), 0));
+	ASSERT_EQ(-EAGAIN, snap_dma_sw_q_rx_post(q, sqe, sizeof(sqe), 0));
+
+	ASSERT_EQ(8, snap_dma_q_progress(q));
+	ASSERT_EQ(8, g_rx_count);
+	ASSERT_EQ(0, snap_dma_sw_q_rx_post(q, sqe, sizeof(sqe), 0));
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, poll_tx) {
+	struct snap_dma_q *q;
+	const int tx_reqs = 64;
+	struct snap_dma_completion write_comp[tx_reqs];
+	struct snap_dma_completion *read_comp[tx_reqs];
+	int i, n, k;
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	for (i = 0; i < tx_reqs; i++) {
+		write_comp[i].count = 1;
+		write_comp[i].func = dma_completion;
+		ASSERT_EQ(0, snap_dma_q_write(q, m_lbuf, m_bsize, 0, m_raddr,
+					SW_HOST_MKEY, &write_comp[i]));
+	}
+
+	k = 0;
+	while ((n = snap_dma_q_poll_tx(q, read_comp, 7)) > 0) {
+		for (i = 0; i < n; i++, k++) {
+			ASSERT_EQ(&write_comp[k], read_comp[i]);
+			read_comp[i]->func(read_comp[i], 0);
+		}
+	}
+
+	ASSERT_EQ(tx_reqs, g_comp_count);
+	ASSERT_TRUE(snap_dma_q_empty(q));
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, error_checks) {
+	struct snap_dma_q *q;
+	struct snap_dma_completion comp;
+	char data[4096];
+
+	/* no worker or dpa support */
+	m_dma_q_attr.dpa_mode = SNAP_DMA_Q_DPA_MODE_POLLING;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_FALSE(q);
+	m_dma_q_attr.dpa_mode = SNAP_DMA_Q_DPA_MODE_NONE;
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+	ASSERT_NE(0, snap_dma_q_send_completion(q, data, sizeof(data)));
+
+	/* wrong key or address results in completion with error */
+	comp.func = dma_completion;
+	comp.count = 1;
+	ASSERT_EQ(0, snap_dma_q_write(q, m_lbuf, 64, 0, m_raddr,
+				SW_HOST_MKEY + 1, &comp));
+	progress_until(q, &g_comp_count, 1);
+	ASSERT_NE(0, g_last_comp_status);
+
+	comp.count = 1;
+	ASSERT_EQ(0, snap_dma_q_read(q, m_lbuf, 64, 0,
+				m_raddr + m_bcount * m_bsize - 32,
+				SW_HOST_MKEY, &comp));
+	progress_until(q, &g_comp_count, 2);
+	ASSERT_NE(0, g_last_comp_status);
+
+	/* queue is still usable */
+	dma_xfer_test(q, false, false, 64);
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, mem_regions) {
+	struct snap_dma_sw_mem *mem2;
+	struct snap_dma_q *q;
+	char buf[128];
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	/* user memory, same address range but another key */
+	mem2 = snap_dma_sw_mem_create(buf, sizeof(buf), SW_HOST_ADDR, SW_HOST_MKEY + 1);
+	ASSERT_TRUE(mem2);
+	ASSERT_TRUE(snap_dma_sw_mem_addr(mem2, SW_HOST_ADDR + sizeof(buf)) == NULL);
+
+	memset(buf, 0, sizeof(buf));
+	memset(m_rbuf, 0, sizeof(buf));
+	memset(m_lbuf, 0x5A, sizeof(buf));
+	ASSERT_EQ(0, snap_dma_q_write_short(q, m_lbuf, 16, SW_HOST_ADDR + 16,
+				SW_HOST_MKEY + 1));
+	ASSERT_EQ(0x5A, buf[16]);
+	ASSERT_EQ(0, m_rbuf[16]);
+
+	/* queue must not use the destroyed region */
+	snap_dma_sw_mem_destroy(mem2);
+	ASSERT_EQ(0, snap_dma_q_write_short(q, m_lbuf, 16, SW_HOST_ADDR + 16,
+				SW_HOST_MKEY));
+	ASSERT_EQ(0x5A, m_rbuf[16]);
+
+	snap_dma_q_flush(q);
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, stat) {
+	struct snap_dma_q *q;
+	const struct snap_dv_qp_stat *stat;
+	char sqe[m_dma_q_attr.rx_elem_size];
+
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	memset(sqe, 0, sizeof(sqe));
+	ASSERT_EQ(0, snap_dma_q_write(q, m_lbuf, 64, 0, m_raddr,
+				SW_HOST_MKEY, NULL));
+	ASSERT_EQ(0, snap_dma_sw_q_rx_post(q, sqe, sizeof(sqe), 0));
+	snap_dma_q_progress(q);
+
+	stat = snap_dma_q_stat(q);
+	ASSERT_TRUE(stat);
+	ASSERT_EQ(1U, stat->tx.total_dbs);
+	ASSERT_EQ(1U, stat->tx.total_completed);
+	ASSERT_EQ(1U, stat->rx.total_completed);
+	snap_dma_q_destroy(q);
+}
+
+struct pending_comp {
+	struct snap_dma_completion comp;
+	int idx;
+};
+
+static int g_comp_order[64];
+static int g_comp_order_n;
+
+static void pending_completion(struct snap_dma_completion *comp, int status)
+{
+	struct pending_comp *pc = (struct pending_comp *)comp;
+
+	g_comp_order[g_comp_order_n++] = pc->idx;
+	g_last_comp_status = status;
+}
+
+TEST_F(SnapDmaSwTest, pending_order) {
+	struct snap_dma_q *q;
+	struct pending_comp comps[32];
+	char sbuf[8];
+	int i, n_comps = 0;
+
+	m_dma_q_attr.tx_qsize = 2;
+	m_dma_q_attr.pending_qsize = 32;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+	snap_dma_sw_q_set_delay(q, 1);
+	memset(m_rbuf, 0, 2 * m_bsize);
+	g_comp_order_n = 0;
+
+	/* mix of short writes to the same location and regular writes */
+	for (i = 0; i < 32; i++) {
+		if (i % 4 == 0) {
+			memset(sbuf, i, sizeof(sbuf));
+			ASSERT_EQ(0, snap_dma_q_write_short(q, sbuf, sizeof(sbuf),
+						m_raddr, SW_HOST_MKEY));
+			/* deferred short op must keep its own copy */
+			memset(sbuf, 0xFF, sizeof(sbuf));
+			continue;
+		}
+
+		memset(m_lbuf + i * 64, i, 64);
+		comps[n_comps].comp.func = pending_completion;
+		comps[n_comps].comp.count = 1;
+		comps[n_comps].idx = i;
+		ASSERT_EQ(0, snap_dma_q_write(q, m_lbuf + i * 64, 64, 0,
+					m_raddr + m_bsize + i * 64, SW_HOST_MKEY,
+					&comps[n_comps].comp));
+		n_comps++;
+	}
+	ASSERT_EQ(0, q->tx_available);
+	ASSERT_EQ(30, snap_dma_q_pending_count(q));
+	ASSERT_FALSE(snap_dma_q_empty(q));
+
+	/* nothing is lost: the ring is drained by the progress */
+	progress_until(q, &g_comp_order_n, n_comps);
+	ASSERT_EQ(0, snap_dma_q_pending_count(q));
+	snap_dma_q_flush(q);
+	ASSERT_TRUE(snap_dma_q_empty(q));
+	ASSERT_EQ(2, q->tx_available);
+
+	for (i = 1; i < n_comps; i++)
+		ASSERT_LT(g_comp_order[i - 1], g_comp_order[i]);
+	ASSERT_EQ(IBV_WC_SUCCESS, g_last_comp_status);
+
+	for (i = 0; i < 32; i++) {
+		if (i % 4) {
+			ASSERT_EQ(i, m_rbuf[m_bsize + i * 64 + 63]);
+		}
+	}
+	/* last short write wins */
+	ASSERT_EQ(28, m_rbuf[0]);
+	ASSERT_EQ(28, m_rbuf[7]);
+
+	snap_dma_q_destroy(q);
+}
+
+/*
+ * Ops posted while the ring is not empty are deferred as well, even if
+ * there are send credits, so they can not overtake the deferred ones.
+ */
+TEST_F(SnapDmaSwTest, pending_order_read) {
+	struct snap_dma_q *q;
+	struct pending_comp comps[4];
+	struct iovec liov, riov[2];
+	uint32_t lkey = 0, rkey = SW_HOST_MKEY;
+	char sbuf[32];
+	int i;
+
+	m_dma_q_attr.tx_qsize = 1;
+	m_dma_q_attr.pending_qsize = 8;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+	snap_dma_sw_q_set_delay(q, 1);
+	memset(m_rbuf, 0, 2 * m_bsize);
+	memset(m_lbuf, 0xAA, m_bsize);
+	memset(m_lbuf + m_bsize, 0xBB, m_bsize);
+	g_comp_order_n = 0;
+
+	for (i = 0; i < 4; i++) {
+		comps[i].comp.func = pending_completion;
+		comps[i].comp.count = 1;
+		comps[i].idx = i;
+	}
+
+	ASSERT_EQ(0, snap_dma_q_write(q, m_lbuf, 64, 0, m_raddr, SW_HOST_MKEY,
+				      &comps[0].comp));
+	ASSERT_EQ(0, snap_dma_q_write(q, m_lbuf + m_bsize, 64, 0,
+				      m_raddr + m_bsize, SW_HOST_MKEY,
+				      &comps[1].comp));
+	ASSERT_EQ(1, snap_dma_q_pending_count(q));
+
+	/* the credit is back but the second write is still deferred */
+	progress_until(q, &g_comp_order_n, 1);
+	ASSERT_EQ(1, q->tx_available);
+	ASSERT_EQ(1, snap_dma_q_pending_count(q));
+
+	memset(sbuf, 0, sizeof(sbuf));
+	ASSERT_EQ(0, snap_dma_q_read_short(q, sbuf, sizeof(sbuf),
+					   m_raddr + m_bsize, SW_HOST_MKEY,
+					   &comps[2].comp));
+	liov.iov_base = m_lbuf + 2 * m_bsize;
+	liov.iov_len = 64;
+	riov[0].iov_base = (void *)(m_raddr + m_bsize);
+	riov[0].iov_len = 16;
+	riov[1].iov_base = (void *)(m_raddr + m_bsize + 16);
+	riov[1].iov_len = 48;
+	memset(m_lbuf + 2 * m_bsize, 0, 64);
+	ASSERT_EQ(0, snap_dma_q_readv2v(q, &lkey, &liov, 1, &rkey, riov, 2,
+					true, true, &comps[3].comp));
+	/* read short and the two pieces of the vectored read */
+	ASSERT_EQ(4, snap_dma_q_pending_count(q));
+
+	/* ops that can not be deferred wait for the ring to drain */
+	ASSERT_EQ(-EAGAIN, snap_dma_q_send(q, sbuf, 8, 0, 0, 0));
+
+	progress_until(q, &g_comp_order_n, 4);
+	for (i = 0; i < 4; i++)
+		ASSERT_EQ(i, g_comp_order[i]);
+	ASSERT_EQ(IBV_WC_SUCCESS, g_last_comp_status);
+	ASSERT_EQ(0, memcmp(sbuf, m_lbuf + m_bsize, sizeof(sbuf)));
+	ASSERT_EQ(0, memcmp(m_lbuf + 2 * m_bsize, m_lbuf + m_bsize, 64));
+
+	snap_dma_q_flush(q);
+	ASSERT_TRUE(snap_dma_q_empty(q));
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, pending_full) {
+	struct snap_dma_q *q;
+	struct snap_dma_completion comp;
+	int i;
+
+	m_dma_q_attr.tx_qsize = 2;
+	m_dma_q_attr.pending_qsize = 3;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	comp.func = dma_completion;
+	comp.count = 6;
+	/* pending ring size is rounded up to the power of 2 */
+	for (i = 0; i < 6; i++)
+		ASSERT_EQ(0, snap_dma_q_read(q, m_lbuf, 64, 0, m_raddr,
+					SW_HOST_MKEY, &comp));
+	ASSERT_EQ(4, snap_dma_q_pending_count(q));
+	ASSERT_EQ(-EAGAIN, snap_dma_q_read(q, m_lbuf, 64, 0, m_raddr,
+				SW_HOST_MKEY, &comp));
+	ASSERT_EQ(-EAGAIN, snap_dma_q_write_short(q, m_lbuf, 8, m_raddr,
+				SW_HOST_MKEY));
+
+	/* first progress returns credits, next one posts from the ring */
+	ASSERT_EQ(2, snap_dma_q_progress(q));
+	ASSERT_EQ(4, snap_dma_q_pending_count(q));
+	ASSERT_EQ(2, snap_dma_q_progress(q));
+	ASSERT_EQ(2, snap_dma_q_pending_count(q));
+
+	/* flush waits for the deferred ops too */
+	ASSERT_EQ(2, snap_dma_q_flush(q));
+	ASSERT_EQ(0, snap_dma_q_pending_count(q));
+	ASSERT_EQ(1, g_comp_count);
+	ASSERT_EQ(0, comp.count);
+
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, pending_send_completion) {
+	struct snap_dma_q *q;
+	char cqe[m_dma_q_attr.tx_elem_size];
+	char fw_cqe[m_dma_q_attr.tx_elem_size];
+	int i;
+
+	m_dma_q_attr.tx_qsize = 1;
+	m_dma_q_attr.pending_qsize = 8;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	for (i = 0; i < 8; i++) {
+		memset(cqe, i, sizeof(cqe));
+		ASSERT_EQ(0, snap_dma_q_send_completion(q, cqe, sizeof(cqe)));
+	}
+	ASSERT_EQ(7, snap_dma_q_pending_count(q));
+
+	/* sw fw side keeps only tx_qsize messages, fetch them one by one */
+	for (i = 0; i < 8; i++) {
+		int n = 0;
+
+		while (snap_dma_sw_q_fw_recv(q, fw_cqe, sizeof(fw_cqe)) == 0 && n++ < 16)
+			snap_dma_q_progress(q);
+		ASSERT_EQ(i, fw_cqe[0]);
+		ASSERT_EQ(i, fw_cqe[sizeof(fw_cqe) - 1]);
+	}
+	snap_dma_q_flush(q);
+	ASSERT_EQ(0, snap_dma_q_pending_count(q));
+	ASSERT_EQ(0, snap_dma_sw_q_fw_recv(q, fw_cqe, sizeof(fw_cqe)));
+	ASSERT_TRUE(snap_dma_q_empty(q));
+
+	snap_dma_q_destroy(q);
+}
+
+TEST(snap_dma_stat, hist) {
+	struct snap_dma_stat_hist h, h2;
+	int i;
+
+	memset(&h, 0, sizeof(h));
+	ASSERT_EQ(0U, snap_dma_stat_hist_percentile(&h, 50));
+
+	ASSERT_EQ(0U, snap_dma_stat_hist_bucket(0));
+	ASSERT_EQ(1U, snap_dma_stat_hist_bucket(1));
+	ASSERT_EQ(2U, snap_dma_stat_hist_bucket(2));
+	ASSERT_EQ(2U, snap_dma_stat_hist_bucket(3));
+	ASSERT_EQ(11U, snap_dma_stat_hist_bucket(1024));
+	ASSERT_EQ((unsigned)SNAP_DMA_STAT_HIST_BUCKETS - 1,
+		  snap_dma_stat_hist_bucket(~0ULL));
+
+	/* 90 fast and 10 slow samples */
+	for (i = 0; i < 90; i++)
+		snap_dma_stat_hist_add(&h, 100);
+	for (i = 0; i < 10; i++)
+		snap_dma_stat_hist_add(&h, 5000);
+
+	ASSERT_EQ(100U, h.count);
+	ASSERT_EQ(90U * 100 + 10U * 5000, h.sum);
+	ASSERT_EQ(5000U, h.max);
+	ASSERT_EQ(90U, h.buckets[7]);
+	ASSERT_EQ(10U, h.buckets[13]);
+
+	/* upper boundary of the bucket, but never above max */
+	ASSERT_EQ(127U, snap_dma_stat_hist_percentile(&h, 50));
+	ASSERT_EQ(127U, snap_dma_stat_hist_percentile(&h, 90));
+	ASSERT_EQ(5000U, snap_dma_stat_hist_percentile(&h, 91));
+	ASSERT_EQ(5000U, snap_dma_stat_hist_percentile(&h, 100));
+	ASSERT_EQ(127U, snap_dma_stat_hist_percentile(&h, 0));
+
+	memset(&h2, 0, sizeof(h2));
+	snap_dma_stat_hist_add(&h2, 0);
+	snap_dma_stat_hist_add(&h2, 9000);
+	snap_dma_stat_hist_merge(&h, &h2);
+	ASSERT_EQ(102U, h.count);
+	ASSERT_EQ(9000U, h.max);
+	ASSERT_EQ(1U, h.buckets[0]);
+	ASSERT_EQ(1U, h.buckets[14]);
+	ASSERT_EQ(9000U, snap_dma_stat_hist_percentile(&h, 100));
+
+	ASSERT_STREQ("write_short", snap_dma_stat_op_name(SNAP_DMA_STAT_OP_WRITE_SHORT));
+	ASSERT_STREQ("unknown", snap_dma_stat_op_name(SNAP_DMA_STAT_OP_MAX));
+}
+
+TEST_F(SnapDmaSwTest, stats) {
+	struct snap_dma_q *q;
+	const struct snap_dma_q_stats *stats;
+	const struct snap_dma_stat_op_counters *c;
+	struct snap_dma_completion comp;
+	const int delay = 4;
+	int i;
+
+	m_dma_q_attr.tx_qsize = 8;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+	ASSERT_TRUE(snap_dma_q_stats_get(q) == NULL);
+	ASSERT_EQ(0, snap_dma_q_stats_enable(q, true));
+	stats = snap_dma_q_stats_get(q);
+	ASSERT_TRUE(stats);
+	snap_dma_sw_q_set_delay(q, delay);
+
+	comp.func = dma_completion;
+	comp.count = 4;
+	for (i = 0; i < 4; i++)
+		ASSERT_EQ(0, snap_dma_q_write(q, m_lbuf, 512, 0, m_raddr,
+					SW_HOST_MKEY, &comp));
+	for (i = 0; i < 4; i++)
+		ASSERT_EQ(0, snap_dma_q_write_short(q, m_lbuf, 8, m_raddr,
+					SW_HOST_MKEY));
+	ASSERT_EQ(-EAGAIN, snap_dma_q_write_short(q, m_lbuf, 8, m_raddr,
+				SW_HOST_MKEY));
+
+	c = &stats->ops[SNAP_DMA_STAT_OP_WRITE];
+	ASSERT_EQ(4U, c->posted);
+	ASSERT_EQ(4U * 512, c->bytes);
+	ASSERT_EQ(0U, c->inline_posted);
+	ASSERT_EQ(0U, c->completed);
+	c = &stats->ops[SNAP_DMA_STAT_OP_WRITE_SHORT];
+	ASSERT_EQ(4U, c->posted);
+	ASSERT_EQ(4U, c->inline_posted);
+	ASSERT_EQ(1U, c->eagain);
+
+	/* every sw queue operation is a doorbell */
+	ASSERT_EQ(8U, stats->db_batch.count);
+	ASSERT_EQ(8U, stats->db_batch.sum);
+	ASSERT_EQ(1U, stats->db_batch.max);
+
+	progress_until(q, &g_comp_count, 1);
+	snap_dma_q_flush(q);
+	ASSERT_TRUE(snap_dma_q_empty(q));
+
+	c = &stats->ops[SNAP_DMA_STAT_OP_WRITE];
+	ASSERT_EQ(4U, c->completed);
+	ASSERT_EQ(4U, c->latency.count);
+	ASSERT_LE(c->latency.max, c->latency.sum);
+	c = &stats->ops[SNAP_DMA_STAT_OP_WRITE_SHORT];
+	ASSERT_EQ(4U, c->completed);
+	ASSERT_EQ(4U, c->latency.count);
+
+	snap_dma_q_stats_reset(q);
+	ASSERT_EQ(0U, stats->ops[SNAP_DMA_STAT_OP_WRITE].posted);
+	ASSERT_EQ(0U, stats->db_batch.count);
+
+	ASSERT_EQ(0, snap_dma_q_stats_enable(q, false));
+	ASSERT_TRUE(snap_dma_q_stats_get(q) == NULL);
+	snap_dma_q_destroy(q);
+
+	/* enabled by the queue attributes */
+	m_dma_q_attr.stats_enable = true;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+	ASSERT_TRUE(snap_dma_q_stats_get(q) != NULL);
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, post_batch) {
+	struct snap_dma_q *q;
+	struct snap_dma_completion comp;
+	struct snap_dma_op ops[4];
+	int i;
+
+	m_dma_q_attr.tx_qsize = 8;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	/* two writes followed by two reads of what was written */
+	memset(m_rbuf, 0, 4 * m_bsize);
+	for (i = 0; i < 4; i++) {
+		memset(m_lbuf + i * m_bsize, i < 2 ? 0xA0 + i : 0, m_bsize);
+		ops[i].opcode = i < 2 ? SNAP_DMA_OP_WRITE : SNAP_DMA_OP_READ;
+		ops[i].buf = m_lbuf + i * m_bsize;
+		ops[i].len = m_bsize;
+		ops[i].lkey = 0;
+		ops[i].raddr = m_raddr + (i % 2) * m_bsize;
+		ops[i].rkey = SW_HOST_MKEY;
+	}
+
+	for (i = 0; i < 6; i++)
+		ASSERT_EQ(0, snap_dma_q_write(q, m_lbuf, 64, 0, m_raddr + 3 * m_bsize,
+					SW_HOST_MKEY, NULL));
+
+	/* credits are checked for the whole batch */
+	comp.func = dma_completion;
+	comp.count = 1;
+	ASSERT_EQ(-EAGAIN, snap_dma_q_post_batch(q, ops, 4, &comp));
+	ASSERT_EQ(2, q->tx_available);
+	ASSERT_EQ(0, m_rbuf[0]);
+
+	ASSERT_EQ(6, snap_dma_q_progress(q));
+	ASSERT_EQ(0, snap_dma_q_post_batch(q, ops, 4, &comp));
+	ASSERT_EQ(4, q->tx_available);
+	ASSERT_EQ(0, g_comp_count);
+
+	/* completion is called once for the whole batch */
+	progress_until(q, &g_comp_count, 1);
+	ASSERT_EQ(0, comp.count);
+	ASSERT_EQ(8, q->tx_available);
+	ASSERT_EQ((char)0xA0, m_lbuf[2 * m_bsize]);
+	ASSERT_EQ((char)0xA1, m_lbuf[4 * m_bsize - 1]);
+
+	snap_dma_q_destroy(q);
+}
+
+TEST_F(SnapDmaSwTest, post_batch_pending) {
+	struct snap_dma_q *q;
+	struct snap_dma_completion comp;
+	struct snap_dma_op ops[4];
+	int i;
+
+	m_dma_q_attr.tx_qsize = 2;
+	m_dma_q_attr.pending_qsize = 4;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	for (i = 0; i < 4; i++) {
+		ops[i].opcode = SNAP_DMA_OP_WRITE;
+		ops[i].buf = m_lbuf;
+		ops[i].len = 64;
+		ops[i].lkey = 0;
+		ops[i].raddr = m_raddr + i * 64;
+		ops[i].rkey = SW_HOST_MKEY;
+	}
+
+	/* batch does not fit into the send queue, it is deferred */
+	comp.func = dma_completion;
+	comp.count = 1;
+	ASSERT_EQ(0, snap_dma_q_post_batch(q, ops, 4, &comp));
+	ASSERT_EQ(4, snap_dma_q_pending_count(q));
+	ASSERT_EQ(2, q->tx_available);
+
+	/* and there is no room for another one */
+	ASSERT_EQ(-EAGAIN, snap_dma_q_post_batch(q, ops, 1, &comp));
+
+	snap_dma_q_flush(q);
+	ASSERT_EQ(0, snap_dma_q_pending_count(q));
+	ASSERT_EQ(1, g_comp_count);
+	ASSERT_EQ(0, comp.count);
+	ASSERT_TRUE(snap_dma_q_empty(q));
+
+	snap_dma_q_destroy(q);
+}
+
+static uint64_t g_fail_raddr;
+static const struct snap_dma_q_ops *g_orig_ops;
+
+static int fail_write(struct snap_dma_q *q, void *src_buf, size_t len,
+		      uint32_t lkey, uint64_t dstaddr, uint32_t rmkey,
+		      struct snap_dma_completion *comp)
+{
+	if (dstaddr == g_fail_raddr)
+		return -EINVAL;
+	return g_orig_ops->write(q, src_buf, len, lkey, dstaddr, rmkey, comp);
+}
+
+TEST_F(SnapDmaSwTest, post_batch_pending_error) {
+	struct snap_dma_q *q;
+	struct snap_dma_q_ops ops_fail;
+	struct snap_dma_completion comp;
+	struct snap_dma_op ops[4];
+	int i;
+
+	m_dma_q_attr.tx_qsize = 1;
+	m_dma_q_attr.pending_qsize = 4;
+	q = snap_dma_q_create(NULL, &m_dma_q_attr);
+	ASSERT_TRUE(q);
+
+	memset(m_rbuf, 0, 4 * 64);
+	memset(m_lbuf, 0xA5, 64);
+	for (i = 0; i < 4; i++) {
+		ops[i].opcode = SNAP_DMA_OP_WRITE;
+		ops[i].buf = m_lbuf;
+		ops[i].len = 64;
+		ops[i].lkey = 0;
+		ops[i].raddr = m_raddr + i * 64;
+		ops[i].rkey = SW_HOST_MKEY;
+	}
+
+	/* the second piece fails to post, the error must reach the caller */
+	g_orig_ops = q->ops;
+	ops_fail = *q->ops;
+	ops_fail.write = fail_write;
+	q->ops = &ops_fail;
+	g_fail_raddr = ops[1].raddr;
+
+	g_comp_count = 0;
+	comp.func = dma_completion;
+	comp.count = 1;
+	ASSERT_EQ(0, snap_dma_q_post_batch(q, ops, 4, &comp));
+	ASSERT_EQ(4, snap_dma_q_pending_count(q));
+
+	snap_dma_q_flush(q);
+	ASSERT_EQ(0, snap_dma_q_pending_count(q));
+	ASSERT_EQ(1, g_comp_count);
+	ASSERT_EQ(-EINVAL, g_last_comp_status);
+	ASSERT_EQ(0, comp.count);
+	ASSERT_EQ((char)0xA5, m_rbuf[0]);
+	ASSERT_EQ(0, m_rbuf[2 * 64]);
+	ASSERT_EQ(0, m_rbuf[3 * 64]);
+
+	q->ops = g_orig_ops;
+	snap_dma_q_destroy(q);
+}
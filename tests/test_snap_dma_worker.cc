@@ -0,0 +1,717 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <endian.h>
+
+#include <infiniband/verbs.h>
+#include <infiniband/mlx5dv.h>
+
+extern "C" {
+#include "snap_dma.h"
+#include "snap_mb.h"
+
+extern const struct snap_dma_q_ops dv_ops;
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * The worker is built on top of plain memory: cq is always empty, qp
+ * doorbell record and doorbell register are regular variables. It allows
+ * to test doorbell batching and to measure the cost of the worker tx
+ * progress without hardware.
+ */
+
+#define WK_TEST_SQ_SIZE 64
+#define WK_TEST_CQ_SIZE 64
+
+struct wk_test_qp {
+	char sq[WK_TEST_SQ_SIZE * MLX5_SEND_WQE_BB] __attribute__((aligned(64)));
+	struct snap_dv_dma_completion comps[WK_TEST_SQ_SIZE];
+	uint32_t dbr[2];
+	uint64_t bf;
+};
+
+struct wk_test_ctx {
+	struct snap_dma_worker *wk;
+	struct wk_test_qp *qps;
+	struct mlx5_cqe64 *cqes;
+	int n_queues;
+};
+
+static int wk_test_create(struct wk_test_ctx *ctx, int n_queues)
+{
+	struct snap_dma_worker *wk;
+	struct snap_dma_q *q;
+	int i;
+
+	memset(ctx, 0, sizeof(*ctx));
+	/* dma queue hot fields are cacheline aligned */
+	if (posix_memalign((void **)&wk, SNAP_CACHE_LINE_SIZE, sizeof(*wk) +
+			   n_queues * sizeof(struct snap_dma_worker_queue)))
+		return -ENOMEM;
+	memset(wk, 0, sizeof(*wk) + n_queues * sizeof(struct snap_dma_worker_queue));
+	ctx->qps = (struct wk_test_qp *)calloc(n_queues, sizeof(*ctx->qps));
+	ctx->cqes = (struct mlx5_cqe64 *)calloc(WK_TEST_CQ_SIZE, sizeof(*ctx->cqes));
+	if (!ctx->qps || !ctx->cqes)
+		return -ENOMEM;
+
+	ctx->wk = wk;
+	ctx->n_queues = n_queues;
+	wk->max_queues = n_queues;
+	wk->mode = SNAP_DMA_WORKER_MODE_CQ_POOL;
+	wk->active_qs = (uint64_t *)calloc((n_queues + 63) / 64, sizeof(uint64_t));
+	if (!wk->active_qs)
+		return -ENOMEM;
+
+	/* invalid opcode, sw owned: nothing to poll */
+	for (i = 0; i < WK_TEST_CQ_SIZE; i++)
+		ctx->cqes[i].op_own = MLX5_CQE_INVALID << 4;
+	wk->dv_tx_cq.cq_addr = (uintptr_t)ctx->cqes;
+	wk->dv_tx_cq.cqe_cnt = WK_TEST_CQ_SIZE;
+	wk->dv_tx_cq.cqe_size = sizeof(struct mlx5_cqe64);
+
+	for (i = 0; i < n_queues; i++) {
+		wk->queues[i].index = i;
+		wk->queues[i].in_use = true;
+
+		q = &wk->queues[i].q;
+		q->ops = &dv_ops;
+		q->worker = wk;
+		q->tx_elem_size = 16;
+		q->tx_available = WK_TEST_SQ_SIZE;
+		q->sw_qp.mode = SNAP_DMA_Q_MODE_DV;
+		q->sw_qp.dv_qp.db_flag = SNAP_DB_RING_BATCH;
+		q->sw_qp.dv_qp.comps = ctx->qps[i].comps;
+		q->sw_qp.dv_qp.hw_qp.qp_num = i;
+		q->sw_qp.dv_qp.hw_qp.dbr_addr = (uintptr_t)ctx->qps[i].dbr;
+		q->sw_qp.dv_qp.hw_qp.sq.addr = (uintptr_t)ctx->qps[i].sq;
+		q->sw_qp.dv_qp.hw_qp.sq.bf_addr = (uintptr_t)&ctx->qps[i].bf;
+		q->sw_qp.dv_qp.hw_qp.sq.wqe_cnt = WK_TEST_SQ_SIZE;
+		q->sw_qp.dv_qp.hw_qp.sq.tx_db_nc = 1;
+		q->sw_qp.dv_qp.wk_active = &wk->active_qs[i / 64];
+		q->sw_qp.dv_qp.wk_active_mask = 1ULL << (i % 64);
+	}
+
+	return 0;
+}
+
+static void wk_test_destroy(struct wk_test_ctx *ctx)
+{
+	if (ctx->wk)
+		free(ctx->wk->active_qs);
+	free(ctx->wk);
+	free(ctx->qps);
+	free(ctx->cqes);
+}
+
+static bool wk_test_q_is_active(struct snap_dma_worker *wk, int i)
+{
+	return wk->active_qs[i / 64] & (1ULL << (i % 64));
+}
+
+/* pretend that all posted work was completed */
+static void wk_test_q_complete(struct snap_dma_q *q)
+{
+	q->tx_available = q->sw_qp.dv_qp.hw_qp.sq.wqe_cnt;
+	q->sw_qp.dv_qp.n_outstanding = 0;
+}
+
+TEST(snap_dma_worker, ring_pending_doorbells) {
+	struct wk_test_ctx ctx;
+	struct snap_dma_q *q;
+	char data[16];
+	const int n_queues = 130;
+	const int active[] = { 0, 63, 64, 129 };
+	int i, j;
+
+	ASSERT_EQ(0, wk_test_create(&ctx, n_queues));
+	memset(data, 0, sizeof(data));
+
+	for (i = 0; i < n_queues; i++)
+		ASSERT_FALSE(wk_test_q_is_active(ctx.wk, i));
+
+	for (j = 0; j < 4; j++) {
+		q = &ctx.wk->queues[active[j]].q;
+		ASSERT_EQ(0, snap_dma_q_write_short(q, data, sizeof(data), 0, 0));
+		ASSERT_TRUE(q->sw_qp.dv_qp.tx_need_ring_db);
+		/* doorbell is deferred until the worker progress */
+		ASSERT_EQ(0U, ctx.qps[active[j]].dbr[MLX5_SND_DBR]);
+	}
+
+	for (i = 0; i < n_queues; i++) {
+		bool is_active = false;
+
+		for (j = 0; j < 4; j++)
+			is_active |= (i == active[j]);
+		ASSERT_EQ(is_active, wk_test_q_is_active(ctx.wk, i));
+	}
+
+	ASSERT_EQ(0, snap_dma_worker_progress_tx(ctx.wk));
+	for (j = 0; j < 4; j++) {
+		q = &ctx.wk->queues[active[j]].q;
+		ASSERT_FALSE(q->sw_qp.dv_qp.tx_need_ring_db);
+		ASSERT_EQ(htobe32(1), ctx.qps[active[j]].dbr[MLX5_SND_DBR]);
+		ASSERT_NE(0U, ctx.qps[active[j]].bf);
+		ASSERT_EQ(1U, q->sw_qp.dv_qp.stat.tx.total_dbs);
+		/* still has outstanding work */
+		ASSERT_TRUE(wk_test_q_is_active(ctx.wk, active[j]));
+	}
+
+	/* nothing to ring */
+	ASSERT_EQ(0, snap_dma_worker_progress_tx(ctx.wk));
+	for (j = 0; j < 4; j++)
+		ASSERT_EQ(1U, ctx.wk->queues[active[j]].q.sw_qp.dv_qp.stat.tx.total_dbs);
+
+	/* completed queues are removed from the active set */
+	wk_test_q_complete(&ctx.wk->queues[active[1]].q);
+	ASSERT_EQ(0, snap_dma_worker_progress_tx(ctx.wk));
+	for (j = 0; j < 4; j++)
+		ASSERT_EQ(j != 1, wk_test_q_is_active(ctx.wk, active[j]));
+
+	wk_test_destroy(&ctx);
+}
+
+/* doorbell ringing as it was done before the active queue tracking */
+static void wk_test_ring_all_doorbells_scan(struct snap_dma_worker *wk)
+{
+	struct snap_dv_qp *dv_qp;
+	int i;
+
+	for (i = 0; i < wk->max_queues; i++) {
+		dv_qp = &wk->queues[i].q.sw_qp.dv_qp;
+		if (wk->queues[i].in_use && dv_qp->tx_need_ring_db) {
+			snap_memory_cpu_store_fence();
+			((uint32_t *)dv_qp->hw_qp.dbr_addr)[MLX5_SND_DBR] = htobe32(dv_qp->hw_qp.sq.pi);
+		}
+	}
+
+	snap_memory_bus_store_fence();
+
+	for (i = 0; i < wk->max_queues; i++) {
+		dv_qp = &wk->queues[i].q.sw_qp.dv_qp;
+		if (wk->queues[i].in_use && dv_qp->tx_need_ring_db) {
+			dv_qp->tx_need_ring_db = false;
+			*(uint64_t *)(dv_qp->hw_qp.sq.bf_addr) = *(uint64_t *)dv_qp->ctrl;
+			++dv_qp->stat.tx.total_dbs;
+		}
+	}
+}
+
+static double wk_test_now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* returns average time of a single worker tx progress call in ns */
+static double wk_test_bench(struct wk_test_ctx *ctx, int n_active, int n_iters,
+			    bool scan)
+{
+	struct snap_dma_q *q;
+	char data[16];
+	double t, total = 0;
+	int i, j, stride;
+
+	memset(data, 0, sizeof(data));
+	/* spread active queues over the whole worker */
+	stride = ctx->n_queues / n_active;
+
+	for (i = 0; i < n_iters; i++) {
+		for (j = 0; j < n_active; j++) {
+			q = &ctx->wk->queues[j * stride].q;
+			wk_test_q_complete(q);
+			snap_dma_q_write_short(q, data, sizeof(data), 0, 0);
+		}
+
+		t = wk_test_now_ns();
+		if (scan)
+			wk_test_ring_all_doorbells_scan(ctx->wk);
+		else
+			snap_dma_worker_progress_tx(ctx->wk);
+		total += wk_test_now_ns() - t;
+	}
+
+	return total / n_iters;
+}
+
+TEST(snap_dma_worker, progress_tx_bench) {
+	struct wk_test_ctx ctx;
+	const int n_iters = 20000;
+	const int max_active = 4;
+	double t_scan, t_active;
+	int n_queues, n_active;
+
+	printf("%8s %8s %16s %16s\n", "queues", "active", "scan ns/call", "active ns/call");
+	for (n_queues = 1; n_queues <= 1024; n_queues *= 2) {
+		ASSERT_EQ(0, wk_test_create(&ctx, n_queues));
+		n_active = n_queues < max_active ? n_queues : max_active;
+
+		/* warm up */
+		wk_test_bench(&ctx, n_active, 100, false);
+		t_scan = wk_test_bench(&ctx, n_active, n_iters, true);
+		t_active = wk_test_bench(&ctx, n_active, n_iters, false);
+		printf("%8d %8d %16.1f %16.1f\n", n_queues, n_active, t_scan, t_active);
+
+		wk_test_destroy(&ctx);
+	}
+	/* with many idle queues the cost must not be dominated by the scan */
+	EXPECT_LT(t_active, t_scan);
+}
+
+extern "C" {
+int snap_dma_worker_qpn_add(struct snap_dma_worker *wk, uint32_t qpn,
+		struct snap_dma_q *q);
+void snap_dma_worker_qpn_del(struct snap_dma_worker *wk, uint32_t qpn);
+};
+
+#define WK_TEST_SRQ_SIZE 8
+#define WK_TEST_SRQ_STRIDE 32
+#define WK_TEST_RX_ELEM_SIZE 64
+
+struct wk_test_rx {
+	struct snap_dma_q *q;
+	const void *data;
+	uint32_t len;
+};
+
+static struct wk_test_rx g_wk_rx[16];
+static int g_wk_rx_count;
+
+static void wk_test_rx_cb(struct snap_dma_q *q, const void *data,
+		uint32_t data_len, uint32_t imm_data)
+{
+	g_wk_rx[g_wk_rx_count].q = q;
+	g_wk_rx[g_wk_rx_count].data = data;
+	g_wk_rx[g_wk_rx_count].len = data_len;
+	g_wk_rx_count++;
+}
+
+struct wk_test_srq {
+	struct mlx5_cqe64 rx_cqes[2 * WK_TEST_CQ_SIZE];
+	char wqes[WK_TEST_SRQ_SIZE * WK_TEST_SRQ_STRIDE];
+	char rx_buf[WK_TEST_SRQ_SIZE * WK_TEST_RX_ELEM_SIZE];
+	uint32_t dbr;
+	int cq_pi;
+};
+
+static void wk_test_srq_init(struct snap_dma_worker *wk, struct wk_test_srq *s)
+{
+	struct mlx5_wqe_srq_next_seg *next;
+	int i;
+
+	memset(s, 0, sizeof(*s));
+	wk->mode = SNAP_DMA_WORKER_MODE_SRQ;
+
+	/* 128 byte cqes, the cqe64 is in the second half */
+	for (i = 0; i < WK_TEST_CQ_SIZE; i++)
+		s->rx_cqes[2 * i + 1].op_own = MLX5_CQE_INVALID << 4;
+	wk->dv_rx_cq.cq_addr = (uintptr_t)s->rx_cqes;
+	wk->dv_rx_cq.cqe_cnt = WK_TEST_CQ_SIZE;
+	wk->dv_rx_cq.cqe_size = 2 * sizeof(struct mlx5_cqe64);
+
+	/* same layout as the one set up by the libmlx5 */
+	for (i = 0; i < WK_TEST_SRQ_SIZE; i++) {
+		next = (struct mlx5_wqe_srq_next_seg *)(s->wqes + i * WK_TEST_SRQ_STRIDE);
+		next->next_wqe_index = htobe16((i + 1) % WK_TEST_SRQ_SIZE);
+	}
+	wk->dv_srq.addr = (uintptr_t)s->wqes;
+	wk->dv_srq.stride = WK_TEST_SRQ_STRIDE;
+	wk->dv_srq.wqe_cnt = WK_TEST_SRQ_SIZE;
+	wk->dv_srq.dbr = &s->dbr;
+	wk->dv_srq.tail = WK_TEST_SRQ_SIZE - 1;
+	wk->dv_srq.counter = WK_TEST_SRQ_SIZE - 1;
+	wk->dv_srq.rx_buf = s->rx_buf;
+	wk->dv_srq.rx_elem_size = WK_TEST_RX_ELEM_SIZE;
+
+	/* small table to force qpn collisions */
+	wk->qpn_mask = 7;
+	wk->qpn_table = (struct snap_dma_worker_qpn *)calloc(8, sizeof(*wk->qpn_table));
+}
+
+/* generate receive completion, same as hw would do */
+static struct mlx5_cqe64 *wk_test_srq_push_cqe_op(struct wk_test_srq *s,
+		uint8_t opcode, uint32_t qpn, uint16_t wqe_index, uint32_t len)
+{
+	struct mlx5_cqe64 *cqe = &s->rx_cqes[2 * (s->cq_pi % WK_TEST_CQ_SIZE) + 1];
+	uint8_t owner = !!(s->cq_pi & WK_TEST_CQ_SIZE);
+
+	memset(cqe, 0, sizeof(*cqe));
+	cqe->sop_drop_qpn = htobe32(qpn);
+	cqe->wqe_counter = htobe16(wqe_index);
+	cqe->byte_cnt = htobe32(len);
+	cqe->op_own = (opcode << 4) | owner;
+	s->cq_pi++;
+	return cqe;
+}
+
+static void wk_test_srq_push_cqe(struct wk_test_srq *s, uint32_t qpn,
+		uint16_t wqe_index, uint32_t len)
+{
+	wk_test_srq_push_cqe_op(s, MLX5_CQE_RESP_SEND, qpn, wqe_index, len);
+}
+
+static uint16_t wk_test_srq_next(struct wk_test_srq *s, int i)
+{
+	struct mlx5_wqe_srq_next_seg *next;
+
+	next = (struct mlx5_wqe_srq_next_seg *)(s->wqes + i * WK_TEST_SRQ_STRIDE);
+	return be16toh(next->next_wqe_index);
+}
+
+TEST(snap_dma_worker, srq_demux) {
+	struct wk_test_ctx ctx;
+	struct wk_test_srq *s;
+	struct snap_dma_worker *wk;
+	/* 0x10 and 0x18 collide, 0x11 is displaced by 0x18 */
+	const uint32_t qpns[3] = { 0x10, 0x18, 0x11 };
+	int i;
+
+	s = (struct wk_test_srq *)malloc(sizeof(*s));
+	ASSERT_TRUE(s);
+	ASSERT_EQ(0, wk_test_create(&ctx, 3));
+	wk = ctx.wk;
+	wk_test_srq_init(wk, s);
+	ASSERT_TRUE(wk->qpn_table);
+
+	for (i = 0; i < 3; i++) {
+		wk->queues[i].q.rx_cb = wk_test_rx_cb;
+		ASSERT_EQ(0, snap_dma_worker_qpn_add(wk, qpns[i], &wk->queues[i].q));
+	}
+	ASSERT_EQ(-EEXIST, snap_dma_worker_qpn_add(wk, qpns[1], &wk->queues[1].q));
+
+	g_wk_rx_count = 0;
+	ASSERT_EQ(0, snap_dma_worker_progress_rx(wk));
+
+	wk_test_srq_push_cqe(s, qpns[1], 0, 10);
+	wk_test_srq_push_cqe(s, qpns[0], 1, 20);
+	wk_test_srq_push_cqe(s, qpns[2], 2, 30);
+	/* unknown qp, buffer must be reposted anyway */
+	wk_test_srq_push_cqe(s, 0x12, 3, 40);
+
+	ASSERT_EQ(4, snap_dma_worker_progress_rx(wk));
+	ASSERT_EQ(3, g_wk_rx_count);
+	ASSERT_EQ(&wk->queues[1].q, g_wk_rx[0].q);
+	ASSERT_EQ(s->rx_buf, g_wk_rx[0].data);
+	ASSERT_EQ(10U, g_wk_rx[0].len);
+	ASSERT_EQ(&wk->queues[0].q, g_wk_rx[1].q);
+	ASSERT_EQ(s->rx_buf + WK_TEST_RX_ELEM_SIZE, g_wk_rx[1].data);
+	ASSERT_EQ(20U, g_wk_rx[1].len);
+	ASSERT_EQ(&wk->queues[2].q, g_wk_rx[2].q);
+	ASSERT_EQ(s->rx_buf + 2 * WK_TEST_RX_ELEM_SIZE, g_wk_rx[2].data);
+
+	/* consumed wqes are appended to the free list and given back to hw */
+	ASSERT_EQ(WK_TEST_SRQ_SIZE - 1 + 4, wk->dv_srq.counter);
+	ASSERT_EQ(htobe32(WK_TEST_SRQ_SIZE - 1 + 4), s->dbr);
+	ASSERT_EQ(3, wk->dv_srq.tail);
+	ASSERT_EQ(0, wk_test_srq_next(s, WK_TEST_SRQ_SIZE - 1));
+	ASSERT_EQ(1, wk_test_srq_next(s, 0));
+	ASSERT_EQ(2, wk_test_srq_next(s, 1));
+	ASSERT_EQ(3, wk_test_srq_next(s, 2));
+
+	/* remove the head of the collision chain, the rest must be found */
+	snap_dma_worker_qpn_del(wk, qpns[0]);
+	g_wk_rx_count = 0;
+	wk_test_srq_push_cqe(s, qpns[0], 4, 1);
+	wk_test_srq_push_cqe(s, qpns[1], 5, 1);
+	wk_test_srq_push_cqe(s, qpns[2], 6, 1);
+	ASSERT_EQ(3, snap_dma_worker_progress_rx(wk));
+	ASSERT_EQ(2, g_wk_rx_count);
+	ASSERT_EQ(&wk->queues[1].q, g_wk_rx[0].q);
+	ASSERT_EQ(&wk->queues[2].q, g_wk_rx[1].q);
+	ASSERT_EQ(6, wk->dv_srq.tail);
+
+	/* wrap around the srq and the cq several times */
+	for (i = 0; i < 4 * WK_TEST_CQ_SIZE; i++) {
+		uint16_t idx = (i + 7) % WK_TEST_SRQ_SIZE;
+
+		g_wk_rx_count = 0;
+		wk_test_srq_push_cqe(s, qpns[2], idx, 1);
+		ASSERT_EQ(1, snap_dma_worker_progress_rx(wk));
+		ASSERT_EQ(1, g_wk_rx_count);
+		ASSERT_EQ(s->rx_buf + idx * WK_TEST_RX_ELEM_SIZE, g_wk_rx[0].data);
+		ASSERT_EQ(idx, wk->dv_srq.tail);
+	}
+
+	for (i = 1; i < 3; i++)
+		snap_dma_worker_qpn_del(wk, qpns[i]);
+	for (i = 0; i < 8; i++)
+		ASSERT_TRUE(wk->qpn_table[i].q == NULL);
+
+	free(wk->qpn_table);
+	wk_test_destroy(&ctx);
+	free(s);
+}
+
+TEST(snap_dma_worker, srq_error_cqe) {
+	struct wk_test_ctx ctx;
+	struct wk_test_srq *s;
+	struct snap_dma_worker *wk;
+	struct mlx5_err_cqe *ecqe;
+	const uint32_t qpn = 0x10;
+
+	s = (struct wk_test_srq *)malloc(sizeof(*s));
+	ASSERT_TRUE(s);
+	ASSERT_EQ(0, wk_test_create(&ctx, 1));
+	wk = ctx.wk;
+	wk_test_srq_init(wk, s);
+	ASSERT_TRUE(wk->qpn_table);
+	wk->queues[0].q.rx_cb = wk_test_rx_cb;
+	ASSERT_EQ(0, snap_dma_worker_qpn_add(wk, qpn, &wk->queues[0].q));
+
+	/* flushed receive of a destroyed qp, the completions behind it
+	 * must still be delivered */
+	g_wk_rx_count = 0;
+	wk_test_srq_push_cqe(s, qpn, 0, 10);
+	ecqe = (struct mlx5_err_cqe *)wk_test_srq_push_cqe_op(s,
+			MLX5_CQE_RESP_ERR, qpn, 1, 0);
+	ecqe->syndrome = MLX5_CQE_SYNDROME_WR_FLUSH_ERR;
+	wk_test_srq_push_cqe_op(s, MLX5_CQE_RESP_WR_IMM, qpn, 2, 30);
+
+	ASSERT_EQ(3, snap_dma_worker_progress_rx(wk));
+	ASSERT_EQ(2, g_wk_rx_count);
+	ASSERT_EQ(s->rx_buf, g_wk_rx[0].data);
+	ASSERT_EQ(s->rx_buf + 2 * WK_TEST_RX_ELEM_SIZE, g_wk_rx[1].data);
+	ASSERT_EQ(30U, g_wk_rx[1].len);
+
+	/* every wqe, including the failed one, is given back to hw */
+	ASSERT_EQ(WK_TEST_SRQ_SIZE - 1 + 3, wk->dv_srq.counter);
+	ASSERT_EQ(htobe32(WK_TEST_SRQ_SIZE - 1 + 3), s->dbr);
+	ASSERT_EQ(2, wk->dv_srq.tail);
+	ASSERT_EQ(1, wk_test_srq_next(s, 0));
+	ASSERT_EQ(2, wk_test_srq_next(s, 1));
+
+	snap_dma_worker_qpn_del(wk, qpn);
+	free(wk->qpn_table);
+	wk_test_destroy(&ctx);
+	free(s);
+}
+
+static void wk_test_push_tx_cqe(struct wk_test_ctx *ctx, uint32_t q_idx,
+		uint16_t wqe_counter)
+{
+	struct snap_hw_cq *cq = &ctx->wk->dv_tx_cq;
+	/* cq is never full in tests, next cqe to poll is the one to fill */
+	struct mlx5_cqe64 *cqe = &ctx->cqes[cq->ci % WK_TEST_CQ_SIZE];
+	uint8_t owner = !!(cq->ci & WK_TEST_CQ_SIZE);
+
+	cqe->srqn_uidx = htobe32(q_idx);
+	cqe->wqe_counter = htobe16(wqe_counter);
+	cqe->op_own = (MLX5_CQE_REQ << 4) | owner;
+}
+
+static int g_wk_batch_comp_count;
+
+static void wk_test_batch_completion(struct snap_dma_completion *comp, int status)
+{
+	g_wk_batch_comp_count++;
+}
+
+static uint8_t wk_test_wqe_opcode(struct wk_test_ctx *ctx, int q_idx, int i)
+{
+	struct mlx5_wqe_ctrl_seg *ctrl;
+
+	ctrl = (struct mlx5_wqe_ctrl_seg *)(ctx->qps[q_idx].sq + i * MLX5_SEND_WQE_BB);
+	return be32toh(ctrl->opmod_idx_opcode) & 0xff;
+}
+
+TEST(snap_dma_worker, post_batch) {
+	struct wk_test_ctx ctx;
+	struct snap_dma_completion comp;
+	struct snap_dma_op ops[5];
+	struct snap_dv_qp *dv_qp;
+	struct snap_dma_q *q;
+	char buf[5][64];
+	int i;
+
+	ASSERT_EQ(0, wk_test_create(&ctx, 1));
+	q = &ctx.wk->queues[0].q;
+	dv_qp = &q->sw_qp.dv_qp;
+
+	for (i = 0; i < 5; i++) {
+		ops[i].opcode = i < 3 ? SNAP_DMA_OP_WRITE : SNAP_DMA_OP_READ;
+		ops[i].buf = buf[i];
+		ops[i].len = sizeof(buf[i]);
+		ops[i].lkey = 1;
+		ops[i].raddr = 0x1000 + i * sizeof(buf[i]);
+		ops[i].rkey = 2;
+	}
+	g_wk_batch_comp_count = 0;
+	comp.func = wk_test_batch_completion;
+	comp.count = 1;
+
+	ASSERT_EQ(-EINVAL, snap_dma_q_post_batch(q, ops, 0, &comp));
+
+	/* not enough credits for the whole batch, nothing is posted */
+	q->tx_available = 4;
+	ASSERT_EQ(-EAGAIN, snap_dma_q_post_batch(q, ops, 5, &comp));
+	ASSERT_EQ(0, dv_qp->hw_qp.sq.pi);
+	ASSERT_EQ(4, q->tx_available);
+	q->tx_available = WK_TEST_SQ_SIZE;
+
+	ASSERT_EQ(0, snap_dma_q_post_batch(q, ops, 5, &comp));
+	ASSERT_EQ(5, dv_qp->hw_qp.sq.pi);
+	ASSERT_EQ(WK_TEST_SQ_SIZE - 5, q->tx_available);
+	for (i = 0; i < 5; i++)
+		ASSERT_EQ(i < 3 ? MLX5_OPCODE_RDMA_WRITE : MLX5_OPCODE_RDMA_READ,
+			  wk_test_wqe_opcode(&ctx, 0, i));
+	/* only the last wqe carries the completion for the whole batch */
+	for (i = 0; i < 4; i++)
+		ASSERT_TRUE(dv_qp->comps[i].comp == NULL);
+	ASSERT_EQ(&comp, dv_qp->comps[4].comp);
+	ASSERT_EQ(5, dv_qp->comps[4].n_outstanding);
+
+	/* worker queue doorbell is rung once by the progress */
+	ASSERT_EQ(0U, dv_qp->stat.tx.total_dbs);
+	ASSERT_EQ(0, snap_dma_worker_progress_tx(ctx.wk));
+	ASSERT_EQ(1U, dv_qp->stat.tx.total_dbs);
+	ASSERT_EQ(htobe32(5), ctx.qps[0].dbr[MLX5_SND_DBR]);
+
+	wk_test_push_tx_cqe(&ctx, 0, 4);
+	ASSERT_EQ(1, snap_dma_worker_progress_tx(ctx.wk));
+	ASSERT_EQ(1, g_wk_batch_comp_count);
+	ASSERT_EQ(WK_TEST_SQ_SIZE, q->tx_available);
+
+	/* immediate doorbell mode still rings once per batch */
+	dv_qp->db_flag = SNAP_DB_RING_IMM;
+	comp.count = 1;
+	ASSERT_EQ(0, snap_dma_q_post_batch(q, ops, 4, &comp));
+	ASSERT_EQ(SNAP_DB_RING_IMM, dv_qp->db_flag);
+	ASSERT_FALSE(dv_qp->tx_need_ring_db);
+	ASSERT_EQ(2U, dv_qp->stat.tx.total_dbs);
+	ASSERT_EQ(htobe32(9), ctx.qps[0].dbr[MLX5_SND_DBR]);
+
+	wk_test_push_tx_cqe(&ctx, 0, 8);
+	ASSERT_EQ(1, snap_dma_worker_progress_tx(ctx.wk));
+	ASSERT_EQ(2, g_wk_batch_comp_count);
+	ASSERT_EQ(WK_TEST_SQ_SIZE, q->tx_available);
+
+	wk_test_destroy(&ctx);
+}
+
+TEST(snap_dma_worker, stats) {
+	struct wk_test_ctx ctx;
+	struct snap_dma_q_stats stats;
+	const struct snap_dma_q_stats *qstats;
+	struct snap_dma_q *q0, *q1;
+	char data[16];
+	int i;
+
+	ASSERT_EQ(0, wk_test_create(&ctx, 3));
+	memset(data, 0, sizeof(data));
+	q0 = &ctx.wk->queues[0].q;
+	q1 = &ctx.wk->queues[1].q;
+	ASSERT_EQ(0, snap_dma_q_stats_enable(q0, true));
+	ASSERT_EQ(0, snap_dma_q_stats_enable(q1, true));
+
+	for (i = 0; i < 3; i++)
+		ASSERT_EQ(0, snap_dma_q_write_short(q0, data, sizeof(data), 0, 0));
+	ASSERT_EQ(0, snap_dma_q_write_short(q1, data, sizeof(data), 0, 0));
+	/* not counted, the queue has no stats */
+	ASSERT_EQ(0, snap_dma_q_write_short(&ctx.wk->queues[2].q, data,
+					    sizeof(data), 0, 0));
+
+	/* doorbell batch is per queue */
+	ASSERT_EQ(0, snap_dma_worker_progress_tx(ctx.wk));
+	qstats = snap_dma_q_stats_get(q0);
+	ASSERT_EQ(1U, qstats->db_batch.count);
+	ASSERT_EQ(3U, qstats->db_batch.sum);
+	qstats = snap_dma_q_stats_get(q1);
+	ASSERT_EQ(1U, qstats->db_batch.count);
+	ASSERT_EQ(1U, qstats->db_batch.sum);
+
+	/* completions of q0 are accounted by the worker progress */
+	wk_test_q_complete(q0);
+	ASSERT_EQ(0, snap_dma_worker_progress_tx(ctx.wk));
+	qstats = snap_dma_q_stats_get(q0);
+	ASSERT_EQ(3U, qstats->ops[SNAP_DMA_STAT_OP_WRITE_SHORT].completed);
+	ASSERT_EQ(3U, qstats->ops[SNAP_DMA_STAT_OP_WRITE_SHORT].latency.count);
+	qstats = snap_dma_q_stats_get(q1);
+	ASSERT_EQ(0U, qstats->ops[SNAP_DMA_STAT_OP_WRITE_SHORT].completed);
+
+	ASSERT_EQ(2, snap_dma_worker_stats(ctx.wk, &stats));
+	ASSERT_EQ(4U, stats.ops[SNAP_DMA_STAT_OP_WRITE_SHORT].posted);
+	ASSERT_EQ(4U, stats.ops[SNAP_DMA_STAT_OP_WRITE_SHORT].inline_posted);
+	ASSERT_EQ(4U * sizeof(data), stats.ops[SNAP_DMA_STAT_OP_WRITE_SHORT].bytes);
+	ASSERT_EQ(3U, stats.ops[SNAP_DMA_STAT_OP_WRITE_SHORT].completed);
+	ASSERT_EQ(2U, stats.db_batch.count);
+	ASSERT_EQ(4U, stats.db_batch.sum);
+	ASSERT_EQ(3U, stats.db_batch.max);
+
+	snap_dma_q_stats_enable(q0, false);
+	snap_dma_q_stats_enable(q1, false);
+	ASSERT_EQ(0, snap_dma_worker_stats(ctx.wk, &stats));
+	wk_test_destroy(&ctx);
+}
+
+static int g_wk_comp_count;
+
+static void wk_test_dma_completion(struct snap_dma_completion *comp, int status)
+{
+	g_wk_comp_count++;
+}
+
+TEST(snap_dma_worker, single_mode) {
+	struct snap_dma_worker_create_attr wk_attr = {};
+	struct snap_dma_q_create_attr q_attr = {};
+	struct snap_dma_completion comp;
+	struct snap_dma_worker *wk;
+	struct snap_dma_sw_mem *hmem;
+	struct snap_dma_q *q, *q2;
+	char buf[64];
+
+	wk_attr.mode = SNAP_DMA_WORKER_MODE_SINGLE;
+	wk_attr.exp_queue_num = 2;
+	ASSERT_TRUE(snap_dma_worker_create(NULL, &wk_attr) == NULL);
+
+	/* no hw resources are needed for the single mode */
+	wk_attr.exp_queue_num = 1;
+	wk = snap_dma_worker_create(NULL, &wk_attr);
+	ASSERT_TRUE(wk);
+
+	hmem = snap_dma_sw_mem_create(NULL, 4096, 0x1000, 0x11);
+	ASSERT_TRUE(hmem);
+
+	q_attr.mode = SNAP_DMA_Q_MODE_SW;
+	q_attr.tx_qsize = q_attr.rx_qsize = 16;
+	q_attr.tx_elem_size = 16;
+	q_attr.rx_elem_size = 64;
+	q_attr.rx_cb = wk_test_rx_cb;
+	q_attr.wk = wk;
+	q = snap_dma_q_create(NULL, &q_attr);
+	ASSERT_TRUE(q);
+	q2 = snap_dma_q_create(NULL, &q_attr);
+	ASSERT_TRUE(q2 == NULL);
+
+	g_wk_comp_count = 0;
+	comp.func = wk_test_dma_completion;
+	comp.count = 1;
+	memset(buf, 0xAB, sizeof(buf));
+	ASSERT_EQ(0, snap_dma_q_write(q, buf, sizeof(buf), 0, 0x1000, 0x11, &comp));
+	ASSERT_EQ(1, snap_dma_worker_progress_tx(wk));
+	ASSERT_EQ(1, g_wk_comp_count);
+	ASSERT_EQ((char)0xAB, *(char *)snap_dma_sw_mem_addr(hmem, 0x1000 + 63));
+
+	g_wk_rx_count = 0;
+	ASSERT_EQ(0, snap_dma_sw_q_rx_post(q, buf, 32, 0));
+	ASSERT_EQ(1, snap_dma_worker_progress_rx(wk));
+	ASSERT_EQ(1, g_wk_rx_count);
+	ASSERT_EQ(q, g_wk_rx[0].q);
+	ASSERT_EQ(32U, g_wk_rx[0].len);
+
+	ASSERT_EQ(0, snap_dma_q_write_short(q, buf, 8, 0x1000, 0x11));
+	ASSERT_EQ(1, snap_dma_worker_flush(wk));
+
+	snap_dma_q_destroy(q);
+	/* queue slot is free again */
+	ASSERT_EQ(0, snap_dma_worker_progress_rx(wk));
+	q = snap_dma_q_create(NULL, &q_attr);
+	ASSERT_TRUE(q);
+	snap_dma_q_destroy(q);
+
+	snap_dma_sw_mem_destroy(hmem);
+	snap_dma_worker_destroy(wk);
+}
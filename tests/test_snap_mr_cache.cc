@@ -0,0 +1,326 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <infiniband/verbs.h>
+
+extern "C" {
+#include "snap_mr_cache.h"
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * The cache does not touch the memory, so the tests use made up addresses
+ * and fake registration callbacks that only record what was registered.
+ */
+
+#define MRC_TEST_PAGE 4096UL
+#define MRC_TEST_BASE 0x100000000UL
+
+struct mrc_test_mr {
+	uintptr_t addr;
+	size_t len;
+};
+
+struct mrc_test_ctx {
+	int n_reg;
+	int n_dereg;
+	int n_live;
+	bool fail_reg;
+};
+
+static void *mrc_test_reg(void *arg, void *addr, size_t len)
+{
+	struct mrc_test_ctx *ctx = (struct mrc_test_ctx *)arg;
+	struct mrc_test_mr *mr;
+
+	if (ctx->fail_reg)
+		return NULL;
+
+	mr = (struct mrc_test_mr *)malloc(sizeof(*mr));
+	mr->addr = (uintptr_t)addr;
+	mr->len = len;
+	ctx->n_reg++;
+	ctx->n_live++;
+	return mr;
+}
+
+static void mrc_test_dereg(void *arg, void *mr)
+{
+	struct mrc_test_ctx *ctx = (struct mrc_test_ctx *)arg;
+
+	ctx->n_dereg++;
+	ctx->n_live--;
+	free(mr);
+}
+
+static const struct snap_mr_cache_ops mrc_test_ops = {
+	mrc_test_reg,
+	mrc_test_dereg
+};
+
+static struct snap_mr_cache *mrc_test_create(struct mrc_test_ctx *ctx, size_t max_bytes)
+{
+	struct snap_mr_cache_attr attr;
+
+	memset(ctx, 0, sizeof(*ctx));
+	memset(&attr, 0, sizeof(attr));
+	attr.max_bytes = max_bytes;
+	attr.alignment = MRC_TEST_PAGE;
+	attr.ops = &mrc_test_ops;
+	attr.arg = ctx;
+	return snap_mr_cache_create(&attr);
+}
+
+static void *mrc_addr(unsigned long page, unsigned long off = 0)
+{
+	return (void *)(MRC_TEST_BASE + page * MRC_TEST_PAGE + off);
+}
+
+TEST(snap_mr_cache, hit) {
+	struct mrc_test_ctx ctx;
+	struct snap_mr_cache *cache;
+	struct snap_mr_cache_entry *e1, *e2;
+	struct snap_mr_cache_stats st;
+
+	cache = mrc_test_create(&ctx, 1UL << 30);
+	ASSERT_TRUE(cache);
+
+	e1 = snap_mr_cache_get(cache, mrc_addr(0, 100), 1000);
+	ASSERT_TRUE(e1);
+	EXPECT_EQ(1, ctx.n_reg);
+	EXPECT_EQ(MRC_TEST_BASE, e1->start);
+	EXPECT_EQ(MRC_TEST_BASE + MRC_TEST_PAGE, e1->end);
+	EXPECT_EQ(MRC_TEST_BASE, ((struct mrc_test_mr *)e1->mr)->addr);
+
+	/* same page, same registration */
+	e2 = snap_mr_cache_get(cache, mrc_addr(0, 2000), 100);
+	EXPECT_EQ(e1, e2);
+	EXPECT_EQ(1, ctx.n_reg);
+
+	snap_mr_cache_put(e1);
+	snap_mr_cache_put(e2);
+	/* unused but cached */
+	EXPECT_EQ(0, ctx.n_dereg);
+	e1 = snap_mr_cache_get(cache, mrc_addr(0), MRC_TEST_PAGE);
+	EXPECT_EQ(e2, e1);
+	snap_mr_cache_put(e1);
+
+	snap_mr_cache_get_stats(cache, &st);
+	EXPECT_EQ(2U, st.hits);
+	EXPECT_EQ(1U, st.misses);
+	EXPECT_EQ(1U, st.entries);
+	EXPECT_EQ(MRC_TEST_PAGE, st.bytes);
+
+	snap_mr_cache_destroy(cache);
+	EXPECT_EQ(0, ctx.n_live);
+}
+
+TEST(snap_mr_cache, overlap_merge) {
+	struct mrc_test_ctx ctx;
+	struct snap_mr_cache *cache;
+	struct snap_mr_cache_entry *e1, *e2, *e3, *e4;
+	struct snap_mr_cache_stats st;
+
+	cache = mrc_test_create(&ctx, 1UL << 30);
+	ASSERT_TRUE(cache);
+
+	e1 = snap_mr_cache_get(cache, mrc_addr(0), 2 * MRC_TEST_PAGE);
+	e2 = snap_mr_cache_get(cache, mrc_addr(4), 2 * MRC_TEST_PAGE);
+	ASSERT_TRUE(e1 && e2);
+	snap_mr_cache_put(e2);
+
+	/* pages 1..4 overlap both entries: pages 0..5 are registered */
+	e3 = snap_mr_cache_get(cache, mrc_addr(1), 4 * MRC_TEST_PAGE);
+	ASSERT_TRUE(e3);
+	EXPECT_EQ(3, ctx.n_reg);
+	EXPECT_EQ((uintptr_t)mrc_addr(0), e3->start);
+	EXPECT_EQ((uintptr_t)mrc_addr(6), e3->end);
+	/* e2 was not used and is released, e1 is still used */
+	EXPECT_EQ(1, ctx.n_dereg);
+	EXPECT_EQ(2, ctx.n_live);
+	EXPECT_EQ((uintptr_t)mrc_addr(0), ((struct mrc_test_mr *)e1->mr)->addr);
+
+	snap_mr_cache_get_stats(cache, &st);
+	EXPECT_EQ(1U, st.merges);
+	EXPECT_EQ(2U, st.entries);
+
+	/* the merged entry serves lookups of the old ranges */
+	e4 = snap_mr_cache_get(cache, mrc_addr(0), MRC_TEST_PAGE);
+	EXPECT_EQ(e3, e4);
+	snap_mr_cache_put(e4);
+
+	snap_mr_cache_put(e1);
+	EXPECT_EQ(2, ctx.n_dereg);
+	EXPECT_EQ(1, ctx.n_live);
+
+	snap_mr_cache_put(e3);
+	snap_mr_cache_destroy(cache);
+	EXPECT_EQ(0, ctx.n_live);
+}
+
+TEST(snap_mr_cache, lru_eviction) {
+	struct mrc_test_ctx ctx;
+	struct snap_mr_cache *cache;
+	struct snap_mr_cache_entry *e[4];
+	struct snap_mr_cache_stats st;
+	int i;
+
+	cache = mrc_test_create(&ctx, 2 * MRC_TEST_PAGE);
+	ASSERT_TRUE(cache);
+
+	for (i = 0; i < 4; i++) {
+		e[i] = snap_mr_cache_get(cache, mrc_addr(2 * i), 1);
+		ASSERT_TRUE(e[i]);
+	}
+	/* used entries are never evicted, even above the budget */
+	EXPECT_EQ(4, ctx.n_live);
+
+	snap_mr_cache_put(e[1]);
+	snap_mr_cache_put(e[0]);
+	EXPECT_EQ(2, ctx.n_live);
+
+	/* touch e[3] so that e[2] becomes the oldest */
+	snap_mr_cache_put(e[2]);
+	snap_mr_cache_put(e[3]);
+	EXPECT_EQ(2, ctx.n_live);
+	e[3] = snap_mr_cache_get(cache, mrc_addr(6), 1);
+	snap_mr_cache_put(e[3]);
+
+	e[0] = snap_mr_cache_get(cache, mrc_addr(0), 1);
+	ASSERT_TRUE(e[0]);
+	/* page 4 was released, page 6 is still cached */
+	EXPECT_EQ(2, ctx.n_live);
+	e[3] = snap_mr_cache_get(cache, mrc_addr(6), 1);
+	snap_mr_cache_get_stats(cache, &st);
+	EXPECT_EQ(2U, st.hits);
+	EXPECT_EQ(3U, st.evictions);
+	EXPECT_EQ(2 * MRC_TEST_PAGE, st.bytes);
+
+	snap_mr_cache_put(e[0]);
+	snap_mr_cache_put(e[3]);
+	snap_mr_cache_destroy(cache);
+	EXPECT_EQ(0, ctx.n_live);
+}
+
+TEST(snap_mr_cache, invalidate) {
+	struct mrc_test_ctx ctx;
+	struct snap_mr_cache *cache;
+	struct snap_mr_cache_entry *e1, *e2, *e3;
+
+	cache = mrc_test_create(&ctx, 1UL << 30);
+	ASSERT_TRUE(cache);
+
+	e1 = snap_mr_cache_get(cache, mrc_addr(0), 1);
+	e2 = snap_mr_cache_get(cache, mrc_addr(1), 1);
+	ASSERT_TRUE(e1 && e2);
+	snap_mr_cache_put(e1);
+
+	snap_mr_cache_invalidate(cache, mrc_addr(0), 2 * MRC_TEST_PAGE);
+	/* unused entry is released at once, used one on put */
+	EXPECT_EQ(1, ctx.n_dereg);
+	e3 = snap_mr_cache_get(cache, mrc_addr(1), 1);
+	ASSERT_TRUE(e3);
+	EXPECT_NE(e2, e3);
+	EXPECT_EQ(3, ctx.n_reg);
+
+	snap_mr_cache_put(e2);
+	EXPECT_EQ(2, ctx.n_dereg);
+	snap_mr_cache_put(e3);
+
+	/* failed registration is not cached */
+	ctx.fail_reg = true;
+	EXPECT_FALSE(snap_mr_cache_get(cache, mrc_addr(10), 1));
+	ctx.fail_reg = false;
+	e1 = snap_mr_cache_get(cache, mrc_addr(10), 1);
+	ASSERT_TRUE(e1);
+	snap_mr_cache_put(e1);
+
+	snap_mr_cache_destroy(cache);
+	EXPECT_EQ(0, ctx.n_live);
+}
+
+TEST(snap_mr_cache, random) {
+	struct mrc_test_ctx ctx;
+	struct snap_mr_cache *cache;
+	struct snap_mr_cache_entry *e[16] = {};
+	unsigned long page, n;
+	uintptr_t addr;
+	size_t len;
+	int i, j;
+
+	cache = mrc_test_create(&ctx, 64 * MRC_TEST_PAGE);
+	ASSERT_TRUE(cache);
+
+	srand(1);
+	for (i = 0; i < 100000; i++) {
+		j = rand() % 16;
+		if (e[j]) {
+			snap_mr_cache_put(e[j]);
+			e[j] = NULL;
+			continue;
+		}
+
+		page = rand() % 256;
+		n = 1 + rand() % 8;
+		addr = (uintptr_t)mrc_addr(page, rand() % MRC_TEST_PAGE);
+		len = n * MRC_TEST_PAGE - (addr % MRC_TEST_PAGE);
+		if (rand() % 8 == 0) {
+			snap_mr_cache_invalidate(cache, (void *)addr, len);
+			continue;
+		}
+
+		e[j] = snap_mr_cache_get(cache, (void *)addr, len);
+		ASSERT_TRUE(e[j]);
+		ASSERT_LE(e[j]->start, addr);
+		ASSERT_GE(e[j]->end, addr + len);
+		ASSERT_EQ(e[j]->start, ((struct mrc_test_mr *)e[j]->mr)->addr);
+	}
+
+	for (j = 0; j < 16; j++) {
+		if (e[j])
+			snap_mr_cache_put(e[j]);
+	}
+	snap_mr_cache_destroy(cache);
+	EXPECT_EQ(0, ctx.n_live);
+}
+
+static uint64_t mrc_test_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+TEST(snap_mr_cache, lookup_perf) {
+	struct mrc_test_ctx ctx;
+	struct snap_mr_cache *cache;
+	struct snap_mr_cache_entry *e;
+	const int n_bufs = 1024, n_iters = 1000000;
+	uint64_t t;
+	int i;
+
+	cache = mrc_test_create(&ctx, 1UL << 30);
+	ASSERT_TRUE(cache);
+
+	for (i = 0; i < n_bufs; i++) {
+		e = snap_mr_cache_get(cache, mrc_addr(2 * i), MRC_TEST_PAGE);
+		ASSERT_TRUE(e);
+		snap_mr_cache_put(e);
+	}
+
+	t = mrc_test_ns();
+	for (i = 0; i < n_iters; i++) {
+		e = snap_mr_cache_get(cache, mrc_addr(2 * ((i * 7) % n_bufs), 64), 512);
+		snap_mr_cache_put(e);
+	}
+	t = mrc_test_ns() - t;
+
+	EXPECT_EQ(n_bufs, ctx.n_reg);
+	printf("mr cache: %d entries, %.1f ns per get/put\n", n_bufs,
+	       (double)t / n_iters);
+	snap_mr_cache_destroy(cache);
+}
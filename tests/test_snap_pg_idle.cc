@@ -0,0 +1,479 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <vector>
+
+extern "C" {
+#include "snap_poll_groups.h"
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * Idle policy of the poll group threads. The state machine is first driven
+ * with simulated activity traces on a simulated clock, then a real thread
+ * sleeps on eventfds that stand in for the completion channels of the
+ * queues.
+ */
+
+#define PG_IDLE_SIM_PASS_NS   (uint64_t)200
+#define PG_IDLE_SIM_WAKE_NS   (uint64_t)20000
+#define PG_IDLE_SIM_NO_EVENT  UINT64_MAX
+
+static uint64_t pg_idle_test_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t pg_idle_test_cpu_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+struct pg_idle_sim_result {
+	double idle_ratio;
+	uint64_t max_latency;
+	uint64_t sleeps;
+};
+
+class PgIdleSimTest : public ::testing::Test {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	struct snap_pg_ctx m_ctx;
+	struct snap_pg_idle *m_idle;
+	struct snap_pg_idle_attr m_attr;
+	/* arrival times of the commands */
+	std::vector<uint64_t> m_trace;
+	uint64_t m_now;
+
+	void set_idle(int spin, int max_spin, int max_sleep_ms,
+		      int short_sleep_us);
+	void add_trace(uint64_t start, uint64_t gap, uint64_t end);
+	struct pg_idle_sim_result run(uint64_t end);
+};
+
+void PgIdleSimTest::SetUp()
+{
+	ASSERT_EQ(0, snap_pgs_alloc(&m_ctx, 1));
+	m_idle = m_ctx.pgs[0].idle;
+	m_now = 0;
+}
+
+void PgIdleSimTest::TearDown()
+{
+	snap_pgs_free(&m_ctx);
+}
+
+void PgIdleSimTest::set_idle(int spin, int max_spin, int max_sleep_ms,
+			     int short_sleep_us)
+{
+	m_attr.spin = spin;
+	m_attr.max_spin = max_spin;
+	m_attr.max_sleep_ms = max_sleep_ms;
+	m_attr.short_sleep_us = short_sleep_us;
+	snap_pgs_set_idle(&m_ctx, &m_attr);
+}
+
+void PgIdleSimTest::add_trace(uint64_t start, uint64_t gap, uint64_t end)
+{
+	uint64_t t;
+
+	for (t = start; t < end; t += gap)
+		m_trace.push_back(t);
+}
+
+/*
+ * A pass takes PG_IDLE_SIM_PASS_NS and handles the commands that arrived
+ * before it. A sleep ends when a command arrives, the thread takes
+ * PG_IDLE_SIM_WAKE_NS to wake up, or when the longest sleep is over.
+ */
+struct pg_idle_sim_result PgIdleSimTest::run(uint64_t end)
+{
+	struct pg_idle_sim_result res = {};
+	uint64_t start = m_now, slept = 0, next, deadline, wake;
+	uint64_t sleeps = m_idle->sleeps;
+	size_t i = 0;
+	int n;
+
+	while (i < m_trace.size() && m_trace[i] < m_now)
+		i++;
+
+	while (m_now < end) {
+		for (n = 0; i < m_trace.size() && m_trace[i] <= m_now; i++, n++)
+			res.max_latency = std::max(res.max_latency,
+						   m_now + PG_IDLE_SIM_PASS_NS - m_trace[i]);
+		m_now += PG_IDLE_SIM_PASS_NS;
+		if (!snap_pg_idle_pass(m_idle, n))
+			continue;
+
+		/* as in snap_pg_idle_sleep(), a queue with work refuses */
+		m_idle->empty = 0;
+		next = i < m_trace.size() ? m_trace[i] : PG_IDLE_SIM_NO_EVENT;
+		if (next <= m_now)
+			continue;
+		deadline = m_now + m_attr.max_sleep_ms * 1000000ULL;
+		wake = next < deadline ? next + PG_IDLE_SIM_WAKE_NS : deadline;
+		snap_pg_idle_woke(m_idle, wake - m_now, next >= deadline);
+		slept += wake - m_now;
+		m_now = wake;
+	}
+
+	res.idle_ratio = (double)slept / (m_now - start);
+	res.sleeps = m_idle->sleeps - sleeps;
+	return res;
+}
+
+/* a command every 5ms, the thread sleeps between them */
+TEST_F(PgIdleSimTest, sparse) {
+	struct pg_idle_sim_result res;
+
+	set_idle(1000, 64000, 10, 500);
+	add_trace(0, 5000000, 1100000000);
+	res = run(1000000000);
+
+	EXPECT_GT(res.idle_ratio, 0.9);
+	EXPECT_LE(res.max_latency, PG_IDLE_SIM_WAKE_NS + PG_IDLE_SIM_PASS_NS);
+	EXPECT_GE(res.sleeps, 190U);
+	EXPECT_EQ(0U, m_idle->timeouts);
+	EXPECT_EQ(m_attr.spin, m_idle->spin);
+}
+
+/* no idle time, no sleep and no wake-up latency */
+TEST_F(PgIdleSimTest, saturated) {
+	struct pg_idle_sim_result res;
+
+	set_idle(1000, 64000, 10, 500);
+	add_trace(0, 1000, 100000000);
+	res = run(100000000);
+
+	EXPECT_EQ(0U, res.sleeps);
+	EXPECT_EQ(0.0, res.idle_ratio);
+	EXPECT_LE(res.max_latency, 2 * PG_IDLE_SIM_PASS_NS);
+}
+
+/*
+ * Gaps a bit longer than the spin make the thread sleep for a short while
+ * and pay the wake-up latency, so the spin doubles until it covers them.
+ */
+TEST_F(PgIdleSimTest, short_gaps_backoff) {
+	struct pg_idle_sim_result res;
+
+	set_idle(1000, 64000, 10, 500);
+	add_trace(0, 300000, 200000000);
+	res = run(100000000);
+
+	EXPECT_LE(res.sleeps, 2U);
+	EXPECT_EQ(2000, m_idle->spin);
+	EXPECT_GE(m_idle->short_sleeps, 1U);
+
+	/* once adapted, commands do not wait for a wake-up */
+	res = run(200000000);
+	EXPECT_EQ(0U, res.sleeps);
+}
+
+/* after a busy period with short gaps, long gaps bring the spin back */
+TEST_F(PgIdleSimTest, profile_change) {
+	struct pg_idle_sim_result res;
+
+	set_idle(1000, 64000, 10, 500);
+	add_trace(0, 1000000, 100000000);
+	add_trace(100000000, 20000000, 1000000000);
+
+	/* sleeps of about 1ms are long enough, the spin stays */
+	res = run(100000000);
+	EXPECT_EQ(m_attr.spin, m_idle->spin);
+
+	/* sleeps of 10ms time out */
+	res = run(1000000000);
+	EXPECT_GT(res.idle_ratio, 0.95);
+	EXPECT_GT(m_idle->timeouts, 0U);
+	EXPECT_EQ(m_attr.spin, m_idle->spin);
+}
+
+TEST_F(PgIdleSimTest, spin_decays) {
+	set_idle(1000, 64000, 10, 500);
+	add_trace(0, 300000, 10000000);
+	add_trace(10000000, 20000000, 100000000);
+
+	run(10000000);
+	EXPECT_EQ(2000, m_idle->spin);
+	run(100000000);
+	EXPECT_EQ(1000, m_idle->spin);
+}
+
+/* the spin does not grow past its limit, the thread keeps sleeping */
+TEST_F(PgIdleSimTest, max_spin) {
+	struct pg_idle_sim_result res;
+
+	set_idle(1000, 4000, 10, 5000);
+	add_trace(0, 2000000, 300000000);
+	res = run(200000000);
+
+	EXPECT_EQ(4000, m_idle->spin);
+	EXPECT_GT(res.idle_ratio, 0.4);
+	EXPECT_GT(res.sleeps, 90U);
+	EXPECT_LE(res.max_latency, PG_IDLE_SIM_WAKE_NS + PG_IDLE_SIM_PASS_NS);
+}
+
+TEST_F(PgIdleSimTest, disabled) {
+	struct pg_idle_sim_result res;
+
+	set_idle(0, 64000, 10, 500);
+	add_trace(0, 5000000, 100000000);
+	res = run(100000000);
+
+	EXPECT_EQ(0U, res.sleeps);
+	EXPECT_EQ(0.0, res.idle_ratio);
+}
+
+/*
+ * A thread with eventfd queues. The producer counts a command and then
+ * signals the eventfd, the arm callback drains the eventfd and then looks
+ * for commands, so a command is either seen or wakes the thread up.
+ */
+
+#define PG_IDLE_TEST_CMDS 40
+#define PG_IDLE_TEST_GAP_US 5000
+
+struct pg_idle_test_q {
+	struct snap_pg_q_entry pg_q;
+	int efd;
+	uint64_t pending;
+	uint64_t done;
+	uint64_t submitted_ns[PG_IDLE_TEST_CMDS];
+	/* a command comes right after the arm callback looked for one */
+	bool race;
+};
+
+class PgIdleTest : public ::testing::Test {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	struct snap_pg_ctx m_ctx;
+	struct snap_pg *m_pg;
+	struct snap_pg_idle *m_idle;
+	struct pg_idle_test_q m_q;
+	bool m_online;
+	bool m_stop;
+	uint64_t m_max_latency;
+	double m_cpu_ratio;
+
+	void set_idle(int spin, int max_sleep_ms);
+	int pass(void);
+	void submit(void);
+};
+
+static void pg_idle_test_submit(struct pg_idle_test_q *q)
+{
+	uint64_t one = 1;
+	uint64_t i = q->pending;
+
+	q->submitted_ns[i] = pg_idle_test_ns();
+	__atomic_store_n(&q->pending, i + 1, __ATOMIC_RELEASE);
+	ASSERT_EQ((ssize_t)sizeof(one), write(q->efd, &one, sizeof(one)));
+}
+
+static int pg_idle_test_arm(struct snap_pg_q_entry *pg_q)
+{
+	struct pg_idle_test_q *q = (struct pg_idle_test_q *)pg_q;
+	uint64_t val;
+
+	if (read(q->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		return -errno;
+	if (__atomic_load_n(&q->pending, __ATOMIC_ACQUIRE) != q->done)
+		return -EBUSY;
+	if (q->race) {
+		q->race = false;
+		pg_idle_test_submit(q);
+	}
+	return 0;
+}
+
+void PgIdleTest::SetUp()
+{
+	ASSERT_EQ(0, snap_pgs_alloc(&m_ctx, 1));
+	m_pg = &m_ctx.pgs[0];
+	m_idle = m_pg->idle;
+	m_ctx.q_arm = pg_idle_test_arm;
+	memset(&m_q, 0, sizeof(m_q));
+	m_q.efd = eventfd(0, EFD_NONBLOCK);
+	ASSERT_GE(m_q.efd, 0);
+	ASSERT_EQ(0, snap_pg_idle_add_fd(m_idle, m_q.efd));
+	TAILQ_INSERT_TAIL(&m_pg->q_list, &m_q.pg_q, entry);
+	m_online = false;
+	m_stop = false;
+	m_max_latency = 0;
+	m_cpu_ratio = 0;
+}
+
+void PgIdleTest::TearDown()
+{
+	TAILQ_REMOVE(&m_pg->q_list, &m_q.pg_q, entry);
+	snap_pg_idle_del_fd(m_idle, m_q.efd);
+	close(m_q.efd);
+	snap_pgs_free(&m_ctx);
+}
+
+void PgIdleTest::set_idle(int spin, int max_sleep_ms)
+{
+	struct snap_pg_idle_attr attr = {
+		.spin = spin,
+		.max_spin = spin * 64,
+		.max_sleep_ms = max_sleep_ms,
+		.short_sleep_us = 500,
+	};
+
+	snap_pgs_set_idle(&m_ctx, &attr);
+}
+
+int PgIdleTest::pass(void)
+{
+	uint64_t pending, now;
+	int n = 0;
+
+	if (snap_pg_poll_begin(m_pg)) {
+		pending = __atomic_load_n(&m_q.pending, __ATOMIC_ACQUIRE);
+		now = pg_idle_test_ns();
+		for (; m_q.done < pending; m_q.done++, n++)
+			m_max_latency = std::max(m_max_latency,
+						 now - m_q.submitted_ns[m_q.done]);
+	}
+	snap_pg_poll_end(m_pg);
+	return n;
+}
+
+void PgIdleTest::submit(void)
+{
+	pg_idle_test_submit(&m_q);
+}
+
+static void *pg_idle_test_poller(void *arg)
+{
+	PgIdleTest *t = (PgIdleTest *)arg;
+	uint64_t start, cpu;
+
+	if (t->m_online)
+		snap_pg_online(t->m_pg);
+	start = pg_idle_test_ns();
+	cpu = pg_idle_test_cpu_ns();
+	while (!__atomic_load_n(&t->m_stop, __ATOMIC_ACQUIRE)) {
+		if (snap_pg_idle_pass(t->m_idle, t->pass()))
+			snap_pg_idle_sleep(t->m_idle);
+	}
+	t->m_cpu_ratio = (double)(pg_idle_test_cpu_ns() - cpu) /
+			 (pg_idle_test_ns() - start);
+	if (t->m_online)
+		snap_pg_offline(t->m_pg);
+	return NULL;
+}
+
+/* the thread wakes up on the eventfd, long before its sleep is over */
+TEST_F(PgIdleTest, wakeup_latency) {
+	pthread_t poller;
+	int i;
+
+	set_idle(1000, 1000);
+	ASSERT_EQ(0, pthread_create(&poller, NULL, pg_idle_test_poller, this));
+	for (i = 0; i < PG_IDLE_TEST_CMDS; i++) {
+		usleep(PG_IDLE_TEST_GAP_US);
+		submit();
+	}
+	usleep(PG_IDLE_TEST_GAP_US);
+	__atomic_store_n(&m_stop, true, __ATOMIC_RELEASE);
+	snap_pg_idle_kick(m_idle);
+	pthread_join(poller, NULL);
+
+	printf("%lu sleeps, max latency %lu us, cpu %.1f%%\n", m_idle->sleeps,
+	       m_max_latency / 1000, m_cpu_ratio * 100);
+	EXPECT_EQ((uint64_t)PG_IDLE_TEST_CMDS, m_q.done);
+	EXPECT_GE(m_idle->sleeps, (uint64_t)PG_IDLE_TEST_CMDS);
+	EXPECT_EQ(0U, m_idle->timeouts);
+	/* far below the longest sleep of 1s */
+	EXPECT_LT(m_max_latency, 20000000U);
+	EXPECT_LT(m_cpu_ratio, 0.5);
+}
+
+TEST_F(PgIdleTest, timeout) {
+	uint64_t start, slept;
+
+	set_idle(1, 50);
+	/* the kick of snap_pgs_set_idle() */
+	EXPECT_EQ(0, snap_pg_idle_sleep(m_idle));
+
+	start = pg_idle_test_ns();
+	EXPECT_EQ(0, snap_pg_idle_sleep(m_idle));
+	slept = pg_idle_test_ns() - start;
+	EXPECT_GE(slept, 45000000U);
+	EXPECT_LT(slept, 500000000U);
+	EXPECT_EQ(1U, m_idle->timeouts);
+	/* a sleep that timed out does not make the spin longer */
+	EXPECT_EQ(1, m_idle->spin);
+}
+
+/* a command that comes after the queue was armed is not lost */
+TEST_F(PgIdleTest, armed_race) {
+	uint64_t start, slept;
+
+	set_idle(1, 1000);
+	/* the kick of snap_pgs_set_idle() */
+	snap_pg_idle_sleep(m_idle);
+
+	m_q.race = true;
+	start = pg_idle_test_ns();
+	EXPECT_EQ(1, snap_pg_idle_sleep(m_idle));
+	slept = pg_idle_test_ns() - start;
+	EXPECT_LT(slept, 100000000U);
+	EXPECT_EQ(1, pass());
+}
+
+/* a queue with work in flight keeps the thread polling */
+TEST_F(PgIdleTest, refused) {
+	set_idle(1, 1000);
+	submit();
+	EXPECT_TRUE(snap_pg_idle_pass(m_idle, 0));
+	EXPECT_EQ(0, snap_pg_idle_sleep(m_idle));
+	EXPECT_EQ(1U, m_idle->refused);
+	EXPECT_EQ(0U, m_idle->sleeps);
+	EXPECT_FALSE(snap_pg_idle_pass(m_idle, pass()));
+
+	/* and so does a queue that cannot notify */
+	m_ctx.q_arm = NULL;
+	EXPECT_EQ(0, snap_pg_idle_sleep(m_idle));
+	EXPECT_EQ(2U, m_idle->refused);
+}
+
+/* a writer does not wait for the sleep of an online thread to end */
+TEST_F(PgIdleTest, writer_kicks) {
+	pthread_t poller;
+	uint64_t start, took;
+
+	m_online = true;
+	set_idle(10, 10000);
+	ASSERT_EQ(0, pthread_create(&poller, NULL, pg_idle_test_poller, this));
+	usleep(50000);
+	start = pg_idle_test_ns();
+	snap_pg_suspend(m_pg);
+	snap_pg_resume(m_pg);
+	took = pg_idle_test_ns() - start;
+	__atomic_store_n(&m_stop, true, __ATOMIC_RELEASE);
+	snap_pg_idle_kick(m_idle);
+	pthread_join(poller, NULL);
+
+	EXPECT_GE(m_idle->sleeps, 1U);
+	EXPECT_LT(took, 1000000000U);
+}
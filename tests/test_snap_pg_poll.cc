@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+extern "C" {
+#include "snap_dma_stat.h"
+#include "snap_poll_groups.h"
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * Poll group passes against writers that add and remove queues. The
+ * poller checks every queue it walks and updates counters that only a
+ * writer holding the group may read, so a missed exclusion shows up as a
+ * bad queue, a wrong count or, with -fsanitize=thread, as a data race.
+ */
+
+#define PG_POLL_TEST_MAGIC   0x5eed5eed5eedULL
+#define PG_POLL_TEST_WRITERS 4
+#define PG_POLL_TEST_OPS     1000
+#define PG_POLL_TEST_BENCH   1000000
+
+struct pg_poll_test_q {
+	struct snap_pg_q_entry pg_q;
+	uint64_t magic;
+	uint64_t polled;
+};
+
+enum pg_poll_test_mode {
+	PG_POLL_TEST_LOCKED,
+	PG_POLL_TEST_ONLINE,
+	/* goes online and offline while it polls */
+	PG_POLL_TEST_TOGGLE,
+};
+
+class PgPollTest : public ::testing::Test {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	struct snap_pg_ctx m_ctx;
+	struct snap_pg *m_pg;
+	enum pg_poll_test_mode m_mode;
+	bool m_stop;
+	bool m_writer_in;
+	uint64_t m_passes;
+	uint64_t m_polled;
+	uint64_t m_bad;
+	uint64_t m_removed_polled;
+	int m_nqs;
+
+	void stress(enum pg_poll_test_mode mode, int nwriters);
+	void poll_pass(void);
+	uint64_t bench(bool online);
+};
+
+void PgPollTest::SetUp()
+{
+	ASSERT_EQ(0, snap_pgs_alloc(&m_ctx, 1));
+	m_pg = &m_ctx.pgs[0];
+	m_stop = false;
+	m_writer_in = false;
+	m_passes = m_polled = m_bad = m_removed_polled = 0;
+	m_nqs = 0;
+}
+
+void PgPollTest::TearDown()
+{
+	snap_pgs_free(&m_ctx);
+}
+
+void PgPollTest::poll_pass(void)
+{
+	struct snap_pg_q_entry *pg_q;
+	struct pg_poll_test_q *q;
+
+	if (snap_pg_poll_begin(m_pg)) {
+		if (__atomic_load_n(&m_writer_in, __ATOMIC_RELAXED))
+			m_bad++;
+		TAILQ_FOREACH(pg_q, &m_pg->q_list, entry) {
+			q = (struct pg_poll_test_q *)pg_q;
+			if (q->magic != PG_POLL_TEST_MAGIC)
+				m_bad++;
+			q->polled++;
+			m_polled++;
+		}
+	}
+	snap_pg_poll_end(m_pg);
+}
+
+static void *pg_poll_test_poller(void *arg)
+{
+	PgPollTest *t = (PgPollTest *)arg;
+	bool online = t->m_mode == PG_POLL_TEST_ONLINE;
+	uint64_t i;
+
+	if (online)
+		snap_pg_online(t->m_pg);
+	for (i = 0; !__atomic_load_n(&t->m_stop, __ATOMIC_RELAXED); i++) {
+		if (t->m_mode == PG_POLL_TEST_TOGGLE && i % 1000 == 0) {
+			online = !online;
+			if (online)
+				snap_pg_online(t->m_pg);
+			else
+				snap_pg_offline(t->m_pg);
+		}
+		t->poll_pass();
+		/* the test can run with less cpus than threads */
+		if (i % 64 == 0)
+			sched_yield();
+	}
+	if (online)
+		snap_pg_offline(t->m_pg);
+	__atomic_store_n(&t->m_passes, i, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void *pg_poll_test_writer(void *arg)
+{
+	PgPollTest *t = (PgPollTest *)arg;
+	struct pg_poll_test_q *qs[4] = {};
+	struct pg_poll_test_q *q;
+	int i, j;
+
+	for (i = 0; i < PG_POLL_TEST_OPS; i++) {
+		j = i % 4;
+		snap_pg_suspend(t->m_pg);
+		__atomic_store_n(&t->m_writer_in, true, __ATOMIC_RELAXED);
+		if (qs[j]) {
+			TAILQ_REMOVE(&t->m_pg->q_list, &qs[j]->pg_q, entry);
+			t->m_removed_polled += qs[j]->polled;
+			t->m_nqs--;
+		} else {
+			q = (struct pg_poll_test_q *)calloc(1, sizeof(*q));
+			q->magic = PG_POLL_TEST_MAGIC;
+			TAILQ_INSERT_TAIL(&t->m_pg->q_list, &q->pg_q, entry);
+			t->m_nqs++;
+		}
+		__atomic_store_n(&t->m_writer_in, false, __ATOMIC_RELAXED);
+		snap_pg_resume(t->m_pg);
+
+		if (qs[j]) {
+			/* no pass can see the queue anymore */
+			qs[j]->magic = 0;
+			free(qs[j]);
+			qs[j] = NULL;
+		} else {
+			qs[j] = q;
+		}
+		/* let the poller see the queues, even on a single cpu */
+		sched_yield();
+	}
+
+	for (j = 0; j < 4; j++) {
+		if (!qs[j])
+			continue;
+		snap_pg_suspend(t->m_pg);
+		TAILQ_REMOVE(&t->m_pg->q_list, &qs[j]->pg_q, entry);
+		t->m_removed_polled += qs[j]->polled;
+		t->m_nqs--;
+		snap_pg_resume(t->m_pg);
+		free(qs[j]);
+	}
+	return NULL;
+}
+
+void PgPollTest::stress(enum pg_poll_test_mode mode, int nwriters)
+{
+	pthread_t poller, writers[PG_POLL_TEST_WRITERS];
+	int i;
+
+	m_mode = mode;
+	ASSERT_EQ(0, pthread_create(&poller, NULL, pg_poll_test_poller, this));
+	for (i = 0; i < nwriters; i++)
+		ASSERT_EQ(0, pthread_create(&writers[i], NULL,
+					    pg_poll_test_writer, this));
+	for (i = 0; i < nwriters; i++)
+		pthread_join(writers[i], NULL);
+	__atomic_store_n(&m_stop, true, __ATOMIC_RELAXED);
+	pthread_join(poller, NULL);
+
+	EXPECT_EQ(0U, m_bad);
+	EXPECT_EQ(0, m_nqs);
+	EXPECT_TRUE(TAILQ_EMPTY(&m_pg->q_list));
+	/* every poll of a queue was seen by the writer that removed it */
+	EXPECT_EQ(m_polled, m_removed_polled);
+	EXPECT_GT(m_passes, 0U);
+	EXPECT_GT(m_polled, 0U);
+	printf("%lu passes, %lu queue polls\n", m_passes, m_polled);
+}
+
+TEST_F(PgPollTest, stress_locked) {
+	stress(PG_POLL_TEST_LOCKED, PG_POLL_TEST_WRITERS);
+}
+
+TEST_F(PgPollTest, stress_online) {
+	stress(PG_POLL_TEST_ONLINE, PG_POLL_TEST_WRITERS);
+}
+
+TEST_F(PgPollTest, stress_online_offline) {
+	stress(PG_POLL_TEST_TOGGLE, PG_POLL_TEST_WRITERS);
+}
+
+/* the poll group thread changes its own queues */
+TEST_F(PgPollTest, writer_is_poller) {
+	struct pg_poll_test_q q = {};
+
+	q.magic = PG_POLL_TEST_MAGIC;
+	snap_pg_online(m_pg);
+	poll_pass();
+	snap_pg_suspend(m_pg);
+	TAILQ_INSERT_TAIL(&m_pg->q_list, &q.pg_q, entry);
+	snap_pg_resume(m_pg);
+	poll_pass();
+	snap_pg_suspend(m_pg);
+	/* held by the writer, the queues are skipped */
+	EXPECT_FALSE(snap_pg_poll_begin(m_pg));
+	snap_pg_poll_end(m_pg);
+	TAILQ_REMOVE(&m_pg->q_list, &q.pg_q, entry);
+	snap_pg_resume(m_pg);
+	snap_pg_offline(m_pg);
+	EXPECT_EQ(1U, q.polled);
+}
+
+static void *pg_poll_test_suspend(void *arg)
+{
+	PgPollTest *t = (PgPollTest *)arg;
+
+	snap_pg_suspend(t->m_pg);
+	snap_pg_resume(t->m_pg);
+	return NULL;
+}
+
+/* a writer does not wait for a thread that went offline */
+TEST_F(PgPollTest, offline_poller) {
+	pthread_t writer;
+
+	snap_pg_online(m_pg);
+	poll_pass();
+	snap_pg_offline(m_pg);
+	/* would wait forever for a quiescent point if it was online */
+	ASSERT_EQ(0, pthread_create(&writer, NULL, pg_poll_test_suspend, this));
+	pthread_join(writer, NULL);
+}
+
+uint64_t PgPollTest::bench(bool online)
+{
+	uint64_t start, ticks;
+	int i;
+
+	if (online)
+		snap_pg_online(m_pg);
+	for (i = 0; i < 1000; i++)
+		poll_pass();
+	start = snap_dma_stat_ticks();
+	for (i = 0; i < PG_POLL_TEST_BENCH; i++)
+		poll_pass();
+	ticks = snap_dma_stat_ticks() - start;
+	if (online)
+		snap_pg_offline(m_pg);
+	return ticks;
+}
+
+/* cost of a pass over a poll group without queues */
+TEST_F(PgPollTest, empty_pass_cycles) {
+	uint64_t locked, online;
+
+	locked = bench(false);
+	online = bench(true);
+	printf("empty pass: locked %.1f cycles, online %.1f cycles\n",
+	       (double)locked / PG_POLL_TEST_BENCH,
+	       (double)online / PG_POLL_TEST_BENCH);
+	EXPECT_EQ(0U, m_bad);
+	EXPECT_EQ(0U, m_polled);
+}
@@ -0,0 +1,378 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+extern "C" {
+#include "snap_queue.h"
+#include "snap_poll_groups.h"
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * Poll group rebalancing. Poll group threads are simulated in periods of
+ * the rebalance period: every queue gets its synthetic load, a thread
+ * fetches commands while it has time left and completes them in the next
+ * period. A queue that is moving stops fetching, it is moved once its
+ * commands in flight are done, the way the controller does it with the
+ * queue suspend and resume.
+ */
+
+#define PG_TEST_NPGS    4
+#define PG_TEST_NQ      16
+/* ticks of a period, the time a thread has */
+#define PG_TEST_PERIOD  1000000ULL
+/* ticks to fetch and to complete a command */
+#define PG_TEST_FETCH   800
+#define PG_TEST_COMP    200
+#define PG_TEST_CMD     (PG_TEST_FETCH + PG_TEST_COMP)
+
+struct pg_test_q {
+	struct snap_pg_q_entry pg_q;
+	struct snap_pg *pg;
+	/* commands per period */
+	uint64_t rate;
+	uint64_t arrived;
+	uint64_t backlog;
+	uint64_t inflight;
+	uint64_t completed;
+};
+
+class PgRebalanceTest : public ::testing::Test {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	struct snap_pg_ctx m_ctx;
+	struct pg_test_q m_qs[PG_TEST_NQ];
+	uint64_t m_now;
+	uint64_t m_busy[PG_TEST_NPGS];
+	int m_max_migrating;
+
+	void set_policy(int imbalance, int max_migrations, int cooldown);
+	void set_rate(int q, double load);
+	void run(int periods);
+	void drain(void);
+	double imbalance(void);
+	struct pg_test_q *to_q(struct snap_pg_q_entry *pg_q);
+};
+
+void PgRebalanceTest::SetUp()
+{
+	int i;
+
+	ASSERT_EQ(0, snap_pgs_alloc(&m_ctx, PG_TEST_NPGS));
+	memset(m_qs, 0, sizeof(m_qs));
+	for (i = 0; i < PG_TEST_NQ; i++) {
+		m_qs[i].pg = snap_pg_get_next(&m_ctx);
+		TAILQ_INSERT_TAIL(&m_qs[i].pg->q_list, &m_qs[i].pg_q, entry);
+	}
+	/* the clock does not start at 0 */
+	m_now = 12345;
+	m_max_migrating = 0;
+	set_policy(20, 2, 8);
+}
+
+void PgRebalanceTest::TearDown()
+{
+	int i;
+
+	for (i = 0; i < PG_TEST_NQ; i++) {
+		TAILQ_REMOVE(&m_qs[i].pg->q_list, &m_qs[i].pg_q, entry);
+		snap_pg_usage_decrease(m_qs[i].pg->id);
+	}
+	snap_pgs_free(&m_ctx);
+}
+
+void PgRebalanceTest::set_policy(int imbalance, int max_migrations,
+		int cooldown)
+{
+	struct snap_pg_rebalance_attr attr = {};
+
+	attr.period = PG_TEST_PERIOD;
+	attr.imbalance = imbalance;
+	attr.min_busy = 20;
+	attr.cost = PG_TEST_PERIOD / 100;
+	attr.max_migrations = max_migrations;
+	attr.cooldown = cooldown;
+	snap_pgs_set_rebalance(&m_ctx, &attr);
+}
+
+/* load is the part of a thread the queue needs */
+void PgRebalanceTest::set_rate(int q, double load)
+{
+	m_qs[q].rate = load * PG_TEST_PERIOD / PG_TEST_CMD;
+}
+
+struct pg_test_q *PgRebalanceTest::to_q(struct snap_pg_q_entry *pg_q)
+{
+	return (struct pg_test_q *)((char *)pg_q - offsetof(struct pg_test_q, pg_q));
+}
+
+void PgRebalanceTest::run(int periods)
+{
+	struct snap_pg_q_entry *pg_q, *tmp;
+	struct pg_test_q *q;
+	struct snap_pg *pg;
+	uint64_t want, left, n, busy;
+	int i, p;
+
+	for (p = 0; p < periods; p++) {
+		for (i = 0; i < PG_TEST_NQ; i++) {
+			m_qs[i].arrived += m_qs[i].rate;
+			m_qs[i].backlog += m_qs[i].rate;
+		}
+
+		for (i = 0; i < PG_TEST_NPGS; i++) {
+			pg = &m_ctx.pgs[i];
+			m_busy[i] = 0;
+
+			/* commands fetched in the last period complete */
+			want = 0;
+			TAILQ_FOREACH(pg_q, &pg->q_list, entry) {
+				q = to_q(pg_q);
+				ASSERT_EQ(pg, q->pg);
+				busy = q->inflight * PG_TEST_COMP;
+				if (q->inflight)
+					snap_pg_q_account(pg, pg_q, busy, q->inflight);
+				m_busy[i] += busy;
+				q->completed += q->inflight;
+				q->inflight = 0;
+				if (!pg_q->migrate_to)
+					want += q->backlog * PG_TEST_FETCH;
+			}
+
+			/* the time left is shared by the backlog */
+			left = PG_TEST_PERIOD - std::min(m_busy[i], (uint64_t)PG_TEST_PERIOD);
+			TAILQ_FOREACH(pg_q, &pg->q_list, entry) {
+				q = to_q(pg_q);
+				/* a moving queue does not fetch new commands */
+				if (pg_q->migrate_to || !q->backlog)
+					continue;
+				n = want <= left ? q->backlog :
+				    (unsigned __int128)q->backlog * left / want;
+				if (!n)
+					continue;
+				q->backlog -= n;
+				q->inflight += n;
+				busy = n * PG_TEST_FETCH;
+				snap_pg_q_account(pg, pg_q, busy, n);
+				m_busy[i] += busy;
+			}
+		}
+
+		m_now += PG_TEST_PERIOD;
+
+		/* hand off the drained queues */
+		for (i = 0; i < PG_TEST_NPGS; i++) {
+			pg = &m_ctx.pgs[i];
+			SNAP_TAILQ_FOREACH_SAFE(pg_q, &pg->q_list, entry, tmp) {
+				q = to_q(pg_q);
+				if (!pg_q->migrate_to || q->inflight)
+					continue;
+				TAILQ_REMOVE(&pg->q_list, pg_q, entry);
+				snap_pg_usage_decrease(pg->id);
+				q->pg = pg_q->migrate_to;
+				TAILQ_INSERT_TAIL(&q->pg->q_list, pg_q, entry);
+				snap_pg_q_migrated(&m_ctx, pg_q);
+			}
+		}
+
+		if (snap_pgs_sample(&m_ctx, m_now))
+			snap_pgs_rebalance(&m_ctx);
+		m_max_migrating = std::max(m_max_migrating, m_ctx.migrating);
+	}
+}
+
+/* stop the load and check that every command is done exactly once */
+void PgRebalanceTest::drain(void)
+{
+	int i;
+
+	for (i = 0; i < PG_TEST_NQ; i++)
+		set_rate(i, 0);
+	for (i = 0; i < 1000 && m_ctx.migrating; i++)
+		run(1);
+	run(100);
+
+	EXPECT_EQ(0, m_ctx.migrating);
+	for (i = 0; i < PG_TEST_NQ; i++) {
+		EXPECT_EQ(0U, m_qs[i].backlog) << "queue " << i;
+		EXPECT_EQ(0U, m_qs[i].inflight) << "queue " << i;
+		EXPECT_EQ(m_qs[i].arrived, m_qs[i].completed) << "queue " << i;
+	}
+}
+
+/* (max - min) / max of the thread busy time in the last period */
+double PgRebalanceTest::imbalance(void)
+{
+	uint64_t max = 0, min = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < PG_TEST_NPGS; i++) {
+		max = std::max(max, m_busy[i]);
+		min = std::min(min, m_busy[i]);
+	}
+	return max ? (double)(max - min) / max : 0;
+}
+
+/*
+ * Queues are placed round robin, 0 and 4 on the first thread. Two hot
+ * queues overload it while the other threads idle. The best placement
+ * leaves the hot queues alone: 0.45 0.45 0.35 0.35, 22% apart.
+ */
+TEST_F(PgRebalanceTest, hot_queues_converge) {
+	int i;
+
+	for (i = 0; i < PG_TEST_NQ; i++)
+		set_rate(i, 0.05);
+	set_rate(0, 0.45);
+	set_rate(4, 0.45);
+	EXPECT_EQ(m_qs[0].pg, m_qs[4].pg);
+
+	run(1);
+	printf("before: imbalance %.2f\n", imbalance());
+	EXPECT_GT(imbalance(), 0.7);
+
+	run(100);
+	printf("after: imbalance %.2f, %lu migrations\n", imbalance(),
+	       m_ctx.migrations);
+	EXPECT_LE(imbalance(), 0.25);
+	EXPECT_NE(m_qs[0].pg, m_qs[4].pg);
+	EXPECT_LE(m_max_migrating, 2);
+	/* the overloaded thread caught up with its backlog */
+	for (i = 0; i < PG_TEST_NQ; i++)
+		EXPECT_LE(m_qs[i].backlog, m_qs[i].rate) << "queue " << i;
+	drain();
+}
+
+/* once balanced, queues stay where they are */
+TEST_F(PgRebalanceTest, stable) {
+	uint64_t migrations;
+	int i;
+
+	for (i = 0; i < PG_TEST_NQ; i++)
+		set_rate(i, 0.05 + 0.01 * (i % 5));
+	set_rate(0, 0.45);
+	set_rate(4, 0.45);
+	run(100);
+	EXPECT_LE(imbalance(), 0.25);
+
+	migrations = m_ctx.migrations;
+	run(500);
+	EXPECT_EQ(migrations, m_ctx.migrations);
+	drain();
+}
+
+/* the load moves to other queues, the groups follow it */
+TEST_F(PgRebalanceTest, profile_change) {
+	int i;
+
+	for (i = 0; i < PG_TEST_NQ; i++)
+		set_rate(i, 0.04);
+	set_rate(0, 0.3);
+	set_rate(4, 0.3);
+	run(100);
+	EXPECT_LE(imbalance(), 0.25);
+
+	/* the hot queues are now all on one thread */
+	set_rate(0, 0.04);
+	set_rate(4, 0.04);
+	for (i = 0; i < PG_TEST_NQ; i++)
+		if (m_qs[i].pg == m_qs[1].pg && i != 1)
+			break;
+	ASSERT_LT(i, PG_TEST_NQ);
+	set_rate(1, 0.3);
+	set_rate(i, 0.3);
+	run(100);
+	printf("after change: imbalance %.2f, %lu migrations\n", imbalance(),
+	       m_ctx.migrations);
+	EXPECT_LE(imbalance(), 0.25);
+	EXPECT_NE(m_qs[1].pg, m_qs[i].pg);
+	drain();
+}
+
+/* a thread with one hot queue has nothing to give away */
+TEST_F(PgRebalanceTest, single_hot_queue) {
+	int i;
+
+	for (i = 0; i < PG_TEST_NQ; i++)
+		if (m_qs[i].pg == m_qs[0].pg)
+			set_rate(i, 0);
+	set_rate(0, 0.9);
+	run(200);
+	EXPECT_EQ(0U, m_ctx.migrations);
+	drain();
+}
+
+/* a light load is not worth a migration */
+TEST_F(PgRebalanceTest, min_busy) {
+	set_rate(0, 0.08);
+	set_rate(4, 0.08);
+	run(200);
+	EXPECT_EQ(0U, m_ctx.migrations);
+	drain();
+}
+
+/* at most max_migrations queues are moving at a time */
+TEST_F(PgRebalanceTest, budget) {
+	int i;
+
+	set_policy(20, 1, 8);
+	for (i = 0; i < PG_TEST_NQ; i++)
+		set_rate(i, i % PG_TEST_NPGS ? 0.01 : 0.2);
+	run(200);
+	EXPECT_EQ(1, m_max_migrating);
+	EXPECT_GE(m_ctx.migrations, 2U);
+	EXPECT_LE(imbalance(), 0.25);
+	drain();
+}
+
+/* without a policy nothing is sampled or moved */
+TEST_F(PgRebalanceTest, disabled) {
+	struct snap_pg_rebalance_attr attr = {};
+
+	snap_pgs_set_rebalance(&m_ctx, &attr);
+	EXPECT_FALSE(snap_pgs_rebalance_enabled(&m_ctx));
+	set_rate(0, 0.5);
+	set_rate(4, 0.5);
+	run(50);
+	EXPECT_EQ(0, snap_pgs_rebalance(&m_ctx));
+	EXPECT_EQ(0U, m_ctx.migrations);
+	drain();
+}
+
+TEST_F(PgRebalanceTest, cancel) {
+	int i;
+
+	set_rate(0, 0.45);
+	set_rate(4, 0.45);
+	for (i = 0; i < 10 && !m_ctx.migrating; i++)
+		run(1);
+	ASSERT_EQ(1, m_ctx.migrating);
+	ASSERT_TRUE(m_qs[0].pg_q.migrate_to || m_qs[4].pg_q.migrate_to);
+
+	snap_pg_q_migration_cancel(&m_ctx, &m_qs[0].pg_q);
+	snap_pg_q_migration_cancel(&m_ctx, &m_qs[4].pg_q);
+	EXPECT_EQ(0, m_ctx.migrating);
+	EXPECT_EQ(m_qs[0].pg, m_qs[4].pg);
+	/* it is chosen again */
+	run(20);
+	EXPECT_GE(m_ctx.migrations, 1U);
+	EXPECT_NE(m_qs[0].pg, m_qs[4].pg);
+	drain();
+}
+
+/* the controller stops the threads only when a sample period is due */
+TEST_F(PgRebalanceTest, sample_due) {
+	m_ctx.last_sample = 0;
+	EXPECT_TRUE(snap_pgs_sample_due(&m_ctx, m_now));
+	EXPECT_FALSE(snap_pgs_sample(&m_ctx, m_now));
+	EXPECT_FALSE(snap_pgs_sample_due(&m_ctx, m_now));
+	EXPECT_FALSE(snap_pgs_sample_due(&m_ctx, m_now + PG_TEST_PERIOD - 1));
+	EXPECT_FALSE(snap_pgs_sample(&m_ctx, m_now + PG_TEST_PERIOD - 1));
+	EXPECT_TRUE(snap_pgs_sample_due(&m_ctx, m_now + PG_TEST_PERIOD));
+	EXPECT_TRUE(snap_pgs_sample(&m_ctx, m_now + PG_TEST_PERIOD));
+	EXPECT_FALSE(snap_pgs_sample_due(&m_ctx, m_now + PG_TEST_PERIOD));
+}
@@ -0,0 +1,368 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+extern "C" {
+#include "snap_qos.h"
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * Token bucket admission. The clock is simulated, one tick is one
+ * nanosecond, and commands are offered as fast as the limits admit them.
+ * Rates are measured after the initial burst.
+ */
+
+#define QOS_TEST_HZ 1000000000ULL
+
+struct qos_test_stream {
+	struct snap_qos *qos;
+	uint64_t size;		/* bytes per command, 0 for random 4K-128K */
+	uint64_t cmds;
+	uint64_t bytes;
+	uint64_t next_size;
+	uint64_t max_wait;	/* longest time the head command waited */
+	uint64_t wait_start;
+};
+
+static uint64_t qos_test_size(struct qos_test_stream *s)
+{
+	if (!s->next_size)
+		s->next_size = s->size ? s->size : 4096ULL << (rand() % 6);
+	return s->next_size;
+}
+
+/* offer the head command of every stream once per step, for @duration */
+static void qos_test_run(struct qos_test_stream *streams, int n,
+			 uint64_t start, uint64_t duration, uint64_t step)
+{
+	uint64_t now;
+	int i;
+
+	for (i = 0; i < n; i++)
+		streams[i].wait_start = start;
+
+	for (now = start; now < start + duration; now += step) {
+		for (i = 0; i < n; i++) {
+			struct qos_test_stream *s = &streams[i];
+
+			/* all that is admitted in this step */
+			while (snap_qos_admit(s->qos, qos_test_size(s), now)) {
+				s->max_wait = std::max(s->max_wait,
+						       now - s->wait_start);
+				s->wait_start = now;
+				s->cmds++;
+				s->bytes += s->next_size;
+				s->next_size = 0;
+			}
+		}
+	}
+}
+
+/* run until the initial burst is gone, then measure from zero */
+static void qos_test_warmup(struct qos_test_stream *streams, int n)
+{
+	int i;
+
+	qos_test_run(streams, n, 0, QOS_TEST_HZ, 1000);
+	for (i = 0; i < n; i++)
+		streams[i].cmds = streams[i].bytes = streams[i].max_wait = 0;
+}
+
+static void qos_test_limits(struct snap_qos_limits *l, uint64_t iops,
+			    uint64_t bps)
+{
+	memset(l, 0, sizeof(*l));
+	l->iops = iops;
+	l->bps = bps;
+}
+
+TEST(snap_qos, unlimited) {
+	struct snap_qos qos;
+	int i;
+
+	ASSERT_EQ(0, snap_qos_init(&qos, NULL, QOS_TEST_HZ));
+	EXPECT_FALSE(snap_qos_is_limited(&qos));
+	for (i = 0; i < 1000; i++)
+		EXPECT_TRUE(snap_qos_admit(&qos, 1 << 20, 0));
+	EXPECT_EQ(1000U, qos.admitted);
+	snap_qos_destroy(&qos);
+}
+
+/* 10 seconds at 25K IOPS, within 1% */
+TEST(snap_qos, iops_accuracy) {
+	struct snap_qos_limits l;
+	struct snap_qos qos;
+	struct qos_test_stream s = {};
+	double rate;
+
+	ASSERT_EQ(0, snap_qos_init(&qos, NULL, QOS_TEST_HZ));
+	qos_test_limits(&l, 25000, 0);
+	snap_qos_set_limits(&qos, &l, 0);
+	s.qos = &qos;
+	s.size = 4096;
+
+	qos_test_warmup(&s, 1);
+	qos_test_run(&s, 1, QOS_TEST_HZ, 10 * QOS_TEST_HZ, 1000);
+	rate = s.cmds / 10.0;
+	printf("iops limit %lu, admitted %.1f per second\n", l.iops, rate);
+	EXPECT_NEAR(25000.0, rate, 250.0);
+	snap_qos_destroy(&qos);
+}
+
+/* 10 seconds at 200MB/s with random command sizes, within 1% */
+TEST(snap_qos, bps_accuracy) {
+	struct snap_qos_limits l;
+	struct snap_qos qos;
+	struct qos_test_stream s = {};
+	double rate;
+
+	srand(7);
+	ASSERT_EQ(0, snap_qos_init(&qos, NULL, QOS_TEST_HZ));
+	qos_test_limits(&l, 0, 200ULL << 20);
+	snap_qos_set_limits(&qos, &l, 0);
+	s.qos = &qos;
+
+	qos_test_warmup(&s, 1);
+	qos_test_run(&s, 1, QOS_TEST_HZ, 10 * QOS_TEST_HZ, 1000);
+	rate = s.bytes / 10.0;
+	printf("bps limit %lu, admitted %.0f per second, %lu commands\n",
+	       l.bps, rate, s.cmds);
+	EXPECT_NEAR((double)l.bps, rate, l.bps / 100.0);
+	snap_qos_destroy(&qos);
+}
+
+/* both limits, the stricter one wins */
+TEST(snap_qos, both_limits) {
+	struct snap_qos_limits l;
+	struct snap_qos qos;
+	struct qos_test_stream s = {};
+
+	ASSERT_EQ(0, snap_qos_init(&qos, NULL, QOS_TEST_HZ));
+	/* 64K commands, 1000 IOPS would be 64MB/s */
+	qos_test_limits(&l, 1000, 16ULL << 20);
+	snap_qos_set_limits(&qos, &l, 0);
+	s.qos = &qos;
+	s.size = 65536;
+
+	qos_test_warmup(&s, 1);
+	qos_test_run(&s, 1, QOS_TEST_HZ, 10 * QOS_TEST_HZ, 10000);
+	EXPECT_NEAR(256.0, s.cmds / 10.0, 2.56);
+	snap_qos_destroy(&qos);
+}
+
+/* an idle queue gets its burst at once, and no more */
+TEST(snap_qos, burst) {
+	struct snap_qos_limits l;
+	struct snap_qos qos;
+	int n = 0;
+
+	ASSERT_EQ(0, snap_qos_init(&qos, NULL, QOS_TEST_HZ));
+	qos_test_limits(&l, 1000, 0);
+	l.iops_burst = 32;
+	snap_qos_set_limits(&qos, &l, 0);
+
+	/* idle for 10 seconds */
+	while (snap_qos_admit(&qos, 0, 10 * QOS_TEST_HZ))
+		n++;
+	EXPECT_EQ(32, n);
+	EXPECT_EQ(1U, qos.throttled);
+
+	/* one more token after 1ms */
+	EXPECT_FALSE(snap_qos_admit(&qos, 0, 10 * QOS_TEST_HZ + 999999));
+	EXPECT_TRUE(snap_qos_admit(&qos, 0, 10 * QOS_TEST_HZ + 1000000));
+	EXPECT_FALSE(snap_qos_admit(&qos, 0, 10 * QOS_TEST_HZ + 1000000));
+	snap_qos_destroy(&qos);
+}
+
+/* a command larger than the bucket is not blocked forever */
+TEST(snap_qos, large_command) {
+	struct snap_qos_limits l;
+	struct snap_qos qos;
+	struct qos_test_stream s = {};
+
+	ASSERT_EQ(0, snap_qos_init(&qos, NULL, QOS_TEST_HZ));
+	qos_test_limits(&l, 0, 1 << 20);
+	l.bps_burst = 64 << 10;
+	snap_qos_set_limits(&qos, &l, 0);
+	s.qos = &qos;
+	s.size = 256 << 10;
+
+	qos_test_run(&s, 1, 0, 100 * QOS_TEST_HZ, 100000);
+	/* 4 commands per second */
+	EXPECT_NEAR(400.0, (double)s.cmds, 4.0);
+	snap_qos_destroy(&qos);
+}
+
+/* limits change while commands flow */
+TEST(snap_qos, set_limits) {
+	struct snap_qos_limits l;
+	struct snap_qos qos;
+	struct qos_test_stream s = {};
+
+	ASSERT_EQ(0, snap_qos_init(&qos, NULL, QOS_TEST_HZ));
+	qos_test_limits(&l, 10000, 0);
+	snap_qos_set_limits(&qos, &l, 0);
+	s.qos = &qos;
+	s.size = 512;
+
+	qos_test_warmup(&s, 1);
+	qos_test_run(&s, 1, QOS_TEST_HZ, 5 * QOS_TEST_HZ, 1000);
+	EXPECT_NEAR(50000.0, (double)s.cmds, 500.0);
+
+	/* the new limit starts with its own burst, 200 commands */
+	s.cmds = 0;
+	qos_test_limits(&l, 2000, 0);
+	snap_qos_set_limits(&qos, &l, 6 * QOS_TEST_HZ);
+	qos_test_run(&s, 1, 6 * QOS_TEST_HZ, 5 * QOS_TEST_HZ, 1000);
+	EXPECT_NEAR(10200.0, (double)s.cmds, 100.0);
+
+	/* removing the limits admits everything */
+	qos_test_limits(&l, 0, 0);
+	snap_qos_set_limits(&qos, &l, 11 * QOS_TEST_HZ);
+	EXPECT_FALSE(snap_qos_is_limited(&qos));
+	EXPECT_TRUE(snap_qos_admit(&qos, 1 << 30, 11 * QOS_TEST_HZ));
+	snap_qos_destroy(&qos);
+}
+
+/*
+ * Four queues share a controller limit. The first queue is offered
+ * commands first in every step and would take all tokens, still every
+ * queue gets a quarter and none waits long.
+ */
+TEST(snap_qos, ctrl_no_starvation) {
+	const int n_queues = 4;
+	struct snap_qos_limits l;
+	struct snap_qos ctrl, qs[n_queues];
+	struct qos_test_stream s[n_queues];
+	uint64_t total = 0;
+	int i;
+
+	ASSERT_EQ(0, snap_qos_init(&ctrl, NULL, QOS_TEST_HZ));
+	qos_test_limits(&l, 40000, 0);
+	snap_qos_set_limits(&ctrl, &l, 0);
+	memset(s, 0, sizeof(s));
+	for (i = 0; i < n_queues; i++) {
+		ASSERT_EQ(0, snap_qos_init(&qs[i], &ctrl, QOS_TEST_HZ));
+		EXPECT_TRUE(snap_qos_is_limited(&qs[i]));
+		s[i].qos = &qs[i];
+		s[i].size = 4096;
+	}
+
+	qos_test_warmup(s, n_queues);
+	qos_test_run(s, n_queues, QOS_TEST_HZ, 10 * QOS_TEST_HZ, 1000);
+	for (i = 0; i < n_queues; i++) {
+		printf("queue %d: %lu commands, max wait %lu us\n", i,
+		       s[i].cmds, s[i].max_wait / 1000);
+		total += s[i].cmds;
+		EXPECT_NEAR(100000.0, (double)s[i].cmds, 1000.0) << "queue " << i;
+		/* a turn comes every n_queues tokens, 100us */
+		EXPECT_LE(s[i].max_wait, 200000U) << "queue " << i;
+	}
+	EXPECT_NEAR(400000.0, (double)total, 4000.0);
+
+	for (i = 0; i < n_queues; i++)
+		snap_qos_destroy(&qs[i]);
+	snap_qos_destroy(&ctrl);
+}
+
+/*
+ * A queue out of its own tokens does not hold the controller tokens
+ * back from the others.
+ */
+TEST(snap_qos, queue_and_ctrl_limits) {
+	struct snap_qos_limits l;
+	struct snap_qos ctrl, qs[2];
+	struct qos_test_stream s[2];
+	int i;
+
+	ASSERT_EQ(0, snap_qos_init(&ctrl, NULL, QOS_TEST_HZ));
+	qos_test_limits(&l, 10000, 0);
+	snap_qos_set_limits(&ctrl, &l, 0);
+	memset(s, 0, sizeof(s));
+	for (i = 0; i < 2; i++) {
+		ASSERT_EQ(0, snap_qos_init(&qs[i], &ctrl, QOS_TEST_HZ));
+		s[i].qos = &qs[i];
+		s[i].size = 4096;
+	}
+	/* queue 0 is limited to 1000 IOPS, queue 1 takes the rest */
+	qos_test_limits(&l, 1000, 0);
+	snap_qos_set_limits(&qs[0], &l, 0);
+
+	qos_test_warmup(s, 2);
+	qos_test_run(s, 2, QOS_TEST_HZ, 10 * QOS_TEST_HZ, 1000);
+	EXPECT_NEAR(10000.0, (double)s[0].cmds, 100.0);
+	EXPECT_NEAR(90000.0, (double)s[1].cmds, 900.0);
+
+	for (i = 0; i < 2; i++)
+		snap_qos_destroy(&qs[i]);
+	snap_qos_destroy(&ctrl);
+}
+
+/* a destroyed waiting queue does not block its siblings */
+TEST(snap_qos, destroy_waiting) {
+	struct snap_qos_limits l;
+	struct snap_qos ctrl, qs[2];
+	int i;
+
+	ASSERT_EQ(0, snap_qos_init(&ctrl, NULL, QOS_TEST_HZ));
+	qos_test_limits(&l, 1000, 0);
+	l.iops_burst = 1;
+	snap_qos_set_limits(&ctrl, &l, 0);
+	for (i = 0; i < 2; i++)
+		ASSERT_EQ(0, snap_qos_init(&qs[i], &ctrl, QOS_TEST_HZ));
+
+	EXPECT_TRUE(snap_qos_admit(&qs[1], 0, 0));
+	EXPECT_FALSE(snap_qos_admit(&qs[0], 0, 0));
+	EXPECT_TRUE(qs[0].waiting);
+	snap_qos_destroy(&qs[0]);
+	EXPECT_TRUE(TAILQ_EMPTY(&ctrl.waiters));
+
+	EXPECT_TRUE(snap_qos_admit(&qs[1], 0, 1000000));
+	snap_qos_destroy(&qs[1]);
+	snap_qos_destroy(&ctrl);
+}
+
+/* a queue that dropped its waiting commands gives up its turn */
+TEST(snap_qos, cancel_waiting) {
+	struct snap_qos_limits l;
+	struct snap_qos ctrl, qs[2];
+	int i;
+
+	ASSERT_EQ(0, snap_qos_init(&ctrl, NULL, QOS_TEST_HZ));
+	qos_test_limits(&l, 1000, 0);
+	l.iops_burst = 1;
+	snap_qos_set_limits(&ctrl, &l, 0);
+	for (i = 0; i < 2; i++)
+		ASSERT_EQ(0, snap_qos_init(&qs[i], &ctrl, QOS_TEST_HZ));
+
+	EXPECT_TRUE(snap_qos_admit(&qs[1], 0, 0));
+	EXPECT_FALSE(snap_qos_admit(&qs[0], 0, 0));
+	EXPECT_TRUE(qs[0].waiting);
+	/* the turn of queue 0 holds queue 1 back */
+	EXPECT_FALSE(snap_qos_admit(&qs[1], 0, 1000000));
+
+	snap_qos_cancel(&qs[0]);
+	EXPECT_FALSE(qs[0].waiting);
+	EXPECT_EQ(&qs[1], TAILQ_FIRST(&ctrl.waiters));
+	EXPECT_TRUE(snap_qos_admit(&qs[1], 0, 1000000));
+	EXPECT_TRUE(TAILQ_EMPTY(&ctrl.waiters));
+
+	/* cancel without a turn or a parent does nothing */
+	snap_qos_cancel(&qs[0]);
+	snap_qos_cancel(&ctrl);
+
+	for (i = 0; i < 2; i++)
+		snap_qos_destroy(&qs[i]);
+	snap_qos_destroy(&ctrl);
+}
+
+TEST(snap_qos, ticks_hz) {
+	uint64_t hz = snap_qos_ticks_hz();
+
+	EXPECT_GT(hz, 0U);
+	EXPECT_EQ(hz, snap_qos_ticks_hz());
+	printf("qos clock %lu Hz\n", hz);
+}
@@ -0,0 +1,434 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <vector>
+#include <linux/virtio_blk.h>
+
+#include <infiniband/verbs.h>
+
+extern "C" {
+#include "snap_dma.h"
+#include "virtq_common.h"
+#include "snap_virtio_blk_virtq.h"
+#include "snap_blk_dev.h"
+#include "snap_uring_blk_dev.h"
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * The io_uring block device works on a temporary file. Data written through
+ * the device is checked with pread() on the file and the other way around.
+ * The loopback test moves the data between the simulated host memory and
+ * the file like a virtq does, with a software DMA queue and pool buffers.
+ */
+
+#define URING_TEST_BLK_SIZE   4096
+#define URING_TEST_SIZE_B     256
+#define URING_TEST_THREADS    2
+#define URING_TEST_BATCH      8
+#define URING_TEST_HOST_ADDR  0x700000000ULL
+#define URING_TEST_HOST_LEN   (64 * 1024)
+#define URING_TEST_MKEY       0x4567
+
+class UringBlkDevTest : public ::testing::Test {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	char m_path[64];
+	int m_fd;
+	struct snap_blk_dev_attrs m_attrs;
+	struct snap_blk_dev *m_bdev;
+	struct snap_bdev_io_done_ctx m_done_ctx;
+	int m_n_done;
+	int m_errors;
+
+	void open(int pool_bufs);
+	void wait(int n, int thread_id = 0);
+	void fill_file(uint8_t val);
+	bool check_file(uint64_t offset_blocks, uint64_t num_blocks, uint8_t val);
+};
+
+static void uring_test_done(enum snap_bdev_op_status status, void *arg)
+{
+	UringBlkDevTest *t = (UringBlkDevTest *)arg;
+
+	if (status != SNAP_BDEV_OP_SUCCESS)
+		t->m_errors++;
+	t->m_n_done++;
+}
+
+void UringBlkDevTest::SetUp()
+{
+	const char *dir = getenv("TMPDIR");
+
+	snprintf(m_path, sizeof(m_path), "%s/snap_uring_XXXXXX",
+		 dir ? dir : "/tmp");
+	m_fd = mkstemp(m_path);
+	ASSERT_GE(m_fd, 0);
+
+	memset(&m_attrs, 0, sizeof(m_attrs));
+	m_attrs.type = SNAP_BLOCK_DEVICE_URING;
+	m_attrs.size_b = URING_TEST_SIZE_B;
+	m_attrs.blk_size = URING_TEST_BLK_SIZE;
+	m_attrs.uring.path = m_path;
+	m_attrs.uring.direct = true;
+	m_attrs.uring.num_threads = URING_TEST_THREADS;
+	m_attrs.uring.queue_depth = 16;
+	m_done_ctx.cb = uring_test_done;
+	m_done_ctx.user_arg = this;
+	m_bdev = NULL;
+	m_n_done = m_errors = 0;
+}
+
+void UringBlkDevTest::TearDown()
+{
+	if (m_bdev)
+		snap_blk_dev_close(m_bdev);
+	if (m_fd >= 0) {
+		close(m_fd);
+		unlink(m_path);
+	}
+}
+
+void UringBlkDevTest::open(int pool_bufs)
+{
+	m_attrs.uring.pool_bufs = pool_bufs;
+	m_attrs.uring.pool_buf_size = URING_TEST_BLK_SIZE;
+	m_bdev = snap_blk_dev_open("uring_blk", &m_attrs);
+	ASSERT_TRUE(m_bdev);
+	EXPECT_EQ((uint64_t)URING_TEST_SIZE_B, m_bdev->ops.get_num_blocks(m_bdev));
+	EXPECT_EQ((uint32_t)URING_TEST_BLK_SIZE,
+		  m_bdev->ops.get_block_size(m_bdev));
+	printf("%s direct IO\n",
+	       snap_uring_blk_dev_is_direct(m_bdev) ? "with" : "without");
+}
+
+void UringBlkDevTest::wait(int n, int thread_id)
+{
+	int i;
+
+	for (i = 0; i < 1000000 && m_n_done < n; i++)
+		snap_uring_blk_dev_progress(m_bdev, thread_id);
+	ASSERT_EQ(n, m_n_done);
+}
+
+void UringBlkDevTest::fill_file(uint8_t val)
+{
+	std::vector<uint8_t> buf(URING_TEST_SIZE_B * URING_TEST_BLK_SIZE, val);
+
+	ASSERT_EQ((ssize_t)buf.size(), pwrite(m_fd, buf.data(), buf.size(), 0));
+}
+
+bool UringBlkDevTest::check_file(uint64_t offset_blocks, uint64_t num_blocks,
+				 uint8_t val)
+{
+	std::vector<uint8_t> buf(num_blocks * URING_TEST_BLK_SIZE);
+	size_t i;
+
+	if (pread(m_fd, buf.data(), buf.size(),
+		  offset_blocks * URING_TEST_BLK_SIZE) != (ssize_t)buf.size())
+		return false;
+	for (i = 0; i < buf.size(); i++)
+		if (buf[i] != val)
+			return false;
+	return true;
+}
+
+TEST_F(UringBlkDevTest, open_close) {
+	m_attrs.size_b = 0;
+	m_attrs.uring.path = "/nonexistent/snap_uring";
+	EXPECT_FALSE(snap_blk_dev_open("uring_blk", &m_attrs));
+
+	/* without a size the device takes the size of the file */
+	m_attrs.uring.path = m_path;
+	EXPECT_FALSE(snap_blk_dev_open("uring_blk", &m_attrs));
+	ASSERT_EQ(0, ftruncate(m_fd, 16 * URING_TEST_BLK_SIZE));
+	m_bdev = snap_blk_dev_open("uring_blk", &m_attrs);
+	ASSERT_TRUE(m_bdev);
+	EXPECT_EQ(16U, m_bdev->ops.get_num_blocks(m_bdev));
+	EXPECT_FALSE(m_bdev->ops.dma_pool_enabled(m_bdev));
+}
+
+/* the operations queued by a thread are submitted with one system call */
+TEST_F(UringBlkDevTest, batch) {
+	struct snap_uring_blk_dev_stats stats;
+	std::vector<uint8_t *> bufs(URING_TEST_BATCH);
+	std::vector<struct iovec> iovs(URING_TEST_BATCH);
+	int i;
+
+	open(0);
+	for (i = 0; i < URING_TEST_BATCH; i++) {
+		bufs[i] = (uint8_t *)m_bdev->ops.dma_malloc(URING_TEST_BLK_SIZE);
+		ASSERT_TRUE(bufs[i]);
+		memset(bufs[i], i + 1, URING_TEST_BLK_SIZE);
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = URING_TEST_BLK_SIZE;
+		ASSERT_EQ(0, m_bdev->ops.writev_blocks(m_bdev, &iovs[i], 1, i * 2,
+						       1, &m_done_ctx, 0));
+	}
+	ASSERT_EQ(0, snap_uring_blk_dev_get_stats(m_bdev, 0, &stats));
+	EXPECT_EQ(0U, stats.submits);
+	EXPECT_EQ(0, m_n_done);
+
+	wait(URING_TEST_BATCH);
+	ASSERT_EQ(0, snap_uring_blk_dev_get_stats(m_bdev, 0, &stats));
+	EXPECT_EQ(1U, stats.submits);
+	EXPECT_EQ((uint64_t)URING_TEST_BATCH, stats.sqes);
+	EXPECT_EQ((uint64_t)URING_TEST_BATCH, stats.cqes);
+	EXPECT_EQ(0, m_errors);
+	for (i = 0; i < URING_TEST_BATCH; i++) {
+		EXPECT_TRUE(check_file(i * 2, 1, i + 1));
+		EXPECT_TRUE(check_file(i * 2 + 1, 1, 0));
+	}
+
+	/* read them back in one vectored operation */
+	for (i = 0; i < URING_TEST_BATCH; i++)
+		memset(bufs[i], 0xff, URING_TEST_BLK_SIZE);
+	ASSERT_EQ(0, m_bdev->ops.readv_blocks(m_bdev, iovs.data(), 4, 2, 4,
+					      &m_done_ctx, 0));
+	wait(URING_TEST_BATCH + 1);
+	for (i = 0; i < 4; i++)
+		EXPECT_EQ(i % 2 ? 0 : 2 + i / 2, bufs[i][URING_TEST_BLK_SIZE - 1]);
+	EXPECT_EQ(0, m_errors);
+
+	for (i = 0; i < URING_TEST_BATCH; i++)
+		m_bdev->ops.dma_free(bufs[i]);
+}
+
+/*
+ * A full submission queue is submitted to make room. Operations beyond the
+ * completion entries wait in the backlog and are submitted by progress.
+ */
+TEST_F(UringBlkDevTest, queue_full) {
+	struct snap_uring_blk_dev_stats stats;
+	uint8_t *buf;
+	int i, n = 5 * 16;
+
+	open(0);
+	buf = (uint8_t *)m_bdev->ops.dma_malloc(URING_TEST_BLK_SIZE);
+	ASSERT_TRUE(buf);
+	for (i = 0; i < n; i++)
+		ASSERT_EQ(0, m_bdev->ops.read(m_bdev, buf, 0, URING_TEST_BLK_SIZE,
+					      &m_done_ctx, 0));
+	ASSERT_EQ(0, snap_uring_blk_dev_get_stats(m_bdev, 0, &stats));
+	EXPECT_EQ((uint64_t)(n - 32), stats.backlog);
+
+	/* the backlog keeps the order of the later operations */
+	ASSERT_EQ(0, m_bdev->ops.write_zeroes(m_bdev, 0, 1, &m_done_ctx, 0));
+	ASSERT_EQ(0, snap_uring_blk_dev_get_stats(m_bdev, 0, &stats));
+	EXPECT_EQ((uint64_t)(n - 31), stats.backlog);
+
+	wait(n + 1);
+	ASSERT_EQ(0, snap_uring_blk_dev_get_stats(m_bdev, 0, &stats));
+	EXPECT_EQ((uint64_t)(n + 1), stats.sqes);
+	EXPECT_EQ(0, m_errors);
+	m_bdev->ops.dma_free(buf);
+}
+
+TEST_F(UringBlkDevTest, flush_discard_write_zeroes) {
+	fill_file(0x5a);
+	open(0);
+	ASSERT_EQ(0, m_bdev->ops.discard(m_bdev, 4, 8, &m_done_ctx, 0));
+	ASSERT_EQ(0, m_bdev->ops.write_zeroes(m_bdev, 20, 3, &m_done_ctx, 0));
+	ASSERT_EQ(0, m_bdev->ops.flush(m_bdev, 0, URING_TEST_SIZE_B,
+				       &m_done_ctx, 0));
+	wait(3);
+	EXPECT_EQ(0, m_errors);
+
+	EXPECT_TRUE(check_file(0, 4, 0x5a));
+	EXPECT_TRUE(check_file(4, 8, 0));
+	EXPECT_TRUE(check_file(12, 8, 0x5a));
+	EXPECT_TRUE(check_file(20, 3, 0));
+	EXPECT_TRUE(check_file(23, URING_TEST_SIZE_B - 23, 0x5a));
+
+	EXPECT_EQ(-EINVAL, m_bdev->ops.discard(m_bdev, URING_TEST_SIZE_B - 1, 2,
+					       &m_done_ctx, 0));
+	EXPECT_EQ(-EINVAL, m_bdev->ops.flush(m_bdev, 0, 0, &m_done_ctx,
+					     URING_TEST_THREADS));
+}
+
+/* each thread has its own ring */
+TEST_F(UringBlkDevTest, threads) {
+	struct snap_uring_blk_dev_stats stats;
+
+	open(0);
+	ASSERT_EQ(0, m_bdev->ops.flush(m_bdev, 0, 0, &m_done_ctx, 1));
+	for (int i = 0; i < 100; i++)
+		snap_uring_blk_dev_progress(m_bdev, 0);
+	EXPECT_EQ(0, m_n_done);
+	wait(1, 1);
+	ASSERT_EQ(0, snap_uring_blk_dev_get_stats(m_bdev, 0, &stats));
+	EXPECT_EQ(0U, stats.sqes);
+
+	/* without a thread id the operations belong to the first thread */
+	ASSERT_EQ(0, m_bdev->ops.flush(m_bdev, 0, 0, &m_done_ctx, -1));
+	wait(2, 0);
+}
+
+struct uring_test_mem {
+	struct snap_blk_mempool_ctx ctx;
+	void *buf;
+	struct ibv_mr *mr;
+	int ready;
+};
+
+static void uring_test_mem_ready(void *data, struct ibv_mr *mr, void *user)
+{
+	struct uring_test_mem *mem = (struct uring_test_mem *)user;
+
+	mem->buf = data;
+	mem->mr = mr;
+	mem->ready++;
+}
+
+static void uring_test_mem_init(struct uring_test_mem *mem,
+				struct snap_blk_dev *bdev)
+{
+	memset(mem, 0, sizeof(*mem));
+	mem->ctx.ctx = bdev;
+	mem->ctx.user = mem;
+	mem->ctx.callback = uring_test_mem_ready;
+}
+
+struct uring_test_loop {
+	struct snap_dma_completion comp;
+	int n_comps;
+};
+
+static void uring_test_loop_dma_cb(struct snap_dma_completion *self,
+				   int status)
+{
+	struct uring_test_loop *loop = (struct uring_test_loop *)self;
+
+	loop->n_comps++;
+}
+
+static void uring_test_loop_rx_cb(struct snap_dma_q *q, const void *data,
+				  uint32_t data_len, uint32_t imm_data)
+{
+}
+
+/*
+ * Host data is read into a pool buffer, written to the file, read back
+ * into another pool buffer and written to the host, as a virtq would do
+ * for a write and a read command.
+ */
+TEST_F(UringBlkDevTest, loopback) {
+	struct snap_uring_blk_dev_stats stats;
+	struct snap_dma_q_create_attr attr;
+	struct snap_dma_sw_mem *hmem;
+	struct uring_test_mem wmem, rmem;
+	struct uring_test_loop loop;
+	struct snap_dma_q *dma_q;
+	uint8_t *host;
+	size_t len = 4 * URING_TEST_BLK_SIZE, i;
+
+	m_attrs.uring.pool_buf_size = len;
+	m_attrs.uring.pool_bufs = 2;
+	m_bdev = snap_blk_dev_open("uring_blk", &m_attrs);
+	ASSERT_TRUE(m_bdev);
+	ASSERT_TRUE(m_bdev->ops.dma_pool_enabled(m_bdev));
+
+	hmem = snap_dma_sw_mem_create(NULL, URING_TEST_HOST_LEN,
+				      URING_TEST_HOST_ADDR, URING_TEST_MKEY);
+	ASSERT_TRUE(hmem);
+	host = (uint8_t *)snap_dma_sw_mem_addr(hmem, URING_TEST_HOST_ADDR);
+	memset(&attr, 0, sizeof(attr));
+	attr.tx_qsize = attr.rx_qsize = 64;
+	attr.tx_elem_size = 16;
+	attr.rx_elem_size = 64;
+	attr.rx_cb = uring_test_loop_rx_cb;
+	attr.mode = SNAP_DMA_Q_MODE_SW;
+	dma_q = snap_dma_q_create(NULL, &attr);
+	ASSERT_TRUE(dma_q);
+	loop.comp.func = uring_test_loop_dma_cb;
+	loop.n_comps = 0;
+
+	for (i = 0; i < len; i++)
+		host[i] = i * 13;
+	memset(host + len, 0, len);
+
+	/* write command */
+	uring_test_mem_init(&wmem, m_bdev);
+	ASSERT_EQ(0, m_bdev->ops.dma_pool_malloc(len, &wmem.ctx));
+	EXPECT_EQ(0, wmem.ready);
+	EXPECT_EQ(1, snap_uring_blk_dev_progress(m_bdev, 0));
+	ASSERT_EQ(1, wmem.ready);
+	loop.comp.count = 1;
+	ASSERT_EQ(0, snap_dma_q_read(dma_q, wmem.buf, len, 0,
+				     URING_TEST_HOST_ADDR, URING_TEST_MKEY,
+				     &loop.comp));
+	for (i = 0; i < 1000 && loop.n_comps < 1; i++)
+		snap_dma_q_progress(dma_q);
+	ASSERT_EQ(1, loop.n_comps);
+	ASSERT_EQ(0, m_bdev->ops.write(m_bdev, wmem.buf, 8 * URING_TEST_BLK_SIZE,
+				       len, &m_done_ctx, 0));
+	wait(1);
+	m_bdev->ops.dma_pool_free(&wmem.ctx, wmem.buf);
+
+	/* read command */
+	uring_test_mem_init(&rmem, m_bdev);
+	ASSERT_EQ(0, m_bdev->ops.dma_pool_malloc(len, &rmem.ctx));
+	snap_uring_blk_dev_progress(m_bdev, 0);
+	ASSERT_EQ(1, rmem.ready);
+	memset(rmem.buf, 0, len);
+	ASSERT_EQ(0, m_bdev->ops.read(m_bdev, rmem.buf, 8 * URING_TEST_BLK_SIZE,
+				      len, &m_done_ctx, 0));
+	wait(2);
+	loop.comp.count = 1;
+	ASSERT_EQ(0, snap_dma_q_write(dma_q, rmem.buf, len, 0,
+				      URING_TEST_HOST_ADDR + len,
+				      URING_TEST_MKEY, &loop.comp));
+	for (i = 0; i < 1000 && loop.n_comps < 2; i++)
+		snap_dma_q_progress(dma_q);
+	ASSERT_EQ(2, loop.n_comps);
+	m_bdev->ops.dma_pool_free(&rmem.ctx, rmem.buf);
+
+	EXPECT_EQ(0, m_errors);
+	ASSERT_EQ(0, snap_uring_blk_dev_get_stats(m_bdev, 0, &stats));
+	EXPECT_EQ(2U, stats.fixed);
+	EXPECT_EQ(0, memcmp(host, host + len, len));
+	std::vector<uint8_t> file(len);
+	ASSERT_EQ((ssize_t)len, pread(m_fd, file.data(), len,
+				      8 * URING_TEST_BLK_SIZE));
+	EXPECT_EQ(0, memcmp(host, file.data(), len));
+
+	snap_dma_q_destroy(dma_q);
+	snap_dma_sw_mem_destroy(hmem);
+}
+
+/* discard and write zeroes segments of a command reach the file */
+TEST_F(UringBlkDevTest, dwz_segments) {
+	struct virtio_blk_discard_write_zeroes segs[3];
+	struct blk_virtq_dwz_io io;
+	int spb = URING_TEST_BLK_SIZE / 512;
+
+	fill_file(0xc3);
+	open(0);
+	memset(segs, 0, sizeof(segs));
+	segs[0].sector = 2 * spb;
+	segs[0].num_sectors = 2 * spb;
+	segs[1].sector = 10 * spb;
+	segs[1].num_sectors = 1 * spb;
+	segs[2].sector = 30 * spb;
+	segs[2].num_sectors = 5 * spb;
+	ASSERT_EQ(0, blk_virtq_dwz_submit(&io, &m_bdev->ops, m_bdev,
+					  VIRTIO_BLK_T_DISCARD, segs, 3,
+					  &m_done_ctx, 0));
+	/* the command completes once, with its last segment */
+	wait(1);
+	EXPECT_EQ(0, m_errors);
+
+	EXPECT_TRUE(check_file(0, 2, 0xc3));
+	EXPECT_TRUE(check_file(2, 2, 0));
+	EXPECT_TRUE(check_file(4, 6, 0xc3));
+	EXPECT_TRUE(check_file(10, 1, 0));
+	EXPECT_TRUE(check_file(11, 19, 0xc3));
+	EXPECT_TRUE(check_file(30, 5, 0));
+	EXPECT_TRUE(check_file(35, URING_TEST_SIZE_B - 35, 0xc3));
+}
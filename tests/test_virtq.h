@@ -0,0 +1,81 @@
+#ifndef TEST_VIRTQ_H
+#define TEST_VIRTQ_H
+
+#include <string.h>
+
+extern "C" {
+#include "snap_dma.h"
+#include "virtq_common.h"
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * Common fixture of the virtq_common tests. The host memory is simulated
+ * with a snap_dma_sw_mem region, it is accessed through a SNAP_DMA_Q_MODE_SW
+ * dma queue. The queue private context is wired by hand, without a
+ * controller or a hw virtq.
+ */
+
+static inline void virtq_test_rx_cb(struct snap_dma_q *q, const void *data,
+		uint32_t data_len, uint32_t imm_data)
+{
+}
+
+class VirtqTest : public ::testing::Test {
+public:
+	struct snap_dma_sw_mem *m_hmem;
+	struct snap_dma_q *m_dma_q;
+	struct virtq_common_ctx m_vq_ctx;
+	struct virtq_priv m_priv;
+	struct snap_virtio_common_queue_attr m_qattr;
+
+	/*
+	 * Create host_len bytes of host memory at host_addr and a dma queue of
+	 * dma_qsize entries. Call with ASSERT_NO_FATAL_FAILURE().
+	 */
+	void virtq_setup(uint64_t host_addr, size_t host_len, uint32_t mkey,
+			 int dma_qsize, bool stats_enable)
+	{
+		struct snap_dma_q_create_attr attr;
+
+		m_dma_q = NULL;
+		m_hmem = snap_dma_sw_mem_create(NULL, host_len, host_addr, mkey);
+		ASSERT_TRUE(m_hmem);
+
+		memset(&attr, 0, sizeof(attr));
+		attr.tx_qsize = attr.rx_qsize = dma_qsize;
+		attr.tx_elem_size = 16;
+		attr.rx_elem_size = 64;
+		attr.rx_cb = virtq_test_rx_cb;
+		attr.mode = SNAP_DMA_Q_MODE_SW;
+		attr.stats_enable = stats_enable;
+		m_dma_q = snap_dma_q_create(NULL, &attr);
+		ASSERT_TRUE(m_dma_q);
+
+		memset(&m_vq_ctx, 0, sizeof(m_vq_ctx));
+		memset(&m_priv, 0, sizeof(m_priv));
+		memset(&m_qattr, 0, sizeof(m_qattr));
+		m_qattr.vattr.dma_mkey = mkey;
+		m_vq_ctx.priv = &m_priv;
+		m_priv.vq_ctx = &m_vq_ctx;
+		m_priv.vattr = &m_qattr.vattr;
+		m_priv.dma_q = m_dma_q;
+		m_priv.swq_state = SW_VIRTQ_RUNNING;
+	}
+
+	void virtq_teardown()
+	{
+		if (m_dma_q)
+			snap_dma_q_destroy(m_dma_q);
+		if (m_hmem)
+			snap_dma_sw_mem_destroy(m_hmem);
+	}
+
+	void *host_mem(uint64_t addr)
+	{
+		return snap_dma_sw_mem_addr(m_hmem, addr);
+	}
+};
+
+#endif
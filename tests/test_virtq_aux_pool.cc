@@ -0,0 +1,183 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/virtio_ring.h>
+
+#include <infiniband/verbs.h>
+
+extern "C" {
+#include "virtq_common.h"
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * Descriptor blocks of long chains. Memory is registered by a malloc backed
+ * stub, so that registrations can be counted without a device.
+ */
+
+#define AUX_TEST_Q_SIZE     256
+#define AUX_TEST_BLOCK_SIZE (16 + AUX_TEST_Q_SIZE * sizeof(struct vring_desc))
+
+struct aux_test_ctx {
+	int n_reg;
+	int n_dereg;
+	uint32_t next_key;
+};
+
+static struct ibv_mr *aux_test_reg(void *arg, void *addr, size_t len)
+{
+	struct aux_test_ctx *ctx = (struct aux_test_ctx *)arg;
+	struct ibv_mr *mr;
+
+	mr = (struct ibv_mr *)calloc(1, sizeof(*mr));
+	if (!mr)
+		return NULL;
+
+	mr->addr = addr;
+	mr->length = len;
+	mr->lkey = ++ctx->next_key;
+	ctx->n_reg++;
+	return mr;
+}
+
+static void aux_test_dereg(void *arg, struct ibv_mr *mr)
+{
+	struct aux_test_ctx *ctx = (struct aux_test_ctx *)arg;
+
+	ctx->n_dereg++;
+	free(mr);
+}
+
+static const struct snap_buf_pool_ops aux_test_ops = {
+	aux_test_reg,
+	aux_test_dereg
+};
+
+static int aux_test_pool_init(struct virtq_aux_pool *pool,
+		struct aux_test_ctx *ctx, int n_init, int max_free)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	return virtq_aux_pool_init(pool, NULL, AUX_TEST_BLOCK_SIZE, n_init,
+				   max_free, &aux_test_ops, ctx);
+}
+
+TEST(virtq_aux_pool, init_destroy) {
+	struct virtq_aux_pool pool;
+	struct aux_test_ctx ctx;
+
+	ASSERT_EQ(0, aux_test_pool_init(&pool, &ctx, 4, 16));
+	EXPECT_EQ(4, ctx.n_reg);
+	EXPECT_EQ(4, pool.n_free);
+	virtq_aux_pool_destroy(&pool);
+	EXPECT_EQ(4, ctx.n_dereg);
+
+	/* upfront blocks are bounded by the cap */
+	ASSERT_EQ(0, aux_test_pool_init(&pool, &ctx, 4, 2));
+	EXPECT_EQ(2, ctx.n_reg);
+	virtq_aux_pool_destroy(&pool);
+	EXPECT_EQ(2, ctx.n_dereg);
+}
+
+/* blocks above the cap are registered and released on every use */
+TEST(virtq_aux_pool, cap) {
+	struct virtq_aux_pool pool;
+	struct aux_test_ctx ctx;
+	struct ibv_mr *mrs[4];
+	void *blocks[4];
+	int i;
+
+	ASSERT_EQ(0, aux_test_pool_init(&pool, &ctx, 1, 2));
+	for (i = 0; i < 4; i++) {
+		blocks[i] = virtq_aux_pool_get(&pool, &mrs[i]);
+		ASSERT_TRUE(blocks[i]);
+		ASSERT_EQ(blocks[i], mrs[i]->addr);
+		ASSERT_EQ(AUX_TEST_BLOCK_SIZE, mrs[i]->length);
+		memset(blocks[i], i, AUX_TEST_BLOCK_SIZE);
+	}
+	EXPECT_EQ(4, ctx.n_reg);
+	EXPECT_EQ(3U, pool.misses);
+
+	for (i = 0; i < 4; i++)
+		virtq_aux_pool_put(&pool, blocks[i], mrs[i]);
+	EXPECT_EQ(2, pool.n_free);
+	EXPECT_EQ(2, ctx.n_dereg);
+
+	virtq_aux_pool_destroy(&pool);
+	EXPECT_EQ(ctx.n_reg, ctx.n_dereg);
+}
+
+/* pooling disabled, every long chain registers its block */
+TEST(virtq_aux_pool, disabled) {
+	struct virtq_aux_pool pool;
+	struct aux_test_ctx ctx;
+	struct ibv_mr *mr;
+	void *block;
+	int i;
+
+	ASSERT_EQ(0, aux_test_pool_init(&pool, &ctx, 2, 0));
+	for (i = 0; i < 10; i++) {
+		block = virtq_aux_pool_get(&pool, &mr);
+		ASSERT_TRUE(block);
+		virtq_aux_pool_put(&pool, block, mr);
+	}
+	EXPECT_EQ(10, ctx.n_reg);
+	EXPECT_EQ(10, ctx.n_dereg);
+	virtq_aux_pool_destroy(&pool);
+}
+
+/*
+ * Commands complete out of order, a quarter of them carry a long chain.
+ * Memory is registered only when more long chains than ever before are in
+ * flight, and it is never released while the queue runs.
+ */
+TEST(virtq_aux_pool, long_chain_traffic) {
+	const int n_iters = 100000, n_inflight = 64;
+	struct virtq_aux_pool pool;
+	struct aux_test_ctx ctx;
+	struct ibv_mr *mrs[n_inflight];
+	void *blocks[n_inflight];
+	int i, j, n_reg, max_long = 0, n_long = 0;
+
+	srand(3);
+	ASSERT_EQ(0, aux_test_pool_init(&pool, &ctx, SNAP_VIRTQ_AUX_POOL_INIT,
+					n_inflight));
+	memset(blocks, 0, sizeof(blocks));
+
+	for (i = 0; i < n_iters; i++) {
+		/* complete a random command */
+		j = rand() % n_inflight;
+		if (blocks[j]) {
+			virtq_aux_pool_put(&pool, blocks[j], mrs[j]);
+			blocks[j] = NULL;
+			n_long--;
+		}
+
+		/* and fetch a new one in its slot */
+		if (rand() % 4)
+			continue;
+
+		n_reg = ctx.n_reg;
+		blocks[j] = virtq_aux_pool_get(&pool, &mrs[j]);
+		ASSERT_TRUE(blocks[j]);
+		((struct vring_desc *)((uint8_t *)blocks[j] + 16))[AUX_TEST_Q_SIZE - 1].len = i;
+		n_long++;
+		if (n_long > snap_max(max_long, SNAP_VIRTQ_AUX_POOL_INIT))
+			ASSERT_EQ(n_reg + 1, ctx.n_reg) << "iteration " << i;
+		else
+			ASSERT_EQ(n_reg, ctx.n_reg) << "iteration " << i;
+		max_long = snap_max(max_long, n_long);
+		ASSERT_EQ(0, ctx.n_dereg);
+	}
+
+	printf("%d iterations, %lu long chains, %lu misses, max %d in flight\n",
+	       n_iters, pool.gets, pool.misses, max_long);
+	EXPECT_EQ(max_long, ctx.n_reg);
+	EXPECT_EQ((uint64_t)(max_long - SNAP_VIRTQ_AUX_POOL_INIT), pool.misses);
+
+	for (j = 0; j < n_inflight; j++)
+		if (blocks[j])
+			virtq_aux_pool_put(&pool, blocks[j], mrs[j]);
+	virtq_aux_pool_destroy(&pool);
+	EXPECT_EQ(ctx.n_reg, ctx.n_dereg);
+}
@@ -0,0 +1,373 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/virtio_ring.h>
+#include <linux/virtio_blk.h>
+
+#include <infiniband/verbs.h>
+
+extern "C" {
+#include "snap_virtio_blk_virtq.h"
+#include "snap_null_blk_dev.h"
+};
+
+#include "test_virtq.h"
+
+/*
+ * Discard and write zeroes segments are read from the simulated host memory
+ * with virtq_xfer_data_descs(), validated and submitted to the null block
+ * device, which records the operations and completes them on demand.
+ */
+
+#define DWZ_TEST_HOST_ADDR  0x600000000ULL
+#define DWZ_TEST_HOST_LEN   (64 * 1024)
+#define DWZ_TEST_MKEY       0x789a
+#define DWZ_TEST_BLK_SIZE   4096
+#define DWZ_TEST_NUM_BLOCKS (1ULL << 20)
+#define DWZ_TEST_SPB        (DWZ_TEST_BLK_SIZE / 512)
+#define DWZ_TEST_MAX_SEGS   16
+#define DWZ_TEST_MAX_IOS    64
+
+class VirtqBlkDwzTest : public VirtqTest {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	uint8_t *m_host;
+	struct ibv_mr m_mr;
+	struct virtq_cmd m_cmd;
+	uint8_t *m_buf;
+	struct snap_blk_dev *m_bdev;
+	struct snap_null_blk_dev_io m_ios[DWZ_TEST_MAX_IOS];
+	struct blk_virtq_dwz_limits m_limits;
+	struct blk_virtq_dwz_io m_io;
+	struct snap_bdev_io_done_ctx m_done_ctx;
+	struct virtio_blk_discard_write_zeroes m_segs[DWZ_TEST_MAX_SEGS];
+	int m_n_comps;
+	int m_n_done;
+	enum snap_bdev_op_status m_done_status;
+
+	void set_seg(int i, uint64_t block, uint32_t num_blocks, uint32_t flags);
+	struct virtio_blk_discard_write_zeroes *read_segs(int n, int n_descs);
+	uint8_t check(uint32_t type, int n);
+	int submit(uint32_t type, int n);
+};
+
+static VirtqBlkDwzTest *g_dwz_test;
+
+static void dwz_test_dma_cb(struct snap_dma_completion *self, int status)
+{
+	g_dwz_test->m_n_comps++;
+}
+
+static void dwz_test_done_cb(enum snap_bdev_op_status status, void *done_arg)
+{
+	VirtqBlkDwzTest *t = (VirtqBlkDwzTest *)done_arg;
+
+	t->m_n_done++;
+	t->m_done_status = status;
+}
+
+void VirtqBlkDwzTest::SetUp()
+{
+	struct snap_blk_dev_attrs bdev_attrs;
+
+	g_dwz_test = this;
+	ASSERT_NO_FATAL_FAILURE(virtq_setup(DWZ_TEST_HOST_ADDR, DWZ_TEST_HOST_LEN,
+					    DWZ_TEST_MKEY, 64, false));
+	m_host = (uint8_t *)host_mem(DWZ_TEST_HOST_ADDR);
+	m_qattr.vattr.size = 64;
+
+	m_buf = (uint8_t *)malloc(DWZ_TEST_HOST_LEN);
+	ASSERT_TRUE(m_buf);
+	memset(&m_mr, 0, sizeof(m_mr));
+	memset(&m_cmd, 0, sizeof(m_cmd));
+	m_cmd.vq_priv = &m_priv;
+	m_cmd.req_buf = m_buf;
+	m_cmd.req_mr = &m_mr;
+	m_cmd.dma_comp.func = dwz_test_dma_cb;
+
+	memset(&bdev_attrs, 0, sizeof(bdev_attrs));
+	bdev_attrs.type = SNAP_BLOCK_DEVICE_NULL;
+	bdev_attrs.blk_size = DWZ_TEST_BLK_SIZE;
+	bdev_attrs.size_b = DWZ_TEST_NUM_BLOCKS;
+	m_bdev = snap_null_blk_dev_open("null_dwz", &bdev_attrs);
+	ASSERT_TRUE(m_bdev);
+	snap_null_blk_dev_record(m_bdev, m_ios, DWZ_TEST_MAX_IOS, false);
+
+	m_limits.max_discard_sectors = 1024 * DWZ_TEST_SPB;
+	m_limits.max_discard_seg = 8;
+	m_limits.max_write_zeroes_sectors = 256 * DWZ_TEST_SPB;
+	m_limits.max_write_zeroes_seg = 4;
+
+	m_done_ctx.cb = dwz_test_done_cb;
+	m_done_ctx.user_arg = this;
+	m_n_done = 0;
+	memset(m_segs, 0, sizeof(m_segs));
+}
+
+void VirtqBlkDwzTest::TearDown()
+{
+	if (m_bdev)
+		snap_null_blk_dev_close(m_bdev);
+	free(m_buf);
+	virtq_teardown();
+	g_dwz_test = NULL;
+}
+
+void VirtqBlkDwzTest::set_seg(int i, uint64_t block, uint32_t num_blocks,
+		uint32_t flags)
+{
+	m_segs[i].sector = block * DWZ_TEST_SPB;
+	m_segs[i].num_sectors = num_blocks * DWZ_TEST_SPB;
+	m_segs[i].flags = flags;
+}
+
+/*
+ * Place n segments in the host memory and read them back with n_descs
+ * descriptors, so that segments may be split between descriptors.
+ */
+struct virtio_blk_discard_write_zeroes *
+VirtqBlkDwzTest::read_segs(int n, int n_descs)
+{
+	struct vring_desc descs[DWZ_TEST_MAX_SEGS];
+	size_t len = n * sizeof(m_segs[0]), off = 0, desc_len;
+	int i, n_posted;
+
+	memset(m_buf, 0xff, len);
+	for (i = 0; i < n_descs; i++) {
+		desc_len = i == n_descs - 1 ? len - off : len / n_descs;
+		/* leave a gap between descriptors */
+		descs[i].addr = DWZ_TEST_HOST_ADDR + off + i * 64;
+		descs[i].len = desc_len;
+		descs[i].flags = 0;
+		memcpy(m_host + off + i * 64, (uint8_t *)m_segs + off, desc_len);
+		off += desc_len;
+	}
+
+	m_n_comps = 0;
+	EXPECT_EQ(0, virtq_xfer_data_descs(&m_cmd, descs, n_descs, false, &n_posted));
+	for (i = 0; i < 1000 && m_n_comps < 1; i++)
+		snap_dma_q_progress(m_dma_q);
+	EXPECT_EQ(1, m_n_comps);
+	return (struct virtio_blk_discard_write_zeroes *)m_buf;
+}
+
+uint8_t VirtqBlkDwzTest::check(uint32_t type, int n)
+{
+	return blk_virtq_dwz_check(type, read_segs(n, 1), n, &m_limits,
+				   DWZ_TEST_BLK_SIZE, DWZ_TEST_NUM_BLOCKS);
+}
+
+int VirtqBlkDwzTest::submit(uint32_t type, int n)
+{
+	m_n_done = 0;
+	return blk_virtq_dwz_submit(&m_io, &m_bdev->ops, m_bdev, type,
+				    (struct virtio_blk_discard_write_zeroes *)m_buf,
+				    n, &m_done_ctx, 3);
+}
+
+/* segments split between descriptors are reassembled */
+TEST_F(VirtqBlkDwzTest, discard_segments) {
+	int i, n_descs;
+
+	for (i = 0; i < 5; i++)
+		set_seg(i, 1000 * i, 1 + i, 0);
+
+	for (n_descs = 1; n_descs <= 3; n_descs++) {
+		snap_null_blk_dev_record(m_bdev, m_ios, DWZ_TEST_MAX_IOS, false);
+		read_segs(5, n_descs);
+		ASSERT_EQ(0, memcmp(m_buf, m_segs, 5 * sizeof(m_segs[0])));
+		ASSERT_EQ(VIRTIO_BLK_S_OK,
+			  blk_virtq_dwz_check(VIRTIO_BLK_T_DISCARD,
+				(struct virtio_blk_discard_write_zeroes *)m_buf,
+				5, &m_limits, DWZ_TEST_BLK_SIZE,
+				DWZ_TEST_NUM_BLOCKS));
+		ASSERT_EQ(0, submit(VIRTIO_BLK_T_DISCARD, 5));
+
+		ASSERT_EQ(5, snap_null_blk_dev_num_ios(m_bdev));
+		for (i = 0; i < 5; i++) {
+			EXPECT_EQ(SNAP_NULL_BLK_DEV_OP_DISCARD, m_ios[i].op);
+			EXPECT_EQ(1000U * i, m_ios[i].offset_blocks);
+			EXPECT_EQ(1U + i, m_ios[i].num_blocks);
+			EXPECT_EQ(3, m_ios[i].thread_id);
+		}
+		EXPECT_EQ(1, m_n_done);
+		EXPECT_EQ(SNAP_BDEV_OP_SUCCESS, m_done_status);
+	}
+}
+
+/* unmap is a hint for write zeroes, blocks are zeroed in any case */
+TEST_F(VirtqBlkDwzTest, write_zeroes_unmap) {
+	set_seg(0, 10, 256, VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+	set_seg(1, 500, 1, 0);
+
+	ASSERT_EQ(VIRTIO_BLK_S_OK, check(VIRTIO_BLK_T_WRITE_ZEROES, 2));
+	ASSERT_EQ(0, submit(VIRTIO_BLK_T_WRITE_ZEROES, 2));
+	ASSERT_EQ(2, snap_null_blk_dev_num_ios(m_bdev));
+	EXPECT_EQ(SNAP_NULL_BLK_DEV_OP_WRITE_ZEROES, m_ios[0].op);
+	EXPECT_EQ(10U, m_ios[0].offset_blocks);
+	EXPECT_EQ(256U, m_ios[0].num_blocks);
+	EXPECT_EQ(SNAP_NULL_BLK_DEV_OP_WRITE_ZEROES, m_ios[1].op);
+	EXPECT_EQ(1, m_n_done);
+}
+
+/* the command completes once, after the last segment */
+TEST_F(VirtqBlkDwzTest, async_completion) {
+	int i;
+
+	for (i = 0; i < 3; i++)
+		set_seg(i, 100 * i, 8, 0);
+
+	snap_null_blk_dev_record(m_bdev, m_ios, DWZ_TEST_MAX_IOS, true);
+	ASSERT_EQ(VIRTIO_BLK_S_OK, check(VIRTIO_BLK_T_DISCARD, 3));
+	ASSERT_EQ(0, submit(VIRTIO_BLK_T_DISCARD, 3));
+	EXPECT_EQ(3, snap_null_blk_dev_num_ios(m_bdev));
+	EXPECT_EQ(0, m_n_done);
+
+	/* complete out of order */
+	m_ios[1].done_ctx->cb(SNAP_BDEV_OP_SUCCESS, m_ios[1].done_ctx->user_arg);
+	m_ios[0].done_ctx->cb(SNAP_BDEV_OP_SUCCESS, m_ios[0].done_ctx->user_arg);
+	EXPECT_EQ(0, m_n_done);
+	m_ios[2].done_ctx->cb(SNAP_BDEV_OP_SUCCESS, m_ios[2].done_ctx->user_arg);
+	EXPECT_EQ(1, m_n_done);
+	EXPECT_EQ(SNAP_BDEV_OP_SUCCESS, m_done_status);
+
+	/* deferred operations are completed by the bdev */
+	snap_null_blk_dev_record(m_bdev, m_ios, DWZ_TEST_MAX_IOS, true);
+	ASSERT_EQ(0, submit(VIRTIO_BLK_T_DISCARD, 3));
+	EXPECT_EQ(0, m_n_done);
+	snap_null_blk_dev_complete(m_bdev, SNAP_BDEV_OP_SUCCESS);
+	EXPECT_EQ(1, m_n_done);
+	EXPECT_EQ(SNAP_BDEV_OP_SUCCESS, m_done_status);
+
+	/* a failed segment fails the command */
+	snap_null_blk_dev_record(m_bdev, m_ios, DWZ_TEST_MAX_IOS, true);
+	ASSERT_EQ(0, submit(VIRTIO_BLK_T_WRITE_ZEROES, 3));
+	m_ios[0].done_ctx->cb(SNAP_BDEV_OP_IO_ERROR, m_ios[0].done_ctx->user_arg);
+	m_ios[1].done_ctx->cb(SNAP_BDEV_OP_SUCCESS, m_ios[1].done_ctx->user_arg);
+	EXPECT_EQ(0, m_n_done);
+	m_ios[2].done_ctx->cb(SNAP_BDEV_OP_SUCCESS, m_ios[2].done_ctx->user_arg);
+	EXPECT_EQ(1, m_n_done);
+	EXPECT_EQ(SNAP_BDEV_OP_IO_ERROR, m_done_status);
+}
+
+TEST_F(VirtqBlkDwzTest, flags) {
+	set_seg(0, 0, 1, VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+	EXPECT_EQ(VIRTIO_BLK_S_UNSUPP, check(VIRTIO_BLK_T_DISCARD, 1));
+	EXPECT_EQ(VIRTIO_BLK_S_OK, check(VIRTIO_BLK_T_WRITE_ZEROES, 1));
+
+	set_seg(1, 8, 1, 0x2);
+	EXPECT_EQ(VIRTIO_BLK_S_UNSUPP, check(VIRTIO_BLK_T_WRITE_ZEROES, 2));
+	set_seg(0, 0, 1, 0);
+	EXPECT_EQ(VIRTIO_BLK_S_UNSUPP, check(VIRTIO_BLK_T_DISCARD, 2));
+}
+
+TEST_F(VirtqBlkDwzTest, limits) {
+	int i;
+
+	for (i = 0; i < DWZ_TEST_MAX_SEGS; i++)
+		set_seg(i, i, 1, 0);
+
+	EXPECT_EQ(VIRTIO_BLK_S_OK, check(VIRTIO_BLK_T_DISCARD, 8));
+	EXPECT_EQ(VIRTIO_BLK_S_IOERR, check(VIRTIO_BLK_T_DISCARD, 9));
+	EXPECT_EQ(VIRTIO_BLK_S_OK, check(VIRTIO_BLK_T_WRITE_ZEROES, 4));
+	EXPECT_EQ(VIRTIO_BLK_S_IOERR, check(VIRTIO_BLK_T_WRITE_ZEROES, 5));
+	EXPECT_EQ(VIRTIO_BLK_S_IOERR, check(VIRTIO_BLK_T_DISCARD, 0));
+
+	/* sectors per segment */
+	set_seg(0, 0, 1024, 0);
+	EXPECT_EQ(VIRTIO_BLK_S_OK, check(VIRTIO_BLK_T_DISCARD, 1));
+	set_seg(0, 0, 1025, 0);
+	EXPECT_EQ(VIRTIO_BLK_S_IOERR, check(VIRTIO_BLK_T_DISCARD, 1));
+	set_seg(0, 0, 257, 0);
+	EXPECT_EQ(VIRTIO_BLK_S_IOERR, check(VIRTIO_BLK_T_WRITE_ZEROES, 1));
+
+	/* whole blocks only */
+	set_seg(0, 0, 1, 0);
+	m_segs[0].sector += 1;
+	EXPECT_EQ(VIRTIO_BLK_S_IOERR, check(VIRTIO_BLK_T_DISCARD, 1));
+	set_seg(0, 0, 1, 0);
+	m_segs[0].num_sectors -= 1;
+	EXPECT_EQ(VIRTIO_BLK_S_IOERR, check(VIRTIO_BLK_T_DISCARD, 1));
+
+	/* inside the device */
+	set_seg(0, DWZ_TEST_NUM_BLOCKS - 2, 2, 0);
+	EXPECT_EQ(VIRTIO_BLK_S_OK, check(VIRTIO_BLK_T_DISCARD, 1));
+	set_seg(0, DWZ_TEST_NUM_BLOCKS - 1, 2, 0);
+	EXPECT_EQ(VIRTIO_BLK_S_IOERR, check(VIRTIO_BLK_T_DISCARD, 1));
+	m_segs[0].sector = UINT64_MAX - 7;
+	EXPECT_EQ(VIRTIO_BLK_S_IOERR, check(VIRTIO_BLK_T_DISCARD, 1));
+
+	/* feature not negotiated */
+	set_seg(0, 0, 1, 0);
+	m_limits.max_discard_seg = 0;
+	EXPECT_EQ(VIRTIO_BLK_S_UNSUPP, check(VIRTIO_BLK_T_DISCARD, 1));
+	EXPECT_EQ(VIRTIO_BLK_S_OK, check(VIRTIO_BLK_T_WRITE_ZEROES, 1));
+}
+
+/* empty segments are not sent to the bdev */
+TEST_F(VirtqBlkDwzTest, empty_segments) {
+	set_seg(0, 0, 0, 0);
+	set_seg(1, 16, 4, 0);
+	set_seg(2, 32, 0, 0);
+
+	ASSERT_EQ(VIRTIO_BLK_S_OK, check(VIRTIO_BLK_T_DISCARD, 3));
+	ASSERT_EQ(0, submit(VIRTIO_BLK_T_DISCARD, 3));
+	ASSERT_EQ(1, snap_null_blk_dev_num_ios(m_bdev));
+	EXPECT_EQ(16U, m_ios[0].offset_blocks);
+	EXPECT_EQ(1, m_n_done);
+
+	snap_null_blk_dev_record(m_bdev, m_ios, DWZ_TEST_MAX_IOS, false);
+	ASSERT_EQ(VIRTIO_BLK_S_OK, check(VIRTIO_BLK_T_DISCARD, 1));
+	ASSERT_EQ(0, submit(VIRTIO_BLK_T_DISCARD, 1));
+	EXPECT_EQ(0, snap_null_blk_dev_num_ios(m_bdev));
+	EXPECT_EQ(1, m_n_done);
+	EXPECT_EQ(SNAP_BDEV_OP_SUCCESS, m_done_status);
+}
+
+static int g_dwz_fail_at;
+
+static int dwz_test_failing_discard(void *ctx, uint64_t offset_blocks,
+		uint64_t num_blocks, struct snap_bdev_io_done_ctx *done_ctx,
+		int thread_id)
+{
+	if (g_dwz_fail_at-- == 0)
+		return -EIO;
+	done_ctx->cb(SNAP_BDEV_OP_SUCCESS, done_ctx->user_arg);
+	return 0;
+}
+
+/* the command is completed only if some of the segments were submitted */
+TEST_F(VirtqBlkDwzTest, submit_error) {
+	struct snap_bdev_ops ops = m_bdev->ops;
+	int i;
+
+	ops.discard = dwz_test_failing_discard;
+	for (i = 0; i < 3; i++)
+		set_seg(i, 8 * i, 1, 0);
+	read_segs(3, 1);
+
+	g_dwz_fail_at = 0;
+	m_n_done = 0;
+	EXPECT_EQ(-EIO, blk_virtq_dwz_submit(&m_io, &ops, m_bdev,
+			VIRTIO_BLK_T_DISCARD,
+			(struct virtio_blk_discard_write_zeroes *)m_buf, 3,
+			&m_done_ctx, 0));
+	EXPECT_EQ(0, m_n_done);
+
+	g_dwz_fail_at = 1;
+	EXPECT_EQ(0, blk_virtq_dwz_submit(&m_io, &ops, m_bdev,
+			VIRTIO_BLK_T_DISCARD,
+			(struct virtio_blk_discard_write_zeroes *)m_buf, 3,
+			&m_done_ctx, 0));
+	EXPECT_EQ(1, m_n_done);
+	EXPECT_EQ(SNAP_BDEV_OP_IO_ERROR, m_done_status);
+
+	ops.discard = NULL;
+	EXPECT_EQ(-ENOTSUP, blk_virtq_dwz_submit(&m_io, &ops, m_bdev,
+			VIRTIO_BLK_T_DISCARD,
+			(struct virtio_blk_discard_write_zeroes *)m_buf, 3,
+			&m_done_ctx, 0));
+}
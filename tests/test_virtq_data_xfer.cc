@@ -0,0 +1,233 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/virtio_ring.h>
+
+#include <infiniband/verbs.h>
+
+extern "C" {
+#include "snap_dma_stat.h"
+};
+
+#include "test_virtq.h"
+
+/*
+ * Data movement between the host and the command request buffer with
+ * virtq_xfer_data_descs(). The host memory is simulated by the
+ * SNAP_DMA_Q_MODE_SW dma queue.
+ */
+
+#define XFER_TEST_HOST_ADDR 0x400000000ULL
+#define XFER_TEST_HOST_LEN  (4 * 1024 * 1024)
+#define XFER_TEST_MKEY      0x5678
+#define XFER_TEST_MAX_DESCS 256
+#define XFER_TEST_MAX_LEN   4096
+
+class VirtqDataXferTest : public VirtqTest {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	uint8_t *m_host;
+	struct ibv_mr m_mr;
+	struct virtq_cmd m_cmd;
+	uint8_t *m_buf;
+	struct vring_desc m_descs[XFER_TEST_MAX_DESCS];
+	size_t m_host_span;
+	int m_n_comps;
+	int m_status;
+
+	size_t make_descs(int n, uint16_t write_mask_pct);
+	uint64_t n_ops(void);
+	void xfer(int n, bool to_host, int *n_posted);
+};
+
+static VirtqDataXferTest *g_xfer_test;
+
+static void xfer_test_dma_cb(struct snap_dma_completion *self, int status)
+{
+	g_xfer_test->m_n_comps++;
+	g_xfer_test->m_status = status;
+}
+
+void VirtqDataXferTest::SetUp()
+{
+	g_xfer_test = this;
+	ASSERT_NO_FATAL_FAILURE(virtq_setup(XFER_TEST_HOST_ADDR, XFER_TEST_HOST_LEN,
+					    XFER_TEST_MKEY, XFER_TEST_MAX_DESCS,
+					    true));
+	ASSERT_TRUE(snap_dma_q_stats_get(m_dma_q));
+	m_host = (uint8_t *)host_mem(XFER_TEST_HOST_ADDR);
+	m_qattr.vattr.size = XFER_TEST_MAX_DESCS;
+
+	m_buf = (uint8_t *)malloc(XFER_TEST_MAX_DESCS * XFER_TEST_MAX_LEN);
+	ASSERT_TRUE(m_buf);
+	memset(&m_mr, 0, sizeof(m_mr));
+	memset(&m_cmd, 0, sizeof(m_cmd));
+	m_cmd.vq_priv = &m_priv;
+	m_cmd.req_buf = m_buf;
+	m_cmd.req_mr = &m_mr;
+	m_cmd.dma_comp.func = xfer_test_dma_cb;
+	srand(17);
+}
+
+void VirtqDataXferTest::TearDown()
+{
+	free(m_buf);
+	virtq_teardown();
+	g_xfer_test = NULL;
+}
+
+/*
+ * Random length descriptors scattered over the host memory, write_pct
+ * percent of them are device writable. Return total length of the
+ * descriptors that are read from the host.
+ */
+size_t VirtqDataXferTest::make_descs(int n, uint16_t write_pct)
+{
+	uint64_t addr = XFER_TEST_HOST_ADDR;
+	size_t read_len = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		m_descs[i].len = 1 + rand() % XFER_TEST_MAX_LEN;
+		m_descs[i].addr = addr;
+		m_descs[i].flags = (rand() % 100 < write_pct) ? VRING_DESC_F_WRITE : 0;
+		m_descs[i].next = i + 1;
+		if (!(m_descs[i].flags & VRING_DESC_F_WRITE))
+			read_len += m_descs[i].len;
+		/* leave a gap, so that descriptors are not contiguous */
+		addr += m_descs[i].len + 1 + rand() % 64;
+	}
+	m_host_span = addr - XFER_TEST_HOST_ADDR;
+	return read_len;
+}
+
+uint64_t VirtqDataXferTest::n_ops(void)
+{
+	const struct snap_dma_q_stats *st = snap_dma_q_stats_get(m_dma_q);
+
+	return st->ops[SNAP_DMA_STAT_OP_READ].posted +
+	       st->ops[SNAP_DMA_STAT_OP_WRITE].posted +
+	       st->ops[SNAP_DMA_STAT_OP_READV].posted +
+	       st->ops[SNAP_DMA_STAT_OP_WRITEV].posted;
+}
+
+void VirtqDataXferTest::xfer(int n, bool to_host, int *n_posted)
+{
+	int i;
+
+	m_n_comps = 0;
+	m_status = -1;
+	snap_dma_q_stats_reset(m_dma_q);
+	ASSERT_EQ(0, virtq_xfer_data_descs(&m_cmd, m_descs, n, to_host, n_posted));
+	for (i = 0; i < 1000 && !m_n_comps; i++)
+		snap_dma_q_progress(m_dma_q);
+	if (*n_posted) {
+		ASSERT_EQ(1, m_n_comps);
+		ASSERT_EQ(IBV_WC_SUCCESS, m_status);
+	} else {
+		ASSERT_EQ(0, m_n_comps);
+	}
+}
+
+static void xfer_test_fill(uint8_t *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		p[i] = rand();
+}
+
+static int xfer_test_chunks(int n, int max_iov)
+{
+	return (n + max_iov - 1) / max_iov;
+}
+
+TEST_F(VirtqDataXferTest, read) {
+	size_t len, off;
+	int n, i, n_posted;
+
+	for (n = 1; n <= XFER_TEST_MAX_DESCS; n++) {
+		len = make_descs(n, 0);
+		xfer_test_fill(m_host, m_host_span);
+		memset(m_buf, 0, len);
+
+		xfer(n, false, &n_posted);
+		ASSERT_EQ(xfer_test_chunks(n, SNAP_DMA_Q_MAX_IOV_CNT), n_posted);
+		/* one op per chunk instead of one op per descriptor */
+		ASSERT_EQ((uint64_t)n_posted, n_ops()) << n << " descs";
+
+		for (i = 0, off = 0; i < n; i++) {
+			ASSERT_EQ(0, memcmp(m_buf + off,
+					    m_host + (m_descs[i].addr - XFER_TEST_HOST_ADDR),
+					    m_descs[i].len)) << "desc " << i << " of " << n;
+			off += m_descs[i].len;
+		}
+		ASSERT_EQ(len, off);
+	}
+}
+
+TEST_F(VirtqDataXferTest, write) {
+	size_t len, off;
+	int n, i, n_posted;
+
+	for (n = 1; n <= XFER_TEST_MAX_DESCS; n++) {
+		len = make_descs(n, 100);
+		for (i = 0, len = 0; i < n; i++)
+			len += m_descs[i].len;
+		memset(m_host, 0, m_host_span);
+		xfer_test_fill(m_buf, len);
+
+		xfer(n, true, &n_posted);
+		ASSERT_EQ(xfer_test_chunks(n, SNAP_DMA_Q_MAX_IOV_CNT), n_posted);
+		ASSERT_EQ((uint64_t)n_posted, n_ops()) << n << " descs";
+
+		for (i = 0, off = 0; i < n; i++) {
+			uint8_t *h = m_host + (m_descs[i].addr - XFER_TEST_HOST_ADDR);
+
+			ASSERT_EQ(0, memcmp(m_buf + off, h, m_descs[i].len))
+				<< "desc " << i << " of " << n;
+			/* gaps are not touched */
+			ASSERT_EQ(0, h[m_descs[i].len]);
+			off += m_descs[i].len;
+		}
+	}
+}
+
+/* device writable descriptors are skipped when reading from the host */
+TEST_F(VirtqDataXferTest, read_mixed) {
+	size_t len, off;
+	int n, i, n_posted, n_read;
+
+	for (n = 1; n <= XFER_TEST_MAX_DESCS; n += 7) {
+		len = make_descs(n, 30);
+		xfer_test_fill(m_host, m_host_span);
+
+		xfer(n, false, &n_posted);
+		for (i = 0, n_read = 0; i < n; i++)
+			n_read += !(m_descs[i].flags & VRING_DESC_F_WRITE);
+		ASSERT_EQ(xfer_test_chunks(n_read, SNAP_DMA_Q_MAX_IOV_CNT), n_posted);
+
+		for (i = 0, off = 0; i < n; i++) {
+			if (m_descs[i].flags & VRING_DESC_F_WRITE)
+				continue;
+			ASSERT_EQ(0, memcmp(m_buf + off,
+					    m_host + (m_descs[i].addr - XFER_TEST_HOST_ADDR),
+					    m_descs[i].len));
+			off += m_descs[i].len;
+		}
+		ASSERT_EQ(len, off);
+	}
+}
+
+/* chunks are also bounded by the queue size */
+TEST_F(VirtqDataXferTest, small_queue) {
+	int n_posted;
+
+	m_qattr.vattr.size = 16;
+	make_descs(100, 0);
+	xfer(100, false, &n_posted);
+	EXPECT_EQ(xfer_test_chunks(100, 16), n_posted);
+	EXPECT_EQ((uint64_t)n_posted, n_ops());
+}
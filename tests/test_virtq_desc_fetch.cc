@@ -0,0 +1,543 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <linux/virtio_ring.h>
+
+#include <infiniband/verbs.h>
+
+#include "test_virtq.h"
+
+/*
+ * Descriptor chain fetch of the virtq_common state machine. The guest vring
+ * lives in the simulated host memory of the SNAP_DMA_Q_MODE_SW dma queue,
+ * each read completes after a configurable number of progress calls.
+ */
+
+#define FETCH_TEST_HOST_ADDR 0x200000000ULL
+#define FETCH_TEST_MKEY      0x4321
+#define FETCH_TEST_Q_SIZE    256
+#define FETCH_TEST_MAX_DESCS 128
+#define FETCH_TEST_TABLE_ADDR 0x300000000ULL
+
+class VirtqDescFetchTest : public VirtqTest {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	struct snap_dma_sw_mem *m_tmem;
+	struct vring_desc *m_ring;
+	struct vring_desc *m_table;
+	uint16_t m_indirect_idx[2 * FETCH_TEST_Q_SIZE];
+	struct virtq_impl_ops m_ops;
+	struct virtq_state_machine m_sm;
+	struct virtq_sm_state m_sm_arr[VIRTQ_CMD_NUM_OF_STATES];
+	struct ibv_mr m_mr;
+	struct virtq_cmd m_cmd;
+	struct vring_desc m_descs[FETCH_TEST_MAX_DESCS];
+	bool m_done;
+	bool m_fatal;
+
+	void make_chain(uint16_t head, const uint16_t *slots, int n);
+	void make_indirect(uint16_t head, const uint16_t *slots, int n, int table_len);
+	int fetch(uint16_t head, int n_tunnel, uint64_t *n_progress);
+	void check_chain(const uint16_t *slots, int n);
+};
+
+static VirtqDescFetchTest *g_test;
+
+static struct vring_desc *fetch_test_get_descs(struct virtq_cmd *cmd)
+{
+	return g_test->m_descs;
+}
+
+static int fetch_test_seg_dmem(struct virtq_cmd *cmd)
+{
+	return cmd->num_desc >= FETCH_TEST_MAX_DESCS ? -1 : 0;
+}
+
+static uint32_t fetch_test_max_descs(struct virtq_cmd *cmd)
+{
+	return FETCH_TEST_MAX_DESCS;
+}
+
+static void fetch_test_descs_processing(struct virtq_cmd *cmd)
+{
+	g_test->m_done = true;
+}
+
+static bool fetch_test_sm_stop(struct virtq_cmd *cmd,
+		enum virtq_cmd_sm_op_status status)
+{
+	return false;
+}
+
+static bool fetch_test_sm_fatal(struct virtq_cmd *cmd,
+		enum virtq_cmd_sm_op_status status)
+{
+	g_test->m_fatal = true;
+	return false;
+}
+
+static void fetch_test_dma_cb(struct snap_dma_completion *self, int status)
+{
+	struct virtq_cmd *cmd = container_of(self, struct virtq_cmd, dma_comp);
+
+	--cmd->vq_priv->cmd_cntrs.outstanding_to_host;
+	virtq_cmd_progress(cmd, status == IBV_WC_SUCCESS ? VIRTQ_CMD_SM_OP_OK :
+			   VIRTQ_CMD_SM_OP_ERR);
+}
+
+void VirtqDescFetchTest::SetUp()
+{
+	int i;
+
+	g_test = this;
+	m_tmem = NULL;
+	ASSERT_NO_FATAL_FAILURE(virtq_setup(FETCH_TEST_HOST_ADDR,
+					    FETCH_TEST_Q_SIZE * sizeof(struct vring_desc),
+					    FETCH_TEST_MKEY, 64, false));
+	m_ring = (struct vring_desc *)host_mem(FETCH_TEST_HOST_ADDR);
+	m_tmem = snap_dma_sw_mem_create(NULL, FETCH_TEST_Q_SIZE * sizeof(struct vring_desc),
+					FETCH_TEST_TABLE_ADDR, FETCH_TEST_MKEY);
+	ASSERT_TRUE(m_tmem);
+	m_table = (struct vring_desc *)snap_dma_sw_mem_addr(m_tmem, FETCH_TEST_TABLE_ADDR);
+
+	memset(&m_ops, 0, sizeof(m_ops));
+	m_ops.get_descs = fetch_test_get_descs;
+	m_ops.seg_dmem = fetch_test_seg_dmem;
+	m_ops.max_descs = fetch_test_max_descs;
+	m_ops.descs_processing = fetch_test_descs_processing;
+
+	for (i = 0; i < VIRTQ_CMD_NUM_OF_STATES; i++)
+		m_sm_arr[i].sm_handler = fetch_test_sm_stop;
+	m_sm_arr[VIRTQ_CMD_STATE_FETCH_CMD_DESCS].sm_handler = virtq_sm_fetch_cmd_descs;
+	m_sm_arr[VIRTQ_CMD_STATE_FATAL_ERR].sm_handler = fetch_test_sm_fatal;
+	m_sm.sm_array = m_sm_arr;
+	m_sm.sme = VIRTQ_CMD_NUM_OF_STATES;
+
+	m_qattr.vattr.size = FETCH_TEST_Q_SIZE;
+	m_qattr.vattr.desc = FETCH_TEST_HOST_ADDR;
+	m_priv.custom_sm = &m_sm;
+	m_priv.ops = &m_ops;
+	m_priv.desc_prefetch = 8;
+	m_priv.indirect_idx = m_indirect_idx;
+
+	memset(&m_mr, 0, sizeof(m_mr));
+	memset(&m_cmd, 0, sizeof(m_cmd));
+	m_cmd.vq_priv = &m_priv;
+	m_cmd.aux_mr = &m_mr;
+	m_cmd.dma_comp.func = fetch_test_dma_cb;
+}
+
+void VirtqDescFetchTest::TearDown()
+{
+	if (m_tmem)
+		snap_dma_sw_mem_destroy(m_tmem);
+	virtq_teardown();
+	g_test = NULL;
+}
+
+/* head is slots[0], descriptor addr encodes its position in the chain */
+void VirtqDescFetchTest::make_chain(uint16_t head, const uint16_t *slots, int n)
+{
+	int i;
+
+	ASSERT_EQ(head, slots[0]);
+	for (i = 0; i < n; i++) {
+		struct vring_desc *d = &m_ring[slots[i]];
+
+		d->addr = 0x1000ULL * (i + 1);
+		d->len = 512;
+		d->flags = i < n - 1 ? VRING_DESC_F_NEXT : VRING_DESC_F_WRITE;
+		d->next = i < n - 1 ? slots[i + 1] : 0;
+	}
+}
+
+/*
+ * head points to an indirect table of table_len descriptors, the chain
+ * occupies table entries slots[0..n), other entries are garbage. The chain
+ * always starts at the first table entry.
+ */
+void VirtqDescFetchTest::make_indirect(uint16_t head, const uint16_t *slots, int n,
+		int table_len)
+{
+	int i;
+
+	ASSERT_EQ(0, slots[0]);
+	for (i = 0; i < table_len; i++) {
+		m_table[i].addr = 0xdead0000ULL + i;
+		m_table[i].len = 1;
+		m_table[i].flags = VRING_DESC_F_NEXT;
+		m_table[i].next = i;
+	}
+	for (i = 0; i < n; i++) {
+		struct vring_desc *d = &m_table[slots[i]];
+
+		d->addr = 0x1000ULL * (i + 1);
+		d->len = 512;
+		d->flags = i < n - 1 ? VRING_DESC_F_NEXT : VRING_DESC_F_WRITE;
+		d->next = i < n - 1 ? slots[i + 1] : 0;
+	}
+
+	m_ring[head].addr = FETCH_TEST_TABLE_ADDR;
+	m_ring[head].len = table_len * sizeof(struct vring_desc);
+	m_ring[head].flags = VRING_DESC_F_INDIRECT;
+	m_ring[head].next = 0;
+}
+
+/* fetch the chain, the first n_tunnel descriptors come with the command */
+int VirtqDescFetchTest::fetch(uint16_t head, int n_tunnel, uint64_t *n_progress)
+{
+	uint64_t reads = m_priv.desc_reads;
+	int i;
+
+	m_done = m_fatal = false;
+	m_cmd.num_desc = n_tunnel;
+	m_cmd.descr_head_idx = head;
+	m_cmd.is_indirect = false;
+	m_cmd.desc_window = 0;
+	m_cmd.desc_prefetch_off = false;
+	m_cmd.state = VIRTQ_CMD_STATE_FETCH_CMD_DESCS;
+	memset(m_descs, 0, sizeof(m_descs));
+	for (i = 0; i < n_tunnel; i++)
+		m_descs[i] = m_ring[i == 0 ? head : m_descs[i - 1].next];
+
+	virtq_cmd_progress(&m_cmd, VIRTQ_CMD_SM_OP_OK);
+	for (*n_progress = 0; !m_done && !m_fatal && *n_progress < 100000; (*n_progress)++)
+		snap_dma_q_progress(m_dma_q);
+
+	return m_priv.desc_reads - reads;
+}
+
+void VirtqDescFetchTest::check_chain(const uint16_t *slots, int n)
+{
+	int i;
+
+	ASSERT_TRUE(m_done);
+	ASSERT_FALSE(m_fatal);
+	ASSERT_EQ((size_t)n, m_cmd.num_desc);
+	for (i = 0; i < n; i++) {
+		ASSERT_EQ(0x1000ULL * (i + 1), m_descs[i].addr) << "desc " << i;
+		ASSERT_EQ(i < n - 1 ? VRING_DESC_F_NEXT : VRING_DESC_F_WRITE,
+			  m_descs[i].flags) << "desc " << i;
+	}
+	EXPECT_EQ(0U, m_priv.cmd_cntrs.outstanding_to_host);
+}
+
+static void fetch_test_seq_slots(uint16_t *slots, uint16_t head, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		slots[i] = (head + i) % FETCH_TEST_Q_SIZE;
+}
+
+TEST_F(VirtqDescFetchTest, sequential) {
+	uint16_t slots[FETCH_TEST_MAX_DESCS];
+	uint64_t n_progress;
+
+	fetch_test_seq_slots(slots, 10, 16);
+	make_chain(10, slots, 16);
+
+	/* one window per 8 descriptors */
+	EXPECT_EQ(2, fetch(10, 0, &n_progress));
+	check_chain(slots, 16);
+	EXPECT_EQ(0U, m_priv.desc_prefetch_misses);
+
+	/* one by one */
+	m_priv.desc_prefetch = 1;
+	EXPECT_EQ(16, fetch(10, 0, &n_progress));
+	check_chain(slots, 16);
+
+	/* chain ends inside the window */
+	m_priv.desc_prefetch = 8;
+	fetch_test_seq_slots(slots, 100, 3);
+	make_chain(100, slots, 3);
+	EXPECT_EQ(1, fetch(100, 0, &n_progress));
+	check_chain(slots, 3);
+
+	/* tunneled descriptors, the rest is fetched */
+	fetch_test_seq_slots(slots, 40, 12);
+	make_chain(40, slots, 12);
+	EXPECT_EQ(2, fetch(40, 2, &n_progress));
+	check_chain(slots, 12);
+
+	/* whole chain is tunneled */
+	EXPECT_EQ(0, fetch(40, 12, &n_progress));
+	check_chain(slots, 12);
+}
+
+TEST_F(VirtqDescFetchTest, wrap) {
+	uint16_t slots[FETCH_TEST_MAX_DESCS];
+	uint64_t n_progress;
+
+	fetch_test_seq_slots(slots, FETCH_TEST_Q_SIZE - 3, 10);
+	make_chain(FETCH_TEST_Q_SIZE - 3, slots, 10);
+	EXPECT_EQ(2, fetch(FETCH_TEST_Q_SIZE - 3, 0, &n_progress));
+	check_chain(slots, 10);
+	EXPECT_EQ(0U, m_priv.desc_prefetch_misses);
+}
+
+TEST_F(VirtqDescFetchTest, jump) {
+	uint16_t slots[FETCH_TEST_MAX_DESCS];
+	uint64_t n_progress;
+	int i;
+
+	/* 4 sequential descriptors then the chain jumps */
+	for (i = 0; i < 4; i++)
+		slots[i] = 20 + i;
+	for (; i < 10; i++)
+		slots[i] = 200 - 10 * i;
+	make_chain(20, slots, 10);
+
+	/* window 20..27, then one by one */
+	EXPECT_EQ(1 + 6, fetch(20, 0, &n_progress));
+	check_chain(slots, 10);
+	EXPECT_EQ(1U, m_priv.desc_prefetch_misses);
+
+	/* jump at the window end is not a miss */
+	for (i = 0; i < 8; i++)
+		slots[i] = 50 + i;
+	for (; i < 16; i++)
+		slots[i] = 150 + i;
+	make_chain(50, slots, 16);
+	EXPECT_EQ(2, fetch(50, 0, &n_progress));
+	check_chain(slots, 16);
+	EXPECT_EQ(1U, m_priv.desc_prefetch_misses);
+}
+
+TEST_F(VirtqDescFetchTest, random) {
+	uint16_t slots[FETCH_TEST_MAX_DESCS];
+	bool used[FETCH_TEST_Q_SIZE];
+	uint64_t n_progress;
+	int iter, i, n;
+	uint16_t s;
+
+	srand(7);
+	for (iter = 0; iter < 500; iter++) {
+		memset(used, 0, sizeof(used));
+		n = 1 + rand() % 64;
+		s = rand() % FETCH_TEST_Q_SIZE;
+		for (i = 0; i < n; i++) {
+			/* mostly sequential with occasional jumps */
+			if (i && rand() % 4)
+				s = (slots[i - 1] + 1) % FETCH_TEST_Q_SIZE;
+			else if (i)
+				s = rand() % FETCH_TEST_Q_SIZE;
+			while (used[s])
+				s = (s + 1) % FETCH_TEST_Q_SIZE;
+			used[s] = true;
+			slots[i] = s;
+		}
+		make_chain(slots[0], slots, n);
+		m_priv.desc_prefetch = 1 + rand() % 16;
+		fetch(slots[0], rand() % 2 ? 1 : 0, &n_progress);
+		check_chain(slots, n);
+	}
+}
+
+static void fetch_test_shuffle(uint16_t *a, int n)
+{
+	int i, j;
+	uint16_t t;
+
+	for (i = n - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		t = a[i];
+		a[i] = a[j];
+		a[j] = t;
+	}
+}
+
+TEST_F(VirtqDescFetchTest, indirect) {
+	uint16_t slots[FETCH_TEST_MAX_DESCS];
+	uint64_t n_progress;
+
+	/* sequential table, as written by drivers and required by IN_ORDER */
+	fetch_test_seq_slots(slots, 0, 16);
+	make_indirect(5, slots, 16, 16);
+	EXPECT_EQ(2, fetch(5, 0, &n_progress));
+	check_chain(slots, 16);
+	EXPECT_EQ(0U, m_priv.indirect_reorders);
+
+	/* head is tunneled */
+	EXPECT_EQ(1, fetch(5, 1, &n_progress));
+	check_chain(slots, 16);
+
+	/* chain is shorter than the table */
+	make_indirect(5, slots, 3, 16);
+	fetch(5, 0, &n_progress);
+	check_chain(slots, 3);
+	EXPECT_EQ(0U, m_priv.indirect_reorders);
+
+	/* chain goes backwards */
+	slots[0] = 0;
+	slots[1] = 7;
+	slots[2] = 6;
+	make_indirect(5, slots, 3, 8);
+	fetch(5, 0, &n_progress);
+	check_chain(slots, 3);
+	EXPECT_EQ(1U, m_priv.indirect_reorders);
+}
+
+TEST_F(VirtqDescFetchTest, indirect_random) {
+	uint16_t slots[FETCH_TEST_MAX_DESCS];
+	uint64_t n_progress;
+	int iter, n, table_len;
+	uint16_t head;
+
+	srand(11);
+	for (iter = 0; iter < 1000; iter++) {
+		table_len = 1 + rand() % FETCH_TEST_MAX_DESCS;
+		n = 1 + rand() % table_len;
+		fetch_test_seq_slots(slots, 0, table_len);
+		fetch_test_shuffle(slots + 1, table_len - 1);
+		head = rand() % FETCH_TEST_Q_SIZE;
+		make_indirect(head, slots, n, table_len);
+		m_priv.desc_prefetch = 1 + rand() % 16;
+		fetch(head, rand() % 2, &n_progress);
+		check_chain(slots, n);
+	}
+}
+
+TEST_F(VirtqDescFetchTest, indirect_malformed) {
+	uint16_t slots[FETCH_TEST_Q_SIZE];
+	uint64_t n_progress;
+
+	/* loop */
+	fetch_test_seq_slots(slots, 0, 4);
+	make_indirect(9, slots, 4, 4);
+	m_table[3].flags = VRING_DESC_F_NEXT;
+	m_table[3].next = 1;
+	fetch(9, 0, &n_progress);
+	EXPECT_TRUE(m_fatal);
+
+	/* next is out of the table */
+	m_table[3].next = 4;
+	fetch(9, 0, &n_progress);
+	EXPECT_TRUE(m_fatal);
+
+	/* bad table length */
+	make_indirect(9, slots, 4, 4);
+	m_ring[9].len = 4 * sizeof(struct vring_desc) - 1;
+	fetch(9, 0, &n_progress);
+	EXPECT_TRUE(m_fatal);
+
+	/* does not fit into the command descriptors */
+	fetch_test_seq_slots(slots, 0, FETCH_TEST_MAX_DESCS + 1);
+	make_indirect(9, slots, FETCH_TEST_MAX_DESCS + 1, FETCH_TEST_MAX_DESCS + 1);
+	fetch(9, 0, &n_progress);
+	EXPECT_TRUE(m_fatal);
+
+	/* still works */
+	make_indirect(9, slots, 4, 4);
+	fetch(9, 0, &n_progress);
+	check_chain(slots, 4);
+}
+
+#ifdef __GLIBC__
+/* count allocations made by the code under test */
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static volatile bool fetch_test_count_allocs;
+static volatile uint64_t fetch_test_n_allocs;
+
+extern "C" void *malloc(size_t size)
+{
+	if (fetch_test_count_allocs)
+		fetch_test_n_allocs++;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+	if (fetch_test_count_allocs)
+		fetch_test_n_allocs++;
+	return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+	if (fetch_test_count_allocs)
+		fetch_test_n_allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+TEST_F(VirtqDescFetchTest, indirect_allocs) {
+	uint16_t slots[FETCH_TEST_MAX_DESCS];
+	const int n_cmds = 10000;
+	uint64_t n_progress;
+	int i;
+
+	srand(13);
+	fetch_test_seq_slots(slots, 0, 64);
+	fetch_test_shuffle(slots + 1, 63);
+	make_indirect(3, slots, 64, 64);
+	/* warm up */
+	fetch(3, 0, &n_progress);
+	check_chain(slots, 64);
+
+	fetch_test_n_allocs = 0;
+	fetch_test_count_allocs = true;
+	for (i = 0; i < n_cmds; i++)
+		fetch(3, 0, &n_progress);
+	fetch_test_count_allocs = false;
+
+	check_chain(slots, 64);
+	EXPECT_EQ((uint64_t)n_cmds + 1, m_priv.indirect_reorders);
+	EXPECT_EQ(0U, fetch_test_n_allocs);
+	printf("%d indirect commands, %lu allocations\n", n_cmds,
+	       (unsigned long)fetch_test_n_allocs);
+}
+#endif
+
+static uint64_t fetch_test_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+TEST_F(VirtqDescFetchTest, latency) {
+	uint16_t slots[FETCH_TEST_MAX_DESCS];
+	const int prefetch[] = { 1, 8 };
+	const int chains[] = { 1, 2, 4, 8, 16, 32 };
+	const int n_cmds = 1000;
+	uint64_t n_progress, total_progress, t;
+	int reads, i, j, k;
+
+	/* every read takes 16 progress calls to complete */
+	snap_dma_sw_q_set_delay(m_dma_q, 16);
+
+	printf("%8s %8s %12s %16s %12s\n", "prefetch", "descs", "reads/cmd",
+	       "progress/cmd", "ns/cmd");
+	for (i = 0; i < 2; i++) {
+		m_priv.desc_prefetch = prefetch[i];
+		for (j = 0; j < 6; j++) {
+			fetch_test_seq_slots(slots, 0, chains[j]);
+			make_chain(0, slots, chains[j]);
+
+			reads = 0;
+			total_progress = 0;
+			t = fetch_test_ns();
+			for (k = 0; k < n_cmds; k++) {
+				reads += fetch(0, 0, &n_progress);
+				total_progress += n_progress;
+			}
+			t = fetch_test_ns() - t;
+			check_chain(slots, chains[j]);
+
+			if (prefetch[i] == 8)
+				EXPECT_EQ((chains[j] + 7) / 8, reads / n_cmds);
+			else
+				EXPECT_EQ(chains[j], reads / n_cmds);
+			printf("%8d %8d %12.2f %16.2f %12.1f\n", prefetch[i],
+			       chains[j], (double)reads / n_cmds,
+			       (double)total_progress / n_cmds, (double)t / n_cmds);
+		}
+	}
+}
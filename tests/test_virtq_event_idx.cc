@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/virtio_ring.h>
+
+#include <infiniband/verbs.h>
+
+extern "C" {
+#include "snap_dma_stat.h"
+};
+
+#include "test_virtq.h"
+
+/*
+ * VIRTIO_RING_F_EVENT_IDX interrupt suppression of the used ring updates
+ * written by virtq_used_batch_flush(). The driver is simulated on top of
+ * the SNAP_DMA_Q_MODE_SW dma queue, it moves used_event when it is
+ * interrupted, the way the guest drivers do.
+ */
+
+#define EVENT_TEST_USED_ADDR  0x600000000ULL
+#define EVENT_TEST_AVAIL_ADDR (EVENT_TEST_USED_ADDR + 0x10000)
+#define EVENT_TEST_MKEY       0x4567
+#define EVENT_TEST_Q_SIZE     256
+
+class VirtqEventIdxTest : public VirtqTest {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	struct vring_used *m_used;
+	uint16_t *m_used_event;
+	struct virtq_cmd m_cmd;
+	uint16_t m_next_id;
+	/* driver: interrupt again after that many used elements, < 0 never */
+	int m_event_delta;
+	int m_n_irqs;
+	uint16_t m_irq_used_idx;
+
+	void setup_queue(uint16_t used_idx, bool event_idx, int event_delta);
+	void complete(int n);
+	void progress(void);
+};
+
+static void event_test_notify(void *arg)
+{
+	VirtqEventIdxTest *t = (VirtqEventIdxTest *)arg;
+
+	t->m_n_irqs++;
+	t->m_irq_used_idx = t->m_used->idx;
+	if (t->m_event_delta >= 0)
+		*t->m_used_event = t->m_used->idx + t->m_event_delta;
+}
+
+void VirtqEventIdxTest::SetUp()
+{
+	size_t mem_len = EVENT_TEST_AVAIL_ADDR - EVENT_TEST_USED_ADDR +
+			 offsetof(struct vring_avail, ring[EVENT_TEST_Q_SIZE + 1]);
+
+	ASSERT_NO_FATAL_FAILURE(virtq_setup(EVENT_TEST_USED_ADDR, mem_len,
+					    EVENT_TEST_MKEY, 4 * EVENT_TEST_Q_SIZE,
+					    true));
+	m_used = (struct vring_used *)host_mem(EVENT_TEST_USED_ADDR);
+	m_used_event = &((struct vring_avail *)host_mem(EVENT_TEST_AVAIL_ADDR))->
+		ring[EVENT_TEST_Q_SIZE];
+	m_priv.used_batch.ring = (struct vring_used_elem *)
+		calloc(EVENT_TEST_Q_SIZE, sizeof(struct vring_used_elem));
+	ASSERT_TRUE(m_priv.used_batch.ring);
+
+	memset(&m_cmd, 0, sizeof(m_cmd));
+	m_cmd.vq_priv = &m_priv;
+}
+
+void VirtqEventIdxTest::TearDown()
+{
+	free(m_priv.used_batch.ring);
+	virtq_teardown();
+}
+
+void VirtqEventIdxTest::setup_queue(uint16_t used_idx, bool event_idx,
+		int event_delta)
+{
+	struct virtq_used_batch *ub = &m_priv.used_batch;
+
+	m_qattr.vattr.size = EVENT_TEST_Q_SIZE;
+	m_qattr.vattr.device = EVENT_TEST_USED_ADDR;
+	m_qattr.vattr.driver = EVENT_TEST_AVAIL_ADDR;
+	m_qattr.hw_used_index = used_idx;
+	ub->used_idx = ub->signalled_used = used_idx;
+	ub->signalled_valid = false;
+	ub->max_batch = EVENT_TEST_Q_SIZE;
+	ub->max_delay = 0;
+	ub->event_idx = event_idx;
+	ub->notify = event_test_notify;
+	ub->notify_arg = this;
+	ub->interrupts = ub->suppressed = 0;
+	m_used->idx = used_idx;
+	*m_used_event = event_delta >= 0 ? used_idx + event_delta : used_idx - 1;
+	m_event_delta = event_delta;
+	m_next_id = used_idx;
+	m_n_irqs = 0;
+	m_irq_used_idx = used_idx;
+}
+
+void VirtqEventIdxTest::complete(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++, m_next_id++) {
+		m_cmd.descr_head_idx = m_next_id % EVENT_TEST_Q_SIZE;
+		m_cmd.total_in_len = 512;
+		ASSERT_EQ(0, virtq_sw_send_comp(&m_cmd, m_dma_q));
+	}
+}
+
+void VirtqEventIdxTest::progress(void)
+{
+	virtq_progress(&m_vq_ctx, 0);
+}
+
+/* without EVENT_IDX every used index update interrupts */
+TEST_F(VirtqEventIdxTest, disabled) {
+	int i;
+
+	setup_queue(0, false, 0);
+	for (i = 0; i < 100; i++) {
+		complete(4);
+		progress();
+	}
+	progress();
+	EXPECT_EQ(100, m_n_irqs);
+	EXPECT_EQ(0U, m_priv.used_batch.suppressed);
+	EXPECT_EQ(0U, snap_dma_q_stats_get(m_dma_q)->ops[SNAP_DMA_STAT_OP_READ_SHORT].posted);
+}
+
+/* a driver that re-enables interrupts right away gets one per update */
+TEST_F(VirtqEventIdxTest, every_update) {
+	int i;
+
+	setup_queue(0, true, 0);
+	for (i = 0; i < 100; i++) {
+		complete(4);
+		progress();
+	}
+	progress();
+	EXPECT_EQ(100, m_n_irqs);
+	EXPECT_EQ(400, m_irq_used_idx);
+	EXPECT_EQ(0U, m_priv.used_batch.suppressed);
+}
+
+/*
+ * A driver that polls keeps used_event behind the used index, it is
+ * interrupted once, when the device has not made a decision yet.
+ */
+TEST_F(VirtqEventIdxTest, polling_driver) {
+	int i;
+
+	setup_queue(0, true, -1);
+	for (i = 0; i < 100; i++) {
+		complete(4);
+		progress();
+	}
+	progress();
+	EXPECT_EQ(1, m_n_irqs);
+	EXPECT_EQ(99U, m_priv.used_batch.suppressed);
+}
+
+/*
+ * The driver asks for an interrupt 16 completions after the one it has
+ * seen. With 4 completions per update the first update interrupts at 4,
+ * then 20, 36, ..., 388: 25 interrupts out of 100 updates.
+ */
+TEST_F(VirtqEventIdxTest, delayed_event) {
+	int i;
+
+	setup_queue(0, true, 15);
+	*m_used_event = 65535;
+	for (i = 0; i < 100; i++) {
+		complete(4);
+		progress();
+	}
+	progress();
+	EXPECT_EQ(25, m_n_irqs);
+	EXPECT_EQ(388, m_irq_used_idx);
+	EXPECT_EQ(75U, m_priv.used_batch.suppressed);
+	EXPECT_EQ(400, m_used->idx);
+}
+
+/* the 16 bit indexes wrap around, same sequence as delayed_event */
+TEST_F(VirtqEventIdxTest, index_wrap) {
+	uint16_t start = 65536 - 50;
+	int i;
+
+	setup_queue(start, true, 15);
+	*m_used_event = start - 1;
+	for (i = 0; i < 100; i++) {
+		complete(4);
+		progress();
+	}
+	progress();
+	EXPECT_EQ(25, m_n_irqs);
+	EXPECT_EQ((uint16_t)(start + 388), m_irq_used_idx);
+	EXPECT_EQ((uint16_t)(start + 400), m_used->idx);
+}
+
+/*
+ * Updates written while a used_event read is in flight are decided
+ * together by one more read.
+ */
+TEST_F(VirtqEventIdxTest, read_in_flight) {
+	struct virtq_used_batch *ub = &m_priv.used_batch;
+
+	setup_queue(0, true, 0);
+	complete(1);
+	EXPECT_EQ(0, virtq_used_batch_flush(&m_priv));
+	EXPECT_TRUE(ub->event_read);
+	EXPECT_EQ(1, ub->event_used_idx);
+	complete(1);
+	EXPECT_EQ(0, virtq_used_batch_flush(&m_priv));
+	complete(1);
+	EXPECT_EQ(0, virtq_used_batch_flush(&m_priv));
+	EXPECT_EQ(1, ub->event_used_idx);
+	EXPECT_EQ(0, m_n_irqs);
+
+	/* first read: used_event was 0, interrupt, the driver moves it to 3 */
+	snap_dma_q_progress(m_dma_q);
+	EXPECT_EQ(1, m_n_irqs);
+	EXPECT_TRUE(ub->event_read);
+	EXPECT_EQ(3, ub->event_used_idx);
+
+	/* second read sees 3, the driver has seen the update from 1 to 3 */
+	snap_dma_q_progress(m_dma_q);
+	EXPECT_EQ(1, m_n_irqs);
+	EXPECT_EQ(1U, ub->suppressed);
+	EXPECT_FALSE(ub->event_read);
+	EXPECT_EQ(3, ub->signalled_used);
+
+	/* nothing new, no read */
+	progress();
+	EXPECT_FALSE(ub->event_read);
+}
+
+/* a suspending queue does not read used_event again, it interrupts */
+TEST_F(VirtqEventIdxTest, flushing) {
+	struct virtq_used_batch *ub = &m_priv.used_batch;
+
+	setup_queue(0, true, -1);
+	complete(1);
+	EXPECT_EQ(0, virtq_used_batch_flush(&m_priv));
+	complete(1);
+	EXPECT_EQ(0, virtq_used_batch_flush(&m_priv));
+
+	m_priv.swq_state = SW_VIRTQ_FLUSHING;
+	snap_dma_q_progress(m_dma_q);
+	EXPECT_FALSE(ub->event_read);
+	EXPECT_EQ(2, m_n_irqs);
+	EXPECT_EQ(2, ub->signalled_used);
+}
+
+/*
+ * The used_event read must not overtake the used index write. With a full
+ * send queue the index write is deferred, the read is deferred behind it
+ * even when the send credits come back before the deferred ops are posted.
+ * The sw dma queue executes an op when it is posted.
+ */
+TEST_F(VirtqEventIdxTest, deferred_index_write) {
+	struct snap_dma_q_create_attr attr;
+	const struct snap_dma_q_stats *st;
+	char buf[64];
+	int i;
+
+	snap_dma_q_destroy(m_dma_q);
+	memset(&attr, 0, sizeof(attr));
+	attr.tx_qsize = 2;
+	attr.rx_qsize = 16;
+	attr.tx_elem_size = 16;
+	attr.rx_elem_size = 64;
+	attr.rx_cb = virtq_test_rx_cb;
+	attr.mode = SNAP_DMA_Q_MODE_SW;
+	attr.stats_enable = true;
+	attr.pending_qsize = 16;
+	m_dma_q = snap_dma_q_create(NULL, &attr);
+	ASSERT_TRUE(m_dma_q);
+	m_priv.dma_q = m_dma_q;
+	st = snap_dma_q_stats_get(m_dma_q);
+
+	setup_queue(0, true, 0);
+	memset(buf, 0, sizeof(buf));
+	ASSERT_EQ(0, snap_dma_q_write(m_dma_q, buf, sizeof(buf), 0,
+				      EVENT_TEST_USED_ADDR + 0x8000,
+				      EVENT_TEST_MKEY, NULL));
+	ASSERT_EQ(0, snap_dma_q_write(m_dma_q, buf, sizeof(buf), 0,
+				      EVENT_TEST_USED_ADDR + 0x8000,
+				      EVENT_TEST_MKEY, NULL));
+	ASSERT_EQ(0, m_dma_q->tx_available);
+
+	complete(1);
+	EXPECT_EQ(0, virtq_used_batch_flush(&m_priv));
+	EXPECT_EQ(0, m_used->idx);
+	/* ring write, index write and the used_event read */
+	EXPECT_EQ(3, snap_dma_q_pending_count(m_dma_q));
+
+	for (i = 0; i < 10 && (m_n_irqs == 0 || snap_dma_q_pending_count(m_dma_q)); i++) {
+		progress();
+		ASSERT_LE(st->ops[SNAP_DMA_STAT_OP_READ_SHORT].posted,
+			  st->ops[SNAP_DMA_STAT_OP_WRITE_SHORT].posted);
+	}
+	EXPECT_EQ(1, m_used->idx);
+	EXPECT_EQ(1, m_n_irqs);
+	EXPECT_EQ(0U, m_priv.used_batch.suppressed);
+}
@@ -0,0 +1,891 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <linux/virtio_ring.h>
+#include <linux/virtio_blk.h>
+
+#include <infiniband/verbs.h>
+
+extern "C" {
+#include "snap_dma.h"
+#include "snap_dma_stat.h"
+#include "snap_vq_internal.h"
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * Packed ring conformance of the snap_vq software path. A virtio-blk device
+ * backed by a RAM disk serves a simulated guest driver, the guest memory
+ * is simulated by the SNAP_DMA_Q_MODE_SW dma queue.
+ */
+
+#define PACKED_TEST_HOST_ADDR  0x600000000ULL
+#define PACKED_TEST_HOST_LEN   (20 * 1024 * 1024)
+#define PACKED_TEST_MKEY       0x789a
+#define PACKED_TEST_RING_OFF   0
+#define PACKED_TEST_DRV_EVENT  0x10000
+#define PACKED_TEST_DEV_EVENT  0x10010
+#define PACKED_TEST_TABLE_OFF  0x20000
+#define PACKED_TEST_DATA_OFF   0x200000
+#define PACKED_TEST_BUF_SPAN   0x10000
+#define PACKED_TEST_SEG_LEN    2048
+#define PACKED_TEST_MAX_SIZE   256
+#define PACKED_TEST_DISK_LEN   (1024 * 1024)
+
+struct packed_test_cmd {
+	struct snap_vq_cmd common;
+	struct virtio_blk_outhdr hdr;
+	uint8_t status;
+	uint8_t *data;
+	size_t data_len;
+	const struct snap_vq_cmd_desc *data_desc;
+	const struct snap_vq_cmd_desc *status_desc;
+};
+
+/* buffer in the guest view: slots it takes and its expected status */
+struct packed_test_buf {
+	int n_slots;
+	uint32_t in_len;
+	bool busy;
+};
+
+class VirtqPackedTest : public ::testing::Test {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	struct snap_dma_sw_mem *m_hmem;
+	uint8_t *m_host;
+	struct snap_dma_q *m_dma_q;
+	struct snap_vq m_q;
+	uint8_t *m_disk;
+	uint8_t *m_shadow;
+	bool m_hold;
+	std::vector<struct packed_test_cmd *> m_held;
+	int m_n_notify;
+
+	/* guest driver */
+	uint16_t m_avail_idx;
+	bool m_avail_wrap;
+	uint16_t m_used_idx;
+	bool m_used_wrap;
+	int m_n_free;
+	struct packed_test_buf m_bufs[PACKED_TEST_MAX_SIZE];
+	std::deque<uint16_t> m_outstanding;
+	std::vector<std::pair<uint16_t, uint32_t> > m_used;
+
+	void setup_queue(uint16_t size, uint32_t op_flags);
+	void destroy_queue(void);
+	struct vring_packed_desc *ring(void);
+	struct vring_packed_desc_event *driver_event(void);
+	uint64_t buf_addr(uint16_t id);
+	uint8_t buf_status(uint16_t id);
+	uint16_t next_id(void);
+	int add_buf(uint32_t type, uint64_t sector, int n_segs, bool indirect);
+	int add_raw(const struct vring_packed_desc *descs, int n);
+	int poll_used(void);
+	void run(int n_bufs);
+	void check_disk(void);
+};
+
+static VirtqPackedTest *g_packed_test;
+
+static void packed_test_rx_cb(struct snap_dma_q *q, const void *data,
+		uint32_t data_len, uint32_t imm_data)
+{
+}
+
+static void packed_test_notify(struct snap_vq *q)
+{
+	g_packed_test->m_n_notify++;
+}
+
+static struct packed_test_cmd *to_packed_test_cmd(struct snap_vq_cmd *cmd)
+{
+	return container_of(cmd, struct packed_test_cmd, common);
+}
+
+static void packed_test_finish(struct packed_test_cmd *cmd)
+{
+	free(cmd->data);
+	cmd->data = NULL;
+	if (g_packed_test->m_hold)
+		g_packed_test->m_held.push_back(cmd);
+	else
+		snap_vq_cmd_complete(&cmd->common);
+}
+
+static void packed_test_status_done(struct snap_vq_cmd *vcmd,
+		enum ibv_wc_status status)
+{
+	ASSERT_EQ(IBV_WC_SUCCESS, status);
+	packed_test_finish(to_packed_test_cmd(vcmd));
+}
+
+static void packed_test_send_status(struct packed_test_cmd *cmd, uint8_t status)
+{
+	cmd->status = status;
+	ASSERT_EQ(0, snap_vq_cmd_descs_rw(&cmd->common, cmd->status_desc, 0,
+					  &cmd->status, 1, 0,
+					  packed_test_status_done, true));
+}
+
+static void packed_test_data_done(struct snap_vq_cmd *vcmd,
+		enum ibv_wc_status status)
+{
+	struct packed_test_cmd *cmd = to_packed_test_cmd(vcmd);
+
+	ASSERT_EQ(IBV_WC_SUCCESS, status);
+	if (cmd->hdr.type == VIRTIO_BLK_T_OUT)
+		memcpy(g_packed_test->m_disk + cmd->hdr.sector * 512, cmd->data,
+		       cmd->data_len);
+	packed_test_send_status(cmd, VIRTIO_BLK_S_OK);
+}
+
+static void packed_test_hdr_done(struct snap_vq_cmd *vcmd,
+		enum ibv_wc_status status)
+{
+	struct packed_test_cmd *cmd = to_packed_test_cmd(vcmd);
+	bool write;
+
+	ASSERT_EQ(IBV_WC_SUCCESS, status);
+	switch (cmd->hdr.type) {
+	case VIRTIO_BLK_T_IN:
+	case VIRTIO_BLK_T_OUT:
+		if (!cmd->data_len ||
+		    cmd->hdr.sector * 512 + cmd->data_len > PACKED_TEST_DISK_LEN)
+			return packed_test_send_status(cmd, VIRTIO_BLK_S_IOERR);
+		write = cmd->hdr.type == VIRTIO_BLK_T_IN;
+		cmd->data = (uint8_t *)malloc(cmd->data_len);
+		ASSERT_TRUE(cmd->data);
+		if (write)
+			memcpy(cmd->data, g_packed_test->m_disk + cmd->hdr.sector * 512,
+			       cmd->data_len);
+		ASSERT_EQ(0, snap_vq_cmd_descs_rw(&cmd->common, cmd->data_desc,
+						  0, cmd->data, cmd->data_len, 0,
+						  packed_test_data_done, write));
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		packed_test_send_status(cmd, VIRTIO_BLK_S_OK);
+		break;
+	default:
+		packed_test_send_status(cmd, VIRTIO_BLK_S_UNSUPP);
+		break;
+	}
+}
+
+/* header, data and status descriptors, as virtio-blk lays them out */
+static void packed_test_handle(struct snap_vq_cmd *vcmd)
+{
+	struct packed_test_cmd *cmd = to_packed_test_cmd(vcmd);
+	const struct snap_vq_cmd_desc *desc;
+
+	desc = TAILQ_FIRST(&vcmd->descs);
+	cmd->status_desc = TAILQ_LAST(&vcmd->descs, snap_vq_cmd_desc_list);
+	cmd->data_desc = TAILQ_NEXT(desc, entry);
+	cmd->data_len = 0;
+	for (desc = cmd->data_desc; desc && desc != cmd->status_desc;
+	     desc = TAILQ_NEXT(desc, entry))
+		cmd->data_len += desc->desc.len;
+
+	ASSERT_EQ(0, snap_vq_cmd_descs_rw(vcmd, TAILQ_FIRST(&vcmd->descs), 0,
+					  &cmd->hdr, sizeof(cmd->hdr), 0,
+					  packed_test_hdr_done, false));
+}
+
+static struct snap_vq_cmd *packed_test_create_cmd(struct snap_vq *q, int index)
+{
+	struct packed_test_cmd *cmd;
+
+	cmd = (struct packed_test_cmd *)calloc(1, sizeof(*cmd));
+	if (!cmd)
+		return NULL;
+
+	snap_vq_cmd_create(q, &cmd->common);
+	return &cmd->common;
+}
+
+static void packed_test_delete_cmd(struct snap_vq_cmd *cmd)
+{
+	snap_vq_cmd_destroy(cmd);
+	free(to_packed_test_cmd(cmd));
+}
+
+static const struct snap_vq_cmd_ops packed_test_cmd_ops = {
+	.hdr_size = sizeof(struct virtio_blk_outhdr),
+	.ftr_size = 1,
+	.create = packed_test_create_cmd,
+	.handle = packed_test_handle,
+	.destroy = packed_test_delete_cmd,
+};
+
+void VirtqPackedTest::SetUp()
+{
+	struct snap_dma_q_create_attr attr;
+
+	g_packed_test = this;
+	m_hmem = snap_dma_sw_mem_create(NULL, PACKED_TEST_HOST_LEN,
+					PACKED_TEST_HOST_ADDR, PACKED_TEST_MKEY);
+	ASSERT_TRUE(m_hmem);
+	m_host = (uint8_t *)snap_dma_sw_mem_addr(m_hmem, PACKED_TEST_HOST_ADDR);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.tx_qsize = attr.rx_qsize = 4096;
+	attr.tx_elem_size = 16;
+	attr.rx_elem_size = 64;
+	attr.rx_cb = packed_test_rx_cb;
+	attr.mode = SNAP_DMA_Q_MODE_SW;
+	attr.stats_enable = true;
+	m_dma_q = snap_dma_q_create(NULL, &attr);
+	ASSERT_TRUE(m_dma_q);
+
+	m_disk = (uint8_t *)calloc(1, PACKED_TEST_DISK_LEN);
+	m_shadow = (uint8_t *)calloc(1, PACKED_TEST_DISK_LEN);
+	ASSERT_TRUE(m_disk && m_shadow);
+	memset(&m_q, 0, sizeof(m_q));
+	m_hold = false;
+	m_n_notify = 0;
+	srand(29);
+}
+
+void VirtqPackedTest::TearDown()
+{
+	destroy_queue();
+	free(m_disk);
+	free(m_shadow);
+	if (m_dma_q)
+		snap_dma_q_destroy(m_dma_q);
+	if (m_hmem)
+		snap_dma_sw_mem_destroy(m_hmem);
+	g_packed_test = NULL;
+}
+
+/*
+ * Same state snap_vq_create() builds for a packed ring, except that the
+ * local buffers don't need a registered pd on the sw dma queue.
+ */
+void VirtqPackedTest::setup_queue(uint16_t size, uint32_t op_flags)
+{
+	struct snap_vq_packed *packed = &m_q.packed;
+	struct snap_vq_cmd *cmd;
+	int i, n_descs = 2 * size;
+
+	destroy_queue();
+	memset(m_host, 0, PACKED_TEST_TABLE_OFF);
+	m_q.size = size;
+	m_q.desc_pa = PACKED_TEST_HOST_ADDR + PACKED_TEST_RING_OFF;
+	m_q.driver_pa = PACKED_TEST_HOST_ADDR + PACKED_TEST_DRV_EVENT;
+	m_q.device_pa = PACKED_TEST_HOST_ADDR + PACKED_TEST_DEV_EVENT;
+	m_q.op_flags = op_flags | SNAP_VQ_OP_FLAGS_PACKED_RING;
+	m_q.xmkey = PACKED_TEST_MKEY;
+	m_q.dma_q = m_dma_q;
+	m_q.state = SNAP_VQ_STATE_RUNNING;
+	m_q.desc_prefetch = 1;
+
+	m_q.cmd_ops = &packed_test_cmd_ops;
+	TAILQ_INIT(&m_q.free_cmds);
+	TAILQ_INIT(&m_q.inflight_cmds);
+	TAILQ_INIT(&m_q.fatal_cmds);
+	for (i = 0; i < size; i++) {
+		cmd = packed_test_create_cmd(&m_q, i);
+		ASSERT_TRUE(cmd);
+		TAILQ_INSERT_TAIL(&m_q.free_cmds, cmd, entry);
+	}
+
+	m_q.desc_pool.entries = (struct snap_vq_cmd_desc *)
+		calloc(n_descs, sizeof(struct snap_vq_cmd_desc));
+	ASSERT_TRUE(m_q.desc_pool.entries);
+	TAILQ_INIT(&m_q.desc_pool.free_descs);
+	for (i = 0; i < n_descs; i++)
+		TAILQ_INSERT_HEAD(&m_q.desc_pool.free_descs,
+				  &m_q.desc_pool.entries[i], entry);
+	m_q.desc_pool.n_free = n_descs;
+
+	packed->ring = (struct vring_packed_desc *)
+		calloc(2 * size + 2, sizeof(struct vring_packed_desc));
+	ASSERT_TRUE(packed->ring);
+	packed->used = packed->ring + size;
+	packed->driver_event = (struct vring_packed_desc_event *)(packed->used + size);
+	packed->device_event = packed->driver_event + 1;
+	packed->notify = packed_test_notify;
+	ASSERT_EQ(0, snap_vq_packed_init(&m_q, SNAP_VQ_PACKED_IDX_WRAP,
+					 SNAP_VQ_PACKED_IDX_WRAP));
+
+	m_avail_idx = m_used_idx = 0;
+	m_avail_wrap = m_used_wrap = true;
+	m_n_free = size;
+	memset(m_bufs, 0, sizeof(m_bufs));
+	m_outstanding.clear();
+	m_used.clear();
+	m_n_notify = 0;
+}
+
+void VirtqPackedTest::destroy_queue(void)
+{
+	struct snap_vq_cmd *cmd;
+
+	if (!m_q.size)
+		return;
+
+	while (!TAILQ_EMPTY(&m_q.inflight_cmds)) {
+		cmd = TAILQ_FIRST(&m_q.inflight_cmds);
+		TAILQ_REMOVE(&m_q.inflight_cmds, cmd, entry);
+		packed_test_delete_cmd(cmd);
+	}
+	while (!TAILQ_EMPTY(&m_q.fatal_cmds)) {
+		cmd = TAILQ_FIRST(&m_q.fatal_cmds);
+		TAILQ_REMOVE(&m_q.fatal_cmds, cmd, entry);
+		packed_test_delete_cmd(cmd);
+	}
+	while (!TAILQ_EMPTY(&m_q.free_cmds)) {
+		cmd = TAILQ_FIRST(&m_q.free_cmds);
+		TAILQ_REMOVE(&m_q.free_cmds, cmd, entry);
+		packed_test_delete_cmd(cmd);
+	}
+	free(m_q.desc_pool.entries);
+	free(m_q.packed.ring);
+	memset(&m_q, 0, sizeof(m_q));
+	m_held.clear();
+}
+
+struct vring_packed_desc *VirtqPackedTest::ring(void)
+{
+	return (struct vring_packed_desc *)(m_host + PACKED_TEST_RING_OFF);
+}
+
+struct vring_packed_desc_event *VirtqPackedTest::driver_event(void)
+{
+	return (struct vring_packed_desc_event *)(m_host + PACKED_TEST_DRV_EVENT);
+}
+
+/*
+ * Header at the start of the buffer area, status at 32 and data segments
+ * from 64. Areas of long chains overlap the following ids.
+ */
+uint64_t VirtqPackedTest::buf_addr(uint16_t id)
+{
+	return PACKED_TEST_HOST_ADDR + PACKED_TEST_DATA_OFF +
+	       (uint64_t)id * PACKED_TEST_BUF_SPAN;
+}
+
+uint8_t VirtqPackedTest::buf_status(uint16_t id)
+{
+	return m_host[buf_addr(id) + 32 - PACKED_TEST_HOST_ADDR];
+}
+
+static uint16_t packed_test_avail_flags(bool wrap)
+{
+	return wrap ? 1 << VRING_PACKED_DESC_F_AVAIL : 1 << VRING_PACKED_DESC_F_USED;
+}
+
+uint16_t VirtqPackedTest::next_id(void)
+{
+	uint16_t id;
+
+	for (id = 0; m_bufs[id].busy; id++)
+		;
+	return id;
+}
+
+/*
+ * Put a chain of n descriptors on the ring, the head is made available
+ * last, like the driver does. Return the buffer id.
+ */
+int VirtqPackedTest::add_raw(const struct vring_packed_desc *descs, int n)
+{
+	uint16_t id, idx = m_avail_idx, head = m_avail_idx, head_flags = 0;
+	bool wrap = m_avail_wrap;
+	int i;
+
+	if (n > m_n_free)
+		return -1;
+
+	id = next_id();
+
+	for (i = 0; i < n; i++) {
+		struct vring_packed_desc *d = &ring()[idx];
+		uint16_t flags = descs[i].flags | packed_test_avail_flags(wrap);
+
+		if (i < n - 1)
+			flags |= VRING_DESC_F_NEXT;
+		d->addr = descs[i].addr;
+		d->len = descs[i].len;
+		d->id = id;
+		if (i == 0)
+			head_flags = flags;
+		else
+			d->flags = flags;
+
+		if (++idx == m_q.size) {
+			idx = 0;
+			wrap = !wrap;
+		}
+	}
+	ring()[head].flags = head_flags;
+
+	m_avail_idx = idx;
+	m_avail_wrap = wrap;
+	m_n_free -= n;
+	m_bufs[id].busy = true;
+	m_bufs[id].n_slots = n;
+	m_outstanding.push_back(id);
+	return id;
+}
+
+/*
+ * virtio-blk request of n_segs data segments of random length. OUT data is
+ * random, and the shadow disk is updated when the request is added.
+ */
+int VirtqPackedTest::add_buf(uint32_t type, uint64_t sector, int n_segs,
+			     bool indirect)
+{
+	std::vector<struct vring_packed_desc> descs(n_segs + 2);
+	struct virtio_blk_outhdr *hdr;
+	uint64_t hdr_addr, st_addr, disk_off = sector * 512, off = 0;
+	uint16_t id;
+	uint32_t j;
+	int i, ret;
+
+	if ((indirect ? 1 : n_segs + 2) > m_n_free)
+		return -1;
+
+	id = next_id();
+	hdr_addr = buf_addr(id);
+	st_addr = hdr_addr + 32;
+	hdr = (struct virtio_blk_outhdr *)(m_host + (hdr_addr - PACKED_TEST_HOST_ADDR));
+	hdr->type = type;
+	hdr->ioprio = 0;
+	hdr->sector = sector;
+	m_host[st_addr - PACKED_TEST_HOST_ADDR] = 0xff;
+
+	descs[0].addr = hdr_addr;
+	descs[0].len = sizeof(*hdr);
+	descs[0].flags = 0;
+	for (i = 1; i <= n_segs; i++) {
+		descs[i].addr = hdr_addr + 64 + (i - 1) * PACKED_TEST_SEG_LEN;
+		descs[i].len = 512 * (1 + rand() % 4);
+		descs[i].flags = type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0;
+		if (type == VIRTIO_BLK_T_OUT) {
+			for (j = 0; j < descs[i].len; j++)
+				m_host[descs[i].addr - PACKED_TEST_HOST_ADDR + j] = rand();
+			memcpy(m_shadow + disk_off + off,
+			       m_host + (descs[i].addr - PACKED_TEST_HOST_ADDR),
+			       descs[i].len);
+		}
+		off += descs[i].len;
+	}
+	descs[n_segs + 1].addr = st_addr;
+	descs[n_segs + 1].len = 1;
+	descs[n_segs + 1].flags = VRING_DESC_F_WRITE;
+
+	if (!indirect) {
+		ret = add_raw(descs.data(), descs.size());
+	} else {
+		struct vring_packed_desc *table, idesc;
+		uint64_t table_addr = PACKED_TEST_HOST_ADDR + PACKED_TEST_TABLE_OFF +
+				      id * PACKED_TEST_MAX_SIZE * sizeof(*table);
+
+		table = (struct vring_packed_desc *)
+			(m_host + (table_addr - PACKED_TEST_HOST_ADDR));
+		for (i = 0; i < (int)descs.size(); i++) {
+			table[i] = descs[i];
+			table[i].id = 0;
+		}
+		idesc.addr = table_addr;
+		idesc.len = descs.size() * sizeof(*table);
+		idesc.flags = VRING_DESC_F_INDIRECT;
+		ret = add_raw(&idesc, 1);
+	}
+	if (ret < 0)
+		return ret;
+
+	m_bufs[ret].in_len = 1 + (type == VIRTIO_BLK_T_IN ? off : 0);
+	return ret;
+}
+
+/* collect used buffers, a used id returns every buffer before it in order */
+int VirtqPackedTest::poll_used(void)
+{
+	struct vring_packed_desc *d;
+	bool avail, used;
+	uint16_t id, done;
+	int n = 0;
+
+	for (;;) {
+		d = &ring()[m_used_idx];
+		avail = d->flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+		used = d->flags & (1 << VRING_PACKED_DESC_F_USED);
+		if (avail != m_used_wrap || used != m_used_wrap)
+			break;
+
+		id = d->id;
+		EXPECT_TRUE(m_bufs[id].busy) << "id " << id;
+		if (!m_bufs[id].busy)
+			return n;
+		m_used.push_back(std::make_pair(id, d->len));
+
+		do {
+			if (m_q.op_flags & SNAP_VQ_OP_FLAGS_IN_ORDER_COMPLETIONS) {
+				done = m_outstanding.front();
+				m_outstanding.pop_front();
+			} else {
+				done = id;
+				m_outstanding.erase(std::find(m_outstanding.begin(),
+							      m_outstanding.end(), id));
+			}
+			m_used_idx += m_bufs[done].n_slots;
+			if (m_used_idx >= m_q.size) {
+				m_used_idx -= m_q.size;
+				m_used_wrap = !m_used_wrap;
+			}
+			m_n_free += m_bufs[done].n_slots;
+			m_bufs[done].busy = false;
+			n++;
+		} while (done != id);
+	}
+
+	return n;
+}
+
+/* progress until n_bufs more buffers are used */
+void VirtqPackedTest::run(int n_bufs)
+{
+	int i, n = 0;
+
+	for (i = 0; i < 1000 && n < n_bufs; i++) {
+		snap_vq_progress(&m_q);
+		n += poll_used();
+	}
+	ASSERT_EQ(n_bufs, n);
+	/* notifications are decided once the driver event read completes */
+	for (i = 0; i < 1000 && m_q.packed.event_read; i++)
+		snap_vq_progress(&m_q);
+	ASSERT_FALSE(m_q.packed.event_read);
+}
+
+void VirtqPackedTest::check_disk(void)
+{
+	ASSERT_EQ(0, memcmp(m_disk, m_shadow, PACKED_TEST_DISK_LEN));
+}
+
+/* written data is read back, used lengths count the device written bytes */
+TEST_F(VirtqPackedTest, read_write) {
+	uint64_t data_addr;
+	int i, id;
+
+	setup_queue(64, 0);
+	for (i = 0; i < 8; i++)
+		ASSERT_LE(0, add_buf(VIRTIO_BLK_T_OUT, 16 * i, 1 + i % 3, false));
+	run(8);
+	check_disk();
+	for (i = 0; i < 8; i++) {
+		EXPECT_EQ(1U, m_used[i].second);
+		EXPECT_EQ(VIRTIO_BLK_S_OK, buf_status(m_used[i].first));
+	}
+
+	m_used.clear();
+	id = add_buf(VIRTIO_BLK_T_IN, 16, 2, false);
+	ASSERT_LE(0, id);
+	data_addr = buf_addr(id) + 64 - PACKED_TEST_HOST_ADDR;
+	memset(m_host + data_addr, 0, 2 * PACKED_TEST_SEG_LEN);
+	run(1);
+	ASSERT_EQ(id, m_used[0].first);
+	EXPECT_EQ(m_bufs[id].in_len, m_used[0].second);
+	/* segments are 512 aligned, data is contiguous on the disk */
+	EXPECT_EQ(0, memcmp(m_host + data_addr, m_shadow + 16 * 512, 512));
+
+	/* unsupported requests are completed with an error status */
+	m_used.clear();
+	id = add_buf(VIRTIO_BLK_T_GET_ID + 100, 0, 0, false);
+	run(1);
+	EXPECT_EQ(VIRTIO_BLK_S_UNSUPP, buf_status(id));
+	EXPECT_TRUE(TAILQ_EMPTY(&m_q.fatal_cmds));
+}
+
+/*
+ * Random requests on a small ring, the wrap counters flip many times and
+ * chains cross the end of the ring. Requests in flight don't overlap on the
+ * disk, as indirect ones may complete after requests added later.
+ */
+TEST_F(VirtqPackedTest, ring_wrap) {
+	const int n_iters = 3000;
+	int i, n_segs, n_inflight = 0, n_wraps = 0;
+	bool wrap, indirect;
+	uint32_t type;
+
+	setup_queue(16, 0);
+	wrap = m_q.packed.avail_wrap;
+	for (i = 0; i < n_iters; i++) {
+		n_segs = 1 + rand() % 4;
+		type = rand() % 2 ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+		indirect = rand() % 8 == 0;
+		if (add_buf(type, next_id() * 16, n_segs, indirect) >= 0)
+			n_inflight++;
+
+		snap_vq_progress(&m_q);
+		n_inflight -= poll_used();
+		if (m_q.packed.avail_wrap != wrap) {
+			wrap = m_q.packed.avail_wrap;
+			n_wraps++;
+		}
+	}
+	run(n_inflight);
+	ASSERT_EQ(0, m_n_free - m_q.size);
+	ASSERT_EQ(m_avail_idx, m_used_idx);
+	ASSERT_EQ(m_q.packed.avail_idx, m_q.packed.used_idx);
+	ASSERT_EQ(m_q.packed.avail_wrap, m_q.packed.used_wrap);
+	ASSERT_TRUE(TAILQ_EMPTY(&m_q.fatal_cmds));
+	check_disk();
+	printf("%d requests, %d ring wraps, %lu ring reads\n", n_iters, n_wraps,
+	       m_q.packed.fetches);
+	EXPECT_GT(n_wraps, 100);
+}
+
+TEST_F(VirtqPackedTest, chain_across_end) {
+	int i, id;
+
+	setup_queue(16, 0);
+	/* a flush takes 2 slots, move the ring to slot 14 */
+	for (i = 0; i < 7; i++)
+		ASSERT_LE(0, add_buf(VIRTIO_BLK_T_FLUSH, 0, 0, false));
+	run(7);
+	ASSERT_EQ(14, m_avail_idx);
+
+	id = add_buf(VIRTIO_BLK_T_OUT, 100, 3, false);
+	ASSERT_LE(0, id);
+	ASSERT_FALSE(m_avail_wrap);
+	run(1);
+	EXPECT_EQ(3, m_q.packed.used_idx);
+	EXPECT_FALSE(m_q.packed.used_wrap);
+	check_disk();
+}
+
+/* a chain longer than the fetch window is read with a wider window */
+TEST_F(VirtqPackedTest, long_chain) {
+	int id;
+
+	setup_queue(256, 0);
+	id = add_buf(VIRTIO_BLK_T_OUT, 0, 150, false);
+	ASSERT_LE(0, id);
+	ASSERT_EQ(152, m_bufs[id].n_slots);
+	run(1);
+	check_disk();
+	EXPECT_EQ(m_bufs[id].in_len, m_used[0].second);
+	/* the window is back to the default once the chain is started */
+	EXPECT_EQ(SNAP_VQ_PACKED_FETCH_MAX, m_q.packed.fetch_len);
+}
+
+/* indirect tables larger than a read batch */
+TEST_F(VirtqPackedTest, indirect) {
+	int i, id;
+
+	setup_queue(128, 0);
+	id = add_buf(VIRTIO_BLK_T_OUT, 0, 100, true);
+	ASSERT_LE(0, id);
+	ASSERT_EQ(1, m_bufs[id].n_slots);
+	run(1);
+	check_disk();
+
+	for (i = 0; i < 10; i++)
+		ASSERT_LE(0, add_buf(VIRTIO_BLK_T_IN, 8 * i, 1 + i, true));
+	run(10);
+	EXPECT_EQ(11, m_q.packed.used_idx);
+	EXPECT_TRUE(TAILQ_EMPTY(&m_q.fatal_cmds));
+}
+
+/*
+ * Requests completed in reverse order. With in-order completions they are
+ * returned in the order they were made available, and only when
+ * VIRTIO_F_IN_ORDER was negotiated the device writes one used descriptor
+ * for all of them.
+ */
+TEST_F(VirtqPackedTest, in_order) {
+	uint32_t flags[] = { 0, SNAP_VQ_OP_FLAGS_IN_ORDER_COMPLETIONS,
+			     SNAP_VQ_OP_FLAGS_IN_ORDER_COMPLETIONS |
+			     SNAP_VQ_OP_FLAGS_IN_ORDER_USED };
+	std::vector<struct packed_test_cmd *> held;
+	int i, k, ids[8];
+
+	for (k = 0; k < 3; k++) {
+		setup_queue(64, flags[k]);
+		m_hold = true;
+		for (i = 0; i < 8; i++)
+			ids[i] = add_buf(VIRTIO_BLK_T_IN, 0, 1 + i % 3, false);
+		for (i = 0; i < 100 && m_held.size() < 8; i++)
+			snap_vq_progress(&m_q);
+		ASSERT_EQ(8U, m_held.size());
+
+		m_hold = false;
+		held = m_held;
+		m_held.clear();
+		for (i = 7; i >= 0; i--) {
+			snap_vq_cmd_complete(&held[i]->common);
+			poll_used();
+			/* nothing is returned until the oldest request completes */
+			if (k && i) {
+				ASSERT_TRUE(m_used.empty());
+			}
+		}
+		run(0);
+		ASSERT_EQ(0U, m_outstanding.size());
+		if (k == 2) {
+			ASSERT_EQ(1U, m_used.size());
+			EXPECT_EQ(ids[7], m_used[0].first);
+		} else {
+			ASSERT_EQ(8U, m_used.size());
+			for (i = 0; i < 8; i++)
+				EXPECT_EQ(ids[k ? i : 7 - i], m_used[i].first);
+		}
+		EXPECT_EQ(m_avail_idx, m_q.packed.used_idx);
+	}
+}
+
+/* driver notifications follow the driver event suppression structure */
+TEST_F(VirtqPackedTest, event_suppression) {
+	struct vring_packed_desc_event *ev;
+	int i;
+
+	setup_queue(16, 0);
+
+	/* the device asks not to be notified, it polls the ring */
+	ev = (struct vring_packed_desc_event *)(m_host + PACKED_TEST_DEV_EVENT);
+	EXPECT_EQ(VRING_PACKED_EVENT_FLAG_DISABLE, ev->flags);
+	ev = driver_event();
+
+	ev->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+	for (i = 0; i < 3; i++) {
+		add_buf(VIRTIO_BLK_T_FLUSH, 0, 0, false);
+		run(1);
+	}
+	EXPECT_EQ(3, m_n_notify);
+
+	m_n_notify = 0;
+	ev->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+	for (i = 0; i < 3; i++) {
+		add_buf(VIRTIO_BLK_T_FLUSH, 0, 0, false);
+		run(1);
+	}
+	EXPECT_EQ(0, m_n_notify);
+	EXPECT_EQ(12, m_used_idx);
+
+	/* notify once slot 2 of the next lap is used, 2 slots per request */
+	ev->flags = VRING_PACKED_EVENT_FLAG_DESC;
+	ev->off_wrap = 2 | (0 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	for (i = 0; i < 6; i++) {
+		add_buf(VIRTIO_BLK_T_FLUSH, 0, 0, false);
+		run(1);
+		/* used descriptors go to slots 12, 14, 0, 2, ... */
+		EXPECT_EQ(i >= 3 ? 1 : 0, m_n_notify) << "request " << i;
+	}
+	EXPECT_EQ(4U, m_q.packed.notifies);
+}
+
+/*
+ * The driver enables notifications after the ring window was read, while
+ * its request is in flight. The device must decide with the new flags.
+ */
+TEST_F(VirtqPackedTest, event_enable_race) {
+	struct vring_packed_desc_event *ev;
+	int i;
+
+	setup_queue(16, 0);
+	ev = driver_event();
+	ev->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+
+	m_hold = true;
+	add_buf(VIRTIO_BLK_T_FLUSH, 0, 0, false);
+	for (i = 0; i < 100 && m_held.empty(); i++)
+		snap_vq_progress(&m_q);
+	ASSERT_EQ(1U, m_held.size());
+
+	/* the ring was fetched with notifications disabled */
+	ev->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+	m_hold = false;
+	snap_vq_cmd_complete(&m_held[0]->common);
+	m_held.clear();
+	run(1);
+	EXPECT_EQ(1, m_n_notify);
+}
+
+/* requests available together are started from a single ring read */
+TEST_F(VirtqPackedTest, batch_fetch) {
+	const struct snap_dma_q_stats *st = snap_dma_q_stats_get(m_dma_q);
+	int i;
+
+	setup_queue(64, 0);
+	for (i = 0; i < 32; i++)
+		ASSERT_LE(0, add_buf(VIRTIO_BLK_T_FLUSH, 0, 0, false));
+
+	snap_dma_q_stats_reset(m_dma_q);
+	snap_vq_progress(&m_q);
+	snap_vq_progress(&m_q);
+	EXPECT_EQ(0, m_q.packed.avail_idx);
+	EXPECT_FALSE(m_q.packed.avail_wrap);
+	/* the window with the requests and the next, empty one */
+	EXPECT_EQ(2U, m_q.packed.fetches);
+	run(32);
+	printf("dma reads per request %.2f\n",
+	       (double)st->ops[SNAP_DMA_STAT_OP_READ].posted / 32);
+}
+
+/* a suspended queue doesn't fetch new requests and drains the started ones */
+TEST_F(VirtqPackedTest, suspend) {
+	int i;
+
+	setup_queue(64, 0);
+	for (i = 0; i < 4; i++)
+		add_buf(VIRTIO_BLK_T_OUT, 8 * i, 2, false);
+	snap_vq_progress(&m_q);
+	snap_vq_progress(&m_q);
+	snap_vq_suspend(&m_q);
+	for (i = 0; i < 100 && !snap_vq_is_suspended(&m_q); i++)
+		snap_vq_progress(&m_q);
+	ASSERT_TRUE(snap_vq_is_suspended(&m_q));
+	EXPECT_EQ(4, poll_used());
+
+	add_buf(VIRTIO_BLK_T_OUT, 100, 2, false);
+	for (i = 0; i < 10; i++)
+		snap_vq_progress(&m_q);
+	EXPECT_EQ(0, poll_used());
+
+	snap_vq_resume(&m_q);
+	run(1);
+	check_disk();
+}
+
+/* bad indirect descriptors fail their request, the queue goes on */
+TEST_F(VirtqPackedTest, malformed) {
+	struct vring_packed_desc bad[2];
+	int n_fatal = 0;
+	struct snap_vq_cmd *cmd;
+
+	setup_queue(16, 0);
+	memset(bad, 0, sizeof(bad));
+	bad[0].addr = PACKED_TEST_HOST_ADDR + PACKED_TEST_TABLE_OFF;
+	bad[0].flags = VRING_DESC_F_INDIRECT;
+
+	/* empty table, table length not a multiple of a descriptor */
+	bad[0].len = 0;
+	add_raw(bad, 1);
+	bad[0].len = 24;
+	add_raw(bad, 1);
+	/* table larger than the queue */
+	bad[0].len = 17 * sizeof(struct vring_packed_desc);
+	add_raw(bad, 1);
+	/* indirect descriptor inside a chain */
+	bad[1] = bad[0];
+	bad[0].flags = 0;
+	bad[0].len = 16;
+	add_raw(bad, 2);
+
+	add_buf(VIRTIO_BLK_T_OUT, 0, 1, false);
+	run(1);
+	check_disk();
+	TAILQ_FOREACH(cmd, &m_q.fatal_cmds, entry)
+		n_fatal++;
+	EXPECT_EQ(4, n_fatal);
+}
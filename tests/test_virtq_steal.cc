@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <infiniband/verbs.h>
+
+#include "test_virtq.h"
+
+/*
+ * Work stealing rings of a queue. Commands are pushed to the ready ring in
+ * sequence order, like the HANDLE_REQ stage does, and the simulated block
+ * device completes them later on the thread that submitted them. Commands
+ * that come back to the owner write their status to the simulated host
+ * memory through the SNAP_DMA_Q_MODE_SW dma queue and are reused once the
+ * write completes.
+ */
+
+#define STEAL_TEST_Q_SIZE    128
+#define STEAL_TEST_THREADS   4
+#define STEAL_TEST_BURST     64
+#define STEAL_TEST_MAX_CMDS  (1 << 15)
+#define STEAL_TEST_HOST_ADDR 0x500000000ULL
+#define STEAL_TEST_MKEY      0x4567
+#define STEAL_TEST_MAGIC     0x5a000000U
+
+struct steal_test_cmd {
+	struct virtq_cmd cmd;
+	uint32_t seq;
+	uint32_t status;
+	/* thread that submitted the command and its completion number */
+	int thread;
+	uint64_t done_no;
+	struct steal_test_cmd *next_free;
+};
+
+class VirtqStealTest;
+
+/* thread 0 is the queue owner */
+struct steal_test_thread {
+	VirtqStealTest *t;
+	int id;
+	pthread_t tid;
+	uint32_t last_seq;
+	uint64_t n_submitted;
+	uint64_t n_done;
+	struct steal_test_cmd *pending[STEAL_TEST_Q_SIZE];
+	int n_pending;
+};
+
+class VirtqStealTest : public VirtqTest {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	uint32_t *m_host;
+	struct virtq_impl_ops m_ops;
+	struct steal_test_cmd m_cmds[STEAL_TEST_Q_SIZE];
+	struct steal_test_cmd *m_free;
+	struct steal_test_thread m_threads[STEAL_TEST_THREADS];
+	uint64_t m_seen[STEAL_TEST_THREADS];
+	uint8_t m_submitted[STEAL_TEST_MAX_CMDS];
+	uint8_t m_done[STEAL_TEST_MAX_CMDS];
+	pthread_t m_owner;
+	uint32_t m_issued;
+	uint32_t m_n_done;
+	uint32_t m_n_written;
+	uint64_t m_bad;
+	uint64_t m_bad_order;
+	bool m_stop;
+
+	void setup_queue(int size);
+	int issue(int n);
+	void complete(int thread);
+	void run(int n_stealers, uint32_t n_cmds);
+};
+
+static VirtqStealTest *g_steal_test;
+
+static void steal_test_bdev_submit(struct virtq_cmd *cmd, int thread_id)
+{
+	struct steal_test_cmd *tc = (struct steal_test_cmd *)cmd;
+	struct steal_test_thread *thr = &g_steal_test->m_threads[thread_id];
+
+	if (!cmd->steal)
+		__atomic_add_fetch(&g_steal_test->m_bad, 1, __ATOMIC_RELAXED);
+	/* each thread takes the commands in the order they were pushed */
+	if (thr->n_submitted && tc->seq <= thr->last_seq)
+		__atomic_add_fetch(&g_steal_test->m_bad_order, 1, __ATOMIC_RELAXED);
+	thr->last_seq = tc->seq;
+	thr->n_submitted++;
+	__atomic_add_fetch(&g_steal_test->m_submitted[tc->seq], 1, __ATOMIC_RELAXED);
+
+	tc->thread = thread_id;
+	thr->pending[thr->n_pending++] = tc;
+}
+
+static void steal_test_dma_cb(struct snap_dma_completion *self, int status)
+{
+	struct steal_test_cmd *tc = container_of(self, struct steal_test_cmd,
+						 cmd.dma_comp);
+
+	if (status)
+		g_steal_test->m_bad++;
+	g_steal_test->m_n_written++;
+	tc->next_free = g_steal_test->m_free;
+	g_steal_test->m_free = tc;
+}
+
+static void steal_test_bdev_done(struct virtq_cmd *cmd)
+{
+	struct steal_test_cmd *tc = (struct steal_test_cmd *)cmd;
+	VirtqStealTest *t = g_steal_test;
+
+	/* the dma queue is used by the owner only */
+	if (!pthread_equal(pthread_self(), t->m_owner) || cmd->steal)
+		t->m_bad++;
+	/* completions of a thread come back in the order it made them */
+	if (tc->done_no != t->m_seen[tc->thread]++)
+		t->m_bad_order++;
+	t->m_done[tc->seq]++;
+	t->m_n_done++;
+	t->m_priv.cmd_cntrs.outstanding_in_bdev--;
+
+	tc->status = STEAL_TEST_MAGIC | tc->seq;
+	cmd->dma_comp.func = steal_test_dma_cb;
+	cmd->dma_comp.count = 1;
+	if (snap_dma_q_write(t->m_priv.dma_q, &tc->status, sizeof(tc->status), 0,
+			     STEAL_TEST_HOST_ADDR + tc->seq * sizeof(uint32_t),
+			     STEAL_TEST_MKEY, &cmd->dma_comp))
+		t->m_bad++;
+}
+
+void VirtqStealTest::SetUp()
+{
+	int i;
+
+	g_steal_test = this;
+	ASSERT_NO_FATAL_FAILURE(virtq_setup(STEAL_TEST_HOST_ADDR,
+					    STEAL_TEST_MAX_CMDS * sizeof(uint32_t),
+					    STEAL_TEST_MKEY, 2 * STEAL_TEST_Q_SIZE,
+					    false));
+	m_host = (uint32_t *)host_mem(STEAL_TEST_HOST_ADDR);
+
+	memset(&m_ops, 0, sizeof(m_ops));
+	m_ops.bdev_submit = steal_test_bdev_submit;
+	m_ops.bdev_done = steal_test_bdev_done;
+	m_priv.ops = &m_ops;
+	m_priv.pg_id = 0;
+
+	memset(m_threads, 0, sizeof(m_threads));
+	for (i = 0; i < STEAL_TEST_THREADS; i++) {
+		m_threads[i].t = this;
+		m_threads[i].id = i;
+	}
+	memset(m_seen, 0, sizeof(m_seen));
+	memset(m_submitted, 0, sizeof(m_submitted));
+	memset(m_done, 0, sizeof(m_done));
+	m_owner = pthread_self();
+	m_issued = m_n_done = m_n_written = 0;
+	m_bad = m_bad_order = 0;
+	m_stop = false;
+}
+
+void VirtqStealTest::TearDown()
+{
+	virtq_steal_destroy(&m_priv.steal);
+	virtq_teardown();
+	g_steal_test = NULL;
+}
+
+void VirtqStealTest::setup_queue(int size)
+{
+	int i;
+
+	ASSERT_EQ(0, virtq_steal_init(&m_priv.steal, size));
+	ASSERT_TRUE(virtq_steal_enabled(&m_priv));
+	memset(m_cmds, 0, sizeof(m_cmds));
+	m_free = NULL;
+	for (i = size - 1; i >= 0; i--) {
+		m_cmds[i].cmd.vq_priv = &m_priv;
+		m_cmds[i].cmd.idx = i;
+		m_cmds[i].next_free = m_free;
+		m_free = &m_cmds[i];
+	}
+}
+
+/* pushes up to n free commands to the ready ring, as the HANDLE_REQ stage */
+int VirtqStealTest::issue(int n)
+{
+	struct steal_test_cmd *tc;
+	int i;
+
+	for (i = 0; i < n && m_free && m_issued < STEAL_TEST_MAX_CMDS; i++) {
+		tc = m_free;
+		m_free = tc->next_free;
+		tc->seq = m_issued++;
+		m_priv.cmd_cntrs.outstanding_in_bdev++;
+		virtq_steal_push(&tc->cmd);
+	}
+	return i;
+}
+
+/* the simulated block device completes the commands of a thread */
+void VirtqStealTest::complete(int thread)
+{
+	struct steal_test_thread *thr = &m_threads[thread];
+	int i;
+
+	for (i = 0; i < thr->n_pending; i++) {
+		thr->pending[i]->done_no = thr->n_done++;
+		virtq_steal_done(&thr->pending[i]->cmd);
+	}
+	thr->n_pending = 0;
+}
+
+static void *steal_test_stealer(void *arg)
+{
+	struct steal_test_thread *thr = (struct steal_test_thread *)arg;
+	VirtqStealTest *t = thr->t;
+	int n;
+
+	while (!__atomic_load_n(&t->m_stop, __ATOMIC_RELAXED)) {
+		n = virtq_steal(&t->m_vq_ctx, thr->id, 4);
+		t->complete(thr->id);
+		/* the test can run with less cpus than threads */
+		if (!n)
+			sched_yield();
+	}
+	return NULL;
+}
+
+void VirtqStealTest::run(int n_stealers, uint32_t n_cmds)
+{
+	uint64_t stolen = 0;
+	uint32_t seq;
+	int i;
+
+	for (i = 1; i <= n_stealers; i++)
+		ASSERT_EQ(0, pthread_create(&m_threads[i].tid, NULL,
+					    steal_test_stealer, &m_threads[i]));
+
+	for (i = 0; m_n_written < n_cmds; i++) {
+		if (m_issued < n_cmds)
+			issue(snap_min(STEAL_TEST_BURST, n_cmds - m_issued));
+		virtq_progress(&m_vq_ctx, 0);
+		complete(0);
+		if (i % 4 == 0)
+			sched_yield();
+	}
+
+	__atomic_store_n(&m_stop, true, __ATOMIC_RELAXED);
+	for (i = 1; i <= n_stealers; i++) {
+		pthread_join(m_threads[i].tid, NULL);
+		stolen += m_threads[i].n_submitted;
+	}
+
+	EXPECT_EQ(0U, m_bad);
+	EXPECT_EQ(0U, m_bad_order);
+	EXPECT_EQ(n_cmds, m_issued);
+	EXPECT_EQ(n_cmds, m_n_done);
+	EXPECT_EQ(0U, m_priv.cmd_cntrs.outstanding_in_bdev);
+	EXPECT_EQ(stolen, m_priv.steal.stolen);
+	EXPECT_EQ(n_cmds, m_threads[0].n_submitted + stolen);
+	/* every command is submitted and completed exactly once */
+	for (seq = 0; seq < n_cmds; seq++) {
+		ASSERT_EQ(1, m_submitted[seq]) << "seq " << seq;
+		ASSERT_EQ(1, m_done[seq]) << "seq " << seq;
+		ASSERT_EQ(STEAL_TEST_MAGIC | seq, m_host[seq]) << "seq " << seq;
+	}
+	printf("%u commands, %lu stolen\n", n_cmds, stolen);
+}
+
+TEST_F(VirtqStealTest, disabled) {
+	EXPECT_FALSE(virtq_steal_enabled(&m_priv));
+	EXPECT_EQ(0, virtq_steal(&m_vq_ctx, 1, 4));
+}
+
+/* the stealer gets the oldest commands, the owner the next ones */
+TEST_F(VirtqStealTest, fifo) {
+	int i;
+
+	setup_queue(STEAL_TEST_Q_SIZE);
+	EXPECT_EQ(5, issue(5));
+
+	EXPECT_EQ(2, virtq_steal(&m_vq_ctx, 1, 2));
+	ASSERT_EQ(2, m_threads[1].n_pending);
+	EXPECT_EQ(0U, m_threads[1].pending[0]->seq);
+	EXPECT_EQ(1U, m_threads[1].pending[1]->seq);
+	EXPECT_EQ(2U, m_priv.steal.stolen);
+
+	/* done commands wait for the owner */
+	complete(1);
+	EXPECT_EQ(0U, m_n_done);
+
+	EXPECT_GE(virtq_progress(&m_vq_ctx, 0), 5);
+	EXPECT_EQ(2U, m_n_done);
+	ASSERT_EQ(3, m_threads[0].n_pending);
+	for (i = 0; i < 3; i++)
+		EXPECT_EQ(2U + i, m_threads[0].pending[i]->seq);
+	EXPECT_EQ(0, virtq_steal(&m_vq_ctx, 1, 4));
+
+	complete(0);
+	EXPECT_GE(virtq_progress(&m_vq_ctx, 0), 3);
+	EXPECT_EQ(5U, m_n_done);
+	EXPECT_EQ(2U, m_priv.steal.stolen);
+	EXPECT_EQ(0U, m_bad);
+	EXPECT_EQ(0U, m_bad_order);
+}
+
+/* a burst is not submitted by the owner at once, idle threads can help */
+TEST_F(VirtqStealTest, owner_batch) {
+	setup_queue(STEAL_TEST_Q_SIZE);
+	EXPECT_EQ(40, issue(40));
+
+	virtq_progress(&m_vq_ctx, 0);
+	EXPECT_EQ(m_priv.steal.owner_batch, m_threads[0].n_pending);
+	EXPECT_EQ(4, virtq_steal(&m_vq_ctx, 2, 4));
+	EXPECT_EQ((uint32_t)m_priv.steal.owner_batch, m_threads[2].pending[0]->seq);
+
+	while (m_n_done < 40) {
+		virtq_progress(&m_vq_ctx, 0);
+		complete(0);
+		complete(2);
+	}
+	EXPECT_EQ(4U, m_priv.steal.stolen);
+	EXPECT_EQ(0U, m_bad);
+}
+
+/* rings of a queue whose size is not a power of 2 wrap many times */
+TEST_F(VirtqStealTest, wrap) {
+	setup_queue(6);
+	EXPECT_EQ(7U, m_priv.steal.ready.mask);
+	run(0, 1000);
+}
+
+TEST_F(VirtqStealTest, stress) {
+	setup_queue(STEAL_TEST_Q_SIZE);
+	run(STEAL_TEST_THREADS - 1, STEAL_TEST_MAX_CMDS);
+}
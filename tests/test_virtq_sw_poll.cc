@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/virtio_ring.h>
+
+#include <infiniband/verbs.h>
+
+extern "C" {
+#include "snap_dma.h"
+#include "snap_dma_stat.h"
+#include "snap_sw_virtio_blk.h"
+};
+
+#include "gtest/gtest.h"
+
+/*
+ * Avail ring polling of the software virtio-blk queue provider. The host
+ * avail ring is simulated by the SNAP_DMA_Q_MODE_SW dma queue.
+ */
+
+#define POLL_TEST_RING_ADDR 0x700000000ULL
+#define POLL_TEST_MKEY      0x89ab
+#define POLL_TEST_Q_SIZE    256
+#define POLL_TEST_MAX_REQS  64
+
+class VirtqSwPollTest : public ::testing::Test {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	struct snap_dma_sw_mem *m_hmem;
+	struct vring_avail *m_avail;
+	struct snap_dma_q *m_dma_q;
+	struct snap_virtio_blk_sw_queue m_swq;
+	struct ibv_mr m_mr;
+	uint16_t m_size;
+	uint16_t m_avail_idx;
+	uint16_t m_next_idx;
+
+	void setup_queue(uint16_t size, uint16_t avail_idx);
+	void post(int n);
+	int poll(int num_reqs, int n_expected);
+	uint64_t n_reads(void);
+};
+
+static void poll_test_rx_cb(struct snap_dma_q *q, const void *data,
+		uint32_t data_len, uint32_t imm_data)
+{
+}
+
+void VirtqSwPollTest::SetUp()
+{
+	struct snap_dma_q_create_attr attr;
+
+	m_hmem = snap_dma_sw_mem_create(NULL,
+			offsetof(struct vring_avail, ring[POLL_TEST_Q_SIZE]),
+			POLL_TEST_RING_ADDR, POLL_TEST_MKEY);
+	ASSERT_TRUE(m_hmem);
+	m_avail = (struct vring_avail *)snap_dma_sw_mem_addr(m_hmem,
+							     POLL_TEST_RING_ADDR);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.tx_qsize = attr.rx_qsize = 64;
+	attr.tx_elem_size = 16;
+	attr.rx_elem_size = 64;
+	attr.rx_cb = poll_test_rx_cb;
+	attr.mode = SNAP_DMA_Q_MODE_SW;
+	attr.stats_enable = true;
+	m_dma_q = snap_dma_q_create(NULL, &attr);
+	ASSERT_TRUE(m_dma_q);
+
+	memset(&m_swq, 0, sizeof(m_swq));
+	memset(&m_mr, 0, sizeof(m_mr));
+	m_swq.avail = (struct vring_avail *)
+		calloc(1, offsetof(struct vring_avail, ring[POLL_TEST_Q_SIZE]));
+	ASSERT_TRUE(m_swq.avail);
+	m_swq.avail_mr = &m_mr;
+	m_swq.vbq.virtq.q_ops = get_sw_queue_ops();
+}
+
+void VirtqSwPollTest::TearDown()
+{
+	free(m_swq.avail);
+	if (m_dma_q)
+		snap_dma_q_destroy(m_dma_q);
+	if (m_hmem)
+		snap_dma_sw_mem_destroy(m_hmem);
+}
+
+void VirtqSwPollTest::setup_queue(uint16_t size, uint16_t avail_idx)
+{
+	struct snap_virtio_common_queue_attr attr;
+	int i;
+
+	/* the read of the previous setup must not land in the new one */
+	for (i = 0; i < 100 && m_swq.read_posted; i++)
+		snap_dma_q_progress(m_dma_q);
+	ASSERT_FALSE(m_swq.read_posted);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.vattr.size = size;
+	attr.vattr.driver = POLL_TEST_RING_ADDR;
+	attr.vattr.dma_mkey = POLL_TEST_MKEY;
+	attr.hw_available_index = avail_idx;
+	attr.dma_q = m_dma_q;
+	snap_virtio_blk_sw_queue_init(&m_swq, &attr);
+	EXPECT_EQ(SNAP_SW_Q_PROVIDER, attr.q_provider);
+
+	m_size = size;
+	m_avail_idx = m_next_idx = avail_idx;
+	m_avail->idx = avail_idx;
+	memset(m_avail->ring, 0xff, size * sizeof(uint16_t));
+	snap_dma_q_stats_reset(m_dma_q);
+}
+
+/* the head of avail index i is i * 7 % size, the index is written last */
+void VirtqSwPollTest::post(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++, m_avail_idx++)
+		m_avail->ring[m_avail_idx % m_size] = (m_avail_idx * 7) % m_size;
+	m_avail->idx = m_avail_idx;
+}
+
+/* poll until n_expected heads are returned, check them and that no more come */
+int VirtqSwPollTest::poll(int num_reqs, int n_expected)
+{
+	struct virtq_split_tunnel_req reqs[POLL_TEST_Q_SIZE];
+	struct virtq_q_ops *ops = m_swq.vbq.virtq.q_ops;
+	int i, j, n, total = 0;
+
+	for (i = 0; i < 100 && (total < n_expected || (!n_expected && i < 3)); i++) {
+		snap_dma_q_progress(m_dma_q);
+		n = ops->poll(&m_swq.vbq.virtq, reqs, num_reqs);
+		if (n < 0)
+			return n;
+		EXPECT_LE(n, num_reqs);
+		for (j = 0; j < n; j++, m_next_idx++) {
+			EXPECT_EQ((m_next_idx * 7) % m_size, reqs[j].hdr.descr_head_idx)
+				<< "avail idx " << m_next_idx;
+			EXPECT_EQ(0, reqs[j].hdr.num_desc);
+		}
+		total += n;
+	}
+	EXPECT_EQ(n_expected, total);
+	return total;
+}
+
+uint64_t VirtqSwPollTest::n_reads(void)
+{
+	return snap_dma_q_stats_get(m_dma_q)->ops[SNAP_DMA_STAT_OP_READ].posted;
+}
+
+TEST_F(VirtqSwPollTest, basic) {
+	setup_queue(POLL_TEST_Q_SIZE, 0);
+
+	EXPECT_EQ(0, poll(POLL_TEST_MAX_REQS, 0));
+	post(5);
+	EXPECT_EQ(5, poll(POLL_TEST_MAX_REQS, 5));
+	EXPECT_EQ(5, m_swq.prev_avail);
+
+	/* nothing new */
+	EXPECT_EQ(0, poll(POLL_TEST_MAX_REQS, 0));
+	EXPECT_EQ(5U, m_swq.heads);
+}
+
+/* caller asks for less heads than are available */
+TEST_F(VirtqSwPollTest, num_reqs) {
+	setup_queue(POLL_TEST_Q_SIZE, 0);
+
+	post(100);
+	EXPECT_EQ(100, poll(3, 100));
+	/* window is bounded as well */
+	post(200);
+	EXPECT_EQ(200, poll(POLL_TEST_Q_SIZE, 200));
+}
+
+/* the ring slot and the 16 bit avail index wrap around */
+TEST_F(VirtqSwPollTest, ring_wrap) {
+	uint16_t size;
+	int i, n;
+
+	srand(5);
+	for (size = 4; size <= POLL_TEST_Q_SIZE; size *= 4) {
+		setup_queue(size, 65536 - 2 * size - 3);
+		for (i = 0; i < 6 * size; i += n) {
+			n = 1 + rand() % size;
+			post(n);
+			ASSERT_EQ(n, poll(POLL_TEST_MAX_REQS, n)) << "size " << size;
+		}
+		ASSERT_EQ(m_avail_idx, m_swq.prev_avail);
+	}
+}
+
+/* a jump of the avail index by more than the queue size is rejected */
+TEST_F(VirtqSwPollTest, bad_index) {
+	setup_queue(16, 0);
+	post(4);
+	poll(POLL_TEST_MAX_REQS, 4);
+
+	m_avail->idx = 4 + 17;
+	EXPECT_EQ(-EINVAL, poll(POLL_TEST_MAX_REQS, 1));
+	EXPECT_EQ(4, m_swq.prev_avail);
+}
+
+/* the avail index and a batch of heads come with one read */
+TEST_F(VirtqSwPollTest, heads_per_dma) {
+	const int n_iters = 1000, batch = 32;
+	double heads_per_read;
+	int i;
+
+	setup_queue(POLL_TEST_Q_SIZE, 0);
+	poll(POLL_TEST_MAX_REQS, 0);
+	for (i = 0; i < n_iters; i++) {
+		post(batch);
+		ASSERT_EQ(batch, poll(POLL_TEST_MAX_REQS, batch));
+	}
+
+	heads_per_read = (double)(n_iters * batch) / n_reads();
+	EXPECT_EQ(m_swq.reads, n_reads());
+	/*
+	 * The previous provider read the index and then every head separately.
+	 * Here the read in flight when a batch is posted misses it, and the
+	 * next one brings the whole batch.
+	 */
+	EXPECT_GE(heads_per_read, batch / 4.0);
+	printf("%d heads, %lu avail ring reads, %.1f heads per dma\n",
+	       n_iters * batch, n_reads(), heads_per_read);
+}
@@ -0,0 +1,316 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/virtio_ring.h>
+
+#include <infiniband/verbs.h>
+
+extern "C" {
+#include "snap_dma_stat.h"
+};
+
+#include "test_virtq.h"
+
+/*
+ * Used ring updates accumulated by virtq_sw_send_comp() and written by
+ * virtq_progress(). The host used ring is simulated by the
+ * SNAP_DMA_Q_MODE_SW dma queue.
+ */
+
+#define USED_TEST_RING_ADDR 0x500000000ULL
+#define USED_TEST_MKEY      0x6789
+#define USED_TEST_Q_SIZE    256
+
+class VirtqUsedBatchTest : public VirtqTest {
+	virtual void SetUp();
+	virtual void TearDown();
+
+public:
+	struct vring_used *m_used;
+	struct virtq_cmd m_cmd;
+	uint16_t m_next_id;
+
+	void setup_queue(uint16_t size, uint16_t used_idx, uint16_t max_batch,
+			 uint16_t max_delay);
+	void complete(int n);
+	void progress(void);
+	void check_ring(uint16_t from, uint16_t to);
+	uint64_t n_ops(void);
+};
+
+void VirtqUsedBatchTest::SetUp()
+{
+	size_t ring_len = sizeof(struct vring_used) +
+			  USED_TEST_Q_SIZE * sizeof(struct vring_used_elem);
+
+	ASSERT_NO_FATAL_FAILURE(virtq_setup(USED_TEST_RING_ADDR, ring_len,
+					    USED_TEST_MKEY, 4 * USED_TEST_Q_SIZE,
+					    true));
+	m_used = (struct vring_used *)host_mem(USED_TEST_RING_ADDR);
+	m_priv.used_batch.ring = (struct vring_used_elem *)
+		calloc(USED_TEST_Q_SIZE, sizeof(struct vring_used_elem));
+	ASSERT_TRUE(m_priv.used_batch.ring);
+
+	memset(&m_cmd, 0, sizeof(m_cmd));
+	m_cmd.vq_priv = &m_priv;
+}
+
+void VirtqUsedBatchTest::TearDown()
+{
+	free(m_priv.used_batch.ring);
+	virtq_teardown();
+}
+
+void VirtqUsedBatchTest::setup_queue(uint16_t size, uint16_t used_idx,
+		uint16_t max_batch, uint16_t max_delay)
+{
+	m_qattr.vattr.size = size;
+	m_qattr.vattr.device = USED_TEST_RING_ADDR;
+	m_qattr.hw_used_index = used_idx;
+	m_priv.used_batch.used_idx = used_idx;
+	m_priv.used_batch.max_batch = max_batch;
+	m_priv.used_batch.max_delay = max_delay;
+	m_used->idx = used_idx;
+	memset(m_used->ring, 0xff, size * sizeof(struct vring_used_elem));
+	m_next_id = used_idx;
+	snap_dma_q_stats_reset(m_dma_q);
+}
+
+/* the used element of completion i is { i % size, 512 * i } */
+void VirtqUsedBatchTest::complete(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++, m_next_id++) {
+		m_cmd.descr_head_idx = m_next_id % m_qattr.vattr.size;
+		m_cmd.total_in_len = 512 * m_next_id;
+		ASSERT_EQ(0, virtq_sw_send_comp(&m_cmd, m_dma_q));
+	}
+}
+
+void VirtqUsedBatchTest::progress(void)
+{
+	virtq_progress(&m_vq_ctx, 0);
+}
+
+void VirtqUsedBatchTest::check_ring(uint16_t from, uint16_t to)
+{
+	uint16_t i, slot;
+
+	for (i = from; i != to; i++) {
+		slot = i % m_qattr.vattr.size;
+		ASSERT_EQ(i % m_qattr.vattr.size, m_used->ring[slot].id) << "idx " << i;
+		ASSERT_EQ(512U * i, m_used->ring[slot].len) << "idx " << i;
+	}
+}
+
+uint64_t VirtqUsedBatchTest::n_ops(void)
+{
+	const struct snap_dma_q_stats *st = snap_dma_q_stats_get(m_dma_q);
+
+	return st->ops[SNAP_DMA_STAT_OP_WRITE].posted +
+	       st->ops[SNAP_DMA_STAT_OP_WRITE_SHORT].posted;
+}
+
+/* used index is published once per progress call */
+TEST_F(VirtqUsedBatchTest, flush_on_progress) {
+	setup_queue(USED_TEST_Q_SIZE, 0, 32, 0);
+
+	complete(5);
+	EXPECT_EQ(0, m_used->idx);
+	EXPECT_EQ(5, m_priv.used_batch.n);
+
+	progress();
+	EXPECT_EQ(5, m_used->idx);
+	EXPECT_EQ(5, m_qattr.hw_used_index);
+	EXPECT_EQ(0, m_priv.used_batch.n);
+	check_ring(0, 5);
+	/* one ring write and one used index write */
+	EXPECT_EQ(2U, n_ops());
+	EXPECT_EQ(1U, m_priv.used_batch.flushes);
+	EXPECT_EQ(5U, m_priv.used_batch.elems);
+
+	/* nothing to flush */
+	progress();
+	EXPECT_EQ(2U, n_ops());
+}
+
+TEST_F(VirtqUsedBatchTest, max_batch) {
+	setup_queue(USED_TEST_Q_SIZE, 0, 4, 0);
+
+	complete(10);
+	EXPECT_EQ(8, m_used->idx);
+	check_ring(0, 8);
+	EXPECT_EQ(2, m_priv.used_batch.n);
+
+	progress();
+	EXPECT_EQ(10, m_used->idx);
+	check_ring(0, 10);
+}
+
+TEST_F(VirtqUsedBatchTest, max_delay) {
+	setup_queue(USED_TEST_Q_SIZE, 0, 32, 3);
+
+	complete(1);
+	progress();
+	progress();
+	complete(1);
+	progress();
+	EXPECT_EQ(0, m_used->idx);
+
+	progress();
+	EXPECT_EQ(2, m_used->idx);
+	check_ring(0, 2);
+	EXPECT_EQ(2U, n_ops());
+}
+
+/* runs crossing the end of the ring are written in two parts */
+TEST_F(VirtqUsedBatchTest, ring_wrap) {
+	uint16_t size, start, batch, idx;
+	int i, n;
+
+	for (size = 4; size <= USED_TEST_Q_SIZE; size *= 4) {
+		for (batch = 1; batch <= size; batch = batch * 2 + 1) {
+			start = 65536 - 2 * size - 3;
+			setup_queue(size, start, batch, 0);
+
+			idx = start;
+			for (i = 0; i < 6 * size; i += n) {
+				n = 1 + rand() % size;
+				complete(n);
+				progress();
+				ASSERT_EQ((uint16_t)(idx + n), m_used->idx);
+				ASSERT_EQ(m_used->idx, m_qattr.hw_used_index);
+				check_ring(m_used->idx - snap_min(n, size), m_used->idx);
+				idx += n;
+			}
+			ASSERT_EQ(0, m_priv.used_batch.n);
+		}
+	}
+}
+
+/* pending elements are written before the queue is suspended */
+TEST_F(VirtqUsedBatchTest, flush_on_suspend) {
+	setup_queue(USED_TEST_Q_SIZE, 0, 32, 10);
+
+	complete(3);
+	EXPECT_EQ(0, virtq_used_batch_flush(&m_priv));
+	EXPECT_EQ(3, m_used->idx);
+	check_ring(0, 3);
+}
+
+static double used_test_ops_per_comp(VirtqUsedBatchTest *t, uint16_t max_batch)
+{
+	const int n_iters = 10000, n_comps = 32;
+	int i;
+
+	t->setup_queue(USED_TEST_Q_SIZE, 0, max_batch, 0);
+	for (i = 0; i < n_iters; i++) {
+		t->complete(n_comps);
+		t->progress();
+	}
+	return (double)t->n_ops() / (n_iters * n_comps);
+}
+
+TEST_F(VirtqUsedBatchTest, ops_per_comp) {
+	double batched, unbatched;
+
+	unbatched = used_test_ops_per_comp(this, 1);
+	EXPECT_DOUBLE_EQ(2.0, unbatched);
+
+	batched = used_test_ops_per_comp(this, 32);
+	/* a ring write, sometimes split at the wrap, and a used index write */
+	EXPECT_LE(batched, 3.0 / 32);
+
+	printf("used ring dma ops per completion, 32 completions per progress: "
+	       "batched %.3f, unbatched %.3f\n", batched, unbatched);
+}
+
+/* a full shadow ring is flushed by the next completion */
+TEST_F(VirtqUsedBatchTest, ring_full) {
+	setup_queue(8, 0, 64, 1000);
+
+	complete(8);
+	EXPECT_EQ(0, m_used->idx);
+	EXPECT_EQ(8, m_priv.used_batch.n);
+
+	complete(1);
+	EXPECT_EQ(8, m_used->idx);
+	EXPECT_EQ(1, m_priv.used_batch.n);
+
+	EXPECT_EQ(0, virtq_used_batch_flush(&m_priv));
+	EXPECT_EQ(9, m_used->idx);
+	/* slot 0 was reused by the ninth completion */
+	check_ring(1, 9);
+}
+
+static struct virtq_cmd *used_test_get_avail_cmd(struct virtq_cmd *cmd_arr,
+						 uint16_t idx)
+{
+	return &cmd_arr[idx];
+}
+
+static bool used_test_release(struct virtq_cmd *cmd,
+			      enum virtq_cmd_sm_op_status status)
+{
+	cmd->state = VIRTQ_CMD_STATE_IDLE;
+	return false;
+}
+
+/* a completion that can not be sent waits for the dma queue resources */
+TEST_F(VirtqUsedBatchTest, blocked_comp) {
+	struct virtq_sm_state sm_array[VIRTQ_CMD_NUM_OF_STATES];
+	struct virtq_state_machine sm;
+	struct virtq_impl_ops ops;
+	struct snap_virtio_ctrl_queue vbq;
+	struct virtq_cmd cmds[8];
+	int i, tx_available;
+
+	for (i = 0; i < VIRTQ_CMD_NUM_OF_STATES; i++)
+		sm_array[i].sm_handler = virtq_sm_idle;
+	sm_array[VIRTQ_CMD_STATE_SEND_COMP].sm_handler = virtq_sm_send_completion;
+	sm_array[VIRTQ_CMD_STATE_RELEASE].sm_handler = used_test_release;
+	sm.sm_array = sm_array;
+	sm.sme = VIRTQ_CMD_NUM_OF_STATES;
+	memset(&ops, 0, sizeof(ops));
+	ops.send_comp = virtq_sw_send_comp;
+	ops.get_avail_cmd = used_test_get_avail_cmd;
+	memset(&vbq, 0, sizeof(vbq));
+	memset(cmds, 0, sizeof(cmds));
+	for (i = 0; i < 8; i++)
+		cmds[i].vq_priv = &m_priv;
+	m_priv.custom_sm = &sm;
+	m_priv.ops = &ops;
+	m_priv.vbq = &vbq;
+	m_priv.cmd_arr = cmds;
+
+	/* the shadow ring is full and the dma queue has no credits */
+	setup_queue(8, 0, 64, 1000);
+	complete(8);
+	tx_available = m_dma_q->tx_available;
+	m_dma_q->tx_available = 0;
+
+	cmds[3].state = VIRTQ_CMD_STATE_SEND_COMP;
+	cmds[3].descr_head_idx = 0;
+	cmds[3].total_in_len = 512 * 8;
+	virtq_cmd_progress(&cmds[3], VIRTQ_CMD_SM_OP_OK);
+	EXPECT_EQ(VIRTQ_CMD_STATE_SEND_COMP, cmds[3].state);
+	EXPECT_EQ(1, m_priv.blocked_comps);
+	EXPECT_EQ(0, m_priv.ctrl_used_index);
+
+	progress();
+	EXPECT_EQ(VIRTQ_CMD_STATE_SEND_COMP, cmds[3].state);
+	EXPECT_EQ(0, m_used->idx);
+
+	m_dma_q->tx_available = tx_available;
+	progress();
+	EXPECT_EQ(VIRTQ_CMD_STATE_IDLE, cmds[3].state);
+	EXPECT_EQ(0, m_priv.blocked_comps);
+	EXPECT_EQ(1, m_priv.ctrl_used_index);
+	EXPECT_EQ(8, m_used->idx);
+
+	EXPECT_EQ(0, virtq_used_batch_flush(&m_priv));
+	EXPECT_EQ(9, m_used->idx);
+	/* slot 0 was reused by the ninth completion */
+	check_ring(1, 9);
+}